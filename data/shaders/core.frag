@@ -27,7 +27,34 @@ layout (std140) uniform lyricColors {
 
 const vec4 epsilon = vec4(1.96e-3);
 
-#ifdef ENABLE_TEXTURING
+#if defined(ENABLE_TEXTURING) && defined(ENABLE_YUV)
+uniform sampler2D tex;  // Y plane
+uniform sampler2D texU;
+uniform sampler2D texV;
+uniform mat3 yuvMatrix;  // Limited range YCbCr to R'G'B' (BT.601 or BT.709)
+vec4 yuvTexture() {
+	vec3 yuv = vec3(texture(tex, fragIn.texCoord).r, texture(texU, fragIn.texCoord).r, texture(texV, fragIn.texCoord).r);
+	vec3 rgb = clamp(yuvMatrix * (yuv - vec3(16.0, 128.0, 128.0) / 255.0), 0.0, 1.0);
+	// Decode sRGB like the hardware does for our RGB textures
+	rgb = mix(rgb / 12.92, pow((rgb + 0.055) / 1.055, vec3(2.4)), step(0.04045, rgb));
+	return vec4(rgb, 1.0);
+}
+#define TEXFUNC yuvTexture()
+#elif defined(ENABLE_TEXTURING) && defined(ENABLE_SPECTROGRAM)
+uniform sampler2D tex;  // One spectrum (levels 0...1 of linear frequency bins) per row, rows used as a ring
+uniform float scroll;  // Texture coordinate of the oldest row
+uniform vec2 freqRange;  // Lowest and highest frequency shown, relative to the top of the texture
+vec4 spectrogram() {
+	// Time from left (oldest) to right (newest), logarithmic frequency from bottom to top
+	float rows = float(textureSize(tex, 0).y);
+	float row = fract(scroll + (0.5 + fragIn.texCoord.x * (rows - 1.0)) / rows);
+	float freq = freqRange.x * pow(freqRange.y / freqRange.x, 1.0 - fragIn.texCoord.y);
+	float level = texture(tex, vec2(freq, row)).r;
+	// Heat colors: transparent black, red, yellow, white
+	return vec4(clamp(vec3(3.0 * level, 3.0 * level - 1.0, 3.0 * level - 2.0), 0.0, 1.0), min(1.0, 4.0 * level));
+}
+#define TEXFUNC spectrogram()
+#elif defined(ENABLE_TEXTURING)
 uniform sampler2D tex;
 #define TEXFUNC texture(tex, fragIn.texCoord)
 #else
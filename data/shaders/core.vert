@@ -21,10 +21,28 @@ out vData {
 	vec4 color;
 } vertex;
 
+#ifdef ENABLE_MULTIVIEW
+layout(num_views = 2) in;
+
+layout (std140) uniform stereoParams {
+	float sepFactor;
+	float z0;
+	float padding[2];
+};
+
+// Shift the position for the eye being drawn, like stereo3d.geom does
+vec4 eyePosition(vec4 pos) {
+	pos.x += (gl_ViewID_OVR == 0u ? -1.0 : 1.0) * sepFactor * (pos.z - z0);
+	return pos;
+}
+#else
+vec4 eyePosition(vec4 pos) { return pos; }
+#endif
+
 void main() {
 	const vec3 lightPos = vec3(-10.0, 2.0, 15.0);
 	vec4 posEye = mvMatrix * vec4(vertPos, 1.0); // Vertex position in eye space
-	gl_Position = projMatrix * posEye; // Vertex position in normalized device coordinates
+	gl_Position = eyePosition(projMatrix * posEye); // Vertex position in normalized device coordinates
 	vertex.lightDir = lightPos - posEye.xyz / posEye.w; // Light position relative to vertex
 	vertex.texCoord = vertTexCoord;
 	vertex.normal = normalize(mat3(normalMatrix) * vertNormal);
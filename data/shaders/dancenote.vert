@@ -1,9 +1,14 @@
 #version 330 core
 
+//DEFINES
+
 layout(location = 0) in vec3 vertPos;
 layout(location = 1) in vec2 vertTexCoord;
 layout(location = 2) in vec3 vertNormal;
 layout(location = 3) in vec4 vertColor;
+// Per instance (glutil::InstanceInfo)
+layout(location = 4) in vec2 instPosition;
+layout(location = 5) in vec2 instParams;  // Hit animation, note type
 
 layout (std140) uniform shaderMatrices {
 	mat4 projMatrix;
@@ -13,12 +18,9 @@ layout (std140) uniform shaderMatrices {
 };
 
 layout (std140) uniform danceNote {
-	int noteType;
-	float hitAnim;
 	float clock;
 	float scale;
-	vec2 position;
-	float padding[2];
+	vec2 padding;
 };
 
 out vData {
@@ -28,6 +30,24 @@ out vData {
 	vec4 color;
 } vertex;
 
+#ifdef ENABLE_MULTIVIEW
+layout(num_views = 2) in;
+
+layout (std140) uniform stereoParams {
+	float sepFactor;
+	float z0;
+	float padding[2];
+};
+
+// Shift the position for the eye being drawn, like stereo3d.geom does
+vec4 eyePosition(vec4 pos) {
+	pos.x += (gl_ViewID_OVR == 0u ? -1.0 : 1.0) * sepFactor * (pos.z - z0);
+	return pos;
+}
+#else
+vec4 eyePosition(vec4 pos) { return pos; }
+#endif
+
  mat4 scaleMat(in float sc) {
 	return mat4(sc, 0, 0, 0,
 				0, sc, 0, 0,
@@ -45,6 +65,8 @@ out vData {
 }
 
 void main() {
+	float hitAnim = instParams.x;
+	int noteType = int(instParams.y);
 	vertex.texCoord = vertTexCoord;
 	vertex.normal = mat3(normalMatrix) * vertNormal;
 	vertex.color = vertColor;
@@ -80,6 +102,6 @@ void main() {
 	);
 	}
 
-	gl_Position = projMatrix * mvMatrix * (vec4(position, 0, 0) + trans * vec4(vertPos, 1.0));
+	gl_Position = eyePosition(projMatrix * mvMatrix * (vec4(instPosition, 0, 0) + trans * vec4(vertPos, 1.0)));
 }
 
@@ -0,0 +1,21 @@
+#version 330 core
+
+// Composites the eyes drawn into the layers of MultiviewFBO
+
+in vData {
+	vec3 lightDir;
+	vec2 texCoord;
+	vec3 normal;
+	vec4 color;
+} fragIn;
+
+out vec4 fragColor;
+
+uniform sampler2DArray tex;
+uniform mat3 eyeMatrix[2];  // Color conversion of each eye (anaglyph filters)
+
+void main() {
+	vec3 left = texture(tex, vec3(fragIn.texCoord, 0.0)).rgb;
+	vec3 right = texture(tex, vec3(fragIn.texCoord, 1.0)).rgb;
+	fragColor = vec4(left * eyeMatrix[0] + right * eyeMatrix[1], 1.0);
+}
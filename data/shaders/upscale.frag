@@ -0,0 +1,34 @@
+#version 330 core
+
+// Scales the scene drawn at a reduced resolution (see Window::renderScaled) up to the window, sharpening it
+// a little to make up for the blur of the bilinear filtering
+
+in vData {
+	vec3 lightDir;
+	vec2 texCoord;
+	vec3 normal;
+	vec4 color;
+} fragIn;
+
+out vec4 fragColor;
+
+uniform sampler2D tex;
+uniform vec2 texelSize;  // Size of a texel in texture coordinates
+uniform vec2 maxCoord;  // Texture coordinates of the far corner of the part drawn to
+uniform float sharpness;  // 0 = plain bilinear
+
+vec3 fetch(vec2 offset) {
+	// Stay within the drawn part, the rest of the texture is left from larger frames
+	return texture(tex, clamp(fragIn.texCoord + offset * texelSize, 0.5 * texelSize, maxCoord - 0.5 * texelSize)).rgb;
+}
+
+void main() {
+	vec3 c = fetch(vec2(0.0, 0.0));
+	vec3 n = fetch(vec2(0.0, 1.0));
+	vec3 s = fetch(vec2(0.0, -1.0));
+	vec3 e = fetch(vec2(1.0, 0.0));
+	vec3 w = fetch(vec2(-1.0, 0.0));
+	// Unsharp mask, limited to the range of the neighbourhood so that edges get no halos
+	vec3 sharp = c + sharpness * (c - 0.25 * (n + s + e + w));
+	fragColor = vec4(clamp(sharp, min(c, min(min(n, s), min(e, w))), max(c, max(max(n, s), max(e, w)))), 1.0);
+}
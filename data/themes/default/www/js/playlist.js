@@ -5,34 +5,67 @@
 "use strict";
 
 /*
-    On refresh playlist button click make an API call to get the current playlist.
-    Once the data is arrived parse it and clear the list and sortable list.
-    Then loop through the returned data to append rows to the list.
+    Clear the list and sortable list and append a row for every song of the playlist.
     Each row is clickable. If clicked it'll show the general information of this song.
     This will be shown through a modal. One can also change the position and remove the song from playlist again.
 */
+function showPlaylist(songs, timeout) {
+    var totalTime = 0;
+
+    clearList("playlist-songs");
+    clearList("playlist-songs-sortable");
+
+    $.each(songs, function (iterator, songObject) {
+        totalTime += songObject.Duration + timeout;
+        $("#playlist-songs").append("<a id=\"playlist-songs-" + iterator + "\" href=\"#\" class=\"list-group-item\" data-toggle=\"modal\" data-target=\"#dynamic-modal\">" + songObject.Artist + " - " + songObject.Title + " - " + secondsToDate(totalTime) + "<span class=\"glyphicon glyphicon-info-sign\"></span></a>");
+        $("#playlist-songs-sortable").append("<a id=\"playlist-songs-sortable-" + iterator + "\" href=\"#\" class=\"list-group-item\" data-toggle=\"modal\" data-target=\"#dynamic-modal\">" + songObject.Artist + " - " + songObject.Title + " - " + secondsToDate(totalTime) + "<span class=\"glyphicon glyphicon-info-sign\"></span></a>");
+        songObject.Position = iterator;
+        $("#playlist-songs-" + iterator).data("modal-songObject", JSON.stringify(songObject));
+        $("#playlist-songs-sortable-" + iterator).data("modal-songObject", JSON.stringify(songObject));
+    });
+}
+
+/*
+    On refresh playlist button click make an API call to get the current playlist and show it.
+*/
 $("#refresh-playlist").click(function () {
     $.get("api/getCurrentPlaylist.json", function (data) {
         var database = data;//JSON.parse(data);
         $.get("api/getplaylistTimeout", function (playlistTimeOut) {
-            var timeout = parseInt(playlistTimeOut);
-            var totalTime = 0;
-
-            clearList("playlist-songs");
-            clearList("playlist-songs-sortable");
-
-            $.each(database, function (iterator, songObject) {
-                totalTime += songObject.Duration + timeout;
-                $("#playlist-songs").append("<a id=\"playlist-songs-" + iterator + "\" href=\"#\" class=\"list-group-item\" data-toggle=\"modal\" data-target=\"#dynamic-modal\">" + songObject.Artist + " - " + songObject.Title + " - " + secondsToDate(totalTime) + "<span class=\"glyphicon glyphicon-info-sign\"></span></a>");
-                $("#playlist-songs-sortable").append("<a id=\"playlist-songs-sortable-" + iterator + "\" href=\"#\" class=\"list-group-item\" data-toggle=\"modal\" data-target=\"#dynamic-modal\">" + songObject.Artist + " - " + songObject.Title + " - " + secondsToDate(totalTime) + "<span class=\"glyphicon glyphicon-info-sign\"></span></a>");
-                songObject.Position = iterator;
-                $("#playlist-songs-" + iterator).data("modal-songObject", JSON.stringify(songObject));
-                $("#playlist-songs-sortable-" + iterator).data("modal-songObject", JSON.stringify(songObject));
-            });
+            showPlaylist(database, parseInt(playlistTimeOut));
         });
     });
 });
 
+/*
+    Where the browser supports it, the server pushes playlist changes as server-sent events, so there is no need to poll.
+    A reset event carries the whole playlist (also sent when connecting or reconnecting), the others a single change.
+*/
+if (window.EventSource) {
+    var livePlaylist = { songs: [], timeout: 0 };
+    var playlistEvents = new EventSource("api/playlistEvents");
+    var onPlaylistEvent = function (name, apply) {
+        playlistEvents.addEventListener(name, function (event) {
+            apply(JSON.parse(event.data));
+            showPlaylist(livePlaylist.songs, livePlaylist.timeout);
+        });
+    };
+    onPlaylistEvent("reset", function (data) {
+        livePlaylist.songs = data.songs;
+        livePlaylist.timeout = data.timeout;
+    });
+    onPlaylistEvent("add", function (data) {
+        livePlaylist.songs.splice(data.position, 0, data.song);
+    });
+    onPlaylistEvent("remove", function (data) {
+        livePlaylist.songs.splice(data.position, 1);
+    });
+    onPlaylistEvent("move", function (data) {
+        var song = livePlaylist.songs.splice(data.from, 1)[0];
+        livePlaylist.songs.splice(data.to, 0, song);
+    });
+}
+
 /*
     Whenever an item in the playlist is clicked on a modal will pop up.
     This modal will show general information about the song for example:
@@ -88,7 +121,7 @@ $("a[href='#playlist']").on("shown.bs.tab", function () {
     /*
         Instantiate the Sortable library. This will make the use of drag and drop available.
     */
-    if (!window.document.refreshToggleIsOn && !window.document.userTurnedToggleOff) {
+    if (!window.EventSource && !window.document.refreshToggleIsOn && !window.document.userTurnedToggleOff) {
         $("#refresh-playlist-toggle").bootstrapToggle("on");
         window.document.refreshToggleIsOn = true;
     }
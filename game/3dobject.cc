@@ -1,8 +1,18 @@
 #include "3dobject.hh"
 
+#include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
 #include <stdexcept>
 #include <sstream>
+#include <tuple>
 
 #include "texture.hh"
 
@@ -10,90 +20,152 @@
 // TODO: group handling for loader
 
 namespace {
-	/// Returns a word (delimited by delim) in a string st at position pos (1-based)
-	std::string getWord(std::string& st, size_t pos, char delim) {
-		std::istringstream iss(st);
-		std::string ret;
-		for (size_t i = 1; i <= pos; i++)
-			getline(iss, ret, delim);
-		return ret;
+	const unsigned VERSION = 1;  ///< Part of the cache file name hash, increment when the format changes
+	const char MAGIC[8] = { 'P', 'M', 'E', 'S', 'H', 0, 0, 0 };
+
+	/// Unique vertices (interleaved) and triangles indexing them
+	struct Mesh {
+		std::vector<glutil::VertexInfo> vertices;
+		std::vector<std::uint32_t> indices;
+	};
+
+	struct MeshHeader {
+		char magic[8];
+		std::uint32_t vertexSize;  ///< sizeof(VertexInfo) of the writer, files of other builds are rejected
+		std::uint32_t vertices, indices;
+	};
+
+	fs::path cacheFile(fs::path const& obj, float scale) {
+		boost::system::error_code ec;
+		std::ostringstream key;
+		key << VERSION << ' ' << scale << ' ' << obj.string() << ' ' << fs::file_size(obj, ec) << ' ' << fs::last_write_time(obj, ec);
+		std::ostringstream name;
+		name << std::hex << std::hash<std::string>()(key.str()) << ".mesh";
+		return getCacheDir() / "meshes" / name.str();
 	}
-}
 
-/// A polygon containing links to required point data
-struct Face {
-	std::vector<int> vertices;
-	std::vector<int> texcoords;
-	std::vector<int> normals;
-};
+	/// Read a mesh written by saveMesh (false if the file is missing or invalid)
+	bool loadMesh(fs::path const& file, Mesh& mesh) {
+		fs::ifstream f(file, std::ios::binary);
+		MeshHeader h;
+		if (!f.read(reinterpret_cast<char*>(&h), sizeof(h))) return false;
+		if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) || h.vertexSize != sizeof(glutil::VertexInfo)) return false;
+		mesh.vertices.resize(h.vertices);
+		mesh.indices.resize(h.indices);
+		f.read(reinterpret_cast<char*>(mesh.vertices.data()), mesh.vertices.size() * sizeof(glutil::VertexInfo));
+		f.read(reinterpret_cast<char*>(mesh.indices.data()), mesh.indices.size() * sizeof(std::uint32_t));
+		if (!f) return false;
+		for (auto i: mesh.indices) if (i >= h.vertices) return false;
+		return true;
+	}
 
-/// Load a Wavefront .obj file and possibly scale it also
-void Object3d::loadWavefrontObj(fs::path const& filepath, float scale) {
-	int linenumber = 0;
-	std::string row;
-	fs::ifstream file(filepath, std::ios::binary);
-	if (!file) throw std::runtime_error("Couldn't open object file "+filepath.string());
-	std::vector<glmath::vec3> vertices;
-	std::vector<glmath::vec3> normals;
-	std::vector<glmath::vec2> texcoords;
-	std::vector<Face> m_faces;
-	while (getline(file, row)) {
-		++linenumber;
-		std::istringstream srow(row);
-		float x,y,z;
-		std::string tempst;
-		if (row.substr(0,2) == "v ") {  // Vertices
-			srow >> tempst >> x >> y >> z;
-			vertices.push_back(glmath::vec3(x*scale, y*scale, z*scale));
-		} else if (row.substr(0,2) == "vt") {  // Texture Coordinates
-			srow >> tempst >> x >> y;
-			texcoords.push_back(glmath::vec2(x, y));
-		} else if (row.substr(0,2) == "vn") {  // Normals
-			srow >> tempst >> x >> y >> z;
-			double sum = std::abs(x)+std::abs(y)+std::abs(z);
-			if (sum == 0) throw std::runtime_error("Invalid normal in "+filepath.string()+":"+std::to_string(linenumber));
-			x /= sum; y /= sum; z /= sum; // Normalize components
-			normals.push_back(glmath::vec3(x, y, z));
-		} else if (row.substr(0,2) == "f ") {  // Faces
-			Face f;
-			srow >> tempst; // Eat away prefix
-			// Parse face point's coordinate references
-			for (std::string fpoint; srow >> fpoint; ) {
-				for (size_t i = 1; i <= 3; ++i) {
-					std::string st_id(getWord(fpoint,i,'/'));
-					if (!st_id.empty()) {
-						// Vertex indices are 1-based in the file
-						int v_id = std::stoi(st_id) - 1;
-						switch (i) {
-							case 1: f.vertices.push_back(v_id); break;
-							case 2: f.texcoords.push_back(v_id); break;
-							case 3: f.normals.push_back(v_id); break;
-						}
+	void saveMesh(fs::path const& file, Mesh const& mesh) {
+		MeshHeader h{};
+		std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+		h.vertexSize = sizeof(glutil::VertexInfo);
+		h.vertices = mesh.vertices.size();
+		h.indices = mesh.indices.size();
+		// Write to a temporary name first so that loadMesh never sees partial files
+		fs::create_directories(file.parent_path());
+		fs::path part = file;
+		part += ".part";
+		{
+			fs::ofstream f(part, std::ios::binary);
+			f.write(reinterpret_cast<char const*>(&h), sizeof(h));
+			f.write(reinterpret_cast<char const*>(mesh.vertices.data()), mesh.vertices.size() * sizeof(glutil::VertexInfo));
+			f.write(reinterpret_cast<char const*>(mesh.indices.data()), mesh.indices.size() * sizeof(std::uint32_t));
+			if (!f) throw std::runtime_error("Cannot write " + part.string());
+		}
+		fs::rename(part, file);
+	}
+
+	/// Parse a 1-based index of a face point (v/vt/vn) at p, advancing p. Returns -1 for an empty field.
+	int parseIndex(char const*& p) {
+		char* end;
+		long v = std::strtol(p, &end, 10);
+		if (end == p) return -1;
+		p = end;
+		return int(v) - 1;
+	}
+
+	/// Parse a Wavefront .obj file, scaling the vertices by scale
+	Mesh parseWavefrontObj(fs::path const& filepath, float scale) {
+		int linenumber = 0;
+		std::string row;
+		fs::ifstream file(filepath, std::ios::binary);
+		if (!file) throw std::runtime_error("Couldn't open object file "+filepath.string());
+		std::vector<glmath::vec3> vertices;
+		std::vector<glmath::vec3> normals;
+		std::vector<glmath::vec2> texcoords;
+		Mesh mesh;
+		std::map<std::tuple<int, int, int>, std::uint32_t> points;  ///< Unique (v, vt, vn) to mesh vertex index
+		auto error = [&](char const* what) { return std::runtime_error(what + (" in " + filepath.string()) + ":" + std::to_string(linenumber)); };
+		while (getline(file, row)) {
+			++linenumber;
+			char const* p = row.c_str();
+			float x = 0.0f, y = 0.0f, z = 0.0f;
+			if (row.compare(0, 2, "v ") == 0) {  // Vertices
+				if (std::sscanf(p + 2, "%f %f %f", &x, &y, &z) != 3) throw error("Invalid vertex");
+				vertices.push_back(glmath::vec3(x*scale, y*scale, z*scale));
+			} else if (row.compare(0, 2, "vt") == 0) {  // Texture Coordinates
+				if (std::sscanf(p + 2, "%f %f", &x, &y) != 2) throw error("Invalid texture coordinate");
+				texcoords.push_back(glmath::vec2(x, y));
+			} else if (row.compare(0, 2, "vn") == 0) {  // Normals
+				if (std::sscanf(p + 2, "%f %f %f", &x, &y, &z) != 3) throw error("Invalid normal");
+				double sum = std::abs(x)+std::abs(y)+std::abs(z);
+				if (sum == 0) throw error("Invalid normal");
+				x /= sum; y /= sum; z /= sum; // Normalize components
+				normals.push_back(glmath::vec3(x, y, z));
+			} else if (row.compare(0, 2, "f ") == 0) {  // Faces
+				// Parse face point's coordinate references (v, v/vt, v//vn or v/vt/vn); vertex indices are 1-based in the file
+				std::tuple<int, int, int> face[3];
+				unsigned count = 0;
+				bool hasTexCoords = false, hasNormals = false;
+				for (p += 2; *p; ) {
+					while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+					if (!*p) break;
+					if (count == 3) throw error("Only triangle faces allowed");
+					int v = parseIndex(p), vt = -1, vn = -1;
+					if (*p == '/') { ++p; vt = parseIndex(p); }
+					if (*p == '/') { ++p; vn = parseIndex(p); }
+					if (v < 0 || v >= int(vertices.size()) || vt >= int(texcoords.size()) || vn >= int(normals.size())) throw error("Invalid face");
+					if (count == 0) { hasTexCoords = vt >= 0; hasNormals = vn >= 0; }
+					// Face must have equal number of v, vt, vn or none of a kind
+					else if (hasTexCoords != (vt >= 0) || hasNormals != (vn >= 0)) throw error("Invalid face");
+					face[count++] = std::make_tuple(v, vt, vn);
+				}
+				if (count == 0) throw error("Invalid face");
+				if (count != 3) throw error("Only triangle faces allowed");
+				for (auto const& point: face) {
+					auto ins = points.emplace(point, mesh.vertices.size());
+					if (ins.second) {
+						glutil::VertexInfo vi;
+						vi.vertPos = vertices[std::get<0>(point)];
+						if (std::get<1>(point) >= 0) vi.vertTexCoord = texcoords[std::get<1>(point)];
+						if (std::get<2>(point) >= 0) vi.vertNormal = normals[std::get<2>(point)];
+						mesh.vertices.push_back(vi);
 					}
+					mesh.indices.push_back(ins.first->second);
 				}
 			}
-			if (!f.vertices.empty() && f.vertices.size() != 3)
-				throw std::runtime_error("Only triangle faces allowed in "+filepath.string()+":"+std::to_string(linenumber));
-			// Face must have equal number of v, vt, vn or none of a kind
-			if (!f.vertices.empty()
-			  && (f.texcoords.empty() || (f.texcoords.size() == f.vertices.size()))
-			  && (f.normals.empty()   || (f.normals.size() == f.vertices.size()))) {
-				m_faces.push_back(f);
-			} else {
-				throw std::runtime_error("Invalid face in "+filepath.string()+":"+std::to_string(linenumber));
-			}
 		}
+		return mesh;
 	}
-	// Construct a vertex array
-	for (std::vector<Face>::const_iterator i = m_faces.begin(); i != m_faces.end(); ++i) {
-		bool hasNormals = !i->normals.empty();
-		bool hasTexCoords = !i->texcoords.empty();
-		for (size_t j = 0; j < i->vertices.size(); ++j) {
-			if (hasNormals) m_va.normal(normals[i->normals[j]]);
-			if (hasTexCoords) m_va.texCoord(texcoords[i->texcoords[j]]);
-			m_va.vertex(vertices[i->vertices[j]]);
+}
+
+/// Load a Wavefront .obj file (from the mesh cache if it has been loaded before) and possibly scale it also
+void Object3d::loadWavefrontObj(fs::path const& filepath, float scale) {
+	Mesh mesh;
+	const fs::path cached = cacheFile(filepath, scale);
+	if (!loadMesh(cached, mesh)) {
+		mesh = parseWavefrontObj(filepath, scale);
+		try {
+			saveMesh(cached, mesh);
+		} catch (std::exception& e) {
+			std::clog << "cache/warning: Cannot cache mesh of " << filepath << ": " << e.what() << std::endl;
 		}
 	}
+	m_mesh.upload(mesh.vertices, mesh.indices);
 }
 
 void Object3d::load(fs::path const& filepath, fs::path const& texturepath, float scale) {
@@ -105,9 +177,9 @@ void Object3d::draw() {
 	UseShader us(getShader("3dobject"));
 	if (m_texture) {
 		UseTexture tex(*m_texture);
-		m_va.draw(GL_TRIANGLES);
+		m_mesh.drawElements(GL_TRIANGLES);
 	} else {
-		m_va.draw(GL_TRIANGLES);
+		m_mesh.drawElements(GL_TRIANGLES);
 	}
 }
 
@@ -14,7 +14,7 @@ class Texture;
 /// Non-copyable because of display lists getting messed up
 class Object3d {
   private:
-	glutil::VertexArray m_va;
+	glutil::VertexBuffer m_mesh;  ///< Indexed triangles, uploaded once at load
 	std::unique_ptr<Texture> m_texture; /// texture
 	/// load a Wavefront .obj 3d object file
 	void loadWavefrontObj(fs::path const& filepath, float scale = 1.0);
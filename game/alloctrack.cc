@@ -0,0 +1,78 @@
+#include "alloctrack.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+	// Plain integers and pointers need no construction, so they work from the first operator new on
+	thread_local std::uint64_t t_allocations = 0;
+	thread_local std::uint64_t t_bytes = 0;
+	thread_local std::uint64_t t_frees = 0;
+	thread_local char const* t_forbidden = nullptr;  ///< The NoAlloc section that the thread is in
+}
+
+namespace alloctrack {
+#ifdef USE_ALLOC_TRACKING
+	bool enabled() { return true; }
+#else
+	bool enabled() { return false; }
+#endif
+	std::uint64_t allocations() { return t_allocations; }
+	std::uint64_t bytes() { return t_bytes; }
+	std::uint64_t frees() { return t_frees; }
+
+	NoAlloc::NoAlloc(char const* what, bool active): m_previous(t_forbidden), m_active(active && enabled()) {
+		if (m_active) t_forbidden = what;
+	}
+
+	NoAlloc::~NoAlloc() {
+		if (m_active) t_forbidden = m_previous;
+	}
+}
+
+#ifdef USE_ALLOC_TRACKING
+namespace {
+	void forbidden(char const* op, std::size_t size) {
+		char const* what = t_forbidden;
+		t_forbidden = nullptr;  // Writing the message may allocate
+		std::fprintf(stderr, "alloctrack: %s of %lu bytes in %s\n", op, static_cast<unsigned long>(size), what);
+		std::abort();
+	}
+
+	void* allocate(std::size_t size) {
+		++t_allocations;
+		t_bytes += size;
+		if (t_forbidden) forbidden("allocation", size);
+		if (size == 0) size = 1;
+		while (true) {
+			if (void* ptr = std::malloc(size)) return ptr;
+			std::new_handler handler = std::get_new_handler();
+			if (!handler) throw std::bad_alloc();
+			handler();
+		}
+	}
+
+	void deallocate(void* ptr) {
+		if (!ptr) return;
+		++t_frees;
+		if (t_forbidden) forbidden("free", 0);
+		std::free(ptr);
+	}
+}
+
+void* operator new(std::size_t size) { return allocate(size); }
+void* operator new[](std::size_t size) { return allocate(size); }
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept {
+	try { return allocate(size); } catch (std::bad_alloc const&) { return nullptr; }
+}
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept {
+	try { return allocate(size); } catch (std::bad_alloc const&) { return nullptr; }
+}
+void operator delete(void* ptr) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::nothrow_t const&) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, std::nothrow_t const&) noexcept { deallocate(ptr); }
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+* Counts the heap allocations of each thread, for checking that the hot paths (the audio callback, engine steps,
+* frames) do not allocate. The global operator new and delete are only replaced in builds with
+* ENABLE_ALLOC_TRACKING (cmake); otherwise nothing is counted and nothing costs anything. The Profiler reports the
+* allocations of its checkpoints and the audio statistics those of the callbacks. With NoAlloc a thread aborts on
+* the first allocation or free of a section, which audio/assert_no_alloc enables for the audio callback.
+**/
+namespace alloctrack {
+	/// Was the game built with allocation tracking?
+	bool enabled();
+	/// Calls of operator new by the calling thread since it started (0 if not enabled)
+	std::uint64_t allocations();
+	/// Bytes requested by those calls
+	std::uint64_t bytes();
+	/// Calls of operator delete (of non-null pointers) by the calling thread since it started
+	std::uint64_t frees();
+
+	/// Abort when the calling thread allocates or frees memory while this exists (if active and enabled)
+	class NoAlloc {
+	  public:
+		/// what names the section in the message
+		explicit NoAlloc(char const* what, bool active = true);
+		~NoAlloc();
+		NoAlloc(NoAlloc const&) = delete;
+		NoAlloc& operator=(NoAlloc const&) = delete;
+	  private:
+		char const* m_previous;  ///< Of the enclosing section, restored on destruction
+		bool m_active;
+	};
+}
@@ -9,7 +9,7 @@
 class AnimValue {
   public:
 	/// constructor
-	AnimValue(double value = 0.0, double rate = 1.0): m_value(value), m_target(value), m_rate(rate), m_time(Clock::now()) {}
+	AnimValue(double value = 0.0, double rate = 1.0): m_value(value), m_target(value), m_rate(rate), m_time(now()) {}
 	/// move animation forward by diff
 	void move(double diff) { m_value += diff; }
 	/// gets animition target
@@ -31,12 +31,24 @@ class AnimValue {
 		double diff = m_value - m_target;
 		double adj = std::min(maxadj, std::fabs(diff));
 		if (diff > 0.0) m_value -= adj; else m_value += adj;
+		if (m_value != m_target) activityFlag() = true;
 		return m_value;
 	}
+	/// Has any AnimValue been read while still moving since resetActivity (render thread)? If not, the frame
+	/// drawn looks like the previous one as far as AnimValues are concerned.
+	static bool activity() { return activityFlag(); }
+	static void resetActivity() { activityFlag() = false; }
+	/// Take the time at which the animations of the frame about to be drawn are evaluated (render thread), so that
+	/// they all move by the same step instead of each reading the clock.
+	static void beginFrame() { frameTime() = Clock::now(); }
+	/// The time of animations: the snapshot of beginFrame on the thread that takes them, the wall clock on others
+	static Time now() { Time const& t = frameTime(); return t == Time() ? Clock::now() : t; }
 
   private:
+	static bool& activityFlag() { static bool flag = false; return flag; }
+	static Time& frameTime() { thread_local Time t{}; return t; }
 	double duration() const {
-		auto newtime = Clock::now();
+		auto newtime = now();
 		Seconds t = newtime - m_time;
 		m_time = newtime;
 		return clamp(t.count());
@@ -60,7 +72,7 @@ class AnimAcceleration {
 		const double overshoot = 0.95; // Over 1.0 decelerates too late, less than 1.0 decelerates too early
 		if (m_songs == 0) return m_target;
 		double num = m_marginLeft + m_songs + m_marginRight;
-		auto curtime = Clock::now();
+		auto curtime = AnimValue::now();
 		double duration = Seconds(curtime - m_time).count();
 		m_time = curtime;
 		if (!(duration > 0.0)) return m_position; // Negative value or NaN, or no songs - skip processing
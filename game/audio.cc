@@ -1,19 +1,35 @@
 #include "audio.hh"
 
+#include "alloctrack.hh"
+#include "capture.hh"
 #include "chrono.hh"
 #include "configuration.hh"
+#include "libda/mix.hpp"
+#include "latencycal.hh"
 #include "libda/portaudio.hpp"
-#include "screen_songs.hh"
-#include "songs.hh"
+#include "lockstats.hh"
+#include "log.hh"
+#include "metrics.hh"
+#include "netmic.hh"
+#include "platform.hh"
+#include "profiler.hh"
+#include "spscqueue.hh"
+#include "threads.hh"
 #include "util.hh"
 
-#include "aubio/aubio.h"
 #include <boost/range/iterator_range.hpp>
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <condition_variable>
 #include <future>
+#include <iomanip>
 #include <iostream>
+#include <list>
 #include <map>
+#include <sstream>
+#include <thread>
 #include <unordered_map>
 
 namespace {
@@ -55,64 +71,63 @@ namespace {
 		return ret;
 	}
 
-	/**
-	 * Pitch shifter.
-	 * @param begin start of the buffer
-	 * @param end end of the buffer
-	 * @param factor shift factor from 0 (no shift) to 1 (maximum)
-	 */
-	template <typename It> void PitchShift(It begin, It end, double factor) {
-		//FIXME: Dummy volume bender
-		for (It i = begin; i != end; ++i)
-			*i *= factor * factor; // Decrease music volume
-	}
+	/// Pitch bend of a track at full whammy (down, in semitones)
+	const double WHAMMY_SEMITONES = 2.0;
+
+	const unsigned long MIX_AHEAD_MIN_FRAMES = 64;  ///< Lower limit of the audio/mixer_thread lookahead
+	const std::size_t MIX_AHEAD_BLOCK = 256;  ///< Frames mixed ahead at once, at most
+
+	const std::size_t FOLLOWER_RING_FRAMES = 1 << 15;  ///< Capacity for the mix of another output device (a power of two)
+
+	const unsigned SYNTH_TABLE = 1024;  ///< Wavetable samples per period (a power of two)
+
+	const std::size_t SAMPLE_VOICES = 16;  ///< Sound effects playing at once, at most
+	const double SAMPLE_MAX_SECONDS = 30.0;  ///< Longer sound effects are cut
 }
 
 void AudioClock::timeSync(Seconds audioPos, Seconds length) {
 	constexpr Seconds maxError = 100ms;  // Step the clock instead of skewing if over 100 ms off
-	// Full correction requires locking, but we can update max without lock too
-	std::unique_lock<std::mutex> l(m_mutex, std::defer_lock);
 	Seconds max = audioPos + length;
-	if (!l.try_lock()) {
-		if (max > m_max.load()) m_max = max; // Allow increasing m_max
-		return;
-	}
-	// Mutex locked - do a full update
 	auto now = Clock::now();
-	const Seconds sys = pos_internal(now);  // Current position (based on system clock + corrections)
+	const Seconds sys = pos(m_state, now);  // Current position (based on system clock + corrections)
 	const Seconds audio = audioPos;  // Audio time
 	const Seconds diff = audio - sys;
 	// Skew-based correction only if going forward and relatively well synced
-	if (max > m_max.load() && std::abs(diff.count()) < maxError.count()) {
+	if (max > m_state.max && std::abs(diff.count()) < maxError.count()) {
 		constexpr double fudgeFactor = 0.001;  // Adjustment ratio
 		// Update base position (this should not affect the clock)
-		m_baseTime = now;
-		m_basePos = sys;
+		m_state.baseTime = now;
+		m_state.basePos = sys;
 		// Apply a VERY ARTIFICIAL correction for clock!
 		const Seconds valadj = length * 0.1 * rand() / RAND_MAX;  // Dither
-		m_skew += (diff < valadj ? -1.0 : 1.0) * fudgeFactor;
+		m_state.skew += (diff < valadj ? -1.0 : 1.0) * fudgeFactor;
 		// Limits to keep things sane in abnormal situations
-		m_skew = clamp(m_skew, -0.01, 0.01);
+		m_state.skew = clamp(m_state.skew, -0.01, 0.01);
 	} else {
 		// Off too much, step to correct time
-		m_baseTime = now;
-		m_basePos = audio;
-		m_skew = 0.0;
+		++m_steps;
+		m_state.baseTime = now;
+		m_state.basePos = audio;
+		m_state.skew = 0.0;
 	}
-	m_max = max;
+	m_state.max = max;
+	m_published.store(m_state);
 }
 
-Seconds AudioClock::pos_internal(Time now) const {
-	Seconds t = m_basePos + (1.0 + m_skew) * (now - m_baseTime);
-	return std::min<Seconds>(t, m_max);
+Seconds AudioClock::pos(State const& state, Time now) {
+	Seconds t = state.basePos + (1.0 + state.skew) * (now - state.baseTime);
+	return std::min<Seconds>(t, state.max);
 }
 
 Seconds AudioClock::pos() const {
-	std::lock_guard<std::mutex> l(m_mutex);
-	return pos_internal(Clock::now());
+	return pos(m_published.load(), Clock::now());
 }
 
-Music::Music(Audio::Files const& files, unsigned int sr, bool preview): srate(sr), m_preview(preview) {
+double AudioClock::skew() const {
+	return m_published.load().skew;
+}
+
+Music::Music(Audio::Files const& files, unsigned int sr, bool preview, double fileOffset): srate(sr), m_fileOffset(2 * int64_t(fileOffset * sr)), m_preview(preview), m_suppressor(sr) {
 	for (auto const& tf /* trackname-filename pair */: files) {
 		if (tf.second.empty()) continue; // Skip tracks with no filenames; FIXME: Why do we even have those here, shouldn't they be eliminated earlier?
 		tracks.emplace(tf.first, std::make_unique<Track>(tf.second, sr));
@@ -120,68 +135,55 @@ Music::Music(Audio::Files const& files, unsigned int sr, bool preview): srate(sr
 	suppressCenterChannel = config["audio/suppress_center_channel"].b();
 }
 
-unsigned Audio::aubio_win_size = 1536;
-unsigned Audio::aubio_hop_size = 768;
-
-std::unique_ptr<aubio_tempo_t, void(*)(aubio_tempo_t*)> Audio::aubioTempo =
-					std::unique_ptr<aubio_tempo_t, void(*)(aubio_tempo_t*)>(
-						new_aubio_tempo(
-							"default",
-							Audio::aubio_win_size,
-							Audio::aubio_hop_size,
-							Audio::getSR()),[](aubio_tempo_t* p) {
-							if (p != nullptr) {
-								del_aubio_tempo(p);
-								}
-							}
-					);
-
-std::recursive_mutex Audio::aubio_mutex;
-
-bool Music::operator()(float* begin, float* end) {
+bool Music::operator()(float* begin, float* end, int64_t delay) {
 	size_t samples = end - begin;
-	m_clock.timeSync(durationOf(m_pos), durationOf(samples)); // Keep the clock synced
+	m_clock.timeSync(durationOf(m_pos - delay), durationOf(samples)); // Keep the clock synced to what is heard
 	bool eof = true;
-	Buffer mixbuf(samples);
+	if (m_mixbuf.size() < samples) m_mixbuf.resize(samples);  // Only grows, so normally allocates once
+	std::fill(m_mixbuf.begin(), m_mixbuf.begin() + samples, 0.0f);
 	for (auto& kv: tracks) {
 		Track& t = *kv.second;
-// #if 0 // FIXME: Include this code bit once there is a sane pitch shifting algorithm
-// //			if (it->first == "guitar") std::cout << t.pitchFactor << std::endl;
-// 			if (t.pitchFactor != 0) { // Pitch shift
-// 				Buffer tempbuf(end - begin);
-// 				// Get audio to temp buffer
-// 				if (t.mpeg.audioQueue(&*tempbuf.begin(), &*tempbuf.end(), m_pos, t.fadeLevel)) eof = false;
-// 				// Do the magic
-// 				PitchShift(&*tempbuf.begin(), &*tempbuf.end(), t.pitchFactor);
-// 				// Mix with other tracks
-// 				Buffer::iterator m = mixbuf.begin();
-// 				Buffer::iterator b = tempbuf.begin();
-// 				while (b != tempbuf.end())
-// 					*m++ += (*b++);
-// 			// Otherwise just get the audio and mix it straight away
-// 			} else
-// #endif
-		if (t.audioBuffer.read(mixbuf.data(), mixbuf.size(), m_pos, t.fadeLevel)) eof = false;
-		
+		if (t.bent) {
+			// Decode to a buffer of its own and mix it to the others through the pitch shifter
+			if (m_bendbuf.size() < samples) m_bendbuf.resize(samples);
+			std::fill(m_bendbuf.begin(), m_bendbuf.begin() + samples, 0.0f);
+			if (t.audioBuffer.read(m_bendbuf.data(), samples, m_pos - m_fileOffset, t.fadeLevel)) eof = false;
+			const double ratio = std::pow(2.0, -WHAMMY_SEMITONES * clamp(double(t.pitchFactor), 0.0, 1.0) / 12.0);
+			t.shifter.mix(m_bendbuf.data(), m_mixbuf.data(), samples / 2, ratio);
+			continue;
+		}
+		if (t.audioBuffer.read(m_mixbuf.data(), samples, m_pos - m_fileOffset, t.fadeLevel)) eof = false;
 	}
 	m_pos += samples;
 	
-	for (size_t i = 0, iend = mixbuf.size(); i != iend; ++i) {
-		if (i % 2 == 0) {
+	static ConfigItem& previewVolume = config["audio/preview_volume"];
+	static ConfigItem& musicVolume = config["audio/music_volume"];
+	const float volume = static_cast<float>(m_preview ? previewVolume.i() : musicVolume.i())/100.0;
+	da::CenterSuppressor* const suppress = suppressCenterChannel && !m_preview ? &m_suppressor : nullptr;  // suppress center channel vocals
+	// Mix to output in segments where the fade level changes linearly
+	const std::size_t frames = samples / 2;
+	for (std::size_t k = 0; k < frames;) {
+		if (fadeRate != 0.0) {
+			// Frames that stay within (0, 1] while fading and can be done as one ramp
+			double n = (fadeRate > 0.0 ? std::floor((1.0 - fadeLevel) / fadeRate) : std::ceil(fadeLevel / -fadeRate) - 1.0);
+			n = clamp(n, 0.0, double(frames - k));
+			std::size_t ramp = n;
+			if (ramp > 0) {
+				da::mix_stereo(begin + 2 * k, m_mixbuf.data() + 2 * k, ramp, (fadeLevel + fadeRate) * volume, fadeRate * volume, suppress);
+				fadeLevel += ramp * fadeRate;
+				k += ramp;
+			}
+			if (k == frames) break;
+			// The frame where the fade completes or the music ends
 			fadeLevel += fadeRate;
 			if (fadeLevel <= 0.0) return false;
 			if (fadeLevel > 1.0) { fadeLevel = 1.0; fadeRate = 0.0; }
+			da::mix_stereo(begin + 2 * k, m_mixbuf.data() + 2 * k, 1, fadeLevel * volume, 0.0f, suppress);
+			++k;
+			continue;
 		}
-		begin[i] += mixbuf[i] * fadeLevel * static_cast<float>(m_preview ? config["audio/preview_volume"].i() : config["audio/music_volume"].i())/100.0;
-	}
-	// suppress center channel vocals
-	if(suppressCenterChannel && !m_preview) {
-		float diffLR;
-		for (size_t i=0; i<mixbuf.size(); i+=2) {
-			diffLR = begin[i] - begin[i+1];
-			begin[i] = diffLR;
-			begin[i+1] = diffLR;
-		}
+		da::mix_stereo(begin + 2 * k, m_mixbuf.data() + 2 * k, frames - k, fadeLevel * volume, 0.0f, suppress);
+		break;
 	}
 	return !eof;
 }
@@ -189,53 +191,14 @@ bool Music::operator()(float* begin, float* end) {
 double Music::duration() const {
 	double dur = 0.0;
 	for (auto& kv: tracks) dur = std::max(dur, kv.second->audioBuffer.duration());
-	return dur;
+	return dur + m_fileOffset / (2.0 * srate);
 }
 
 bool Music::prepare() {
 	bool ready = true;
 	for (auto& kv: tracks) {
 		auto& audioBuffer = kv.second->audioBuffer;
-		if (audioBuffer.prepare(m_pos)) {
-			if (kv.first == "background" && m_preview && m_pos > 0) {
-				auto previewSamples = audioBuffer.makePreviewBuffer();
-				fvec_t* previewBeats = ScreenSongs::previewBeatsBuffer.get();
-				intptr_t readptr = 0;
-				fvec_t* tempoSamplePtr = new_fvec(Audio::aubio_hop_size);
-				std::lock_guard<std::recursive_mutex> l(Audio::aubio_mutex);
-				Game* gm = Game::getSingletonPtr();
-				ScreenSongs* sSongs = static_cast<ScreenSongs *>(gm->getScreen("Songs"));
-				double pstart = sSongs->getSongs().currentPtr()->preview_start;
-				pstart = (std::isnan(pstart) ? 0.0 : pstart);
-				double first_period = 0.0, first_beat = 0.0;
-				std::vector<double> extra_beats;
-				Song::Beats& beats = sSongs->getSongs().currentPtr()->beats;
-				if (!sSongs->getSongs().currentPtr()->hasControllers()) {
-				while ((readptr + Audio::aubio_hop_size) <= previewSamples->length) {
-					tempoSamplePtr->data = &previewSamples->data[readptr];
-					aubio_tempo_do(Audio::aubioTempo.get(),tempoSamplePtr,previewBeats);
-					if (previewBeats->data[0] != 0) {
-						double beatSecs = aubio_tempo_get_last_s(Audio::aubioTempo.get());
-							if (beats.empty()) { // Store time and period of first detected beat.
-								first_beat = beatSecs;
-								first_period = aubio_tempo_get_period_s(Audio::aubioTempo.get());
-							}
-						beats.push_back(beatSecs + pstart);
-					}
-					readptr += Audio::aubio_hop_size;
-				}
-					if (!beats.empty()) {
-						double newBeat = first_beat - first_period;
-						while (newBeat > 0.02) {
-							extra_beats.push_back(newBeat + pstart);
-							newBeat -= first_period;
-						}
-						beats.insert(beats.begin(),extra_beats.rbegin(),extra_beats.rend());
-					}
-				}
-			}	
-		continue;  // Buffering done
-		}
+		if (audioBuffer.prepare(m_pos - m_fileOffset)) continue;  // Buffering done
 		ready = false;  // Need to wait for buffering
 		break;
 	}
@@ -252,158 +215,508 @@ void Music::trackPitchBend(std::string const& name, double pitchFactor) {
 	auto it = tracks.find(name);
 	if (it == tracks.end()) return;
 	it->second->pitchFactor = pitchFactor;
+	if (pitchFactor != 0.0) it->second->bent = true;
 }
 
-struct Sample {
-  private:
-	double m_pos;
-	AudioBuffer audioBuffer;
-	bool eof;
-  public:
-	Sample(fs::path const& filename, unsigned sr) : m_pos(), audioBuffer(filename, sr), eof(true) { }
-	void operator()(float* begin, float* end) {
-		if(eof) {
-			// No more data to play in this sample
-			return;
-		}
-		std::vector<float> mixbuf(end - begin);
-		if(!audioBuffer.read(mixbuf.data(), mixbuf.size(), m_pos, 1.0)) {
-			eof = true;
-		}
-		for (size_t i = 0, iend = end - begin; i != iend; ++i) {
-			begin[i] += mixbuf[i] * static_cast<float>(config["audio/fail_volume"].i())/100.0;
+/// A short sound effect, decoded completely when loaded and then only read (by any number of voices)
+struct SampleData {
+	SampleData(fs::path const& filename, unsigned sr);
+	fs::path file;
+	std::vector<float> samples;  ///< Interleaved stereo at the output rate
+};
+
+SampleData::SampleData(fs::path const& filename, unsigned sr): file(filename) {
+	const std::size_t maxSamples = 2 * std::size_t(SAMPLE_MAX_SECONDS * sr);
+	AudioFFmpeg ffmpeg(filename, sr, AudioFFmpeg::FloatCb([this, maxSamples](float const* data, size_t count, int64_t pos) {
+		if (pos < 0 || std::size_t(pos) >= maxSamples) return;
+		const std::size_t begin = pos;
+		count = std::min(count, maxSamples - begin);
+		if (samples.size() < begin + count) samples.resize(begin + count);
+		std::copy(data, data + count, samples.begin() + begin);
+	}));
+	unsigned errors = 0;
+	while (samples.size() < maxSamples) {
+		try {
+			ffmpeg.handleOneFrame();
+			errors = 0;
+		} catch (FFmpeg::Eof const&) {
+			break;
+		} catch (std::exception const& e) {
+			std::clog << "ffmpeg/error: " << filename << ": " << e.what() << std::endl;
+			if (++errors > 2) break;
 		}
-		m_pos += end - begin;
-	}
-	void reset() {
-		eof = false;
-		m_pos = 0;
 	}
+	samples.shrink_to_fit();
+}
+
+/// Playback of a sound effect; the voices belong to the sample bank and are guarded by its mutex
+struct SampleVoice {
+	SampleData const* data = nullptr;  ///< Nullptr if not playing
+	std::size_t pos = 0;  ///< Next sample to play
 };
 
+/**
+* Plays the notes of a vocal track as tones, for practice. Each of the twelve pitch classes has its own timbre,
+* so one period of every tone is tabulated when constructed and the callback only steps a phase accumulator
+* through the table of the current note, interpolating linearly.
+**/
 struct Synth {
   private:
 	Notes m_notes;
-	double srate; ///< Sample rate
+	std::size_t m_cursor = 0;  ///< Index of the first note not yet ended at the previous position
+	double m_phase = 0.0;  ///< Position in the wavetable, [0, SYNTH_TABLE)
+	double m_step[12];  ///< Wavetable samples per frame for each note
+	std::vector<float> m_table;  ///< One period of each note, plus a guard sample for interpolation
   public:
-	Synth(Notes const& notes, unsigned int sr) : m_notes(notes), srate(sr) {}
+	Synth(Notes const& notes, unsigned int sr) : m_notes(notes), m_table(12 * (SYNTH_TABLE + 1)) {
+		for (int note = 0; note < 12; ++note) {
+			double d = (note + 1) / 13.0;
+			m_step[note] = SYNTH_TABLE * MusicalScale().setNote(note + 4 * 12).getFreq() / sr;
+			float* table = &m_table[note * (SYNTH_TABLE + 1)];
+			for (unsigned i = 0; i <= SYNTH_TABLE; ++i) {
+				double phase = TAU * i / SYNTH_TABLE;
+				table[i] = d * 0.2 * std::sin(phase) + 0.2 * std::sin(2 * phase) + (1.0 - d) * 0.2 * std::sin(4 * phase);
+			}
+		}
+	}
 	void operator()(float* begin, float* end, double position) {
-		static double phase = 0.0;
 		for (float *i = begin; i < end; ++i) *i *= 0.3; // Decrease music volume
-
-		std::vector<float> mixbuf(end - begin);
-		Notes::const_iterator it = m_notes.begin();
-
-		while (it != m_notes.end() && it->end < position) ++it;
-		if (it == m_notes.end() || it->type == Note::SLEEP || it->begin > position) { phase = 0.0; return; }
-		int note = it->note % 12;
-		double d = (note + 1) / 13.0;
-		double freq = MusicalScale().setNote(note + 4 * 12).getFreq();
-		double value = 0.0;
-		// Synthesize tones
-		for (size_t i = 0, iend = mixbuf.size(); i != iend; ++i) {
-			if (i % 2 == 0) {
-				value = d * 0.2 * std::sin(phase) + 0.2 * std::sin(2 * phase) + (1.0 - d) * 0.2 * std::sin(4 * phase);
-				phase += TAU * freq / srate;
-			}
-			begin[i] += value;
+		// Find the current note, continuing from the previous callback (or going back after a seek)
+		while (m_cursor > 0 && m_notes[m_cursor - 1].end >= position) --m_cursor;
+		while (m_cursor < m_notes.size() && m_notes[m_cursor].end < position) ++m_cursor;
+		if (m_cursor == m_notes.size()) { m_phase = 0.0; return; }
+		Note const& n = m_notes[m_cursor];
+		if (n.type == Note::SLEEP || n.begin > position) { m_phase = 0.0; return; }
+		int note = n.note % 12;
+		float const* table = &m_table[note * (SYNTH_TABLE + 1)];
+		const double step = m_step[note];
+		double phase = m_phase;
+		for (float* i = begin; i + 1 < end; i += 2) {
+			const unsigned k = phase;
+			const float value = table[k] + float(phase - k) * (table[k + 1] - table[k]);
+			i[0] += value;
+			i[1] += value;
+			phase += step;
+			if (phase >= SYNTH_TABLE) phase -= SYNTH_TABLE;
 		}
+		m_phase = phase;
 	}
 };
 
 struct Command {
-	enum { TRACK_FADE, TRACK_PITCHBEND, SAMPLE_RESET } type;
+	enum { TRACK_FADE, TRACK_PITCHBEND, SAMPLE_PLAY, SEEK, SEEK_RELATIVE, TOGGLE_CENTER_SUPPRESSOR, SYNTH } type;
 	std::string track;
 	double factor;
 };
 
+class OutputFollower;
+
 /// Audio output callback wrapper. The playback Device calls this when it needs samples.
 struct Output {
-	std::mutex mutex;
-	std::mutex samples_mutex;
-	std::mutex synth_mutex;
-	std::unique_ptr<Synth> synth;
+	lockstats::Mutex mutex{ "audio output" };  ///< Guards playing and preloading for readers; the callback only changes them with try_lock
+	std::mutex command_mutex;  ///< Serializes senders of commands (never taken by the callback)
+	std::size_t droppedCommands = 0;  ///< Commands that did not fit the queue (guarded by command_mutex)
+	lockstats::Mutex samples_mutex{ "audio samples" };  ///< Guards samples and voices (the callback only takes it with try_lock)
+	std::unique_ptr<Synth> synth;  ///< Only accessed by the callback
+	std::atomic<Synth*> synthIncoming{ nullptr };  ///< Synth sent by toggleSynth, taken by the callback on SYNTH
+	bool synthOn = false;  ///< Has toggleSynth started the synth (only accessed by the sender)
 	std::unique_ptr<Music> preloading;
-	std::vector<std::unique_ptr<Music>> playing, disposing;
-	std::vector<Analyzer*> mics;  // Used for audio pass-through
-	std::unordered_map<std::string, std::unique_ptr<Sample>> samples;
-	std::vector<Command> commands;
+	std::vector<std::unique_ptr<Music>> playing;
+	std::atomic<Music*> incoming{ nullptr };  ///< Music sent by playMusic, taken by the next callback (not a command, so never dropped)
+	std::array<std::atomic<Analyzer*>, AUDIO_MAX_ANALYZERS> mics{};  ///< Used for audio pass-through (filled in order as mics are added)
+	std::unordered_map<std::string, std::shared_ptr<SampleData const>> samples;  ///< Sample bank, by name
+	std::array<SampleVoice, SAMPLE_VOICES> voices{};
+	SpscQueue<Command, 256> commands;
+	SpscQueue<std::unique_ptr<Music>, 64> reclaim;  ///< Streams no longer needed, deleted by the reclaimer thread
+	SpscQueue<std::unique_ptr<Synth>, 8> reclaimSynth;  ///< Stopped synths, deleted by the reclaimer thread
 	std::atomic<bool> paused{ false };
-	Output(): paused(false) {}
+	int64_t delay = 0;  ///< Samples mixed ahead but not yet played, set by MixAhead before each callback (callback only)
+	std::array<std::atomic<OutputFollower*>, 4> followers{};  ///< Other output devices playing this mix
+	std::atomic<bool> monitored{ false };  ///< Is there a monitor follower (which then plays the mic pass-through)?
+	std::atomic<Capture*> capture{ nullptr };  ///< Gameplay recording that gets a copy of the mix
+	std::atomic<bool> capturing{ false };  ///< Is the callback using capture (so that it is not deleted meanwhile)?
+	std::atomic<bool> feeding{ false };  ///< Is the callback using followers (so that they are not deleted meanwhile)?
+	/// What is playing, for the other threads
+	struct Playback {
+		bool active = false;  ///< Music playing or preloading
+		bool ready = false;  ///< Music playing (not preloading)
+		double duration = 0.0;
+		AudioClock::State clock;
+	};
+	SeqLock<Playback> playback;  ///< Published by the callback, read without locking
+	std::mutex reclaim_mutex;
+	std::condition_variable reclaim_cond;
+	bool quit = false;
+	std::thread reclaimer;
+	Output(): paused(false), reclaimer(&Output::reclaimLoop, this) {}
+	~Output() {
+		{
+			std::lock_guard<std::mutex> l(reclaim_mutex);
+			quit = true;
+		}
+		reclaim_cond.notify_one();
+		reclaimer.join();
+		delete incoming.exchange(nullptr);
+		delete synthIncoming.exchange(nullptr);
+	}
 
-	void callbackUpdate() {
-		std::unique_lock<std::mutex> l(mutex, std::try_to_lock);
-		if (!l.owns_lock()) return;  // No update now, try again later (cannot stop and wait for mutex to be released)
+	/// Send a command to the callback (the command is dropped if the callback has not kept up)
+	void send(Command&& cmd) {
+		std::lock_guard<std::mutex> l(command_mutex);
+		if (commands.push(std::move(cmd))) return;
+		if (droppedCommands++ == 0) std::clog << "audio/warning: Audio commands dropped, the output is not processing them" << std::endl;
+	}
+
+	/// Delete disposed streams outside of the callback (Music destructors stop decoder threads)
+	void reclaimLoop() {
+		std::unique_lock<std::mutex> l(reclaim_mutex);
+		while (true) {
+			std::unique_ptr<Music> m;
+			while (reclaim.tryPop(m)) {
+				UnlockGuard<std::unique_lock<std::mutex>> unlocked(l);
+				m.reset();
+			}
+			std::unique_ptr<Synth> s;
+			while (reclaimSynth.tryPop(s)) s.reset();
+			if (quit) break;
+			reclaim_cond.wait_for(l, 100ms);  // The callback cannot notify, so poll
+		}
+	}
+
+	/// Publish the state of playing and preloading (callback only)
+	void publishPlayback() {
+		Playback p;
+		p.active = preloading || !playing.empty();
+		p.ready = !preloading && !playing.empty();
+		if (p.ready) {
+			p.duration = playing[0]->duration();
+			p.clock = playing[0]->clockState();
+		}
+		playback.store(p);
+	}
+
+	/// Process preloading and commands, returning false if something had to be postponed (a lock was busy)
+	bool callbackUpdate() {
+		std::unique_lock<lockstats::Mutex> l(mutex, std::defer_lock);  // Only needed for changing playing or preloading
 		// Move from preloading to playing, if ready
+		bool done = true;
 		if (preloading && preloading->prepare()) {
-			std::clog << "audio/debug: preload done -> playing " << preloading.get() << std::endl;
-			if (!playing.empty()) playing[0]->fadeRate = -preloading->fadeRate;  // Fade out the old music
-			playing.insert(playing.begin(), std::move(preloading));
+			if (l.try_lock()) {
+				LOG("audio", debug) << "preload done -> playing " << preloading.get() << std::endl;
+				if (!playing.empty()) playing[0]->fadeRate = -preloading->fadeRate;  // Fade out the old music
+				playing.insert(playing.begin(), std::move(preloading));
+			} else done = false;
+		}
+		// Start preloading new music (retried on the next callback if a lock is busy)
+		if (incoming.load()) {
+			if (!l.owns_lock() && !l.try_lock()) done = false;
+			else if (preloading && !reclaim.push(std::move(preloading))) done = false;  // Earlier music still preloading, dispose it
+			else {
+				playback.store(Playback{ true, false });  // Before incoming is cleared, so that readers always see some music
+				preloading.reset(incoming.exchange(nullptr));
+			}
 		}
-		// Process commands
-		for (auto const& cmd: commands) {
-			switch (cmd.type) {
+		// Process commands in order; if one cannot be done now, it and the rest are retried on the next callback
+		while (Command* cmd = commands.front()) {
+			switch (cmd->type) {
+			case Command::SEEK:
+				for (auto& trk: playing) trk->seek(cmd->factor);
+				break;
+			case Command::SEEK_RELATIVE:
+				for (auto& trk: playing) trk->seek(clamp(trk->pos() + cmd->factor, 0.0, trk->duration()));
+				break;
+			case Command::SYNTH:
+				// Start (factor 1) with the synth sent or stop
+				if (synth && !reclaimSynth.push(std::move(synth))) return false;
+				synth.reset(cmd->factor > 0.0 ? synthIncoming.exchange(nullptr) : nullptr);
+				break;
+			case Command::TOGGLE_CENTER_SUPPRESSOR:
+				for (auto& trk: playing) trk->suppressCenterChannel = !trk->suppressCenterChannel;
+				break;
 			case Command::TRACK_FADE:
-				if (!playing.empty()) playing[0]->trackFade(cmd.track, cmd.factor);
+				if (!playing.empty()) playing[0]->trackFade(cmd->track, cmd->factor);
 				break;
 			case Command::TRACK_PITCHBEND:
-				if (!playing.empty()) playing[0]->trackPitchBend(cmd.track, cmd.factor);
+				if (!playing.empty()) playing[0]->trackPitchBend(cmd->track, cmd->factor);
 				break;
-			case Command::SAMPLE_RESET:
-				auto it = samples.find(cmd.track);
-				if (it != samples.end())
-					it->second->reset();
+			case Command::SAMPLE_PLAY:
+				std::unique_lock<lockstats::Mutex> ls(samples_mutex, std::try_to_lock);
+				if (!ls.owns_lock()) return false;
+				auto it = samples.find(cmd->track);
+				if (it != samples.end()) startVoice(*it->second);
 				break;
 			}
+			commands.pop();
 		}
-		commands.clear();
+		return done;
+	}
+
+	/// Play a sample on a free voice, or else on the one that has played longest (must hold samples_mutex)
+	void startVoice(SampleData const& data) {
+		SampleVoice* voice = &voices[0];
+		for (auto& v: voices) {
+			if (!v.data) { voice = &v; break; }
+			if (v.pos > voice->pos) voice = &v;
+		}
+		voice->data = &data;
+		voice->pos = 0;
+	}
+
+	/// Stop the voices playing a sample, before it is deleted (must hold samples_mutex)
+	void stopVoices(SampleData const* data) {
+		for (auto& v: voices) if (v.data == data) v.data = nullptr;
+	}
+
+	/// Mix in microphones (if pass-through is enabled)
+	void mixPassThrough(float* begin, float* end, double rate) {
+		static ConfigItem& passThrough = config["audio/pass-through"];
+		static ConfigItem& passThroughRatio = config["audio/pass-through_ratio"];
+		if (mics[0].load() && passThrough.b()) {
+			// Decrease music volume
+			float amp = 1.0f / passThroughRatio.f();
+			if (amp != 1.0f) for (auto& s: boost::make_iterator_range(begin, end)) s *= amp;
+			// Do the mixing
+			for (auto& m: mics) if (Analyzer* a = m.load()) a->output(begin, end, rate);
+		}
+	}
+
+	/// Pass the mix to the other output devices
+	void feedFollowers(float const* begin, float const* end, double rate);
+
+	/// Copy the mix to the recording, if any (callback only)
+	void feedCapture(float const* begin, float const* end) {
+		capturing = true;
+		if (Capture* c = capture.load()) c->addAudio(begin, end);
+		capturing = false;
 	}
 
-	void callback(float* begin, float* end, double rate) {
-		callbackUpdate();
+	/// Mix the output, returning the number of updates postponed because a lock was busy
+	unsigned callback(float* begin, float* end, double rate) {
+		// Read the pause state first, so that commands sent before unpausing (e.g. seeks) are processed before playback resumes
+		const bool pause = paused;
+		unsigned skipped = callbackUpdate() ? 0 : 1;
 		std::fill(begin, end, 0.0f);
-		if (paused) return;
+		if (pause) {
+			publishPlayback();
+			feedCapture(begin, end);
+			feedFollowers(begin, end, rate);
+			return skipped;
+		}
 		// Mix in from the streams currently playing
 		auto arrayEnd = playing.end();
 		for (auto i = playing.begin(); i != arrayEnd;) {
-			bool keep = (*i->get())(begin, end);  // Do the actual mixing
-			std::unique_lock<std::mutex> l(mutex, std::defer_lock);
-			if (!keep && l.try_lock()) {
-				// Dispose streams no longer needed by moving them to another container (that will be cleared by another thread).
-				disposing.push_back(std::move(*i));
+			bool keep = (*i->get())(begin, end, delay);  // Do the actual mixing
+			std::unique_lock<lockstats::Mutex> l(mutex, std::defer_lock);
+			if (!keep && l.try_lock() && reclaim.push(std::move(*i))) {
+				// Dispose streams no longer needed by moving them to the reclaimer thread
 				i = playing.erase(i);
 				arrayEnd = playing.end();
 			}
-			else { ++i; }
-		}
-		// Mix in microphones (if pass-through is enabled)
-		if (mics.size() > 0 && config["audio/pass-through"].b()) {
-			// Decrease music volume
-			float amp = 1.0f / config["audio/pass-through_ratio"].f();
-			if (amp != 1.0f) for (auto& s: boost::make_iterator_range(begin, end)) s *= amp;
-			// Do the mixing
-			for (auto& m: mics) if (m) m->output(begin, end, rate);
+			else { skipped += !keep; ++i; }
 		}
+		publishPlayback();
+		if (!monitored) mixPassThrough(begin, end, rate);  // Otherwise the monitor device plays the mics
 		// Mix in the samples currently playing
 		{
 			// samples should not be created/destroyed on the fly
-			std::unique_lock<std::mutex> l(samples_mutex, std::defer_lock);
+			std::unique_lock<lockstats::Mutex> l(samples_mutex, std::defer_lock);
 			if(l.try_lock()) {
-				for(auto it = samples.begin() ; it != samples.end() ; ++it) {
-					(*it->second)(begin, end);
+				static ConfigItem& failVolume = config["audio/fail_volume"];
+				const float volume = static_cast<float>(failVolume.i())/100.0;
+				for (auto& v: voices) {
+					if (!v.data) continue;
+					const std::size_t n = std::min<std::size_t>(end - begin, v.data->samples.size() - v.pos);
+					da::mix_f32(begin, v.data->samples.data() + v.pos, n, volume);
+					v.pos += n;
+					if (v.pos == v.data->samples.size()) v.data = nullptr;
 				}
-			}
+			} else ++skipped;
 		}
 		// Mix synth if available (should be done at the end)
-		{
-			std::unique_lock<std::mutex> l(synth_mutex, std::defer_lock);
-			if(l.try_lock() && synth.get() && !playing.empty()) {
-				(*synth.get())(begin, end, playing[0]->pos());
+		if (synth && !playing.empty()) (*synth)(begin, end, playing[0]->pos());
+		feedCapture(begin, end);
+		feedFollowers(begin, end, rate);
+		return skipped;
+	}
+};
+
+/**
+* Mixes the output of a device ahead of its callback, in a high priority thread, into a wait-free ring that
+* the callback only copies from. The lookahead starts at two callback buffers, doubles whenever the callback
+* finds the ring short and is lowered again by one buffer after ten seconds without underruns.
+* The callback cannot notify, so the thread polls at a fraction of the callback period.
+**/
+class MixAhead {
+  public:
+	MixAhead(Output& output, double rate, std::atomic<unsigned>& skipped):
+	  m_output(output), m_rate(rate), m_skipped(skipped),
+	  m_maxFrames(rate * 0.1), m_target(MIX_AHEAD_MIN_FRAMES), m_period(256)
+	{
+		std::size_t size = 1;
+		while (size < 4 * m_maxFrames) size *= 2;  // Stereo samples, room for the maximum lookahead and a block
+		m_ring.assign(size, 0.0f);
+		m_thread = std::thread(&MixAhead::run, this);
+	}
+	~MixAhead() {
+		m_quit = true;
+		m_thread.join();
+	}
+	/// Copy frames of mixed output to outbuf (callback only), returning the number of frames that were missing
+	unsigned long read(float* outbuf, unsigned long frames) {
+		const std::size_t mask = m_ring.size() - 1;
+		const std::size_t r = m_read.load(std::memory_order_relaxed);
+		const std::size_t available = m_write.load(std::memory_order_acquire) - r;
+		const std::size_t n = std::min<std::size_t>(available, 2 * frames);
+		const std::size_t first = std::min(n, m_ring.size() - (r & mask));
+		std::copy_n(&m_ring[r & mask], first, outbuf);
+		std::copy_n(&m_ring[0], n - first, outbuf + first);
+		std::fill(outbuf + n, outbuf + 2 * frames, 0.0f);
+		m_read.store(r + n, std::memory_order_release);
+		// Adapt the lookahead to the buffer size and to how well the thread keeps up
+		m_period = frames;
+		unsigned long target = m_target.load(std::memory_order_relaxed);
+		const unsigned long minimum = std::min(std::max(MIX_AHEAD_MIN_FRAMES, 2 * frames), m_maxFrames);
+		if (n < 2 * frames) {
+			target = std::min(2 * std::max(target, minimum), m_maxFrames);
+			m_goodFrames = 0;
+		} else if ((m_goodFrames += frames) > 10 * m_rate && target > minimum) {
+			target = std::max(target - frames, minimum);
+			m_goodFrames = 0;
+		} else target = std::max(target, minimum);
+		m_target.store(target, std::memory_order_relaxed);
+		return frames - n / 2;
+	}
+  private:
+	void run() {
+		threads::enter(threads::Class::audio, "audio mixer");
+		std::vector<float> block(2 * MIX_AHEAD_BLOCK);
+		const std::size_t mask = m_ring.size() - 1;
+		while (!m_quit) {
+			const std::size_t w = m_write.load(std::memory_order_relaxed);
+			const std::size_t fill = (w - m_read.load(std::memory_order_acquire)) / 2;
+			const unsigned long target = m_target.load(std::memory_order_relaxed);
+			if (fill >= target) {
+				// Wait for the callback to consume about a quarter buffer
+				std::this_thread::sleep_for(std::chrono::duration<double>(std::max(0.25 * m_period / m_rate, 0.0005)));
+				continue;
 			}
+			const std::size_t frames = std::min<std::size_t>(target - fill, MIX_AHEAD_BLOCK);
+			trace::Scope scope("audio mix ahead");
+			m_output.delay = 2 * fill;  // Played before this block, which the clock must account for
+			m_skipped += m_output.callback(block.data(), block.data() + 2 * frames, m_rate);
+			const std::size_t first = std::min(2 * frames, m_ring.size() - (w & mask));
+			std::copy_n(block.data(), first, &m_ring[w & mask]);
+			std::copy_n(block.data() + first, 2 * frames - first, &m_ring[0]);
+			m_write.store(w + 2 * frames, std::memory_order_release);
 		}
 	}
+	Output& m_output;
+	const double m_rate;
+	std::atomic<unsigned>& m_skipped;
+	const unsigned long m_maxFrames;  ///< Lookahead upper limit (100 ms)
+	std::vector<float> m_ring;  ///< Interleaved stereo samples, a power of two
+	std::atomic<std::size_t> m_read{ 0 }, m_write{ 0 };  ///< Samples consumed by the callback and mixed by the thread
+	std::atomic<unsigned long> m_target;  ///< Lookahead in frames, set by the callback
+	std::atomic<unsigned long> m_period;  ///< Frames of the latest callback
+	double m_goodFrames = 0.0;  ///< Frames played since the latest underrun or lookahead decrease (callback only)
+	std::atomic<bool> m_quit{ false };
+	std::thread m_thread;
 };
 
+/**
+* Plays the mix of the main output on another output device, whose clock runs at its own pace. The main output
+* pushes each mixed buffer into a wait-free ring and the device callback reads it resampled by a skew (as in
+* AudioClock), nudged each callback towards keeping the ring at its target fill, so that the two clocks drifting
+* apart neither empties nor overflows the ring. A monitor also plays the mic pass-through (for stage headphones),
+* which the main output then leaves out.
+**/
+class OutputFollower {
+  public:
+	OutputFollower(Output& output, bool monitor): m_output(output), m_monitor(monitor), m_ring(2 * FOLLOWER_RING_FRAMES) {}
+	~OutputFollower() {
+		for (auto& f: m_output.followers) {
+			OutputFollower* self = this;
+			f.compare_exchange_strong(self, nullptr);
+		}
+	}
+	bool monitor() const { return m_monitor; }
+	/// Add a mixed buffer (main output only); dropped if the device has stopped reading
+	void push(float const* begin, float const* end, double rate) {
+		const std::size_t frames = (end - begin) / 2;
+		const std::size_t w = m_write.load(std::memory_order_relaxed);
+		if (w + frames - m_read.load(std::memory_order_acquire) > FOLLOWER_RING_FRAMES) return;
+		for (std::size_t i = 0; i < frames; ++i) {
+			const std::size_t k = 2 * ((w + i) & (FOLLOWER_RING_FRAMES - 1));
+			m_ring[k] = begin[2 * i];
+			m_ring[k + 1] = begin[2 * i + 1];
+		}
+		m_rate = rate;
+		m_pushFrames = frames;
+		m_write.store(w + frames, std::memory_order_release);
+	}
+	/// Fill the device buffer (its callback only), returning false on an underrun
+	bool callback(float* begin, float* end, double rate) {
+		const std::size_t frames = (end - begin) / 2;
+		const double step = m_rate.load() / rate * (1.0 + m_skew);
+		const double target = 2.0 * (m_pushFrames.load() + frames * step) + 4.0;  // Fill that absorbs the jitter of both callbacks
+		const std::size_t w = m_write.load(std::memory_order_acquire);
+		std::size_t r = m_read.load(std::memory_order_relaxed);
+		const std::size_t available = w - r;
+		const double advance = m_frac + frames * step;
+		bool ok = true;
+		if (m_priming ? available < target : available < std::size_t(advance) + 2) {
+			// Wait for the ring to fill up to the target again
+			std::fill(begin, end, 0.0f);
+			m_priming = true;
+			ok = false;
+		} else {
+			m_priming = false;
+			const std::size_t mask = FOLLOWER_RING_FRAMES - 1;
+			for (std::size_t i = 0; i < frames; ++i) {
+				const double pos = m_frac + i * step;
+				const std::size_t k = pos;
+				const float f = pos - k;
+				float const* a = &m_ring[2 * ((r + k) & mask)];
+				float const* b = &m_ring[2 * ((r + k + 1) & mask)];
+				begin[2 * i] = a[0] + f * (b[0] - a[0]);
+				begin[2 * i + 1] = a[1] + f * (b[1] - a[1]);
+			}
+			const std::size_t consumed = advance;
+			m_frac = advance - consumed;
+			r += consumed;
+			const std::size_t fill = w - r;
+			if (fill > 4 * target) {
+				// Far behind (e.g. the device was stalled), skip ahead instead of catching up slowly
+				r = w - std::size_t(target);
+				m_skew = 0.0;
+			} else {
+				constexpr double fudgeFactor = 0.000001;  // Adjustment ratio per callback
+				m_skew += (fill > target ? 1.0 : -1.0) * fudgeFactor;
+				m_skew = clamp(m_skew, -0.01, 0.01);
+			}
+			m_read.store(r, std::memory_order_release);
+		}
+		if (m_monitor) m_output.mixPassThrough(begin, end, rate);
+		return ok;
+	}
+  private:
+	Output& m_output;
+	const bool m_monitor;
+	std::vector<float> m_ring;  ///< Interleaved stereo frames
+	std::atomic<std::size_t> m_read{ 0 }, m_write{ 0 };  ///< Frames read by the device and pushed by the main output
+	std::atomic<double> m_rate{ 48000.0 };  ///< Sample rate of the main output
+	std::atomic<std::size_t> m_pushFrames{ 0 };  ///< Size of the latest push
+	// Callback only
+	double m_frac = 0.0;  ///< Read position after m_read, in frames
+	double m_skew = 0.0;  ///< Relative speed correction
+	bool m_priming = true;
+};
+
+void Output::feedFollowers(float const* begin, float const* end, double rate) {
+	feeding = true;
+	for (auto& f: followers) if (OutputFollower* follower = f.load()) follower->push(begin, end, rate);
+	feeding = false;
+}
 
 Device::Device(unsigned int in, unsigned int out, double rate, unsigned int dev):
   in(in), out(out), rate(rate), dev(dev),
@@ -414,6 +727,41 @@ Device::Device(unsigned int in, unsigned int out, double rate, unsigned int dev)
   outptr()
 {}
 
+Device::~Device() = default;
+
+void Device::startMixAhead() {
+	if (outptr && !m_mixAhead) m_mixAhead = std::make_unique<MixAhead>(*outptr, rate, m_skipped);
+}
+
+void Device::startFollowing(Output& output, bool monitor) {
+	if (outptr || m_follower) return;
+	if (monitor && output.monitored) {
+		std::clog << "audio/warning: Only one monitor output is supported, playing the main mix instead." << std::endl;
+		monitor = false;
+	}
+	m_follower = std::make_unique<OutputFollower>(output, monitor);
+	for (auto& f: output.followers) {
+		OutputFollower* expected = nullptr;
+		if (!f.compare_exchange_strong(expected, m_follower.get())) continue;
+		if (monitor) output.monitored = true;
+		return;
+	}
+	m_follower.reset();
+	throw std::runtime_error("Too many output devices");
+}
+
+void Device::stopFollowing(Output& output) {
+	if (!m_follower) return;
+	if (m_follower->monitor()) output.monitored = false;
+	for (auto& f: output.followers) {
+		OutputFollower* expected = m_follower.get();
+		f.compare_exchange_strong(expected, nullptr);
+	}
+	// Wait for a callback that may still be pushing to it (both flags are sequentially consistent)
+	while (output.feeding) std::this_thread::yield();
+	m_follower.reset();
+}
+
 void Device::start() {
 	PaError err = Pa_StartStream(stream);
 	if (err != paNoError) throw std::runtime_error(std::string("Pa_StartStream: ") + Pa_GetErrorText(err));
@@ -424,119 +772,333 @@ void Device::stop() {
 	if (err != paNoError) throw std::runtime_error(std::string("Pa_StopStream: ") + Pa_GetErrorText(err));
 }
 
-int Device::operator()(float const* inbuf, float* outbuf, unsigned long frames) try {
+int Device::operator()(float const* inbuf, float* outbuf, unsigned long frames, PaStreamCallbackFlags flags) try {
+	static thread_local bool named = (trace::threadName("audio"), true);  // Once, as naming takes a lock
+	(void)named;
+	trace::Scope scope("audio callback");
+	const Time begin = Clock::now();
+	// After the first call, which initializes the static locals on the way
+	static ConfigItem& assertNoAlloc = config["audio/assert_no_alloc"];
+	const std::uint64_t allocations = alloctrack::allocations();
+	alloctrack::NoAlloc noAlloc("the audio callback", assertNoAlloc.b() && m_callbacks > 0);
+	if (flags & (paInputUnderflow | paInputOverflow)) ++m_inputXruns;
+	if (flags & (paOutputUnderflow | paOutputOverflow)) ++m_outputXruns;
 	for (std::size_t i = 0; i < mics.size(); ++i) {
 		if (!mics[i]) continue;  // No analyzer? -> Channel not used
 		da::sample_const_iterator it = da::sample_const_iterator(inbuf + i, in);
 		mics[i]->input(it, it + frames);
 	}
-	if (outptr) outptr->callback(outbuf, outbuf + 2 * frames, rate);
+	if (m_mixAhead) { if (m_mixAhead->read(outbuf, frames)) ++m_underruns; }
+	else if (outptr) m_skipped += outptr->callback(outbuf, outbuf + 2 * frames, rate);
+	else if (m_follower && !m_follower->callback(outbuf, outbuf + 2 * frames, rate)) ++m_underruns;
+	// Time spent versus the time that the buffer lasts
+	const double load = Seconds(Clock::now() - begin).count() * rate / frames;
+	const std::uint32_t ppm = std::min(load, 1000.0) * 1e6;
+	++m_callbacks;
+	++m_histogram[std::min<unsigned>(load * 4.0, DeviceStats::BUCKETS - 1)];
+	m_frames = frames;
+	m_loadSum += ppm;
+	if (ppm > m_loadMax.load(std::memory_order_relaxed)) m_loadMax = ppm;
+	m_allocations += alloctrack::allocations() - allocations;
 	return paContinue;
 } catch (std::exception& e) {
 	std::cerr << "Exception in audio callback: " << e.what() << std::endl;
 	return paAbort;
 }
 
+DeviceStats Device::takeStats() {
+	DeviceStats s;
+	s.callbacks = m_callbacks.exchange(0);
+	for (unsigned i = 0; i < DeviceStats::BUCKETS; ++i) s.histogram[i] = m_histogram[i].exchange(0);
+	s.period = m_frames / rate;
+	const std::uint64_t loadSum = m_loadSum.exchange(0);
+	if (s.callbacks) s.avgLoad = 1e-6 * loadSum / s.callbacks;
+	s.maxLoad = 1e-6 * m_loadMax.exchange(0);
+	s.inputXruns = m_inputXruns.exchange(0);
+	s.outputXruns = m_outputXruns.exchange(0);
+	s.skipped = m_skipped.exchange(0);
+	s.underruns = m_underruns.exchange(0);
+	s.allocations = m_allocations.exchange(0);
+	return s;
+}
+
+void DeviceStats::add(DeviceStats const& other) {
+	callbacks += other.callbacks;
+	for (unsigned i = 0; i < BUCKETS; ++i) histogram[i] += other.histogram[i];
+	period = other.period;
+	avgLoad = other.avgLoad;
+	maxLoad = other.maxLoad;
+	inputXruns += other.inputXruns;
+	outputXruns += other.outputXruns;
+	skipped += other.skipped;
+	underruns += other.underruns;
+	allocations += other.allocations;
+}
+
+std::string DeviceStats::summary() const {
+	std::ostringstream oss;
+	oss << std::fixed << std::setprecision(1) << period * 1000.0 << " ms buffers, " << callbacks << " callbacks, load "
+	  << std::setprecision(0) << avgLoad * 100.0 << " % (max " << maxLoad * 100.0 << " %), histogram";
+	for (unsigned i = 0; i < BUCKETS; ++i) oss << (i ? "/" : " ") << histogram[i];
+	oss << ", xruns in " << inputXruns << " out " << outputXruns << ", skipped " << skipped;
+	if (underruns) oss << ", mix-ahead underruns " << underruns;
+	if (alloctrack::enabled()) oss << ", allocations " << allocations;
+	return oss.str();
+}
+
+namespace {
+	/// A device cannot be opened without a full restart (e.g. a mic was reassigned with another analysis)
+	struct RestartRequired {};
+}
+
 struct Audio::Impl {
 	Output output;
 	portaudio::Init init;
-	std::deque<Analyzer> analyzers;
-	std::deque<Device> devices;
-	bool playback = false;
 	std::string selectedBackend = Audio::backendConfig().getValue();
+	/// The devices of selectedBackend, enumerated in the background as some backends take seconds to probe
+	std::shared_future<portaudio::AudioDevices> available = std::async(std::launch::async, [backend = selectedBackend] {
+		threads::enter(threads::Class::background, "audio devices");
+		return portaudio::AudioDevices(PaHostApiTypeId(PaHostApiNameToHostApiTypeId(backend)));
+	}).share();
+	std::future<void> dump = std::async(std::launch::async, [] {
+		threads::enter(threads::Class::background, "audio backends");
+		std::clog << portaudio::AudioBackends().dump() << std::flush; // Dump PortAudio backends and devices to log.
+	});
+	std::deque<Analyzer> analyzers;  ///< Only added to, as the players refer to them (those of removed devices are detached)
+	std::vector<std::vector<Analyzer*>> batches;  ///< Analyzers of each device, in groups of ANALYZER_BATCH
+	std::list<Device> devices;  ///< A list, so that one can be closed while the others keep running
+	std::list<NetworkMics> netMics;  ///< After analyzers, so that they stop feeding them first
+	bool playback = false;
 	Impl() {
 		populateBackends(portaudio::AudioBackends().getBackends());
-		std::clog << portaudio::AudioBackends().dump() << std::flush; // Dump PortAudio backends and devices to log.
 		// Parse audio devices from config
-		ConfigItem::StringList devs = config["audio/devices"].sl();
-		for (ConfigItem::StringList::const_iterator it = devs.begin(), end = devs.end(); it != end; ++it) {
-			try {
-				struct Params {
-					unsigned out, in;
-					unsigned int rate;
-					std::string dev;
-					std::vector<std::string> mics;
-				} params = Params();
-				params.out = 0;
-				params.in = 0;
-				params.rate = 48000;
-				// Break into tokens:
-				for (auto& kv: parseKeyValuePairs(*it)) {
-					// Handle keys
-					std::string key = kv.first;
-					std::istringstream iss(kv.second);
-					if (key == "out") iss >> params.out;
-					else if (key == "in") iss >> params.in;
-					else if (key == "rate") iss >> params.rate;
-					else if (key == "dev") std::getline(iss, params.dev);
-					else if (key == "mics") {
-						// Parse a comma-separated list of mics
-						for (std::string mic; std::getline(iss, mic, ','); params.mics.push_back(mic)) {
-							++params.in;
-						}
+		for (auto const& spec: config["audio/devices"].sl()) addDevice(spec);
+		LatencyCalibration::apply(devices);
+		// Devices added or removed later change the statistics under statsMutex
+		auto perDevice = [this](std::function<double (DeviceStats const&)> value, bool total) {
+			return [this, value, total] {
+				std::lock_guard<std::mutex> l(statsMutex);
+				updateStats();
+				metrics::Samples samples;
+				auto const& stats = total ? totalStats : latestStats;
+				for (std::size_t i = 0; i < stats.size(); ++i) samples.push_back(metrics::Sample{ metrics::label("device", std::to_string(i)), value(stats[i]) });
+				return samples;
+			};
+		};
+		exported.push_back(std::make_unique<metrics::Family>("performous_audio_callback_load", "Time spent in the audio callback as a fraction of the buffer period (average over the latest second)", "gauge",
+		  perDevice([](DeviceStats const& s) { return s.avgLoad; }, false)));
+		exported.push_back(std::make_unique<metrics::Family>("performous_audio_callback_max_load", "Longest audio callback of the latest second as a fraction of the buffer period", "gauge",
+		  perDevice([](DeviceStats const& s) { return s.maxLoad; }, false)));
+		exported.push_back(std::make_unique<metrics::Family>("performous_audio_callbacks_total", "Audio callbacks", "counter",
+		  perDevice([](DeviceStats const& s) { return s.callbacks; }, true)));
+		exported.push_back(std::make_unique<metrics::Family>("performous_audio_input_xruns_total", "Input overflows reported by PortAudio", "counter",
+		  perDevice([](DeviceStats const& s) { return s.inputXruns; }, true)));
+		exported.push_back(std::make_unique<metrics::Family>("performous_audio_output_xruns_total", "Output underflows reported by PortAudio", "counter",
+		  perDevice([](DeviceStats const& s) { return s.outputXruns; }, true)));
+		exported.push_back(std::make_unique<metrics::Family>("performous_audio_skipped_updates_total", "Audio callback updates postponed because a lock was busy", "counter",
+		  perDevice([](DeviceStats const& s) { return s.skipped; }, true)));
+		exported.push_back(std::make_unique<metrics::Family>("performous_audio_mix_ahead_underruns_total", "Callbacks that found less output mixed ahead than needed (audio/mixer_thread)", "counter",
+		  perDevice([](DeviceStats const& s) { return s.underruns; }, true)));
+	}
+	/// Open the device of an audio/devices line and start it (errors other than RestartRequired are logged)
+	void addDevice(std::string const& spec) {
+		try {
+			struct Params {
+				unsigned out, in;
+				unsigned int rate;
+				std::string dev;
+				std::vector<std::string> mics;
+				std::size_t fft, step;  ///< Analyzer profile of the mics
+				std::string pitch;  ///< Pitch detector of the mics
+				bool monitor;  ///< Play the mix with mic pass-through (e.g. on stage headphones) instead of being the main output
+				unsigned short net;  ///< UDP port of network mics (instead of a sound card)
+				unsigned jitter;  ///< Jitter buffer of network mics, in packets
+				double latency;  ///< Of network mics, in seconds
+			} params = Params();
+			params.out = 0;
+			params.in = 0;
+			params.rate = 48000;
+			params.fft = FFT_N;
+			params.step = 200;
+			params.pitch = "fft";
+			params.jitter = 3;
+			params.latency = 0.1;
+			// Break into tokens:
+			for (auto& kv: parseKeyValuePairs(spec)) {
+				// Handle keys
+				std::string key = kv.first;
+				std::istringstream iss(kv.second);
+				if (key == "out") iss >> params.out;
+				else if (key == "in") iss >> params.in;
+				else if (key == "rate") iss >> params.rate;
+				else if (key == "fft") iss >> params.fft;
+				else if (key == "step") iss >> params.step;
+				else if (key == "pitch") iss >> params.pitch;
+				else if (key == "monitor") iss >> params.monitor;
+				else if (key == "net") iss >> params.net;
+				else if (key == "jitter") iss >> params.jitter;
+				else if (key == "latency") iss >> params.latency;
+				else if (key == "dev") std::getline(iss, params.dev);
+				else if (key == "mics") {
+					// Parse a comma-separated list of mics
+					for (std::string mic; std::getline(iss, mic, ','); params.mics.push_back(mic)) {
+						++params.in;
 					}
-					else throw std::runtime_error("Unknown device parameter " + key);
-					if (!iss.eof()) throw std::runtime_error("Syntax error parsing device parameter " + key);
 				}
-				if (params.mics.size() < params.in) { params.mics.resize(params.in); }
-				portaudio::AudioDevices ad(PaHostApiTypeId(PaHostApiNameToHostApiTypeId(selectedBackend)));
-					bool wantOutput = (params.in == 0) ? true : false;
-					unsigned num;
-					std::string msg = "audio/info: Device string empty; will look for a device with at least ";
-					if (wantOutput) {
-						msg += std::to_string(params.out) + " output channels.";
-						num = params.out;
-					}
-					else {
-						msg += std::to_string(params.in) + " input channels.";
-						num = params.in;
-					}
-					if (!params.dev.empty()) {
-					std::clog << "audio/debug: Will try to find device matching dev: " << params.dev << std::endl;
-					}
-					else { std::clog << msg << std::endl; }
-					portaudio::DeviceInfo const& info = ad.find(params.dev, wantOutput, num);
-					std::clog << "audio/info: Found: " << info.name << ", in: " << info.in << ", out: " << info.out << std::endl;
-				if (info.in < params.mics.size()) throw std::runtime_error("Device doesn't have enough input channels");
-				if (info.out < params.out) throw std::runtime_error("Device doesn't have enough output channels");
-				// Match found if we got here, construct a device
-				devices.emplace_back(params.in, params.out, params.rate, info.index);
-				Device& d = devices.back();
-				// Assign mics for all channels of the device
-				int assigned_mics = 0;
+				else throw std::runtime_error("Unknown device parameter " + key);
+				if (!iss.eof()) throw std::runtime_error("Syntax error parsing device parameter " + key);
+			}
+			if (params.mics.size() < params.in) { params.mics.resize(params.in); }
+			if (!Analyzer::supportsFFT(params.fft)) throw std::runtime_error("Unsupported fft size (use 512, 1024, 2048 or 4096)");
+			if (params.step == 0 || params.step > params.fft) throw std::runtime_error("The step must be between 1 and the fft size");
+			// Add analyzers for the channels of a device that are used as mics
+			auto assignMics = [&](std::vector<Analyzer*>& mics, double rate, double latency) {
+				int assigned_mics = 0, added = 0;
 				for (unsigned int j = 0; j < params.in; ++j) {
-					if (analyzers.size() >= AUDIO_MAX_ANALYZERS) break; // Too many mics
 					std::string const& m = params.mics[j];
 					if (m.empty()) continue; // Input channel not used
-					// Check that the color is not already taken
-					bool mic_used = false;
-					for (size_t mi = 0; mi < analyzers.size(); ++mi) {
-						if (analyzers[mi].getId() == m) { mic_used = true; break; }
+					// Check that the color is not already taken, reusing the analyzer of a removed device
+					Analyzer* analyzer = nullptr;
+					for (Analyzer& a: analyzers) if (a.getId() == m) { analyzer = &a; break; }
+					if (analyzer && attached(*analyzer)) continue;
+					if (analyzer) {
+						if (analyzer->inputRate() != rate || analyzer->step() != params.step || analyzer->fftSize() != params.fft || analyzer->detector() != params.pitch) throw RestartRequired();
+					} else {
+						if (analyzers.size() >= AUDIO_MAX_ANALYZERS) break; // Too many mics
+						// Add the new analyzer
+						analyzers.emplace_back(rate, m, params.step, params.fft, params.pitch);
+						analyzer = &analyzers.back();
+						output.mics[analyzers.size() - 1] = analyzer;  // For pass-through
+						if (added++ % ANALYZER_BATCH == 0) batches.emplace_back();
+						batches.back().push_back(analyzer);
 					}
-					if (mic_used) continue;
-					// Add the new analyzer
-					analyzers.emplace_back(d.rate, m);
-					d.mics[j] = &analyzers.back();
+					analyzer->setLatency(latency);
+					mics[j] = analyzer;
 					++assigned_mics;
 				}
-				// Assign playback output for the first available stereo output
-				if (!playback && d.out == 2) { d.outptr = &output; playback = true; }
-				std::clog << "audio/info: Using audio device: " << info.desc();
-				if (assigned_mics) std::clog << ", input channels: " << assigned_mics;
-				if (params.out) std::clog << ", output channels: " << params.out;
-				std::clog << std::endl;
-				// Start capture/playback on this device (likely to throw due to audio system errors)
-				// NOTE: When it throws we want to keep the device in devices to avoid calling ~Device
-				// which often would hit the Pa_CloseStream hang bug and terminate the application.
-				d.start();
-			} catch(std::runtime_error& e) {
-				std::clog << "audio/error: Audio device '" << *it << "': " << e.what() << std::endl;
+				return assigned_mics;
+			};
+			if (params.net) {
+				if (params.in == 0) throw std::runtime_error("Network device without mics");
+				if (params.jitter == 0 || params.jitter > 8) throw std::runtime_error("The jitter buffer must be between 1 and 8 packets");
+				netMics.emplace_back(params.in, params.net, params.rate, params.jitter, params.latency);
+				NetworkMics& n = netMics.back();
+				n.spec = spec;
+				const int assigned_mics = assignMics(n.mics, n.rate, params.latency);
+				std::clog << "audio/info: Listening for network mics on UDP port " << n.port << ", input channels: " << assigned_mics << std::endl;
+				n.start();
+				return;
+			}
+			portaudio::AudioDevices const& ad = available.get();
+				bool wantOutput = (params.in == 0) ? true : false;
+				unsigned num;
+				std::string msg = "audio/info: Device string empty; will look for a device with at least ";
+				if (wantOutput) {
+					msg += std::to_string(params.out) + " output channels.";
+					num = params.out;
+				}
+				else {
+					msg += std::to_string(params.in) + " input channels.";
+					num = params.in;
+				}
+				if (!params.dev.empty()) {
+				LOG("audio", debug) << "Will try to find device matching dev: " << params.dev << std::endl;
+				}
+				else { std::clog << msg << std::endl; }
+				portaudio::DeviceInfo const& info = ad.find(params.dev, wantOutput, num);
+				std::clog << "audio/info: Found: " << info.name << ", in: " << info.in << ", out: " << info.out << std::endl;
+			if (info.in < params.mics.size()) throw std::runtime_error("Device doesn't have enough input channels");
+			if (info.out < params.out) throw std::runtime_error("Device doesn't have enough output channels");
+			// Match found if we got here, construct a device
+			std::list<Device> opened;
+			opened.emplace_back(params.in, params.out, params.rate, info.index);
+			Device& d = opened.back();
+			d.spec = spec;
+			{
+				std::lock_guard<std::mutex> l(statsMutex);
+				devices.splice(devices.end(), opened);
 			}
+			// Assign mics for all channels of the device
+			const int assigned_mics = assignMics(d.mics, d.rate, 0.0);
+			// Assign playback output for the first available stereo output
+			if (d.out == 2 && !playback && !params.monitor) {
+				d.outptr = &output;
+				playback = true;
+				if (config["audio/mixer_thread"].b()) d.startMixAhead();
+			}
+			else if (d.out == 2) d.startFollowing(output, params.monitor);  // Further outputs play the same mix
+			std::clog << "audio/info: Using audio device: " << info.desc();
+			if (assigned_mics) std::clog << ", input channels: " << assigned_mics;
+			if (params.out) std::clog << ", output channels: " << params.out;
+			std::clog << std::endl;
+			// Start capture/playback on this device (likely to throw due to audio system errors)
+			// NOTE: When it throws we want to keep the device in devices to avoid calling ~Device
+			// which often would hit the Pa_CloseStream hang bug and terminate the application.
+			d.start();
+		} catch(std::runtime_error& e) {
+			std::clog << "audio/error: Audio device '" << spec << "': " << e.what() << std::endl;
+		}
+	}
+	/// Is the line open (or did it fail only when starting)?
+	bool hasDevice(std::string const& spec) const {
+		for (Device const& d: devices) if (d.spec == spec) return true;
+		for (NetworkMics const& n: netMics) if (n.spec == spec) return true;
+		return false;
+	}
+	/// Does a device feed the analyzer?
+	bool attached(Analyzer const& analyzer) const {
+		for (Device const& d: devices) if (std::count(d.mics.begin(), d.mics.end(), &analyzer)) return true;
+		for (NetworkMics const& n: netMics) if (std::count(n.mics.begin(), n.mics.end(), &analyzer)) return true;
+		return false;
+	}
+	/// Stop and close a device while the others keep running. Its analyzers stay, detached, for the players.
+	std::list<Device>::iterator removeDevice(std::list<Device>::iterator it) {
+		Device& d = *it;
+		std::clog << "audio/info: Closing audio device '" << d.spec << "'" << std::endl;
+		try { d.stop(); } catch (std::exception const& e) { std::clog << "audio/error: " << e.what() << std::endl; }
+		d.stopFollowing(output);
+		if (d.isOutput()) playback = false;
+		std::list<Device> closing;  // Closes the stream on return, without holding statsMutex
+		std::lock_guard<std::mutex> l(statsMutex);
+		const std::size_t index = std::distance(devices.begin(), it);
+		if (index < latestStats.size()) latestStats.erase(latestStats.begin() + index);
+		if (index < totalStats.size()) totalStats.erase(totalStats.begin() + index);
+		closing.splice(closing.end(), devices, it++);
+		return it;
+	}
+	/// Close the devices whose lines are no longer configured and open the new lines
+	void updateDevices(ConfigItem::StringList const& specs) {
+		auto configured = [&specs](std::string const& spec) { return std::find(specs.begin(), specs.end(), spec) != specs.end(); };
+		for (auto it = devices.begin(); it != devices.end();) {
+			if (configured(it->spec)) ++it; else it = removeDevice(it);
+		}
+		for (auto it = netMics.begin(); it != netMics.end();) {
+			if (configured(it->spec)) { ++it; continue; }
+			std::clog << "audio/info: Closing network mics on UDP port " << it->port << std::endl;
+			it = netMics.erase(it);
+		}
+		for (auto const& spec: specs) if (!hasDevice(spec)) addDevice(spec);
+		LatencyCalibration::apply(devices);
+	}
+	std::mutex statsMutex;
+	std::vector<DeviceStats> latestStats;  ///< Of the latest second, guarded by statsMutex
+	std::vector<DeviceStats> totalStats;  ///< Since the start, guarded by statsMutex
+	Time statsTime;
+	/// Take the statistics of the devices unless that was done less than a second ago (statsMutex must be held)
+	void updateStats() {
+		const Time now = Clock::now();
+		if (!latestStats.empty() && now - statsTime < 1s) return;
+		statsTime = now;
+		latestStats.resize(devices.size());
+		totalStats.resize(devices.size());
+		std::size_t i = 0;
+		for (Device& d: devices) {
+			latestStats[i] = d.takeStats();
+			totalStats[i].add(latestStats[i]);
+			++i;
 		}
-		// Assign mic buffers to the output for pass-through
-		for (size_t i = 0; i < analyzers.size(); ++i)
-			output.mics.push_back(&analyzers[i]);
 	}
+	std::vector<std::unique_ptr<metrics::Family>> exported;  ///< Last, so that it goes away first
 	~Impl() {
 		// stop all audio streams befor destoying the object.
 		// else portaudio will keep sending data to those destroyed
@@ -545,10 +1107,7 @@ struct Audio::Impl {
 	}
 };
 
-Audio::Audio(): self(std::make_unique<Impl>()) {
-	aubio_tempo_set_silence(Audio::aubioTempo.get(), -50.0);
-	aubio_tempo_set_threshold(Audio::aubioTempo.get(), 0.4);
-}
+Audio::Audio(): self(std::make_unique<Impl>()) {}
 Audio::~Audio() { close(); }
 
 ConfigItem& Audio::backendConfig() {
@@ -558,6 +1117,20 @@ ConfigItem& Audio::backendConfig() {
 
 void Audio::restart() { close(); self = std::make_unique<Impl>(); }
 
+void Audio::updateDevices() {
+	if (self && self->selectedBackend == backendConfig().getValue()) {
+		try {
+			self->updateDevices(config["audio/devices"].sl());
+			return;
+		} catch (RestartRequired const&) {
+			std::clog << "audio/info: Restarting audio to change the analysis of a mic." << std::endl;
+		}
+	}
+	restart();
+}
+
+portaudio::DeviceInfos const& Audio::availableDevices() const { return self->available.get().devices; }
+
 void Audio::close() {
 	// Only wait a limited time for closing of audio devices because it often hangs (on Linux)
 	auto audiokiller = std::async(std::launch::async, [this]{ self.reset(); });
@@ -570,44 +1143,59 @@ bool Audio::isOpen() const {
 }
 
 bool Audio::hasPlayback() const {
-	for (size_t i = 0; i < self->devices.size(); ++i)
-		if (self->devices[i].isOutput()) return true;
+	for (auto const& d: self->devices) if (d.isOutput()) return true;
 	return false;
 }
 
 void Audio::loadSample(std::string const& streamId, fs::path const& filename) {
-	std::lock_guard<std::mutex> l(self->output.samples_mutex);
-	self->output.samples.emplace(streamId, std::unique_ptr<Sample>(new Sample(filename, getSR())));
+	Output& o = self->output;
+	std::shared_ptr<SampleData const> data;
+	{
+		// Share the data of a file loaded earlier under another name
+		std::lock_guard<lockstats::Mutex> l(o.samples_mutex);
+		for (auto const& s: o.samples) if (s.second->file == filename) data = s.second;
+	}
+	if (!data) data = std::make_shared<SampleData const>(filename, getSR());  // Decode without holding the lock
+	std::lock_guard<lockstats::Mutex> l(o.samples_mutex);
+	auto& slot = o.samples[streamId];
+	if (slot && slot.use_count() == 1) o.stopVoices(slot.get());
+	slot = std::move(data);
 }
 
 void Audio::playSample(std::string const& streamId) {
-	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	Command cmd = { Command::SAMPLE_RESET, streamId, 0.0 };
-	o.commands.push_back(cmd);
+	self->output.send({ Command::SAMPLE_PLAY, streamId, 0.0 });
 }
 
 void Audio::unloadSample(std::string const& streamId) {
-	std::lock_guard<std::mutex> l(self->output.samples_mutex);
-	self->output.samples.erase(streamId);
+	Output& o = self->output;
+	std::lock_guard<lockstats::Mutex> l(o.samples_mutex);
+	auto it = o.samples.find(streamId);
+	if (it == o.samples.end()) return;
+	if (it->second.use_count() == 1) o.stopVoices(it->second.get());  // Not shared with another name
+	o.samples.erase(it);
 }
 
-void Audio::playMusic(Audio::Files const& filenames, bool preview, double fadeTime, double startPos) {
-	Output& o = self->output;
-	auto m = std::make_unique<Music>(filenames, getSR(), preview);
-	m->seek(startPos);
-	m->fadeRate = 1.0 / getSR() / fadeTime;
+void Audio::playMusic(Audio::Files const& filenames, bool preview, double fadeTime, double startPos, double fileOffset) {
+	auto m = openMusic(filenames, preview, fileOffset);
 	// Format debug message
 	std::string logmsg = "audio/debug: playMusic(";
 	for (auto& kv: filenames) logmsg += kv.first + "=" + kv.second.filename().string() + ", ";
 	logmsg += ") -> ";
 	std::clog << logmsg << m.get() << std::endl;
+	playMusic(std::move(m), fadeTime, startPos);
+}
+
+std::unique_ptr<Music> Audio::openMusic(Audio::Files const& filenames, bool preview, double fileOffset) {
+	return std::make_unique<Music>(filenames, getSR(), preview, fileOffset);
+}
+
+void Audio::playMusic(std::unique_ptr<Music> m, double fadeTime, double startPos) {
+	Output& o = self->output;
+	m->seek(startPos);
+	m->fadeRate = 1.0 / getSR() / fadeTime;
 	// Send to audio playback thread
-	std::lock_guard<std::mutex> l(o.mutex);
-	if (o.preloading) std::clog << "audio/debug: earlier music still preloading, disposing " << o.preloading.get() << std::endl;
-	o.preloading = std::move(m);
-	o.disposing.clear();  // Delete disposed streams
-	o.commands.clear();  // Remove old unprocessed commands (they should not apply to the new music)
+	std::unique_ptr<Music> old(o.incoming.exchange(m.release()));
+	if (old) LOG("audio", debug) << "earlier music not yet taken by playback, disposing " << old.get() << std::endl;
 }
 
 void Audio::playMusic(fs::path const& filename, bool preview, double fadeTime, double startPos) {
@@ -618,53 +1206,40 @@ void Audio::playMusic(fs::path const& filename, bool preview, double fadeTime, d
 
 void Audio::stopMusic() {
 	playMusic(Audio::Files(), false, 0.0);
-	{
-		Output& o = self->output;
-		// stop synth when music is stopped
-		std::lock_guard<std::mutex> l(o.synth_mutex);
-		o.synth.reset();
-	}
+	stopSynth();  // stop synth when music is stopped
 }
 
 void Audio::fadeout(double fadeTime) {
 	playMusic(Audio::Files(), false, fadeTime);
-	{
-		Output& o = self->output;
-		// stop synth when music is stopped
-		std::lock_guard<std::mutex> l(o.synth_mutex);
-		o.synth.reset();
-	}
+	stopSynth();  // stop synth when music is stopped
 }
 
 double Audio::getPosition() const {
 	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	return (o.playing.empty() || o.preloading.get()) ? getNaN() : o.playing[0]->pos();
+	const Output::Playback p = o.playback.load();
+	return (!p.ready || o.incoming.load()) ? getNaN() : AudioClock::pos(p.clock, Clock::now()).count();
 }
 
 double Audio::getLength() const {
 	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	return (o.playing.empty() || o.preloading.get()) ? getNaN() : o.playing[0]->duration();
+	const Output::Playback p = o.playback.load();
+	return (!p.ready || o.incoming.load()) ? getNaN() : p.duration;
 }
 
 bool Audio::isPlaying() const {
 	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	return o.preloading || !o.playing.empty();
+	// Check incoming first: the callback publishes the music as active before it clears incoming
+	if (o.incoming.load()) return true;
+	return o.playback.load().active;
 }
 
 void Audio::seek(double offset) {
-	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	for (auto& trk: o.playing) trk->seek(clamp(trk->pos() + offset, 0.0, trk->duration()));
+	self->output.send({ Command::SEEK_RELATIVE, std::string(), offset });
 	pause(false);
 }
 
 void Audio::seekPos(double pos) {
-	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	for (auto& trk: o.playing) trk->seek(pos);
+	self->output.send({ Command::SEEK, std::string(), pos });
 	pause(false);
 }
 
@@ -672,33 +1247,55 @@ void Audio::pause(bool state) { self->output.paused = state; }
 bool Audio::isPaused() const { return self->output.paused; }
 
 void Audio::streamFade(std::string track, double fadeLevel) {
-	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	Command cmd = { Command::TRACK_FADE, track, fadeLevel };
-	o.commands.push_back(cmd);
+	self->output.send({ Command::TRACK_FADE, track, fadeLevel });
 }
 
 void Audio::streamBend(std::string track, double pitchFactor) {
-	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	Command cmd = { Command::TRACK_PITCHBEND, track, pitchFactor };
-	o.commands.push_back(cmd);
+	self->output.send({ Command::TRACK_PITCHBEND, track, pitchFactor });
 }
 
 void Audio::toggleSynth(Notes const& notes) {
 	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.synth_mutex);
-	if (o.synth.get()) o.synth.reset();
-	else o.synth = std::make_unique<Synth>(notes, getSR());
+	if (o.synthOn) return stopSynth();
+	o.synthOn = true;
+	delete o.synthIncoming.exchange(new Synth(notes, getSR()));
+	o.send({ Command::SYNTH, std::string(), 1.0 });
 }
 
-void Audio::toggleCenterChannelSuppressor() {
+void Audio::setCapture(Capture* capture) {
 	Output& o = self->output;
-	std::lock_guard<std::mutex> l(o.mutex);
-	for (size_t i = 0; i < o.playing.size(); i++) {
-		o.playing[i]->suppressCenterChannel = !o.playing[i]->suppressCenterChannel;
-	}
+	o.capture = capture;
+	// Wait for a callback that may still be using the previous one (both flags are sequentially consistent)
+	while (o.capturing) std::this_thread::yield();
+}
+
+void Audio::stopSynth() {
+	Output& o = self->output;
+	o.synthOn = false;
+	delete o.synthIncoming.exchange(nullptr);
+	o.send({ Command::SYNTH, std::string(), 0.0 });
+}
+
+void Audio::toggleCenterChannelSuppressor() {
+	self->output.send({ Command::TOGGLE_CENTER_SUPPRESSOR, std::string(), 0.0 });
 }
 
 std::deque<Analyzer>& Audio::analyzers() { return self->analyzers; }
-std::deque<Device>& Audio::devices() { return self->devices; }
+std::vector<std::vector<Analyzer*>> const& Audio::analyzerBatches() const { return self->batches; }
+std::list<Device>& Audio::devices() { return self->devices; }
+
+std::vector<std::string> Audio::statistics() {
+	std::vector<std::string> ret;
+	{
+		std::lock_guard<std::mutex> l(self->statsMutex);
+		self->updateStats();
+		for (std::size_t i = 0; i < self->latestStats.size(); ++i) ret.push_back("Device " + std::to_string(i) + ": " + self->latestStats[i].summary());
+	}
+	std::lock_guard<lockstats::Mutex> l(self->output.mutex);
+	if (self->output.playing.empty()) return ret;
+	AudioClock& clock = self->output.playing[0]->m_clock;
+	std::ostringstream oss;
+	oss << "Clock: skew " << std::showpos << std::fixed << std::setprecision(2) << clock.skew() * 100.0 << std::noshowpos << " %, " << clock.takeSteps() << " steps";
+	ret.push_back(oss.str());
+	return ret;
+}
@@ -4,9 +4,13 @@
 #include "ffmpeg.hh"
 #include "notes.hh"
 #include "pitch.hh"
+#include "libda/pitchshift.hpp"
 #include "libda/portaudio.hpp"
-#include "aubio/aubio.h"
+#include "seqlock.hh"
+#include <atomic>
+#include <cstdint>
 #include <deque>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -16,6 +20,7 @@
 
 const unsigned AUDIO_MAX_ANALYZERS = 11;
 
+class Capture;
 struct Output;
 
 /**
@@ -25,13 +30,19 @@ struct Output;
 * it is late or early. The clock is also stopped if audio output pauses.
 **/
 class AudioClock {
-	mutable std::mutex m_mutex;
-	Time m_baseTime; ///< A reference time (corresponds to m_basePos)
-	Seconds m_basePos = 0.0s; ///< A reference position in song
-	double m_skew = 0.0; ///< The skew ratio applied to system time (since baseTime)
-	std::atomic<Seconds> m_max{ 0.0s }; ///< Maximum output value for the clock (end of the current audio block)
-	/// Get the current position (current time via parameter, no locking)
-	Seconds pos_internal(Time now) const;
+public:
+	struct State {
+		Time baseTime; ///< A reference time (corresponds to basePos)
+		Seconds basePos = 0.0s; ///< A reference position in song
+		double skew = 0.0; ///< The skew ratio applied to system time (since baseTime)
+		Seconds max = 0.0s; ///< Maximum output value for the clock (end of the current audio block)
+	};
+	/// Get the position of a clock state at the time now
+	static Seconds pos(State const& state, Time now);
+private:
+	State m_state; ///< Only accessed by the audio callback (timeSync)
+	SeqLock<State> m_published; ///< m_state for the other threads, read without locking
+	std::atomic<unsigned> m_steps{ 0 }; ///< Times the clock was stepped (instead of skewed) since takeSteps
 public:
 	/**
 	* Called from audio callback to keep the clock synced.
@@ -39,10 +50,38 @@ public:
 	* @param length the duration of the current audio block
 	*/
 	void timeSync(Seconds audioPos, Seconds length);
-	/// Get the current position in seconds
+	/// Get the current position in seconds (from any thread, without locking)
 	Seconds pos() const;
+	/// Get the state as last synced (from any thread, without locking)
+	State state() const { return m_published.load(); }
+	/// Get the skew ratio currently applied (positive when running fast)
+	double skew() const;
+	/// Get and reset the number of steps
+	unsigned takeSteps() { return m_steps.exchange(0); }
+};
+
+/// Callback statistics of a Device since the previous Device::takeStats
+struct DeviceStats {
+	/// Histogram of callback durations as a fraction of the buffer period: under 25 %, 50 %, 75 %, 100 % and over (xrun likely)
+	static const unsigned BUCKETS = 5;
+	unsigned callbacks = 0;
+	unsigned histogram[BUCKETS] = {};
+	double period = 0.0;  ///< Buffer period of the latest callback, in seconds
+	double avgLoad = 0.0;  ///< Average fraction of the buffer period spent in the callback
+	double maxLoad = 0.0;  ///< Largest fraction of the buffer period spent in the callback
+	unsigned inputXruns = 0, outputXruns = 0;  ///< Overflows and underflows reported by PortAudio
+	unsigned skipped = 0;  ///< Updates postponed because a lock was busy (commands, stream disposal, samples)
+	unsigned underruns = 0;  ///< Callbacks that found less output mixed ahead than they needed (audio/mixer_thread or a second output device)
+	unsigned allocations = 0;  ///< Heap allocations in the callbacks (with allocation tracking, see alloctrack.hh)
+	/// One line for the log and the overlay
+	std::string summary() const;
+	/// Add the counts of a later interval (the period and loads become those of other)
+	void add(DeviceStats const& other);
 };
 
+class MixAhead;
+class OutputFollower;
+
 struct Device {
 	// Init
 	const unsigned int in, out;
@@ -51,14 +90,24 @@ struct Device {
 	portaudio::Stream stream;
 	std::vector<Analyzer*> mics;
 	Output* outptr;
+	std::string spec;  ///< The audio/devices line that opened it
 
 	Device(unsigned int in, unsigned int out, double rate, unsigned int dev);
+	~Device();
+	/// Mix the output of outptr in a thread of its own instead of the callback (call before start)
+	void startMixAhead();
+	/// Play the mix of output resampled to this device's clock, with the mic pass-through if monitor (call before start)
+	void startFollowing(Output& output, bool monitor);
+	/// Stop playing the mix of output (call after stop, before destroying it while the main output keeps playing)
+	void stopFollowing(Output& output);
 	/// Start
 	void start();
 	/// Stop
 	void stop();
 	/// Callback
-	int operator()(float const* input, float* output, unsigned long frames);
+	int operator()(float const* input, float* output, unsigned long frames, PaStreamCallbackFlags flags);
+	/// Get and reset the callback statistics (any thread)
+	DeviceStats takeStats();
 	/// Returns true if this device is opened for output
 	bool isOutput() const { return outptr != nullptr; }
 	/// Returns true if this device is assigned to the named channel (mic color or "OUT")
@@ -67,28 +116,43 @@ struct Device {
 		for (auto const& m: mics) if (m && m->getId() == name) return true;
 		return false;
 	}
+  private:
+	// Statistics, written by the callback without locking
+	std::atomic<unsigned> m_callbacks{ 0 };
+	std::atomic<unsigned> m_histogram[DeviceStats::BUCKETS] = {};
+	std::atomic<unsigned long> m_frames{ 0 };  ///< Buffer size of the latest callback
+	std::atomic<std::uint64_t> m_loadSum{ 0 };  ///< Sum of callback loads, in millionths of the period
+	std::atomic<std::uint32_t> m_loadMax{ 0 };
+	std::atomic<unsigned> m_inputXruns{ 0 }, m_outputXruns{ 0 }, m_skipped{ 0 }, m_underruns{ 0 }, m_allocations{ 0 };
+	std::unique_ptr<MixAhead> m_mixAhead;
+	std::unique_ptr<OutputFollower> m_follower;
 };
 
 extern int getBackend();
 class ConfigItem;
+class Music;
 
 /** @short High level audio playback API **/
 class Audio {
 	friend int getBackend();
 	struct Impl;
 	std::unique_ptr<Impl> self;
-	friend class ScreenSongs;
-	friend class Music;
-	static std::recursive_mutex aubio_mutex;
 public:
 	typedef std::map<std::string, fs::path> Files;
 	static ConfigItem& backendConfig();
 	Audio();
 	~Audio();
 	void restart();
+	/// Apply changes of audio/devices: close the devices no longer configured and open the new ones while the others
+	/// keep running (restarts if the backend or the analysis of a mic changed). Not while an Engine uses the analyzers.
+	void updateDevices();
+	/// The devices of the backend in use, enumerated in the background when audio started (waits for that)
+	portaudio::DeviceInfos const& availableDevices() const;
 	void close();
 	std::deque<Analyzer>& analyzers();
-	std::deque<Device>& devices();
+	/// Analyzers grouped by device, at most ANALYZER_BATCH per group, for Analyzer::process(batch, count)
+	std::vector<std::vector<Analyzer*>> const& analyzerBatches() const;
+	std::list<Device>& devices();
 	bool isOpen() const;
 	bool hasPlayback() const;
 	/** Play a song beginning at startPos (defaults to 0)
@@ -98,9 +162,13 @@ public:
 	 * @param startPos starting position
 	 */
 	void playMusic(fs::path const& filename, bool preview = false, double fadeTime = 0.5, double startPos = 0.0);
-	/** Plays a list of songs **/
-	void playMusic(Files const& filenames, bool preview = false, double fadeTime = 0.5, double startPos = 0.0);
-	/** Loads/plays/unloads a sample **/
+	/** Plays a list of songs. The files begin at fileOffset seconds into the song (used for cached previews). **/
+	void playMusic(Files const& filenames, bool preview = false, double fadeTime = 0.5, double startPos = 0.0, double fileOffset = 0.0);
+	/** Opens the files of a song for playMusic (may be called on any thread, e.g. while the notes are loading) **/
+	static std::unique_ptr<Music> openMusic(Files const& filenames, bool preview = false, double fileOffset = 0.0);
+	/** Plays music opened by openMusic **/
+	void playMusic(std::unique_ptr<Music> music, double fadeTime = 0.5, double startPos = 0.0);
+	/** Loads/plays/unloads a sample (a short sound effect, decoded completely when loaded; files are shared by name) **/
 	void loadSample(std::string const& streamId, fs::path const& filename);
 	void playSample(std::string const& streamId);
 	void unloadSample(std::string const& streamId);
@@ -127,6 +195,10 @@ public:
 	bool isPaused() const;
 	/** Toggle synth playback **/
 	void toggleSynth(Notes const&);
+	/** Stop synth playback **/
+	void stopSynth();
+	/** Copy the output mix (at getSR()) to a recording, or stop with nullptr. The previous one is no longer used on return. **/
+	void setCapture(Capture* capture);
 	/** Toggle center channel suppressor **/
 	void toggleCenterChannelSuppressor();
 	/** Adjust volume level of a single track (used for muting incorrectly played instruments). Range 0.0 to 1.0. **/
@@ -135,39 +207,48 @@ public:
 	void streamBend(std::string track, double pitchFactor);
 	/** Get sample rate */
 	static double getSR() { return 48000.0; }
-	static unsigned aubio_hop_size;
-	static unsigned aubio_win_size;
-	static std::unique_ptr<aubio_tempo_t, void(*)(aubio_tempo_t*)> aubioTempo;
+	/// Callback statistics of all devices (over the latest second) and the clock of the music playing, one line each
+	std::vector<std::string> statistics();
 };
 
 class Music {
 struct Track {
 	AudioBuffer audioBuffer;
 	float fadeLevel = 1.0f;
-	float pitchFactor = 0.0f;
-	template <typename... Args> Track(Args&&... args): audioBuffer(std::forward<Args>(args)...) {}
+	float pitchFactor = 0.0f;  ///< Whammy from 0 (no shift) to 1 (maximum bend)
+	bool bent = false;  ///< Has the track been pitch bent (and is thus mixed through shifter)?
+	da::PitchShifter shifter;
+	Track(fs::path const& filename, unsigned sr): audioBuffer(filename, sr), shifter(sr / 25) {}  // 40 ms window
 };	
 	friend class ScreenSongs;
 	public:
 	std::unordered_map<std::string, std::unique_ptr<Track>> tracks; ///< Audio decoders
 	double srate; ///< Sample rate
 	int64_t m_pos = 0; ///< Current sample position
+	int64_t m_fileOffset = 0; ///< Sample position in song where the files begin
 	bool m_preview;
 	class AudioClock m_clock;
 	Seconds durationOf(int64_t samples) const { return 1.0s * samples / srate / 2.0; }
 	float* sampleStartPtr = nullptr;
 	float* sampleEndPtr = nullptr;
+	std::vector<float> m_mixbuf;  ///< Sum of the tracks, reused between callbacks
+	std::vector<float> m_bendbuf;  ///< A pitch bent track before shifting, reused between callbacks
+	da::CenterSuppressor m_suppressor;  ///< Vocal remover (keeps its filter state between callbacks)
 public:
 	bool suppressCenterChannel = false;
 	double fadeLevel = 0.0;
 	double fadeRate = 0.0;
 	using Buffer = std::vector<float>;
-	Music(Audio::Files const& files, unsigned int sr, bool preview);
+	Music(Audio::Files const& files, unsigned int sr, bool preview, double fileOffset = 0.0);
 	/// Sums the stream to output sample range, returns true if the stream still has audio left afterwards.
-	bool operator()(float* begin, float* end);
+	/// delay is the number of samples mixed earlier that play before this range (audio/mixer_thread), which the
+	/// clock takes off so that it follows what is heard.
+	bool operator()(float* begin, float* end, int64_t delay = 0);
 	void seek(double time) { m_pos = time * srate * 2.0; }
 	/// Get the current position in seconds
 	double pos() const { return m_clock.pos().count(); }
+	/// Get the state of the clock (for publishing the position)
+	AudioClock::State clockState() const { return m_clock.state(); }
 	double duration() const;
 	/// Prepare (seek) all tracks to current position, return true when done (nonblocking)
 	bool prepare();
@@ -1,75 +1,209 @@
 #include "backgrounds.hh"
 
 #include "configuration.hh"
+#include "songwatcher.hh"
+#include "texture.hh"
+#include "threads.hh"
 #include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <random>
 #include "regex.hh"
 
+namespace {
+	const char CACHE_HEADER[] = "performous-backgrounds 1";
+
+	fs::path cacheFile() { return getCacheDir() / "Backgrounds.cache"; }
+
+	/**
+	* Read the folder listings of the previous scan (nothing if the file is missing or invalid). The format is text,
+	* "D <time> <folder>" followed by "d <subfolder>" and "f <image>" lines of the entries in that folder.
+	**/
+	Backgrounds::Dirs loadCache(fs::path const& file) {
+		Backgrounds::Dirs dirs;
+		fs::ifstream f(file);
+		std::string line;
+		if (!std::getline(f, line) || line != CACHE_HEADER) return dirs;
+		Backgrounds::Dir* dir = nullptr;
+		while (std::getline(f, line)) {
+			if (line.size() < 2 || line[1] != ' ') return Backgrounds::Dirs();
+			std::string value = line.substr(2);
+			if (line[0] == 'D') {
+				std::istringstream iss(value);
+				Backgrounds::Dir d{};
+				std::string name;
+				if (!(iss >> d.time) || !std::getline(iss >> std::ws, name)) return Backgrounds::Dirs();
+				dir = &(dirs[name] = std::move(d));
+			} else if (!dir) return Backgrounds::Dirs();
+			else if (line[0] == 'd') dir->subdirs.push_back(value);
+			else if (line[0] == 'f') dir->files.push_back(value);
+			else return Backgrounds::Dirs();
+		}
+		return dirs;
+	}
+
+	void saveCache(fs::path const& file, Backgrounds::Dirs const& dirs) {
+		auto valid = [](std::string const& name) { return name.find('\n') == std::string::npos; };
+		fs::create_directories(file.parent_path());
+		fs::path part = file;
+		part += ".part";
+		{
+			fs::ofstream f(part);
+			f << CACHE_HEADER << '\n';
+			for (auto const& d: dirs) {
+				// Folders that cannot be written are simply listed again on the next scan
+				if (!valid(d.first) || !std::all_of(d.second.subdirs.begin(), d.second.subdirs.end(), valid)
+				  || !std::all_of(d.second.files.begin(), d.second.files.end(), valid)) continue;
+				f << "D " << d.second.time << ' ' << d.first << '\n';
+				for (auto const& s: d.second.subdirs) f << "d " << s << '\n';
+				for (auto const& s: d.second.files) f << "f " << s << '\n';
+			}
+			if (!f) throw std::runtime_error("Cannot write " + part.string());
+		}
+		fs::rename(part, file);
+	}
+
+	/// Lists folders on several threads at once (folders with an unchanged modification time come from the cache)
+	class Walk {
+	  public:
+		Walk(Backgrounds::Dirs const& cached, std::atomic<bool> const& loading): m_cached(cached), m_loading(loading) {}
+		void add(fs::path const& dir) { m_queue.push_back(dir); }
+		/// Scan everything added and below, using threads threads (including the caller)
+		void run(unsigned threads) {
+			std::vector<std::thread> workers;
+			for (unsigned i = 1; i < threads; ++i) workers.emplace_back([this] { work(); });
+			work();
+			for (auto& t: workers) t.join();
+		}
+		Backgrounds::Dirs scanned;  ///< Folders visited (complete after run)
+		std::vector<std::string> images;  ///< Full paths of images found (complete after run)
+
+	  private:
+		void work() {
+			std::unique_lock<std::mutex> l(m_mutex);
+			while (true) {
+				m_cond.wait(l, [this] { return !m_queue.empty() || m_busy == 0 || !m_loading; });
+				if (m_queue.empty() || !m_loading) break;
+				fs::path dir = std::move(m_queue.front());
+				m_queue.pop_front();
+				++m_busy;
+				l.unlock();
+				Backgrounds::Dir stamp{};
+				bool ok = visit(dir, stamp);
+				l.lock();
+				--m_busy;
+				for (auto const& sub: stamp.subdirs) m_queue.push_back(dir / sub);
+				for (auto const& file: stamp.files) images.push_back((dir / file).string());
+				if (ok) scanned[dir.string()] = std::move(stamp);
+				m_cond.notify_all();
+			}
+			m_cond.notify_all();
+		}
+		/// List a folder into stamp, returns false if it should not be cached
+		bool visit(fs::path const& parent, Backgrounds::Dir& stamp) {
+			if (std::distance(parent.begin(), parent.end()) > 20) { std::clog << "backgrounds/info: >>> Not scanning: " << parent.string() << " (maximum depth reached, possibly due to cyclic symlinks)" << std::endl; return false; }
+			boost::system::error_code ec;
+			stamp.time = fs::last_write_time(parent, ec);
+			auto cached = m_cached.find(parent.string());
+			if (!ec && cached != m_cached.end() && cached->second.time == stamp.time) {
+				stamp = cached->second;  // No files were added or removed here since the cache was written
+				return true;
+			}
+			try {
+				// Find suitable file formats
+				static const regex expression(R"(\.(png|jpeg|jpg|svg)$)", regex_constants::icase);
+				for (fs::directory_iterator dirIt(parent), dirEnd; m_loading && dirIt != dirEnd; ++dirIt) {
+					fs::path p = dirIt->path();
+					std::string name = p.filename().string();
+					if (fs::is_directory(p)) stamp.subdirs.push_back(name);
+					else if (regex_search(name, expression)) stamp.files.push_back(name);
+				}
+			} catch (std::exception const& e) {
+				std::clog << "backgrounds/error: Error accessing " << parent << ": " << e.what() << std::endl;
+				return false;
+			}
+			return !ec && m_loading;
+		}
+		Backgrounds::Dirs const& m_cached;
+		std::atomic<bool> const& m_loading;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::deque<fs::path> m_queue;
+		unsigned m_busy = 0;
+	};
+}
+
+Backgrounds::Backgrounds() {
+	if (config["songs/watch"].b()) m_watcher = std::make_unique<SongWatcher>();
+	reload();
+}
+
+Backgrounds::~Backgrounds() {
+	m_loading = false; // Terminate loading if currently in progress
+	if (m_thread) m_thread->join();
+}
+
 void Backgrounds::reload() {
 	if (m_loading) return;
+	if (m_thread) m_thread->join();
 	// Run loading thread
 	m_loading = true;
 	m_thread = std::make_unique<std::thread>([this] { reload_internal(); });
 }
 
 void Backgrounds::reload_internal() {
-	{	// Remove old ones
-		std::lock_guard<std::mutex> l(m_mutex);
-		m_bgs.clear();
-		m_dirty = true;
-	}
+	threads::enter(threads::Class::io, "background scanner");
+	const Dirs cached = loadCache(cacheFile());
+	Walk walk(cached, m_loading);
 	// Go through the background paths
 	Paths paths = getPaths();
 	for (auto it = paths.begin(); m_loading && it != paths.end(); ++it) {
-		if (!m_loading) break;
 		*it /= "backgrounds";
 		if (!fs::is_directory(*it)) { std::clog << "backgrounds/info: >>> Not scanning for backgrounds: " << *it << " (no such directory)" << std::endl; continue; }
 		std::clog << "backgrounds/info: >>> Scanning " << *it << " (for backgrounds)" << std::endl;
-		size_t count = m_bgs.size();
-		reload_internal(*it); // Scan the found folder
-		size_t diff = m_bgs.size() - count;
-		if (diff > 0 && m_loading) std::clog << "backgrounds/info: " << diff << " backgrounds loaded" << std::endl;
-	}
-	m_loading = false;
-	{	// Randomize the order
-		std::lock_guard<std::mutex> l(m_mutex);
-		std::shuffle(m_bgs.begin(), m_bgs.end(), std::mt19937(std::random_device()()));
-		m_dirty = false;
-		m_bgiter = 0;
+		walk.add(*it);
 	}
-}
-
-void Backgrounds::reload_internal(fs::path const& parent) {
-	if (std::distance(parent.begin(), parent.end()) > 20) { std::clog << "backgrounds/info: >>> Not scanning: " << parent.string() << " (maximum depth reached, possibly due to cyclic symlinks)" << std::endl; return; }
+	walk.run(threads::poolSize(threads::Class::io, config["songs/loader_threads"].i()));
+	if (!m_loading) return;
+	std::clog << "backgrounds/info: " << walk.images.size() << " backgrounds loaded" << std::endl;
 	try {
-		// Find suitable file formats
-		regex expression(R"(\.(png|jpeg|jpg|svg)$)", regex_constants::icase);
-		for (fs::directory_iterator dirIt(parent), dirEnd; m_loading && dirIt != dirEnd; ++dirIt) {
-			fs::path p = dirIt->path();
-			if (fs::is_directory(p)) { reload_internal(p); continue; }
-			std::string name = p.filename().string(); // File basename
-			std::string path = p.string(); // Path without filename
-			path.erase(path.size() - name.size());
-			if (!regex_search(name, expression)) continue;
-			{
-				std::lock_guard<std::mutex> l(m_mutex);
-				m_bgs.push_back(path + name); // Add the background
-				m_dirty = true;
-			}
-		}
+		saveCache(cacheFile(), walk.scanned);
 	} catch (std::exception const& e) {
-		std::cout << "Error accessing " << parent << std::endl;
+		std::clog << "backgrounds/error: Could not save the background cache: " << e.what() << std::endl;
+	}
+	if (m_watcher) {
+		std::vector<fs::path> dirs;
+		for (auto const& dir: walk.scanned) dirs.push_back(dir.first);
+		m_watcher->watch(dirs);
 	}
+	// Randomize the order
+	std::shuffle(walk.images.begin(), walk.images.end(), std::mt19937(std::random_device()()));
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_bgs = std::move(walk.images);
+		m_bgiter = 0;
+	}
+	m_loading = false;
 }
 
 /// Get a random background
 std::string Backgrounds::getRandom() {
+	std::lock_guard<std::mutex> l(m_mutex);
 	if (m_bgs.empty()) throw std::runtime_error("No random backgrounds available");
 	// This relies on that the bgs are in random order
 	return m_bgs.at((++m_bgiter) % m_bgs.size());
 }
 
+std::unique_ptr<Texture> Backgrounds::takeRandom() {
+	if (m_watcher && !m_loading && !m_watcher->takeChanged().empty()) reload();  // Keeps the old list until done
+	std::unique_ptr<Texture> ret = std::move(m_next);
+	if (!ret) ret = std::make_unique<Texture>(getRandom());
+	if (size() > 1) m_next = std::make_unique<Texture>(getRandom());
+	return ret;
+}
+
@@ -2,44 +2,57 @@
 
 #include "fs.hh"
 #include <atomic>
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
-/// songs class for songs screen
+class SongWatcher;
+class Texture;
+
+/**
+* Background images for the singing and playlist screens.
+* The background folders are scanned in parallel in a thread of their own. The listing of each folder is kept in
+* a cache file with the folder's modification time, so unchanged folders are not listed again on the next start.
+* With songs/watch the folders are also watched and rescanned when something changes.
+**/
 class Backgrounds {
   public:
 	/// constructor
 	Backgrounds(const Backgrounds&) = delete;
   	const Backgrounds& operator=(const Backgrounds&) = delete;
-	Backgrounds() {
-		reload();
-	}
-	~Backgrounds() {
-		m_loading = false; // Terminate loading if currently in progress
-		m_thread->join();
-	}
+	Backgrounds();
+	~Backgrounds();
 	/// reloads backgrounds list
 	void reload();
-	/// array access
-	std::string& operator[](std::size_t pos) { return m_bgs.at(pos); }
 	/// number of backgrounds
-	int size() const { return m_bgs.size(); };
+	int size() const { std::lock_guard<std::mutex> l(m_mutex); return m_bgs.size(); };
 	/// true if empty
-	int empty() const { return m_bgs.empty(); };
+	int empty() const { std::lock_guard<std::mutex> l(m_mutex); return m_bgs.empty(); };
 	/// returns random background
 	std::string getRandom();
+	/// returns a texture of a random background and starts loading the next one, so that it is decoded by the time
+	/// it is needed (must be called with the OpenGL context current)
+	std::unique_ptr<Texture> takeRandom();
+
+	/// Modification time, images and subfolders of a scanned folder
+	struct Dir {
+		std::int64_t time;
+		std::vector<std::string> subdirs, files;
+	};
+	typedef std::unordered_map<std::string, Dir> Dirs;
 
   private:
 	typedef std::vector<std::string> BGVector;
 	BGVector m_bgs;
 	int m_bgiter = 0;
 	void reload_internal();
-	void reload_internal(fs::path const& p);
-	std::atomic<bool> m_dirty{ false };
 	std::atomic<bool> m_loading{ false };
 	std::unique_ptr<std::thread> m_thread;
+	std::unique_ptr<SongWatcher> m_watcher;  ///< Only with songs/watch
+	std::unique_ptr<Texture> m_next;  ///< Prefetched by takeRandom
 	mutable std::mutex m_mutex;
 };
 
@@ -0,0 +1,180 @@
+#include "beatgrid.hh"
+
+#include "audio.hh"
+#include "ffmpeg.hh"
+#include "threads.hh"
+#include "util.hh"
+
+#include "aubio/aubio.h"
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+namespace {
+	const std::size_t MAX_QUEUE = 16;  ///< Requests kept (older ones are dropped)
+	const unsigned WIN_SIZE = 1536, HOP_SIZE = 768;  ///< Of the tempo detection (samples)
+	using Tempo = std::unique_ptr<aubio_tempo_t, std::integral_constant<decltype(&del_aubio_tempo), &del_aubio_tempo>>;
+	const char MAGIC[8] = { 'B', 'E', 'A', 'T', 'S', '1', 0, 0 };
+
+	/// Read a beat grid written by save (false if the file is missing or invalid)
+	bool load(fs::path const& file, Song::Beats& beats) {
+		fs::ifstream f(file, std::ios::binary);
+		char magic[sizeof(MAGIC)];
+		std::uint64_t count;
+		if (!f.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), MAGIC)) return false;
+		if (!f.read(reinterpret_cast<char*>(&count), sizeof(count)) || count > 1000000) return false;
+		beats.resize(count);
+		return bool(f.read(reinterpret_cast<char*>(beats.data()), count * sizeof(double)));
+	}
+
+	void save(fs::path const& file, Song::Beats const& beats) {
+		// Write to a temporary name first so that load never sees partial files
+		fs::path part = file;
+		part += ".part";
+		{
+			fs::ofstream f(part, std::ios::binary);
+			const std::uint64_t count = beats.size();
+			f.write(MAGIC, sizeof(MAGIC));
+			f.write(reinterpret_cast<char const*>(&count), sizeof(count));
+			f.write(reinterpret_cast<char const*>(beats.data()), count * sizeof(double));
+			if (!f) throw std::runtime_error("Cannot write " + part.string());
+		}
+		fs::rename(part, file);
+	}
+}
+
+BeatGrid::BeatGrid(): m_dir(getCacheDir() / "beats") {
+	boost::system::error_code ec;
+	fs::create_directories(m_dir, ec);
+	if (ec) std::clog << "cache/error: Beat grids will not be cached, cannot use " << m_dir << ": " << ec.message() << std::endl;
+	const unsigned count = threads::poolSize(threads::Class::background);
+	for (unsigned i = 0; i < count; ++i) m_threads.emplace_back(&BeatGrid::run, this);
+}
+
+BeatGrid::~BeatGrid() {
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_all();
+	for (auto& t: m_threads) t.join();
+}
+
+fs::path BeatGrid::filename(Song const& song) const {
+	std::ostringstream key;
+	key << Audio::getSR() << ' ' << WIN_SIZE << ' ' << HOP_SIZE;
+	for (auto const& kv: song.music) {
+		if (kv.second.empty()) continue;
+		boost::system::error_code ec;
+		key << '\n' << kv.first << '=' << kv.second.string() << ' ' << fs::last_write_time(kv.second, ec);
+	}
+	std::ostringstream name;
+	name << std::hex << std::hash<std::string>()(key.str()) << ".beats";
+	return m_dir / name.str();
+}
+
+void BeatGrid::request(std::shared_ptr<Song> const& song) {
+	if (!song || !song->beats.empty() || song->hasControllers()) return;  // Checked here because the main thread owns the song
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_urgent.push_front(song);
+		if (m_urgent.size() > MAX_QUEUE) m_urgent.resize(MAX_QUEUE);
+		auto it = m_active.find(song.get());
+		if (it != m_active.end()) it->second = true;  // Already being analyzed in the background
+	}
+	m_cond.notify_one();
+}
+
+void BeatGrid::populate(std::vector<std::shared_ptr<Song>> const& songs) {
+	std::lock_guard<std::mutex> l(m_mutex);
+	m_background.clear();
+	for (auto const& song: songs) if (song->beats.empty() && !song->hasControllers()) m_background.push_back(song);
+	m_cond.notify_all();
+}
+
+bool BeatGrid::take(Song& song) {
+	std::lock_guard<std::mutex> l(m_mutex);
+	for (auto it = m_results.begin(); it != m_results.end(); ++it) {
+		std::shared_ptr<Song> s = it->first.lock();
+		if (s.get() != &song) continue;
+		song.beats = std::move(it->second);
+		m_results.erase(it);
+		return true;
+	}
+	return false;
+}
+
+Song::Beats BeatGrid::analyze(Song const& song) {
+	auto music = song.music.find("background");
+	if (music == song.music.end() || music->second.empty()) throw std::runtime_error("No background track");
+	Song::Beats beats;
+	double firstPeriod = 0.0;
+	Tempo tempoPtr(new_aubio_tempo("default", WIN_SIZE, HOP_SIZE, Audio::getSR()));
+	aubio_tempo_t* tempo = tempoPtr.get();
+	if (!tempo) throw std::runtime_error("Cannot create tempo detection");
+	aubio_tempo_set_silence(tempo, -50.0);
+	aubio_tempo_set_threshold(tempo, 0.4);
+	AudioBuffer::uFvec hop(new_fvec(HOP_SIZE)), beat(new_fvec(1));
+	std::size_t fill = 0;
+	AudioFFmpeg ffmpeg(music->second, Audio::getSR(), [&](float const* data, size_t count, int64_t) {
+		for (size_t i = 0; i + 1 < count; i += 2) {
+			hop->data[fill++] = 0.5f * (data[i] + data[i + 1]);  // Stereo to mono
+			if (fill < hop->length) continue;
+			fill = 0;
+			aubio_tempo_do(tempo, hop.get(), beat.get());
+			if (beat->data[0] == 0) continue;
+			if (beats.empty()) firstPeriod = aubio_tempo_get_period_s(tempo);
+			beats.push_back(aubio_tempo_get_last_s(tempo));
+		}
+	});
+	try {
+		while (!m_quit) ffmpeg.handleOneFrame();
+	} catch (FFmpeg::Eof const&) {}
+	if (beats.empty()) return beats;
+	// Extend the grid back to the beginning of the song with the tempo of the first beat
+	Song::Beats extra;
+	for (double t = beats.front() - firstPeriod; firstPeriod > 0.0 && t > 0.02; t -= firstPeriod) extra.push_back(t);
+	beats.insert(beats.begin(), extra.rbegin(), extra.rend());
+	return beats;
+}
+
+void BeatGrid::run() {
+	threads::enter(threads::Class::background, "beat tracker");
+	std::unique_lock<std::mutex> l(m_mutex);
+	while (!m_quit) {
+		std::shared_ptr<Song> song;
+		bool urgent = !m_urgent.empty();
+		if (urgent) { song = m_urgent.front().lock(); m_urgent.pop_front(); }
+		else if (!m_background.empty()) { song = m_background.front().lock(); m_background.pop_front(); }
+		else { m_cond.wait(l); continue; }
+		if (!song) continue;
+		auto active = m_active.find(song.get());
+		if (active != m_active.end()) { active->second |= urgent; continue; }  // Another thread has it
+		m_active.emplace(song.get(), urgent);
+		Song::Beats beats;
+		bool ok = true;
+		{
+			UnlockGuard<decltype(l)> unlocked(l);  // Decoding takes a while
+			fs::path target = filename(*song);
+			if (!load(target, beats)) {
+				try {
+					beats = analyze(*song);
+					if (!m_quit) save(target, beats);
+				} catch (std::exception& e) {
+					std::clog << "cache/warning: Cannot detect beats of " << song->filename << ": " << e.what() << std::endl;
+					ok = false;
+				}
+			}
+		}
+		active = m_active.find(song.get());
+		if (ok && !m_quit && active->second) {
+			if (m_results.size() >= MAX_QUEUE) m_results.erase(m_results.begin());  // Browsed past without taking
+			m_results.emplace_back(song, std::move(beats));
+		}
+		m_active.erase(active);
+	}
+}
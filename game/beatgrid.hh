@@ -0,0 +1,46 @@
+#pragma once
+
+#include "fs.hh"
+#include "song.hh"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+* Beat detection for songs without instrument tracks (whose beats come from the notes). Background threads
+* run aubio tempo detection over the whole background track once per song (each job with a tempo detector of
+* its own, so songs are analyzed in parallel) and keep the beat grid in
+* getCacheDir() / "beats", named by a hash of the music files and their modification times (like the preview
+* cache), so later requests of the same song only read the file. Results are handed to the main thread by take().
+**/
+class BeatGrid {
+  public:
+	BeatGrid();
+	~BeatGrid();
+	/// Analyze song (or read its cached beat grid), before anything else queued
+	void request(std::shared_ptr<Song> const& song);
+	/// Queue songs for analysis when nothing is requested (e.g. the library after a scan), replacing earlier ones
+	void populate(std::vector<std::shared_ptr<Song>> const& songs);
+	/// Move a finished beat grid of song into song.beats. Returns false if there is none (yet).
+	bool take(Song& song);
+
+  private:
+	fs::path filename(Song const& song) const;
+	Song::Beats analyze(Song const& song);
+	void run();
+
+	const fs::path m_dir;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<std::weak_ptr<Song>> m_urgent, m_background;
+	std::map<Song const*, bool> m_active;  ///< Songs being analyzed, and whether take() wants the result
+	std::vector<std::pair<std::weak_ptr<Song>, Song::Beats>> m_results;  ///< Finished, waiting for take()
+	std::atomic<bool> m_quit{ false };
+	std::vector<std::thread> m_threads;
+};
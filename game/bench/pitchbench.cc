@@ -0,0 +1,216 @@
+/**
+* Pitch detection benchmark: feeds WAV files through Analyzer faster than real time and reports
+* throughput, memory allocations and (with labels) findTone accuracy.
+*
+* Usage: pitchbench [--step N] [--fft N] [--detector fft|yin] file.wav...
+*
+* Labels are read from a text file next to each WAV with the extension replaced by .pitch, one
+* "<seconds> <Hz>" pair per line (0 Hz for silence or unvoiced sounds). Each label holds until the next one.
+**/
+
+#include "../pitch.hh"
+#include "../libda/simd.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+	std::atomic<std::size_t> g_allocations{ 0 };
+}
+
+// Count every heap allocation of the program (the analyzer should do none once constructed)
+void* operator new(std::size_t size) {
+	++g_allocations;
+	if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+namespace {
+	/// Feed this many samples at a time (like an audio callback would)
+	const std::size_t CHUNK = 256;
+	/// Detections within this many cents of the label count as correct
+	const double TOLERANCE_CENTS = 50.0;
+
+	struct Wave {
+		double rate = 0.0;
+		std::vector<float> samples;  ///< Mono (channels averaged)
+	};
+
+	/// Read a little endian unsigned integer of bytes bytes
+	std::uint32_t readLE(char const* p, unsigned bytes) {
+		std::uint32_t v = 0;
+		for (unsigned i = 0; i < bytes; ++i) v |= std::uint32_t(static_cast<unsigned char>(p[i])) << (8 * i);
+		return v;
+	}
+
+	/// Load a RIFF WAVE file with 16, 24 or 32 bit integer or 32 bit float samples
+	Wave loadWave(std::string const& filename) {
+		std::ifstream f(filename, std::ios::binary);
+		if (!f) throw std::runtime_error("Cannot open " + filename);
+		std::vector<char> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+		if (data.size() < 12 || std::memcmp(&data[0], "RIFF", 4) || std::memcmp(&data[8], "WAVE", 4)) throw std::runtime_error(filename + " is not a WAV file");
+		unsigned format = 0, channels = 0, bits = 0;
+		Wave wave;
+		for (std::size_t pos = 12; pos + 8 <= data.size(); ) {
+			char const* chunk = &data[pos];
+			const std::size_t size = readLE(chunk + 4, 4);
+			char const* body = chunk + 8;
+			if (pos + 8 + size > data.size()) break;
+			if (!std::memcmp(chunk, "fmt ", 4) && size >= 16) {
+				format = readLE(body, 2);
+				channels = readLE(body + 2, 2);
+				wave.rate = readLE(body + 4, 4);
+				bits = readLE(body + 14, 2);
+				if (format == 0xFFFE && size >= 26) format = readLE(body + 24, 2);  // WAVE_FORMAT_EXTENSIBLE
+			} else if (!std::memcmp(chunk, "data", 4)) {
+				if (!channels) throw std::runtime_error(filename + ": data before format");
+				const unsigned bytes = bits / 8;
+				if (!(format == 1 && (bits == 16 || bits == 24 || bits == 32)) && !(format == 3 && bits == 32)) {
+					throw std::runtime_error(filename + ": unsupported sample format");
+				}
+				const std::size_t frames = size / (bytes * channels);
+				wave.samples.resize(frames);
+				for (std::size_t i = 0; i < frames; ++i) {
+					double sum = 0.0;
+					for (unsigned ch = 0; ch < channels; ++ch) {
+						char const* s = body + (i * channels + ch) * bytes;
+						if (format == 3) { float v; std::memcpy(&v, s, 4); sum += v; continue; }
+						sum += std::int32_t(readLE(s, bytes) << (32 - bits)) / 2147483648.0;  // Sign extend and scale to [-1, 1)
+					}
+					wave.samples[i] = sum / channels;
+				}
+				return wave;
+			}
+			pos += 8 + size + (size & 1);
+		}
+		throw std::runtime_error(filename + ": no audio data");
+	}
+
+	typedef std::vector<std::pair<double, double>> Labels;  ///< (time, frequency) sorted by time
+
+	Labels loadLabels(std::string const& wavname) {
+		Labels labels;
+		std::string name = wavname.substr(0, wavname.rfind('.')) + ".pitch";
+		std::ifstream f(name);
+		for (double t, freq; f >> t >> freq; ) labels.emplace_back(t, freq);
+		return labels;
+	}
+
+	double labelAt(Labels const& labels, double t, std::size_t& pos) {
+		while (pos + 1 < labels.size() && labels[pos + 1].first <= t) ++pos;
+		if (labels.empty() || labels[pos].first > t) return 0.0;
+		return labels[pos].second;
+	}
+
+	double cents(double freq, double ref) { return 1200.0 * std::log2(freq / ref); }
+
+	struct Accuracy {
+		unsigned voiced = 0, correct = 0, octave = 0, wrong = 0, missed = 0;
+		unsigned unvoiced = 0, spurious = 0;
+		void add(double label, Tone const* tone) {
+			if (label <= 0.0) { ++unvoiced; spurious += !!tone; return; }
+			++voiced;
+			if (!tone) { ++missed; return; }
+			const double c = std::abs(cents(tone->freq, label));
+			if (c < TOLERANCE_CENTS) ++correct;
+			else if (std::abs(c - 1200.0) < TOLERANCE_CENTS) ++octave;
+			else ++wrong;
+		}
+		void add(Accuracy const& o) {
+			voiced += o.voiced; correct += o.correct; octave += o.octave; wrong += o.wrong; missed += o.missed;
+			unvoiced += o.unvoiced; spurious += o.spurious;
+		}
+		void print(std::ostream& os) const {
+			auto pct = [](unsigned n, unsigned total) { return total ? 100.0 * n / total : 0.0; };
+			os << "  voiced " << voiced << ": correct " << pct(correct, voiced) << " %, octave " << pct(octave, voiced)
+			  << " %, wrong " << pct(wrong, voiced) << " %, missed " << pct(missed, voiced) << " %\n"
+			  << "  unvoiced " << unvoiced << ": spurious " << pct(spurious, unvoiced) << " %\n";
+		}
+	};
+
+	char const* simdName() {
+#if DA_SIMD_AVX
+		return "AVX";
+#elif DA_SIMD_SSE2
+		return "SSE2";
+#elif DA_SIMD_NEON
+		return "NEON";
+#else
+		return "scalar";
+#endif
+	}
+}
+
+int main(int argc, char** argv) try {
+	std::size_t step = 200, fft = FFT_N;
+	std::string detector = "fft";
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--step" && i + 1 < argc) step = std::stoul(argv[++i]);
+		else if (arg == "--fft" && i + 1 < argc) fft = std::stoul(argv[++i]);
+		else if (arg == "--detector" && i + 1 < argc) detector = argv[++i];
+		else if (arg.empty() || arg[0] != '-') files.push_back(arg);
+		else {
+			std::cout << "Usage: " << argv[0] << " [--step N] [--fft N] [--detector fft|yin] file.wav..." << std::endl;
+			return arg == "--help" || arg == "-h" ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (files.empty()) { std::cerr << "No input files (see --help)" << std::endl; return EXIT_FAILURE; }
+	std::cout << std::fixed << std::setprecision(1) << "FFT " << fft << " points, step " << step << ", " << detector << " detector, " << simdName() << " kernels\n";
+	double totalAudio = 0.0, totalCpu = 0.0;
+	std::size_t totalAllocs = 0;
+	Accuracy total;
+	bool labeled = false;
+	for (auto const& file: files) {
+		Wave wave = loadWave(file);
+		Labels labels = loadLabels(file);
+		labeled |= !labels.empty();
+		Analyzer analyzer(wave.rate, "bench", step, fft, detector);
+		Accuracy acc;
+		std::size_t labelPos = 0;
+		const std::size_t allocs = g_allocations;
+		const std::clock_t begin = std::clock();
+		for (std::size_t pos = 0; pos < wave.samples.size(); pos += CHUNK) {
+			const std::size_t end = std::min(pos + CHUNK, wave.samples.size());
+			analyzer.input(wave.samples.begin() + pos, wave.samples.begin() + end);
+			analyzer.process();
+			Tone tone;
+			const bool found = analyzer.findTone(tone);
+			if (labels.empty()) continue;
+			const double t = (double(end) - fft / 2) / wave.rate;  // Middle of the latest window
+			if (t >= 0.0) acc.add(labelAt(labels, t, labelPos), found ? &tone : nullptr);
+		}
+		const double cpu = double(std::clock() - begin) / CLOCKS_PER_SEC;
+		const std::size_t allocated = g_allocations - allocs;
+		const double seconds = wave.samples.size() / wave.rate;
+		std::cout << file << ": " << seconds << " s at " << wave.rate << " Hz, " << cpu * 1000.0 << " ms CPU, "
+		  << (cpu > 0.0 ? seconds / cpu : 0.0) << " x real time, " << allocated << " allocations\n";
+		if (!labels.empty()) acc.print(std::cout);
+		totalAudio += seconds;
+		totalCpu += cpu;
+		totalAllocs += allocated;
+		total.add(acc);
+	}
+	std::cout << "Total: " << totalAudio << " mic-seconds in " << std::setprecision(3) << totalCpu << std::setprecision(1) << " CPU-seconds, "
+	  << (totalCpu > 0.0 ? totalAudio / totalCpu : 0.0) << " mic-seconds per CPU-second, " << totalAllocs << " allocations\n";
+	if (labeled) total.print(std::cout);
+	return EXIT_SUCCESS;
+} catch (std::exception& e) {
+	std::cerr << "ERROR: " << e.what() << std::endl;
+	return EXIT_FAILURE;
+}
@@ -1,20 +1,66 @@
 #include "cache.hh"
-#include "fs.hh"
 
+#include <boost/filesystem.hpp>
 #include <boost/format.hpp>
-#include <algorithm>
-#include <boost/algorithm/string/classification.hpp>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	const unsigned VERSION = 1;  ///< Part of the file name hash, increment when the format changes
+
+	struct Header {
+		char magic[4];
+		std::uint32_t width, height;
+		std::uint32_t svgSize;  ///< Size of the source SVG data, as a sanity check against hash collisions
+	};
+
+	fs::path cacheFile(std::string const& svgdata, double factor) {
+		std::string const key = (boost::format("%u %.2f ") % VERSION % factor).str() + svgdata;
+		std::ostringstream name;
+		name << std::hex << std::hash<std::string>()(key) << ".raw";
+		return getCacheDir() / "svg" / name.str();
+	}
+}
 
 namespace cache {
-	fs::path constructSVGCacheFileName(fs::path const& svgfilename, double factor){
-		fs::path cache_filename;
-		std::string const lod = (boost::format("%.2f") % factor).str();
-		std::string const cache_basename = svgfilename.filename().string() + ".cache_" + lod + ".premul.png";
-		std::string fullpath = svgfilename.parent_path().string();
-		// Windows drive name handling
-		std::replace_if(fullpath.begin(), fullpath.end(), boost::is_any_of(":"), '_');
-		cache_filename = getCacheDir() / "misc" / fullpath / cache_basename;
-		return cache_filename;
+	bool loadSVG(Bitmap& bitmap, std::string const& svgdata, double factor) {
+		std::ifstream f(cacheFile(svgdata, factor).string(), std::ios::binary);
+		if (!f) return false;
+		Header h;
+		if (!f.read(reinterpret_cast<char*>(&h), sizeof(h)) || std::memcmp(h.magic, "SVGR", 4) != 0) return false;
+		if (h.svgSize != svgdata.size() || h.width == 0 || h.height == 0 || h.width > 16384 || h.height > 16384) return false;
+		Bitmap ret;
+		ret.resize(h.width, h.height);
+		if (!f.read(reinterpret_cast<char*>(ret.buf.data()), ret.buf.size()) || f.peek() != std::ifstream::traits_type::eof()) return false;
+		ret.fmt = pix::INT_ARGB;
+		bitmap.swap(ret);
+		bitmap.linearPremul = true;
+		return true;
 	}
 
+	void saveSVG(Bitmap const& bitmap, std::string const& svgdata, double factor) {
+		if (bitmap.fmt != pix::INT_ARGB) throw std::logic_error("cache::saveSVG: unsupported bitmap");
+		Header h{};
+		std::memcpy(h.magic, "SVGR", 4);
+		h.width = bitmap.width;
+		h.height = bitmap.height;
+		h.svgSize = svgdata.size();
+		// Write to a temporary name first so that loadSVG never sees partial files
+		fs::path file = cacheFile(svgdata, factor);
+		fs::create_directories(file.parent_path());
+		fs::path part = file;
+		part += ".part";
+		{
+			std::ofstream f(part.string(), std::ios::binary);
+			f.write(reinterpret_cast<char const*>(&h), sizeof(h));
+			f.write(reinterpret_cast<char const*>(bitmap.data()), std::size_t(bitmap.width) * bitmap.height * 4);
+			if (!f) throw std::runtime_error("Cannot write " + part.string());
+		}
+		fs::rename(part, file);
+	}
 }
+
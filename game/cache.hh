@@ -1,25 +1,21 @@
 #pragma once
 
-#include "configuration.hh"
 #include "fs.hh"
-#include <boost/filesystem.hpp>
-#include <cstring>
-#include <stdexcept>
+#include "image.hh"
+#include <string>
 
 namespace cache {
 
-	/** Builds the full path and file name for the SVG cache resource **/
-	fs::path constructSVGCacheFileName(fs::path const& svgfilename, double factor);
+	/**
+	* Rasterized SVGs are cached as raw premultiplied pixels (the Cairo format, uploaded as is), so that loading one
+	* is a single read without any decoding. Files are named by a hash of the SVG data and the rendering factor,
+	* so edited images (or another graphic/svg_lod) simply miss.
+	**/
 
-	/** Load an SVG from the cache, if loading fails invalid_cache_error is thrown **/
-	template <typename T> bool loadSVG(T& target, fs::path const& source_filename, double factor) {
-		fs::path const cache_filename = cache::constructSVGCacheFileName(source_filename, factor);
-		// Verify that a cached file exists and that it is more recent than the original SVG
-		if (!fs::is_regular_file(cache_filename)) return false;
-		if (fs::last_write_time(source_filename) > fs::last_write_time(cache_filename)) return false;
-		// Try to load the cached file		
-		try { loadPNG(target, cache_filename.string()); } catch( ... ) { return false; }
-		return true;
-	}
+	/** Load the cached rasterization of svgdata at factor into bitmap. Returns false if not cached. **/
+	bool loadSVG(Bitmap& bitmap, std::string const& svgdata, double factor);
+
+	/** Store the rasterization of svgdata at factor. Throws std::runtime_error on failure. **/
+	void saveSVG(Bitmap const& bitmap, std::string const& svgdata, double factor);
 }
 
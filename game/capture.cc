@@ -0,0 +1,296 @@
+#include "capture.hh"
+
+#include "config.hh"
+#include "log.hh"
+#include "threads.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+extern "C" {
+#include AVCODEC_INCLUDE
+#include AVFORMAT_INCLUDE
+#include SWSCALE_INCLUDE
+#include AVUTIL_INCLUDE
+#include AVUTIL_OPT_INCLUDE
+#include AVUTIL_ERROR_INCLUDE
+}
+
+namespace {
+	/// Video encoders by preference: hardware (which leaves the CPU to the game) before software
+	char const* const VIDEO_ENCODERS[] = { "h264_nvenc", "h264_qsv", "h264_amf", "h264_videotoolbox", "h264_mf", "libx264", "mpeg4" };
+	const std::size_t AUDIO_RING_FRAMES = 1 << 17;  // Some 2.7 s at 48 kHz (a power of two)
+	const std::int64_t AUDIO_BITRATE = 192000;
+
+	std::string errorString(int err) {
+		char message[AV_ERROR_MAX_STRING_SIZE];
+		av_strerror(err, message, AV_ERROR_MAX_STRING_SIZE);
+		return message;
+	}
+
+	void check(int err, char const* what) {
+		if (err < 0) throw std::runtime_error(std::string("Capture: ") + what + ": " + errorString(err));
+	}
+
+	/// NV12 (what hardware encoders take natively) or YUV420P if the encoder supports them, otherwise its first format
+	AVPixelFormat pixelFormat(AVPixelFormat const* formats) {
+		if (!formats) return AV_PIX_FMT_YUV420P;
+		for (AVPixelFormat wanted: { AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P }) {
+			for (auto f = formats; *f != AV_PIX_FMT_NONE; ++f) if (*f == wanted) return wanted;
+		}
+		return formats[0];
+	}
+}
+
+/// The FFmpeg side, only used by the encoder thread (after the constructor)
+struct Capture::Encoder {
+	AVFormatContext* format = nullptr;
+	AVCodecContext* video = nullptr;
+	AVCodecContext* audio = nullptr;
+	AVStream* videoStream = nullptr;
+	AVStream* audioStream = nullptr;
+	SwsContext* sws = nullptr;
+	AVFrame* videoFrame = nullptr;
+	AVFrame* audioFrame = nullptr;
+	AVPacket* packet = nullptr;
+	unsigned width = 0, height = 0;  ///< Of the frames read back (the encoder needs even sizes)
+	std::int64_t audioPts = 0;
+
+	Encoder(fs::path const& filename, unsigned width, unsigned height, unsigned fps, unsigned rate): width(width), height(height) {
+		try {
+			check(avformat_alloc_output_context2(&format, nullptr, nullptr, filename.string().c_str()), "Choosing the container");
+			openVideo(fps);
+			openAudio(rate);
+			videoStream = addStream(video);
+			audioStream = addStream(audio);
+			check(avio_open(&format->pb, filename.string().c_str(), AVIO_FLAG_WRITE), "Opening the file");
+			check(avformat_write_header(format, nullptr), "Writing the header");
+			sws = sws_getContext(width, height, AV_PIX_FMT_RGB24, video->width, video->height, video->pix_fmt, SWS_BILINEAR, nullptr, nullptr, nullptr);
+			if (!sws) throw std::runtime_error("Capture: Cannot convert to the pixel format of the encoder");
+			videoFrame = av_frame_alloc();
+			videoFrame->format = video->pix_fmt;
+			videoFrame->width = video->width;
+			videoFrame->height = video->height;
+			check(av_frame_get_buffer(videoFrame, 0), "Allocating a video frame");
+			audioFrame = av_frame_alloc();
+			audioFrame->format = audio->sample_fmt;
+			audioFrame->nb_samples = audio->frame_size;
+			audioFrame->channel_layout = audio->channel_layout;
+			audioFrame->channels = audio->channels;
+			audioFrame->sample_rate = audio->sample_rate;
+			check(av_frame_get_buffer(audioFrame, 0), "Allocating an audio frame");
+			packet = av_packet_alloc();
+		} catch (...) {
+			release();
+			throw;
+		}
+	}
+	~Encoder() { release(); }
+
+	void release() {
+		av_frame_free(&videoFrame);
+		av_frame_free(&audioFrame);
+		av_packet_free(&packet);
+		sws_freeContext(sws);
+		sws = nullptr;
+		avcodec_free_context(&video);
+		avcodec_free_context(&audio);
+		if (format) {
+			if (format->pb) avio_closep(&format->pb);
+			avformat_free_context(format);
+			format = nullptr;
+		}
+	}
+
+	void openVideo(unsigned fps) {
+		for (char const* name: VIDEO_ENCODERS) {
+			auto codec = avcodec_find_encoder_by_name(name);
+			if (!codec) continue;
+			AVCodecContext* ctx = avcodec_alloc_context3(codec);
+			ctx->width = width & ~1u;
+			ctx->height = height & ~1u;
+			ctx->time_base = AVRational{ 1, int(fps) };
+			ctx->framerate = AVRational{ int(fps), 1 };
+			ctx->gop_size = 2 * fps;
+			ctx->max_b_frames = 0;  // No reordering, which keeps every encoder cheap and its latency low
+			ctx->bit_rate = std::int64_t(ctx->width) * ctx->height * fps / 8;  // Some 8 Mbit/s at 1080p30
+			ctx->pix_fmt = pixelFormat(codec->pix_fmts);
+			if (format->oformat->flags & AVFMT_GLOBALHEADER) ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+			if (std::strcmp(name, "libx264") == 0) av_opt_set(ctx->priv_data, "preset", "veryfast", 0);
+			const int err = avcodec_open2(ctx, codec, nullptr);
+			if (err < 0) {  // E.g. no such GPU or driver
+				LOG("video", debug) << "Capture: " << name << " not available: " << errorString(err) << std::endl;
+				avcodec_free_context(&ctx);
+				continue;
+			}
+			std::clog << "video/info: Capture: Encoding video with " << name << std::endl;
+			video = ctx;
+			return;
+		}
+		throw std::runtime_error("Capture: No video encoder available");
+	}
+
+	void openAudio(unsigned rate) {
+		auto codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+		if (!codec) throw std::runtime_error("Capture: No AAC encoder available");
+		audio = avcodec_alloc_context3(codec);
+		audio->sample_fmt = AV_SAMPLE_FMT_FLTP;
+		audio->sample_rate = rate;
+		audio->channel_layout = AV_CH_LAYOUT_STEREO;
+		audio->channels = 2;
+		audio->bit_rate = AUDIO_BITRATE;
+		audio->time_base = AVRational{ 1, int(rate) };
+		if (format->oformat->flags & AVFMT_GLOBALHEADER) audio->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+		check(avcodec_open2(audio, codec, nullptr), "Opening the AAC encoder");
+	}
+
+	AVStream* addStream(AVCodecContext* ctx) {
+		AVStream* stream = avformat_new_stream(format, nullptr);
+		if (!stream) throw std::runtime_error("Capture: Cannot add a stream");
+		stream->time_base = ctx->time_base;
+		check(avcodec_parameters_from_context(stream->codecpar, ctx), "Setting up a stream");
+		return stream;
+	}
+
+	/// Send a frame (nullptr to flush) and write the packets that come out
+	void encode(AVCodecContext* ctx, AVStream* stream, AVFrame* frame) {
+		check(avcodec_send_frame(ctx, frame), "Encoding");
+		while (true) {
+			const int err = avcodec_receive_packet(ctx, packet);
+			if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) return;
+			check(err, "Encoding");
+			av_packet_rescale_ts(packet, ctx->time_base, stream->time_base);
+			packet->stream_index = stream->index;
+			check(av_interleaved_write_frame(format, packet), "Writing");  // Takes the packet's data
+		}
+	}
+
+	/// Encode RGB rows (aligned to 4 bytes, bottom row first)
+	void encodeVideo(std::vector<std::uint8_t> const& pixels, std::int64_t pts) {
+		check(av_frame_make_writable(videoFrame), "Allocating a video frame");  // The encoder may still reference the previous one
+		const int stride = (width * 3 + 3) & ~3u;
+		// Start from the top row and step backwards, which flips the image while converting
+		std::uint8_t const* const src[] = { pixels.data() + std::size_t(height - 1) * stride };
+		const int srcStride[] = { -stride };
+		sws_scale(sws, src, srcStride, 0, height, videoFrame->data, videoFrame->linesize);
+		videoFrame->pts = pts;
+		encode(video, videoStream, videoFrame);
+	}
+
+	/// Encode a block of audio->frame_size interleaved stereo frames
+	void encodeAudio(float const* samples) {
+		check(av_frame_make_writable(audioFrame), "Allocating an audio frame");
+		float* left = reinterpret_cast<float*>(audioFrame->data[0]);
+		float* right = reinterpret_cast<float*>(audioFrame->data[1]);
+		for (int i = 0; i < audio->frame_size; ++i) {
+			left[i] = samples[2 * i];
+			right[i] = samples[2 * i + 1];
+		}
+		audioFrame->pts = audioPts;
+		audioPts += audio->frame_size;
+		encode(audio, audioStream, audioFrame);
+	}
+
+	/// Flush the encoders and complete the file
+	void finish() {
+		encode(video, videoStream, nullptr);
+		encode(audio, audioStream, nullptr);
+		check(av_write_trailer(format), "Writing the trailer");
+	}
+};
+
+Capture::Capture(fs::path const& filename, unsigned width, unsigned height, unsigned fps, unsigned rate):
+  m_filename(filename), m_width(width), m_height(height), m_fps(std::max(fps, 1u)),
+  m_encoder(std::make_unique<Encoder>(filename, width, height, m_fps, rate)),
+  m_start(Clock::now()),
+  m_ring(2 * AUDIO_RING_FRAMES),
+  m_block(2 * m_encoder->audio->frame_size)
+{
+	std::clog << "video/info: Capture: Recording " << width << "x" << height << " at " << m_fps << " FPS to " << filename << std::endl;
+	m_thread = std::thread(&Capture::run, this);
+}
+
+Capture::~Capture() {
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_one();
+	m_thread.join();
+	std::clog << "video/info: Capture: Finished " << m_filename << " (" << m_droppedFrames << " frames dropped)" << std::endl;
+}
+
+std::int64_t Capture::nextFrame(Time now) {
+	const std::int64_t pts = Seconds(now - m_start).count() * m_fps;
+	if (pts <= m_lastPts) return -1;
+	m_lastPts = pts;
+	return pts;
+}
+
+void Capture::addFrame(std::vector<std::uint8_t>&& pixels, std::int64_t pts) {
+	if (pixels.size() < frameBytes() || !m_frames.push(Frame{ std::move(pixels), pts })) {
+		++m_droppedFrames;
+		return;
+	}
+	m_cond.notify_one();
+}
+
+void Capture::addAudio(float const* begin, float const* end) {
+	const std::size_t frames = (end - begin) / 2;
+	const std::size_t w = m_audioWrite.load(std::memory_order_relaxed);
+	if (w + frames - m_audioRead.load(std::memory_order_acquire) > AUDIO_RING_FRAMES) {
+		m_audioLost += frames;
+		return;
+	}
+	for (std::size_t i = 0; i < frames; ++i) {
+		const std::size_t k = 2 * ((w + i) & (AUDIO_RING_FRAMES - 1));
+		m_ring[k] = begin[2 * i];
+		m_ring[k + 1] = begin[2 * i + 1];
+	}
+	m_audioWrite.store(w + frames, std::memory_order_release);
+}
+
+void Capture::encodeAudio() {
+	const std::size_t blockFrames = m_block.size() / 2;
+	while (true) {
+		m_silence += m_audioLost.exchange(0);
+		const std::size_t r = m_audioRead.load(std::memory_order_relaxed);
+		const std::size_t available = m_audioWrite.load(std::memory_order_acquire) - r;
+		if (m_silence + available < blockFrames) return;
+		// Silence for lost audio first (close enough to where it was lost, as the ring is rarely full)
+		const std::size_t silent = std::min(m_silence, blockFrames);
+		std::fill(m_block.begin(), m_block.begin() + 2 * silent, 0.0f);
+		m_silence -= silent;
+		for (std::size_t i = silent; i < blockFrames; ++i) {
+			const std::size_t k = 2 * ((r + i - silent) & (AUDIO_RING_FRAMES - 1));
+			m_block[2 * i] = m_ring[k];
+			m_block[2 * i + 1] = m_ring[k + 1];
+		}
+		m_audioRead.store(r + blockFrames - silent, std::memory_order_release);
+		m_encoder->encodeAudio(m_block.data());
+	}
+}
+
+void Capture::run() {
+	threads::enter(threads::Class::decode, "capture");
+	try {
+		for (bool quit = false; !quit;) {
+			{
+				// The audio callback cannot notify, so also wake up regularly for its samples
+				std::unique_lock<std::mutex> l(m_mutex);
+				m_cond.wait_for(l, 20ms, [this] { return m_quit || !m_frames.empty(); });
+				quit = m_quit;
+			}
+			Frame frame;
+			while (m_frames.tryPop(frame)) m_encoder->encodeVideo(frame.pixels, frame.pts);
+			encodeAudio();
+		}
+		m_encoder->finish();
+	} catch (std::exception& e) {
+		std::clog << "video/error: " << e.what() << std::endl;
+	}
+	m_encoder.reset();  // Closes the file
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "chrono.hh"
+#include "fs.hh"
+#include "spscqueue.hh"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+* Records gameplay into a video file. The render thread hands over the composited frames, read back without
+* stalling (see glutil::PixelReadback), and the audio callback copies the output mix into a wait-free ring.
+* A thread of its own converts and encodes both, with a hardware encoder when FFmpeg has one that works here.
+* Neither producer ever waits: frames are dropped when the encoder falls behind and so is audio when the ring
+* is full (replaced by silence, so that the sound stays in sync).
+**/
+class Capture {
+  public:
+	/// Start recording frames of width x height and stereo audio of rate (Hz) into filename (throws on failure)
+	Capture(fs::path const& filename, unsigned width, unsigned height, unsigned fps, unsigned rate);
+	/// Encodes what is queued and finishes the file
+	~Capture();
+	Capture(Capture const&) = delete;
+	Capture& operator=(Capture const&) = delete;
+	fs::path const& filename() const { return m_filename; }
+	unsigned width() const { return m_width; }
+	unsigned height() const { return m_height; }
+	/// Size of a frame for addFrame: RGB rows aligned to 4 bytes
+	std::size_t frameBytes() const { return std::size_t((m_width * 3 + 3) & ~3u) * m_height; }
+	/// Number of the frame due at time now, or -1 if the last one is still current (render thread)
+	std::int64_t nextFrame(Time now);
+	/// Add frame number pts, bottom row first (render thread); dropped if the encoder is behind
+	void addFrame(std::vector<std::uint8_t>&& pixels, std::int64_t pts);
+	/// Count a frame that could not be read back
+	void dropFrame() { ++m_droppedFrames; }
+	/// Add interleaved stereo samples of the output mix (audio callback, wait-free)
+	void addAudio(float const* begin, float const* end);
+  private:
+	struct Encoder;
+	struct Frame {
+		std::vector<std::uint8_t> pixels;
+		std::int64_t pts = 0;
+	};
+	void run();
+	/// Encode the audio in the ring, in blocks of the encoder's frame size
+	void encodeAudio();
+	fs::path m_filename;
+	unsigned m_width, m_height, m_fps;
+	std::unique_ptr<Encoder> m_encoder;
+	Time m_start;
+	std::int64_t m_lastPts = -1;  ///< Only accessed by the render thread
+	SpscQueue<Frame, 8> m_frames;  ///< Render thread to encoder
+	std::vector<float> m_ring;  ///< Audio callback to encoder, interleaved stereo
+	std::atomic<std::size_t> m_audioWrite{ 0 }, m_audioRead{ 0 };  ///< Positions in frames
+	std::atomic<std::size_t> m_audioLost{ 0 };  ///< Frames dropped by addAudio, not yet replaced by silence
+	std::size_t m_silence = 0;  ///< Frames of silence still to encode in place of lost audio (encoder thread only)
+	std::vector<float> m_block;  ///< A block of audio for the encoder
+	std::atomic<unsigned> m_droppedFrames{ 0 };
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_quit = false;
+	std::thread m_thread;
+};
@@ -21,6 +21,8 @@
 #define AVUTIL_OPT_INCLUDE <@AVUtil_INCLUDE_DIRS@/libavutil/opt.h> //HACK to get AVOption class!
 #define AVUTIL_MATH_INCLUDE <@AVUtil_INCLUDE_DIRS@/libavutil/mathematics.h>
 #define AVUTIL_ERROR_INCLUDE <@AVUtil_INCLUDE_DIRS@/libavutil/error.h>
+#define AVUTIL_HWCONTEXT_INCLUDE <@AVUtil_INCLUDE_DIRS@/libavutil/hwcontext.h>
+#define AVUTIL_PIXDESC_INCLUDE <@AVUtil_INCLUDE_DIRS@/libavutil/pixdesc.h>
 
 // libxml++ version
 #define LIBXMLPP_VERSION_2_6 @LibXML++_VERSION_2_6@
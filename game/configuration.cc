@@ -7,10 +7,15 @@
 #include "i18n.hh"
 #include "screen_intro.hh"
 #include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
 #include <boost/format.hpp>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <future>
 #include <iomanip>
+#include <iterator>
 #include <stdexcept>
 #include <iostream>
 #include <cmath>
@@ -269,6 +274,100 @@ void ConfigItem::update(xmlpp::Element& elem, int mode) try {
 				throw std::runtime_error(std::to_string(line) + ": Error while reading entry: " + e.what());
 			}
 
+namespace {
+	/// Fixed-size values in a config snapshot (native byte order, the snapshot is a local cache)
+	template <typename T> void writePod(std::ostream& os, T v) { os.write(reinterpret_cast<char const*>(&v), sizeof(v)); }
+	template <typename T> T readPod(std::istream& is) {
+		T v;
+		if (!is.read(reinterpret_cast<char*>(&v), sizeof(v))) throw std::runtime_error("Unexpected end of data");
+		return v;
+	}
+	void writeString(std::ostream& os, std::string const& str) {
+		writePod<std::uint32_t>(os, str.size());
+		os.write(str.data(), str.size());
+	}
+	std::string readString(std::istream& is) {
+		const std::uint32_t size = readPod<std::uint32_t>(is);
+		if (size > 1 << 20) throw std::runtime_error("Invalid string length");
+		std::string str(size, '\0');
+		if (size && !is.read(&str[0], size)) throw std::runtime_error("Unexpected end of data");
+		return str;
+	}
+	void writeStrings(std::ostream& os, std::vector<std::string> const& strs) {
+		writePod<std::uint32_t>(os, strs.size());
+		for (auto const& str: strs) writeString(os, str);
+	}
+	std::vector<std::string> readStrings(std::istream& is) {
+		std::vector<std::string> strs;
+		for (std::uint32_t n = readPod<std::uint32_t>(is); n; --n) strs.push_back(readString(is));
+		return strs;
+	}
+	void writeNumber(std::ostream& os, boost::variant<int, double> const& v) {
+		writePod<std::uint8_t>(os, v.which());
+		if (v.which() == 0) writePod(os, boost::get<int>(v)); else writePod(os, boost::get<double>(v));
+	}
+	boost::variant<int, double> readNumber(std::istream& is) {
+		switch (readPod<std::uint8_t>(is)) {
+		case 0: return readPod<int>(is);
+		case 1: return readPod<double>(is);
+		}
+		throw std::runtime_error("Invalid number type");
+	}
+}
+
+void ConfigItem::write(std::ostream& os) const {
+	// Values are stored by their index in Value
+	auto writeValue = [&os](Value const& v) {
+		writePod<std::uint8_t>(os, v.which());
+		switch (v.which()) {
+		case 0: writePod<std::uint8_t>(os, boost::get<bool>(v)); break;
+		case 1: writePod(os, boost::get<int>(v)); break;
+		case 2: writePod(os, boost::get<double>(v)); break;
+		case 3: writeString(os, boost::get<std::string>(v)); break;
+		case 4: writeStrings(os, boost::get<StringList>(v)); break;
+		}
+	};
+	writeString(os, m_type);
+	writeString(os, m_shortDesc);
+	writeString(os, m_longDesc);
+	writeValue(m_value);
+	writeValue(m_factoryDefaultValue);
+	writeValue(m_defaultValue);
+	writeStrings(os, m_enums);
+	writeNumber(os, m_step);
+	writeNumber(os, m_min);
+	writeNumber(os, m_max);
+	writeNumber(os, m_multiplier);
+	writeString(os, m_unit);
+	writePod<std::int32_t>(os, m_sel);
+}
+
+void ConfigItem::read(std::istream& is) {
+	auto readValue = [&is]() -> Value {
+		switch (readPod<std::uint8_t>(is)) {
+		case 0: return bool(readPod<std::uint8_t>(is));
+		case 1: return readPod<int>(is);
+		case 2: return readPod<double>(is);
+		case 3: return readString(is);
+		case 4: return readStrings(is);
+		}
+		throw std::runtime_error("Invalid value type");
+	};
+	m_type = readString(is);
+	m_shortDesc = readString(is);
+	m_longDesc = readString(is);
+	m_value = readValue();
+	m_factoryDefaultValue = readValue();
+	m_defaultValue = readValue();
+	m_enums = readStrings(is);
+	m_step = readNumber(is);
+	m_min = readNumber(is);
+	m_max = readNumber(is);
+	m_multiplier = readNumber(is);
+	m_unit = readString(is);
+	m_sel = readPod<std::int32_t>(is);
+}
+
 // These are set in readConfig, once the paths have been bootstrapped.
 fs::path systemConfFile;
 fs::path userConfFile;
@@ -413,14 +512,99 @@ int PaHostApiNameToHostApiTypeId (const std::string& name) {
 }
 
 
+namespace {
+	const unsigned SNAPSHOT_VERSION = 1;  ///< Part of the snapshot key, increment when the format changes
+	const char SNAPSHOT_MAGIC[8] = { 'P', 'C', 'O', 'N', 'F', 'I', 'G', 0 };
+
+	/// Key of the snapshot made of the given XML files (their contents, so that rewriting the same settings keeps it valid)
+	std::uint64_t snapshotKey(std::vector<fs::path> const& files) {
+		std::string key = std::to_string(SNAPSHOT_VERSION);
+		for (fs::path const& file: files) {
+			key += '\0' + file.string() + '\0';
+			fs::ifstream f(file, std::ios::binary);
+			key.append(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+		}
+		return std::hash<std::string>()(key);
+	}
+
+	/// Replace config and configMenu with the snapshot (false if it is missing, stale or invalid)
+	bool loadSnapshot(fs::path const& file, std::uint64_t key) {
+		fs::ifstream f(file, std::ios::binary);
+		char magic[sizeof(SNAPSHOT_MAGIC)];
+		if (!f.read(magic, sizeof(magic)) || std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic))) return false;
+		try {
+			if (readPod<std::uint64_t>(f) != key) return false;
+			ConfigMenu menu;
+			for (std::uint32_t n = readPod<std::uint32_t>(f); n; --n) {
+				MenuEntry me;
+				me.name = readString(f);
+				me.shortDesc = readString(f);
+				me.longDesc = readString(f);
+				me.items = readStrings(f);
+				menu.push_back(me);
+			}
+			Config items;
+			for (std::uint32_t n = readPod<std::uint32_t>(f); n; --n) {
+				std::string name = readString(f);
+				items[name].read(f);
+			}
+			configMenu.swap(menu);
+			config.swap(items);
+		} catch (std::runtime_error& e) {
+			std::clog << "config/warning: Ignoring " << file << ": " << e.what() << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	/// Store config and configMenu as they were read from the XML files
+	void saveSnapshot(fs::path const& file, std::uint64_t key) {
+		// Write to a temporary name first so that loadSnapshot never sees partial files
+		fs::create_directories(file.parent_path());
+		fs::path part = file;
+		part += ".part";
+		{
+			fs::ofstream f(part, std::ios::binary);
+			f.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+			writePod(f, key);
+			writePod<std::uint32_t>(f, configMenu.size());
+			for (MenuEntry const& me: configMenu) {
+				writeString(f, me.name);
+				writeString(f, me.shortDesc);
+				writeString(f, me.longDesc);
+				writeStrings(f, me.items);
+			}
+			writePod<std::uint32_t>(f, config.size());
+			for (auto const& elem: config) {
+				writeString(f, elem.first);
+				elem.second.write(f);
+			}
+			if (!f) throw std::runtime_error("Cannot write " + part.string());
+		}
+		fs::rename(part, file);
+	}
+}
+
 void readConfig() {
 	// Find config schema
 	fs::path schemaFile = getSchemaFilename();
 	systemConfFile = getSysConfigDir() / "config.xml";
 	userConfFile = getConfigDir() / "config.xml";
-	readConfigXML(schemaFile, 0);  // Read schema and defaults
-	readConfigXML(systemConfFile, 1);  // Update defaults with system config
-	readConfigXML(userConfFile, 2);  // Read user settings
+	// The parsed files are cached in a snapshot, which is used as long as none of them changes
+	const std::uint64_t key = snapshotKey({ schemaFile, systemConfFile, userConfFile });
+	const fs::path snapshot = getCacheDir() / "config.bin";
+	if (loadSnapshot(snapshot, key)) {
+		std::clog << "config/info: Loaded " << snapshot << " (the config files have not changed)" << std::endl;
+	} else {
+		readConfigXML(schemaFile, 0);  // Read schema and defaults
+		readConfigXML(systemConfFile, 1);  // Update defaults with system config
+		readConfigXML(userConfFile, 2);  // Read user settings
+		try {
+			saveSnapshot(snapshot, key);
+		} catch (std::exception& e) {
+			std::clog << "config/warning: Cannot save the config snapshot: " << e.what() << std::endl;
+		}
+	}
 	pathInit();
 	// Populate themes
 	ConfigItem& ci = config["game/theme"];
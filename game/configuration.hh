@@ -3,6 +3,7 @@
 #include "libxml++.hh"
 
 #include <boost/variant.hpp>
+#include <iosfwd>
 #include <map>
 #include <string>
 #include <vector>
@@ -42,6 +43,8 @@ class ConfigItem {
 	void addEnum(std::string name); ///< Dynamically adds an enum to all values
 	void selectEnum(std::string const& name); ///< Set integer value by enum name
 	std::string const getEnumName() const; ///< Returns the selected enum option's text
+	void write(std::ostream& os) const; ///< Write the item to a binary config snapshot
+	void read(std::istream& is); ///< Read an item written by write (throws std::runtime_error if the data is invalid)
 	std::string oldValue;
 	
   private:
@@ -1,9 +1,13 @@
 #ifdef USE_PORTMIDI
 
+#include "chrono.hh"
 #include "controllers.hh"
 #include "fs.hh"
 #include "portmidi.hh"
 #include "regex.hh"
+#include <porttime.h>
+#include <algorithm>
+#include <deque>
 #include <unordered_map>
 
 namespace input {
@@ -34,10 +38,14 @@ namespace input {
 			name << dev << ": " << info->name;
 			return name.str();
 		}
+		/// Called by the input thread of Controllers. Everything buffered by PortMidi is read at once and each
+		/// event gets the time when PortMidi received it (on the Clock timeline), not the time of the read.
 		bool process(Event& event) override {
-			PmEvent ev;
-			for (auto it = m_streams.begin(); it != m_streams.end(); ++it) {
-				if (Pm_Read(*it->second, &ev, 1) != 1) continue;
+			if (m_pending.empty()) read();
+			while (!m_pending.empty()) {
+				Pending const p = m_pending.front();
+				m_pending.pop_front();
+				PmEvent const& ev = p.event;
 				unsigned char evnt = ev.message & 0xF0;
 				unsigned char note = ev.message >> 8;
 				unsigned char vel  = ev.message >> 16;
@@ -45,16 +53,45 @@ namespace input {
 				if (evnt == 0x80 /* NOTE OFF */) { evnt = 0x90; vel = 0; }  // Translate NOTE OFF into NOTE ON with zero-velocity
 				if (evnt != 0x90 /* NOTE ON */) continue;  // Ignore anything that isn't NOTE ON/OFF
 				std::clog << "controller-midi/info: MIDI NOTE ON/OFF event: ch=" << unsigned(chan) << " note=" << unsigned(note) << " vel=" << unsigned(vel) << std::endl;
-				event.source = SourceId(SOURCETYPE_MIDI, it->first, chan);
+				event.source = SourceId(SOURCETYPE_MIDI, p.dev, chan);
 				event.hw = note;
 				event.value = vel / 127.0;
+				event.time = p.time;
 				return true;
 			}
 			return false;
 		}
 	private:
+		/// Events further back than this are from a stalled reader or a bogus timestamp and get the time of the read
+		static const PmTimestamp MAX_AGE_MS = 200;
+		static const int BATCH = 64;  ///< Events per Pm_Read
+		struct Pending {
+			unsigned dev;
+			PmEvent event;
+			Time time;
+		};
+		/// Read the events buffered by all streams into m_pending
+		void read() {
+			// PortMidi stamps the events with PortTime (milliseconds), which is mapped to Clock at the read
+			const PmTimestamp pmNow = Pt_Time();
+			const Time now = Clock::now();
+			for (auto& stream: m_streams) {
+				while (true) {
+					const int count = Pm_Read(*stream.second, m_buffer, BATCH);
+					for (int i = 0; i < count; ++i) {
+						const PmTimestamp age = pmNow - m_buffer[i].timestamp;
+						const Time time = age >= 0 && age <= MAX_AGE_MS ? now - std::chrono::milliseconds(age) : now;
+						m_pending.push_back(Pending{ stream.first, m_buffer[i], time });
+					}
+					if (count < BATCH) break;  // Drained (or an error, a negative count)
+				}
+			}
+			std::stable_sort(m_pending.begin(), m_pending.end(), [](Pending const& a, Pending const& b) { return a.time < b.time; });
+		}
 		pm::Initialize m_init;
 		std::unordered_map<unsigned, std::unique_ptr<pm::Input>> m_streams;
+		std::deque<Pending> m_pending;  ///< Read but not yet processed, in order of arrival
+		PmEvent m_buffer[BATCH];
 	};
 
 	Hardware::ptr constructMidi() { return Hardware::ptr(new Midi()); }
@@ -3,13 +3,18 @@
 #include "chrono.hh"
 #include "fs.hh"
 #include "libxml++-impl.hh"
+#include "log.hh"
+#include "profiler.hh"
+#include "threads.hh"
 #include "unicode.hh"
 #include <boost/filesystem.hpp>
 #include <SDL2/SDL_joystick.h>
 #include "regex.hh"
 
+#include <atomic>
 #include <deque>
 #include <stdexcept>
+#include <thread>
 #include <algorithm>
 
 using namespace input;
@@ -141,6 +146,10 @@ struct Controllers::Impl {
 
 	Time m_prevProcess{};
 
+	SpscQueue<Event, 1024> m_polled;  ///< Events of polled hardware (MIDI) from the input thread
+	std::atomic<bool> m_quit{ false };
+	std::thread m_pollThread;
+
 	Impl(): m_eventsEnabled() {
 		#define DEFINE_BUTTON(devtype, button, num, nav) m_buttons[DEVTYPE_##devtype][#button] = devtype##_##button;
 		#include "controllers-buttons.ii"
@@ -149,6 +158,33 @@ struct Controllers::Impl {
 		m_hw[SOURCETYPE_KEYBOARD] = constructKeyboard();
 		m_hw[SOURCETYPE_JOYSTICK] = constructJoysticks();
 		if (Hardware::midiEnabled()) m_hw[SOURCETYPE_MIDI] = constructMidi();
+		// Only MIDI needs polling (m_hw must not change after this)
+		if (m_hw.count(SOURCETYPE_MIDI)) m_pollThread = std::thread(&Impl::poll, this);
+	}
+	~Impl() {
+		m_quit = true;
+		if (m_pollThread.joinable()) m_pollThread.join();
+	}
+	/// Input thread: poll hardware often, so that events get the time they arrived rather than the time of the frame
+	/// (MIDI events carry their arrival time anyway, but a busy main loop must not hold them back)
+	void poll() {
+		threads::enter(threads::Class::audio, "input");  // Drum hits are judged as they come, like the mics
+
+		// An event taken from the hardware when the queue was full (main loop not running), pushed before any other
+		Event held;
+		bool holding = false;
+		while (!m_quit) {
+			if (holding && m_polled.push(held)) holding = false;
+			for (auto it = m_hw.begin(); !holding && it != m_hw.end(); ++it) {
+				while (true) {
+					Event event;
+					event.time = Clock::now();
+					if (!it->second->process(event)) break;
+					if (!m_polled.push(event)) { held = event; holding = true; break; }  // The rest wait in the hardware
+				}
+			}
+			std::this_thread::sleep_for(1ms);
+		}
 	}
 	
 	void readControllers(fs::path const& file) {
@@ -272,16 +308,9 @@ struct Controllers::Impl {
 		m_eventsEnabled = state;
 		Hardware::enableKeyboardInstruments(state);
 	}
-	/// Do internal event processing (poll for MIDI events etc)
+	/// Do internal event processing (events polled by the input thread etc)
 	void process(Time now) {
-		for (auto& typehw: m_hw) {
-			while (true) {
-				Event event;
-				event.time = now;
-				if (!typehw.second->process(event)) break;
-				pushHWEvent(event);
-			}
-		}
+		for (Event event; m_polled.tryPop(event); ) pushHWEvent(event);
 		// Reset all key repeat timers if there is a latency spike
 		if (now - m_prevProcess > 50ms) {
 			for (auto& kv: m_navRepeat) kv.second.time = now;
@@ -297,7 +326,7 @@ struct Controllers::Impl {
 			// Note: We intentionally only emit one per frame (call to process) to avoid surprises when latency spikes occur.
 			++ne.repeat;
 			ne.time += clockDur(delay);  // Increment rather than set to now, so that repeating is smoother.
-			std::clog << "controllers/debug: NavEvent auto repeat " << ne.repeat << " after " << since.count() << " s, next delay " << delay.count() << "s " << std::endl;
+			LOG("controllers", debug) << "NavEvent auto repeat " << ne.repeat << " after " << since.count() << " s, next delay " << delay.count() << "s " << std::endl;
 			m_navEvents.push_back(ne);
 		}
 	}
@@ -316,7 +345,7 @@ struct Controllers::Impl {
 		std::pair<Assignments::iterator, bool> ret = m_assignments.insert(Assignments::value_type(event.source, nullptr));
 		ControllerDef const*& def = ret.first->second;  // A reference to the value inside the map
 		if (!ret.second) return def;  // Source already assigned, just return it.
-		std::string devName = m_hw[event.source.type]->getName(event.source.device);
+		std::string devName = m_hw.at(event.source.type)->getName(event.source.device);
 		// Find a matching ControllerDef
 		for (ControllerDefs::const_iterator it = m_controllerDefs.begin(); it != m_controllerDefs.end() && !def; ++it) {
 			if (it->second.matches(event, devName)) def = &it->second;
@@ -359,7 +388,7 @@ struct Controllers::Impl {
 	bool pushMappedEvent(Event& ev) {
 		if (ev.button == GENERIC_UNASSIGNED) return false;
 		if (!valueChanged(ev)) return false;  // Avoid repeated or other useless events
-		std::clog << "controllers/debug: processing " << ev << std::endl;
+		LOG("controllers", debug) << "processing " << ev << std::endl;
 		ev.nav = navigation(ev);
 		// Emit nav event (except if device is currently registered for events)
 		if (ev.nav != NAV_NONE) {
@@ -412,14 +441,11 @@ void Controllers::enableEvents(bool state) { self->enableEvents(state); }
 void Controllers::process(Time now) { self->process(now); }
 bool Controllers::pushEvent(SDL_Event const& ev, Time t) { return self->pushEvent(ev, t); }
 
-bool Device::getEvent(Event& ev) {
-	if (m_events.empty()) return false;
-	ev = m_events.front();
-	m_events.pop_front();
-	return true;
-}
+bool Device::getEvent(Event& ev) { return m_events.tryPop(ev); }
 
 void Device::pushEvent(Event const& ev) {
-	m_events.push_back(ev);
+	if (m_events.push(ev)) return;
+	// Nobody is reading the events (e.g. an orphan device), the queue holds a few seconds of furious play
+	if (m_dropped++ == 0) LOG("controllers", debug) << "Event queue of a device is full, dropping events" << std::endl;
 }
 
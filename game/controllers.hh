@@ -2,6 +2,7 @@
 
 #include "chrono.hh"
 #include "configuration.hh"
+#include "spscqueue.hh"
 #include "util.hh"
 #include <SDL2/SDL_events.h>
 #include <climits>
@@ -79,18 +80,19 @@ namespace input {
 		explicit NavEvent(Event const& ev): source(ev.source), devType(ev.devType), button(ev.nav), menu(), time(ev.time), repeat() {}
 	};
 	
-	/// A handle for receiving device events
+	/// A handle for receiving device events. The events are passed from the controller processing to the device owner
+	/// through a fixed-size lock-free queue (events that do not fit are dropped), so neither side allocates or blocks.
 	class Device {
-		typedef std::deque<Event> Events;
-		Events m_events;
+		SpscQueue<Event, 256> m_events;
+		unsigned m_dropped = 0;
 	public:
 		Device(const Device&) = delete;
   		const Device& operator=(const Device&) = delete;
 		const SourceId source;
 		const DevType type;
 		Device(SourceId const& source, DevType type): source(source), type(type) {}
-		bool getEvent(Event&);
-		void pushEvent(Event const&);
+		bool getEvent(Event&);  ///< Consumer only
+		void pushEvent(Event const&);  ///< Producer only
 	};
 	typedef std::shared_ptr<Device> DevicePtr;
 
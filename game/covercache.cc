@@ -0,0 +1,54 @@
+#include "covercache.hh"
+
+#include "configuration.hh"
+#include "texture.hh"
+
+namespace {
+	/// Textures used this recently are (probably) on screen
+	const std::chrono::milliseconds IN_USE(500);
+}
+
+CoverCache::CoverCache(): m_limit(std::size_t(config["graphic/cover_cache_mb"].i()) << 20) {}
+
+CoverCache::~CoverCache() {}
+
+Texture& CoverCache::get(fs::path const& image) {
+	Clock::time_point now = Clock::now();
+	std::string key = image.string();
+	auto it = m_entries.find(key);
+	if (it == m_entries.end()) {
+		m_lru.push_front(key);
+		Entry e{ std::make_unique<Texture>(image, Texture::THUMBNAIL_SIZE), m_lru.begin(), 0, now };
+		it = m_entries.emplace(key, std::move(e)).first;
+	} else {
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	}
+	Entry& e = it->second;
+	e.used = now;
+	// The size changes once the image has been loaded
+	m_bytes += e.texture->bytes() - e.bytes;
+	e.bytes = e.texture->bytes();
+	trim(now);
+	m_memory.set(m_bytes);
+	return *e.texture;
+}
+
+void CoverCache::clear() {
+	m_entries.clear();
+	m_lru.clear();
+	m_bytes = 0;
+	m_memory.set(0);
+}
+
+void CoverCache::trim(Clock::time_point now) {
+	while (m_bytes > m_limit && !m_lru.empty()) {
+		auto it = m_entries.find(m_lru.back());
+		Entry& e = it->second;
+		m_bytes += e.texture->bytes() - e.bytes;  // May have finished loading since it was last used
+		e.bytes = e.texture->bytes();
+		if (now - e.used < IN_USE) break;  // Everything else is even more recent
+		m_bytes -= e.bytes;
+		m_lru.pop_back();
+		m_entries.erase(it);
+	}
+}
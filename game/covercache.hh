@@ -0,0 +1,42 @@
+#pragma once
+
+#include "fs.hh"
+#include "memstats.hh"
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+class Texture;
+
+/**
+* Cover thumbnail textures shared by the song browser and the playlist screen.
+* The textures are kept within graphic/cover_cache_mb of (estimated) video memory by dropping the least
+* recently used ones; anything used in the last moment is on screen and is never dropped.
+**/
+class CoverCache {
+  public:
+	CoverCache();
+	~CoverCache();
+	/// The thumbnail texture of image (loaded in the background on first use)
+	Texture& get(fs::path const& image);
+	/// Drop all textures
+	void clear();
+
+  private:
+	typedef std::chrono::steady_clock Clock;
+	struct Entry {
+		std::unique_ptr<Texture> texture;
+		std::list<std::string>::iterator lru;
+		std::size_t bytes;  ///< Texture size when last checked
+		Clock::time_point used;
+	};
+	void trim(Clock::time_point now);
+	std::size_t m_limit;
+	std::size_t m_bytes = 0;  ///< Sum of Entry::bytes
+	memstats::Usage m_memory{ "textures/covers", memstats::Kind::VRAM };
+	std::list<std::string> m_lru;  ///< Most recently used first
+	std::unordered_map<std::string, Entry> m_entries;
+};
@@ -220,10 +220,17 @@ bool DanceGraph::difficulty(DanceDifficulty level, bool check_only) {
 	DanceDifficultyMap const& ddm = m_song.danceTracks.find(m_gamingMode)->second;
 	if (ddm.find(level) == ddm.end()) return false;	else if (check_only) return true;
 	m_notes.clear();
-	DanceTrack const& track = ddm.find(level)->second;
-	for (auto const& n: track.notes) m_notes.push_back(DanceNote(n));
+	for (auto const& n: m_song.danceNotes(m_gamingMode, level)) m_notes.push_back(DanceNote(n));
 	std::sort(m_notes.begin(), m_notes.end(), lessEnd()); // for engine's iterators
 	m_notesIt = m_notes.begin();
+	m_longestNote = 0.0;
+	for (auto& lane: m_laneNotes) lane.clear();
+	for (std::size_t i = 0; i < m_notes.size(); ++i) {
+		Note const& n = m_notes[i].note;
+		if (unsigned(n.note) < max_panels) m_laneNotes[n.note].push_back(i);
+		m_longestNote = std::max(m_longestNote, n.end - n.begin);
+	}
+	for (auto& cursor: m_laneCursors) cursor = 0;
 	m_level = level;
 	for (auto& noteIt: m_activeNotes) noteIt = m_notes.end();
 	m_scoreFactor = 1;
@@ -235,7 +242,9 @@ bool DanceGraph::difficulty(DanceDifficulty level, bool check_only) {
 /// Handles input and some logic
 void DanceGraph::engine() {
 	double time = m_audio.getPosition();
-	time -= config["audio/controller_delay"].f();
+	const Time now = Clock::now();
+	static ConfigItem& controllerDelay = config["audio/controller_delay"];
+	time -= controllerDelay.f();
 	doUpdates();
 	// Handle stops
 	bool outsideStop = true;
@@ -280,11 +289,11 @@ void DanceGraph::engine() {
 			// Gaming controls
 			if (ev.value == 0.0) {
 				m_pressed[ev.button] = false;
-				dance(time, ev);
+				dance(eventTime(time, ev, now), ev);
 				m_pressed_anim[ev.button].setTarget(0.0);
 			} else if (ev.value != 0.0) {
 				m_pressed[ev.button] = true;
-				dance(time, ev);
+				dance(eventTime(time, ev, now), ev);
 				m_pressed_anim[ev.button].setValue(1.0);
 			}
 		}
@@ -303,14 +312,22 @@ void DanceGraph::engine() {
 		}
 		if (!joining(time)) ++m_dead;  // Increment dead counter (but not while joining)
 	}
+	for (unsigned lane = 0; lane < max_panels; ++lane) {
+		std::size_t& cursor = m_laneCursors[lane];
+		while (cursor < m_laneNotes[lane].size() && time > m_notes[m_laneNotes[lane][cursor]].note.end + maxTolerance) ++cursor;
+	}
 	if (difficulty_changed) m_dead = 0; // if difficulty is changed, m_dead would get incorrect
 
 	// Holding button when mine comes?
-	for (auto it = m_notesIt; it != m_notes.end() && time <= it->note.begin + maxTolerance; ++it) {
-		if(!it->isHit && it->note.type == Note::MINE && m_pressed[it->note.note] &&
-		  it->note.begin >= time - maxTolerance && it->note.end <= time + maxTolerance) {
-			it->isHit = true;
-			m_score -= points(0);
+	for (unsigned lane = 0; lane < max_panels; ++lane) {
+		if (!m_pressed[lane]) continue;
+		for (std::size_t i = m_laneCursors[lane]; i < m_laneNotes[lane].size(); ++i) {
+			DanceNote& n = m_notes[m_laneNotes[lane][i]];
+			if (n.note.begin > time + maxTolerance) break;  // The rest of the lane comes later
+			if (!n.isHit && n.note.type == Note::MINE && n.note.begin >= time - maxTolerance && n.note.end <= time + maxTolerance) {
+				n.isHit = true;
+				m_score -= points(0);
+			}
 		}
 	}
 
@@ -337,9 +354,12 @@ void DanceGraph::dance(double time, input::Event const& ev) {
 		return;
 	}
 
-	// So it was a PRESS event
-	for (auto it = m_notesIt; it != m_notes.end() && time <= it->note.end + maxTolerance; ++it) {
-		if(!it->isHit && std::abs(time - it->note.begin) <= maxTolerance && ev.button == unsigned(it->note.note)) {
+	// So it was a PRESS event: only the arrows of its lane within the timing window can be hit
+	auto const& lane = m_laneNotes[ev.button];
+	for (std::size_t i = m_laneCursors[ev.button]; i < lane.size(); ++i) {
+		auto it = m_notes.begin() + lane[i];
+		if (it->note.begin > time + maxTolerance) break;  // The rest of the lane comes later
+		if(!it->isHit && std::abs(time - it->note.begin) <= maxTolerance) {
 			it->isHit = true;
 			if (it->note.type != Note::MINE) {
 				it->score = points(it->note.begin - time);
@@ -375,14 +395,35 @@ namespace {
 	}
 }
 
-/// Draw a dance pad icon using the given texture
-void DanceGraph::drawArrow(int arrow_i, Texture& tex, float ty1, float ty2) {
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(tex.type(), tex.id());
+/// Draw a dance pad icon using the given texture at each instance
+void DanceGraph::drawArrow(int arrow_i, Texture& tex, std::vector<glutil::InstanceInfo> const& instances, float ty1, float ty2) {
+	glutil::bindTexture(tex.type(), tex.id());
 	glutil::VertexArray va;
 	vertexPair(va, arrow_i, -arrowSize, ty1);
 	vertexPair(va, arrow_i,  arrowSize, ty2);
-	va.draw();
+	va.drawInstanced(instances);
+}
+
+void DanceGraph::queueArrow(ArrowKind kind, int arrow_i, float x, float y, double glow) {
+	glutil::InstanceInfo inst;
+	inst.position = glmath::vec2(x, y);
+	inst.glow = static_cast<float>(glow);
+	inst.type = kind;  // Matches noteType of dancenote.vert
+	m_arrowInstances[kind][kind == ARROW_MINE ? 0 : arrow_i].push_back(inst);
+}
+
+void DanceGraph::drawArrows() {
+	Texture* textures[ARROW_KINDS] = { &m_arrows_cursor, &m_arrows, &m_arrows_hold, &m_mine };
+	for (unsigned kind = 0; kind < ARROW_KINDS; ++kind) {
+		for (unsigned arrow_i = 0; arrow_i < max_panels; ++arrow_i) {
+			auto& instances = m_arrowInstances[kind][arrow_i];
+			if (instances.empty()) continue;
+			if (kind == ARROW_MINE) drawArrow(-1, *textures[kind], instances);
+			else if (kind == ARROW_HOLD) drawArrow(arrow_i, *textures[kind], instances, 0.0f, 1.0f/3.0f);  // Begin of the hold
+			else drawArrow(arrow_i, *textures[kind], instances);
+			instances.clear();
+		}
+	}
 }
 
 /// Draws the dance graph
@@ -405,29 +446,27 @@ void DanceGraph::draw(double time) {
 		// Draw the "neck" graph (beat lines)
 		drawBeats(time);
 
+		UseShader us(getShader("dancenote"));
+		m_uniforms.clock = static_cast<float>(time);
+		m_uniforms.scale = getScale();
+		glutil::UniformArena::current()->bind(m_uniforms);
+
 		// Arrows on cursor
-		{
-			UseShader us(getShader("dancenote"));
-			m_uniforms.clock = static_cast<float>(time);
-			m_uniforms.noteType = 0;
-			m_uniforms.scale = getScale();
-			for (unsigned arrow_i = 0; arrow_i < m_pads; ++arrow_i) {
-				float l = m_pressed_anim[arrow_i].get();
-				m_uniforms.hitAnim = l;
-				m_uniforms.position = glmath::vec2(panel2x(arrow_i), time2y(0.0));
-				glBufferSubData(GL_UNIFORM_BUFFER, m_uniforms.offset(), m_uniforms.size(), &m_uniforms);
-				drawArrow(arrow_i, m_arrows_cursor);
-			}
+		for (unsigned arrow_i = 0; arrow_i < m_pads; ++arrow_i) {
+			queueArrow(ARROW_CURSOR, arrow_i, panel2x(arrow_i), time2y(0.0), m_pressed_anim[arrow_i].get());
 		}
+		drawArrows();
 
-		// Draw the notes
+		// Draw the notes (hold bodies right away, arrows are queued)
 		if (time == time) { // Check that time is not NaN
-			for (auto& n: m_notes) {
-				if (n.note.end - time < past) continue;
-				if (n.note.begin - time > future) continue;
-				drawNote(n, time); // Let's just do all the calculating in the sub, instead of passing them as a long list
+			// From the first note not past, until the ends are too far for even the longest note to begin on screen
+			auto it = std::lower_bound(m_notes.begin(), m_notes.end(), past, [time](DanceNote const& n, float p) { return n.note.end - time < p; });
+			for (; it != m_notes.end() && it->note.end - time <= future + m_longestNote; ++it) {
+				if (it->note.begin - time > future) continue;
+				drawNote(*it, time); // Let's just do all the calculating in the sub, instead of passing them as a long list
 			}
 		}
+		drawArrows();
 	}
 	drawInfo(time, dimensions); // Go draw some texts and other interface stuff
 }
@@ -472,10 +511,6 @@ void DanceGraph::drawNote(DanceNote& note, double time) {
 
 	{
 		UseShader us(getShader("dancenote"));
-		m_uniforms.hitAnim = static_cast<float>(glow);
-		m_uniforms.clock = static_cast<float>(time);
-		m_uniforms.scale = getScale();
-
 		if (yEnd - yBeg > arrowSize) {
 			// Draw holds
 			if (note.isHit && note.releaseTime <= 0) { // The note is being held down
@@ -483,14 +518,10 @@ void DanceGraph::drawNote(DanceNote& note, double time) {
 				yEnd = std::max(time2y(0.0), yEnd);
 			}
 			if (note.releaseTime > 0) yBeg = time2y(note.releaseTime - time); // Oh noes, it got released!
-			m_uniforms.noteType = 2;
-			m_uniforms.position = glmath::vec2(x, yBeg);
-			glBufferSubData(GL_UNIFORM_BUFFER, m_uniforms.offset(), m_uniforms.size(), &m_uniforms);
 			// Draw begin
-			drawArrow(arrow_i, m_arrows_hold, 0.0f, 1.0f/3.0f);
+			queueArrow(ARROW_HOLD, arrow_i, x, yBeg, glow);
 			if (yEnd - yBeg > 0) {
-				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(m_arrows_hold.type(), m_arrows_hold.id());
+				glutil::bindTexture(m_arrows_hold.type(), m_arrows_hold.id());
 				glutil::VertexArray va;
 				// Middle
 				vertexPair(va, arrow_i, arrowSize, 1.0f/3.0f);
@@ -499,15 +530,16 @@ void DanceGraph::drawNote(DanceNote& note, double time) {
 				vertexPair(va, arrow_i, yMid, 2.0f/3.0f);
 				// End
 				vertexPair(va, arrow_i, l, 1.0f);
-				va.draw();
+				glutil::InstanceInfo inst;
+				inst.position = glmath::vec2(x, yBeg);
+				inst.glow = static_cast<float>(glow);
+				inst.type = ARROW_HOLD;
+				va.drawInstanced({ inst });  // The only instance of its length
 			}
 		} else {
 			// Draw short note
 			if (mine && note.isHit) yBeg = time2y(0.0);
-			m_uniforms.noteType = (mine ? 3 : 1);
-			m_uniforms.position = glmath::vec2(x, yBeg);
-			glBufferSubData(GL_UNIFORM_BUFFER, m_uniforms.offset(), m_uniforms.size(), &m_uniforms);
-			drawArrow((mine ? -1 : arrow_i), (mine ? m_mine : m_arrows));
+			queueArrow(mine ? ARROW_MINE : ARROW_NOTE, arrow_i, x, yBeg, glow);
 		}
 	}
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "instrumentgraph.hh"
+#include <cstdint>
 
 class Song;
 
@@ -51,17 +52,28 @@ class DanceGraph: public InstrumentGraph {
 	void drawBeats(double time);
 	void drawNote(DanceNote& note, double time);
 	void drawInfo(double time, Dimensions dimensions);
-	void drawArrow(int arrow_i, Texture& tex, float ty1 = 0.0, float ty2 = 1.0);
+	/// Kinds of arrows, each drawn from its own texture
+	enum ArrowKind { ARROW_CURSOR, ARROW_NOTE, ARROW_HOLD, ARROW_MINE, ARROW_KINDS };
+	/// Queue an arrow to be drawn by drawArrows (arrow_i is ignored for mines)
+	void queueArrow(ArrowKind kind, int arrow_i, float x, float y, double glow);
+	/// Draw the queued arrows with one instanced draw call per kind and lane
+	void drawArrows();
+	void drawArrow(int arrow_i, Texture& tex, std::vector<glutil::InstanceInfo> const& instances, float ty1 = 0.0, float ty2 = 1.0);
 
 	// Helpers
 	float panel2x(int i) const { return getScale() * (-(m_pads * 0.5f) + m_arrow_map[i] + 0.5f); } /// Get x for an arrow line
 	float getScale() const { return 1.0f / m_pads * 8.0f; }
 	double getNotesBeginTime() const { return m_notes.front().note.begin; }
 	glutil::danceNoteUniforms m_uniforms;
+	std::vector<glutil::InstanceInfo> m_arrowInstances[ARROW_KINDS][max_panels];  ///< Queued by queueArrow
 
 	// Note stuff
-	DanceNotes m_notes; /// contains the dancing notes for current game mode and difficulty
+	DanceNotes m_notes; /// contains the dancing notes for current game mode and difficulty (sorted by end)
 	DanceNotes::iterator m_notesIt; /// the first note that hasn't gone away yet
+	/// Indices of the notes of each lane in m_notes (sorted by end, and thus by begin as the notes of a lane do not overlap)
+	std::vector<std::uint32_t> m_laneNotes[max_panels];
+	std::size_t m_laneCursors[max_panels] = {}; /// the first note of each lane that hasn't gone away yet (in m_laneNotes)
+	double m_longestNote = 0.0; /// duration of the longest note (for finding the ones to draw)
 	DanceNotes::iterator m_activeNotes[max_panels]; /// hold notes that are currently pressed down
 
 	// Textures
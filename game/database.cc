@@ -2,8 +2,139 @@
 
 #include "libxml++-impl.hh"
 #include "i18n.hh"
+#include "threads.hh"
 #include <boost/filesystem.hpp>
+#include <algorithm>
+#include <ctime>
 #include <iostream>
+#include <map>
+
+namespace {
+	/// Compact the journals into the database file after this many records
+	const unsigned COMPACT_RECORDS = 1000;
+
+	/// Journals of the database file by serial
+	std::map<unsigned, fs::path> journals(fs::path const& filename) {
+		std::map<unsigned, fs::path> ret;
+		const std::string prefix = filename.filename().string() + ".", suffix = ".journal";
+		boost::system::error_code ec;
+		for (fs::directory_iterator it(filename.parent_path(), ec), end; !ec && it != end; it.increment(ec)) {
+			std::string name = it->path().filename().string();
+			if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0) continue;
+			if (name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) continue;
+			std::string serial = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+			if (serial.find_first_not_of("0123456789") != std::string::npos) continue;
+			try { ret[std::stoul(serial)] = it->path(); } catch (std::exception&) {}
+		}
+		return ret;
+	}
+
+	fs::path journalPath(fs::path const& filename, unsigned serial) {
+		return filename.string() + "." + std::to_string(serial) + ".journal";
+	}
+
+	/// For attribute values and text of journal records (on a single line)
+	std::string escape(std::string const& str) {
+		std::string ret;
+		for (char ch: str) {
+			switch (ch) {
+			  case '&': ret += "&amp;"; break;
+			  case '<': ret += "&lt;"; break;
+			  case '>': ret += "&gt;"; break;
+			  case '"': ret += "&quot;"; break;
+			  case '\n': ret += "&#10;"; break;
+			  case '\r': ret += "&#13;"; break;
+			  case '\t': ret += "&#9;"; break;
+			  default: ret += ch;
+			}
+		}
+		return ret;
+	}
+
+	bool attribute(xmlpp::TextReader& reader, char const* name, std::string& value) {
+		if (!reader.move_to_attribute(name)) return false;
+		value = reader.get_value();
+		reader.move_to_element();
+		return true;
+	}
+
+	std::string requireAttribute(xmlpp::TextReader& reader, char const* name) {
+		std::string value;
+		if (!attribute(reader, name, value)) throw std::runtime_error(reader.get_name() + " without attribute " + name);
+		return value;
+	}
+
+	/**Load the elements of a database file or journal as they are read, without building a DOM.
+	  @return the journal serial of the root element (0 if none)
+	  @exception std::exception on parse errors, missing attributes or invalid values
+	  */
+	unsigned read(xmlpp::TextReader& reader, Players& players, SongItems& songs, Hiscore& hiscores) {
+		unsigned serial = 0;
+		while (reader.read()) {
+			if (!xmlpp::is_element(reader)) continue;
+			const std::string name = reader.get_name();
+			std::string value;
+			if (reader.get_depth() == 0) {
+				if (attribute(reader, "journal", value)) serial = std::stoul(value);
+			} else if (name == "player") {
+				const std::string playerName = requireAttribute(reader, "name");
+				const std::string idText = requireAttribute(reader, "id");
+				int id = -1;
+				try { id = std::stoi(idText); } catch (std::exception&) { }
+				std::string picture;  // optional picture element
+				if (!reader.is_empty_element()) {
+					const int depth = reader.get_depth();
+					while (reader.read() && reader.get_depth() > depth) {
+						if (xmlpp::is_element(reader) && reader.get_name() == "picture") picture = reader.read_string();
+					}
+				}
+				players.addPlayer(playerName, picture, id);
+			} else if (name == "song") {
+				int id = std::stoi(requireAttribute(reader, "id"));
+				id = songs.addSongItem(requireAttribute(reader, "artist"), requireAttribute(reader, "title"), id);
+				std::string lastPlayed = "0";
+				attribute(reader, "lastPlayed", lastPlayed);
+				if (attribute(reader, "plays", value)) songs.played(id, std::stoll(lastPlayed), std::stoul(value));
+			} else if (name == "play") {
+				songs.played(std::stoi(requireAttribute(reader, "songid")), std::stoll(requireAttribute(reader, "time")));
+			} else if (name == "hiscore") {
+				const int playerid = std::stoi(requireAttribute(reader, "playerid"));
+				const int songid = std::stoi(requireAttribute(reader, "songid"));
+				std::string track = "vocals";
+				attribute(reader, "track", track);
+				const std::string score = reader.is_empty_element() ? std::string() : std::string(reader.read_string());
+				if (score.empty()) throw std::runtime_error("Score not found");
+				const std::size_t count = hiscores.size();
+				hiscores.addHiscore(std::stoi(score), playerid, songid, track);
+				if (hiscores.size() != count) songs.scored(songid, std::stoi(score), playerid);
+			}
+		}
+		return serial;
+	}
+
+	/// Save a copy of the contents (made by the caller, so this can run in any thread), followed by journals from serial
+	void write(fs::path const& filename, unsigned serial, Players::players_t const& players, SongItems const& songs, Hiscore const& hiscores) {
+		try {
+			create_directories(filename.parent_path());
+			fs::path tmp = filename.string() + ".tmp";
+			{
+				xmlpp::Document doc;
+				auto nodeRoot = doc.create_root_node("performous");
+				nodeRoot->set_attribute("journal", std::to_string(serial));
+				Players::save(xmlpp::add_child_element(nodeRoot, "players"), players);
+				songs.save(xmlpp::add_child_element(nodeRoot, "songs"));
+				hiscores.save(xmlpp::add_child_element(nodeRoot, "hiscores"));
+				doc.write_to_file_formatted(tmp.string(), "UTF-8");
+			}
+			rename(tmp, filename);
+			// The older journals are in the file now
+			for (auto const& j: journals(filename)) if (j.first < serial) remove(j.second);
+			std::clog << "database/info: Saved " << players.size() << " players, " << songs.size() << " songs and " << hiscores.size() << " hiscores to " << filename.string() << std::endl;
+		} catch (std::exception const& e) {
+			std::clog << "database/error: Could not save " + filename.string() + ": " + e.what() << std::endl;
+		}
+	}
+}
 
 Database::Database(fs::path const& filename): m_filename(filename) {
 	load();
@@ -14,45 +145,84 @@ Database::~Database() {
 }
 
 void Database::load() {
-	if (!exists(m_filename)) return;
-	try {
-		xmlpp::DomParser domParser(m_filename.string());
-		xmlpp::Node* nodeRoot = domParser.get_document()->get_root_node();
-		m_players.load(nodeRoot->find("/performous/players/player"));
-		m_songs.load(nodeRoot->find("/performous/songs/song"));
-		m_hiscores.load(nodeRoot->find("/performous/hiscores/hiscore"));
-		std::clog << "database/info: Loaded " << m_players.size() << " players, " << m_songs.size() << " songs and " << m_hiscores.size() << " hiscores from " << m_filename.string() << std::endl;
-	} catch (std::exception& e) {
-		std::clog << "database/error: Error loading " + m_filename.string() + ": " + e.what() << std::endl;
+	if (exists(m_filename)) {
+		try {
+			xmlpp::TextReader reader(m_filename.string());
+			m_serial = read(reader, m_players, m_songs, m_hiscores);
+			std::clog << "database/info: Loaded " << m_players.size() << " players, " << m_songs.size() << " songs and " << m_hiscores.size() << " hiscores from " << m_filename.string() << std::endl;
+		} catch (std::exception& e) {
+			std::clog << "database/error: Error loading " + m_filename.string() + ": " + e.what() << std::endl;
+		}
+	}
+	for (auto const& j: journals(m_filename)) {
+		if (j.first < m_serial) continue;  // Already in the file (left over from a compaction that was interrupted)
+		m_serial = j.first + 1;  // Continue in a new journal
+		try {
+			std::ifstream f(j.second.string(), std::ios::binary);
+			std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+			text.erase(text.rfind('\n') + 1);  // An incomplete record if writing it was interrupted
+			const std::string doc = "<journal>" + text + "</journal>";
+			xmlpp::TextReader reader(reinterpret_cast<unsigned char const*>(doc.data()), doc.size());
+			read(reader, m_players, m_songs, m_hiscores);
+			m_journalRecords += std::count(text.begin(), text.end(), '\n');
+		} catch (std::exception& e) {
+			std::clog << "database/error: Error loading " + j.second.string() + ": " + e.what() << std::endl;
+		}
 	}
 }
 
 void Database::save() {
-	try {
+	compact(false);
+}
+
+void Database::compact(bool background) {
+	if (m_compactor.joinable()) {
+		if (background && m_compacting) return;  // Try again after the next record
+		m_compactor.join();
+	}
+	// New records go to the next journal, the file will include everything up to now
+	m_journal.close();
+	m_journalRecords = 0;
+	const unsigned serial = ++m_serial;
+	if (!background) return write(m_filename, serial, m_players.items(), m_songs, m_hiscores);
+	m_compacting = true;
+	m_compactor = std::thread([this, serial, players = m_players.items(), songs = m_songs, hiscores = m_hiscores] {
+		threads::enter(threads::Class::io, "database");
+		write(m_filename, serial, players, songs, hiscores);
+		m_compacting = false;
+	});
+}
+
+void Database::journal(std::string const& record) {
+	if (!m_journal.is_open()) {
 		create_directories(m_filename.parent_path());
-		fs::path tmp = m_filename.string() + ".tmp";
-		{
-			xmlpp::Document doc;
-			auto nodeRoot = doc.create_root_node("performous");
-			m_players.save(xmlpp::add_child_element(nodeRoot, "players"));
-			m_songs.save(xmlpp::add_child_element(nodeRoot, "songs"));
-			m_hiscores.save(xmlpp::add_child_element(nodeRoot, "hiscores"));
-			doc.write_to_file_formatted(tmp.string(), "UTF-8");
-		}
-		rename(tmp, m_filename);
-		std::clog << "database/info: Saved " << m_players.size() << " players, " << m_songs.size() << " songs and " << m_hiscores.size() << " hiscores to " << m_filename.string() << std::endl;
-	} catch (std::exception const& e) {
-		std::clog << "database/error: Could not save " + m_filename.string() + ": " + e.what() << std::endl;
-		return;
+		m_journal.open(journalPath(m_filename, m_serial).string(), std::ios::binary | std::ios::app);
 	}
+	m_journal << record << '\n' << std::flush;
+	if (!m_journal) std::clog << "database/error: Could not write " << journalPath(m_filename, m_serial).string() << std::endl;
+	if (++m_journalRecords >= COMPACT_RECORDS) compact(true);
 }
 
 void Database::addPlayer(std::string const& name, std::string const& picture, int id) {
-	m_players.addPlayer(name, picture, id);
+	id = m_players.addPlayer(name, picture, id);
+	std::string record = "<player name=\"" + escape(name) + "\" id=\"" + std::to_string(id) + "\">";
+	if (!picture.empty()) record += "<picture>" + escape(picture) + "</picture>";
+	journal(record + "</player>");
 }
 
 void Database::addSong(std::shared_ptr<Song> s) {
-	m_songs.addSong(s);
+	const std::size_t count = m_songs.size();
+	const std::time_t now = std::time(nullptr);
+	int songid;
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_songs.addSong(s);
+		songid = m_songs.lookup(s);
+		m_songs.played(songid, now);
+	}
+	++m_generation;
+	if (m_songs.size() != count) journal("<song id=\"" + std::to_string(songid) + "\" artist=\"" + escape(s->collateByArtistOnly()) + "\" title=\"" + escape(s->collateByTitleOnly()) + "\"/>");
+	journal("<play songid=\"" + std::to_string(songid) + "\" time=\"" + std::to_string(now) + "\"/>");
 }
 
 void Database::addHiscore(std::shared_ptr<Song> s) {
@@ -61,8 +231,16 @@ void Database::addHiscore(std::shared_ptr<Song> s) {
 	std::string track = scores.front().track;
 	int songid = m_songs.lookup(s);
 
+	const std::size_t count = m_hiscores.size();
 	m_hiscores.addHiscore(score, playerid, songid, track);
+	if (m_hiscores.size() == count) return;  // Did not make it to the list
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_songs.scored(songid, score, playerid);
+	}
+	++m_generation;
 	std::clog << "database/info: Added new hiscore " << score << " points on track " << track << " of songid " << songid << std::endl;
+	journal("<hiscore playerid=\"" + std::to_string(playerid) + "\" songid=\"" + std::to_string(songid) + "\" track=\"" + escape(track) + "\">" + std::to_string(score) + "</hiscore>");
 }
 
 bool Database::reachedHiscore(std::shared_ptr<Song> s) const {
@@ -110,6 +288,11 @@ void Database::queryPerPlayerHiscore(std::ostream & os, std::string const& track
 	}
 }
 
+SongSummary Database::summary(Song const& s) const {
+	std::lock_guard<std::mutex> l(m_mutex);
+	return m_songs.summary(s);
+}
+
 bool Database::hasHiscore(Song& s) const {
 	int songid = m_songs.lookup(s);
 	return m_hiscores.hasHiscore(songid);
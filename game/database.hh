@@ -6,8 +6,12 @@
 #include "hiscore.hh"
 #include "players.hh"
 #include "songitems.hh"
+#include <atomic>
+#include <fstream>
+#include <mutex>
 #include <string>
 #include <ostream>
+#include <thread>
 
 struct ScoreItem {
 	int score;
@@ -44,17 +48,15 @@ public:
 	  */
 	~Database();
 
-	/**Loads the whole database from xml.
-	  @exception bad_cast may be thrown if xml element is not of correct type
-	  @exception xmlpp exceptions may be thrown on any parse errors
-	  @exception PlayersException if some conditions of players fail (e.g. no id)
-	  @exception HiscoreException if some hiscore conditions fail (e.g. score too high)
-	  @exception SongItemsExceptions if some songs conditions fail (e.g. no id)
+	/**Loads the whole database from xml, followed by the journals written since it was saved.
+	  Errors are printed on stderr (a journal that fails to load is skipped).
 	  @post filled database
 	  */
 	void load();
 	/**Saves the whole database to xml.
-	  Will write out everything to the file given in the constructor, @see file()
+	  Will write out everything to the file given in the constructor and remove the journals.
+	  Players, songs and hiscores are journaled as they are added, so this is only needed for compacting;
+	  that is done in the background when the journal grows long, and by the destructor.
 	*/
 	void save();
 
@@ -97,9 +99,28 @@ public: // methods for database queries
 
 	bool hasHiscore(Song& s) const;
 	bool noPlayers() const;
+	/// Plays and the best hiscore of a song (may be called from any thread)
+	SongSummary summary(Song const& s) const;
+	/// Changes whenever a summary does
+	unsigned generation() const { return m_generation; }
 
 private:
+	/// Write everything to the file, with background = true in another thread (unless one is already busy)
+	void compact(bool background);
+	/// Append an XML element to the journal, to be loaded after the database file
+	void journal(std::string const& record);
 	fs::path m_filename;
+	/**Journals are named after the database file with a serial number, e.g. database.xml.3.journal.
+	  The database file records the serial of the first journal not included in it.
+	  */
+	unsigned m_serial = 0;  ///< Of the journal being written
+	std::ofstream m_journal;  ///< Opened when the first record is written
+	unsigned m_journalRecords = 0;
+	std::thread m_compactor;
+	std::atomic<bool> m_compacting{ false };
+	std::atomic<unsigned> m_generation{ 0 };
+	/// Guards changes of m_songs (made by the main thread) against summary() in other threads
+	mutable std::mutex m_mutex;
 
 	Players m_players;
 	Hiscore m_hiscores;
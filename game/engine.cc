@@ -1,18 +1,30 @@
 #include "engine.hh"
 
 #include "audio.hh"
+#include "log.hh"
+#include "micrecord.hh"
 #include "song.hh"
 #include "database.hh"
 #include "configuration.hh"
+#include "profiler.hh"
+#include "util.hh"
+#include <algorithm>
 #include <iostream>
 #include <list>
 
 const double Engine::TIMESTEP = 0.01;
 
-Engine::Engine(Audio& audio, VocalTrackPtrs vocals, Database& database):
-  m_audio(audio), m_time(), m_quit(), m_database(database)
+Engine::Engine(Audio& audio, VocalTrackPtrs vocals, Database& database, std::unique_ptr<MicRecorder> recorder):
+  Engine(audio.analyzers(), audio.analyzerBatches(), vocals, database)
+{
+	m_audio = &audio;
+	m_recorder = std::move(recorder);
+	m_thread.reset(new std::thread(std::ref(*this)));
+}
+
+Engine::Engine(std::deque<Analyzer>& analyzers, std::vector<std::vector<Analyzer*>> const& batches, VocalTrackPtrs vocals, Database& database):
+  m_quit(), m_database(database)
 {
-	auto& analyzers = m_audio.analyzers();
 	if (analyzers.size() != vocals.size()) throw std::logic_error("Engine requires the same number of vocal tracks as there are analyzers.");
 	// Clear old player information
 	m_database.cur.clear();
@@ -24,17 +36,109 @@ Engine::Engine(Audio& audio, VocalTrackPtrs vocals, Database& database):
 		m_database.cur.push_back(Player(*vocals[i], a, frames));
 		++i;
 	}
-	m_thread.reset(new std::thread(std::ref(*this)));
+	m_batches = &batches;
+	// Start helper threads for analysis (the engine thread processes one share itself)
+	unsigned threads = config["audio/analyzer_threads"].i();
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = std::min<std::size_t>(threads, m_batches->size());
+	for (unsigned t = 1; t < threads; ++t) m_workers.emplace_back(&Engine::worker, this);
+	LOG("engine", debug) << "Processing " << analyzers.size() << " analyzer(s) in " << m_batches->size() << " batch(es) using " << std::max(1u, threads) << " thread(s)" << std::endl;
+}
+
+Engine::~Engine() { kill(); }
+
+void Engine::kill() {
+	{
+		std::lock_guard<std::mutex> l(m_workMutex);
+		m_quit = true;
+	}
+	m_workCond.notify_all();
+	Analyzer::signal().notify();  // Wake up the engine thread
+	if (m_thread && m_thread->joinable()) m_thread->join();
+	for (auto& w: m_workers) if (w.joinable()) w.join();
+}
+
+void Engine::prepareAll() {
+	if (m_workers.empty()) {
+		for (auto const& batch: *m_batches) Analyzer::process(batch.data(), batch.size());
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> l(m_workMutex);
+		m_nextTask = 0;
+		m_pending = m_batches->size();
+		++m_generation;
+	}
+	m_workCond.notify_all();
+	runTasks();
+	std::unique_lock<std::mutex> l(m_workMutex);
+	m_doneCond.wait(l, [this]{ return m_pending == 0; });
+}
+
+void Engine::runTasks() {
+	std::size_t done = 0;
+	for (std::size_t i; (i = m_nextTask++) < m_batches->size(); ++done) {
+		auto const& batch = (*m_batches)[i];
+		Analyzer::process(batch.data(), batch.size());
+	}
+	if (done == 0) return;
+	std::lock_guard<std::mutex> l(m_workMutex);
+	m_pending -= done;
+	if (m_pending == 0) m_doneCond.notify_one();
+}
+
+void Engine::worker() {
+	trace::threadName("engine worker");
+	unsigned generation = 0;
+	std::unique_lock<std::mutex> l(m_workMutex);
+	while (true) {
+		m_workCond.wait(l, [&]{ return m_quit || m_generation != generation; });
+		if (m_quit) return;
+		generation = m_generation;
+		UnlockGuard<decltype(l)> unlocked(l);
+		trace::Scope scope("engine analyze");
+		runTasks();
+	}
 }
 
 void Engine::operator()() {
-	while (!m_quit) {
-		for (Player& player: m_database.cur) player.prepare();
-		double t = m_audio.getPosition() - config["audio/round-trip"].f();
-		double timeLeft = m_time - t;
-		if (timeLeft != timeLeft || timeLeft > 1.0) timeLeft = 1.0;  // FIXME: Workaround for NaN values and other weirdness (should fix the weirdness instead)
-		if (timeLeft > 0.0) { std::this_thread::sleep_for(std::min(TIMESTEP, timeLeft) * 1s); continue; }
-		for (Player& player: m_database.cur) player.update();
-		m_time += TIMESTEP;
+	trace::threadName("engine");
+	static ConfigItem& roundTrip = config["audio/round-trip"];
+	AnalyzerSignal& signal = Analyzer::signal();
+	Profiler prof("engine");  // Allocations of the steps, with allocation tracking (logged at the end)
+	while (true) {
+		// Read before m_quit, so that the notification of kill cannot be missed
+		const unsigned inputs = signal.count();
+		if (m_quit) return;
+		if (alloctrack::enabled()) prof("wait");
+		const double timeLeft = step(m_audio->getPosition(), roundTrip.f());
+		if (alloctrack::enabled()) prof("step");
+		// Sleep until the next step is due or there is new input to analyze
+		signal.wait(inputs, timeLeft * 1s);
+	}
+}
+
+double Engine::step(double pos, double roundTrip) {
+	{
+		trace::Scope scope("engine analyze");
+		prepareAll();
+	}
+	if (m_recorder) m_recorder->step(pos);
+	// Update players on all steps that are due (a batch if the engine has fallen behind)
+	const double t = pos - roundTrip;
+	double timeLeft = TIMESTEP;  // There is no position (NaN) while a song is loading
+	if (t == t) {
+		timeLeft = 1.0;  // Audio position may also jump backwards
+		for (Player& player: m_database.cur) {
+			if (player.m_pos == player.m_pitch.size()) continue;  // End of song already
+			// Each player at its own time, as the input of some mics (e.g. over the network) arrives later
+			const double playerTime = t - player.m_analyzer.latency();
+			if (TIMESTEP * player.m_pos <= playerTime) {
+				trace::Scope scope("engine update");
+				while (player.m_pos < player.m_pitch.size() && TIMESTEP * player.m_pos <= playerTime) player.update();
+			}
+			if (player.m_pos < player.m_pitch.size()) timeLeft = std::min(timeLeft, TIMESTEP * player.m_pos - playerTime);
+		}
 	}
+	return timeLeft;
 }
@@ -1,33 +1,53 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
+class Analyzer;
 class Audio;
 class Database;
+class MicRecorder;
 class VocalTrack;
 
 /// performous engine
 class Engine {
-	Audio& m_audio;
-	double m_time;
+	Audio* m_audio = nullptr;  ///< Clock of the engine thread (none when stepped by replay)
+	std::unique_ptr<MicRecorder> m_recorder;
 	std::atomic<bool> m_quit{ false };
 	Database& m_database;
 	std::unique_ptr<std::thread> m_thread;
+	// Parallel analysis: one task per analyzer batch per step, helper threads plus the engine thread itself
+	std::vector<std::vector<Analyzer*>> const* m_batches = nullptr;  ///< Owned by Audio
+	std::vector<std::thread> m_workers;  ///< Empty when processing serially
+	std::mutex m_workMutex;
+	std::condition_variable m_workCond;  ///< Signals workers that a new step is available (or quit)
+	std::condition_variable m_doneCond;  ///< Signals the engine thread that all tasks are done
+	std::atomic<std::size_t> m_nextTask{ 0 };
+	std::size_t m_pending = 0;  ///< Unfinished tasks of the current step (guarded by m_workMutex)
+	unsigned m_generation = 0;  ///< Step counter (guarded by m_workMutex)
+	/// Process all analyzers and return once all of them are done (barrier)
+	void prepareAll();
+	/// Run tasks of the current step until none are left
+	void runTasks();
+	void worker();
 
   public:
 	typedef std::vector<VocalTrack*> VocalTrackPtrs;
 	static const double TIMESTEP;  ///< The duration of one engine time step in seconds
-	/// Construct an engine thread with vocal tracks and players specified by parameters
-	Engine(Audio& audio, VocalTrackPtrs vocals, Database& database);
-	~Engine() { kill(); }
+	/// Construct an engine thread with vocal tracks and players specified by parameters, recording the mics with recorder if given
+	Engine(Audio& audio, VocalTrackPtrs vocals, Database& database, std::unique_ptr<MicRecorder> recorder = nullptr);
+	/// Construct without a thread, for calling step with recorded input (see MicRecorder)
+	Engine(std::deque<Analyzer>& analyzers, std::vector<std::vector<Analyzer*>> const& batches, VocalTrackPtrs vocals, Database& database);
+	~Engine();
 	/// Terminates processing
-	void kill() { 
-		m_quit = true;
-		if (m_thread->joinable()) m_thread->join();
-		}
+	void kill();
+	/// Analyze the input so far and update the players up to the song position pos - roundTrip. Returns the time until the next update is due.
+	double step(double pos, double roundTrip);
 	/** Used internally for std::thread. Do not call this yourself. (std::thread requires this to be public). **/
 	void operator()();
 };
@@ -62,8 +62,62 @@ class FBO {
 	OpenGLTexture<GL_TEXTURE_2D> m_depth;
 };
 
+/// FBO with a texture layer for each eye, drawn to at once by shaders using GL_OVR_multiview
+class MultiviewFBO {
+  public:
+	static const unsigned VIEWS = 2;
+	MultiviewFBO(const MultiviewFBO&) = delete;
+	const MultiviewFBO& operator=(const MultiviewFBO&) = delete;
+	/// Generate the FBO and attach fresh layered textures to it
+	MultiviewFBO(float w, float h): m_w(w), m_h(h) {
+		glGenFramebuffers(1, &m_fbo);
+		update();
+	}
+	~MultiviewFBO() {
+		if (m_fbo) glDeleteFramebuffers(1, &m_fbo);
+	}
+	/// Returns a reference to the attached texture (layer 0 = left eye, layer 1 = right eye)
+	OpenGLTexture<GL_TEXTURE_2D_ARRAY>& getTexture() {
+		return m_texture;
+	}
+	/// Bind the FBO into use
+	void bind() {
+		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+	}
+	void resize(float w, float h) {
+		m_w = w;
+		m_h = h;
+		update();
+	}
+	float width() const { return m_w; }
+	float height() const { return m_h; }
+	void update() {
+		{
+			UseTexture tex(m_texture);
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, m_w, m_h, VIEWS, 0, GL_RGBA, GL_FLOAT, nullptr);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+		}
+		{
+			UseTexture tex(m_depth);
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT, m_w, m_h, VIEWS, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+		}
+		bind();
+		glFramebufferTextureMultiviewOVR(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_texture.id(), 0, 0, VIEWS);
+		glFramebufferTextureMultiviewOVR(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depth.id(), 0, 0, VIEWS);
+		FBO::unbind();
+	}
+  private:
+	float m_w;
+	float m_h;
+	GLuint m_fbo {0};
+	OpenGLTexture<GL_TEXTURE_2D_ARRAY> m_texture;
+	OpenGLTexture<GL_TEXTURE_2D_ARRAY> m_depth;
+};
+
 /// RAII FBO binder
 struct UseFBO {
-	UseFBO(FBO& fbo) { fbo.bind(); }
-	~UseFBO() { FBO::unbind(); }
+	UseFBO(FBO& fbo) { glutil::QuadBatch::flush(); fbo.bind(); }
+	UseFBO(MultiviewFBO& fbo) { glutil::QuadBatch::flush(); fbo.bind(); }
+	~UseFBO() { glutil::QuadBatch::flush(); FBO::unbind(); }
 };
@@ -2,12 +2,29 @@
 
 #include "chrono.hh"
 #include "config.hh"
+#include "configuration.hh"
+#include "log.hh"
+#include "mediacache.hh"
+#include "memstats.hh"
+#include "platform.hh"
+#include "profiler.hh"
+#include "threads.hh"
 #include "screen_songs.hh"
 #include "util.hh"
+#include "libda/mix.hpp"
 
 #include "aubio/aubio.h"
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <memory>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <system_error>
@@ -22,8 +39,13 @@ extern "C" {
 #include AVUTIL_OPT_INCLUDE
 #include AVUTIL_MATH_INCLUDE
 #include AVUTIL_ERROR_INCLUDE
+#include AVUTIL_HWCONTEXT_INCLUDE
+#include AVUTIL_PIXDESC_INCLUDE
 }
 
+// Hardware decoding with AVHWDeviceContext (avcodec_get_hw_config) needs FFmpeg 4.0
+#define HAVE_HWACCEL (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100))
+
 #define AUDIO_CHANNELS 2
 
 
@@ -36,19 +58,27 @@ namespace {
 		oss << major << "." << minor << "." << micro << (micro >= 100 ? "(ff)" : "(lav)");
 		return oss.str();
 	}
-}
 
-AudioBuffer::uFvec AudioBuffer::makePreviewBuffer() {
-	uFvec fvec(new_fvec(m_data.size() / 2));
-	float previewVol = float(config["audio/preview_volume"].i()) / 100.0;
-	{
-		std::lock_guard<std::mutex> l(m_mutex);
-		for (size_t rpos = 0, bpos = 0; rpos < m_data.size(); rpos += 2, bpos ++) {
-			fvec->data[bpos] = (((da::conv_from_s16(m_data.at(rpos)) + da::conv_from_s16(m_data.at(rpos + 1))) / 2) / previewVol);
+#if HAVE_HWACCEL
+	/// Hardware decoders by graphic/video_hwaccel (0 = off, 1 = automatic)
+	AVHWDeviceType const hwDeviceTypes[] = {
+		AV_HWDEVICE_TYPE_NONE, AV_HWDEVICE_TYPE_NONE, AV_HWDEVICE_TYPE_VAAPI, AV_HWDEVICE_TYPE_VDPAU,
+		AV_HWDEVICE_TYPE_DXVA2, AV_HWDEVICE_TYPE_D3D11VA, AV_HWDEVICE_TYPE_VIDEOTOOLBOX
+	};
+
+	/// Choose the hardware format if the decoder offers it, otherwise fall back to software decoding
+	AVPixelFormat getHardwareFormat(AVCodecContext* ctx, AVPixelFormat const* formats) {
+		const int hw = *static_cast<int const*>(ctx->opaque);
+		for (auto f = formats; *f != AV_PIX_FMT_NONE; ++f) if (*f == hw) return *f;
+		for (auto f = formats; *f != AV_PIX_FMT_NONE; ++f) {
+			if (av_pix_fmt_desc_get(*f)->flags & AV_PIX_FMT_FLAG_HWACCEL) continue;
+			std::clog << "ffmpeg/warning: Hardware decoding not possible for this video, using software." << std::endl;
+			return *f;
 		}
+		return AV_PIX_FMT_NONE;
 	}
-	return fvec;
-};
+#endif
+}
 
 bool AudioBuffer::wantMore() {
 	return m_write_pos < m_read_pos + static_cast<std::int64_t>(m_data.size() / 2);
@@ -56,46 +86,66 @@ bool AudioBuffer::wantMore() {
 
 /// Should the input stop waiting?
 bool AudioBuffer::condition() {
-	return m_quit || m_seek_asked || wantMore();
+	return m_quit || seekPending() || wantMore();
 }
 
-void AudioBuffer::operator()(const std::int16_t *data, size_t count, int64_t sample_position) {
+template <typename Pred> void AudioBuffer::sleepUntil(Pred pred) {
+	std::unique_lock<std::mutex> l(m_mutex);
+	m_sleeping = true;
+	while (!pred()) m_cond.wait_for(l, 10ms);  // The wakeup may come just before waiting (see wake)
+	m_sleeping = false;
+}
+
+void AudioBuffer::wake() {
+	// Without locking, so that the audio callback never waits for the decoder thread
+	if (m_sleeping) m_cond.notify_all();
+}
+
+template <typename Sample> void AudioBuffer::write(Sample const* data, size_t count, int64_t sample_position) {
 	if (sample_position < 0) {
 		std::clog << "ffmpeg/warning: Negative audio sample_position " << sample_position << " seconds, frame ignored." << std::endl;
 		return;
 	}
 
-	std::unique_lock<std::mutex> l(m_mutex);
 	if (sample_position < m_read_pos) {
 		// frame to be dropped as being before read... arrived too last or due to a seek.
 		return;
 	}
 
-	m_cond.wait(l, [this]{ return  condition(); });
-	if (m_quit || m_seek_asked) return;
+	sleepUntil([this] { return condition(); });
+	if (m_quit || seekPending()) return;
 
-	if (m_write_pos != sample_position) {
-		std::clog << "ffmpeg/debug: Gap in audio: expected=" << m_write_pos << " received=" << sample_position << '\n';
+	const std::int64_t write_pos = m_write_pos;  // Only changed by this thread
+	if (write_pos != sample_position) {
+		LOG("ffmpeg", debug) << "Gap in audio: expected=" << write_pos << " received=" << sample_position << '\n';
+	}
+	if (sample_position > write_pos) {
+		// The ring still holds older audio in the gap, so silence it (readers stop at m_write_pos)
+		const std::int64_t read_pos = m_read_pos;
+		const std::int64_t gap = std::max(write_pos, read_pos);
+		const std::int64_t gap_size = std::min<std::int64_t>(sample_position - gap, read_pos + m_data.size() - gap);
+		if (gap_size > 0) m_data.silence(gap % m_data.size(), gap_size);
+	} else if (sample_position < write_pos) {
+		// The reader may be mixing the published samples right now, so only the part past them is stored
+		const std::int64_t overlap = write_pos - sample_position;
+		if (overlap >= static_cast<std::int64_t>(count)) return;
+		data += overlap;
+		count -= overlap;
+		sample_position = write_pos;
 	}
 
-	m_write_pos = sample_position;
-	size_t write_pos_in_ring = m_write_pos % m_data.size();
-	auto first_hunk_size = std::min(count, m_data.size() - write_pos_in_ring);
-	std::copy(data, data + first_hunk_size, m_data.begin() + write_pos_in_ring);
-	// second part is when data wrapped in the ring buffer
-	std::copy(data + first_hunk_size, data + count, m_data.begin());
-	m_write_pos += count;
-	m_cond.notify_all();
+	m_data.write(sample_position % m_data.size(), data, count);
+	m_write_pos = sample_position + count;  // Publish the samples
 }
 
 bool AudioBuffer::prepare(std::int64_t pos) {
 	// perform fake read to trigger any potential seek
 	if (!read(nullptr, 0, pos, 1)) return true;
 
-	std::unique_lock<std::mutex> l(m_mutex);
 	// Has enough been prebuffered already and is the requested position still within buffer
-	auto ring_size = static_cast<std::int64_t>(m_data.size());
-	return m_write_pos > m_read_pos + ring_size / 16 && m_write_pos <= m_read_pos + ring_size;
+	const auto ring_size = static_cast<std::int64_t>(m_data.size());
+	const std::int64_t read_pos = m_read_pos, write_pos = m_write_pos;
+	return !seekPending() && write_pos > read_pos + ring_size / 16 && write_pos <= read_pos + ring_size;
 }
 
 // pos may be negative because upper layer may request 'extra time' before
@@ -103,80 +153,155 @@ bool AudioBuffer::prepare(std::int64_t pos) {
 //
 bool AudioBuffer::read(float* begin, size_t samples, std::int64_t pos, float volume) {
 	if (pos < 0) {
-		size_t negative_samples;
-		if (static_cast<std::int64_t>(samples) + pos > 0) negative_samples = samples - (samples + pos);
-		else negative_samples = samples;
-
-		// put zeros to negative positions
-		std::fill(begin, begin + negative_samples, 0);
-
+		// Negative positions are silence (nothing to mix)
+		const size_t negative_samples = std::min<std::int64_t>(samples, -pos);
 		if (negative_samples == samples) return true;
 
 		// if there are remaining samples to read in positive land, do the 'normal' read
+		begin += negative_samples;
 		pos = 0;
 		samples -= negative_samples;
 	}
 
-	std::unique_lock<std::mutex> l(m_mutex);
 	if (eof(pos + samples) || m_quit)
 		return false;
 
 	// one cannot read more data than the size of buffer
 	samples = std::min(samples, m_data.size());
-	if (pos >= m_read_pos + static_cast<std::int64_t>(m_data.size() - samples) || pos < m_read_pos) {
+	const std::int64_t read_pos = m_read_pos;  // Only changed by this thread
+	if (pos >= read_pos + static_cast<std::int64_t>(m_data.size() - samples) || pos < read_pos) {
 		// in case request position is not in the current possible range, we trigger a seek
-		// Note: m_write_pos is not checked on purpose: if pos is after
-		// m_write_pos, zeros present in buffer will be returned
-		std::fill(begin, begin + samples, 0);
+		// (the decoder thread restarts writing at m_read_pos, which invalidates the whole ring at once)
 		m_read_pos = pos + samples;
-		m_seek_asked = true;
-		std::fill(m_data.begin(), m_data.end(), 0);
-		m_cond.notify_all();
+		++m_seek_requested;
+		wake();
 		return true;
 	}
 
-	for (size_t s = 0; s < samples; ++s) {
-		begin[s] += volume * da::conv_from_s16(m_data[(m_read_pos + s) % m_data.size()]);
-	}
+	// Only what was decoded since the latest seek is valid: up to m_write_pos, and nothing while a seek is pending
+	const size_t valid = seekPending() ? 0 : clamp<std::int64_t>(m_write_pos - pos, 0, samples);
+	// Convert and mix the ring contents as (at most) two contiguous spans
+	const size_t read_pos_in_ring = pos % m_data.size();
+	const size_t first_hunk_size = std::min(valid, m_data.size() - read_pos_in_ring);
+	m_data.mix(begin, read_pos_in_ring, first_hunk_size, volume);
+	m_data.mix(begin + first_hunk_size, 0, valid - first_hunk_size, volume);
 
-	m_read_pos = pos + samples;
-	m_cond.notify_all();
+	m_read_pos = pos + samples;  // Hand the space back to the decoder
+	wake();
 	return true;
 }
 
 double AudioBuffer::duration() { return m_duration; }
 
+void AudioBuffer::Storage::allocate(size_t samples, bool floatSamples, bool fileBacked) {
+	m_float = floatSamples;
+	const size_t bytes = samples * (floatSamples ? sizeof(float) : sizeof(std::int16_t));
+	if (fileBacked) {
+		try {
+			// File-backed pages can be dropped by the OS under memory pressure instead of being swapped out
+			fs::path dir = getCacheDir() / "audio";
+			fs::create_directories(dir);
+			m_filename = dir / fs::unique_path(floatSamples ? "buffer-%%%%-%%%%-%%%%.f32" : "buffer-%%%%-%%%%-%%%%.s16");
+			boost::iostreams::mapped_file_params params(m_filename.string());
+			params.flags = boost::iostreams::mapped_file::readwrite;
+			params.new_file_size = bytes;  // New files are zero-filled
+			m_file = std::make_unique<boost::iostreams::mapped_file>(params);
+			m_ptr = reinterpret_cast<unsigned char*>(m_file->data());
+			m_size = samples;
+			m_usage.set(bytes);
+			return;
+		} catch (std::exception& e) {
+			std::clog << "ffmpeg/warning: Cannot map audio buffer file " << m_filename << ", using memory instead: " << e.what() << std::endl;
+			m_file.reset();
+			boost::system::error_code ec;
+			fs::remove(m_filename, ec);
+		}
+	}
+	m_memory.assign((bytes + sizeof(float) - 1) / sizeof(float), 0.0f);
+	m_ptr = reinterpret_cast<unsigned char*>(m_memory.data());
+	m_size = samples;
+	m_usage.set(bytes);
+}
+
+AudioBuffer::Storage::~Storage() {
+	if (!m_file) return;
+	m_file.reset();
+	boost::system::error_code ec;
+	fs::remove(m_filename, ec);
+}
+
+void AudioBuffer::Storage::silence(size_t pos, size_t count) {
+	const size_t bytes = m_float ? sizeof(float) : sizeof(std::int16_t);
+	const size_t first_hunk_size = std::min(count, m_size - pos);
+	std::memset(m_ptr + pos * bytes, 0, first_hunk_size * bytes);
+	std::memset(m_ptr, 0, (count - first_hunk_size) * bytes);
+}
+
+template <typename Sample> void AudioBuffer::Storage::write(size_t pos, Sample const* src, size_t count) {
+	if (m_float != std::is_same<Sample, float>::value) throw std::logic_error("AudioBuffer::Storage::write: wrong sample type");
+	Sample* ring = reinterpret_cast<Sample*>(m_ptr);
+	const size_t first_hunk_size = std::min(count, m_size - pos);
+	std::copy(src, src + first_hunk_size, ring + pos);
+	// second part is when data wrapped in the ring buffer
+	std::copy(src + first_hunk_size, src + count, ring);
+}
+
+void AudioBuffer::Storage::mix(float* dst, size_t pos, size_t count, float gain) const {
+	if (m_float) da::mix_f32(dst, reinterpret_cast<float const*>(m_ptr) + pos, count, gain);
+	else da::mix_s16(dst, reinterpret_cast<std::int16_t const*>(m_ptr) + pos, count, gain);
+}
+
+float AudioBuffer::Storage::at(size_t i) const {
+	if (i >= m_size) throw std::out_of_range("AudioBuffer::Storage::at");
+	if (m_float) return reinterpret_cast<float const*>(m_ptr)[i];
+	return da::conv_from_s16(reinterpret_cast<std::int16_t const*>(m_ptr)[i]);
+}
+
 AudioBuffer::AudioBuffer(fs::path const& file, unsigned int rate, size_t size):
-	m_data(size), m_sps(rate * AUDIO_CHANNELS) {
-		auto ffmpeg = std::make_unique<AudioFFmpeg>(file, rate, std::ref(*this));
+	m_sps(rate * AUDIO_CHANNELS) {
+		// Float samples take twice the memory, but are mixed without conversion and never quantized to 16 bits
+		const bool floatSamples = config["audio/buffer_float"].b();
+		auto ffmpeg = floatSamples ?
+		  std::make_unique<AudioFFmpeg>(file, rate, AudioFFmpeg::FloatCb([this](float const* data, size_t count, int64_t pos) { write(data, count, pos); })) :
+		  std::make_unique<AudioFFmpeg>(file, rate, AudioFFmpeg::AudioCb([this](std::int16_t const* data, size_t count, int64_t pos) { write(data, count, pos); }));
 		const_cast<double&>(m_duration) = ffmpeg->duration();
+		if (size == 0) {
+			// Room for the whole track (plus a second for rounding), but no more than configured
+			double seconds = config["audio/buffer_seconds"].i();
+			if (m_duration > 0.0) seconds = std::min(seconds, m_duration + 1.0);
+			size = AUDIO_CHANNELS * static_cast<size_t>(seconds * rate);
+		}
+		m_data.allocate(size, floatSamples, config["audio/buffer_file_backed"].b());
 		reader_thread = std::async(std::launch::async, [this, ffmpeg = std::move(ffmpeg)] {
+			threads::enter(threads::Class::decode, "audio decoder");
 			auto errors = 0u;
-			std::unique_lock<std::mutex> l(m_mutex);
 			while (!m_quit) {
-				if (m_seek_asked) {
-					m_seek_asked = false;
-					m_write_pos = m_read_pos;
-					auto seek_pos = m_read_pos / double(AV_TIME_BASE);
-
-					UnlockGuard<decltype(l)> unlocked(l); // release lock during seek
-					ffmpeg->seek(seek_pos);
+				const unsigned seek = m_seek_requested;
+				if (seek != m_seek_handled) {
+					// Restart at the position read, which invalidates the ring (reads are silent until m_seek_handled is set)
+					const std::int64_t pos = m_read_pos;
+					m_write_pos = pos;
+					m_seek_handled = seek;
+					ffmpeg->seek(pos / double(m_sps));  // Samples to seconds
 					continue;
 				}
 
+				if (!wantMore()) {
+					// Wait for room before taking a decoder slot, so that full buffers do not hold slots
+					sleepUntil([this]{ return condition(); });
+					continue;
+				}
 				try {
-					UnlockGuard<decltype(l)> unlocked(l); // release lock during possibly blocking ffmpeg stuff
-
+					threads::Budget::Slot slot(threads::decodeBudget());
 					ffmpeg->handleOneFrame();
 					errors = 0;
 				} catch (const FFmpeg::Eof&) {
 					// now we know exact eof_pos
-					m_eof_pos = m_write_pos;
+					m_eof_pos = m_write_pos.load();
 					// Wait here on eof: either quit is asked, either a new seek
 					// was asked and return back reading frames
-					m_cond.wait(l, [this]{ return m_quit || m_seek_asked; });
+					sleepUntil([this]{ return m_quit || seekPending(); });
 				} catch (const std::exception& e) {
-					UnlockGuard<decltype(l)> unlocked(l); // unlock while doing IOs
 					std::clog << "ffmpeg/error: " << e.what() << std::endl;
 					if (++errors > 2) std::clog << "ffmpeg/error: FFMPEG terminating due to multiple errors" << std::endl;
 				}
@@ -185,13 +310,7 @@ AudioBuffer::AudioBuffer(fs::path const& file, unsigned int rate, size_t size):
 }
 
 AudioBuffer::~AudioBuffer() {
-	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		m_read_pos = 0;
-		m_write_pos = 0;
-		std::fill(m_data.begin(), m_data.end(), 0);
-		m_quit = true;
-	}
+	m_quit = true;
 	m_cond.notify_all();
 	reader_thread.get();
 }
@@ -236,60 +355,655 @@ class FFmpeg::Error: public std::runtime_error {
 	}
 };
 
-FFmpeg::FFmpeg(fs::path const& _filename, int mediaType) : m_filename(_filename) {
+struct FFmpeg::Packet: public AVPacket {
+	Packet() {
+		av_init_packet(this);
+		this->data = nullptr;
+		this->size = 0;
+	}
+
+	~Packet() { av_packet_unref(this); }
+};
+
+namespace {
+	/// Packets queued for a decoder that does not take them fast enough are dropped beyond this
+	const std::size_t DEMUX_QUEUE_BYTES = 64 << 20;
+	/// Likewise for a stream without a decoder (e.g. the video of a song while its music starts)
+	const std::size_t DEMUX_PREBUFFER_BYTES = 16 << 20;
+	/// Probing limits when the probe cache knows the file (the container headers usually tell enough)
+	const std::int64_t QUICK_PROBESIZE = 64 << 10;
+	const std::int64_t QUICK_ANALYZE_DURATION = AV_TIME_BASE / 10;
+
+	/// Cache file for something about a media file, named by the path, size and modification time
+	fs::path mediaCacheFile(fs::path const& media, std::string const& dir, std::string const& what, std::string const& ext) {
+		boost::system::error_code ec;
+		std::ostringstream key;
+		key << media.string() << ' ' << fs::file_size(media, ec) << ' ' << fs::last_write_time(media, ec) << ' ' << what;
+		std::ostringstream name;
+		name << std::hex << std::hash<std::string>()(key.str()) << ext;
+		return getCacheDir() / dir / name.str();
+	}
+
+	/// Stream parameters as stored in the probe cache
+	struct ProbeStream {
+		std::int32_t codecType, codecId, format, width, height, sampleRate, channels;
+		std::uint64_t channelLayout;
+		std::int32_t timeBaseNum, timeBaseDen;
+		std::int64_t startTime, duration;
+	};
+
+	/// What avformat_find_stream_info found out about a file, so that it can be opened with little probing next time
+	struct ProbeInfo {
+		struct Header {
+			char magic[4];
+			std::uint32_t streams;
+			char format[32];  ///< Input format (its first short name)
+			std::int64_t startTime, duration;
+		} header;
+		std::vector<ProbeStream> streams;
+
+		bool load(fs::path const& file) {
+			std::ifstream f(file.string(), std::ios::binary);
+			if (!f.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "PRB1", 4)) return false;
+			header.format[sizeof(header.format) - 1] = '\0';
+			streams.resize(header.streams);
+			return bool(f.read(reinterpret_cast<char*>(streams.data()), streams.size() * sizeof(ProbeStream)));
+		}
+
+		void save(fs::path const& file) const {
+			fs::create_directories(file.parent_path());
+			fs::path part = file;
+			part += ".part";
+			{
+				std::ofstream f(part.string(), std::ios::binary);
+				f.write(reinterpret_cast<char const*>(&header), sizeof(header));
+				f.write(reinterpret_cast<char const*>(streams.data()), streams.size() * sizeof(ProbeStream));
+				if (!f) throw std::runtime_error("Cannot write " + part.string());
+			}
+			fs::rename(part, file);
+		}
+
+		void store(AVFormatContext const* ctx) {
+			header = Header();
+			std::memcpy(header.magic, "PRB1", 4);
+			std::string name = ctx->iformat->name;
+			name = name.substr(0, name.find(','));
+			name.copy(header.format, sizeof(header.format) - 1);
+			header.startTime = ctx->start_time;
+			header.duration = ctx->duration;
+			header.streams = ctx->nb_streams;
+			streams.clear();
+			for (unsigned i = 0; i < ctx->nb_streams; ++i) {
+				AVStream const* st = ctx->streams[i];
+				AVCodecParameters const* par = st->codecpar;
+				streams.push_back(ProbeStream{ par->codec_type, par->codec_id, par->format, par->width, par->height, par->sample_rate,
+				  par->channels, par->channel_layout, st->time_base.num, st->time_base.den, st->start_time, st->duration });
+			}
+		}
+
+		/// Fill in what a quick probe left out. Returns false if the file turns out to be different.
+		bool apply(AVFormatContext* ctx) const {
+			if (ctx->nb_streams != streams.size()) return false;
+			for (unsigned i = 0; i < ctx->nb_streams; ++i) {
+				AVStream* st = ctx->streams[i];
+				AVCodecParameters* par = st->codecpar;
+				ProbeStream const& ps = streams[i];
+				if (par->codec_type != ps.codecType || par->codec_id != ps.codecId) return false;
+				if (st->time_base.num != ps.timeBaseNum || st->time_base.den != ps.timeBaseDen) return false;
+				if (par->format < 0) par->format = ps.format;
+				if (!par->width || !par->height) { par->width = ps.width; par->height = ps.height; }
+				if (!par->sample_rate) par->sample_rate = ps.sampleRate;
+				if (!par->channels) { par->channels = ps.channels; par->channel_layout = ps.channelLayout; }
+				if (st->start_time == int64_t(AV_NOPTS_VALUE)) st->start_time = ps.startTime;
+				if (st->duration == int64_t(AV_NOPTS_VALUE)) st->duration = ps.duration;
+			}
+			// Without full probing, durations may be mere bitrate estimates
+			ctx->start_time = header.startTime;
+			ctx->duration = header.duration;
+			return true;
+		}
+	};
+}
+
+namespace {
+	/**
+	* Reads a media file for FFmpeg (through a custom AVIOContext) with a thread of its own that keeps reading
+	* ahead of the demuxer into a ring buffer in large sequential chunks, so that the many small reads of demuxing
+	* do not each wait for slow (network) storage. Seeks within the buffered range cost nothing; others restart the
+	* read-ahead from the new position. A quarter of the ring keeps data already read, for short seeks back.
+	**/
+	class ReadAhead {
+	  public:
+		ReadAhead(fs::path const& filename, std::size_t size): m_filename(filename), m_ring(size) {
+			m_file.rdbuf()->pubsetbuf(nullptr, 0);  // Our chunks are big enough
+			m_file.open(filename.string(), std::ios::binary);
+			if (!m_file) throw std::runtime_error("Cannot open " + filename.string());
+			m_file.seekg(0, std::ios::end);
+			m_size = m_file.tellg();
+			m_file.seekg(0);
+			m_memory.set(size);
+			m_thread = std::thread(&ReadAhead::run, this);
+		}
+		~ReadAhead() {
+			{
+				std::lock_guard<std::mutex> l(m_mutex);
+				m_quit = true;
+			}
+			m_cond.notify_all();
+			m_thread.join();
+			LOG("ffmpeg", debug) << "Read " << m_bytesRead / 1e6 << " MB of " << m_filename.filename() << " at "
+			  << (m_readTime.count() > 0.0 ? m_bytesRead / 1e6 / m_readTime.count() : 0.0) << " MB/s, demuxing waited "
+			  << m_stalls << " times for " << m_stallTime.count() * 1e3 << " ms" << std::endl;
+		}
+		/// read_packet of AVIOContext
+		static int readPacket(void* opaque, std::uint8_t* buf, int bufSize) { return static_cast<ReadAhead*>(opaque)->read(buf, bufSize); }
+		/// seek of AVIOContext
+		static std::int64_t seekPacket(void* opaque, std::int64_t offset, int whence) { return static_cast<ReadAhead*>(opaque)->seek(offset, whence); }
+
+	  private:
+		static const std::size_t CHUNK = 256 << 10;  ///< Bytes read from the file at once
+		int read(std::uint8_t* buf, int bufSize) {
+			std::unique_lock<std::mutex> l(m_mutex);
+			if (m_pos >= m_size) return AVERROR_EOF;
+			if (m_end <= m_pos && !m_error) {
+				trace::Scope trace("read-ahead stall");
+				const Time begin = Clock::now();
+				m_cond.wait(l, [this] { return m_end > m_pos || m_error; });
+				m_stallTime += Clock::now() - begin;
+				++m_stalls;
+			}
+			if (m_end <= m_pos) return AVERROR(EIO);
+			const std::size_t count = std::min<std::int64_t>(bufSize, m_end - m_pos);
+			const std::size_t index = m_pos % m_ring.size();
+			const std::size_t first = std::min(count, m_ring.size() - index);
+			std::memcpy(buf, &m_ring[index], first);
+			std::memcpy(buf + first, &m_ring[0], count - first);
+			m_pos += count;
+			m_cond.notify_all();  // Maybe room for reading further
+			return count;
+		}
+		std::int64_t seek(std::int64_t offset, int whence) {
+			if (whence & AVSEEK_SIZE) return m_size;
+			std::lock_guard<std::mutex> l(m_mutex);
+			std::int64_t pos = -1;
+			switch (whence & ~AVSEEK_FORCE) {
+				case SEEK_SET: pos = offset; break;
+				case SEEK_CUR: pos = m_pos + offset; break;
+				case SEEK_END: pos = m_size + offset; break;
+			}
+			if (pos < 0) return AVERROR(EINVAL);
+			if (pos < m_start || pos > m_end) {
+				// Not buffered, start reading ahead from there
+				m_start = m_end = pos;
+				m_error = false;
+				++m_generation;
+			}
+			m_pos = pos;
+			m_cond.notify_all();
+			return pos;
+		}
+		void run() {
+			threads::enter(threads::Class::io, "read-ahead");
+			std::vector<char> chunk(CHUNK);
+			std::int64_t filePos = 0;
+			std::unique_lock<std::mutex> l(m_mutex);
+			while (!m_quit) {
+				const std::int64_t ring = m_ring.size();
+				m_start = std::max(m_start, m_pos - ring / 4);  // History beyond that may be overwritten
+				const std::int64_t amount = std::min<std::int64_t>({ std::int64_t(CHUNK), ring - (m_end - m_start), m_size - m_end });
+				if (m_error || amount <= 0) { m_cond.wait(l); continue; }
+				const std::int64_t offset = m_end;
+				const unsigned generation = m_generation;
+				std::int64_t got = 0;
+				Seconds time;
+				{
+					UnlockGuard<decltype(l)> unlocked(l);
+					trace::Scope trace("read-ahead");
+					const Time begin = Clock::now();
+					if (filePos != offset) { m_file.clear(); m_file.seekg(offset); }
+					m_file.read(chunk.data(), amount);
+					got = m_file.gcount();
+					filePos = offset + got;
+					time = Clock::now() - begin;
+				}
+				m_bytesRead += got;
+				m_readTime += time;
+				if (generation != m_generation) continue;  // Seeked meanwhile
+				if (got <= 0) m_error = true;
+				const std::size_t index = offset % ring;
+				const std::size_t first = std::min<std::int64_t>(got, ring - index);
+				std::memcpy(&m_ring[index], chunk.data(), first);
+				std::memcpy(&m_ring[0], chunk.data() + first, got - first);
+				m_end += got;
+				m_cond.notify_all();
+			}
+		}
+		const fs::path m_filename;
+		std::vector<char> m_ring;
+		std::ifstream m_file;  ///< Only used by the read-ahead thread (after the constructor)
+		std::int64_t m_size = 0;  ///< Of the file
+		std::int64_t m_start = 0, m_end = 0;  ///< File offsets of the data in m_ring
+		std::int64_t m_pos = 0;  ///< File offset of the next read by FFmpeg
+		unsigned m_generation = 0;  ///< Incremented by seeks that discard the buffer
+		bool m_error = false;  ///< Reading at m_end failed
+		bool m_quit = false;
+		// Statistics, logged when done
+		std::int64_t m_bytesRead = 0;
+		Seconds m_readTime{ 0.0 }, m_stallTime{ 0.0 };
+		unsigned m_stalls = 0;
+		memstats::Usage m_memory{ "read-ahead" };
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::thread m_thread;
+	};
+}
+
+/**
+* Songs often have the music and the video in one file. Their decoders share a demuxer, so that the file gets
+* opened, probed and read only once: packets of the best audio and video streams are queued until the decoder
+* of that stream takes them. A decoder that has to go its own way (seeking while the other one keeps playing,
+* or lagging too far behind) continues with a private demuxer.
+**/
+class FFmpeg::Demuxer {
+  public:
+	/// Returned by read when the stream has to continue with a demuxer of its own
+	static const int DETACHED = FFERRTAG('D', 'T', 'C', 'H');
+	/// Use the demuxer of the file if it is already being decoded (and share is set), otherwise open and probe it
+	static std::shared_ptr<Demuxer> open(FFmpeg const& owner, bool share);
+	~Demuxer() { for (auto& kv: m_queues) kv.second.clear(); }
+	AVFormatContext* context() const { return m_context.get(); }
+	/// Must be held while using the stream index (or other things that reading packets changes)
+	std::unique_lock<std::mutex> lock() { return std::unique_lock<std::mutex>(m_mutex); }
+	/// Start taking the packets of a stream. Returns false if another decoder takes them or some have been lost.
+	bool attach(int stream);
+	void detach(int stream);
+	/// Get the next packet of the stream. Returns an FFmpeg error code or DETACHED.
+	int read(int stream, Packet& pkt);
+	/// Seek for the decoder of the stream. Returns false if this would disturb other decoders.
+	bool seek(int stream, double time);
+
+  private:
+	explicit Demuxer(FFmpeg const& owner);
+	/// Open and probe the file; quickly if probe (from the cache) is given. Returns false if probe does not match the file.
+	bool open(FFmpeg const& owner, ProbeInfo const* probe);
+	/// Packets of a stream not taken by its decoder yet
+	struct Queue {
+		std::deque<AVPacket*> packets;
+		std::size_t bytes = 0;
+		bool attached = false;  ///< A decoder takes these packets
+		bool valid = true;  ///< No packets have been dropped (since the beginning or the last seek)
+		bool fromStart = true;  ///< The decoder has not read nor seeked yet
+		void clear() {
+			for (AVPacket* p: packets) av_packet_free(&p);
+			packets.clear();
+			bytes = 0;
+		}
+	};
+	std::unique_ptr<ReadAhead> m_reader;  ///< With songs/media_read_ahead_mb
+	std::unique_ptr<AVIOContext, void (*)(AVIOContext*)> m_io{nullptr, [] (AVIOContext* io) { av_freep(&io->buffer); avio_context_free(&io); }};
+	std::unique_ptr<AVFormatContext, decltype(&avformat_close_input)> m_context{nullptr, avformat_close_input};
+	std::map<int, Queue> m_queues;
+	bool m_read = false;  ///< Has any packet been read?
+	std::mutex m_mutex;
+};
+
+const int FFmpeg::Demuxer::DETACHED;
+
+std::shared_ptr<FFmpeg::Demuxer> FFmpeg::Demuxer::open(FFmpeg const& owner, bool share) {
+	if (!share) return std::shared_ptr<Demuxer>(new Demuxer(owner));
+	static std::mutex s_mutex;
+	static std::map<std::string, std::weak_ptr<Demuxer>> s_demuxers;  // Files being decoded
+	const std::string key = owner.m_filename.string();
+	{
+		std::lock_guard<std::mutex> l(s_mutex);
+		if (auto demuxer = s_demuxers[key].lock()) return demuxer;
+	}
+	std::shared_ptr<Demuxer> demuxer(new Demuxer(owner));  // Probing may be slow, don't keep others waiting
+	std::lock_guard<std::mutex> l(s_mutex);
+	for (auto it = s_demuxers.begin(); it != s_demuxers.end();) it = it->second.expired() ? s_demuxers.erase(it) : std::next(it);
+	s_demuxers[key] = demuxer;
+	return demuxer;
+}
+
+// Probing (avformat_find_stream_info) may read several megabytes, so its results
+// are cached for opening the file with minimal probing later.
+FFmpeg::Demuxer::Demuxer(FFmpeg const& owner) {
+	const fs::path cache = mediaCacheFile(owner.m_filename, "probe", "probe", ".probe");
+	ProbeInfo probe;
+	bool cached = probe.load(cache);
+	if (cached && !open(owner, &probe)) {
+		LOG("ffmpeg", debug) << "Probe cache of " << owner.m_filename << " does not match, probing again." << std::endl;
+		cached = false;
+	}
+	if (!cached) {
+		open(owner, nullptr);
+		try {
+			probe.store(m_context.get());
+			probe.save(cache);
+		} catch (std::exception& e) {
+			std::clog << "ffmpeg/warning: Cannot store probe results of " << owner.m_filename << ": " << e.what() << std::endl;
+		}
+	}
+	AVFormatContext* avfctx = m_context.get();
+	avfctx->flags |= AVFMT_FLAG_GENPTS;
+	// Keep the packets of the streams that decoders would choose
+	for (AVMediaType type: { AVMEDIA_TYPE_AUDIO, AVMEDIA_TYPE_VIDEO }) {
+		int stream = av_find_best_stream(avfctx, type, -1, -1, nullptr, 0);
+		if (stream >= 0) m_queues[stream];
+	}
+}
+
+bool FFmpeg::Demuxer::open(FFmpeg const& owner, ProbeInfo const* probe) {
+	m_context.reset();
+	m_io.reset();
+	m_reader.reset();
+	const fs::path input = MediaCache::instance().resolve(owner.m_filename);  // The local copy of network media
+	static ConfigItem& readAhead = config["songs/media_read_ahead_mb"];
+	if (readAhead.i() > 0) {
+		try {
+			m_reader = std::make_unique<ReadAhead>(input, std::size_t(readAhead.i()) << 20);
+		} catch (std::exception& e) {
+			std::clog << "ffmpeg/warning: " << e.what() << ", reading without read-ahead" << std::endl;
+		}
+	}
+	AVFormatContext* avfctx = avformat_alloc_context();
+	if (!avfctx) throw std::bad_alloc();
+	if (m_reader) {
+		const int size = 64 << 10;  // Of FFmpeg's own buffer in front of ours
+		auto buf = static_cast<unsigned char*>(av_malloc(size));
+		if (buf) m_io.reset(avio_alloc_context(buf, size, 0, m_reader.get(), ReadAhead::readPacket, nullptr, ReadAhead::seekPacket));
+		if (!m_io) { av_free(buf); avformat_free_context(avfctx); throw std::bad_alloc(); }
+		avfctx->pb = m_io.get();
+	}
+	if (probe) {
+		avfctx->probesize = QUICK_PROBESIZE;
+		avfctx->max_analyze_duration = QUICK_ANALYZE_DURATION;
+	}
+	auto format = probe ? av_find_input_format(probe->header.format) : nullptr;  // Skips detecting the format
+	auto err = avformat_open_input(&avfctx, input.string().c_str(), format, nullptr);  // Frees avfctx on error
+	if (err && probe) return false;
+	if (err) throw Error(owner, err);
+	m_context.reset(avfctx);
+	err = avformat_find_stream_info(avfctx, nullptr);
+	if (err < 0 && probe) return false;
+	if (err < 0) throw Error(owner, err);
+	return !probe || probe->apply(avfctx);
+}
+
+bool FFmpeg::Demuxer::attach(int stream) {
+	std::lock_guard<std::mutex> l(m_mutex);
+	auto it = m_queues.find(stream);
+	if (it == m_queues.end()) {
+		if (m_read) return false;  // Its packets have not been kept
+		it = m_queues.emplace(stream, Queue()).first;
+	}
+	if (it->second.attached || !it->second.valid) return false;
+	it->second.attached = true;
+	return true;
+}
+
+void FFmpeg::Demuxer::detach(int stream) {
+	std::lock_guard<std::mutex> l(m_mutex);
+	Queue& q = m_queues[stream];
+	q.clear();
+	q.attached = false;
+	q.valid = false;
+}
+
+int FFmpeg::Demuxer::read(int stream, Packet& pkt) {
+	std::lock_guard<std::mutex> l(m_mutex);
+	Queue& q = m_queues[stream];
+	q.fromStart = false;
+	while (true) {
+		if (!q.packets.empty()) {
+			AVPacket* p = q.packets.front();
+			q.packets.pop_front();
+			q.bytes -= p->size;
+			av_packet_move_ref(&pkt, p);
+			av_packet_free(&p);
+			return 0;
+		}
+		if (!q.valid) return DETACHED;
+		auto err = av_read_frame(m_context.get(), &pkt);
+		if (err < 0) return err;
+		m_read = true;
+		if (pkt.stream_index == stream) return 0;
+		auto it = m_queues.find(pkt.stream_index);
+		if (it != m_queues.end() && it->second.valid) {
+			Queue& other = it->second;
+			if (other.bytes + pkt.size > (other.attached ? DEMUX_QUEUE_BYTES : DEMUX_PREBUFFER_BYTES)) {
+				other.clear();
+				other.valid = false;
+			} else {
+				AVPacket* p = av_packet_alloc();
+				av_packet_move_ref(p, &pkt);
+				other.packets.push_back(p);
+				other.bytes += p->size;
+			}
+		}
+		av_packet_unref(&pkt);
+	}
+}
+
+bool FFmpeg::Demuxer::seek(int stream, double time) {
+	std::lock_guard<std::mutex> l(m_mutex);
+	Queue& q = m_queues[stream];
+	if (q.fromStart && q.valid && time <= 0.0) return true;  // Going to read from the beginning anyway
+	for (auto const& kv: m_queues) if (kv.first != stream && kv.second.attached) return false;
+	// AVSEEK_FLAG_BACKWARD makes sure we always get a keyframe BEFORE the
+	// request time, thus it allows us to drop some frames to reach the
+	// exact point where asked to seek
+	av_seek_frame(m_context.get(), -1, time * AV_TIME_BASE, AVSEEK_FLAG_BACKWARD);
+	// Packets kept for others are no longer from the beginning
+	for (auto& kv: m_queues) {
+		kv.second.clear();
+		kv.second.valid = kv.first == stream;
+	}
+	q.fromStart = false;
+	return true;
+}
+
+FFmpeg::FFmpeg(fs::path const& _filename, int mediaType, unsigned displayWidth) : m_filename(_filename) {
 	static std::once_flag static_infos;
 	std::call_once(static_infos, &printFFmpegInfo);
 
 	av_log_set_level(AV_LOG_ERROR);
-	{
-		AVFormatContext *avfctx = nullptr;
-		auto err = avformat_open_input(&avfctx, m_filename.string().c_str(), nullptr, nullptr);
-		if (err) throw Error(*this, err);
-		m_formatContext.reset(avfctx);
-	}
-	auto err = avformat_find_stream_info(m_formatContext.get(), nullptr);
-	if (err < 0) throw Error(*this, err);
-	m_formatContext->flags |= AVFMT_FLAG_GENPTS;
+	m_demuxer = Demuxer::open(*this, true);
+	m_formatContext = m_demuxer->context();
 	// Find a track and open the codec
 	AVCodec* codec = nullptr;
-	m_streamId = av_find_best_stream(m_formatContext.get(), static_cast<AVMediaType>(mediaType), -1, -1, &codec, 0);
+	{
+		auto l = m_demuxer->lock();
+		m_streamId = av_find_best_stream(m_formatContext, static_cast<AVMediaType>(mediaType), -1, -1, &codec, 0);
+	}
 	if (m_streamId < 0) throw Error(*this, m_streamId);
+	if (!m_demuxer->attach(m_streamId)) {
+		// Another decoder has the stream, or its beginning has already been dropped
+		m_demuxer = Demuxer::open(*this, false);
+		m_formatContext = m_demuxer->context();
+		m_demuxer->attach(m_streamId);
+	}
+
+	auto err = openCodec(codec, mediaType, mediaType == AVMEDIA_TYPE_VIDEO, displayWidth);
+	if (err < 0 && m_hwPixelFormat != -1) {
+		std::clog << "ffmpeg/warning: Cannot open hardware decoder for " << m_filename << ", using software." << std::endl;
+		m_hwPixelFormat = -1;
+		err = openCodec(codec, mediaType, false, displayWidth);
+	}
+	if (err < 0) {
+		m_demuxer->detach(m_streamId);  // Nobody is going to take its packets
+		throw Error(*this, err);
+	}
+	m_codecContext->workaround_bugs = FF_BUG_AUTODETECT;
+	loadIndex();
+}
+
+FFmpeg::~FFmpeg() {
+	try {
+		saveIndex();
+	} catch (std::exception& e) {
+		std::clog << "ffmpeg/warning: Cannot store keyframe index of " << m_filename << ": " << e.what() << std::endl;
+	}
+	if (m_demuxer) m_demuxer->detach(m_streamId);
+}
+
+void FFmpeg::openPrivate() {
+	LOG("ffmpeg", debug) << "" << m_filename << ": Stream " << m_streamId << " continues with a demuxer of its own" << std::endl;
+	m_demuxer->detach(m_streamId);
+	m_demuxer = Demuxer::open(*this, false);
+	m_formatContext = m_demuxer->context();
+	m_demuxer->attach(m_streamId);
+	loadIndex();
+}
+
+namespace {
+	/// Keyframe index entry as stored in the cache
+	struct IndexEntry {
+		std::int64_t pos, timestamp;
+		std::int32_t size, distance;
+	};
+
+	int indexEntries(AVStream* st) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+		return avformat_index_get_entries_count(st);
+#else
+		return st->nb_index_entries;
+#endif
+	}
+
+	AVIndexEntry const* indexEntry(AVStream* st, int i) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+		return avformat_index_get_entry(st, i);
+#else
+		return &st->index_entries[i];
+#endif
+	}
+}
+
+// Containers such as MP4 and MKV come with an index. For the others (e.g. MPEG-PS/TS) the demuxer learns keyframe
+// positions while reading (AVFMT_GENERIC_INDEX); we keep them for the next time, so that seeking goes straight to
+// the right keyframe instead of guessing by bitrate.
+fs::path FFmpeg::indexFile() const {
+	return mediaCacheFile(m_filename, "keyframes", std::to_string(m_streamId), ".idx");
+}
+
+void FFmpeg::loadIndex() {
+	auto l = m_demuxer->lock();
+	AVStream* st = m_formatContext->streams[m_streamId];
+	if (m_formatContext->iformat->flags & AVFMT_GENERIC_INDEX) {
+		std::ifstream f(indexFile().string(), std::ios::binary);
+		IndexEntry e;
+		while (f.read(reinterpret_cast<char*>(&e), sizeof(e))) av_add_index_entry(st, e.pos, e.timestamp, e.size, e.distance, AVINDEX_KEYFRAME);
+	}
+	m_indexEntries = indexEntries(st);
+}
+
+void FFmpeg::saveIndex() {
+	if (!m_formatContext || !(m_formatContext->iformat->flags & AVFMT_GENERIC_INDEX)) return;
+	std::vector<IndexEntry> entries;
+	{
+		auto l = m_demuxer->lock();
+		AVStream* st = m_formatContext->streams[m_streamId];
+		const int count = indexEntries(st);
+		if (std::size_t(count) <= m_indexEntries) return;  // Nothing new
+		for (int i = 0; i < count; ++i) {
+			AVIndexEntry const* e = indexEntry(st, i);
+			if (e->flags & AVINDEX_KEYFRAME) entries.push_back(IndexEntry{ e->pos, e->timestamp, e->size, e->min_distance });
+		}
+	}
+	fs::path file = indexFile();
+	fs::create_directories(file.parent_path());
+	fs::path part = file;
+	part += ".part";
+	{
+		std::ofstream f(part.string(), std::ios::binary);
+		f.write(reinterpret_cast<char const*>(entries.data()), entries.size() * sizeof(IndexEntry));
+		if (!f) throw std::runtime_error("Cannot write " + part.string());
+	}
+	fs::rename(part, file);
+}
 
+int FFmpeg::openCodec(AVCodec const* codec, int mediaType, bool hardware, unsigned displayWidth) {
 	decltype(m_codecContext) pCodecCtx{avcodec_alloc_context3(codec), avcodec_free_context};
 	avcodec_parameters_to_context(pCodecCtx.get(), m_formatContext->streams[m_streamId]->codecpar);
+	if (hardware) setupHardware(pCodecCtx.get(), codec);
+	if (mediaType == AVMEDIA_TYPE_VIDEO) {
+		// Big videos need several cores; 0 lets FFmpeg choose by the number of cores
+		pCodecCtx->thread_count = config["graphic/video_threads"].i();
+		pCodecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		// Some (mostly older) decoders can decode at 1/2, 1/4 or 1/8 of the size, which is much faster
+		if (displayWidth && m_hwPixelFormat == -1) {
+			int lowres = 0;
+			while (lowres < codec->max_lowres && unsigned(pCodecCtx->width >> (lowres + 1)) >= displayWidth) ++lowres;
+			pCodecCtx->lowres = lowres;
+		}
+	} else {
+		pCodecCtx->thread_count = 1;  // Audio decodes fast enough, leave the cores to video and pitch detection
+	}
 	{
 		static std::mutex s_avcodec_mutex;
 		// ffmpeg documentation is clear on the fact that avcodec_open2 is not thread safe.
 		std::lock_guard<std::mutex> l(s_avcodec_mutex);
-		err = avcodec_open2(pCodecCtx.get(), codec, nullptr);
-		if (err < 0) throw Error(*this, err);
+		auto err = avcodec_open2(pCodecCtx.get(), codec, nullptr);
+		if (err < 0) return err;
 	}
-	pCodecCtx->workaround_bugs = FF_BUG_AUTODETECT;
 	m_codecContext = std::move(pCodecCtx);
+	return 0;
 }
 
-VideoFFmpeg::VideoFFmpeg(fs::path const& filename, VideoCb videoCb) : FFmpeg(filename, AVMEDIA_TYPE_VIDEO), handleVideoData(videoCb) {
-	// Setup software scaling context for YUV to RGB conversion
-	m_swsContext.reset(sws_getContext(
-				m_codecContext->width, m_codecContext->height, m_codecContext->pix_fmt,
-				m_codecContext->width, m_codecContext->height, AV_PIX_FMT_RGB24,
-				SWS_POINT, nullptr, nullptr, nullptr));
+void FFmpeg::setupHardware(AVCodecContext* ctx, AVCodec const* codec) {
+#if HAVE_HWACCEL
+	const int mode = config["graphic/video_hwaccel"].i();
+	if (mode <= 0 || mode >= int(sizeof(hwDeviceTypes) / sizeof(*hwDeviceTypes))) return;
+	for (int i = 0; AVCodecHWConfig const* hw = avcodec_get_hw_config(codec, i); ++i) {
+		if (!(hw->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX)) continue;
+		if (mode > 1 && hw->device_type != hwDeviceTypes[mode]) continue;
+		AVBufferRef* device = nullptr;
+		if (av_hwdevice_ctx_create(&device, hw->device_type, nullptr, nullptr, 0) < 0) continue;
+		ctx->hw_device_ctx = device;  // The codec context takes our reference
+		ctx->opaque = &m_hwPixelFormat;
+		ctx->get_format = getHardwareFormat;
+		m_hwPixelFormat = hw->pix_fmt;
+		std::clog << "ffmpeg/info: Decoding " << m_filename << " with " << av_hwdevice_get_type_name(hw->device_type) << std::endl;
+		return;
+	}
+	std::clog << "ffmpeg/info: No hardware decoder available for " << m_filename << ", using software." << std::endl;
+#else
+	(void)ctx; (void)codec;
+#endif
 }
 
+VideoFFmpeg::VideoFFmpeg(fs::path const& filename, VideoCb videoCb, Display& display):
+  FFmpeg(filename, AVMEDIA_TYPE_VIDEO, display.width), handleVideoData(videoCb), m_display(display) {}
+
 AudioFFmpeg::AudioFFmpeg(fs::path const& filename, unsigned int rate, AudioCb audioCb) :
 	FFmpeg(filename, AVMEDIA_TYPE_AUDIO), m_rate(rate), handleAudioData(audioCb) {
-		// setup resampler
-		m_resampleContext.reset(swr_alloc());
-		if (!m_resampleContext) throw std::runtime_error("Cannot create resampling context");
-		av_opt_set_int(m_resampleContext.get(), "in_channel_layout", m_codecContext->channel_layout ? m_codecContext->channel_layout : av_get_default_channel_layout(m_codecContext->channels), 0);
-		av_opt_set_int(m_resampleContext.get(), "out_channel_layout", av_get_default_channel_layout(AUDIO_CHANNELS), 0);
-		av_opt_set_int(m_resampleContext.get(), "in_sample_rate", m_codecContext->sample_rate, 0);
-		av_opt_set_int(m_resampleContext.get(), "out_sample_rate", m_rate, 0);
-		av_opt_set_int(m_resampleContext.get(), "in_sample_fmt", m_codecContext->sample_fmt, 0);
-		av_opt_set_int(m_resampleContext.get(), "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
-		swr_init(m_resampleContext.get());
+		setupResampler(AV_SAMPLE_FMT_S16);
 	}
 
+AudioFFmpeg::AudioFFmpeg(fs::path const& filename, unsigned int rate, FloatCb floatCb) :
+	FFmpeg(filename, AVMEDIA_TYPE_AUDIO), m_rate(rate), handleFloatData(floatCb) {
+		setupResampler(AV_SAMPLE_FMT_FLT);
+	}
+
+void AudioFFmpeg::setupResampler(int sampleFormat) {
+	m_resampleContext.reset(swr_alloc());
+	if (!m_resampleContext) throw std::runtime_error("Cannot create resampling context");
+	av_opt_set_int(m_resampleContext.get(), "in_channel_layout", m_codecContext->channel_layout ? m_codecContext->channel_layout : av_get_default_channel_layout(m_codecContext->channels), 0);
+	av_opt_set_int(m_resampleContext.get(), "out_channel_layout", av_get_default_channel_layout(AUDIO_CHANNELS), 0);
+	av_opt_set_int(m_resampleContext.get(), "in_sample_rate", m_codecContext->sample_rate, 0);
+	av_opt_set_int(m_resampleContext.get(), "out_sample_rate", m_rate, 0);
+	av_opt_set_int(m_resampleContext.get(), "in_sample_fmt", m_codecContext->sample_fmt, 0);
+	av_opt_set_int(m_resampleContext.get(), "out_sample_fmt", sampleFormat, 0);
+	// Shorter filters take less CPU time, at the cost of some aliasing (audio/resampler_quality; Normal = swr defaults)
+	static const int filterSizes[] = { 8, 16, 32, 64 }, phaseShifts[] = { 6, 8, 10, 12 };
+	const int quality = clamp(config["audio/resampler_quality"].i(), 0, 3);
+	av_opt_set_int(m_resampleContext.get(), "filter_size", filterSizes[quality], 0);
+	av_opt_set_int(m_resampleContext.get(), "phase_shift", phaseShifts[quality], 0);
+	auto err = swr_init(m_resampleContext.get());
+	if (err < 0) throw Error(*this, err);
+}
+
 double FFmpeg::duration() const { return m_formatContext->duration / double(AV_TIME_BASE); }
 
 void FFmpeg::avformat_close_input(AVFormatContext *fctx) {
@@ -301,41 +1015,35 @@ void FFmpeg::avcodec_free_context(AVCodecContext *avctx) {
 	::avcodec_free_context(&avctx);
 }
 
-struct FFmpeg::Packet: public AVPacket {
-	Packet() {
-		av_init_packet(this);
-		this->data = nullptr;
-		this->size = 0;
-	}
-
-	~Packet() { av_packet_unref(this); }
-};
-
 void FFmpeg::handleOneFrame() {
 	bool read_one = false;
 	do {
 		Packet pkt;
-		auto ret = av_read_frame(m_formatContext.get(), &pkt);
-		if(ret == AVERROR_EOF) {
+		auto ret = m_demuxer->read(m_streamId, pkt);
+		if (ret == Demuxer::DETACHED) {
+			// Continue after the last frame
+			openPrivate();
+			seek(m_position + m_frameDuration);
+			continue;
+		} else if(ret == AVERROR_EOF) {
 			// End of file: no more data to read.
 			throw Eof();
 		} else if(ret < 0) {
 			throw Error(*this, ret);
 		}
 
-		if (pkt.stream_index != m_streamId) continue;
-
 		decodePacket(pkt);
 		read_one = true;
 	} while (!read_one);
 }
 
 void FFmpeg::seek(double time) {
-	// AVSEEK_FLAG_BACKWARD makes sure we always get a keyframe BEFORE the
-	// request time, thus it allows us to drop some frames to reach the
-	// exact point where asked to seek
-	int flags = AVSEEK_FLAG_BACKWARD;
-	av_seek_frame(m_formatContext.get(), -1, time * AV_TIME_BASE, flags);
+	if (!m_demuxer->seek(m_streamId, time)) {
+		openPrivate();
+		m_demuxer->seek(m_streamId, time);
+	}
+	avcodec_flush_buffers(m_codecContext.get());  // Forget frames from before the seek
+	m_seekTarget = time;
 }
 
 void AudioFFmpeg::seek(double time) {
@@ -373,40 +1081,89 @@ void FFmpeg::decodePacket(Packet &pkt) {
 				new_position -= double(m_formatContext->streams[m_streamId]->start_time) * av_q2d(m_formatContext->streams[m_streamId]->time_base);
 			m_position = new_position;
 		}
+		// Frames before the seek target (from the keyframe onwards) are only decoded, not converted
+		m_frameDuration = 0.0;
+		if (m_codecContext->codec_type == AVMEDIA_TYPE_AUDIO) m_frameDuration = double(frame->nb_samples) / m_codecContext->sample_rate;
+		else {
+			AVRational fps = av_guess_frame_rate(m_formatContext, m_formatContext->streams[m_streamId], frame.get());
+			if (fps.num) m_frameDuration = av_q2d(av_inv_q(fps));
+		}
+		if (frame->pts != int64_t(AV_NOPTS_VALUE) && m_position + m_frameDuration <= m_seekTarget) continue;
 		processFrame(std::move(frame));
 	}
 }
 
 void VideoFFmpeg::processFrame(uFrame frame) {
-	// Convert into RGB and scale the data
-	int w = (m_codecContext->width + 15) & ~15;
-	auto h = m_codecContext->height;
+	// When decoding falls behind, catch up by skipping the conversion of frames that the renderer is already past
+	if (m_frameDuration > 0.0 && m_position + m_frameDuration < m_display.time) {
+		++m_display.dropped;
+		return;
+	}
+#if HAVE_HWACCEL
+	// Download hardware decoded frames (usually NV12)
+	if (m_hwPixelFormat != -1 && frame->format == m_hwPixelFormat) {
+		uFrame sw{av_frame_alloc()};
+		auto err = av_hwframe_transfer_data(sw.get(), frame.get(), 0);
+		if (err < 0) throw Error(*this, err);
+		frame = std::move(sw);
+	}
+#endif
+	// Scale down to the display size (there is no point converting and uploading pixels that cannot be seen)
+	int width = frame->width, height = frame->height;
+	const unsigned maxWidth = m_display.width, maxHeight = m_display.height;
+	const bool scale = maxWidth && maxHeight && (unsigned(width) > maxWidth || unsigned(height) > maxHeight);
+	const double s = scale ? std::min(double(maxWidth) / width, double(maxHeight) / height) : 1.0;
+	if (scale) {
+		width = std::max(2, int(width * s) & ~1);
+		height = std::max(2, int(height * s) & ~1);
+	}
+	// Deblocking frames that nothing refers to is wasted effort when they get scaled down this much
+	m_codecContext->skip_loop_filter = s <= 0.5 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+	// Setup software scaling context for getting planar YUV, which is converted to RGB by the video shader.
+	// Most videos already are YUV 4:2:0 and only get copied; the source format may differ from the codec's with hardware decoding.
+	// The context gets recreated whenever the format or the size changes (e.g. the window is resized).
+	m_swsContext.reset(sws_getCachedContext(m_swsContext.release(),
+				frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+				width, height, AV_PIX_FMT_YUV420P,
+				scale ? SWS_FAST_BILINEAR : SWS_POINT, nullptr, nullptr, nullptr));
+	if (!m_swsContext) throw std::runtime_error("Cannot convert video frames of " + m_filename.string());
+	int w = (width + 15) & ~15;  // Row length of the Y plane
+	int h = height;
 	Bitmap f;
 	f.timestamp = m_position;
-	f.fmt = pix::RGB;
-	f.resize(w, h);
+	f.fmt = pix::YUV420P;
+	f.resize(w, h);  // More than enough for the three planes
+	f.width = width;
+	f.ar = float(frame->width) / frame->height;  // Scaling keeps the aspect ratio (up to rounding)
 	{
-		uint8_t* data = f.data();
-		int linesize = w * 3;
-		sws_scale(m_swsContext.get(), frame->data, frame->linesize, 0, h, &data, &linesize);
+		uint8_t* y = f.data();
+		uint8_t* u = y + w * h;
+		uint8_t* v = u + (w / 2) * ((h + 1) / 2);
+		uint8_t* data[] = { y, u, v };
+		int linesize[] = { w, w / 2, w / 2 };
+		sws_scale(m_swsContext.get(), frame->data, frame->linesize, 0, frame->height, data, linesize);
 	}
 	handleVideoData(std::move(f));  // Takes ownership and may block until there is space
 }
 
 void AudioFFmpeg::processFrame(uFrame frame) {
-	// resample to output
-	int16_t *output;
+	// resample to output (the buffer only grows, so that decoding does not allocate after the first frames)
+	const bool floats = bool(handleFloatData);
 	int out_samples = swr_get_out_samples(m_resampleContext.get(), frame->nb_samples);
-	av_samples_alloc((uint8_t**)&output, nullptr, AUDIO_CHANNELS, out_samples,
-			AV_SAMPLE_FMT_S16, 0);
-	out_samples = swr_convert(m_resampleContext.get(), (uint8_t**)&output, out_samples,
+	const std::size_t bytes = std::size_t(out_samples) * AUDIO_CHANNELS * (floats ? sizeof(float) : sizeof(std::int16_t));
+	if (m_output.size() < bytes) m_output.resize(bytes);
+	uint8_t* output = m_output.data();
+	out_samples = swr_convert(m_resampleContext.get(), &output, out_samples,
 			(const uint8_t**)&frame->data[0], frame->nb_samples);
-	// The output is now an interleaved array of 16-bit samples
+	if (out_samples < 0) throw Error(*this, out_samples);
+	// The output is now an interleaved array of 16-bit or float samples
 	if (m_position_in_48k_frames == -1) {
 		m_position_in_48k_frames = m_position * m_rate + 0.5;
 	}
-	handleAudioData(output, out_samples * AUDIO_CHANNELS, m_position_in_48k_frames * AUDIO_CHANNELS /* pass in samples */);
-	av_freep(&output);
+	const size_t count = out_samples * AUDIO_CHANNELS;
+	const int64_t pos = m_position_in_48k_frames * AUDIO_CHANNELS;  // Position in samples
+	if (floats) handleFloatData(reinterpret_cast<float const*>(output), count, pos);
+	else handleAudioData(reinterpret_cast<std::int16_t const*>(output), count, pos);
 	m_position_in_48k_frames += out_samples;
 	m_position += frame->nb_samples * av_q2d(m_formatContext->streams[m_streamId]->time_base);
 }
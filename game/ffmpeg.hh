@@ -1,6 +1,7 @@
 #pragma once
 
 #include "chrono.hh"
+#include "memstats.hh"
 #include "texture.hh"
 #include "util.hh"
 #include "libda/sample.hpp"
@@ -12,13 +13,17 @@
 #include <future>
 #include <deque>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 
+namespace boost { namespace iostreams { class mapped_file; } }
+
 // ffmpeg forward declarations
 extern "C" {
+  struct AVCodec;
   struct AVCodecContext;
   struct AVFormatContext;
   struct AVFrame;
@@ -38,8 +43,8 @@ class FFmpeg {
 	class Error;
 	friend Error;
 
-	/// Decode file, depending on media type audio.
-	FFmpeg(fs::path const& filename, int mediaType);
+	/// Decode file, depending on media type audio. Videos are displayed at most displayWidth wide (0 = unknown).
+	FFmpeg(fs::path const& filename, int mediaType, unsigned displayWidth = 0);
 
 	void handleOneFrame();
 
@@ -49,7 +54,7 @@ class FFmpeg {
 	/// duration
 	double duration() const;
 
-	virtual ~FFmpeg() = default;
+	virtual ~FFmpeg();
 
   protected:
 	static void frameDeleter(AVFrame *f) { if (f) av_frame_free(&f); }
@@ -58,45 +63,80 @@ class FFmpeg {
 	virtual void processFrame(uFrame frame) = 0;
 
 	struct Packet;
+	class Demuxer;
 	void decodePacket(Packet &);
+	/// Switch to a demuxer of our own (when the shared one cannot serve us); the caller seeks it
+	void openPrivate();
+	/// Allocate and open m_codecContext (preferably with a hardware decoder for video). Returns an FFmpeg error code.
+	int openCodec(AVCodec const* codec, int mediaType, bool hardware, unsigned displayWidth);
+	/// Attach a hardware device to the codec context, if one is configured and available
+	void setupHardware(AVCodecContext* ctx, AVCodec const* codec);
+	/// Keyframe index cache file of the stream
+	fs::path indexFile() const;
+	/// Feed keyframes seen in earlier sessions to the demuxer's index
+	void loadIndex();
+	/// Store the keyframes found by the demuxer, if it has learned any new ones
+	void saveIndex();
 
 	static void avformat_close_input(AVFormatContext *fctx);
 	static void avcodec_free_context(AVCodecContext *avctx);
 
 	fs::path m_filename;
 	double m_position = 0.0;
+	double m_seekTarget = -std::numeric_limits<double>::infinity();  ///< Frames ending before this (after a seek) are dropped without processing them
+	double m_frameDuration = 0.0;  ///< Of the frame being processed (0 if unknown)
+	std::size_t m_indexEntries = 0;  ///< Keyframe index entries known after opening
 	double m_duration = 0.0;
 	// libav-specific variables
 	int m_streamId = -1;
-	std::unique_ptr<AVFormatContext, decltype(&avformat_close_input)> m_formatContext{nullptr, avformat_close_input};
+	int m_hwPixelFormat = -1;  ///< AVPixelFormat of hardware decoded frames (-1 when decoding in software)
+	std::shared_ptr<Demuxer> m_demuxer;  ///< Possibly shared with the decoder of another stream of the file
+	AVFormatContext* m_formatContext = nullptr;  ///< Owned by m_demuxer
 	std::unique_ptr<AVCodecContext, decltype(&avcodec_free_context)> m_codecContext{nullptr, avcodec_free_context};
 };
 
 class AudioFFmpeg : public FFmpeg {
   public:
 	using AudioCb = std::function<void(const std::int16_t *data, size_t count, int64_t sample_position)>;
+	using FloatCb = std::function<void(const float *data, size_t count, int64_t sample_position)>;
 	AudioFFmpeg(fs::path const& file, unsigned int rate, AudioCb audioCb);
+	/// Decode to float samples (no quantization to 16 bits)
+	AudioFFmpeg(fs::path const& file, unsigned int rate, FloatCb floatCb);
 
 	void seek(double time) override;
   protected:
 	void processFrame(uFrame frame) override;
   private:
+	/// Setup resampling to interleaved stereo of the given AVSampleFormat at m_rate
+	void setupResampler(int sampleFormat);
 	int64_t m_position_in_48k_frames = -1;
 	unsigned int m_rate = 0;
 	AudioCb handleAudioData;
+	FloatCb handleFloatData;  ///< Used instead of handleAudioData when set
+	std::vector<std::uint8_t> m_output;  ///< Resampled samples of the current frame
 	std::unique_ptr<SwrContext, void(*)(SwrContext*)> m_resampleContext{nullptr, [] (auto p) { swr_close(p); swr_free(&p); }};
 };
 
 class VideoFFmpeg : public FFmpeg {
   public:
 	using VideoCb = std::function<void(Bitmap)>;
-	VideoFFmpeg(fs::path const& file, VideoCb videoCb);
+	/// State shared with the renderer
+	struct Display {
+		/// Largest size that the video is shown at (in pixels). Frames are scaled down to fit.
+		std::atomic<unsigned> width{ 0 }, height{ 0 };
+		/// Video time being shown; frames that end before it are late and get dropped before conversion
+		std::atomic<double> time{ -std::numeric_limits<double>::infinity() };
+		std::atomic<unsigned> dropped{ 0 };  ///< Late frames dropped so far
+	};
+	/// display must outlive the object
+	VideoFFmpeg(fs::path const& file, VideoCb videoCb, Display& display);
 
   protected:
 	void processFrame(uFrame frame) override;
   private:
 	std::unique_ptr<SwsContext, void(*)(SwsContext*)> m_swsContext{nullptr, sws_freeContext};
         VideoCb handleVideoData;
+	Display& m_display;
 
 };
 
@@ -104,39 +144,82 @@ class AudioBuffer {
   public:
 	using uFvec = std::unique_ptr<fvec_t, std::integral_constant<decltype(&del_fvec), &del_fvec>>;
 
-	AudioBuffer(fs::path const& file, unsigned int rate, size_t size = 4320256);
+	/// Open file for decoding. A size of zero sizes the ring by the track duration, limited by audio/buffer_seconds.
+	AudioBuffer(fs::path const& file, unsigned int rate, size_t size = 0);
 	~AudioBuffer();
 
-	uFvec makePreviewBuffer();
-	void operator()(const std::int16_t *data, size_t count, int64_t sample_position);
 	bool prepare(std::int64_t pos);
+	/// Mix count samples from pos on, scaled by volume, into begin (audio callback). What is not decoded yet adds silence,
+	/// and a pos outside of the buffered range starts a seek. Returns false at the end of the track.
 	bool read(float* begin, size_t count, std::int64_t pos, float volume = 1.0f);
 	bool terminating();
 	double duration();
 
   private:
-	// must be called holding the mutex
 	bool eof(std::int64_t pos) const {
-		return (m_eof_pos != -1 && pos >= m_eof_pos) || (double(pos) / m_sps >= m_duration);
+		const std::int64_t eof_pos = m_eof_pos;
+		return (eof_pos != -1 && pos >= eof_pos) || (double(pos) / m_sps >= m_duration);
 	}
 
-	bool wantSeek();
+	/// Store decoded samples (std::int16_t or float, matching m_data) at the given position
+	template <typename Sample> void write(Sample const* data, size_t count, int64_t sample_position);
 	bool wantMore();
 	/// Should the input stop waiting?
 	bool condition();
-
-	mutable std::mutex m_mutex;
+	/// Has the reader asked for a seek that the decoder thread has not started yet?
+	bool seekPending() const { return m_seek_requested != m_seek_handled; }
+	/// Sleep until pred() holds (decoder thread)
+	template <typename Pred> void sleepUntil(Pred pred);
+	/// Wake up the decoder thread if it sleeps. Never blocks, and may thus be missed by a decoder that is just about to
+	/// sleep, which is why sleeping has a timeout.
+	void wake();
+
+	/// Sample storage of the ring: heap memory or a memory-mapped temporary file (audio/buffer_file_backed),
+	/// holding 16-bit or float samples (audio/buffer_float)
+	class Storage {
+	  public:
+		Storage() = default;
+		~Storage();
+		void allocate(size_t samples, bool floatSamples, bool fileBacked);
+		bool isFloat() const { return m_float; }
+		size_t size() const { return m_size; }
+		/// Fill count samples from position pos on with silence, wrapping around
+		void silence(size_t pos, size_t count);
+		/// Copy samples to the ring, starting at position pos and wrapping around. Sample must match isFloat().
+		template <typename Sample> void write(size_t pos, Sample const* src, size_t count);
+		/// Mix samples starting at position pos (without wrapping) into dst
+		void mix(float* dst, size_t pos, size_t count, float gain) const;
+		float at(size_t i) const;
+	  private:
+		std::vector<float> m_memory;
+		std::unique_ptr<boost::iostreams::mapped_file> m_file;
+		fs::path m_filename;
+		unsigned char* m_ptr = nullptr;
+		size_t m_size = 0;
+		bool m_float = false;
+		memstats::Usage m_usage{ "audio buffers" };  ///< Counts file-backed rings too (they are in the page cache)
+	};
+
+	/**
+	* The decoder thread writes the ring ahead of the audio callback, which is the only reader, and neither ever waits
+	* for the other: the positions are atomic, each published after its side is done with the samples. The decoder
+	* never touches samples once published (below m_write_pos); only a seek restarts the ring, and the reader ignores
+	* it until the decoder has taken the seek on. The mutex is only for the decoder thread to sleep on.
+	**/
+	std::mutex m_mutex;
 	std::condition_variable m_cond;
+	std::atomic<bool> m_sleeping{ false };
 
-	std::vector<std::int16_t> m_data;
-	std::int64_t m_write_pos = 0;
-	std::int64_t m_read_pos = 0;
-	std::int64_t m_eof_pos = -1; // -1 until we get the read end from ffmpeg
+	Storage m_data;
+	std::atomic<std::int64_t> m_write_pos{ 0 };  ///< End of the decoded samples (set by the decoder thread)
+	std::atomic<std::int64_t> m_read_pos{ 0 };  ///< End of the samples read (set by the reader)
+	std::atomic<std::int64_t> m_eof_pos{ -1 }; // -1 until we get the read end from ffmpeg
 
 	const unsigned m_sps;
 	const double m_duration{ 0 };
-	bool m_seek_asked { false };
-	bool m_quit{ false };
+	std::atomic<unsigned> m_seek_requested{ 0 };  ///< Seeks to m_read_pos asked by the reader
+	std::atomic<unsigned> m_seek_handled{ 0 };  ///< Value of m_seek_requested that the decoder thread last started
+	std::atomic<bool> m_quit{ false };
 	std::future<void> reader_thread;
 };
 
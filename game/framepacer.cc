@@ -0,0 +1,47 @@
+#include "framepacer.hh"
+
+#include <algorithm>
+#include <thread>
+
+namespace {
+	/// Frame interval used when the refresh rate is unknown (max 100 FPS)
+	const Seconds DEFAULT_INTERVAL(0.010);
+	/// Left free before the swap for timing jitter
+	const Seconds MARGIN(0.002);
+	/// Background work gets at least this much even when rendering is slow
+	const Seconds MIN_BUDGET(0.001);
+	/// Weight of the latest frame in the smoothed render time
+	const double SMOOTHING = 0.1;
+}
+
+void FramePacer::begin() {
+	m_begin = Clock::now();
+}
+
+void FramePacer::rendered() {
+	const Seconds t = Clock::now() - m_begin;
+	m_lastRender = t;
+	// Rising quickly and falling slowly, so that a slow frame doesn't make the next one late too
+	m_renderTime = std::max(t, m_renderTime + SMOOTHING * (t - m_renderTime));
+}
+
+void FramePacer::swapped(Seconds refresh, bool vsync) {
+	m_swapped = Clock::now();
+	m_refresh = refresh;
+	m_vsync = vsync;
+}
+
+Time FramePacer::deadline() const {
+	const Seconds interval = m_refresh.count() > 0.0 ? m_refresh : DEFAULT_INTERVAL;
+	// When the swap waits for the refresh anyway, starting early costs nothing but being late costs a whole frame
+	const Seconds slack = m_vsync ? std::max(MARGIN, m_renderTime) : Seconds(0.0);
+	return m_swapped + clockDur(interval - m_renderTime - slack);
+}
+
+Clock::duration FramePacer::idleBudget() const {
+	return std::max(clockDur(MIN_BUDGET), deadline() - Clock::now());
+}
+
+void FramePacer::wait() const {
+	std::this_thread::sleep_until(deadline());
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "chrono.hh"
+
+/**
+* Paces the main loop to the display refresh instead of a fixed frame rate. The time spent rendering is
+* measured, and the loop sleeps until just before the next frame needs to be rendered. Background work
+* done between frames (texture uploads, Screen::prepare) gets whatever is left of the frame.
+* With vsync Window::swap waits for the refresh too, so more slack is left before it to avoid missing one.
+**/
+class FramePacer {
+  public:
+	/// Mark the start of rendering a frame
+	void begin();
+	/// Mark the end of rendering (just before swap)
+	void rendered();
+	/// Mark the end of a swap. refresh is the display refresh interval (zero if unknown), vsync whether swaps wait for it.
+	void swapped(Seconds refresh, bool vsync);
+	/// Time left for background work before the next frame is due (always a little, so that the work progresses)
+	Clock::duration idleBudget() const;
+	/// Sleep until the next frame is due
+	void wait() const;
+	/// Time from begin to rendered of the latest frame (the CPU side of drawing it)
+	Seconds renderTime() const { return m_lastRender; }
+
+  private:
+	Time deadline() const;  ///< When rendering the next frame should begin
+	Time m_begin = Clock::now();
+	Time m_swapped = Clock::now();
+	Seconds m_refresh{ 0.0 };
+	Seconds m_renderTime{ 0.0 };  ///< Smoothed time from begin to rendered
+	Seconds m_lastRender{ 0.0 };
+	bool m_vsync = false;
+};
@@ -3,14 +3,17 @@
 #include "config.hh"
 #include "configuration.hh"
 #include "platform.hh"
+#include "themebundle.hh"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/range.hpp>
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <mutex>
 #include <set>
 #include <sstream>
+#include <unordered_map>
 
 #if (BOOST_OS_WINDOWS)
 #include <windows.h>
@@ -62,6 +65,74 @@ namespace {
 
 	std::mutex mutex;
 	using Lock = std::lock_guard<std::mutex>;
+
+	std::atomic<unsigned> pathGeneration{ 0 };  ///< Incremented by pathInit to invalidate the theme index
+
+	/// The theme search path with the folders listed once, so that findFile is a hash lookup instead of probing each folder
+	struct ThemeIndex {
+		std::string theme;
+		unsigned generation = ~0u;
+		Paths paths;
+		std::unordered_map<std::string, fs::path> files;  ///< The first match of each plain file name
+		std::unordered_map<std::string, fs::path> resolved;  ///< Memoized lookups of names with folders
+		/// Rebuild if the theme or the search path have changed since the last call
+		void update(std::string const& currentTheme);
+	} themeIndex;
+
+	std::mutex themeMutex;  ///< Guards themeIndex (never lock mutex while holding this, not the other way around)
+
+	Paths buildThemePaths(std::string const& theme) {
+		const fs::path themes = "themes";
+		const fs::path def = "default";
+		const fs::path www = "www";
+		const fs::path js = "js";
+		const fs::path css = "css";
+		const fs::path images = "images";
+		const fs::path fonts = "fonts";
+
+		Paths paths = getPaths();
+		Paths infixes = {
+						  themes / theme,
+						  themes / theme / www,
+						  themes / theme / www / js,
+						  themes / theme / www / css,
+						  themes / theme / www / images,
+						  themes / theme / www / fonts,
+
+						  themes / def,
+						  themes / def / www,
+						  themes / def / www / js,
+						  themes / def / www / css,
+						  themes / def / www / images,
+						  themes / def / www / fonts,
+						  fs::path() };
+		if (!theme.empty() && theme != def) infixes.push_front(themes / theme);
+		// Build combinations of paths and infixes
+		Paths themePaths;
+		for (fs::path const& infix: infixes) {
+			for (fs::path p: paths) {
+				p /= infix;
+				if (fs::is_directory(p)) themePaths.push_back(p);
+			}
+		}
+		return themePaths;
+	}
+
+	void ThemeIndex::update(std::string const& currentTheme) {
+		const unsigned currentGeneration = pathGeneration;
+		if (currentTheme == theme && currentGeneration == generation) return;
+		theme = currentTheme;
+		generation = currentGeneration;
+		paths = buildThemePaths(theme);
+		files.clear();
+		resolved.clear();
+		for (auto const& dir: paths) {
+			boost::system::error_code ec;
+			for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+				files.emplace(it->path().filename().string(), it->path());  // Earlier folders take precedence
+			}
+		}
+	}
 }
 
 	BinaryBuffer readFile(fs::path const& path) {
@@ -106,7 +177,10 @@ void copyDirectoryRecursively(const fs::path& sourceDir, const fs::path& destina
 }
 
 void pathBootstrap() { Lock l(mutex); cache.pathBootstrap(); }
-void pathInit() { Lock l(mutex); cache.pathInit(); }
+void pathInit() {
+	{ Lock l(mutex); cache.pathInit(); }
+	++pathGeneration;
+}
 fs::path getLogFilename() { Lock l(mutex); return cache.cache / "infolog.txt"; }
 fs::path getSchemaFilename() { Lock l(mutex); return cache.share / configSchema; }
 fs::path getHomeDir() { Lock l(mutex); return cache.home; }
@@ -119,51 +193,39 @@ fs::path getCacheDir() { Lock l(mutex); return cache.cache; }
 Paths const& getPaths() { Lock l(mutex); return cache.paths; }
 
 Paths getThemePaths() {
-	const fs::path themes = "themes";
-	const fs::path def = "default";
-	const fs::path www = "www";
-	const fs::path js = "js";
-	const fs::path css = "css";
-	const fs::path images = "images";
-	const fs::path fonts = "fonts";
-
 	std::string theme = config["game/theme"].getEnumName();
-	Paths paths = getPaths();
-	Paths infixes = { 
-					  themes / theme,
-					  themes / theme / www,
-					  themes / theme / www / js,
-					  themes / theme / www / css,
-					  themes / theme / www / images,
-					  themes / theme / www / fonts,
-
-					  themes / def,
-					  themes / def / www,					  
-					  themes / def / www / js,
-					  themes / def / www / css,				  
-					  themes / def / www / images,			  
-					  themes / def / www / fonts,
-					  fs::path() };
-	if (!theme.empty() && theme != def) infixes.push_front(themes / theme);
-	// Build combinations of paths and infixes
-	Paths themePaths;
-	for (fs::path const& infix: infixes) {
-		for (fs::path p: paths) {
-			p /= infix;
-			if (fs::is_directory(p)) themePaths.push_back(p);
-		}
-	}
-	return themePaths;
+	std::lock_guard<std::mutex> l(themeMutex);
+	themeIndex.update(theme);
+	return themeIndex.paths;
 }
 
 fs::path findFile(fs::path const& filename) {
 	if (filename.empty()) throw std::logic_error("findFile expects a filename.");
 	if (filename.is_absolute()) throw std::logic_error("findFile expects a filename without path.");
+	{
+		fs::path p = ThemeBundle::find(filename);
+		if (!p.empty()) return p;
+	}
+	std::string theme = config["game/theme"].getEnumName();
+	Paths paths;
+	{
+		std::lock_guard<std::mutex> l(themeMutex);
+		themeIndex.update(theme);
+		auto& map = ++filename.begin() == filename.end() ? themeIndex.files : themeIndex.resolved;
+		auto it = map.find(filename.string());
+		if (it != map.end()) return it->second;
+		paths = themeIndex.paths;
+	}
+	// Not indexed (has folders or was added after indexing), so probe the folders
 	Paths list;
-	for (fs::path p: getThemePaths()) {
+	for (fs::path p: paths) {
 		p /= filename;
 		list.push_back(p);
-		if (fs::exists(p)) return p.string();
+		if (fs::exists(p)) {
+			std::lock_guard<std::mutex> l(themeMutex);
+			if (themeIndex.theme == theme) themeIndex.resolved.emplace(filename.string(), p);
+			return p.string();
+		}
 	}
 	std::string logmsg = "fs/error: Unable to locate data file, tried:\n";
 	for (auto const& p: list) logmsg += "  " + p.string() + '\n';
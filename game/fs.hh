@@ -43,7 +43,7 @@ struct pathCache {
 	void pathInit();
 };
 
-fs::path findFile(fs::path const& filename);  ///< Look for the specified file in theme and data folders.
+fs::path findFile(fs::path const& filename);  ///< Look for the specified file in theme and data folders (listed once per theme and search path).
 
 BinaryBuffer readFile(fs::path const& path); ///< Reads a file into a buffer. 
 
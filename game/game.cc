@@ -1,13 +1,16 @@
 #include "audio.hh"
+#include "log.hh"
 #include "screen.hh"
 #include "fs.hh"
 #include "configuration.hh"
 #include "glutil.hh"
+#include "memstats.hh"
 #include "util.hh"
 
-#include <thread>
-#include <stdexcept>
 #include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
 
 template<> Game* Singleton<Game>::ms_Singleton = nullptr;
 
@@ -15,6 +18,8 @@ Game::Game(Window& _window, Audio& _audio):
   m_audio(_audio), m_window(_window), m_finished(false), newScreen(), currentScreen(), currentPlaylist(),
   m_timeToFadeIn(), m_timeToFadeOut(), m_timeToShow(), m_message(),
   m_messagePopup(0.0, 1.0), m_textMessage(findFile("message_text.svg"), config["graphic/text_lod"].f()),
+  m_textStats(findFile("message_text.svg"), config["graphic/text_lod"].f()), m_statsTime(Clock::now()),
+  m_memStatsTime(Clock::now()),
   m_loadingProgress(0.0f), m_logo(findFile("logo.svg")), m_logoAnim(0.0, 0.5)
 {
 	m_textMessage.dimensions.middle().center(-0.05);
@@ -34,12 +39,41 @@ void Game::updateScreen() {
 	currentScreen = s;
 }
 
+void Game::addScreen(std::string const& name, ScreenFactory factory, bool prewarm) {
+	std::lock_guard<std::recursive_mutex> l(m_screensMutex);
+	m_factories[name] = std::move(factory);
+	if (prewarm) m_prewarm.push_back(name);
+}
+
+bool Game::prewarmScreen() {
+	while (!m_prewarm.empty()) {
+		std::string name = m_prewarm.front();
+		m_prewarm.erase(m_prewarm.begin());
+		if (findScreen(name)) continue;  // Already created when needed
+		getScreen(name);
+		return true;
+	}
+	return false;
+}
+
 Screen* Game::getScreen(std::string const& name) {
+	std::lock_guard<std::recursive_mutex> l(m_screensMutex);
 	auto it = screens.find(name);
 	if (it != screens.end()){
 		return it->second.get();
 	}
-	throw std::invalid_argument("Screen " + name + " does not exist");
+	auto factory = m_factories.find(name);
+	if (factory == m_factories.end()) throw std::invalid_argument("Screen " + name + " does not exist");
+	LOG("game", debug) << "Creating screen " << name << std::endl;
+	std::unique_ptr<Screen> s = factory->second();
+	m_factories.erase(factory);
+	return screens.emplace(name, std::move(s)).first->second.get();
+}
+
+Screen* Game::findScreen(std::string const& name) {
+	std::lock_guard<std::recursive_mutex> l(m_screensMutex);
+	auto it = screens.find(name);
+	return it == screens.end() ? nullptr : it->second.get();
 }
 
 void Game::prepareScreen() {
@@ -47,15 +81,28 @@ void Game::prepareScreen() {
 }
 
 void Game::drawScreen() {
-	getCurrentScreen()->draw();
+	{
+		glutil::GPUTimer::Section section(getCurrentScreen()->getName());
+		getCurrentScreen()->draw();
+	}
 	drawLogo();
 	drawNotifications();
 }
 
+double Game::idleFps() const {
+	static ConfigItem& audioStats = config["audio/stats"];
+	static ConfigItem& memoryStats = config["graphic/memory_stats"];
+	static ConfigItem& perfOverlay = config["graphic/perf_overlay"];
+	// The overlays and dialogs change by themselves, flash messages and the logo animate through AnimValues
+	if (newScreen || !currentScreen || m_dialog || audioStats.b() || memoryStats.b() || perfOverlay.b()) return std::numeric_limits<double>::infinity();
+	return currentScreen->idleFps();
+}
+
 void Game::loading(std::string const& message, float progress) {
 	// TODO: Create a better one, this is quite ugly
 	flashMessage(message + " " + std::to_string(int(round(progress*100))) + "%", 0.0f, 0.5f, 0.2f);
 	m_loadingProgress = progress;
+	AnimValue::beginFrame();
 	m_window.blank();
 	m_window.render([this] { drawLoading(); });
 	m_window.swap();
@@ -85,6 +132,7 @@ void Game::drawLoading() {
 
 void Game::fatalError(std::string const& message) {
 	dialog("FATAL ERROR\n\n" + message);
+	AnimValue::beginFrame();
 	m_window.blank();
 	m_window.render([this] { drawNotifications(); });
 	m_window.swap();
@@ -133,6 +181,12 @@ void Game::drawNotifications() {
 		ColorTrans c(Color::alpha(fadeValue));
 		m_textMessage.draw(m_message); // Draw the message
 	}
+	static ConfigItem& audioStats = config["audio/stats"];
+	static ConfigItem& memoryStats = config["graphic/memory_stats"];
+	static ConfigItem& perfOverlay = config["graphic/perf_overlay"];
+	if (audioStats.b()) drawAudioStats();
+	if (memoryStats.b()) drawMemoryStats();
+	if (perfOverlay.b()) m_perfOverlay.draw();
 	// Dialog
 	if (m_dialog) {
 		m_dialog->draw();
@@ -140,6 +194,36 @@ void Game::drawNotifications() {
 	}
 }
 
+void Game::drawAudioStats() {
+	auto now = Clock::now();
+	if (m_stats.empty() || now - m_statsTime >= 1s) {
+		m_statsTime = now;
+		m_stats = m_audio.statistics();
+		for (auto const& line: m_stats) std::clog << "audio/info: " << line << std::endl;
+	}
+	for (std::size_t i = 0; i < m_stats.size(); ++i) {
+		m_textStats.dimensions.left(-0.45).screenTop(0.12 + 0.04 * i);
+		m_textStats.draw(m_stats[i]);
+	}
+}
+
+void Game::drawMemoryStats() {
+	auto now = Clock::now();
+	if (m_memStats.empty() || now - m_memStatsTime >= 1s) {
+		m_memStatsTime = now;
+		m_memStats.clear();
+		for (auto const& a: memstats::statistics()) {
+			m_memStats.push_back(a.name + (a.kind == memstats::Kind::VRAM ? " (VRAM): " : ": ") + memstats::format(a.current)
+			  + ", peak " + memstats::format(a.peak) + ", " + std::to_string(a.holders) + " objects");
+		}
+		for (auto const& line: m_memStats) std::clog << "memory/info: " << line << std::endl;
+	}
+	for (std::size_t i = 0; i < m_memStats.size(); ++i) {
+		m_textStats.dimensions.left(0.0).screenTop(0.12 + 0.04 * i);
+		m_textStats.draw(m_memStats[i]);
+	}
+}
+
 void Game::finished() {
 	m_finished = true;
 }
@@ -4,6 +4,11 @@
 #include "video_driver.hh"
 #include <boost/filesystem/fstream.hpp>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
 #include <stdexcept>
 
 using namespace glutil;
@@ -21,6 +26,34 @@ namespace {
 		data.back() = '\0';
 		return std::string(&data[0]);
 	}
+
+	const unsigned VERSION = 1;  ///< Part of the cache file name hash, increment when the format changes
+	const char MAGIC[8] = "PFSPROG";
+
+	struct ProgramHeader {
+		char magic[8];
+		std::uint32_t format;  ///< Driver specific binary format
+		std::uint32_t size;
+	};
+
+	/// Can the driver save and load program binaries
+	bool programBinaries() {
+		if (epoxy_gl_version() < 41 && !epoxy_has_gl_extension("GL_ARB_get_program_binary")) return false;
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return formats > 0;
+	}
+
+	/// Cache file of a program, by the driver and the sources (with defines) it is made of
+	template <typename Sources> fs::path cacheFile(Sources const& sources) {
+		auto str = [](GLenum name) { char const* s = reinterpret_cast<char const*>(glGetString(name)); return std::string(s ? s : ""); };
+		std::ostringstream key;
+		key << VERSION << '\n' << str(GL_VENDOR) << '\n' << str(GL_RENDERER) << '\n' << str(GL_VERSION) << '\n';
+		for (auto const& s: sources) key << s.type << '\n' << s.code << '\n';
+		std::ostringstream name;
+		name << std::hex << std::hash<std::string>()(key.str()) << ".bin";
+		return getCacheDir() / "shaders" / name.str();
+	}
 }
 
 /// Dumps Shader/Program InfoLog
@@ -52,40 +85,15 @@ void Shader::dumpInfoLog(GLuint id) {
 }
 
 void Shader::bindUniformBlocks() {
-	glUseProgram(program);
-	glBindBuffer(GL_UNIFORM_BUFFER,Window::UBO());
-	GLsizei bufferSize = glutil::danceNoteUniforms::offset() + glutil::danceNoteUniforms::size();
-	glBufferData(GL_UNIFORM_BUFFER, bufferSize, NULL, GL_DYNAMIC_DRAW);
+	glutil::GLErrorChecker ec("Shader::bindUniformBlocks");
+	// Window binds the blocks themselves to these binding points (see glutil::UniformArena)
 	for (std::pair<std::string, unsigned int> const& uniformBlock: Shader::m_uniformblocks) {
-			GLuint blockIndex = glGetUniformBlockIndex(program, uniformBlock.first.c_str());
-			if (blockIndex != GL_INVALID_INDEX) {
-		glutil::GLErrorChecker ec("Shader::bindUniformBlocks");
-		ec.check("glBindBufferRange()");
-		{
-				switch (uniformBlock.second) {
-				case 7:
-					glBindBufferRange(GL_UNIFORM_BUFFER, 7, Window::UBO(), glutil::shaderMatrices::offset(), sizeof(glutil::shaderMatrices));
-					break;
-				case 8:
-					glBindBufferRange(GL_UNIFORM_BUFFER, 8, Window::UBO(), glutil::stereo3dParams::offset(), sizeof(glutil::stereo3dParams));
-					break;
-				case 9:
-					glBindBufferRange(GL_UNIFORM_BUFFER, 9, Window::UBO(), glutil::lyricColorUniforms::offset(), sizeof(glutil::lyricColorUniforms));
-					break;
-				case 10:
-					glBindBufferRange(GL_UNIFORM_BUFFER, 10, Window::UBO(), glutil::danceNoteUniforms::offset(), sizeof(glutil::danceNoteUniforms));
-					break;
-				}
-			}
-		ec.check("glUniformBlockBinding()");
-		{
-				glUniformBlockBinding(program, blockIndex, uniformBlock.second);
-		}
-		}
+		GLuint blockIndex = glGetUniformBlockIndex(program, uniformBlock.first.c_str());
+		if (blockIndex != GL_INVALID_INDEX) glUniformBlockBinding(program, blockIndex, uniformBlock.second);
 	}
 }
 
-Shader::Shader(std::string const& name): name(name), program(0) {}
+Shader::Shader(std::string const& name): name(name), program(0) { locations.fill(-1); }
 
 Shader::~Shader() {
 	glDeleteProgram(program);
@@ -105,20 +113,17 @@ Shader& Shader::compileFile(fs::path const& filename) {
 		std::string::size_type pos = srccode.find("//DEFINES");
 		if (pos != std::string::npos) srccode = srccode.substr(0, pos) + defs + srccode.substr(pos + 9);
 	}
-	try {
-		return compileCode(srccode, type);
-	} catch (std::runtime_error& e) {
-		throw std::runtime_error(filename.filename().string() + ": " + e.what());
-	}
+	sources.push_back(Source{ filename.filename().string(), srccode, type });
+	return *this;
 }
 
 const std::forward_list<std::pair<std::string, unsigned int>> Shader::m_uniformblocks = {
 // Holds the block names for our uniform blocks, this list will be iterated on Shader::link to assign valid bindings to each of these.
 // Make sure to update this if ever the uniform block names change in GLSL.
-	{"shaderMatrices", 7},
-	{"stereoParams", 8},
-	{"lyricColors", 9},
-	{"danceNote", 10}
+	{"shaderMatrices", glutil::shaderMatrices::binding},
+	{"stereoParams", glutil::stereo3dParams::binding},
+	{"lyricColors", glutil::lyricColorUniforms::binding},
+	{"danceNote", glutil::danceNoteUniforms::binding}
 };
 
 
@@ -149,6 +154,24 @@ Shader& Shader::compileCode(std::string const& srccode, GLenum type) {
 Shader& Shader::link() {
 	glutil::GLErrorChecker ec("Shader::link");
 	if (program) throw std::runtime_error("Shader already linked.");
+	// Programs of compileFile sources only are cached (the key cannot cover compileCode)
+	fs::path cache;
+	if (shader_ids.empty() && !sources.empty() && programBinaries()) {
+		cache = cacheFile(sources);
+		if (loadBinary(cache)) {
+			sources.clear();
+			resolveUniforms();
+			return *this;
+		}
+	}
+	for (Source const& s: sources) {
+		try {
+			compileCode(s.code, s.type);
+		} catch (std::runtime_error& e) {
+			throw std::runtime_error(s.file + ": " + e.what());
+		}
+	}
+	sources.clear();
 	// Create the program id
 	program = glCreateProgram();
 	ec.check("glCreateProgram");
@@ -160,6 +183,7 @@ Shader& Shader::link() {
 	ec.check("glAttachShader");
 
 	// Link and check status
+	if (!cache.empty()) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(program);
 
 	// always detach shaders, linked or not, they need to be detached
@@ -171,19 +195,85 @@ Shader& Shader::link() {
 		throw std::runtime_error("Something went wrong linking the shader program.");
 	}
 	ec.check("glLinkProgram");
-
+	resolveUniforms();
+	if (!cache.empty()) {
+		try {
+			saveBinary(cache);
+		} catch (std::exception& e) {
+			std::clog << "opengl/warning: Shader " << name << ": " << e.what() << std::endl;
+		}
+	}
 	return *this;
 }
 
+bool Shader::loadBinary(fs::path const& file) {
+	fs::ifstream f(file, std::ios::binary);
+	ProgramHeader h;
+	if (!f.read(reinterpret_cast<char*>(&h), sizeof(h))) return false;
+	if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC))) return false;
+	std::vector<char> data(h.size);
+	if (!f.read(data.data(), data.size())) return false;
+	program = glCreateProgram();
+	if (program == 0) return false;
+	glProgramBinary(program, h.format, data.data(), data.size());
+	glGetError();  // A rejected binary (e.g. after a driver update) is no error for us
+	glGetProgramiv(program, GL_LINK_STATUS, &gl_response);
+	if (gl_response == GL_TRUE) return true;
+	std::clog << "opengl/info: Shader " << name << ": Cached program was rejected by the driver, compiling." << std::endl;
+	glDeleteProgram(program);
+	program = 0;
+	return false;
+}
+
+void Shader::saveBinary(fs::path const& file) {
+	GLint size = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0) return;
+	std::vector<char> data(size);
+	GLenum format = 0;
+	glGetProgramBinary(program, size, &size, &format, data.data());
+	ProgramHeader h{};
+	std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.format = format;
+	h.size = size;
+	// Write to a temporary name first so that loadBinary never sees partial files
+	fs::create_directories(file.parent_path());
+	fs::path part = file;
+	part += ".part";
+	{
+		fs::ofstream f(part, std::ios::binary);
+		f.write(reinterpret_cast<char const*>(&h), sizeof(h));
+		f.write(data.data(), h.size);
+		if (!f) throw std::runtime_error("Cannot write " + part.string());
+	}
+	fs::rename(part, file);
+}
+
 
 Shader& Shader::bind() {
 	glutil::GLErrorChecker ec("Shader::bind");
-	glUseProgram(program);
+	glutil::useProgram(program);
 	return *this;
 }
 
 
+void Shader::resolveUniforms() {
+	// Names of UniformId values, in order
+	static char const* const names[] = { "texU", "texV", "yuvMatrix", "scroll", "freqRange" };
+	static_assert(sizeof(names) / sizeof(*names) == std::size_t(UniformId::COUNT), "Update the names of UniformId");
+	for (std::size_t i = 0; i < locations.size(); ++i) locations[i] = glGetUniformLocation(program, names[i]);
+}
+
+Uniform Shader::operator[](UniformId uniform) {
+	glutil::QuadBatch::flush();  // Queued quads may use the old value
+	bind();
+	GLint var = locations[std::size_t(uniform)];
+	if (var == -1) throw std::logic_error("GLSL shader '" + name + "' uniform variable #" + std::to_string(int(uniform)) + " not found.");
+	return Uniform(var);
+}
+
 Uniform Shader::operator[](const std::string& uniform) {
+	glutil::QuadBatch::flush();  // Queued quads may use the old value
 	bind();
 	// Try to use a cached value
 	auto it = uniforms.find(uniform);
@@ -2,6 +2,7 @@
 
 #include "fs.hh"
 #include "glutil.hh"
+#include <array>
 #include <forward_list>
 #include <map>
 #include <string>
@@ -24,6 +25,9 @@ struct Uniform {
 	void setMat4(glmath::mat4 const& m) { glUniformMatrix4fv(id, 1, GL_FALSE, &m[0][0]); }
 };
 
+/// Uniforms set by draw code (uniform blocks excluded), their locations are looked up once when a program is linked
+enum class UniformId { texU, texV, yuvMatrix, scroll, freqRange, COUNT };
+
 struct Shader {
 	Shader(const Shader&) = delete;
   	const Shader& operator=(const Shader&) = delete;
@@ -38,11 +42,14 @@ struct Shader {
 	~Shader();
 	/// Set a string that will replace "//DEFINES" in anything loaded by compileFile
 	Shader& addDefines(std::string const& defines) { defs += defines; return *this; }
-	/// Load shader from file
+	/// Load shader from file (compiled by link, unless the program binary is cached)
 	Shader& compileFile(fs::path const& filename);
 	/** Compiles a shader of a given type. */
 	Shader& compileCode(std::string const& srccode, GLenum type);
-	/** Links all compiled shaders to a shader program. */
+	/**
+	* Links all compiled shaders to a shader program. A program made only of compileFile sources is loaded from
+	* the program binary cache in getCacheDir() when the driver accepts it, otherwise it is built and cached.
+	**/
 	Shader& link();
 
 	/** Binds the shader into use. */
@@ -53,6 +60,11 @@ struct Shader {
 
 	/** Get uniform location. Uses caching internally. */
 	Uniform operator[](const std::string& uniform);
+	/** Get uniform location resolved at link time, without any lookups. */
+	Uniform operator[](UniformId uniform);
+
+	/// Program object id
+	GLuint id() const { return program; }
 
 	// Some operators
 	bool operator==(const Shader& rhs) const { return program == rhs.program; }
@@ -67,11 +79,25 @@ private:
 
 	std::string defs;
 
+	/// A source loaded by compileFile, waiting for link
+	struct Source {
+		std::string file;
+		std::string code;  ///< With defines
+		GLenum type;
+	};
+	std::vector<Source> sources;
+
 	typedef std::vector<GLuint> ShaderObjects;
 	ShaderObjects shader_ids;
 
+	/// Create program from a cached binary (false if missing or rejected by the driver)
+	bool loadBinary(fs::path const& file);
+	void saveBinary(fs::path const& file);
+
 	typedef std::map<std::string, GLint> UniformMap;
 	UniformMap uniforms; ///< Cached uniform locations, use operator[] to access
+	std::array<GLint, std::size_t(UniformId::COUNT)> locations; ///< Locations of UniformId uniforms (-1 if not in the program)
+	void resolveUniforms();
 
 };
 
@@ -79,14 +105,14 @@ private:
 /** Temporarily switch shader in a RAII manner. */
 struct UseShader {
 	UseShader(Shader& new_shader): m_shader(new_shader) {
-		glGetIntegerv(GL_CURRENT_PROGRAM, &m_old);
+		m_old = glutil::currentProgram();
 		m_shader.bind();
 	}
-	~UseShader() { glUseProgram(m_old); }
+	~UseShader() { glutil::useProgram(m_old); }
 	/// Access the bound shader
 	Shader& operator()() { return m_shader; }
 
   private:
 	Shader& m_shader;
-	GLint m_old;
+	GLuint m_old;
 };
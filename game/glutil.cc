@@ -1,30 +1,545 @@
 #include "glutil.hh"
 #include "video_driver.hh"
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <utility>
+
 namespace glutil {
 
-	GLintptr alignOffset(GLintptr offset) {
-		if (Window::bufferOffsetAlignment == -1) {
-		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &Window::bufferOffsetAlignment);
-		}
-		float result;
-		result = std::ceil(static_cast<float>(offset) / static_cast<float>(Window::bufferOffsetAlignment));
-		result *= Window::bufferOffsetAlignment;
-		return result;
+	const GLuint shaderMatrices::binding;
+	const GLuint stereo3dParams::binding;
+	const GLuint lyricColorUniforms::binding;
+	const GLuint danceNoteUniforms::binding;
+
+	namespace {
+		std::size_t s_drawCalls = 0;
 	}
-		
+
+	std::size_t drawCalls() { return s_drawCalls; }
+
+	void VertexInfo::setupAttribs() {
+		const GLsizei stride = sizeof(VertexInfo);
+		glEnableVertexAttribArray(positionAttrib);
+		glVertexAttribPointer(positionAttrib, 3, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(VertexInfo, vertPos));
+		glEnableVertexAttribArray(texCoordAttrib);
+		glVertexAttribPointer(texCoordAttrib, 2, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(VertexInfo, vertTexCoord));
+		glEnableVertexAttribArray(normalAttrib);
+		glVertexAttribPointer(normalAttrib, 3, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(VertexInfo, vertNormal));
+		glEnableVertexAttribArray(colorAttrib);
+		glVertexAttribPointer(colorAttrib, 4, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(VertexInfo, vertColor));
+	}
+
 	void VertexArray::clear() {
 		m_vertices.clear();
 	}
 
 	void VertexArray::draw(GLint mode) {
+		QuadBatch::flush();  // Keep the drawing order
+		submit(mode);
+	}
+
+	void VertexArray::submit(GLint mode) {
 		GLErrorChecker glerror("VertexArray::draw");
 		if (empty()) return;
 	
-		glBufferData(GL_ARRAY_BUFFER, stride() * size(), &m_vertices.front(), GL_DYNAMIC_DRAW);
+		GLint first = VertexStream::current()->write(&m_vertices.front(), size());
 
 		glerror.check("draw arrays");
-		glDrawArrays(mode, 0, size());
+		glDrawArrays(mode, first, size());
+		++s_drawCalls;
+	}
+
+	void VertexArray::drawInstanced(std::vector<InstanceInfo> const& instances, GLint mode) {
+		QuadBatch::flush();  // Keep the drawing order
+		GLErrorChecker glerror("VertexArray::drawInstanced");
+		if (empty() || instances.empty()) return;
+		GLintptr offset;
+		GLint first = VertexStream::current()->write(&m_vertices.front(), size(), instances, offset);
+		// Instance attributes are only enabled for the draw, so that other draws need no instance data
+		const GLsizei stride = sizeof(InstanceInfo);
+		glEnableVertexAttribArray(InstanceInfo::positionAttrib);
+		glVertexAttribPointer(InstanceInfo::positionAttrib, 2, GL_FLOAT, GL_FALSE, stride, (void *)(offset + offsetof(InstanceInfo, position)));
+		glVertexAttribDivisor(InstanceInfo::positionAttrib, 1);
+		glEnableVertexAttribArray(InstanceInfo::paramsAttrib);
+		glVertexAttribPointer(InstanceInfo::paramsAttrib, 2, GL_FLOAT, GL_FALSE, stride, (void *)(offset + offsetof(InstanceInfo, glow)));
+		glVertexAttribDivisor(InstanceInfo::paramsAttrib, 1);
+		glerror.check("instance attributes");
+		glDrawArraysInstanced(mode, first, size(), instances.size());
+		++s_drawCalls;
+		glDisableVertexAttribArray(InstanceInfo::positionAttrib);
+		glDisableVertexAttribArray(InstanceInfo::paramsAttrib);
+	}
+
+	namespace {
+		/// Initial size of the vertex stream (grown if a single VertexArray does not fit)
+		const std::size_t STREAM_VERTICES = 1 << 16;
+		/// Size of the uniform arena (a frame typically uses a few hundred kB)
+		const std::size_t ARENA_BYTES = 4 << 20;
+		/// Pixel buffers kept by PixelReadback for reuse (enough for the reads in flight while capturing video)
+		const std::size_t READBACK_SPARE_BUFFERS = 4;
+	}
+
+	StreamBuffer::StreamBuffer(std::size_t capacity): m_capacity(capacity) {
+		GLErrorChecker glerror("StreamBuffer");
+		glGenBuffers(1, &m_buffer);
+		bindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+		if (epoxy_gl_version() >= 44 || epoxy_has_gl_extension("GL_ARB_buffer_storage")) {
+			const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, nullptr, flags);
+			m_ring = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity, flags));
+			if (!m_ring) {
+				// Storage is immutable, so start over with a new buffer for the fallback path
+				std::clog << "video/warning: Cannot map stream buffer persistently, using slower uploads." << std::endl;
+				deleteBuffer(m_buffer);
+				glGenBuffers(1, &m_buffer);
+				bindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+			}
+		}
+		if (!m_ring) glBufferData(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+		glerror.check("storage");
+	}
+
+	StreamBuffer::~StreamBuffer() {
+		for (auto const& r: m_inFlight) glDeleteSync(r.fence);
+		deleteBuffer(m_buffer);  // Also unmaps the ring; the driver keeps the storage alive for draws still pending
+	}
+
+	void StreamBuffer::fence() {
+		if (!m_ring || m_fenced == m_head) return;
+		m_inFlight.push_back(Region{ m_fenced, m_head, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) });
+		m_fenced = m_head;
+	}
+
+	void StreamBuffer::waitFor(std::size_t begin, std::size_t end) {
+		while (!m_inFlight.empty()) {
+			Region const& r = m_inFlight.front();
+			if (r.end <= begin || r.begin >= end) break;
+			glClientWaitSync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 /* ns */);
+			glDeleteSync(r.fence);
+			m_inFlight.pop_front();
+		}
+	}
+
+	std::size_t StreamBuffer::reserve(std::size_t bytes, std::size_t alignment) {
+		std::size_t first = (m_head + alignment - 1) / alignment * alignment;
+		if (first + bytes > m_capacity) {
+			if (m_ring) {
+				fence();  // Data of this frame may still be in use too
+				waitFor(m_head, m_capacity);  // The regions skipped at the end are the oldest ones
+			} else {
+				bindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+				glBufferData(GL_COPY_WRITE_BUFFER, m_capacity, nullptr, GL_STREAM_DRAW);  // Orphan the previous contents
+			}
+			m_head = m_fenced = first = 0;
+		}
+		if (m_ring) waitFor(first, first + bytes);
+		m_head = first + bytes;
+		return first;
+	}
+
+	void StreamBuffer::copy(std::size_t offset, void const* data, std::size_t bytes) {
+		if (m_ring) {
+			std::memcpy(m_ring + offset, data, bytes);
+			return;
+		}
+		bindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+		const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+		void* ptr = glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, bytes, access);
+		if (ptr) {
+			std::memcpy(ptr, data, bytes);
+			glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		} else {
+			glBufferSubData(GL_COPY_WRITE_BUFFER, offset, bytes, data);
+		}
+	}
+
+	VertexStream* VertexStream::s_current = nullptr;
+
+	VertexStream::VertexStream(Setup setup): m_setup(std::move(setup)) {
+		create(STREAM_VERTICES);
+		s_current = this;
+	}
+
+	VertexStream::~VertexStream() {
+		if (s_current == this) s_current = nullptr;
+	}
+
+	void VertexStream::create(std::size_t capacity) {
+		m_buffer.reset();
+		m_buffer = std::make_unique<StreamBuffer>(capacity * sizeof(VertexInfo));
+		bindBuffer(GL_ARRAY_BUFFER, m_buffer->id());
+		m_setup(m_buffer->id());
+	}
+
+	std::size_t VertexStream::reserve(std::size_t count) {
+		const std::size_t capacity = m_buffer->capacity() / sizeof(VertexInfo);
+		if (count > capacity) {
+			std::size_t grown = capacity;
+			while (grown < count) grown *= 2;
+			create(grown);
+		}
+		return m_buffer->reserve(count * sizeof(VertexInfo), sizeof(VertexInfo)) / sizeof(VertexInfo);
+	}
+
+	GLint VertexStream::write(VertexInfo const* vertices, std::size_t count) {
+		const std::size_t first = reserve(count);
+		m_buffer->copy(first * sizeof(VertexInfo), vertices, count * sizeof(VertexInfo));
+		return first;
+	}
+
+	GLint VertexStream::write(VertexInfo const* vertices, std::size_t count, std::vector<InstanceInfo> const& instances, GLintptr& instanceOffset) {
+		// Reserved together so that the vertices cannot be orphaned before the instances are in
+		const std::size_t bytes = instances.size() * sizeof(InstanceInfo);
+		const std::size_t first = reserve(count + (bytes + sizeof(VertexInfo) - 1) / sizeof(VertexInfo));
+		m_buffer->copy(first * sizeof(VertexInfo), vertices, count * sizeof(VertexInfo));
+		instanceOffset = (first + count) * sizeof(VertexInfo);
+		m_buffer->copy(instanceOffset, instances.data(), bytes);
+		return first;
+	}
+
+	UniformArena* UniformArena::s_current = nullptr;
+
+	UniformArena::UniformArena(): m_buffer(ARENA_BYTES) {
+		s_current = this;
+	}
+
+	UniformArena::~UniformArena() {
+		if (s_current == this) s_current = nullptr;
+	}
+
+	void UniformArena::bind(GLuint binding, void const* data, std::size_t bytes) {
+		static GLint alignment = 0;
+		if (!alignment) glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		QuadBatch::flush();
+		const std::size_t offset = m_buffer.reserve(bytes, alignment);
+		m_buffer.copy(offset, data, bytes);
+		glBindBufferRange(GL_UNIFORM_BUFFER, binding, m_buffer.id(), offset, bytes);
+	}
+
+	namespace {
+		/// Frames to wait for query results before reading them anyway (blocking)
+		const std::size_t MAX_PENDING_FRAMES = 4;
+	}
+
+	GPUTimer* GPUTimer::s_current = nullptr;
+
+	GPUTimer::Section::Section(char const* name) {
+		if (s_current && s_current->m_enabled) begin(name);
+	}
+
+	GPUTimer::Section::Section(std::string const& name) {
+		if (s_current && s_current->m_enabled) begin(trace::intern(name));
+	}
+
+	void GPUTimer::Section::begin(char const* name) {
+		QuadBatch::flush();  // Queued draws belong to the enclosing section
+		m_timer = s_current;
+		m_frame = m_timer->m_frameNumber;
+		m_index = m_timer->m_frame.size();
+		GLuint q = m_timer->query();
+		glQueryCounter(q, GL_TIMESTAMP);
+		m_timer->m_frame.push_back(Record{ name, q, 0 });
+	}
+
+	GPUTimer::Section::~Section() {
+		if (!m_timer || m_timer != s_current || m_frame != m_timer->m_frameNumber) return;  // Timer or frame gone meanwhile
+		QuadBatch::flush();
+		GLuint q = m_timer->query();
+		glQueryCounter(q, GL_TIMESTAMP);
+		m_timer->m_frame[m_index].end = q;
+	}
+
+	GPUTimer::GPUTimer(): m_profiler("gpu") {
+		s_current = this;
+	}
+
+	GPUTimer::~GPUTimer() {
+		if (s_current == this) s_current = nullptr;
+		m_pending.push_back(std::move(m_frame));
+		for (auto& frame: m_pending) for (auto& r: frame) { m_free.push_back(r.begin); if (r.end) m_free.push_back(r.end); }
+		if (!m_free.empty()) glDeleteQueries(m_free.size(), m_free.data());
+		m_profiler.dump("");  // Discard
+	}
+
+	GLuint GPUTimer::query() {
+		GLuint q = 0;
+		if (m_free.empty()) glGenQueries(1, &q);
+		else { q = m_free.back(); m_free.pop_back(); }
+		return q;
+	}
+
+	void GPUTimer::endFrame() {
+		if (!m_frame.empty()) m_pending.push_back(std::move(m_frame));
+		m_frame.clear();
+		++m_frameNumber;
+		while (!m_pending.empty()) {
+			Frame& frame = m_pending.front();
+			if (m_pending.size() <= MAX_PENDING_FRAMES) {
+				// Queries complete in order, so the frame is ready when its last one is
+				GLuint available = GL_FALSE;
+				glGetQueryObjectuiv(frame.back().end ? frame.back().end : frame.back().begin, GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available) break;
+			}
+			collect(frame);
+			m_pending.pop_front();
+		}
+	}
+
+	void GPUTimer::collect(Frame& frame) {
+		for (auto& r: frame) {
+			m_free.push_back(r.begin);
+			if (!r.end) continue;  // Section still open at swap (not a complete measurement)
+			m_free.push_back(r.end);
+			GLuint64 begin = 0, end = 0;
+			glGetQueryObjectui64v(r.begin, GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(r.end, GL_QUERY_RESULT, &end);
+			m_profiler.add(r.name, 1e-9 * double(end - begin));
+			if (&r == &frame.front()) m_latest = Seconds(1e-9 * double(end - begin));
+		}
+	}
+
+	PixelReadback::~PixelReadback() {
+		for (auto& p: m_pending) {
+			glDeleteSync(p.fence);
+			deleteBuffer(p.pbo);
+		}
+		for (auto& s: m_spare) deleteBuffer(s.first);
+	}
+
+	void PixelReadback::read(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, std::size_t bytes, Callback callback) {
+		GLErrorChecker glerror("PixelReadback::read");
+		QuadBatch::flush();
+		Pending p{ 0, nullptr, bytes, std::move(callback) };
+		auto spare = std::find_if(m_spare.begin(), m_spare.end(), [bytes](auto const& s) { return s.second == bytes; });
+		if (spare != m_spare.end()) {
+			// Repeated reads (video capture) cycle through the same few buffers
+			p.pbo = spare->first;
+			m_spare.erase(spare);
+			bindBuffer(GL_PIXEL_PACK_BUFFER, p.pbo);
+		} else {
+			glGenBuffers(1, &p.pbo);
+			bindBuffer(GL_PIXEL_PACK_BUFFER, p.pbo);
+			glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+		}
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(x, y, width, height, format, type, nullptr);  // Into the buffer, returns at once
+		bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		p.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glerror.check("glReadPixels");
+		m_pending.push_back(std::move(p));
+	}
+
+	void PixelReadback::endFrame() {
+		while (!m_pending.empty()) {
+			Pending& p = m_pending.front();
+			// Poll without waiting (flushing, so that the fence gets there)
+			if (glClientWaitSync(p.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) break;
+			glDeleteSync(p.fence);
+			std::vector<std::uint8_t> pixels(p.bytes);
+			bindBuffer(GL_PIXEL_PACK_BUFFER, p.pbo);
+			void const* ptr = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, p.bytes, GL_MAP_READ_BIT);
+			if (ptr) std::memcpy(pixels.data(), ptr, p.bytes);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			if (m_spare.size() < READBACK_SPARE_BUFFERS) m_spare.emplace_back(p.pbo, p.bytes);
+			else deleteBuffer(p.pbo);
+			Callback callback = std::move(p.callback);
+			m_pending.pop_front();
+			if (ptr) callback(std::move(pixels));
+			else std::clog << "opengl/error: PixelReadback: Cannot map the pixel buffer" << std::endl;
+		}
+	}
+
+	VertexBuffer::~VertexBuffer() {
+		deleteBuffer(m_vbo);
+		deleteBuffer(m_ibo);
+		deleteVertexArray(m_vao);
+	}
+
+	void VertexBuffer::upload(VertexArray const& va) {
+		upload(va.empty() ? nullptr : &va.m_vertices.front(), va.size());
+		m_indices = 0;
+	}
+
+	void VertexBuffer::upload(std::vector<VertexInfo> const& vertices, std::vector<std::uint32_t> const& indices) {
+		upload(vertices.data(), vertices.size());
+		GLErrorChecker glerror("VertexBuffer::upload indices");
+		const GLuint vao = boundVertexArray();
+		bindVertexArray(m_vao);
+		// The element array binding is part of the VAO state, so it is bound directly rather than through bindBuffer
+		if (!m_ibo) {
+			glGenBuffers(1, &m_ibo);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+		}
+		m_indices = indices.size();
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indices * sizeof(std::uint32_t), indices.data(), GL_STATIC_DRAW);
+		bindVertexArray(vao);
+	}
+
+	void VertexBuffer::upload(VertexInfo const* vertices, GLsizei count) {
+		GLErrorChecker glerror("VertexBuffer::upload");
+		const GLuint vao = boundVertexArray(), vbo = boundBuffer(GL_ARRAY_BUFFER);
+		if (!m_vao) {
+			glGenVertexArrays(1, &m_vao);
+			glGenBuffers(1, &m_vbo);
+			bindVertexArray(m_vao);
+			bindBuffer(GL_ARRAY_BUFFER, m_vbo);
+			VertexInfo::setupAttribs();
+		} else {
+			bindBuffer(GL_ARRAY_BUFFER, m_vbo);
+		}
+		m_size = count;
+		glBufferData(GL_ARRAY_BUFFER, m_size * sizeof(VertexInfo), vertices, GL_STATIC_DRAW);
+		bindVertexArray(vao);
+		bindBuffer(GL_ARRAY_BUFFER, vbo);
+	}
+
+	void VertexBuffer::draw(GLint mode, GLint first, GLsizei count) {
+		QuadBatch::flush();  // Keep the drawing order
+		if (count <= 0 || !m_vao) return;
+		GLErrorChecker glerror("VertexBuffer::draw");
+		const GLuint vao = boundVertexArray();
+		bindVertexArray(m_vao);
+		glDrawArrays(mode, first, count);
+		++s_drawCalls;
+		bindVertexArray(vao);
+	}
+
+	void VertexBuffer::drawElements(GLint mode) {
+		QuadBatch::flush();  // Keep the drawing order
+		if (m_indices <= 0 || !m_vao) return;
+		GLErrorChecker glerror("VertexBuffer::drawElements");
+		const GLuint vao = boundVertexArray();
+		bindVertexArray(m_vao);
+		glDrawElements(mode, m_indices, GL_UNSIGNED_INT, nullptr);
+		++s_drawCalls;
+		bindVertexArray(vao);
+	}
+
+	namespace {
+		QuadBatch::Key s_batchKey;
+		VertexArray s_batch;
+		GLenum s_blendSrc = GL_NONE, s_blendDst = GL_NONE;  // Unknown until set
+		// The rest of the cached state starts from the defaults of a new context
+		GLuint s_program = 0;
+		GLuint s_activeUnit = 0;
+		std::map<std::pair<GLuint, GLenum>, GLuint> s_textures;  ///< By unit and target
+		bool s_depthTest = false;
+		GLuint s_vao = 0;
+		std::map<GLenum, GLuint> s_buffers;  ///< By target
+	}
+
+	void QuadBatch::add(Key const& key, float x1, float y1, float x2, float y2, float s1, float t1, float s2, float t2) {
+		if (s_batch.empty() || !(key == s_batchKey)) {
+			flush();
+			s_batchKey = key;
+		}
+		// Two triangles per quad
+		s_batch.texCoord(s1, t1).vertex(x1, y1);
+		s_batch.texCoord(s2, t1).vertex(x2, y1);
+		s_batch.texCoord(s1, t2).vertex(x1, y2);
+		s_batch.texCoord(s2, t1).vertex(x2, y1);
+		s_batch.texCoord(s2, t2).vertex(x2, y2);
+		s_batch.texCoord(s1, t2).vertex(x1, y2);
+	}
+
+	void QuadBatch::flush() {
+		if (s_batch.empty()) return;
+		GLErrorChecker glerror("QuadBatch::flush");
+		// Restore the program and texture afterwards, the flush may happen in the middle of setting up another draw
+		const GLuint program = currentProgram(), unit = activeTextureUnit(), texture = boundTexture(s_batchKey.target);
+		useProgram(s_batchKey.program);
+		bindTexture(s_batchKey.target, s_batchKey.texture);
+		const GLint wrap = s_batchKey.repeat ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+		glTexParameteri(s_batchKey.target, GL_TEXTURE_WRAP_S, wrap);
+		glTexParameteri(s_batchKey.target, GL_TEXTURE_WRAP_T, wrap);
+		glerror.check("texture");
+		s_batch.submit(GL_TRIANGLES);
+		s_batch.clear();
+		bindTexture(s_batchKey.target, texture);
+		activeTexture(unit);
+		useProgram(program);
+	}
+
+	void blendFunc(GLenum src, GLenum dst) {
+		if (src == s_blendSrc && dst == s_blendDst) return;
+		QuadBatch::flush();
+		glBlendFunc(src, dst);
+		s_blendSrc = src;
+		s_blendDst = dst;
+	}
+
+	void useProgram(GLuint program) {
+		if (program == s_program) return;
+		glUseProgram(program);
+		s_program = program;
+	}
+
+	GLuint currentProgram() { return s_program; }
+
+	void activeTexture(GLuint unit) {
+		if (unit == s_activeUnit) return;
+		glActiveTexture(GL_TEXTURE0 + unit);
+		s_activeUnit = unit;
+	}
+
+	GLuint activeTextureUnit() { return s_activeUnit; }
+
+	void bindTexture(GLenum target, GLuint texture, GLuint unit) {
+		activeTexture(unit);
+		GLuint& bound = s_textures[std::make_pair(unit, target)];
+		if (bound == texture) return;
+		glBindTexture(target, texture);
+		bound = texture;
+	}
+
+	GLuint boundTexture(GLenum target, GLuint unit) {
+		auto it = s_textures.find(std::make_pair(unit, target));
+		return it == s_textures.end() ? 0 : it->second;
+	}
+
+	void depthTest(bool enable) {
+		if (enable == s_depthTest) return;
+		if (enable) glEnable(GL_DEPTH_TEST); else glDisable(GL_DEPTH_TEST);
+		s_depthTest = enable;
+	}
+
+	void bindVertexArray(GLuint vao) {
+		if (vao == s_vao) return;
+		glBindVertexArray(vao);
+		s_vao = vao;
+	}
+
+	GLuint boundVertexArray() { return s_vao; }
+
+	void bindBuffer(GLenum target, GLuint buffer) {
+		GLuint& bound = s_buffers[target];
+		if (bound == buffer) return;
+		glBindBuffer(target, buffer);
+		bound = buffer;
+	}
+
+	GLuint boundBuffer(GLenum target) {
+		auto it = s_buffers.find(target);
+		return it == s_buffers.end() ? 0 : it->second;
+	}
+
+	void deleteTexture(GLuint texture) {
+		glDeleteTextures(1, &texture);
+		for (auto& t: s_textures) if (t.second == texture) t.second = 0;
+	}
+
+	void deleteVertexArray(GLuint vao) {
+		glDeleteVertexArrays(1, &vao);
+		if (vao == s_vao) s_vao = 0;
+	}
+
+	void deleteBuffer(GLuint buffer) {
+		glDeleteBuffers(1, &buffer);
+		for (auto& b: s_buffers) if (b.second == buffer) b.second = 0;
 	}
 
 	GLErrorChecker::GLErrorChecker(std::string const& info): info(info) {
@@ -3,83 +3,271 @@
 
 #include "color.hh"
 #include "glmath.hh"
+#include "profiler.hh"
 #include <epoxy/gl.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <string>
 #include <iostream>
 #include <vector>
 
 namespace glutil {
 
-	GLintptr alignOffset(GLintptr offset);
-
 	// Note: if you reorder or otherwise change the contents of this, VertexArray::Draw() must be modified accordingly
 	struct VertexInfo {
+		/// Attribute locations of the shaders
+		static const GLuint positionAttrib = 0, texCoordAttrib = 1, normalAttrib = 2, colorAttrib = 3;
+		/// Point the attributes at the currently bound GL_ARRAY_BUFFER (of the bound VAO)
+		static void setupAttribs();
 		glmath::vec3 vertPos = glmath::vec3(0.0f);
 		glmath::vec2 vertTexCoord = glmath::vec2(0.0f);
 		glmath::vec3 vertNormal = glmath::vec3(0.0f);
 		glmath::vec4 vertColor = glmath::vec4(1.0f);
 	};
+
+	/// Per-instance attributes for VertexArray::drawInstanced (see dancenote.vert)
+	struct InstanceInfo {
+		static const GLuint positionAttrib = 4;  ///< instPosition
+		static const GLuint paramsAttrib = 5;  ///< instParams
+		glmath::vec2 position = glmath::vec2(0.0f);  ///< Offset added to the (transformed) vertices
+		float glow = 0.0f;  ///< Hit animation
+		float type = 0.0f;  ///< Shader specific kind of instance
+	};
 	
-	// Uniform block structs
+	// Uniform block structs (bound to their binding points by UniformArena, see also Shader::m_uniformblocks)
 	struct shaderMatrices {
 		glmath::mat4 projMatrix; // 0 --- Equals vec4[4].
 		glmath::mat4 mvMatrix; // 64 --- Equals vec4[4].
 		glmath::mat4 normalMatrix; // 128 --- Equals vec4[4], but this one should be converted to mat3 in the shader.
 		glmath::mat4 colorMatrix; // 192 --- Equals vec4[4].
 		
-		static GLsizeiptr size() { return sizeof(shaderMatrices); };
-		static GLintptr offset() { return 0; };
+		static const GLuint binding = 7;
 		shaderMatrices() {};
 		shaderMatrices(const shaderMatrices&) = delete;
 		shaderMatrices& operator=(const shaderMatrices&) = delete;
 	}; // 256 bytes
 	
 	struct stereo3dParams {
-		float sepFactor; // 256
-		float z0; // 260
-		float padding[2] = {7.0, 13.0}; // 264
+		float sepFactor = 0.0f; // 0
+		float z0 = 0.0f; // 4
+		float padding[2] = {7.0, 13.0}; // 8
 		
-		static GLsizeiptr size() { return sizeof(stereo3dParams); };
-		static GLintptr offset() { return alignOffset(shaderMatrices::size()); };
+		static const GLuint binding = 8;
 		stereo3dParams() {};
 		stereo3dParams(const stereo3dParams&) = delete;
 		stereo3dParams& operator=(const stereo3dParams&) = delete;
 	}; // 16 bytes
 	
 	struct lyricColorUniforms {
-		glmath::vec4 origFill; // 272
-		glmath::vec4 origStroke; // 288
-		glmath::vec4 newFill; // 304
-		glmath::vec4 newStroke; // 320
+		glmath::vec4 origFill; // 0
+		glmath::vec4 origStroke; // 16
+		glmath::vec4 newFill; // 32
+		glmath::vec4 newStroke; // 48
 
-		static GLsizeiptr size() { return sizeof(lyricColorUniforms); };
-		static GLintptr offset() { return alignOffset(stereo3dParams::offset() + stereo3dParams::size()); };
+		static const GLuint binding = 9;
 		lyricColorUniforms() {};
 		lyricColorUniforms(const lyricColorUniforms&) = delete;
 		lyricColorUniforms& operator=(const lyricColorUniforms&) = delete;
 	}; // 64 bytes
 	
 	struct danceNoteUniforms {
-		int noteType; // 336
-		float hitAnim; // 340
-		float clock; // 344
-		float scale; // 348
-		glmath::vec2 position; // 352
-		float padding[2] = {7.0, 13.0};
-
-		static GLsizeiptr size() { return sizeof(danceNoteUniforms); };
-		static GLintptr offset() { return alignOffset(lyricColorUniforms::offset() + lyricColorUniforms::size()); };
+		float clock; // 0
+		float scale; // 4
+		glmath::vec2 padding = glmath::vec2(7.0, 13.0); // 8
+
+		static const GLuint binding = 10;
 		danceNoteUniforms() {};
 		danceNoteUniforms(const danceNoteUniforms&) = delete;
 		danceNoteUniforms& operator=(const danceNoteUniforms&) = delete;
-	}; // 32 bytes
-	// Total 368 bytes
+	}; // 16 bytes
+
+	/**
+	* Ring of GPU memory that the CPU fills once per use (vertices, uniform blocks).
+	* With GL 4.4 or ARB_buffer_storage the buffer is mapped persistently and fences keep the CPU from
+	* overwriting data that the GPU has not used yet. Otherwise data is written with unsynchronized
+	* glMapBufferRange and the buffer is orphaned when full. Either way there is no glBufferData per use.
+	* The buffer is only bound to GL_COPY_WRITE_BUFFER for this, so other bindings are not disturbed.
+	**/
+	class StreamBuffer {
+	public:
+		explicit StreamBuffer(std::size_t capacity);
+		~StreamBuffer();
+		StreamBuffer(StreamBuffer const&) = delete;
+		StreamBuffer& operator=(StreamBuffer const&) = delete;
+		GLuint id() const { return m_buffer; }
+		std::size_t capacity() const { return m_capacity; }
+		/// Make room for bytes (at most capacity) at an offset that is a multiple of alignment, returning the offset
+		std::size_t reserve(std::size_t bytes, std::size_t alignment);
+		/// Copy bytes of data to offset (within space reserved)
+		void copy(std::size_t offset, void const* data, std::size_t bytes);
+		/// Fence the data written during the frame (call at buffer swap)
+		void endFrame() { fence(); }
+	private:
+		struct Region {
+			std::size_t begin, end;  ///< Byte offsets
+			GLsync fence;
+		};
+		void fence();
+		void waitFor(std::size_t begin, std::size_t end);
+		GLuint m_buffer = 0;
+		std::size_t m_capacity;
+		std::size_t m_head = 0;  ///< Next byte to write
+		std::size_t m_fenced = 0;  ///< Bytes before this (back to m_head of the previous frame) are fenced
+		unsigned char* m_ring = nullptr;  ///< Persistent mapping (if available)
+		std::deque<Region> m_inFlight;  ///< Ring regions that the GPU may still be reading, oldest first
+	};
+
+	/**
+	* Stream of vertices that all VertexArrays are drawn from (the GL_ARRAY_BUFFER of Window's VAO).
+	* Replaced by a larger StreamBuffer if a single VertexArray does not fit.
+	**/
+	class VertexStream {
+	public:
+		/// Called with the buffer bound (and its id) whenever it is (re)created, to set up the vertex attributes
+		using Setup = std::function<void (GLuint vbo)>;
+		explicit VertexStream(Setup setup);
+		~VertexStream();
+		VertexStream(VertexStream const&) = delete;
+		VertexStream& operator=(VertexStream const&) = delete;
+		/// Copy count vertices into the stream, returning the index of the first one for glDrawArrays
+		GLint write(VertexInfo const* vertices, std::size_t count);
+		/// Also copy instances right after the vertices, storing their byte offset in the buffer
+		GLint write(VertexInfo const* vertices, std::size_t count, std::vector<InstanceInfo> const& instances, GLintptr& instanceOffset);
+		/// Fence the vertices written during the frame (call at buffer swap)
+		void endFrame() { m_buffer->endFrame(); }
+		/// The stream in use (nullptr if there is none)
+		static VertexStream* current() { return s_current; }
+	private:
+		/// Make room for count vertices (slots), returning the first of them
+		std::size_t reserve(std::size_t count);
+		void create(std::size_t capacity);
+		static VertexStream* s_current;
+		Setup m_setup;
+		std::unique_ptr<StreamBuffer> m_buffer;
+	};
+
+	/**
+	* Uniform blocks of the shaders (shaderMatrices etc.), streamed per frame. Every update is appended
+	* to a StreamBuffer and bound to the block's binding point with glBindBufferRange, so changing uniforms
+	* between draws (ColorTrans, Transform...) is a copy into mapped memory and an offset change instead of
+	* glBufferSubData into a buffer that earlier draws are still using.
+	**/
+	class UniformArena {
+	public:
+		UniformArena();
+		~UniformArena();
+		UniformArena(UniformArena const&) = delete;
+		UniformArena& operator=(UniformArena const&) = delete;
+		/// Copy a uniform block into the arena and bind it to binding (flushes QuadBatch, as the draws queued use the old values)
+		void bind(GLuint binding, void const* data, std::size_t bytes);
+		/// Bind a uniform block struct (with a static binding member)
+		template <typename Block> void bind(Block const& block) { bind(Block::binding, &block, sizeof(Block)); }
+		/// Fence the blocks written during the frame (call at buffer swap)
+		void endFrame() { m_buffer.endFrame(); }
+		/// The arena in use (nullptr if there is none)
+		static UniformArena* current() { return s_current; }
+	private:
+		static UniformArena* s_current;
+		StreamBuffer m_buffer;
+	};
+
+	/**
+	* Asynchronous glReadPixels: the pixels are copied into a pixel pack buffer and a fence is set, and once the
+	* GPU has passed the fence (checked at buffer swap) they are mapped and handed to the callback. Reading back
+	* the framebuffer (screenshots and other captures) thus never waits for the GPU to finish drawing.
+	**/
+	class PixelReadback {
+	public:
+		/// Receives the pixels (rows of the requested format, aligned to 4 bytes, bottom row first)
+		typedef std::function<void (std::vector<std::uint8_t>&& pixels)> Callback;
+		PixelReadback() = default;
+		~PixelReadback();
+		PixelReadback(PixelReadback const&) = delete;
+		PixelReadback& operator=(PixelReadback const&) = delete;
+		/// Start reading a rectangle of bytes bytes from the current read framebuffer
+		void read(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, std::size_t bytes, Callback callback);
+		/// Deliver the reads that are complete (call at buffer swap, in the same context)
+		void endFrame();
+		/// Reads not yet delivered
+		std::size_t pending() const { return m_pending.size(); }
+	private:
+		struct Pending {
+			GLuint pbo;
+			GLsync fence;
+			std::size_t bytes;
+			Callback callback;
+		};
+		std::deque<Pending> m_pending;  ///< Oldest first
+		std::vector<std::pair<GLuint, std::size_t>> m_spare;  ///< Buffers of delivered reads and their sizes, reused by reads of the same size
+	};
+
+	/**
+	* GPU time of draw sections, for the graphic/fps statistics. Sections are bracketed by GL_TIMESTAMP queries
+	* (so that they can nest, which GL_TIME_ELAPSED queries cannot) and the results are collected a few
+	* frames later, once the GPU has them, so that measuring never waits for the GPU.
+	**/
+	class GPUTimer {
+	public:
+		/// Time the draws issued during the object's lifetime (no-op unless the timer is enabled)
+		class Section {
+		public:
+			explicit Section(char const* name);
+			/// For dynamic names such as screen names (interned only while timing)
+			explicit Section(std::string const& name);
+			~Section();
+			Section(Section const&) = delete;
+			Section& operator=(Section const&) = delete;
+		private:
+			void begin(char const* name);
+			GPUTimer* m_timer = nullptr;
+			unsigned m_frame = 0;
+			std::size_t m_index = 0;
+		};
+		GPUTimer();
+		~GPUTimer();
+		GPUTimer(GPUTimer const&) = delete;
+		GPUTimer& operator=(GPUTimer const&) = delete;
+		/// Start or stop timing sections (from the next one on)
+		void enable(bool enabled) { m_enabled = enabled; }
+		bool enabled() const { return m_enabled; }
+		/// Close the frame (call at buffer swap) and collect the results that are available
+		void endFrame();
+		/// Dump the times collected to log and reset
+		void dump() { m_profiler.dump(); }
+		/// GPU time of the outermost section of the latest frame collected (a few frames behind)
+		Seconds latest() const { return m_latest; }
+		/// The timer in use (nullptr if there is none)
+		static GPUTimer* current() { return s_current; }
+	private:
+		struct Record {
+			char const* name;
+			GLuint begin, end;
+		};
+		typedef std::vector<Record> Frame;
+		GLuint query();
+		void collect(Frame& frame);
+		static GPUTimer* s_current;
+		bool m_enabled = false;
+		unsigned m_frameNumber = 0;  ///< Incremented by endFrame
+		Frame m_frame;  ///< Sections of the frame being drawn
+		std::deque<Frame> m_pending;  ///< Earlier frames whose results have not been read yet, oldest first
+		std::vector<GLuint> m_free;  ///< Query objects for reuse
+		Seconds m_latest{ 0.0 };
+		Profiler m_profiler;
+	};
 
 	/// Handy vertex array capable of drawing itself
 	class VertexArray {
 	private:
+		friend class QuadBatch;
+		friend class VertexBuffer;
 		std::vector<VertexInfo> m_vertices;
 		VertexInfo m_vert;
+		/// Upload and draw (without flushing QuadBatch)
+		void submit(GLint mode);
 	public:
 		VertexArray& vertex(float x, float y, float z = 0.0f) {
 			return vertex(glmath::vec3(x, y, z));
@@ -116,6 +304,8 @@ namespace glutil {
 		}
 
 		void draw(GLint mode = GL_TRIANGLE_STRIP);
+		/// Draw a copy of the vertices for each instance with a single draw call
+		void drawInstanced(std::vector<InstanceInfo> const& instances, GLint mode = GL_TRIANGLE_STRIP);
 
 		bool empty() const {
 			return m_vertices.empty();
@@ -130,15 +320,87 @@ namespace glutil {
 		void clear();
 	};
 
+	/**
+	* Vertices uploaded once into a buffer (and VAO) of their own, for geometry that stays the same over many
+	* frames. Unlike VertexArray, nothing is copied when drawing.
+	**/
+	class VertexBuffer {
+	public:
+		VertexBuffer() = default;
+		~VertexBuffer();
+		VertexBuffer(VertexBuffer const&) = delete;
+		VertexBuffer& operator=(VertexBuffer const&) = delete;
+		/// Replace the contents with the vertices of va
+		void upload(VertexArray const& va);
+		/// Replace the contents with vertices and the indices (into vertices) that drawElements uses
+		void upload(std::vector<VertexInfo> const& vertices, std::vector<std::uint32_t> const& indices);
+		/// Draw count vertices starting from first
+		void draw(GLint mode, GLint first, GLsizei count);
+		/// Draw all the vertices given by the indices of the latest upload
+		void drawElements(GLint mode);
+		GLsizei size() const { return m_size; }
+	private:
+		void upload(VertexInfo const* vertices, GLsizei count);
+		GLuint m_vao = 0, m_vbo = 0, m_ibo = 0;
+		GLsizei m_size = 0, m_indices = 0;
+	};
+
+	/**
+	* Textured quads waiting to be drawn (see OpenGLTexture::draw). Consecutive quads with the same texture,
+	* shader and wrap mode go into a single draw call. Anything that changes other GL state they use (uniforms,
+	* blending, depth test, framebuffer, texture contents) must flush first; the wrappers in glutil, glshader.hh,
+	* fbo.hh and Window do.
+	**/
+	class QuadBatch {
+	public:
+		struct Key {
+			GLenum target;
+			GLuint texture, program;
+			bool repeat;  ///< GL_REPEAT instead of GL_CLAMP_TO_EDGE
+			bool operator==(Key const& k) const { return target == k.target && texture == k.texture && program == k.program && repeat == k.repeat; }
+		};
+		/// Queue a quad from (x1, y1) to (x2, y2) with texture coordinates from (s1, t1) to (s2, t2)
+		static void add(Key const& key, float x1, float y1, float x2, float y2, float s1, float t1, float s2, float t2);
+		/// Draw the queued quads (binding their texture to unit 0)
+		static void flush();
+	};
+
+	/// glBlendFunc that skips redundant changes (and flushes QuadBatch on real ones)
+	void blendFunc(GLenum src, GLenum dst);
+
+	// Cached GL state: these skip calls that would not change anything, and the getters need no glGet.
+	// All changes of the program, texture, depth test, VAO and buffer bindings must go through them.
+	void useProgram(GLuint program);
+	GLuint currentProgram();
+	/// glActiveTexture(GL_TEXTURE0 + unit)
+	void activeTexture(GLuint unit);
+	GLuint activeTextureUnit();
+	/// Bind texture to target of unit, leaving unit active (as glTexImage etc. need)
+	void bindTexture(GLenum target, GLuint texture, GLuint unit = 0);
+	GLuint boundTexture(GLenum target, GLuint unit = 0);
+	void depthTest(bool enable);
+	void bindVertexArray(GLuint vao);
+	GLuint boundVertexArray();
+	void bindBuffer(GLenum target, GLuint buffer);
+	GLuint boundBuffer(GLenum target);
+	// Deleting unbinds the objects, so their names (which GL reuses) are forgotten too
+	void deleteTexture(GLuint texture);
+	void deleteVertexArray(GLuint vao);
+	void deleteBuffer(GLuint buffer);
+	/// Number of draw calls issued through VertexArray and VertexBuffer so far (for benchmarks)
+	std::size_t drawCalls();
+
 	/// Wrapper struct for RAII
 	struct UseDepthTest {
 		/// enable depth test (for 3d objects)
 		UseDepthTest() {
+			QuadBatch::flush();
 			glClear(GL_DEPTH_BUFFER_BIT);
-			glEnable(GL_DEPTH_TEST);
+			depthTest(true);
 		}
 		~UseDepthTest() {
-			glDisable(GL_DEPTH_TEST);
+			QuadBatch::flush();
+			depthTest(false);
 		}
 	};
 
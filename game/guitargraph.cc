@@ -2,6 +2,7 @@
 #include "fs.hh"
 #include "song.hh"
 #include "i18n.hh"
+#include "threads.hh"
 
 #include <cmath>
 #include <cstdlib>
@@ -134,6 +135,15 @@ GuitarGraph::GuitarGraph(Audio& audio, Song const& song, input::DevicePtr dev, i
 		m_holds[i] = 0;
 	}
 	m_pads = 5;
+	// Build the chords of every track and level, so that switching them in the join menu does not hitch
+	m_chartsTask = std::async(std::launch::async, [this] {
+		threads::enter(threads::Class::background, "guitar chords");
+		Charts charts;
+		for (auto const& elem: m_instrumentTracks) {
+			for (int level = 0; level < DIFFICULTYCOUNT; ++level) charts[elem.first][level] = buildChart(*elem.second, Difficulty(level));
+		}
+		return charts;
+	});
 	m_track_index = m_instrumentTracks.begin();
 	while (number--)
 		if (++m_track_index == m_instrumentTracks.end()) m_track_index = m_instrumentTracks.begin();
@@ -281,21 +291,27 @@ bool GuitarGraph::difficulty(Difficulty level, bool check_only) {
 	for (unsigned fret = 0; fret < m_pads; ++fret) if (nm.find(basepitch + fret) == nm.end()) ++fail;
 	if (fail == m_pads) return false;
 	if (check_only) return true;
-	Difficulty prevLevel = m_level;
+	ChartPtr c = chart(level);
+	if (c->chords.size() <= 1) return false;  // If there is only one chord, it's probably b0rked
 	m_level = level;
-	updateChords();
-	if (m_chords.size() <= 1) { // If there is only one chord, it's probably b0rked
-		m_level = prevLevel;
-		updateChords();
-		return false;
-	}
+	updateChords(*c);
 	return true;
 }
 
+/// Get the chart of the current track at level
+GuitarGraph::ChartPtr GuitarGraph::chart(Difficulty level) {
+	if (m_chartsTask.valid() && m_chartsTask.wait_for(0s) == std::future_status::ready) m_charts = m_chartsTask.get();
+	auto it = m_charts.find(m_track_index->first);
+	if (it != m_charts.end()) return it->second[level];
+	return buildChart(*m_track_index->second, level);  // Still building in the background (while constructing)
+}
+
 /// Core engine
 void GuitarGraph::engine() {
 	double time = m_audio.getPosition();
-	time -= config["audio/controller_delay"].f();
+	const Time now = Clock::now();
+	static ConfigItem& controllerDelay = config["audio/controller_delay"];
+	time -= controllerDelay.f();
 	doUpdates();
 	if (!m_drumfills.empty()) updateDrumFill(time); // Drum Fills / BREs
 	m_whammy = 0;
@@ -366,14 +382,14 @@ void GuitarGraph::engine() {
 		if (!m_drums) {
 			if (ev.button == input::GUITAR_GODMODE && ev.pressed()) activateStarpower();
 			if (ev.button == input::GUITAR_WHAMMY) m_whammy = (1.0 + ev.value + 2.0*(rand()/double(RAND_MAX))) / 4.0;
-			if (ev.button <= m_pads && !ev.pressed()) endHold(ev.button, time);
+			if (ev.button <= m_pads && !ev.pressed()) endHold(ev.button, eventTime(time, ev, now));
 		}
 
-		// Playing
+		// Playing (judged at the time of the event rather than of this frame)
 		if (m_drums) {
-			if (ev.pressed() && ev.button.layer() < 8 && ev.button.num() < m_pads) drumHit(time, ev.button.layer(), ev.button.num());
+			if (ev.pressed() && ev.button.layer() < 8 && ev.button.num() < m_pads) drumHit(eventTime(time, ev, now), ev.button.layer(), ev.button.num());
 		} else {
-			guitarPlay(time, ev);
+			guitarPlay(eventTime(time, ev, now), ev);
 		}
 		if (m_score < 0) m_score = 0;
 	}
@@ -478,9 +494,12 @@ void GuitarGraph::endHold(unsigned fret, double time) {
 	m_events[m_holds[fret] - 1].whammy.setTarget(0.0, true);
 	m_holds[fret] = 0;
 	if (time > 0) { // Do we set the releaseTime?
-		// Search for the Chord this hold belongs to
-		for (auto& chord: m_chords) {
-			if (time > chord.begin + maxTolerance && time < chord.end - maxTolerance) {
+		// Search for the Chord this hold belongs to (none beginning before first can last until time)
+		auto first = std::lower_bound(m_chords.begin(), m_chords.end(), time + maxTolerance - m_maxChordLength,
+		  [](GuitarChord const& chord, double t) { return chord.begin < t; });
+		for (auto it = first; it != m_chords.end() && it->begin < time - maxTolerance; ++it) {
+			GuitarChord& chord = *it;
+			if (time < chord.end - maxTolerance) {
 				chord.releaseTimes[fret] = time;
 				if (time >= chord.end - maxTolerance) chord.passed = true; // Mark as past note for rewinding
 				else m_correctness.setValue(0.0);  // Note: if still holding some frets, proper percentage will be set in hold handling
@@ -775,8 +794,10 @@ void GuitarGraph::drawNotes(double time) {
 
 	glmath::dvec4 neckglow;  // Used for calculating the average neck color
 
-	// Iterate chords
-	for (auto& chord: m_chords) {
+	// Iterate chords (skipping those that have passed already, they are not drawn)
+	while (m_drawIt != m_chords.end() && m_drawIt->passed) ++m_drawIt;
+	for (auto it = m_drawIt; it != m_chords.end(); ++it) {
+		GuitarChord& chord = *it;
 		float tBeg = chord.begin - time;
 		float tEnd = m_drums ? tBeg : chord.end - time;
 		if (tBeg > future) break;
@@ -1021,9 +1042,10 @@ void GuitarGraph::drawNote(int fret, Color color, float tBeg, float tEnd, float
 		y = yEnd + fretWid;
 		vertexPair(va, x, y, color, doanim ? tc(y + t) : 0.20f);
 		vertexPair(va, x, yEnd, color, doanim ? tc(yEnd + t) : 0.0f);
-		glDisable(GL_DEPTH_TEST);
+		glutil::QuadBatch::flush();
+		glutil::depthTest(false);
 		va.draw();
-		glEnable(GL_DEPTH_TEST);
+		glutil::depthTest(true);
 		// Render the fret object
 		{
 			ColorTrans c(color);
@@ -1131,13 +1153,13 @@ void GuitarGraph::drawBar(double time, float h) {
 	va.draw();
 }
 
-bool GuitarGraph::updateTom(unsigned int tomTrack, unsigned int fretId) {
-	auto tomTrackIt = m_track_index->second->nm.find(tomTrack);
-	if (tomTrackIt == m_track_index->second->nm.end()) return false;  // Track not found
-	auto chordIt = m_chords.begin();
+bool GuitarGraph::updateTom(NoteMap const& nm, Chords& chords, unsigned int tomTrack, unsigned int fretId) {
+	auto tomTrackIt = nm.find(tomTrack);
+	if (tomTrackIt == nm.end()) return false;  // Track not found
+	auto chordIt = chords.begin();
 	for (Duration const& tom: tomTrackIt->second) {
 		// Iterate over chords of the song
-		for (; chordIt != m_chords.end() && chordIt->begin < tom.end; ++chordIt) {
+		for (; chordIt != chords.end() && chordIt->begin < tom.end; ++chordIt) {
 			if (!chordIt->fret[fretId]) continue;  // Chord doesn't contain the fret we are looking for
 			chordIt->fret_cymbal[fretId] = (chordIt->begin < tom.begin);  // If not within tom, it is a cymbal
 		}
@@ -1145,16 +1167,17 @@ bool GuitarGraph::updateTom(unsigned int tomTrack, unsigned int fretId) {
 	return true;
 }
 
-/// Create the Chord structures for the current track/difficulty level
-void GuitarGraph::updateChords() {
-	m_chords.clear(); m_solos.clear(); m_drumfills.clear();
-	m_scoreFactor = 0;
-	NoteMap const& nm = m_track_index->second->nm;
+/// Create the Chord structures for a track/difficulty level (any thread, only reads the song)
+GuitarGraph::ChartPtr GuitarGraph::buildChart(InstrumentTrack const& track, Difficulty level) const {
+	auto chart = std::make_shared<Chart>();
+	Chords& chords = chart->chords;
+	double scoreFactor = 0.0;
+	NoteMap const& nm = track.nm;
 
 	Durations::size_type pos[5] = {}, size[5] = {};
 	Durations const* durations[5] = {};
 	for (unsigned fret = 0; fret < m_pads; ++fret) {
-		int basepitch = diffv[m_level].basepitch;
+		int basepitch = diffv[level].basepitch;
 		auto it = nm.find(basepitch + fret);
 		if (it == nm.end()) continue;
 		durations[fret] = &it->second;
@@ -1187,28 +1210,27 @@ void GuitarGraph::updateChords() {
 			tapfret = fret;
 			++c.polyphony;
 			++pos[fret];
-			m_scoreFactor += 50;
-			if (d.end - d.begin > 0.0) m_scoreFactor += 50.0 * (d.end - d.begin);
+			scoreFactor += 50;
+			if (d.end - d.begin > 0.0) scoreFactor += 50.0 * (d.end - d.begin);
 		}
 		// Check if the chord is tappable
 		if (!m_drums && c.polyphony == 1) {
 			c.tappable = true;
-			if (m_chords.empty() || m_chords.back().fret[tapfret]) c.tappable = false;
+			if (chords.empty() || chords.back().fret[tapfret]) c.tappable = false;
 			if (lastEnd + tapMaxDelay < t) c.tappable = false;
 		}
 		lastEnd = c.end;
-		m_chords.push_back(c);
+		chart->maxChordLength = std::max(chart->maxChordLength, c.end - c.begin);
+		chords.push_back(c);
 	}
-	m_chordIt = m_chords.begin();
 
-	m_hasTomTrack = false;
 	if(m_drums) {
 		// HiHat/Rack Tom 1 detection
-		m_hasTomTrack = updateTom(110, input::DRUMS_YELLOW) || m_hasTomTrack;
+		chart->hasTomTrack = updateTom(nm, chords, 110, input::DRUMS_YELLOW) || chart->hasTomTrack;
 		// Ride Cymbal/Rack Tom 2 detection
-		m_hasTomTrack = updateTom(111, input::DRUMS_BLUE) || m_hasTomTrack;
+		chart->hasTomTrack = updateTom(nm, chords, 111, input::DRUMS_BLUE) || chart->hasTomTrack;
 		// Crash Cymbal/Floor Tom detection
-		m_hasTomTrack = updateTom(112, input::DRUMS_GREEN) || m_hasTomTrack;
+		chart->hasTomTrack = updateTom(nm, chords, 112, input::DRUMS_GREEN) || chart->hasTomTrack;
 	}
 
 	// Solos
@@ -1216,19 +1238,31 @@ void GuitarGraph::updateChords() {
 	if (solotrack != nm.end()) {
 		for (auto const& solo: solotrack->second) {
 			// Require at least 6s length in order to avoid starpower sections
-			if (solo.end - solo.begin >= 6.0) m_solos.push_back(solo);
+			if (solo.end - solo.begin >= 6.0) chart->solos.push_back(solo);
 		}
 	}
 	// Drum fills
 	auto dfTrack = nm.find(124); // 124 = drum fills (actually 120-124, but one is enough)
 	if (dfTrack != nm.end()) {
-		m_drumfills = dfTrack->second;
+		chart->drumfills = dfTrack->second;
 		// Big Rock Ending scoring (single hold note)
 		if (!m_drums || m_song.hasBRE)
-			m_scoreFactor += 50.0 * (m_drumfills.back().end - m_drumfills.back().begin);
+			scoreFactor += 50.0 * (chart->drumfills.back().end - chart->drumfills.back().begin);
 	}
-	m_dfIt = m_drumfills.end();
 
 	// Normalize maximum score factor
-	m_scoreFactor = 10000.0 / m_scoreFactor;
+	chart->scoreFactor = 10000.0 / scoreFactor;
+	return chart;
+}
+
+/// Start playing the chords of chart (copied, as playing marks them)
+void GuitarGraph::updateChords(Chart const& chart) {
+	m_chords = chart.chords;
+	m_chordIt = m_drawIt = m_chords.begin();
+	m_maxChordLength = chart.maxChordLength;
+	m_scoreFactor = chart.scoreFactor;
+	m_hasTomTrack = chart.hasTomTrack;
+	m_solos = chart.solos;
+	m_drumfills = chart.drumfills;
+	m_dfIt = m_drumfills.end();
 }
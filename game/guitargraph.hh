@@ -2,6 +2,10 @@
 
 #include "instrumentgraph.hh"
 #include "3dobject.hh"
+#include <array>
+#include <future>
+#include <map>
+#include <memory>
 
 class Song;
 
@@ -127,12 +131,27 @@ class GuitarGraph: public InstrumentGraph {
 	float getFretX(int fret) { return (-2.0f + fret- (m_drums ? 0.5 : 0)) * (m_leftymode.b() ? -1 : 1); }
 	double neckWidth() const; ///< Get the currently effective neck width (0.5 or less)
 	// Chords & notes
-	void updateChords();
-	bool updateTom(unsigned int tomTrack, unsigned int fretId); // returns true if this tom track exists
-	double getNotesBeginTime() const { return m_chords.front().begin; }
 	typedef std::vector<GuitarChord> Chords;
+	/// The chords of a track at a difficulty level and what their scoring needs (built once, see m_charts)
+	struct Chart {
+		Chords chords;
+		double maxChordLength = 0.0;
+		double scoreFactor = 0.0;
+		bool hasTomTrack = false;
+		std::vector<Duration> solos;
+		std::vector<Duration> drumfills;
+	};
+	typedef std::shared_ptr<Chart const> ChartPtr;
+	typedef std::map<std::string, std::array<ChartPtr, DIFFICULTYCOUNT>> Charts;  ///< By track name and level
+	ChartPtr buildChart(InstrumentTrack const& track, Difficulty level) const;
+	ChartPtr chart(Difficulty level);  ///< Of the current track, built now if the background build is not done yet
+	void updateChords(Chart const& chart);  ///< Start playing the chords of chart
+	static bool updateTom(NoteMap const& nm, Chords& chords, unsigned int tomTrack, unsigned int fretId); // returns true if this tom track exists
+	double getNotesBeginTime() const { return m_chords.front().begin; }
 	Chords m_chords;
 	Chords::iterator m_chordIt;
+	Chords::iterator m_drawIt;  ///< Chords before this have passed (not drawn anymore)
+	double m_maxChordLength = 0.0;  ///< The longest end - begin of m_chords
 	typedef std::map<Duration const*, unsigned> NoteStatus; // Note in song to m_events[unsigned - 1] or 0 for not played
 	NoteStatus m_notes;
 	std::vector<Duration> m_solos; /// holds guitar solos
@@ -155,4 +174,6 @@ class GuitarGraph: public InstrumentGraph {
 	bool m_hasTomTrack; /// true if the track has at least one tom track
 	bool m_proMode; /// true if pro drums. (it would be better to split guitar/trum tracks into sep classes)
 	double m_whammy; /// whammy value for pitch shift
+	Charts m_charts;  ///< Of all tracks and levels, once m_chartsTask is done
+	std::future<Charts> m_chartsTask;  ///< Builds m_charts (last member, so that it finishes before the rest is destroyed)
 };
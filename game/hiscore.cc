@@ -6,13 +6,46 @@
 #include <sstream>
 #include <stdexcept>
 
+namespace {
+	const std::vector<std::multiset<HiscoreItem>::const_iterator> s_none;
+}
+
+Hiscore::Hiscore(Hiscore const& other): m_hiscore(other.m_hiscore) {
+	for (auto it = m_hiscore.begin(); it != m_hiscore.end(); ++it) index(it);
+}
+
+Hiscore& Hiscore::operator=(Hiscore const& other) {
+	if (this == &other) return *this;
+	m_bySong.clear();
+	m_byPlayer.clear();
+	m_byTrack.clear();
+	m_hiscore = other.m_hiscore;
+	for (auto it = m_hiscore.begin(); it != m_hiscore.end(); ++it) index(it);
+	return *this;
+}
+
+void Hiscore::index(hiscore_t::const_iterator it) {
+	// After the items of the same score, as in the multiset
+	auto add = [it](index_t& items) {
+		items.insert(std::upper_bound(items.begin(), items.end(), it, [](hiscore_t::const_iterator a, hiscore_t::const_iterator b) { return *a < *b; }), it);
+	};
+	add(m_bySong[it->songid]);
+	add(m_byPlayer[it->playerid]);
+	add(m_byTrack[it->track]);
+}
+
+Hiscore::index_t const& Hiscore::bySong(unsigned songid) const {
+	auto it = m_bySong.find(songid);
+	return it == m_bySong.end() ? s_none : it->second;
+}
+
 bool Hiscore::reachedHiscore(unsigned score, unsigned songid, std::string const& track) const {
 	if (score > 10000) throw std::logic_error("Invalid score value");
 	if (score < 2000) return false; // come on, did you even try to sing?
 
 	unsigned position = 0;
-	for (auto const& elem: m_hiscore) {
-		if (elem.songid != songid) continue;
+	for (auto const& it: bySong(songid)) {
+		HiscoreItem const& elem = *it;
 		if (elem.track != track) continue;
 		if (score > elem.score) return true; // seems like you are in top 3!
 		if (++position == 3) return false; // not in top 3 -> leave
@@ -23,12 +56,26 @@ bool Hiscore::reachedHiscore(unsigned score, unsigned songid, std::string const&
 void Hiscore::addHiscore(unsigned score, unsigned playerid, unsigned songid, std::string const& track) {
 	if (track.empty()) throw std::runtime_error("No track given");
 	if (!reachedHiscore(score, songid, track)) return;
-	m_hiscore.insert(HiscoreItem(score, playerid, songid, track));
+	index(m_hiscore.insert(HiscoreItem(score, playerid, songid, track)));
 }
 
 Hiscore::HiscoreVector Hiscore::queryHiscore(unsigned max, unsigned playerid, unsigned songid, std::string const& track) const {
+	// Go through the smallest index that has all of the matches
+	index_t const* items = nullptr;
+	auto pick = [&items](index_t const& candidates) { if (!items || candidates.size() < items->size()) items = &candidates; };
+	if (songid != unsigned(-1)) pick(bySong(songid));
+	if (playerid != unsigned(-1)) { auto it = m_byPlayer.find(playerid); pick(it == m_byPlayer.end() ? s_none : it->second); }
+	if (!track.empty()) { auto it = m_byTrack.find(track); pick(it == m_byTrack.end() ? s_none : it->second); }
 	HiscoreVector hv;
-	for (auto const& h: m_hiscore) {
+	if (!items) {
+		for (auto const& h: m_hiscore) {
+			if (--max == 0) break;
+			hv.push_back(h);
+		}
+		return hv;
+	}
+	for (auto const& it: *items) {
+		HiscoreItem const& h = *it;
 		if (playerid != unsigned(-1) && playerid != h.playerid) continue;
 		if (songid != unsigned(-1) && songid != h.songid) continue;
 		if (!track.empty() && track != h.track) continue;
@@ -39,31 +86,10 @@ Hiscore::HiscoreVector Hiscore::queryHiscore(unsigned max, unsigned playerid, un
 }
 
 bool Hiscore::hasHiscore(unsigned songid) const {
-	for (auto const& h: m_hiscore) if (songid == h.songid) return true;
-	return false;
-}
-
-void Hiscore::load(xmlpp::NodeSet const& nodes) {
-	for (auto const& n: nodes) {
-		xmlpp::Element& element = dynamic_cast<xmlpp::Element&>(*n);
-		xmlpp::Attribute* a_playerid = element.get_attribute("playerid");
-		if (!a_playerid) throw std::runtime_error("Attribute playerid not found");
-		xmlpp::Attribute* a_songid = element.get_attribute("songid");
-		if (!a_songid) throw std::runtime_error("Attribute songid not found");
-		xmlpp::Attribute* a_track = element.get_attribute("track");
-
-		int playerid = std::stoi(a_playerid->get_value());
-		int songid = std::stoi(a_songid->get_value());
-
-		auto tn = xmlpp::get_first_child_text(element);
-		if (!tn) throw std::runtime_error("Score not found");
-		int score = std::stoi(tn->get_content());
-
-		addHiscore(score, playerid, songid, a_track ? a_track->get_value() : "vocals");
-	}
+	return m_bySong.count(songid) > 0;
 }
 
-void Hiscore::save(xmlpp::Element *hiscores) {
+void Hiscore::save(xmlpp::Element *hiscores) const {
 	for (auto const& h: m_hiscore) {
 		xmlpp::Element* hiscore = xmlpp::add_child_element(hiscores, "hiscore");
 		hiscore->set_attribute("playerid", std::to_string(h.playerid));
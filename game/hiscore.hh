@@ -4,6 +4,7 @@
 
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 /// This struct holds together information for a single item of a highscore.
@@ -18,8 +19,11 @@ struct HiscoreItem {
 
 class Hiscore {
 public:
-	void load(xmlpp::NodeSet const& n);
-	void save(xmlpp::Element *players);
+	Hiscore() = default;
+	/// Copies get indexes of their own
+	Hiscore(Hiscore const& other);
+	Hiscore& operator=(Hiscore const& other);
+	void save(xmlpp::Element *players) const;
 
 	/**Check if you reached a new highscore.
 
@@ -55,5 +59,11 @@ public:
 	std::size_t size() const { return m_hiscore.size(); }
 private:
 	typedef std::multiset<HiscoreItem> hiscore_t;
+	/// Items of m_hiscore in its order (highest score first)
+	typedef std::vector<hiscore_t::const_iterator> index_t;
+	void index(hiscore_t::const_iterator it);
+	index_t const& bySong(unsigned songid) const;
 	hiscore_t m_hiscore;
+	std::unordered_map<unsigned, index_t> m_bySong, m_byPlayer;
+	std::unordered_map<std::string, index_t> m_byTrack;
 };
@@ -1,11 +1,41 @@
 #pragma once
 
 #include <boost/locale.hpp>
+#include <atomic>
 #include <iostream>
+#include <string>
 #include "fs.hh"
 
 #define _(x) boost::locale::translate(x).str()
 #define translate_noop(x) x
+/// Translation of a string literal for code that runs every frame (main thread). Each use has a string of its
+/// own, translated once per language, that stays at the same address (so it can also key cached text textures).
+#define _C(x) ([]() -> std::string const& { static i18n::Cached s_cached(x); return s_cached.get(); }())
+
+namespace i18n {
+	/// Changed whenever the language changes, so that cached translations are looked up again
+	inline std::atomic<unsigned>& generation() {
+		static std::atomic<unsigned> s_generation{ 0 };
+		return s_generation;
+	}
+	/// A translation kept for reuse (see _C)
+	class Cached {
+	public:
+		explicit Cached(char const* msgid): m_msgid(msgid) {}
+		std::string const& get() {
+			const unsigned gen = generation();
+			if (gen != m_generation) {
+				m_text = boost::locale::translate(m_msgid).str();
+				m_generation = gen;
+			}
+			return m_text;
+		}
+	private:
+		char const* m_msgid;
+		unsigned m_generation = ~0u;
+		std::string m_text;
+	};
+}
 
 class TranslationEngine {
 public:
@@ -19,6 +49,7 @@ public:
 			std::clog << "locale/warning: Unable to detect locale, will try to fallback to en_US.UTF-8" << std::endl;
 			std::locale::global(gen("en_US.UTF-8"));
 		}
+		++i18n::generation();
 	};
 	static bool enabled() {
 		return true;
@@ -1,26 +1,43 @@
 #include "fs.hh"
 #include "image.hh"
+#include "log.hh"
 
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/path.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <jpeglib.h>
 #include <png.h>
 
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
 
 using fs::ofstream;
-using fs::ifstream;
 
 namespace {
 	void writePngHelper(png_structp pngPtr, png_bytep data, png_size_t length) {
 		static_cast<std::ostream*>(png_get_io_ptr(pngPtr))->write((char*)data, length);
 	}
 
+	/// Image file data read from a memory mapping
+	struct MappedFile {
+		boost::iostreams::mapped_file_source file;
+		std::size_t pos = 0;
+		explicit MappedFile(fs::path const& filename): file(filename.string()) {}
+		unsigned char const* data() const { return reinterpret_cast<unsigned char const*>(file.data()); }
+		std::size_t size() const { return file.size(); }
+	};
+
 	void readPngHelper(png_structp pngPtr, png_bytep data, png_size_t length) {
-		static_cast<std::istream*>(png_get_io_ptr(pngPtr))->read((char*)data, length);
+		MappedFile& file = *static_cast<MappedFile*>(png_get_io_ptr(pngPtr));
+		if (length > file.size() - file.pos) png_error(pngPtr, "Unexpected end of file");
+		std::memcpy(data, file.data() + file.pos, length);
+		file.pos += length;
 	}
-	void loadPNG_internal(png_structp pngPtr, png_infop infoPtr, ifstream& file, Bitmap& bitmap, std::vector<png_bytep>& rows) {
+	void loadPNG_internal(png_structp pngPtr, png_infop infoPtr, MappedFile& file, Bitmap& bitmap, std::vector<png_bytep>& rows) {
 		if (setjmp(png_jmpbuf(pngPtr))) throw std::runtime_error("Reading PNG failed");
 		png_set_read_fn(pngPtr,(png_voidp)&file, readPngHelper);
 		png_read_info(pngPtr, infoPtr);
@@ -97,7 +114,7 @@ namespace {
 void writePNG(fs::path const& filename, Bitmap const& img, unsigned stride) {
 	fs::path name = filename;
 	// We use PNG in a non-standard way, with premultiplied alpha, signified by .premul.png extension.
-	std::clog << "image/debug: Saving PNG: " + name.string() << std::endl;
+	LOG("image", debug) << "Saving PNG: " + name.string() << std::endl;
 	std::vector<png_bytep> rows(img.height);
 	// Determine color type and bytes per pixel
 	unsigned char bpp;
@@ -136,10 +153,10 @@ void writePNG(fs::path const& filename, Bitmap const& img, unsigned stride) {
 }
 
 void loadPNG(Bitmap& bitmap, fs::path const& filename) {
-	std::clog << "image/debug: Loading PNG: " + filename.string() << std::endl;
+	LOG("image", debug) << "Loading PNG: " + filename.string() << std::endl;
 	// A hack to assume linear premultiplied data if file extension is .premul.png (used for cached SVGs)
 	if (filename.stem().extension() == "premul") bitmap.linearPremul = true;
-	ifstream file(filename, std::ios::binary);
+	MappedFile file(filename);
 	png_structp pngPtr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
 	if (!pngPtr) throw std::runtime_error("png_create_read_struct failed");
 	png_infop infoPtr = nullptr;
@@ -155,11 +172,11 @@ void loadPNG(Bitmap& bitmap, fs::path const& filename) {
 	loadPNG_internal(pngPtr, infoPtr, file, bitmap, rows);
 }
 
-void loadJPEG(Bitmap& bitmap, fs::path const& filename) {
-	std::clog << "image/debug: Loading JPEG: " + filename.string() << std::endl;
+void loadJPEG(Bitmap& bitmap, fs::path const& filename, unsigned maxSize) {
+	LOG("image", debug) << "Loading JPEG: " + filename.string() << std::endl;
 	bitmap.fmt = pix::RGB;
 	struct my_jpeg_error_mgr jerr;
-	BinaryBuffer data = readFile(filename);
+	MappedFile data(filename);
 	jpeg_decompress_struct cinfo;
 	cinfo.err = jpeg_std_error(&jerr.pub);
 	jerr.pub.error_exit = my_jpeg_error_exit;
@@ -168,11 +185,18 @@ void loadJPEG(Bitmap& bitmap, fs::path const& filename) {
 		throw std::runtime_error("Error in libjpeg when decoding " + filename.string());
 	}
 	jpeg_create_decompress(&cinfo);
-	jpeg_mem_src(&cinfo, data.data(), data.size());
+	jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data.data()), data.size());
 	if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) throw std::runtime_error("Cannot read header of " + filename.string());
+	// Let the decoder downscale (1/2, 1/4 or 1/8) as far as the result still covers maxSize, which is much faster
+	if (maxSize) {
+		unsigned size = std::max(cinfo.image_width, cinfo.image_height);
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = 1;
+		while (cinfo.scale_denom < 8 && size / (cinfo.scale_denom * 2) >= maxSize) cinfo.scale_denom *= 2;
+	}
 	jpeg_start_decompress(&cinfo);
 	bitmap.resize(cinfo.output_width, cinfo.output_height);
-	unsigned stride = (bitmap.width * 3 + 3) & ~3;  // Number of bytes per row (word-aligned)
+	unsigned stride = bitmap.width * 3;  // Number of bytes per row (no padding, as pix::RGB says)
 	unsigned char* ptr = &bitmap.buf[0];
 	while (cinfo.output_scanline < bitmap.height) {
 		jpeg_read_scanlines(&cinfo, &ptr, 1);
@@ -181,6 +205,149 @@ void loadJPEG(Bitmap& bitmap, fs::path const& filename) {
 	jpeg_destroy_decompress(&cinfo);
 }
 
+void writeJPEG(fs::path const& filename, Bitmap const& bitmap, int quality) {
+	LOG("image", debug) << "Saving JPEG: " + filename.string() << std::endl;
+	unsigned bpp;
+	switch (bitmap.fmt) {
+		case pix::RGB: bpp = 3; break;
+		case pix::CHAR_RGBA: bpp = 4; break;
+		default: throw std::logic_error("Unsupported pixel format in writeJPEG");
+	}
+	std::FILE* file = std::fopen(filename.string().c_str(), "wb");
+	if (!file) throw std::runtime_error("Cannot write " + filename.string());
+	struct my_jpeg_error_mgr jerr;
+	jpeg_compress_struct cinfo;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_jpeg_error_exit;
+	std::vector<unsigned char> row(bitmap.width * 3);
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_compress(&cinfo);
+		std::fclose(file);
+		throw std::runtime_error("Error in libjpeg when encoding " + filename.string());
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, file);
+	cinfo.image_width = bitmap.width;
+	cinfo.image_height = bitmap.height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		const unsigned y = bitmap.bottomFirst ? bitmap.height - 1 - cinfo.next_scanline : cinfo.next_scanline;
+		unsigned char const* src = bitmap.data() + std::size_t(y) * bitmap.width * bpp;
+		if (bpp == 3) {
+			for (unsigned x = 0; x < bitmap.width; ++x) std::memcpy(&row[3 * x], src + bpp * x, 3);
+		} else {
+			// JPEG has no alpha, so blend over white like the song list of the web interface that shows the thumbnails
+			const unsigned bg = 255;
+			for (unsigned x = 0; x < bitmap.width; ++x) {
+				unsigned char const* px = src + bpp * x;
+				const unsigned a = px[3];
+				for (unsigned c = 0; c < 3; ++c) {
+					const unsigned color = bitmap.linearPremul ? px[c] * 255u : px[c] * a;
+					row[3 * x + c] = (color + bg * (255u - a) + 127u) / 255u;
+				}
+			}
+		}
+		JSAMPROW ptr = row.data();
+		jpeg_write_scanlines(&cinfo, &ptr, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	if (std::fclose(file) != 0) throw std::runtime_error("Cannot write " + filename.string());
+}
+
+namespace {
+	/**
+	* Recycles large pixel buffers, so that decoding a video frame or an image does not need fresh memory each time.
+	* Buffers are allocated in size classes (at most 25 % larger than asked for), so that similar sizes share them.
+	**/
+	class BufferPool {
+		typedef std::vector<unsigned char> Buffer;
+		static const std::size_t MIN_BYTES = 64 << 10;  ///< Smaller buffers are left to malloc
+		static const std::size_t MAX_BYTES = 128 << 20;  ///< Total size of the buffers kept
+		std::mutex m_mutex;
+		std::map<std::size_t, std::vector<Buffer>> m_free;  ///< By capacity
+		std::size_t m_bytes = 0;
+		static std::size_t sizeClass(std::size_t bytes) {
+			std::size_t step = 1;
+			while (step * 8 <= bytes) step *= 2;
+			return (bytes + step - 1) / step * step;
+		}
+	  public:
+		/// Get a buffer of the given size (the contents are undefined)
+		Buffer acquire(std::size_t bytes) {
+			Buffer buf;
+			if (bytes >= MIN_BYTES) {
+				std::size_t cls = sizeClass(bytes);
+				std::unique_lock<std::mutex> l(m_mutex);
+				auto it = m_free.find(cls);
+				if (it != m_free.end() && !it->second.empty()) {
+					buf.swap(it->second.back());
+					it->second.pop_back();
+					m_bytes -= cls;
+				} else {
+					l.unlock();
+					buf.reserve(cls);
+				}
+			}
+			buf.resize(bytes);  // Usually no-op for recycled buffers, which tend to get the same size again
+			return buf;
+		}
+		/// Take buf for reuse (leaving it empty)
+		void release(Buffer& buf) {
+			std::size_t cls = buf.capacity();
+			if (cls < MIN_BYTES || cls != sizeClass(cls)) return;  // Not one of ours
+			std::lock_guard<std::mutex> l(m_mutex);
+			if (m_bytes + cls > MAX_BYTES) return;
+			m_free[cls].emplace_back(std::move(buf));
+			buf.clear();
+			m_bytes += cls;
+		}
+	};
+	/// Never destroyed, as Bitmaps in static storage may still release their buffers after it would be
+	BufferPool& bufferPool() {
+		static BufferPool& pool = *new BufferPool();
+		return pool;
+	}
+}
+
+Bitmap& Bitmap::operator=(Bitmap&& b) {
+	if (this == &b) return *this;
+	bufferPool().release(buf);
+	buf = std::move(b.buf);
+	ptr = b.ptr;
+	width = b.width;
+	height = b.height;
+	ar = b.ar;
+	timestamp = b.timestamp;
+	fmt = b.fmt;
+	linearPremul = b.linearPremul;
+	bottomFirst = b.bottomFirst;
+	return *this;
+}
+
+Bitmap::~Bitmap() { bufferPool().release(buf); }
+
+void Bitmap::resize(unsigned w, unsigned h) {
+	// Video frames only need their three planes; everything else gets four bytes per pixel
+	const std::size_t bytes = fmt == pix::YUV420P ? std::size_t(w) * h + std::size_t(w / 2) * ((h + 1) / 2) * 2 : std::size_t(w) * h * 4;
+	if (ptr) buf.clear();
+	else if (buf.capacity() >= bytes) buf.resize(bytes);
+	else {
+		std::vector<unsigned char> old;
+		old.swap(buf);
+		buf = bufferPool().acquire(bytes);
+		std::copy(old.begin(), old.end(), buf.begin());  // Keep the contents, like std::vector::resize
+		bufferPool().release(old);
+	}
+	width = w;
+	height = h;
+	ar = float(w) / float(h);
+}
+
 void Bitmap::crop(const unsigned width, const unsigned height, const unsigned x, const unsigned y) {
 	if (ptr) throw std::logic_error("Cannot Bitmap::crop foreign pointers.");
 	if (x + width > this->width || y+ height > this->height)
@@ -211,6 +378,42 @@ void Bitmap::crop(const unsigned width, const unsigned height, const unsigned x,
 	this->height = height;
 }
 
+void Bitmap::shrink(unsigned maxSize) {
+	if (ptr) throw std::logic_error("Cannot Bitmap::shrink foreign pointers.");
+	if (width <= maxSize && height <= maxSize) return;
+	unsigned bpp;
+	switch (fmt) {
+	case pix::INT_ARGB: bpp = 4; break;
+	case pix::BGR: bpp = 3; break;
+	case pix::RGB: bpp = 3; break;
+	case pix::CHAR_RGBA: bpp = 4; break;
+	default: throw std::logic_error("Unsupported picture format.");
+	}
+	double scale = double(maxSize) / std::max(width, height);
+	unsigned w = std::max(1u, unsigned(width * scale + 0.5)), h = std::max(1u, unsigned(height * scale + 0.5));
+	std::vector<unsigned char> out = bufferPool().acquire(std::size_t(w) * h * bpp);
+	// Each output pixel is the average of the source pixels within its area
+	std::vector<unsigned> sum(std::size_t(w) * bpp);
+	for (unsigned y = 0; y < h; ++y) {
+		unsigned y0 = std::size_t(y) * height / h, y1 = std::max(y0 + 1, unsigned(std::size_t(y + 1) * height / h));
+		std::fill(sum.begin(), sum.end(), 0);
+		std::vector<unsigned> count(w);
+		for (unsigned sy = y0; sy < y1; ++sy) {
+			unsigned char const* row = &buf[std::size_t(sy) * width * bpp];
+			for (unsigned x = 0; x < w; ++x) {
+				unsigned x0 = std::size_t(x) * width / w, x1 = std::max(x0 + 1, unsigned(std::size_t(x + 1) * width / w));
+				for (unsigned sx = x0; sx < x1; ++sx) for (unsigned c = 0; c < bpp; ++c) sum[x * bpp + c] += row[sx * bpp + c];
+				count[x] += x1 - x0;
+			}
+		}
+		for (unsigned x = 0; x < w; ++x) for (unsigned c = 0; c < bpp; ++c) out[(std::size_t(y) * w + x) * bpp + c] = (sum[x * bpp + c] + count[x] / 2) / count[x];
+	}
+	buf.swap(out);
+	bufferPool().release(out);
+	width = w;
+	height = h;
+}
+
 void Bitmap::copyFromCairo(cairo_surface_t* surface) {
 	size_t width = cairo_image_surface_get_width(surface);
 	size_t height = cairo_image_surface_get_height(surface);
@@ -14,7 +14,10 @@ namespace pix { enum Format {
 	INT_ARGB,  // Cairo's pixel format (SVG, text): premultiplied linear RGB (BGRA byte order)
 	CHAR_RGBA,  // libpng w/ alpha: non-premul sRGB (RGBA byte order)
 	RGB,  // libpng w/o alpha, libjpeg, ffmpeg: sRGB (RGB byte order, no padding)
-	BGR  // OpenCV/webcam: sRGB (BGR byte order, no padding)
+	BGR,  // OpenCV/webcam: sRGB (BGR byte order, no padding)
+	BC1,  // S3TC DXT1 (opaque) from TextureCache: sRGB, all mipmap levels one after another
+	BC3,  // S3TC DXT5 (with alpha) from TextureCache: non-premul sRGB, all mipmap levels one after another
+	YUV420P  // ffmpeg video: limited range Y plane, then U and V at half resolution (rows padded to 16 and 8 bytes)
 }; }
 
 struct Bitmap {
@@ -27,12 +30,14 @@ struct Bitmap {
 	bool linearPremul;  // Is the data linear RGB and premultiplied (as opposed to sRGB and non-premultiplied)
 	bool bottomFirst;  // Upside-down (only used for taking screenshots)
 	Bitmap(unsigned char* ptr = nullptr): ptr(ptr), width(), height(), ar(), timestamp(), fmt(pix::CHAR_RGBA), linearPremul(), bottomFirst() {}
-	void resize(unsigned w, unsigned h) {
-		if (!ptr) buf.resize(w * h * 4); else buf.clear();
-		width = w;
-		height = h;
-		ar = float(w) / float(h);
-	}
+	Bitmap(Bitmap const&) = default;
+	Bitmap(Bitmap&&) = default;
+	Bitmap& operator=(Bitmap const&) = default;
+	Bitmap& operator=(Bitmap&& b);
+	/// Large pixel buffers are returned to a pool for reuse by later bitmaps (e.g. the next video frame)
+	~Bitmap();
+	/// Allocate room for w x h pixels of fmt (set it first), keeping the old contents
+	void resize(unsigned w, unsigned h);
 	void swap(Bitmap& b) {
 		if (ptr || b.ptr) throw std::logic_error("Cannot Bitmap::swap foreign pointers.");
 		buf.swap(b.buf);
@@ -46,10 +51,15 @@ struct Bitmap {
 	unsigned char* data() { return ptr ? ptr : &buf[0]; }
 	void copyFromCairo(cairo_surface_t* surface);
 	void crop(const unsigned width, const unsigned height, const unsigned x, const unsigned y);
+	/// Scale down (averaging pixels) to fit inside maxSize x maxSize, keeping the aspect ratio. Smaller bitmaps are left as they are.
+	void shrink(unsigned maxSize);
 };
 
 // The total number of bytes per line (stride) may be specified. By default no padding at end of line is assumed.
 void writePNG(fs::path const& filename, Bitmap const& bitmap, unsigned stride = 0);
 void loadPNG(Bitmap& bitmap, fs::path const& filename);
-void loadJPEG(Bitmap& bitmap, fs::path const& filename);
+/// Decode a JPEG. If maxSize is given, the image may come out smaller (but still at least maxSize on its longer side).
+void loadJPEG(Bitmap& bitmap, fs::path const& filename, unsigned maxSize = 0);
+/// Encode a pix::RGB or pix::CHAR_RGBA (blended over white) bitmap as a JPEG of quality 0 to 100
+void writeJPEG(fs::path const& filename, Bitmap const& bitmap, int quality = 85);
 
@@ -18,10 +18,10 @@ InstrumentGraph::InstrumentGraph(Audio& audio, Song const& song, input::DevicePt
   m_cx(0.0, 0.2), m_width(0.5, 0.4),
   m_menu(),
   m_button(findFile("button.svg")),
-  m_arrow_up(findFile("arrow_button_up.svg")),
-  m_arrow_down(findFile("arrow_button_down.svg")),
-  m_arrow_left(findFile("arrow_button_left.svg")),
-  m_arrow_right(findFile("arrow_button_right.svg")),
+  m_arrow_up(m_atlas.add(findFile("arrow_button_up.svg"))),
+  m_arrow_down(m_atlas.add(findFile("arrow_button_down.svg"))),
+  m_arrow_left(m_atlas.add(findFile("arrow_button_left.svg"))),
+  m_arrow_right(m_atlas.add(findFile("arrow_button_right.svg"))),
   m_text(findFile("sing_timetxt.svg"), config["graphic/text_lod"].f()),
   m_selectedTrack(""),
   m_selectedDifficulty(0),
@@ -110,6 +110,7 @@ void InstrumentGraph::drawMenu() {
 	// Loop through menu items
 	w = 0;
 	unsigned i = 0;
+	TextureAtlas::Batch arrows;
 	for (MenuOptions::const_iterator it = m_menu.begin(); it != m_menu.end(); ++it, ++i) {
 		std::string menutext = it->getName();
 		SvgTxtTheme* txt = &th.option_selected; // Default: font for selected menu item
@@ -128,18 +129,18 @@ void InstrumentGraph::drawMenu() {
 				m_arrow_left.dimensions.middle(x - button_margin).center(y);
 				m_arrow_right.dimensions.middle(xx + button_margin).center(y);
 			}
-			m_arrow_left.draw();
-			m_arrow_right.draw();
+			arrows.add(m_arrow_left);
+			arrows.add(m_arrow_right);
 
 			// Up/down icons
 			if (getGraphType() != input::DEVTYPE_GUITAR) {
 				if (i > 0) { // Up
 					m_arrow_up.dimensions.middle(x - button_margin).center(y - step);
-					m_arrow_up.draw();
+					arrows.add(m_arrow_up);
 				}
 				if (i < m_menu.getOptions().size()-1) { // Down
 					m_arrow_down.dimensions.middle(x - button_margin).center(y + step);
-					m_arrow_down.draw();
+					arrows.add(m_arrow_down);
 				}
 			}
 
@@ -180,6 +181,7 @@ void InstrumentGraph::drawMenu() {
 		w = std::max(w, txt->w() + 2 * step + button_margin * 2); // Calculate the widest entry
 		y += step; // Move draw position down for the next option
 	}
+	arrows.draw();
 	// Draw comment text
 	if (cur->getComment() != "") {
 		//th.comment_bg.dimensions.middle().screenBottom(-0.2);
@@ -200,6 +202,12 @@ void InstrumentGraph::drawPopups() {
 }
 
 
+double InstrumentGraph::eventTime(double time, input::Event const& ev, Time now) {
+	// Synthesized events (without a time) and stale ones (e.g. queued during a pause) count as happening now
+	const double age = Seconds(now - ev.time).count();
+	return age > 0.0 && age < 0.2 ? time - age : time;
+}
+
 void InstrumentGraph::handleCountdown(double time, double beginTime) {
 	if (!dead() && time < beginTime && time >= beginTime - m_countdown - 1) {
 		m_popups.push_back(Popup(m_countdown > 0 ?
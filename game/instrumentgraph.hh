@@ -7,6 +7,7 @@
 #include "notes.hh"
 #include "controllers.hh"
 #include "texture.hh"
+#include "textureatlas.hh"
 #include "opengl_text.hh"
 #include "glutil.hh"
 #include "menu.hh"
@@ -125,16 +126,19 @@ public:
 	// Shared functions for derived classes
 	void drawPopups();
 	void handleCountdown(double time, double beginTime);
+	/// Song time when ev happened, given the song time at now (events carry the time they were read from the hardware)
+	static double eventTime(double time, input::Event const& ev, Time now);
 
 	// Functions not really shared, but needed here
 	Color const& color(unsigned fret) const;
 
 	// Media
 	Texture m_button;
-	Texture m_arrow_up;
-	Texture m_arrow_down;
-	Texture m_arrow_left;
-	Texture m_arrow_right;
+	TextureAtlas m_atlas;  ///< Menu arrows (drawn as one batch)
+	TextureAtlas::Sprite& m_arrow_up;
+	TextureAtlas::Sprite& m_arrow_down;
+	TextureAtlas::Sprite& m_arrow_left;
+	TextureAtlas::Sprite& m_arrow_right;
 	SvgTxtTheme m_text;
 	std::unique_ptr<SvgTxtThemeSimple> m_popupText;
 	std::unique_ptr<ThemeInstrumentMenu> m_menuTheme;
@@ -0,0 +1,26 @@
+#include "internedstring.hh"
+
+#include <mutex>
+#include <ostream>
+#include <unordered_set>
+
+namespace {
+	std::mutex s_mutex;
+	std::unordered_set<std::string>& pool() {
+		static std::unordered_set<std::string> s_pool;  // Node based, so the elements never move
+		return s_pool;
+	}
+}
+
+std::string const& InternedString::emptyString() {
+	static const std::string s_empty;
+	return s_empty;
+}
+
+std::string const* InternedString::intern(std::string const& str) {
+	if (str.empty()) return &emptyString();
+	std::lock_guard<std::mutex> l(s_mutex);
+	return &*pool().insert(str).first;
+}
+
+std::ostream& operator<<(std::ostream& os, InternedString const& str) { return os << str.str(); }
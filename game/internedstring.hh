@@ -0,0 +1,39 @@
+#pragma once
+
+#include <iosfwd>
+#include <string>
+
+/**
+* An immutable string stored once in a global pool and shared by all equal values, for song metadata that
+* repeats a lot (artist, genre, edition, ...). The object itself is a single pointer and equal strings are
+* only allocated once. Pooled strings are never freed (the set of distinct values is small).
+**/
+class InternedString {
+  public:
+	InternedString(): m_str(&emptyString()) {}
+	InternedString(std::string const& str): m_str(intern(str)) {}
+	InternedString(char const* str): m_str(intern(str)) {}
+	InternedString& operator=(std::string const& str) { m_str = intern(str); return *this; }
+	InternedString& operator=(char const* str) { m_str = intern(str); return *this; }
+	std::string const& str() const { return *m_str; }
+	operator std::string const&() const { return *m_str; }
+	bool empty() const { return m_str->empty(); }
+	std::size_t size() const { return m_str->size(); }
+	/// Equal strings share the pooled object, so comparison is a pointer comparison
+	bool operator==(InternedString const& other) const { return m_str == other.m_str; }
+	bool operator!=(InternedString const& other) const { return m_str != other.m_str; }
+  private:
+	static std::string const& emptyString();
+	static std::string const* intern(std::string const& str);  ///< Thread-safe
+	std::string const* m_str;
+};
+
+inline bool operator==(InternedString const& a, std::string const& b) { return a.str() == b; }
+inline bool operator==(std::string const& a, InternedString const& b) { return a == b.str(); }
+inline bool operator!=(InternedString const& a, std::string const& b) { return a.str() != b; }
+inline bool operator!=(std::string const& a, InternedString const& b) { return a != b.str(); }
+inline std::string operator+(InternedString const& a, std::string const& b) { return a.str() + b; }
+inline std::string operator+(std::string const& a, InternedString const& b) { return a + b.str(); }
+inline std::string operator+(InternedString const& a, char const* b) { return a.str() + b; }
+inline std::string operator+(char const* a, InternedString const& b) { return a + b.str(); }
+std::ostream& operator<<(std::ostream& os, InternedString const& str);
@@ -0,0 +1,171 @@
+#include "latencycal.hh"
+
+#include "audio.hh"
+#include "chrono.hh"
+#include "configuration.hh"
+#include "pitch.hh"
+#include "threads.hh"
+#include "util.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	const unsigned CLICKS = 10;
+	const double FIRST_CLICK = 1.0;  ///< Position of the first click, in seconds (the noise level is measured before it)
+	const double CLICK_INTERVAL = 0.75;
+	const double CLICK_LENGTH = 0.010;
+	const double MAX_ROUND_TRIP = 0.5;  ///< Clicks are looked for this long after they were played
+	const double END = FIRST_CLICK + CLICKS * CLICK_INTERVAL + MAX_ROUND_TRIP;
+	const double MIN_LEVEL = 0.02;  ///< Of a click in the input (also at least a few times the noise)
+	const double MAX_SPREAD = 0.010;  ///< Between the quartiles of the clicks found, in seconds
+	const unsigned RATE = 48000;
+	const char SEPARATOR = '|';  ///< Between the fields of audio/latency_calibration entries
+
+	void le16(std::ostream& os, std::uint16_t v) { os.put(v & 0xFF).put(v >> 8); }
+	void le32(std::ostream& os, std::uint32_t v) { le16(os, v & 0xFFFF); le16(os, v >> 16); }
+
+	/// Write the click track as a mono 16-bit WAV file
+	void writeClicks(fs::path const& file) {
+		std::vector<std::int16_t> pcm(std::size_t((END + 0.5) * RATE));
+		for (unsigned k = 0; k < CLICKS; ++k) {
+			const std::size_t begin = (FIRST_CLICK + k * CLICK_INTERVAL) * RATE;
+			// A burst of 1 kHz that starts at full level, well within the range of any mic
+			for (std::size_t i = 0; i < CLICK_LENGTH * RATE; ++i) pcm[begin + i] = std::lround(26000.0 * std::sin(TAU * 1000.0 * i / RATE));
+		}
+		std::ofstream f(file.string(), std::ios::binary);
+		const std::uint32_t bytes = pcm.size() * 2;
+		f.write("RIFF", 4); le32(f, 36 + bytes); f.write("WAVE", 4);
+		f.write("fmt ", 4); le32(f, 16); le16(f, 1); le16(f, 1); le32(f, RATE); le32(f, RATE * 2); le16(f, 2); le16(f, 16);
+		f.write("data", 4); le32(f, bytes);
+		for (std::int16_t s: pcm) le16(f, s);
+		if (!f) throw std::runtime_error("Cannot write " + file.string());
+	}
+
+	/// The stored round trip of the input device with the output device (or NaN)
+	double stored(std::string const& input, std::string const& output) {
+		for (auto const& entry: config["audio/latency_calibration"].sl()) {
+			std::istringstream iss(entry);
+			std::string in, out;
+			double seconds;
+			if (std::getline(iss, in, SEPARATOR) && std::getline(iss, out, SEPARATOR) && iss >> seconds && in == input && out == output) return seconds;
+		}
+		return getNaN();
+	}
+}
+
+LatencyCalibration::LatencyCalibration(Audio& audio): m_audio(audio), m_file(fs::temp_directory_path() / "performous-latency-clicks.wav") {
+	for (Device const& d: m_audio.devices()) {
+		if (d.isOutput()) m_output = d.spec;
+		Input input;
+		for (Analyzer* a: d.mics) if (a) input.mics.push_back(a);
+		if (input.mics.empty()) continue;
+		input.spec = d.spec;
+		input.samples.resize(input.mics.size());
+		input.found.assign(CLICKS, getNaN());
+		m_inputs.push_back(std::move(input));
+	}
+	if (m_output.empty()) throw std::runtime_error("No playback device is open");
+	if (m_inputs.empty()) throw std::runtime_error("No mics are open");
+	writeClicks(m_file);
+	for (Input& input: m_inputs) {
+		for (std::size_t i = 0; i < input.mics.size(); ++i) {
+			std::vector<float>& samples = input.samples[i];
+			input.mics[i]->setTap([&samples](float const* begin, float const* end) { samples.insert(samples.end(), begin, end); });
+		}
+	}
+	m_audio.playMusic(m_file, false, 0.0);
+	m_thread = std::thread(&LatencyCalibration::run, this);
+}
+
+LatencyCalibration::~LatencyCalibration() {
+	m_quit = true;
+	if (m_thread.joinable()) m_thread.join();
+	for (Input& input: m_inputs) for (Analyzer* a: input.mics) a->setTap(nullptr);
+	m_audio.stopMusic();
+	boost::system::error_code ec;
+	fs::remove(m_file, ec);
+}
+
+void LatencyCalibration::run() {
+	threads::enter(threads::Class::io, "latency calibration");
+	AnalyzerSignal& signal = Analyzer::signal();
+	const Time start = Clock::now();
+	while (!m_quit) {
+		const unsigned inputs = signal.count();
+		const double pos = m_audio.getPosition();
+		for (Input& input: m_inputs) {
+			for (Analyzer* a: input.mics) a->process();
+			if (pos == pos) detect(input, pos, input.mics.front()->analysisRate());
+			for (auto& samples: input.samples) samples.clear();
+		}
+		if (pos >= END || (pos != pos && Clock::now() - start > 10s)) break;  // Done, or the clicks do not play
+		signal.wait(inputs, 20ms);
+	}
+	for (Input const& input: m_inputs) {
+		Result r;
+		r.spec = input.spec;
+		std::vector<double> found;
+		for (double rt: input.found) if (rt == rt) found.push_back(rt);
+		std::sort(found.begin(), found.end());
+		r.detected = found.size();
+		if (!found.empty()) {
+			r.roundTrip = found[found.size() / 2];
+			r.ok = found.size() >= CLICKS / 2 && found[3 * found.size() / 4] - found[found.size() / 4] <= MAX_SPREAD;
+		}
+		std::clog << "audio/info: Latency calibration of " << input.spec << ": " << r.detected << " of " << CLICKS << " clicks found"
+		  << (r.detected ? ", round trip " + std::to_string(std::lround(1e3 * r.roundTrip)) + " ms" : std::string())
+		  << (r.ok ? "" : " (failed)") << std::endl;
+		m_results.push_back(r);
+	}
+	m_done = true;
+}
+
+void LatencyCalibration::detect(Input& input, double pos, double rate) {
+	for (auto const& samples: input.samples) {
+		const double threshold = std::max(MIN_LEVEL, 4.0 * input.noise);
+		for (std::size_t i = 0; i < samples.size(); ++i) {
+			const double t = pos - (samples.size() - 1 - i) / rate;  // The newest sample consumed is about now
+			const double level = std::abs(samples[i]);
+			if (t < FIRST_CLICK - 0.1) { input.noise = std::max(input.noise, level); continue; }
+			const double k = std::floor((t - FIRST_CLICK) / CLICK_INTERVAL);
+			if (k < 0.0 || k >= CLICKS || level < threshold) continue;
+			const double rt = t - (FIRST_CLICK + k * CLICK_INTERVAL);
+			double& found = input.found[std::size_t(k)];
+			if (rt < MAX_ROUND_TRIP && !(found <= rt)) found = rt;  // The earliest of the mics
+		}
+	}
+}
+
+void LatencyCalibration::save() {
+	auto& entries = config["audio/latency_calibration"].sl();
+	for (Result const& r: m_results) {
+		if (!r.ok) continue;
+		const std::string prefix = r.spec + SEPARATOR + m_output + SEPARATOR;
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [&prefix](std::string const& e) { return e.compare(0, prefix.size(), prefix) == 0; }), entries.end());
+		entries.push_back(prefix + std::to_string(r.roundTrip));
+	}
+	apply(m_audio.devices());
+	writeConfig(false);
+}
+
+void LatencyCalibration::apply(std::list<Device>& devices) {
+	std::string output;
+	for (Device const& d: devices) if (d.isOutput()) output = d.spec;
+	double base = getInf();
+	for (Device const& d: devices) {
+		const double rt = stored(d.spec, output);
+		if (rt == rt) base = std::min(base, rt);
+	}
+	if (base == getInf()) return;  // Nothing calibrated
+	config["audio/round-trip"].f() = base;
+	for (Device const& d: devices) {
+		const double rt = stored(d.spec, output);
+		for (Analyzer* a: d.mics) if (a) a->setLatency(rt == rt ? rt - base : 0.0);
+		if (rt == rt) std::clog << "audio/info: Calibrated round trip of " << d.spec << ": " << std::lround(1e3 * rt) << " ms" << std::endl;
+	}
+}
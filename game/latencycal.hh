@@ -0,0 +1,62 @@
+#pragma once
+
+#include "fs.hh"
+#include <atomic>
+#include <list>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Analyzer;
+class Audio;
+struct Device;
+
+/**
+* Measures the round-trip latency (audio/round-trip) of each input device with the playback device. A track of
+* clicks is played as music and the clicks are looked for in the input of the mics, timed against the audio
+* position like the engine times singing. The results are stored per device pair (audio/latency_calibration)
+* and applied whenever the devices are opened: audio/round-trip becomes the smallest of them and the mics of
+* slower devices get the difference as their Analyzer::latency.
+**/
+class LatencyCalibration {
+  public:
+	/// Result of an input device
+	struct Result {
+		std::string spec;  ///< The audio/devices line of the input device
+		unsigned detected = 0;  ///< Clicks found
+		double roundTrip = 0.0;  ///< Median of the clicks found, in seconds
+		bool ok = false;  ///< Enough clicks found, close enough to each other
+	};
+	/// Start playing the clicks on the open devices (not while the engine is analyzing)
+	explicit LatencyCalibration(Audio& audio);
+	~LatencyCalibration();
+	LatencyCalibration(LatencyCalibration const&) = delete;
+	LatencyCalibration& operator=(LatencyCalibration const&) = delete;
+	/// Have all the clicks been played and the results computed?
+	bool done() const { return m_done; }
+	/// The results (once done)
+	std::vector<Result> const& results() const { return m_results; }
+	/// Store the successful results in the config, write it and apply them to the open devices (once done)
+	void save();
+	/// Set audio/round-trip and the latencies of the mics of the devices from the stored results
+	static void apply(std::list<Device>& devices);
+  private:
+	/// An input device being measured
+	struct Input {
+		std::string spec;
+		std::vector<Analyzer*> mics;
+		std::vector<std::vector<float>> samples;  ///< Consumed by the analysis of each mic since the previous round
+		std::vector<double> found;  ///< Round trip of each click (NaN until found)
+		double noise = 0.0;  ///< Largest level before the first click
+	};
+	void run();
+	/// Look for the clicks in the samples of input, which end at the audio position pos
+	void detect(Input& input, double pos, double rate);
+	Audio& m_audio;
+	std::string m_output;  ///< The audio/devices line of the playback device
+	std::vector<Input> m_inputs;
+	std::vector<Result> m_results;  ///< Written by the thread before m_done
+	fs::path m_file;  ///< The click track
+	std::atomic<bool> m_quit{ false }, m_done{ false };
+	std::thread m_thread;
+};
@@ -101,8 +101,10 @@ void LayoutSinger::drawScore(PositionMode position) {
 }
 
 void LayoutSinger::draw(double time, PositionMode position) {
+	static ConfigItem& karaokeMode = config["game/karaoke_mode"];
 	// Draw notes and pitch waves (only when not in karaoke mode)
-	if (!config["game/karaoke_mode"].i()) {
+	if (!karaokeMode.i()) {
+		glutil::GPUTimer::Section section("note highway");
 		switch(position) {
 			case LayoutSinger::FULL:
 				m_noteGraph.draw(time, m_database, NoteGraph::FULLSCREEN);
@@ -122,11 +124,12 @@ void LayoutSinger::draw(double time, PositionMode position) {
 
 	// Draw the lyrics
 	if (!m_hideLyrics) {
+		glutil::GPUTimer::Section section("lyrics");
 		double linespacing = 0.0;
 		Dimensions pos;
 		switch(position) {
 			case LayoutSinger::FULL:
-				if(config["game/karaoke_mode"].i() >= 2) {
+				if(karaokeMode.i() >= 2) {
 					pos.center(0);
 				} else {
 					pos.screenBottom(-0.07);
@@ -147,7 +150,7 @@ void LayoutSinger::draw(double time, PositionMode position) {
 				linespacing = 0.06;
 				break;
 		}
-		bool dirty;
+		bool dirty, changed = false;
 		do {
 			dirty = false;
 			if (!m_lyrics.empty() && m_lyrics[0].expired(time)) {
@@ -160,7 +163,9 @@ void LayoutSinger::draw(double time, PositionMode position) {
 				m_lyrics.push_back(LyricRow(m_lyricit, m_vocal.notes.end()));
 				dirty = true;
 			}
+			changed |= dirty;
 		} while (dirty);
+		if (changed && m_theme.get()) prefetchLyrics();
 		if (m_theme.get()) // if there is a theme, draw the lyrics with it
 		{
 			for (size_t i = 0; i < m_lyrics.size(); ++i, pos.move(0.0, linespacing)) {
@@ -171,7 +176,33 @@ void LayoutSinger::draw(double time, PositionMode position) {
 		}
 	}
 
-	if (!config["game/karaoke_mode"].i() ) drawScore(position); // draw score if not in karaoke mode
+	if (!karaokeMode.i() ) drawScore(position); // draw score if not in karaoke mode
+}
+
+namespace {
+	/// Rows (after the two drawn ones) to prefetch for lyrics_next
+	const unsigned LYRICS_LOOKAHEAD = 2;
+}
+
+void LayoutSinger::prefetchLyrics() {
+	// Rows move up from lyrics_next to lyrics_now, which use different styles
+	std::vector<std::string> now, next;
+	for (size_t i = 1; i < m_lyrics.size() && i <= 1 + LYRICS_LOOKAHEAD; ++i) {
+		auto row = m_lyrics[i].syllables();
+		now.insert(now.end(), row.begin(), row.end());
+		if (i >= 2) next.insert(next.end(), row.begin(), row.end());
+	}
+	// Sentences not yet in m_lyrics, split like LyricRow does
+	LyricRow::Iterator it = m_lyricit, eof = m_vocal.notes.end();
+	for (size_t rows = m_lyrics.size(); it != eof && rows < 2 + LYRICS_LOOKAHEAD; ++rows) {
+		auto begin = it;
+		while (it != eof && it->type != Note::SLEEP) ++it;
+		auto row = LyricRow::syllables(begin, it);
+		next.insert(next.end(), row.begin(), row.end());
+		if (it != eof) ++it;
+	}
+	if (!now.empty()) m_theme->lyrics_now.prefetch(now);
+	if (!next.empty()) m_theme->lyrics_next.prefetch(next);
 }
 
 double LayoutSinger::lyrics_begin() const {
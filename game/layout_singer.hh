@@ -33,24 +33,38 @@ class LyricRow {
 	}
 	/// draw/print lyrics
 	void draw(SvgTxtTheme& txt, double time, Dimensions &dim) const {
-		std::vector<TZoomText> sentence;
-		for (Iterator it = m_begin; it != m_end; ++it) {
-			sentence.push_back(TZoomText(it->syllable));
-			if(!config["game/Textstyle"].i()) {
+		static ConfigItem& textStyle = config["game/Textstyle"];
+		// The syllables are only copied once, after that only their zoom changes
+		if (m_sentence.empty()) {
+			for (Iterator it = m_begin; it != m_end; ++it) m_sentence.push_back(TZoomText(it->syllable));
+		}
+		auto zt = m_sentence.begin();
+		for (Iterator it = m_begin; it != m_end; ++it, ++zt) {
+			if(!textStyle.i()) {
 			bool current = (time >= it->begin && time < it->end);
-			sentence.back().factor = current ? 1.1 - 0.1 * (time - it->begin) / (it->end - it->begin) : 1.0; // Zoom-in and out while it's the current syllable.
+			zt->factor = current ? 1.1 - 0.1 * (time - it->begin) / (it->end - it->begin) : 1.0; // Zoom-in and out while it's the current syllable.
 			} else {
 			bool current = time >=it->begin;
-			sentence.back().factor = current ? std::min(1.0 + (0.15 * (time - it->begin) / (it->end - it->begin)), 1.1) : 1.0; // Zoom-in and out syllable proportionally to their length.
+			zt->factor = current ? std::min(1.0 + (0.15 * (time - it->begin) / (it->end - it->begin)), 1.1) : 1.0; // Zoom-in and out syllable proportionally to their length.
 			}
 		}
 		ColorTrans c(Color::alpha(fade.get()));
 		txt.dimensions = dim;
-		txt.draw(sentence, true);
+		txt.draw(m_sentence, true, m_id);
+	}
+	/// syllables of the row (as drawn, for SvgTxtTheme::prefetch)
+	std::vector<std::string> syllables() const { return syllables(m_begin, m_end); }
+	/// syllables of notes [begin, end)
+	static std::vector<std::string> syllables(Iterator begin, Iterator end) {
+		std::vector<std::string> ret;
+		for (Iterator it = begin; it != end; ++it) ret.push_back(it->syllable);
+		return ret;
 	}
 
   private:
 	Iterator m_begin, m_end;
+	std::uint64_t m_id = SvgTxtTheme::newTextId();  ///< Identifies the row's text for SvgTxtTheme::draw
+	mutable std::vector<TZoomText> m_sentence;  ///< As drawn (built by the first draw)
 };
 
 class LayoutSinger {
@@ -65,6 +79,8 @@ class LayoutSinger {
 	double lyrics_begin() const;
 	void hideLyrics(bool hide = true) { m_hideLyrics = hide; }
   private:
+	/// Have the texts of rows that will be drawn soon rendered in the background
+	void prefetchLyrics();
 	VocalTrack& m_vocal;
 	NoteGraph m_noteGraph;
 	Notes::const_iterator m_lyricit;
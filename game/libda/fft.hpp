@@ -5,68 +5,325 @@
  */
 
 #include "sample.hpp"
+#include "simd.hpp"
 #include <complex>
 #include <cstddef>
+#include <cstdint>
 #include <vector>
 
 
 namespace da {
 
 	constexpr double TAU = 2.0 * 3.141592653589793238462643383279502884;
+	/// Number of channels transformed together by fftBatch, one per SIMD lane
+	constexpr std::size_t FFT_LANES = 4;
 
 	// With g++ optimization -fcx-limited-range should be used for 5x performance boost.
-	
-	// Based on the description of Volodymyr Myrnyy in
-	// http://www.dspdesignline.com/showArticle.jhtml?printableArticle=true&articleId=199903272
-	template<unsigned P, typename T> struct DanielsonLanczos {
-		static void apply(std::complex<T>* data) {
-			constexpr std::size_t N = 1 << P;
-			constexpr std::size_t M = N / 2;
-			// Compute even and odd halves
-			DanielsonLanczos<P - 1, T>().apply(data);
-			DanielsonLanczos<P - 1, T>().apply(data + M);
-			// Combine the results
-			std::complex<T> w(1.0);
-			for (std::size_t i = 0; i < M; ++i) {
-				const std::complex<T> temp = data[i + M] * w;
-				data[M + i] = data[i] - temp;
-				data[i] += temp;
-				w *= std::polar<T>(1.0, - TAU / N);
+
+	/// Precomputed tables for a 2^P point transform, shared by all users of the same size.
+	template<unsigned P, typename T> class FFTPlan {
+	  public:
+		static constexpr std::size_t N = std::size_t(1) << P;
+		static FFTPlan const& get() { static const FFTPlan plan; return plan; }
+		/// Twiddle factors exp(-i tau k / (2 half)) for k < half, contiguous for the butterfly stage of the given half size.
+		std::complex<T> const* twiddles(std::size_t half) const { return &m_twiddles[half]; }
+		/// Bit-reversed index
+		std::size_t bitrev(std::size_t i) const { return m_bitrev[i]; }
+	  private:
+		FFTPlan(): m_twiddles(N), m_bitrev(N) {
+			// Computed directly in double precision instead of accumulating rotations
+			for (std::size_t half = 1; half < N; half <<= 1) {
+				for (std::size_t k = 0; k < half; ++k) m_twiddles[half + k] = std::polar<double>(1.0, -TAU * k / (2 * half));
+			}
+			for (std::size_t i = 0; i < N; ++i) {
+				std::size_t r = 0;
+				for (unsigned b = 0; b < P; ++b) if (i & (std::size_t(1) << b)) r |= std::size_t(1) << (P - 1 - b);
+				m_bitrev[i] = r;
 			}
 		}
+		std::vector<std::complex<T>> m_twiddles;
+		std::vector<std::uint32_t> m_bitrev;
 	};
 
-	template<typename T> struct DanielsonLanczos<0, T> { static void apply(std::complex<T>*) {} };
+	namespace fftdetail {
+		/// Combine two half-transforms: a[k] += w[k] b[k], b[k] = a[k] - w[k] b[k]
+		template<typename T> void butterfly(std::complex<T>* a, std::complex<T>* b, std::complex<T> const* w, std::size_t n) {
+			for (std::size_t k = 0; k < n; ++k) {
+				const std::complex<T> temp = b[k] * w[k];
+				b[k] = a[k] - temp;
+				a[k] += temp;
+			}
+		}
+
+		/// Vectorized butterfly for single precision (std::complex<float> is guaranteed to be laid out as float[2])
+		inline void butterfly(std::complex<float>* a, std::complex<float>* b, std::complex<float> const* w, std::size_t n) {
+			std::size_t k = 0;
+#if defined(DA_SIMD_AVX)
+			for (; k + 4 <= n; k += 4) {
+				float* pa = reinterpret_cast<float*>(a + k);
+				float* pb = reinterpret_cast<float*>(b + k);
+				__m256 va = _mm256_loadu_ps(pa), vb = _mm256_loadu_ps(pb), vw = _mm256_loadu_ps(reinterpret_cast<float const*>(w + k));
+				__m256 wr = _mm256_moveldup_ps(vw);  // (re, re) pairs
+				__m256 wi = _mm256_movehdup_ps(vw);  // (im, im) pairs
+				__m256 bs = _mm256_permute_ps(vb, 0xB1);  // Swap re and im
+				__m256 t = _mm256_addsub_ps(_mm256_mul_ps(vb, wr), _mm256_mul_ps(bs, wi));
+				_mm256_storeu_ps(pb, _mm256_sub_ps(va, t));
+				_mm256_storeu_ps(pa, _mm256_add_ps(va, t));
+			}
+#endif
+#if defined(DA_SIMD_SSE2)
+			const __m128 sign = _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f);  // Negate the real lanes
+			for (; k + 2 <= n; k += 2) {
+				float* pa = reinterpret_cast<float*>(a + k);
+				float* pb = reinterpret_cast<float*>(b + k);
+				__m128 va = _mm_loadu_ps(pa), vb = _mm_loadu_ps(pb), vw = _mm_loadu_ps(reinterpret_cast<float const*>(w + k));
+				__m128 wr = _mm_shuffle_ps(vw, vw, _MM_SHUFFLE(2, 2, 0, 0));
+				__m128 wi = _mm_shuffle_ps(vw, vw, _MM_SHUFFLE(3, 3, 1, 1));
+				__m128 bs = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(2, 3, 0, 1));
+				__m128 t = _mm_add_ps(_mm_mul_ps(vb, wr), _mm_xor_ps(_mm_mul_ps(bs, wi), sign));
+				_mm_storeu_ps(pb, _mm_sub_ps(va, t));
+				_mm_storeu_ps(pa, _mm_add_ps(va, t));
+			}
+#elif defined(DA_SIMD_NEON)
+			for (; k + 4 <= n; k += 4) {
+				float* pa = reinterpret_cast<float*>(a + k);
+				float* pb = reinterpret_cast<float*>(b + k);
+				float32x4x2_t va = vld2q_f32(pa), vb = vld2q_f32(pb), vw = vld2q_f32(reinterpret_cast<float const*>(w + k));
+				float32x4_t tr = vmlsq_f32(vmulq_f32(vb.val[0], vw.val[0]), vb.val[1], vw.val[1]);
+				float32x4_t ti = vmlaq_f32(vmulq_f32(vb.val[1], vw.val[0]), vb.val[0], vw.val[1]);
+				float32x4x2_t ra, rb;
+				ra.val[0] = vaddq_f32(va.val[0], tr); ra.val[1] = vaddq_f32(va.val[1], ti);
+				rb.val[0] = vsubq_f32(va.val[0], tr); rb.val[1] = vsubq_f32(va.val[1], ti);
+				vst2q_f32(pa, ra);
+				vst2q_f32(pb, rb);
+			}
+#endif
+			for (; k < n; ++k) {
+				const std::complex<float> temp = b[k] * w[k];
+				b[k] = a[k] - temp;
+				a[k] += temp;
+			}
+		}
+
+		/// The first two stages done as one radix-4 pass (twiddles are 1 and -i, so no multiplications needed)
+		template<typename T> void radix4(std::complex<T>* data, std::size_t N) {
+			for (std::size_t i = 0; i + 4 <= N; i += 4) {
+				const std::complex<T> b0 = data[i] + data[i + 1], b1 = data[i] - data[i + 1];
+				const std::complex<T> b2 = data[i + 2] + data[i + 3], b3 = data[i + 2] - data[i + 3];
+				const std::complex<T> t(b3.imag(), -b3.real());  // b3 * -i
+				data[i] = b0 + b2;
+				data[i + 2] = b0 - b2;
+				data[i + 1] = b1 + t;
+				data[i + 3] = b1 - t;
+			}
+		}
+
+		/// butterfly() of FFT_LANES interleaved transforms, with real and imaginary parts in separate arrays
+		inline void butterflyLanes(float* ar, float* ai, float* br, float* bi, std::complex<float> const* w, std::size_t n) {
+			for (std::size_t k = 0; k < n; ++k, ar += FFT_LANES, ai += FFT_LANES, br += FFT_LANES, bi += FFT_LANES) {
+				const float wr = w[k].real(), wi = w[k].imag();
+#if defined(DA_SIMD_SSE2)
+				const __m128 vwr = _mm_set1_ps(wr), vwi = _mm_set1_ps(wi);
+				const __m128 xr = _mm_loadu_ps(br), xi = _mm_loadu_ps(bi);
+				const __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, vwr), _mm_mul_ps(xi, vwi));
+				const __m128 ti = _mm_add_ps(_mm_mul_ps(xr, vwi), _mm_mul_ps(xi, vwr));
+				const __m128 yr = _mm_loadu_ps(ar), yi = _mm_loadu_ps(ai);
+				_mm_storeu_ps(br, _mm_sub_ps(yr, tr));
+				_mm_storeu_ps(bi, _mm_sub_ps(yi, ti));
+				_mm_storeu_ps(ar, _mm_add_ps(yr, tr));
+				_mm_storeu_ps(ai, _mm_add_ps(yi, ti));
+#elif defined(DA_SIMD_NEON)
+				const float32x4_t xr = vld1q_f32(br), xi = vld1q_f32(bi);
+				const float32x4_t tr = vmlsq_n_f32(vmulq_n_f32(xr, wr), xi, wi);
+				const float32x4_t ti = vmlaq_n_f32(vmulq_n_f32(xr, wi), xi, wr);
+				const float32x4_t yr = vld1q_f32(ar), yi = vld1q_f32(ai);
+				vst1q_f32(br, vsubq_f32(yr, tr));
+				vst1q_f32(bi, vsubq_f32(yi, ti));
+				vst1q_f32(ar, vaddq_f32(yr, tr));
+				vst1q_f32(ai, vaddq_f32(yi, ti));
+#else
+				for (std::size_t l = 0; l < FFT_LANES; ++l) {
+					const float tr = br[l] * wr - bi[l] * wi, ti = br[l] * wi + bi[l] * wr;
+					br[l] = ar[l] - tr;
+					bi[l] = ai[l] - ti;
+					ar[l] += tr;
+					ai[l] += ti;
+				}
+#endif
+			}
+		}
+
+		/// radix4() of FFT_LANES interleaved transforms (plain loops over lanes, which compilers vectorize)
+		inline void radix4Lanes(float* re, float* im, std::size_t N) {
+			constexpr std::size_t L = FFT_LANES;
+			for (std::size_t i = 0; i + 4 <= N; i += 4) {
+				float* r = re + i * L;
+				float* m = im + i * L;
+				for (std::size_t l = 0; l < L; ++l) {
+					const float b0r = r[l] + r[L + l], b0i = m[l] + m[L + l];
+					const float b1r = r[l] - r[L + l], b1i = m[l] - m[L + l];
+					const float b2r = r[2 * L + l] + r[3 * L + l], b2i = m[2 * L + l] + m[3 * L + l];
+					const float b3r = r[2 * L + l] - r[3 * L + l], b3i = m[2 * L + l] - m[3 * L + l];
+					// t = b3 * -i = (b3i, -b3r)
+					r[l] = b0r + b2r; m[l] = b0i + b2i;
+					r[2 * L + l] = b0r - b2r; m[2 * L + l] = b0i - b2i;
+					r[L + l] = b1r + b3i; m[L + l] = b1i - b3r;
+					r[3 * L + l] = b1r - b3i; m[3 * L + l] = b1i + b3r;
+				}
+			}
+		}
+
+		/// transform() of FFT_LANES interleaved bit-reversed transforms (element k of lane l at [k * FFT_LANES + l])
+		template<unsigned P> void transformLanes(float* re, float* im) {
+			constexpr std::size_t N = std::size_t(1) << P;
+			static_assert(N >= 4, "transformLanes requires at least four points");
+			radix4Lanes(re, im, N);
+			FFTPlan<P, float> const& plan = FFTPlan<P, float>::get();
+			for (std::size_t half = 4; half < N; half <<= 1) {
+				std::complex<float> const* w = plan.twiddles(half);
+				for (std::size_t i = 0; i < N; i += 2 * half) {
+					const std::size_t a = i * FFT_LANES, b = (i + half) * FFT_LANES;
+					butterflyLanes(re + a, im + a, re + b, im + b, w, half);
+				}
+			}
+		}
+
+		/// Turn the 2^(P-1) point transform of even (real) and odd (imaginary) samples in out into bins 0...N/2 of the real signal
+		template<unsigned P> void rfftCombine(std::complex<float>* out) {
+			constexpr std::size_t H = std::size_t(1) << (P - 1);
+			std::complex<float> const* w = FFTPlan<P, float>::get().twiddles(H);  // exp(-i tau k / N)
+			const std::complex<float> z0 = out[0];
+			out[0] = z0.real() + z0.imag();
+			out[H] = z0.real() - z0.imag();
+			out[H / 2] = std::conj(out[H / 2]);
+			for (std::size_t k = 1; k < H / 2; ++k) {
+				const std::complex<float> zk = out[k], zm = std::conj(out[H - k]);
+				const std::complex<float> even = 0.5f * (zk + zm);
+				const std::complex<float> d = zk - zm;
+				const std::complex<float> odd = w[k] * std::complex<float>(0.5f * d.imag(), -0.5f * d.real());  // w * d / 2i
+				out[k] = even + odd;
+				out[H - k] = std::conj(even - odd);
+			}
+		}
+
+		/// Perform the butterfly stages of FFT on bit-reversed data.
+		template<unsigned P, typename T> void transform(std::complex<T>* data) {
+			constexpr std::size_t N = std::size_t(1) << P;
+			if (N == 2) { fftdetail::butterfly(data, data + 1, FFTPlan<P, T>::get().twiddles(1), 1); return; }
+			if (N < 4) return;
+			radix4(data, N);
+			FFTPlan<P, T> const& plan = FFTPlan<P, T>::get();
+			for (std::size_t half = 4; half < N; half <<= 1) {
+				std::complex<T> const* w = plan.twiddles(half);
+				for (std::size_t i = 0; i < N; i += 2 * half) fftdetail::butterfly(data + i, data + i + half, w, half);
+			}
+		}
+	}
 
 	/** Perform FFT on data. **/
 	template<unsigned P, typename T> void fft(std::complex<T>* data) {
 		// Perform bit-reversal sorting of sample data.
-		constexpr std::size_t N = 1 << P;
-		std::size_t j = 0;
+		constexpr std::size_t N = std::size_t(1) << P;
+		FFTPlan<P, T> const& plan = FFTPlan<P, T>::get();
 		for (std::size_t i = 0; i < N; ++i) {
+			std::size_t j = plan.bitrev(i);
 			if (i < j) std::swap(data[i], data[j]);
-			std::size_t m = N / 2;
-			while (m > 1 && m <= j) { j -= m; m >>= 1; }
-			j += m;
 		}
 		// Do the actual calculation
-		DanielsonLanczos<P, T>::apply(data);
+		fftdetail::transform<P, T>(data);
+	}
+
+	/**
+	* Perform FFT on real-valued data from floating point iterator, windowing the input.
+	* The 2^P real samples are packed into a 2^(P-1) point complex transform, so only half of
+	* the work of a full complex FFT is done. Writes the non-redundant bins 0...N/2 (N/2 + 1 values)
+	* to out; the remaining bins are their complex conjugates.
+	**/
+	template<unsigned P, typename InIt, typename Window> void rfft(InIt begin, Window const& window, std::complex<float>* out) {
+		static_assert(P >= 2, "rfft requires at least four points");
+		constexpr std::size_t N = std::size_t(1) << P;
+		constexpr std::size_t H = N / 2;
+		// Even samples to real part, odd samples to imaginary part, stored in bit-reversed order
+		FFTPlan<P - 1, float> const& half = FFTPlan<P - 1, float>::get();
+		for (std::size_t i = 0; i < H; ++i) {
+			float re = *begin++ * window[2 * i];
+			float im = *begin++ * window[2 * i + 1];
+			out[half.bitrev(i)] = std::complex<float>(re, im);
+		}
+		fftdetail::transform<P - 1, float>(out);
+		// Separate the even and odd spectra and combine them into the spectrum of the real signal
+		fftdetail::rfftCombine<P>(out);
+	}
+
+	/** Perform FFT on data from floating point iterator, windowing the input. Writes all 2^P bins to the caller-owned out (no allocations). **/
+	template<unsigned P, typename InIt, typename Window> void fft(InIt begin, Window const& window, std::complex<float>* out) {
+		constexpr std::size_t N = std::size_t(1) << P;
+		rfft<P>(begin, window, out);
+		// The input is real, so the upper half is the mirror image of the lower half
+		for (std::size_t k = 1; k < N / 2; ++k) out[N - k] = std::conj(out[k]);
+	}
+
+	/**
+	* Perform the FFT of fft(begin, window, out) on count <= FFT_LANES channels at once, each channel in its own SIMD lane,
+	* so that the butterflies of all channels share the same vector instructions. pcm[c] holds 2^P samples of channel c and
+	* out[c] receives its 2^P bins. scratch is caller-owned room for FFT_LANES * 2^P floats (no allocations).
+	**/
+	template<unsigned P, typename Window> void fftBatch(float const* const* pcm, std::size_t count, Window const& window, std::complex<float>* const* out, float* scratch) {
+		static_assert(P >= 3, "fftBatch requires at least eight points");
+		constexpr std::size_t N = std::size_t(1) << P;
+		constexpr std::size_t H = N / 2;
+		// Even samples to real parts, odd samples to imaginary parts (as in rfft), lanes interleaved in bit-reversed order
+		FFTPlan<P - 1, float> const& half = FFTPlan<P - 1, float>::get();
+		float* re = scratch;
+		float* im = scratch + H * FFT_LANES;
+		for (std::size_t i = 0; i < H; ++i) {
+			const std::size_t j = half.bitrev(i) * FFT_LANES;
+			const float w0 = window[2 * i], w1 = window[2 * i + 1];
+			for (std::size_t l = 0; l < count; ++l) {
+				re[j + l] = pcm[l][2 * i] * w0;
+				im[j + l] = pcm[l][2 * i + 1] * w1;
+			}
+			for (std::size_t l = count; l < FFT_LANES; ++l) re[j + l] = im[j + l] = 0.0f;
+		}
+		fftdetail::transformLanes<P - 1>(re, im);
+		// Combine the spectra as rfftCombine does, all lanes at once, and write out the full spectrum of each channel as fft does
+		constexpr std::size_t L = FFT_LANES;
+		std::complex<float> const* w = FFTPlan<P, float>::get().twiddles(H);  // exp(-i tau k / N)
+		for (std::size_t l = 0; l < count; ++l) {
+			out[l][0] = re[l] + im[l];
+			out[l][H] = re[l] - im[l];
+			out[l][H / 2] = std::complex<float>(re[H / 2 * L + l], -im[H / 2 * L + l]);
+			out[l][N - H / 2] = std::conj(out[l][H / 2]);
+		}
+		for (std::size_t k = 1; k < H / 2; ++k) {
+			float const* zkr = re + k * L;
+			float const* zki = im + k * L;
+			float const* zmr = re + (H - k) * L;
+			float const* zmi = im + (H - k) * L;
+			const float wr = w[k].real(), wi = w[k].imag();
+			float lowr[L], lowi[L], highr[L], highi[L];
+			for (std::size_t l = 0; l < L; ++l) {
+				// even = (zk + conj(zm)) / 2, odd = w * (zk - conj(zm)) / 2i
+				const float er = 0.5f * (zkr[l] + zmr[l]), ei = 0.5f * (zki[l] - zmi[l]);
+				const float dr = 0.5f * (zki[l] + zmi[l]), di = -0.5f * (zkr[l] - zmr[l]);
+				const float or_ = wr * dr - wi * di, oi = wr * di + wi * dr;
+				lowr[l] = er + or_; lowi[l] = ei + oi;
+				highr[l] = er - or_; highi[l] = oi - ei;  // conj(even - odd)
+			}
+			for (std::size_t l = 0; l < count; ++l) {
+				std::complex<float>* o = out[l];
+				o[k] = std::complex<float>(lowr[l], lowi[l]);
+				o[H - k] = std::complex<float>(highr[l], highi[l]);
+				o[N - k] = std::complex<float>(lowr[l], -lowi[l]);
+				o[H + k] = std::complex<float>(highr[l], -highi[l]);
+			}
+		}
 	}
 
 	/** Perform FFT on data from floating point iterator, windowing the input. **/
 	template<unsigned P, typename InIt, typename Window> std::vector<std::complex<float> > fft(InIt begin, Window window) {
-		std::vector<std::complex<float> > data(1 << P);
-		// Perform bit-reversal sorting of sample data.
-		constexpr std::size_t N = 1 << P;
-		std::size_t j = 0;
-		for (std::size_t i = 0; i < N; ++i) {
-			data[j] = *begin++ * window[i];
-			std::size_t m = N / 2;
-			while (m > 1 && m <= j) { j -= m; m >>= 1; }
-			j += m;
-		}
-		// Do the actual calculation
-		DanielsonLanczos<P, float>::apply(&data[0]);
+		std::vector<std::complex<float> > data(std::size_t(1) << P);
+		fft<P>(begin, window, &data[0]);
 		return data;
 	}
 
@@ -77,5 +334,5 @@ namespace da {
 		constexpr std::complex<T> scale(1.0/N, 0.0);
 		for (std::size_t i = 0; i < N; ++i) data[i] = scale * std::conj(data[i]);  // Invert back, and apply IFFT scaling
 	}
-	
+
 }
@@ -0,0 +1,166 @@
+#pragma once
+
+/**
+ * @file mix.hpp Vectorized mixing kernels (format conversion, gain ramps, accumulation).
+ */
+
+#include "sample.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace da {
+
+	/// Accumulate s16 samples to float: dst[i] += gain * conv_from_s16(src[i])
+	static inline void mix_s16(sample_t* dst, std::int16_t const* src, std::size_t n, float gain) {
+		std::size_t i = 0;
+		const float scale = gain / max_s16;
+#if defined(DA_SIMD_SSE2)
+		const __m128 g = _mm_set1_ps(scale);
+		for (; i + 8 <= n; i += 8) {
+			__m128i s = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+			// Sign-extend to 32 bits by unpacking into the upper halves and shifting down
+			__m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+			__m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+			_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(lo, g)));
+			_mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_loadu_ps(dst + i + 4), _mm_mul_ps(hi, g)));
+		}
+#elif defined(DA_SIMD_NEON)
+		for (; i + 8 <= n; i += 8) {
+			int16x8_t s = vld1q_s16(src + i);
+			float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+			float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+			vst1q_f32(dst + i, vmlaq_n_f32(vld1q_f32(dst + i), lo, scale));
+			vst1q_f32(dst + i + 4, vmlaq_n_f32(vld1q_f32(dst + i + 4), hi, scale));
+		}
+#endif
+		for (; i < n; ++i) dst[i] += scale * src[i];
+	}
+
+	/// Accumulate float samples: dst[i] += gain * src[i]
+	static inline void mix_f32(sample_t* dst, sample_t const* src, std::size_t n, float gain) {
+		std::size_t i = 0;
+#if defined(DA_SIMD_SSE2)
+		const __m128 g = _mm_set1_ps(gain);
+		for (; i + 4 <= n; i += 4) _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g)));
+#elif defined(DA_SIMD_NEON)
+		for (; i + 4 <= n; i += 4) vst1q_f32(dst + i, vmlaq_n_f32(vld1q_f32(dst + i), vld1q_f32(src + i), gain));
+#endif
+		for (; i < n; ++i) dst[i] += gain * src[i];
+	}
+
+	/**
+	* Frequency-aware vocal remover for interleaved stereo. Vocals are usually panned to the center, so the
+	* mid channel (L + R) / 2 is removed, except for its low band (bass and kick drum, also centered), which
+	* a second order Butterworth low-pass (a biquad) keeps. The side channel (L - R) / 2 is kept as is:
+	* output left = low mid + side, right = low mid - side.
+	* The filter is recursive and thus runs per frame on a block at a time; combining the channels and mixing
+	* to the output is vectorized.
+	**/
+	class CenterSuppressor {
+	  public:
+		/// crossover is the cutoff frequency of the mid channel in Hz
+		explicit CenterSuppressor(double rate, double crossover = 150.0) {
+			const double w0 = 2.0 * pi * crossover / rate;
+			const double alpha = std::sin(w0) / (2.0 * 0.7071067811865476);
+			const double c = std::cos(w0), a0 = 1.0 + alpha;
+			m_b0 = m_b2 = 0.5 * (1.0 - c) / a0;
+			m_b1 = (1.0 - c) / a0;
+			m_a1 = -2.0 * c / a0;
+			m_a2 = (1.0 - alpha) / a0;
+		}
+		/// Add frames of src with center removed to dst with a linear gain ramp (as in mix_stereo)
+		void mix(sample_t* dst, sample_t const* src, std::size_t frames, float gain, float step) {
+			sample_t low[BLOCK];
+			for (std::size_t block = 0; block < frames; block += BLOCK) {
+				const std::size_t n = frames - block < BLOCK ? frames - block : BLOCK;
+				sample_t const* s = src + 2 * block;
+				sample_t* d = dst + 2 * block;
+				// Low-pass the mid channel (transposed direct form II)
+				for (std::size_t k = 0; k < n; ++k) {
+					const double x = 0.5 * (s[2 * k] + s[2 * k + 1]);
+					const double y = m_b0 * x + m_z1;
+					m_z1 = m_b1 * x - m_a1 * y + m_z2;
+					m_z2 = m_b2 * x - m_a2 * y;
+					low[k] = y;
+				}
+				const float g0 = gain + block * step;
+				std::size_t k = 0;
+#if defined(DA_SIMD_SSE2)
+				__m128 g = _mm_set_ps(g0 + step, g0 + step, g0, g0);
+				const __m128 inc = _mm_set1_ps(2.0f * step);
+				const __m128 half = _mm_set1_ps(0.5f);
+				for (; k + 2 <= n; k += 2) {
+					const __m128 v = _mm_loadu_ps(s + 2 * k);
+					// (L-R, R-L) pairs halved are the side channel with the signs of left and right
+					const __m128 side = _mm_mul_ps(_mm_sub_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1))), half);
+					const __m128 mid = _mm_set_ps(low[k + 1], low[k + 1], low[k], low[k]);
+					_mm_storeu_ps(d + 2 * k, _mm_add_ps(_mm_loadu_ps(d + 2 * k), _mm_mul_ps(_mm_add_ps(mid, side), g)));
+					g = _mm_add_ps(g, inc);
+				}
+#elif defined(DA_SIMD_NEON)
+				float32x4_t g = { g0, g0 + step, g0 + 2.0f * step, g0 + 3.0f * step };
+				const float32x4_t inc = vdupq_n_f32(4.0f * step);
+				for (; k + 4 <= n; k += 4) {
+					const float32x4x2_t v = vld2q_f32(s + 2 * k);
+					float32x4x2_t o = vld2q_f32(d + 2 * k);
+					const float32x4_t side = vmulq_n_f32(vsubq_f32(v.val[0], v.val[1]), 0.5f);
+					const float32x4_t mid = vld1q_f32(low + k);
+					o.val[0] = vmlaq_f32(o.val[0], vaddq_f32(mid, side), g);
+					o.val[1] = vmlaq_f32(o.val[1], vsubq_f32(mid, side), g);
+					vst2q_f32(d + 2 * k, o);
+					g = vaddq_f32(g, inc);
+				}
+#endif
+				for (; k < n; ++k) {
+					const float gk = g0 + k * step;
+					const sample_t side = 0.5f * (s[2 * k] - s[2 * k + 1]);
+					d[2 * k] += gk * (low[k] + side);
+					d[2 * k + 1] += gk * (low[k] - side);
+				}
+			}
+		}
+	  private:
+		static constexpr std::size_t BLOCK = 64;  ///< Frames filtered at once (kept on the stack)
+		double m_b0, m_b1, m_b2, m_a1, m_a2;
+		double m_z1 = 0.0, m_z2 = 0.0;
+	};
+
+	/**
+	* Accumulate interleaved stereo frames with a linear gain ramp: frame k of src is added to dst
+	* with gain + k * step. With a suppressor the center channel is removed (see CenterSuppressor).
+	**/
+	static inline void mix_stereo(sample_t* dst, sample_t const* src, std::size_t frames, float gain, float step, CenterSuppressor* suppressor = nullptr) {
+		if (suppressor) return suppressor->mix(dst, src, frames, gain, step);
+		std::size_t k = 0;
+#if defined(DA_SIMD_SSE2)
+		// Two frames per vector: gains (g, g, g + step, g + step)
+		__m128 g = _mm_set_ps(gain + step, gain + step, gain, gain);
+		const __m128 inc = _mm_set1_ps(2.0f * step);
+		for (; k + 2 <= frames; k += 2) {
+			_mm_storeu_ps(dst + 2 * k, _mm_add_ps(_mm_loadu_ps(dst + 2 * k), _mm_mul_ps(_mm_loadu_ps(src + 2 * k), g)));
+			g = _mm_add_ps(g, inc);
+		}
+#elif defined(DA_SIMD_NEON)
+		// Four frames per vector, deinterleaved into left and right
+		float32x4_t g = { gain, gain + step, gain + 2.0f * step, gain + 3.0f * step };
+		const float32x4_t inc = vdupq_n_f32(4.0f * step);
+		for (; k + 4 <= frames; k += 4) {
+			float32x4x2_t s = vld2q_f32(src + 2 * k);
+			float32x4x2_t d = vld2q_f32(dst + 2 * k);
+			d.val[0] = vmlaq_f32(d.val[0], s.val[0], g);
+			d.val[1] = vmlaq_f32(d.val[1], s.val[1], g);
+			vst2q_f32(dst + 2 * k, d);
+			g = vaddq_f32(g, inc);
+		}
+#endif
+		for (; k < frames; ++k) {
+			const float gk = gain + k * step;
+			dst[2 * k] += gk * src[2 * k];
+			dst[2 * k + 1] += gk * src[2 * k + 1];
+		}
+	}
+
+}
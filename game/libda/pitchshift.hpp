@@ -0,0 +1,125 @@
+#pragma once
+
+/**
+ * @file pitchshift.hpp Low-latency time-domain pitch shifting (delay line with two sweeping taps).
+ */
+
+#include "mix.hpp"
+#include "sample.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace da {
+
+	/**
+	* Real-time pitch shifter for interleaved stereo, for effects such as the whammy bar.
+	* The input is written to a short delay line that is read by two taps. Their delays sweep through one
+	* window at the rate 1 - ratio (which plays the signal at ratio times its speed) and each tap is faded
+	* in and out with a Hann window, half a window apart, so that the tap gains always sum to one.
+	* The cost per frame is fixed (two interpolated reads for both channels, as one SIMD vector), nothing is
+	* looked ahead and the added latency is at most one window. While not shifting the dry input is passed
+	* through (with a short crossfade), so an unbent track is not delayed.
+	**/
+	class PitchShifter {
+	  public:
+		/// window is the sweep period in frames (some 40 ms suits guitars; longer is smoother but more delayed)
+		explicit PitchShifter(std::size_t window):
+		  m_window(std::max<std::size_t>(window, 16)),
+		  m_fadeStep(4.0f / m_window)
+		{
+			std::size_t size = 1;
+			while (size < m_window + 4) size *= 2;
+			m_mask = size - 1;
+			m_ring.assign(2 * size, 0.0f);
+			for (unsigned i = 0; i <= HANN_SIZE; ++i) {
+				const double s = std::sin(pi * i / HANN_SIZE);
+				m_hann[i] = s * s;
+			}
+		}
+		/// Shift frames of src (interleaved stereo) by ratio (1.0 = no shift, 0.5 = octave down) and add gain times the result to dst
+		void mix(sample_t const* src, sample_t* dst, std::size_t frames, double ratio, float gain = 1.0f) {
+			const bool shift = ratio != 1.0;
+			if (!shift && m_wet == 0.0f) {
+				// Dry: only keep the delay line filled, for when shifting begins
+				for (std::size_t i = 0; i < frames; ++i, m_write = (m_write + 1) & m_mask) {
+					m_ring[2 * m_write] = src[2 * i];
+					m_ring[2 * m_write + 1] = src[2 * i + 1];
+				}
+				mix_f32(dst, src, 2 * frames, gain);
+				m_phase = 0.0;
+				return;
+			}
+			const double step = (1.0 - ratio) / m_window;
+			const double size = m_mask + 1;
+			for (std::size_t i = 0; i < frames; ++i, m_write = (m_write + 1) & m_mask) {
+				const sample_t l = src[2 * i], r = src[2 * i + 1];
+				m_ring[2 * m_write] = l;
+				m_ring[2 * m_write + 1] = r;
+				// The taps, half a window apart
+				double phase2 = m_phase + 0.5;
+				if (phase2 >= 1.0) phase2 -= 1.0;
+				const double pos1 = m_write + size - 1.0 - m_phase * m_window;
+				const double pos2 = m_write + size - 1.0 - phase2 * m_window;
+				const std::size_t k1 = pos1, k2 = pos2;
+				const float f1 = pos1 - k1, f2 = pos2 - k2;
+				const float g1 = hann(m_phase), g2 = 1.0f - g1;
+				sample_t const* a1 = &m_ring[2 * (k1 & m_mask)];
+				sample_t const* b1 = &m_ring[2 * ((k1 + 1) & m_mask)];
+				sample_t const* a2 = &m_ring[2 * (k2 & m_mask)];
+				sample_t const* b2 = &m_ring[2 * ((k2 + 1) & m_mask)];
+#if defined(DA_SIMD_SSE2)
+				// Lanes: tap 1 left, tap 1 right, tap 2 left, tap 2 right
+				const __m128 a = _mm_castpd_ps(_mm_loadh_pd(_mm_load_sd(reinterpret_cast<double const*>(a1)), reinterpret_cast<double const*>(a2)));
+				const __m128 b = _mm_castpd_ps(_mm_loadh_pd(_mm_load_sd(reinterpret_cast<double const*>(b1)), reinterpret_cast<double const*>(b2)));
+				const __m128 v = _mm_mul_ps(_mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), _mm_set_ps(f2, f2, f1, f1))), _mm_set_ps(g2, g2, g1, g1));
+				float out[4];
+				_mm_storeu_ps(out, _mm_add_ps(v, _mm_movehl_ps(v, v)));
+				const sample_t wetL = out[0], wetR = out[1];
+#elif defined(DA_SIMD_NEON)
+				const float32x4_t a = vcombine_f32(vld1_f32(a1), vld1_f32(a2));
+				const float32x4_t b = vcombine_f32(vld1_f32(b1), vld1_f32(b2));
+				const float fs[4] = { f1, f1, f2, f2 }, gs[4] = { g1, g1, g2, g2 };
+				const float32x4_t v = vmulq_f32(vmlaq_f32(a, vsubq_f32(b, a), vld1q_f32(fs)), vld1q_f32(gs));
+				const float32x2_t sum = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+				const sample_t wetL = vget_lane_f32(sum, 0), wetR = vget_lane_f32(sum, 1);
+#else
+				const sample_t wetL = g1 * (a1[0] + f1 * (b1[0] - a1[0])) + g2 * (a2[0] + f2 * (b2[0] - a2[0]));
+				const sample_t wetR = g1 * (a1[1] + f1 * (b1[1] - a1[1])) + g2 * (a2[1] + f2 * (b2[1] - a2[1]));
+#endif
+				m_phase += step;
+				if (m_phase >= 1.0) m_phase -= 1.0;
+				else if (m_phase < 0.0) m_phase += 1.0;
+				// Crossfade between dry and shifted when shifting starts or ends
+				m_wet = shift ? std::min(1.0f, m_wet + m_fadeStep) : std::max(0.0f, m_wet - m_fadeStep);
+				dst[2 * i] += gain * (l + m_wet * (wetL - l));
+				dst[2 * i + 1] += gain * (r + m_wet * (wetR - r));
+			}
+		}
+		/// Forget the buffered input (e.g. after seeking)
+		void reset() {
+			std::fill(m_ring.begin(), m_ring.end(), 0.0f);
+			m_phase = 0.0;
+			m_wet = 0.0f;
+		}
+	  private:
+		static constexpr unsigned HANN_SIZE = 256;
+		/// Tabulated sin^2(pi * phase) for phase in [0, 1), linearly interpolated
+		float hann(double phase) const {
+			const double x = phase * HANN_SIZE;
+			const unsigned i = x;
+			return m_hann[i] + float(x - i) * (m_hann[i + 1] - m_hann[i]);
+		}
+		std::size_t m_window;
+		float m_fadeStep;  ///< Wet level change per frame
+		std::size_t m_mask;  ///< Ring size in frames - 1 (a power of two)
+		std::vector<sample_t> m_ring;  ///< Delay line of stereo frames
+		std::size_t m_write = 0;  ///< Frame index of the next write
+		double m_phase = 0.0;  ///< Position of the first tap within the window, [0, 1)
+		float m_wet = 0.0f;
+		float m_hann[HANN_SIZE + 1];
+	};
+
+}
@@ -109,7 +109,7 @@ namespace portaudio {
 			for (auto const& d: devices) { oss << "    #" << d.idx << " " << d.desc() << std::endl; }
 			return oss.str();
 		}
-		DeviceInfo const& find(std::string const& name, bool output, unsigned num) {
+		DeviceInfo const& find(std::string const& name, bool output, unsigned num) const {
 			if (name.empty()) { return findByChannels(output, num); }
 			// Try name search with full match
 			for (auto const& dev: devices) {
@@ -124,7 +124,7 @@ namespace portaudio {
 			}
 			throw std::runtime_error("No such device.");
 		}
-		DeviceInfo const& findByChannels(bool output, unsigned num) {
+		DeviceInfo const& findByChannels(bool output, unsigned num) const {
 			for (auto const& dev: devices) {
 				unsigned reqChannels = output ? dev.out : dev.in;
 				if (reqChannels >= num) { return dev;  }
@@ -216,9 +216,9 @@ namespace portaudio {
 	};
 
 	template <typename Functor> static int functorCallback(void const* input, void* output, unsigned long frameCount,
-                                                               const PaStreamCallbackTimeInfo*, PaStreamCallbackFlags, void* userData) {
+                                                               const PaStreamCallbackTimeInfo*, PaStreamCallbackFlags flags, void* userData) {
 		auto &callback = *reinterpret_cast<Functor*>(userData);
-		return callback(reinterpret_cast<float const*>(input), reinterpret_cast<float*>(output), frameCount);
+		return callback(reinterpret_cast<float const*>(input), reinterpret_cast<float*>(output), frameCount, flags);
 	}
 
 	class Stream {
@@ -0,0 +1,148 @@
+#pragma once
+
+/**
+ * @file resample.hpp Table-driven polyphase Lanczos resampling and FIR decimation.
+ */
+
+#include "sample.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace da {
+
+	/**
+	* Polyphase Lanczos resampler with a kernel of size A (2A taps).
+	* The kernel is tabulated once for PHASES fractional positions and linearly interpolated
+	* between adjacent phases, so no trigonometry is done per sample. The output at position pos
+	* is centered at src[pos + A], i.e. the taps src[floor(pos) + 1] ... src[floor(pos) + 2A] are used.
+	**/
+	template <unsigned A, unsigned PHASES = 256> class LanczosResampler {
+	  public:
+		static constexpr unsigned TAPS = 2 * A;
+		static_assert(TAPS % 4 == 0, "Resampler kernel must be a multiple of four taps (used as SIMD vectors)");
+		static LanczosResampler const& get() { static const LanczosResampler resampler; return resampler; }
+		/// Interpolated value at fractional position pos of src
+		float operator()(float const* src, double pos) const {
+			std::size_t k = pos;
+			double phase = (pos - k) * PHASES;
+			unsigned p = phase;
+			return dot(src + k + 1, &m_table[p * TAPS], float(phase - p));
+		}
+		/**
+		* Resample src into frames of dst (interleaved with channels), adding gain * value to each channel,
+		* starting from position pos and advancing it by step per frame. Returns the position after the last frame.
+		**/
+		double mix(float const* src, double pos, double step, float* dst, std::size_t frames, unsigned channels, float gain) const {
+			for (std::size_t i = 0; i < frames; ++i, pos += step) {
+				const float s = gain * (*this)(src, pos);
+				for (unsigned ch = 0; ch < channels; ++ch) *dst++ += s;
+			}
+			return pos;
+		}
+	  private:
+		LanczosResampler(): m_table((PHASES + 1) * TAPS) {
+			// Row p contains the taps for fractional position p / PHASES, an extra row for interpolating the last phase
+			for (unsigned p = 0; p <= PHASES; ++p) {
+				double x = double(p) / PHASES;
+				for (unsigned t = 0; t < TAPS; ++t) m_table[p * TAPS + t] = lanc<A>(x + A - 1 - t);
+			}
+		}
+		/// Dot product of the taps with the kernel blended between rows h and h + TAPS
+		static float dot(float const* s, float const* h, float frac) {
+			unsigned t = 0;
+			float sum = 0.0f;
+#if defined(DA_SIMD_SSE2)
+			const __m128 f = _mm_set1_ps(frac);
+			__m128 acc = _mm_setzero_ps();
+			for (; t < TAPS; t += 4) {
+				__m128 h0 = _mm_loadu_ps(h + t), h1 = _mm_loadu_ps(h + TAPS + t);
+				__m128 c = _mm_add_ps(h0, _mm_mul_ps(f, _mm_sub_ps(h1, h0)));
+				acc = _mm_add_ps(acc, _mm_mul_ps(c, _mm_loadu_ps(s + t)));
+			}
+			acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+			acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(1, 1, 1, 1)));
+			sum = _mm_cvtss_f32(acc);
+#elif defined(DA_SIMD_NEON)
+			float32x4_t acc = vdupq_n_f32(0.0f);
+			for (; t < TAPS; t += 4) {
+				float32x4_t h0 = vld1q_f32(h + t), h1 = vld1q_f32(h + TAPS + t);
+				float32x4_t c = vmlaq_n_f32(h0, vsubq_f32(h1, h0), frac);
+				acc = vmlaq_f32(acc, c, vld1q_f32(s + t));
+			}
+			float32x2_t half = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+			sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#endif
+			for (; t < TAPS; ++t) sum += (h[t] + frac * (h[TAPS + t] - h[t])) * s[t];
+			return sum;
+		}
+		std::vector<float> m_table;
+	};
+
+	/**
+	* Integer factor decimator: low-pass filters below the Nyquist frequency of the lower rate (a Blackman
+	* windowed sinc of 16 taps per factor) and keeps every factor'th sample. Only the outputs kept are
+	* computed, each as one dot product with the taps (the polyphase form of filtering and then dropping).
+	**/
+	class Decimator {
+	  public:
+		explicit Decimator(unsigned factor): m_factor(std::max(1u, factor)), m_taps(16 * m_factor), m_history(2 * m_taps.size()) {
+			const double cutoff = 0.5 / m_factor;  // Of the input rate
+			const std::size_t n = m_taps.size();
+			double sum = 0.0;
+			for (std::size_t t = 0; t < n; ++t) {
+				const double x = t - 0.5 * (n - 1);
+				const double w = 0.42 + 0.5 * std::cos(2.0 * pi * x / n) + 0.08 * std::cos(4.0 * pi * x / n);
+				const double sinc = x == 0.0 ? 1.0 : std::sin(2.0 * pi * cutoff * x) / (2.0 * pi * cutoff * x);
+				m_taps[t] = w * sinc;
+				sum += m_taps[t];
+			}
+			for (auto& h: m_taps) h /= sum;  // Unity gain at DC
+		}
+		unsigned factor() const { return m_factor; }
+		/// Filter n samples of src, writing every factor'th output to dst. Returns the number written (at most n / factor + 1).
+		std::size_t process(float const* src, std::size_t n, float* dst) {
+			if (m_factor == 1) { std::copy(src, src + n, dst); return n; }
+			const std::size_t taps = m_taps.size();
+			std::size_t out = 0;
+			for (std::size_t i = 0; i < n; ++i) {
+				// Written twice, so that the latest taps samples are always contiguous at m_history[m_pos ...]
+				m_history[m_pos] = m_history[m_pos + taps] = src[i];
+				if (++m_pos == taps) m_pos = 0;
+				if (++m_phase < m_factor) continue;
+				m_phase = 0;
+				dst[out++] = dot(&m_history[m_pos]);
+			}
+			return out;
+		}
+	  private:
+		float dot(float const* s) const {
+			const std::size_t taps = m_taps.size();
+			float const* h = m_taps.data();
+			std::size_t t = 0;
+			float sum = 0.0f;
+#if defined(DA_SIMD_SSE2)
+			__m128 acc = _mm_setzero_ps();
+			for (; t + 4 <= taps; t += 4) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(h + t), _mm_loadu_ps(s + t)));
+			acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+			acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(1, 1, 1, 1)));
+			sum = _mm_cvtss_f32(acc);
+#elif defined(DA_SIMD_NEON)
+			float32x4_t acc = vdupq_n_f32(0.0f);
+			for (; t + 4 <= taps; t += 4) acc = vmlaq_f32(acc, vld1q_f32(h + t), vld1q_f32(s + t));
+			float32x2_t half = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+			sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#endif
+			for (; t < taps; ++t) sum += h[t] * s[t];
+			return sum;
+		}
+		unsigned m_factor;
+		std::vector<float> m_taps;  ///< Symmetric, so the order of the history does not matter
+		std::vector<float> m_history;  ///< The latest input samples, stored twice
+		std::size_t m_pos = 0;  ///< Position of the next write in m_history
+		unsigned m_phase = 0;  ///< Input samples since the latest output
+	};
+
+}
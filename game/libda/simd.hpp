@@ -0,0 +1,39 @@
+#pragma once
+
+/**
+ * @file simd.hpp Compile-time selection of the SIMD instruction set used by LibDA kernels.
+ *
+ * One of DA_SIMD_AVX, DA_SIMD_SSE2, DA_SIMD_NEON or DA_SIMD_SCALAR is defined to 1, except that
+ * AVX implies SSE2: with DA_SIMD_AVX, DA_SIMD_SSE2 is defined too, so that kernels without an AVX
+ * version use their SSE2 one. Test DA_SIMD_AVX before DA_SIMD_SSE2. AVX is only used when the compiler targets it (e.g. -mavx or -march=native), SSE2 is the
+ * baseline on x86-64 and NEON the baseline on AArch64. Everything else uses plain C++.
+ */
+
+#if defined(__AVX__)
+#define DA_SIMD_AVX 1
+#define DA_SIMD_SSE2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DA_SIMD_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DA_SIMD_NEON 1
+#include <arm_neon.h>
+#else
+#define DA_SIMD_SCALAR 1
+#endif
+
+namespace da {
+	/// Name of the instruction set selected at compile time (for logging and benchmarks)
+	constexpr char const* simdName() {
+#if defined(DA_SIMD_AVX)
+		return "AVX";
+#elif defined(DA_SIMD_SSE2)
+		return "SSE2";
+#elif defined(DA_SIMD_NEON)
+		return "NEON";
+#else
+		return "scalar";
+#endif
+	}
+}
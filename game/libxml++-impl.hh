@@ -19,6 +19,10 @@ namespace xmlpp {
 	static inline void set_first_child_text(Element* element, const Glib::ustring& content) {
 		return element->set_child_text(content);
 	}
+
+	static inline bool is_element(TextReader& reader) {
+		return reader.get_node_type() == TextReader::Element;
+	}
 #elif LIBXMLPP_VERSION_3_0
 	typedef Node::const_NodeSet const_NodeSet; // correct libxml++ 3.0 implementation
 
@@ -33,5 +37,9 @@ namespace xmlpp {
 	static inline void set_first_child_text(Element* element, const Glib::ustring& content) {
 		return element->set_first_child_text(content);
 	}
+
+	static inline bool is_element(TextReader& reader) {
+		return reader.get_node_type() == TextReader::NodeType::Element;
+	}
 #endif
 }
@@ -0,0 +1,82 @@
+#include "lockstats.hh"
+
+#include <algorithm>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+namespace lockstats {
+	std::atomic<bool> active{ false };
+
+	namespace {
+		unsigned bucket(Seconds time) {
+			unsigned i = 0;
+			while (i < BUCKET_COUNT - 1 && time.count() > BUCKETS[i]) ++i;
+			return i;
+		}
+		std::uint64_t nanoseconds(Seconds time) { return time.count() > 0.0 ? time.count() * 1e9 : 0; }
+
+		struct Registry {
+			std::mutex mutex;
+			std::deque<Stats> locks;  ///< By the order of creation (a deque, so that they stay in place)
+			struct Dumped { std::uint64_t acquisitions, contended, waitNanoseconds; };
+			std::map<Stats const*, Dumped> dumped;  ///< The counters at the previous dump
+		};
+		Registry& registry() {
+			static Registry r;
+			return r;
+		}
+	}
+
+	void Stats::waited(Seconds time) {
+		++contended;
+		waitNanoseconds += nanoseconds(time);
+		++waits[bucket(time)];
+	}
+
+	void Stats::held(Seconds time) {
+		++acquisitions;
+		holdNanoseconds += nanoseconds(time);
+		++holds[bucket(time)];
+	}
+
+	void enable(bool on) { active.store(on, std::memory_order_relaxed); }
+
+	Stats& stats(char const* name) {
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		for (Stats& s: r.locks) if (std::string(s.name) == name) return s;
+		r.locks.emplace_back(name);
+		return r.locks.back();
+	}
+
+	std::vector<Stats const*> all() {
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		std::vector<Stats const*> ret;
+		for (Stats const& s: r.locks) ret.push_back(&s);
+		return ret;
+	}
+
+	void dump() {
+		Registry& r = registry();
+		std::ostringstream oss;
+		oss << std::fixed << std::setprecision(2) << "profiler-locks/debug:";
+		bool any = false;
+		std::lock_guard<std::mutex> l(r.mutex);
+		for (Stats const& s: r.locks) {
+			const Registry::Dumped now{ s.acquisitions, s.contended, s.waitNanoseconds };
+			Registry::Dumped& prev = r.dumped[&s];
+			if (now.acquisitions == prev.acquisitions) continue;
+			const std::uint64_t count = now.acquisitions - prev.acquisitions;
+			oss << "  " << s.name << " (" << count << "x, " << std::min(100.0, 100.0 * (now.contended - prev.contended) / count)
+			  << " % contended, waited " << 1e-6 * (now.waitNanoseconds - prev.waitNanoseconds) << " ms)";
+			prev = now;
+			any = true;
+		}
+		if (any) std::clog << oss.str() << std::endl;
+	}
+}
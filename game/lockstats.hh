@@ -0,0 +1,75 @@
+#pragma once
+
+#include "chrono.hh"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+* Contention statistics of the key mutexes: how long threads waited for each named lock and how long they held it,
+* as histograms. lockstats::Mutex replaces std::mutex (use std::condition_variable_any with it); mutexes of the
+* same name (e.g. of all videos) add up. While disabled, locking costs one relaxed load more than std::mutex.
+* Enabled with game/lock_stats or while profiling; reported by dump (the main loop in benchmark mode) and at
+* /api/metrics.
+**/
+namespace lockstats {
+	/// Upper bounds of the histogram buckets, in seconds (the last bucket has none)
+	const double BUCKETS[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1 };
+	const unsigned BUCKET_COUNT = sizeof(BUCKETS) / sizeof(*BUCKETS) + 1;
+
+	/// Counters of a named lock (never destroyed)
+	struct Stats {
+		explicit Stats(char const* name): name(name) {}
+		char const* const name;
+		std::atomic<std::uint64_t> acquisitions{ 0 };
+		std::atomic<std::uint64_t> contended{ 0 };  ///< Acquisitions that had to wait
+		std::atomic<std::uint64_t> waitNanoseconds{ 0 }, holdNanoseconds{ 0 };
+		std::atomic<std::uint64_t> waits[BUCKET_COUNT] = {};  ///< Contended acquisitions by wait time
+		std::atomic<std::uint64_t> holds[BUCKET_COUNT] = {};  ///< Acquisitions by hold time
+		void waited(Seconds time);
+		void held(Seconds time);
+	};
+
+	extern std::atomic<bool> active;
+	/// Are the statistics being collected?
+	inline bool enabled() { return active.load(std::memory_order_relaxed); }
+	/// Start or stop collecting
+	void enable(bool on);
+	/// The statistics of the locks of a name (a string literal)
+	Stats& stats(char const* name);
+	/// The statistics of all names
+	std::vector<Stats const*> all();
+	/// Log what happened since the previous dump, one line for all locks
+	void dump();
+
+	/// A std::mutex that records its wait and hold times while enabled
+	class Mutex {
+	  public:
+		explicit Mutex(char const* name): m_stats(stats(name)) {}
+		Mutex(Mutex const&) = delete;
+		Mutex& operator=(Mutex const&) = delete;
+		void lock() {
+			if (!enabled()) { m_mutex.lock(); m_acquired = Time(); return; }
+			if (m_mutex.try_lock()) { m_acquired = Clock::now(); return; }
+			const Time begin = Clock::now();
+			m_mutex.lock();
+			m_acquired = Clock::now();
+			m_stats.waited(m_acquired - begin);
+		}
+		bool try_lock() {
+			if (!m_mutex.try_lock()) return false;
+			m_acquired = enabled() ? Clock::now() : Time();
+			return true;
+		}
+		void unlock() {
+			const Time acquired = m_acquired;  // Only the owner writes it
+			m_mutex.unlock();
+			if (acquired != Time()) m_stats.held(Clock::now() - acquired);
+		}
+	  private:
+		std::mutex m_mutex;
+		Stats& m_stats;
+		Time m_acquired;  ///< When the owner took it, or zero if not recorded
+	};
+}
@@ -1,13 +1,21 @@
 #include "log.hh"
 
 #include "fs.hh"
+#include "lockstats.hh"
+#include "profiler.hh"
 #include <boost/filesystem.hpp>
 #include <boost/iostreams/device/file_descriptor.hpp>
 #include <boost/iostreams/stream.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 /** \file
  * \brief The std::clog logger.
@@ -35,53 +43,20 @@
  * substring search) to be monitored all the way down to debug level, in which case only errors from any other
  * subsystems will be printed.
  *
+ * Messages that are frequent or costly to format should rather use the LOG macro of log.hh, which skips the
+ * formatting altogether when the message would be filtered out:
+ * \code
+ * LOG("foo", debug) << "Here's a debug message from subsystem foo" << std::endl;
+ * \endcode
+ *
  **/
 
 /** \internal
  * Guard to ensure we're atomically printing to cerr.
  * \attention This only guards from multiple clog interleaving, not other console I/O.
  */
-std::mutex log_lock;
+lockstats::Mutex log_lock{ "log" };
 
-// Capture stderr spam from other libraries and log it properly
-// Note: std::cerr retains its normal functionality but other means of writing stderr get redirected to std::clog
-#if defined(__unix__) || defined(__APPLE__)
-#include <unistd.h>
-#include <future>
-struct StderrGrabber {
-	boost::iostreams::stream<boost::iostreams::file_descriptor_sink> stream;
-	std::streambuf* backup;
-	std::future<void> logger;
-	StderrGrabber(): stream(dup(STDERR_FILENO), boost::iostreams::close_handle), backup(std::cerr.rdbuf()) {
-		std::cerr.rdbuf(stream.rdbuf());  // Make std::cerr write to our stream (which connects to normal stderr)
-		int fd[2];
-		pipe(fd);  // Create pipe fd[1]->fd[0]
-		dup2(fd[1], STDERR_FILENO);  // Close stderr and replace it with a copy of pipe begin
-		close(fd[1]);  // Close the original pipe begin
-		std::clog << "stderr/info: Standard error output redirected here\n" << std::flush;
-		logger = std::async(std::launch::async, [fdpipe = fd[0]] {
-			std::string line;
-			unsigned count = 0;
-			for (char ch; read(fdpipe, &ch, 1) == 1;) {
-				line += ch;
-				if (ch != '\n') continue;
-				std::clog << "stderr/info: " + line << std::flush;
-				line.clear(); ++count;
-			}
-			close(fdpipe);  // Close this end of pipe
-			if (count > 0) std::clog << "stderr/notice: " << count << " messages logged to stderr/info\n" << std::flush;
-		});
-	}
-	~StderrGrabber() {
-		dup2(stream->handle(), STDERR_FILENO);  // Restore stderr (closes the pipe, terminating the thread)
-		std::cerr.rdbuf(backup);  // Restore original rdbuf (that writes to normal stderr)
-	}
-};
-#else
-struct StderrGrabber {};  // Not supported on Windows
-#endif
-
-std::unique_ptr<StderrGrabber> grabber;
 
 /** \internal The implementation of the stream filter that handles the message filtering. **/
 class VerboseMessageSink : public boost::iostreams::sink {
@@ -102,51 +77,241 @@ std::string target;
 int minLevel;
 
 void writeLog(std::string const& msg) {
-	std::lock_guard<std::mutex> l(log_lock);
+	std::lock_guard<lockstats::Mutex> l(log_lock);
 	std::cerr << msg << std::flush;
 	file << msg << std::flush;
 }
 
-int numeric(std::string const& level) {
-	if (level == "debug") return 0;
-	if (level == "info") return 1;
-	if (level == "notice") return 2;
-	if (level == "warning") return 3;
-	if (level == "error") return 4;
+namespace {
+	/** \internal
+	 * Lock-free queue of messages from any number of threads to the writer thread (Vyukov's intrusive MPSC queue).
+	 * Messages of each thread stay in order.
+	 */
+	class MessageQueue {
+	  public:
+		struct Node {
+			std::atomic<Node*> next{ nullptr };
+			std::string msg;
+			std::atomic<bool>* written = nullptr;  ///< Set once the message is on disk (for errors)
+		};
+		MessageQueue(): m_head(&m_stub), m_tail(&m_stub) {}
+		/// Any thread
+		void push(Node* node) {
+			node->next.store(nullptr, std::memory_order_relaxed);
+			Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+		}
+		/// The writer only; returns nullptr if empty (or if the next push is still in progress)
+		Node* pop() {
+			Node* tail = m_tail;
+			Node* next = tail->next.load(std::memory_order_acquire);
+			if (tail == &m_stub) {
+				if (!next) return nullptr;
+				m_tail = tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (next) { m_tail = next; return tail; }
+			if (tail != m_head.load(std::memory_order_acquire)) return nullptr;
+			push(&m_stub);  // tail is the last node; put the stub behind it so that it can be taken
+			next = tail->next.load(std::memory_order_acquire);
+			if (next) { m_tail = next; return tail; }
+			return nullptr;
+		}
+	  private:
+		std::atomic<Node*> m_head;
+		Node* m_tail;
+		Node m_stub;
+	};
+
+	/** \internal
+	 * Writes the messages in a background thread, so that logging threads never wait for I/O. Whatever has
+	 * queued up is written with one write and one flush. Errors are waited for, so that they are on disk
+	 * even if the program crashes right after.
+	 */
+	class AsyncWriter {
+	  public:
+		void start() { m_thread = std::thread(&AsyncWriter::run, this); m_running = true; }
+		/// Write everything still queued and stop the thread (messages after this are written synchronously)
+		void stop() {
+			if (!m_running) return;
+			m_running = false;
+			{
+				std::lock_guard<std::mutex> l(m_mutex);
+				m_quit = true;
+			}
+			m_wake.notify_one();
+			m_thread.join();
+		}
+		void post(std::string&& msg, bool wait) {
+			if (!m_running) { writeLog(msg); return; }
+			auto node = new MessageQueue::Node();
+			node->msg = std::move(msg);
+			std::atomic<bool> written{ false };
+			if (wait) node->written = &written;
+			m_queue.push(node);
+			++m_posted;
+			if (m_sleeping) {
+				std::lock_guard<std::mutex> l(m_mutex);
+				m_wake.notify_one();
+			}
+			if (!wait) return;
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_done.wait(l, [&written] { return written.load(); });
+		}
+	  private:
+		void run() {
+			std::string batch;
+			std::vector<std::atomic<bool>*> waiting;
+			while (true) {
+				unsigned count = 0;
+				while (auto node = m_queue.pop()) {
+					batch += node->msg;
+					if (node->written) waiting.push_back(node->written);
+					delete node;
+					++count;
+				}
+				if (count) {
+					writeLog(batch);
+					batch.clear();
+					m_written += count;
+					if (!waiting.empty()) {
+						std::lock_guard<std::mutex> l(m_mutex);
+						for (auto w: waiting) *w = true;
+						waiting.clear();
+						m_done.notify_all();
+					}
+					continue;
+				}
+				std::unique_lock<std::mutex> l(m_mutex);
+				if (m_quit && m_posted == m_written) break;
+				m_sleeping = true;
+				m_wake.wait(l, [this] { return m_quit || m_posted != m_written; });
+				m_sleeping = false;
+			}
+		}
+		MessageQueue m_queue;
+		std::atomic<unsigned long> m_posted{ 0 };
+		std::atomic<unsigned long> m_written{ 0 };
+		std::atomic<bool> m_sleeping{ false };
+		std::atomic<bool> m_running{ false };
+		bool m_quit = false;  ///< Guarded by m_mutex
+		std::mutex m_mutex;
+		std::condition_variable m_wake;  ///< Wakes the writer
+		std::condition_variable m_done;  ///< Wakes those waiting for their errors to be written
+		std::thread m_thread;
+	};
+
+	AsyncWriter writer;
+}
+
+int numeric(char const* level, std::size_t size) {
+	auto is = [level, size](char const* name) { return size == std::strlen(name) && std::equal(level, level + size, name); };
+	if (is("debug")) return 0;
+	if (is("info")) return 1;
+	if (is("notice")) return 2;
+	if (is("warning")) return 3;
+	if (is("error")) return 4;
 	return -1;
 }
 
+int numeric(std::string const& level) { return numeric(level.data(), level.size()); }
+
+/// Is a message of the given level and subsystem (from begin to end) to be logged?
+bool shown(int level, char const* begin, char const* end) {
+	return level >= minLevel || (!target.empty() && std::search(begin, end, target.begin(), target.end()) != end);
+}
+
+bool logging::enabled(char const* subsystem, Level level) {
+	if (int(level) >= minLevel) return true;
+	return !target.empty() && std::strstr(subsystem, target.c_str());
+}
+
 std::streamsize VerboseMessageSink::write(const char* s, std::streamsize n) {
-	std::string line(s, n);  // Note: s is *not* a c-string, thus we must stop after n chars.
+	// Note: s is *not* a c-string, thus we must stop after n chars. Nothing is copied unless the message is shown.
+	char const* end = s + n;
 	// Parse prefix as subsystem/level:...
-	size_t slash = line.find('/');
-	size_t colon = line.find(": ", slash);
-	if (slash == std::string::npos || colon == std::string::npos) {
-		std::string msg = "logger/error: Invalid log prefix on line [[[\n" + line + "]]]\n";
+	char const* slash = std::find(s, end, '/');
+	char const* colon = std::search(slash, end, ": ", ": " + 2);
+	if (slash == end || colon == end) {
+		std::string msg = "logger/error: Invalid log prefix on line [[[\n" + std::string(s, n) + "]]]\n";
 		write(msg.data(), msg.size());
 		return n;
 	}
-	std::string subsystem(line, 0, slash);
-	std::string level(line, slash + 1, colon - slash - 1);
-	int lev = numeric(level);
+	int lev = numeric(slash + 1, colon - slash - 1);
 	if (lev == -1) {
-		std::string msg = "logger/error: Invalid level '" + level + "' line [[[\n" + line + "]]]\n";
+		std::string msg = "logger/error: Invalid level '" + std::string(slash + 1, colon) + "' line [[[\n" + std::string(s, n) + "]]]\n";
 		write(msg.data(), msg.size());
 		return n;
 	}
-	if (lev >= minLevel || (!target.empty() && subsystem.find(target) != std::string::npos)) {
-		writeLog(line);
-	}
+	if (shown(lev, s, slash)) writer.post(std::string(s, n), lev >= numeric("error"));
 	return n;
 }
 
+// Capture stderr spam from other libraries and log it properly
+// Note: std::cerr retains its normal functionality but other means of writing stderr get redirected to std::clog
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <future>
+#include <unistd.h>
+struct StderrGrabber {
+	boost::iostreams::stream<boost::iostreams::file_descriptor_sink> stream;
+	std::streambuf* backup;
+	std::future<void> logger;
+	StderrGrabber(): stream(dup(STDERR_FILENO), boost::iostreams::close_handle), backup(std::cerr.rdbuf()) {
+		std::cerr.rdbuf(stream.rdbuf());  // Make std::cerr write to our stream (which connects to normal stderr)
+		int fd[2];
+		pipe(fd);  // Create pipe fd[1]->fd[0]
+		dup2(fd[1], STDERR_FILENO);  // Close stderr and replace it with a copy of pipe begin
+		close(fd[1]);  // Close the original pipe begin
+		std::clog << "stderr/info: Standard error output redirected here\n" << std::flush;
+		logger = std::async(std::launch::async, [fdpipe = fd[0]] {
+			trace::threadName("stderr grabber");
+			static char const subsystem[] = "stderr";
+			const bool show = shown(numeric("info"), subsystem, subsystem + sizeof(subsystem) - 1);
+			auto post = [show](char const* begin, char const* end) {
+				if (!show) return;
+				std::string msg = "stderr/info: ";
+				msg.append(begin, end);
+				if (msg.back() != '\n') msg += '\n';
+				writer.post(std::move(msg), false);
+			};
+			char buf[4096];
+			std::size_t used = 0;  // Bytes of an incomplete line at the beginning of buf
+			unsigned count = 0;
+			while (true) {
+				ssize_t ret = read(fdpipe, buf + used, sizeof(buf) - used);
+				if (ret < 0 && errno == EINTR) continue;
+				if (ret <= 0) break;
+				char* begin = buf;
+				char* end = buf + used + ret;
+				for (char* nl; (nl = std::find(begin, end, '\n')) != end; begin = nl + 1, ++count) post(begin, nl + 1);
+				used = end - begin;
+				if (used == sizeof(buf)) { post(buf, end); used = 0; ++count; }  // Too long, pass it on in pieces
+				else std::memmove(buf, begin, used);
+			}
+			if (used) { post(buf, buf + used); ++count; }
+			close(fdpipe);  // Close this end of pipe
+			if (count > 0) std::clog << "stderr/notice: " << count << " messages logged to stderr/info\n" << std::flush;
+		});
+	}
+	~StderrGrabber() {
+		dup2(stream->handle(), STDERR_FILENO);  // Restore stderr (closes the pipe, terminating the thread)
+		std::cerr.rdbuf(backup);  // Restore original rdbuf (that writes to normal stderr)
+	}
+};
+#else
+struct StderrGrabber {};  // Not supported on Windows
+#endif
+
+std::unique_ptr<StderrGrabber> grabber;
+
 Logger::Logger(std::string const& level) {
 	if (default_ClogBuf) throw std::logic_error("Multiple loggers constructed. There can only be one.");
 	if (level.find_first_of(":/_* ") != std::string::npos) throw std::runtime_error("Invalid logging level specified. Specify either a subsystem name (e.g. logger) or a level (debug, info, notice, warning, error).");
 	pathBootstrap();  // So that log filename is known...
 	std::string msg = "logger/notice: Logging ";
 	{
-		std::lock_guard<std::mutex> l(log_lock);
+		std::lock_guard<lockstats::Mutex> l(log_lock);
 		if (level.empty()) {
 			minLevel = 2;  // Display all notices, warnings and errors
 			msg += "all notices, warnings and errors.";
@@ -169,6 +334,7 @@ Logger::Logger(std::string const& level) {
 			file.open(name);
 			msg += " Log file: " + name.string();
 		}
+		writer.start();
 		sb.open(vsm);
 		default_ClogBuf = std::clog.rdbuf();
 		std::clog.rdbuf(&sb);
@@ -183,7 +349,8 @@ Logger::~Logger() { teardown(); }
 void Logger::teardown() {
 	grabber.reset();
 	if (default_ClogBuf) std::clog << "logger/info: Exiting normally." << std::endl;
-	std::lock_guard<std::mutex> l(log_lock);
+	writer.stop();
+	std::lock_guard<lockstats::Mutex> l(log_lock);
 	if (!default_ClogBuf) return;
 	std::clog.rdbuf(default_ClogBuf);
 	sb.close();
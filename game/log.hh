@@ -1,5 +1,6 @@
 #pragma once
 
+#include <iostream>
 #include <string>
 
 class Logger {
@@ -9,3 +10,20 @@ public:
 	static void teardown();
 };
 
+namespace logging {
+	/// Message levels, in ascending order of priority (see log.cc)
+	enum class Level { debug, info, notice, warning, error };
+	/// Would a message of level from subsystem be logged? Cheap enough to ask before formatting every message.
+	bool enabled(char const* subsystem, Level level);
+}
+
+/**
+* Log a message with the usual prefix, formatting it only if it is going to be shown:
+* \code
+* LOG("image", debug) << "Loading SVG: " << filename << std::endl;
+* \endcode
+* The same rules as with writing std::clog directly apply (flush when and only when the message is complete).
+* Expands to a single statement, so it is safe as the body of an unbraced if that has an else of its own.
+**/
+#define LOG(subsystem, level) \
+	switch (0) default: if (!::logging::enabled(subsystem, ::logging::Level::level)) {} else std::clog << subsystem "/" #level ": "
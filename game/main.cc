@@ -1,17 +1,27 @@
 #include "backgrounds.hh"
+#include "capture.hh"
 #include "chrono.hh"
 #include "config.hh"
 #include "controllers.hh"
+#include "covercache.hh"
 #include "database.hh"
 #include "engine.hh"
+#include "framepacer.hh"
 #include "fs.hh"
 #include "glutil.hh"
 #include "i18n.hh"
+#include "lockstats.hh"
 #include "log.hh"
+#include "metrics.hh"
+#include "micrecord.hh"
+#include "microbench.hh"
 #include "platform.hh"
 #include "profiler.hh"
+#include "renderbench.hh"
 #include "screen.hh"
+#include "songbench.hh"
 #include "songs.hh"
+#include "themebundle.hh"
 #include "video_driver.hh"
 #include "webcam.hh"
 #include "webserver.hh"
@@ -29,6 +39,8 @@
 #include <boost/program_options.hpp>
 #include <cstdlib>
 #include <csignal>
+#include <future>
+#include <limits>
 #include <string>
 #include <thread>
 #include <vector>
@@ -46,6 +58,7 @@ namespace { struct Nothing { char const* what() const { return nullptr; } }; }
 std::atomic<bool> g_quit{ false };
 
 bool g_take_screenshot = false;
+bool g_toggle_capture = false;
 
 // Signal handling for Ctrl-C
 
@@ -66,7 +79,9 @@ static void signalSetup() {
 /// can be thrown as an exception to quit the game
 struct QuitNow {};
 
-static void checkEvents(Game& gm, Time eventTime) {
+/// Handle input; returns whether there was any
+static bool checkEvents(Game& gm, Time eventTime) {
+	bool any = false;
 	if (g_quit) {
 		std::cerr << "Terminating, please wait... (or kill the process)" << std::endl;
 		throw QuitNow();
@@ -74,8 +89,10 @@ static void checkEvents(Game& gm, Time eventTime) {
 	Window& window = gm.window();
 	SDL_Event event;
 	while (SDL_PollEvent(&event) == 1) {
-		// Let the navigation system grab any and all SDL events
-		gm.controllers.pushEvent(event, eventTime);
+		any = true;
+		// Let the navigation system grab any and all SDL events (at the time SDL got them, if it was during this frame)
+		const Uint32 age = SDL_GetTicks() - event.common.timestamp;
+		gm.controllers.pushEvent(event, age < 100 ? eventTime - std::chrono::milliseconds(age) : eventTime);
 		auto type = event.type;
 		if (type == SDL_WINDOWEVENT) window.event(event.window.event, event.window.data1, event.window.data2);
 		if (type == SDL_QUIT) gm.finished();
@@ -89,7 +106,12 @@ static void checkEvents(Game& gm, Time eventTime) {
 				continue; // Already handled here...
 			}
 			if (key == SDL_SCANCODE_PRINTSCREEN || (key == SDL_SCANCODE_F12 && (mod & Platform::shortcutModifier()))) {
-				g_take_screenshot = true;
+				if (mod & KMOD_SHIFT) g_toggle_capture = true;  // Start or stop recording video
+				else g_take_screenshot = true;
+				continue; // Already handled here...
+			}
+			if (key == SDL_SCANCODE_F10) {
+				config["graphic/perf_overlay"].b() = !config["graphic/perf_overlay"].b();
 				continue; // Already handled here...
 			}
 			if (key == SDL_SCANCODE_F4 && mod & KMOD_ALT) {
@@ -101,6 +123,7 @@ static void checkEvents(Game& gm, Time eventTime) {
 		gm.getCurrentScreen()->manageEvent(event);
 	}
 	for (input::NavEvent event; gm.controllers.getNav(event); ) {
+		any = true;
 		input::NavButton nav = event.button;
 		// Volume control
 		if (nav == input::NAV_VOLUME_UP || nav == input::NAV_VOLUME_DOWN) {
@@ -122,25 +145,36 @@ static void checkEvents(Game& gm, Time eventTime) {
 
 	// Need to toggle full screen mode or adjust resolution?
 	window.resize();
+	return any;
 }
 
 void mainLoop(std::string const& songlist) {
 	Platform platform;
+	TranslationEngine localization(PACKAGE);  // Sets the global locale, so before any other threads start
+	// Initialization that does not depend on anything else runs concurrently with creating the window (which must
+	// be done in this thread). An exception of a task is thrown by get().
 	std::clog << "core/notice: Starting the audio subsystem (errors printed on console may be ignored)." << std::endl;
-	Audio audio;
+	auto audioTask = std::async(std::launch::async, [] { return std::make_unique<Audio>(); });
+	auto databaseTask = std::async(std::launch::async, [] { return std::make_unique<Database>(getConfigDir() / "database.xml"); });
+	auto fontTask = std::async(std::launch::async, buildFonts);
 	std::clog << "core/info: Loading assets." << std::endl;
-	TranslationEngine localization(PACKAGE);
 	std::unique_ptr<Window> window;
+	ThemeBundle themeBundle;  // Before anything that looks up theme files
 	TextureLoader m_loader;
+	CoverCache covers;
 	Backgrounds backgrounds;
-	Database database(getConfigDir() / "database.xml");
-	Songs songs(database, songlist);
-	loadFonts();
 	try {
 		window = std::make_unique<Window>();
 		} catch (RUNTIME_ERROR& e) {
 			std::cerr << "ERROR: " << e.what() << std::endl;
 		}
+	const std::unique_ptr<Database> databasePtr = databaseTask.get();
+	Database& database = *databasePtr;
+	Songs songs(database, songlist);  // Loads the song cache in its own thread
+	fontTask.get();
+	useFonts();
+	const std::unique_ptr<Audio> audioPtr = audioTask.get();
+	Audio& audio = *audioPtr;
 	Game gm(*window, audio);
 	WebServer server(songs);
 	try {
@@ -161,14 +195,16 @@ void mainLoop(std::string const& songlist) {
 		audio.loadSample("notice.ogg",findFile("notice.ogg"));
 		// Load screens
 		gm.loading(_("Creating screens..."), 0.7);
+		// Only the intro is created now, the song browser and the singing screen between the first frames of the
+		// menu and the rest when they are first opened
 		gm.addScreen(std::make_unique<ScreenIntro>("Intro", audio));
-		gm.addScreen(std::make_unique<ScreenSongs>("Songs", audio, songs, database));
-		gm.addScreen(std::make_unique<ScreenSing>("Sing", audio, database, backgrounds));
-		gm.addScreen(std::make_unique<ScreenPractice>("Practice", audio));
-		gm.addScreen(std::make_unique<ScreenAudioDevices>("AudioDevices", audio));
-		gm.addScreen(std::make_unique<ScreenPaths>("Paths", audio, songs));
-		gm.addScreen(std::make_unique<ScreenPlayers>("Players", audio, database));
-		gm.addScreen(std::make_unique<ScreenPlaylist>("Playlist", audio, songs, backgrounds));
+		gm.addScreen("Songs", [&] { return std::make_unique<ScreenSongs>("Songs", audio, songs, database, covers); }, true);
+		gm.addScreen("Sing", [&] { return std::make_unique<ScreenSing>("Sing", audio, songs, database, backgrounds); }, true);
+		gm.addScreen("Practice", [&] { return std::make_unique<ScreenPractice>("Practice", audio); });
+		gm.addScreen("AudioDevices", [&] { return std::make_unique<ScreenAudioDevices>("AudioDevices", audio); });
+		gm.addScreen("Paths", [&] { return std::make_unique<ScreenPaths>("Paths", audio, songs); });
+		gm.addScreen("Players", [&] { return std::make_unique<ScreenPlayers>("Players", audio, database, covers); });
+		gm.addScreen("Playlist", [&] { return std::make_unique<ScreenPlaylist>("Playlist", audio, songs, backgrounds, covers); });
 		gm.activateScreen("Intro");
 		gm.loading(_("Entering main menu"), 0.8);
 		gm.updateScreen();  // exit/enter, any exception is fatal error
@@ -176,10 +212,25 @@ void mainLoop(std::string const& songlist) {
 		// Main loop
 		auto time = Clock::now();
 		unsigned frames = 0;
+		FramePacer pacer;
+		Time lastSwap = Clock::now();
 		std::clog << "core/info: Assets loaded, entering main loop." << std::endl;
+		Profiler prof("mainloop");
+		trace::threadName("main");
+		ConfigItem& fps = config["graphic/fps"];
+		ConfigItem& lockStats = config["game/lock_stats"];
+		ConfigItem& perfOverlay = config["graphic/perf_overlay"];
+		std::shared_ptr<Capture> capture;  // Video being recorded (the window keeps it until after the audio is gone)
+		// Frames that looked like the one before (no input, no AnimValue moving, no new textures, same screen).
+		// After a couple of those (so that both buffers have it) drawing stops or slows down to Screen::idleFps.
+		unsigned quietFrames = 0;
+		Time lastDraw = Clock::now();
+		Screen* lastScreen = nullptr;
+		std::size_t lastUploads = textureUploads();
 		while (!gm.isFinished()) {
-			Profiler prof("mainloop");
-			bool benchmarking = config["graphic/fps"].b();
+			bool benchmarking = fps.b();
+			bool profiling = benchmarking || trace::enabled();
+			lockstats::enable(profiling || lockStats.b());
 			if (songs.doneLoading == true && songs.displayedAlert == false) {
 				gm.dialog(_("Done Loading!\n Loaded ") + std::to_string(songs.loadedSongs()) + " Songs.");
 				songs.displayedAlert = true;
@@ -194,39 +245,86 @@ void mainLoop(std::string const& songlist) {
 				}
 				g_take_screenshot = false;
 			}
+			if (g_toggle_capture) {
+				if (capture) {
+					audio.setCapture(nullptr);
+					window->stopCapture();
+					gm.flashMessage(_("Recording saved: ") + capture->filename().filename().string());
+					capture.reset();  // The file is finished when the frames still being read back are done
+				} else try {
+					capture = window->startCapture(Audio::getSR());
+					audio.setCapture(capture.get());
+					gm.flashMessage(_("Recording started"));
+				} catch (std::exception& e) {
+					std::clog << "video/error: " << e.what() << std::endl;
+					gm.flashMessage(_("Recording failed!"));
+				}
+				g_toggle_capture = false;
+			}
 			gm.updateScreen();  // exit/enter, any exception is fatal error
-			if (benchmarking) prof("misc");
+			if (profiling) prof("misc");
 			try {
-				window->blank();
-				// Draw
-				window->render([&gm]{ gm.drawScreen(); });
-				if (benchmarking) { glFinish(); prof("draw"); }
-				// Display (and wait until next frame)
-				window->swap();
-				if (benchmarking) { glFinish(); prof("swap"); }
-				updateTextures();
+				if (gm.getCurrentScreen() != lastScreen) { lastScreen = gm.getCurrentScreen(); quietFrames = 0; }
+				const double idleFps = benchmarking || capture ? std::numeric_limits<double>::infinity() : gm.idleFps();
+				const bool due = !(idleFps < std::numeric_limits<double>::infinity())
+				  || (idleFps > 0.0 && Seconds(Clock::now() - lastDraw).count() >= 1.0 / idleFps);
+				const bool draw = quietFrames < 2 || due;
+				if (draw) {
+					window->updateVsync(!benchmarking);
+					if (auto gpu = glutil::GPUTimer::current()) gpu->enable(benchmarking || perfOverlay.b());
+					pacer.begin();
+					window->blank();
+					// Draw
+					AnimValue::resetActivity();
+					AnimValue::beginFrame();
+					window->render([&gm]{ gm.drawScreen(); });
+					if (profiling) prof("draw");
+					pacer.rendered();
+					// Display (and wait until next frame)
+					window->swap();
+					pacer.swapped(window->refreshInterval(), window->vsync());
+					{
+						const Time now = Clock::now();
+						metrics::frame(now - lastSwap);
+						if (perfOverlay.b()) gm.perfOverlay().frame(now - lastSwap, pacer.renderTime(), window->refreshInterval());
+						lastSwap = now;
+						lastDraw = now;
+					}
+					if (profiling) prof("swap");
+					if (AnimValue::activity()) quietFrames = 0; else ++quietFrames;
+				}
+				// Background work in what is left of the frame (half of it for uploads, the rest stays for prepareScreen)
+				updateTextures(pacer.idleBudget() / 2);
 				gm.prepareScreen();
-				if (benchmarking) { glFinish(); prof("textures"); }
+				if (!benchmarking) gm.prewarmScreen();  // Screens added for prewarming, one per frame
+				if (profiling) prof("textures");
 				if (benchmarking) {
 					++frames;
 					if (Clock::now() - time > 1s) {
 						std::ostringstream oss;
 						oss << frames << " FPS";
 						gm.flashMessage(oss.str());
+						prof.dump();
+						lockstats::dump();
+						if (auto gpu = glutil::GPUTimer::current()) gpu->dump();
 						time += 1s;
 						frames = 0;
 					}
-				} else {
-					std::this_thread::sleep_until(time + 10ms); // Max 100 FPS
+				} else if (draw) {
+					pacer.wait();  // Until the next frame is due
 					time = Clock::now();
 					frames = 0;
+				} else {
+					// Nothing to draw: sleep until there is input (polling now and then for other input devices)
+					SDL_WaitEventTimeout(nullptr, 20);
 				}
-				if (benchmarking) prof("fpsctrl");
+				if (profiling) prof("fpsctrl");
 				// Process events for the next frame
 				auto eventTime = Clock::now();
 				gm.controllers.process(eventTime);
-				checkEvents(gm, eventTime);
-				if (benchmarking) prof("events");
+				if (checkEvents(gm, eventTime)) quietFrames = 0;
+				if (textureUploads() != lastUploads) { lastUploads = textureUploads(); quietFrames = 0; }
+				if (profiling) prof("events");
 		} catch (RUNTIME_ERROR& e) {
 			std::cerr << "ERROR: " << e.what() << std::endl;
 			gm.flashMessage(std::string("ERROR: ") + e.what());
@@ -317,11 +415,22 @@ int main(int argc, char** argv) try {
 	po::options_description opt1("Generic options");
 	std::string songlist;
 	std::string loglevel;
+	std::string tracefile;
+	std::string benchdir;
+	std::string microfilter;
+	std::string micdir;
+	std::string replayfile;
 	opt1.add_options()
 	  ("help,h", "you are viewing it")
 	  ("log,l", po::value<std::string>(&loglevel), "subsystem name or minimum level to log")
 	  ("version,v", "display version number")
-	  ("songlist", po::value<std::string>(&songlist), "save a list of songs in the specified folder");
+	  ("songlist", po::value<std::string>(&songlist), "save a list of songs in the specified folder")
+	  ("trace", po::value<std::string>(&tracefile), "record a timeline of all threads into the specified file (Chrome trace JSON)")
+	  ("bench-songs", po::value<std::string>(&benchdir), "benchmark loading the songs in the specified folder and exit")
+	  ("bench-render", "benchmark rendering scripted scenes offscreen and exit")
+	  ("bench-micro", po::value<std::string>(&microfilter)->implicit_value(""), "run the microbenchmarks (those whose names contain the optional filter) and exit")
+	  ("record-mics", po::value<std::string>(&micdir), "record the microphones of singing into the specified folder (for --replay-mics)")
+	  ("replay-mics", po::value<std::string>(&replayfile), "replay recorded microphones through scoring as fast as possible, print the scores and exit");
 	po::options_description opt2("Configuration options");
 	opt2.add_options()
 	  ("audio", po::value<std::vector<std::string> >(&devices)->composing(), "specify an audio device to use")
@@ -375,12 +484,31 @@ int main(int argc, char** argv) try {
 			std::cout << "  --audio \"dev=1 out=2\"   # Pick device id 1 and assign stereo playback" << std::endl;
 			std::cout << "  --audio 'dev=\"HDA Intel\" mics=blue,red'   # HDA Intel with two mics" << std::endl;
 			std::cout << "  --audio 'dev=pulse out=2 mics=blue'       # PulseAudio with input and output" << std::endl;
+			std::cout << "  --audio 'mics=blue,red fft=2048 step=512' # Less CPU per mic (analysis of 2048 points every 512 samples)" << std::endl;
+			std::cout << "  --audio 'mics=blue fft=1024 step=128'     # Lower scoring latency (the default is fft=1024 step=200)" << std::endl;
 			return EXIT_SUCCESS;
 		}
 		// Override XML config for options that were specified from commandline or performous.conf
 		confOverride(songdirs, "paths/songs");
 		confOverride(devices, "audio/devices");
 		getPaths(); // Initialize paths before other threads start
+		if (!benchdir.empty()) {
+			std::clog << "core/notice: Starting song loading benchmark." << std::endl;
+			return benchSongs(benchdir);
+		}
+		if (vm.count("bench-micro")) {
+			std::clog << "core/notice: Starting microbenchmarks." << std::endl;
+			return benchMicro(microfilter);
+		}
+		if (vm.count("bench-render")) {
+			std::clog << "core/notice: Starting rendering benchmark." << std::endl;
+			return benchRender();
+		}
+		if (!replayfile.empty()) {
+			std::clog << "core/notice: Starting microphone replay." << std::endl;
+			return replayMics(replayfile);
+		}
+		MicRecorder::folder() = micdir;
 		if (vm.count("jstest")) { // Joystick test program
 			std::clog << "core/notice: Starting jstest input test utility." << std::endl;
 			std::cout << std::endl << "Joystick utility - Touch your joystick to see buttons here" << std::endl
@@ -389,6 +517,7 @@ int main(int argc, char** argv) try {
 			return EXIT_SUCCESS;
 		}
 		// Run the game init and main loop
+		trace::Session session(tracefile);
 		mainLoop(songlist);
 
 		return EXIT_SUCCESS; // Do not remove. SDL_Main (which this function is called on some platforms) needs return statement.
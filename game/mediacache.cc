@@ -0,0 +1,142 @@
+#include "mediacache.hh"
+
+#include "configuration.hh"
+#include "log.hh"
+#include "song.hh"
+#include "threads.hh"
+#include "util.hh"
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+	const std::size_t MAX_QUEUED = 64;  ///< Copy requests kept (older ones are dropped)
+}
+
+MediaCache& MediaCache::instance() {
+	static MediaCache& cache = *new MediaCache();  // Leaked, decoder threads may use it until exit
+	return cache;
+}
+
+MediaCache::MediaCache():
+  m_limit(std::uintmax_t(config["songs/media_cache_mb"].i()) << 20),
+  m_dir(getCacheDir() / "media"),
+  m_roots(getPathsConfig("songs/media_cache_paths")),
+  m_enabled(m_limit && !m_roots.empty())
+{
+	if (m_enabled) std::thread(&MediaCache::run, this).detach();
+}
+
+bool MediaCache::cached(fs::path const& file) const {
+	const auto depth = std::distance(file.begin(), file.end());
+	for (auto const& root: m_roots) {
+		if (std::distance(root.begin(), root.end()) <= depth && std::equal(root.begin(), root.end(), file.begin())) return true;
+	}
+	return false;
+}
+
+fs::path MediaCache::filename(fs::path const& file) const {
+	boost::system::error_code ec;
+	std::ostringstream key;
+	key << file.string() << ' ' << fs::file_size(file, ec) << ' ' << fs::last_write_time(file, ec);
+	std::ostringstream name;
+	name << std::hex << std::hash<std::string>()(key.str()) << file.extension().string();  // FFmpeg may look at the extension
+	return m_dir / name.str();
+}
+
+fs::path MediaCache::resolve(fs::path const& file) {
+	if (!m_enabled || file.empty() || !cached(file)) return file;
+	fs::path p = filename(file);
+	boost::system::error_code ec;
+	if (!fs::is_regular_file(p, ec)) return file;
+	fs::last_write_time(p, std::time(nullptr), ec);  // Most recently used, for trim()
+	LOG("cache", debug) << "Opening the local copy of " << file << std::endl;
+	return p;
+}
+
+void MediaCache::prefetch(Song const& song) {
+	if (!m_enabled) return;
+	std::vector<fs::path> files;
+	for (auto const& kv: song.music) files.push_back(kv.second);
+	if (config["graphic/video"].b()) files.push_back(song.video);
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		for (auto it = files.rbegin(); it != files.rend(); ++it) {
+			if (it->empty() || !cached(*it)) continue;
+			m_queue.erase(std::remove(m_queue.begin(), m_queue.end(), *it), m_queue.end());
+			m_queue.push_front(*it);
+		}
+		if (m_queue.size() > MAX_QUEUED) m_queue.resize(MAX_QUEUED);
+	}
+	m_cond.notify_one();
+}
+
+void MediaCache::copy(fs::path const& file, fs::path const& target) {
+	// Copy to a temporary name first so that resolve never sees partial files
+	fs::path part = target;
+	part += ".part";
+	fs::remove(part);  // Left over from an interrupted copy
+	fs::copy_file(file, part);
+	fs::rename(part, target);
+	fs::last_write_time(target, std::time(nullptr));
+}
+
+void MediaCache::trim(std::uintmax_t limit) {
+	struct Entry { std::time_t time; std::uintmax_t size; fs::path path; };
+	std::vector<Entry> entries;
+	m_size = 0;
+	boost::system::error_code ec;
+	for (fs::directory_iterator it(m_dir, ec), end; !ec && it != end; it.increment(ec)) {
+		if (it->path().extension() == ".part") continue;
+		Entry e{ fs::last_write_time(it->path(), ec), fs::file_size(it->path(), ec), it->path() };
+		if (ec) continue;
+		m_size += e.size;
+		entries.push_back(e);
+	}
+	std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) { return a.time < b.time; });
+	for (auto const& e: entries) {
+		if (m_size <= limit) break;
+		if (fs::remove(e.path, ec)) m_size -= e.size;  // Fails for files open on some systems, those stay for now
+	}
+}
+
+void MediaCache::run() {
+	threads::enter(threads::Class::background, "media cache");
+	try {
+		fs::create_directories(m_dir);
+		trim(m_limit);
+	} catch (std::exception& e) {
+		std::clog << "cache/error: Media cache disabled, cannot use " << m_dir << ": " << e.what() << std::endl;
+		return;
+	}
+	std::unique_lock<std::mutex> l(m_mutex);
+	while (true) {
+		if (m_queue.empty()) { m_cond.wait(l); continue; }
+		fs::path file = m_queue.front();
+		m_queue.pop_front();
+		UnlockGuard<decltype(l)> unlocked(l);  // Copying takes a while
+		fs::path target = filename(file);
+		boost::system::error_code ec;
+		if (fs::exists(target, ec)) continue;
+		const std::uintmax_t size = fs::file_size(file, ec);
+		if (ec || size > m_limit / 2) continue;  // Gone, or too big to be worth it
+		// Make room first, the copy is used right away
+		trim(m_limit - size);
+		try {
+			copy(file, target);
+			LOG("cache", debug) << "Copied " << file << " to the media cache" << std::endl;
+		} catch (std::exception& e) {
+			std::clog << "cache/warning: Cannot copy " << file << " to the media cache: " << e.what() << std::endl;
+			fs::path part = target;
+			part += ".part";
+			fs::remove(part, ec);
+		}
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "fs.hh"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+class Song;
+
+/**
+* Local copies of song media (music and video) from song folders on slow network storage, for setups where
+* several machines play from one library on a server. The media of songs about to be played (the playlist and
+* the next song) are copied into getCacheDir() / "media" by a background thread, and FFmpeg opens the local copy
+* instead of the original once it is complete. Files are named by a hash of the path, size and modification time,
+* so changed files simply miss. The total size is kept within songs/media_cache_mb by removing the least recently
+* used copies. Only files under songs/media_cache_paths are cached.
+**/
+class MediaCache {
+  public:
+	/// The cache (created on first use, with the configuration of that time)
+	static MediaCache& instance();
+	/// The complete local copy of file if there is one, otherwise file itself (any thread)
+	fs::path resolve(fs::path const& file);
+	/// Copy the media of song in the background, before anything else queued
+	void prefetch(Song const& song);
+
+  private:
+	MediaCache();
+	/// Is file in a cached folder?
+	bool cached(fs::path const& file) const;
+	fs::path filename(fs::path const& file) const;
+	void copy(fs::path const& file, fs::path const& target);
+	void trim(std::uintmax_t limit);
+	void run();
+
+	const std::uintmax_t m_limit;  ///< Maximum total size in bytes, 0 if disabled
+	const fs::path m_dir;
+	const Paths m_roots;  ///< Cached folders
+	const bool m_enabled;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<fs::path> m_queue;  ///< Files to copy, most urgent first
+	std::uintmax_t m_size = 0;  ///< Current total size of the cache files (only used by the worker thread)
+};
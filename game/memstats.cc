@@ -0,0 +1,80 @@
+#include "memstats.hh"
+
+#include <atomic>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+namespace memstats {
+	struct Account {
+		Account(char const* name, Kind kind): name(name), kind(kind) {}
+		std::string name;
+		Kind kind;
+		std::atomic<std::size_t> current{ 0 }, peak{ 0 };
+		std::atomic<unsigned> holders{ 0 };
+		void add(std::size_t bytes) {
+			std::size_t now = current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+			for (std::size_t p = peak.load(std::memory_order_relaxed); p < now && !peak.compare_exchange_weak(p, now, std::memory_order_relaxed); ) {}
+		}
+		void sub(std::size_t bytes) { current.fetch_sub(bytes, std::memory_order_relaxed); }
+	};
+}
+
+namespace {
+	struct Registry {
+		std::mutex mutex;
+		std::map<std::string, std::unique_ptr<memstats::Account>> accounts;
+	};
+	Registry& registry() {
+		static Registry* r = new Registry();  // Leaked so that static objects can still release their usage at exit
+		return *r;
+	}
+	memstats::Account* find(char const* name, memstats::Kind kind) {
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		auto& account = r.accounts[name];
+		if (!account) account = std::make_unique<memstats::Account>(name, kind);
+		return account.get();
+	}
+}
+
+namespace memstats {
+	Usage::Usage(char const* account, Kind kind): m_account(find(account, kind)) {}
+
+	Usage::Usage(Usage const& other): m_account(other.m_account) { set(other.m_bytes); }
+
+	Usage& Usage::operator=(Usage const& other) {
+		if (this == &other) return *this;
+		set(0);
+		m_account = other.m_account;
+		set(other.m_bytes);
+		return *this;
+	}
+
+	void Usage::set(std::size_t bytes) {
+		if (bytes == m_bytes) return;
+		if (m_bytes == 0) ++m_account->holders;
+		if (bytes == 0) --m_account->holders;
+		if (bytes > m_bytes) m_account->add(bytes - m_bytes); else m_account->sub(m_bytes - bytes);
+		m_bytes = bytes;
+	}
+
+	std::vector<Stats> statistics() {
+		std::vector<Stats> ret;
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		for (auto const& a: r.accounts) ret.push_back(Stats{ a.second->name, a.second->kind, a.second->current, a.second->peak, a.second->holders });
+		return ret;
+	}
+
+	std::string format(std::size_t bytes) {
+		std::ostringstream oss;
+		oss << std::fixed << std::setprecision(1);
+		if (bytes < 1024) oss << bytes << " B";
+		else if (bytes < 1024 * 1024) oss << bytes / 1024.0 << " KiB";
+		else oss << bytes / 1048576.0 << " MiB";
+		return oss.str();
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+* Memory accounting: caches and buffers report how many bytes of RAM or video memory they hold, so that the
+* totals can be checked against a memory budget (debug overlay with graphic/memory_stats, /api/stats on the
+* webserver). Accounts are named by subsystem; "a/b" is the part of account "a" that is used for b.
+* The numbers are sizes of the data itself (allocator and driver overhead are not included).
+**/
+namespace memstats {
+	enum class Kind { RAM, VRAM };
+
+	/// Bytes held for one account while the object exists; copies hold the same amount again
+	class Usage {
+	  public:
+		explicit Usage(char const* account, Kind kind = Kind::RAM);
+		~Usage() { set(0); }
+		Usage(Usage const& other);
+		Usage& operator=(Usage const& other);
+		/// Change the amount held
+		void set(std::size_t bytes);
+		std::size_t bytes() const { return m_bytes; }
+	  private:
+		struct Account* m_account;
+		std::size_t m_bytes = 0;
+	};
+
+	struct Stats {
+		std::string name;
+		Kind kind;
+		std::size_t current, peak;
+		unsigned holders;  ///< Usage objects with something on the account
+	};
+	/// All accounts by name
+	std::vector<Stats> statistics();
+	/// Human readable size, e.g. "12.3 MiB"
+	std::string format(std::size_t bytes);
+}
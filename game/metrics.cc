@@ -0,0 +1,140 @@
+#include "metrics.hh"
+
+#include "lockstats.hh"
+#include "memstats.hh"
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+
+namespace {
+	/// Frame time percentiles cover this many of the latest frames (ten seconds at 60 FPS)
+	const std::size_t FRAME_WINDOW = 600;
+	struct Registry {
+		std::mutex mutex;
+		std::vector<metrics::Family const*> families;
+		std::vector<double> frames;  ///< Ring of the latest frame intervals, in seconds
+		std::size_t framePos = 0;
+		std::uint64_t frameCount = 0;
+		double frameSum = 0.0;
+	};
+	Registry& registry() {
+		static Registry* r = new Registry();  // Leaked so that static Families can still unregister at exit
+		return *r;
+	}
+	void header(std::ostream& os, std::string const& name, std::string const& help, char const* type) {
+		os << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+	}
+	void sample(std::ostream& os, std::string const& name, std::string const& labels, double value) {
+		os << name;
+		if (!labels.empty()) os << "{" << labels << "}";
+		os << " " << value << "\n";
+	}
+}
+
+namespace metrics {
+	Family::Family(std::string const& name, std::string const& help, char const* type, std::function<Samples ()> read):
+	  m_name(name), m_help(help), m_type(type), m_read(std::move(read))
+	{
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		r.families.push_back(this);
+	}
+
+	Family::Family(std::string const& name, std::string const& help, char const* type, std::function<double ()> read):
+	  Family(name, help, type, [read] { return Samples{ Sample{ std::string(), read() } }; })
+	{}
+
+	Family::~Family() {
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		r.families.erase(std::remove(r.families.begin(), r.families.end(), this), r.families.end());
+	}
+
+	std::string label(std::string const& name, std::string const& value) {
+		std::string ret = name + "=\"";
+		for (char ch: value) {
+			if (ch == '\\' || ch == '"') ret += '\\';
+			if (ch == '\n') { ret += "\\n"; continue; }
+			ret += ch;
+		}
+		return ret + '"';
+	}
+
+	double peek(std::string const& name) {
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		double ret = 0.0;
+		for (Family const* f: r.families) {
+			if (f->m_name != name) continue;
+			for (Sample const& s: f->m_read()) ret = std::max(ret, s.value);
+		}
+		return ret;
+	}
+
+	void frame(Seconds interval) {
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		if (r.frames.size() < FRAME_WINDOW) r.frames.push_back(interval.count());
+		else r.frames[r.framePos] = interval.count();
+		r.framePos = (r.framePos + 1) % FRAME_WINDOW;
+		++r.frameCount;
+		r.frameSum += interval.count();
+	}
+
+	std::string exposition() {
+		Registry& r = registry();
+		std::ostringstream os;
+		os.precision(9);
+		std::lock_guard<std::mutex> l(r.mutex);
+		// Frames
+		std::vector<double> sorted = r.frames;
+		std::sort(sorted.begin(), sorted.end());
+		double window = 0.0;
+		for (double t: sorted) window += t;
+		header(os, "performous_fps", "Frames per second over the latest " + std::to_string(FRAME_WINDOW) + " frames", "gauge");
+		sample(os, "performous_fps", std::string(), window > 0.0 ? sorted.size() / window : 0.0);
+		header(os, "performous_frame_seconds", "Interval between frames (quantiles over the latest frames)", "summary");
+		for (double q: { 0.5, 0.9, 0.99 }) {
+			std::ostringstream label;
+			label << "quantile=\"" << q << "\"";
+			sample(os, "performous_frame_seconds", label.str(), sorted.empty() ? 0.0 : sorted[std::min<std::size_t>(sorted.size() - 1, q * sorted.size())]);
+		}
+		sample(os, "performous_frame_seconds_sum", std::string(), r.frameSum);
+		sample(os, "performous_frame_seconds_count", std::string(), r.frameCount);
+		// Memory accounting
+		std::vector<memstats::Stats> memory = memstats::statistics();
+		header(os, "performous_memory_bytes", "Memory held by caches and buffers (see memstats.hh)", "gauge");
+		auto labels = [](memstats::Stats const& a) { return label("account", a.name) + "," + label("kind", a.kind == memstats::Kind::VRAM ? "vram" : "ram"); };
+		for (auto const& a: memory) sample(os, "performous_memory_bytes", labels(a), a.current);
+		header(os, "performous_memory_peak_bytes", "Highest value of performous_memory_bytes", "gauge");
+		for (auto const& a: memory) sample(os, "performous_memory_peak_bytes", labels(a), a.peak);
+		// Lock contention (cumulative histograms; empty while lockstats is disabled)
+		std::vector<lockstats::Stats const*> locks = lockstats::all();
+		auto histogram = [&os, &locks](std::string const& name, std::string const& help, bool wait) {
+			header(os, name, help, "histogram");
+			for (lockstats::Stats const* l: locks) {
+				std::uint64_t count = 0;
+				for (unsigned b = 0; b < lockstats::BUCKET_COUNT; ++b) {
+					count += (wait ? l->waits : l->holds)[b];
+					std::ostringstream le;
+					if (b + 1 < lockstats::BUCKET_COUNT) le << lockstats::BUCKETS[b]; else le << "+Inf";
+					sample(os, name + "_bucket", label("lock", l->name) + "," + label("le", le.str()), count);
+				}
+				sample(os, name + "_sum", label("lock", l->name), 1e-9 * (wait ? l->waitNanoseconds : l->holdNanoseconds));
+				sample(os, name + "_count", label("lock", l->name), count);
+			}
+		};
+		histogram("performous_lock_wait_seconds", "Time spent waiting for contended locks (see lockstats.hh)", true);
+		histogram("performous_lock_hold_seconds", "Time that locks were held", false);
+		// Registered by subsystems (families of the same name, e.g. of two videos, go under one header)
+		std::vector<Family const*> families = r.families;
+		std::stable_sort(families.begin(), families.end(), [](Family const* a, Family const* b) { return a->m_name < b->m_name; });
+		for (std::size_t i = 0; i < families.size(); ++i) {
+			Family const* f = families[i];
+			if (i == 0 || families[i - 1]->m_name != f->m_name) header(os, f->m_name, f->m_help, f->m_type);
+			for (Sample const& s: f->m_read()) sample(os, f->m_name, s.labels, s.value);
+		}
+		return os.str();
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "chrono.hh"
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+* Performance metrics for central monitoring, served by the web server at /api/metrics in the Prometheus text
+* format. Subsystems register their metrics as Families that are read when scraped (from the web server thread,
+* so the read functions must do their own locking). Frame times and memory accounting are built in.
+**/
+namespace metrics {
+	struct Sample {
+		std::string labels;  ///< Prometheus labels without braces, e.g. device="0" (empty for none)
+		double value;
+	};
+	typedef std::vector<Sample> Samples;
+
+	/// A metric (with any number of labeled samples) that is exported while the object exists
+	class Family {
+	  public:
+		/// type is "gauge" or "counter"
+		Family(std::string const& name, std::string const& help, char const* type, std::function<Samples ()> read);
+		/// A metric with a single unlabeled sample
+		Family(std::string const& name, std::string const& help, char const* type, std::function<double ()> read);
+		~Family();
+		Family(Family const&) = delete;
+		Family& operator=(Family const&) = delete;
+	  private:
+		friend std::string exposition();
+		friend double peek(std::string const& name);
+		std::string m_name, m_help;
+		char const* m_type;
+		std::function<Samples ()> m_read;
+	};
+
+	/// A label for Sample::labels, e.g. label("file", name) gives file="name" (with quotes and backslashes escaped)
+	std::string label(std::string const& name, std::string const& value);
+	/// The largest current sample of the families registered as name (zero if there are none), e.g. for PerfOverlay
+	double peek(std::string const& name);
+	/// Record the interval between two frames (main loop)
+	void frame(Seconds interval);
+	/// Everything in the Prometheus text exposition format
+	std::string exposition();
+}
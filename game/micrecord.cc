@@ -0,0 +1,175 @@
+#include "micrecord.hh"
+
+#include "chrono.hh"
+#include "configuration.hh"
+#include "database.hh"
+#include "engine.hh"
+#include "notes.hh"
+#include "pitch.hh"
+#include "song.hh"
+#include "util.hh"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace {
+	char const MAGIC[4] = { 'P', 'M', 'R', '2' };  ///< The last byte is the version (1 had no pitch detectors)
+
+	// The file is in native byte order, like the other caches (recordings are replayed on the machine that made them)
+	template <typename T> void put(std::ostream& os, T value) { os.write(reinterpret_cast<char const*>(&value), sizeof(value)); }
+	void putString(std::ostream& os, std::string const& str) {
+		put<std::uint32_t>(os, str.size());
+		os.write(str.data(), str.size());
+	}
+	template <typename T> T get(std::istream& is) {
+		T value{};
+		if (!is.read(reinterpret_cast<char*>(&value), sizeof(value))) throw std::runtime_error("Unexpected end of file");
+		return value;
+	}
+	std::string getString(std::istream& is) {
+		std::string str(get<std::uint32_t>(is), '\0');
+		if (!is.read(&str[0], str.size())) throw std::runtime_error("Unexpected end of file");
+		return str;
+	}
+}
+
+MicRecorder::MicRecorder(fs::path const& file, Song const& song, std::deque<Analyzer>& analyzers, std::vector<VocalTrack*> const& vocals, double roundTrip):
+  m_file(file.string(), std::ios::binary), m_analyzers(analyzers), m_samples(analyzers.size())
+{
+	if (vocals.size() != analyzers.size()) throw std::logic_error("MicRecorder requires a vocal track for each analyzer.");
+	if (!m_file) throw std::runtime_error("Cannot write " + file.string());
+	m_file.write(MAGIC, sizeof(MAGIC));
+	putString(m_file, song.path.string());
+	putString(m_file, song.filename.string());
+	put<double>(m_file, roundTrip);
+	put<std::uint32_t>(m_file, analyzers.size());
+	for (std::size_t i = 0; i < analyzers.size(); ++i) {
+		Analyzer& a = analyzers[i];
+		putString(m_file, a.getId());
+		putString(m_file, vocals[i]->name);
+		put<double>(m_file, a.analysisRate());
+		put<std::uint32_t>(m_file, a.fftSize());
+		put<std::uint32_t>(m_file, a.step());
+		putString(m_file, a.detector());
+		put<double>(m_file, a.latency());
+		std::vector<float>& samples = m_samples[i];
+		a.setTap([&samples](float const* begin, float const* end) { samples.insert(samples.end(), begin, end); });
+	}
+}
+
+MicRecorder::~MicRecorder() {
+	for (Analyzer& a: m_analyzers) a.setTap(nullptr);
+}
+
+fs::path& MicRecorder::folder() {
+	static fs::path dir;
+	return dir;
+}
+
+std::unique_ptr<MicRecorder> MicRecorder::start(Song const& song, std::deque<Analyzer>& analyzers, std::vector<VocalTrack*> const& vocals) {
+	if (folder().empty()) return nullptr;
+	try {
+		fs::create_directories(folder());
+		fs::path file;
+		for (unsigned i = 1;; ++i) {
+			file = folder() / ("Performous_" + std::to_string(i) + ".mics");
+			if (!fs::exists(file)) break;
+		}
+		auto recorder = std::make_unique<MicRecorder>(file, song, analyzers, vocals, config["audio/round-trip"].f());
+		std::clog << "audio/info: Recording the mics into " << file.string() << std::endl;
+		return recorder;
+	} catch (std::exception& e) {
+		std::clog << "audio/error: Cannot record the mics: " << e.what() << std::endl;
+		return nullptr;
+	}
+}
+
+void MicRecorder::step(double pos) {
+	put<double>(m_file, pos);
+	for (auto& samples: m_samples) {
+		put<std::uint32_t>(m_file, samples.size());
+		m_file.write(reinterpret_cast<char const*>(samples.data()), samples.size() * sizeof(float));
+		samples.clear();
+	}
+}
+
+int replayMics(fs::path const& file) {
+	const fs::path tmp = fs::temp_directory_path() / fs::unique_path("performous-replay-%%%%-%%%%");
+	fs::create_directories(tmp);
+	int ret = EXIT_SUCCESS;
+	try {
+		std::ifstream f(file.string(), std::ios::binary);
+		if (!f) throw std::runtime_error("Cannot open " + file.string());
+		char magic[sizeof(MAGIC)];
+		if (!f.read(magic, sizeof(magic)) || !std::equal(magic, magic + 3, MAGIC) || magic[3] < '1' || magic[3] > MAGIC[3]) throw std::runtime_error(file.string() + " is not a recording of mics");
+		const int version = magic[3] - '0';
+		const fs::path path = getString(f);
+		const fs::path filename = getString(f);
+		const double roundTrip = get<double>(f);
+		Song song(path, filename);
+		song.loadNotes(false);
+		std::deque<Analyzer> analyzers;
+		std::vector<std::vector<Analyzer*>> batches;
+		Engine::VocalTrackPtrs vocals;
+		const std::uint32_t mics = get<std::uint32_t>(f);
+		for (std::uint32_t i = 0; i < mics; ++i) {
+			const std::string id = getString(f);
+			const std::string track = getString(f);
+			const double rate = get<double>(f);
+			const std::size_t fft = get<std::uint32_t>(f);
+			const std::size_t step = get<std::uint32_t>(f);
+			const std::string detector = version >= 2 ? getString(f) : "fft";
+			// At the analysis rate, so that the samples are analyzed as recorded (without decimating them again)
+			analyzers.emplace_back(rate, id, step, fft, detector);
+			analyzers.back().setLatency(get<double>(f));
+			vocals.push_back(&song.getVocalTrack(track));
+			// Batches have equal FFT sizes, like the devices had
+			if (batches.empty() || batches.back().size() == ANALYZER_BATCH || batches.back().front()->fftSize() != analyzers.back().fftSize()) batches.emplace_back();
+			batches.back().push_back(&analyzers.back());
+		}
+		Database database(tmp / "database.xml");
+		Engine engine(analyzers, batches, vocals, database);
+		std::cout << std::fixed << std::setprecision(3) << "Replaying " << song.str() << " from " << file.string() << std::endl;
+		// Each step gets what the analyzers got before the same step while recording, with the position it had
+		std::vector<float> samples;
+		std::size_t steps = 0;
+		double first = getNaN(), last = getNaN();
+		Seconds busy{ 0.0 }, longest{ 0.0 };
+		while (f.peek() != std::ifstream::traits_type::eof()) {
+			const double pos = get<double>(f);
+			for (Analyzer& a: analyzers) {
+				samples.resize(get<std::uint32_t>(f));
+				if (!f.read(reinterpret_cast<char*>(samples.data()), samples.size() * sizeof(float))) throw std::runtime_error("Unexpected end of file");
+				a.input(samples.begin(), samples.end());
+			}
+			const Time begin = Clock::now();
+			engine.step(pos, roundTrip);
+			const Seconds time = Clock::now() - begin;
+			busy += time;
+			longest = std::max(longest, time);
+			++steps;
+			if (pos != pos) continue;  // Still loading
+			if (first != first) first = pos;
+			last = pos;
+		}
+		const double duration = first == first ? last - first : 0.0;
+		std::cout << steps << " engine steps covering " << duration << " s of the song took " << busy.count() << " s ("
+		  << (busy.count() > 0.0 ? duration / busy.count() : 0.0) << " times real time), " << (steps ? 1000.0 * busy.count() / steps : 0.0)
+		  << " ms per step, longest " << 1000.0 * longest.count() << " ms\n";
+		for (Player const& player: database.cur) {
+			std::cout << "  " << player.m_analyzer.getId() << " (" << player.m_vocal.name << "): score " << player.getScore() << "\n";
+		}
+		std::cout << std::flush;
+	} catch (std::exception& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		ret = EXIT_FAILURE;
+	}
+	boost::system::error_code ec;
+	fs::remove_all(tmp, ec);
+	return ret;
+}
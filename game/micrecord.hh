@@ -0,0 +1,40 @@
+#pragma once
+
+#include "fs.hh"
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+class Analyzer;
+class Song;
+class VocalTrack;
+
+/**
+* Records the microphone input of a singing session (performous --record-mics <folder>) for replaying it later
+* (performous --replay-mics <file>) with the same scores, so that scoring changes can be compared on real singing and
+* the engine benchmarked. The engine calls step with the song position on each of its steps, and what each analyzer
+* consumed since the previous step (after decimation to the analysis rate) is written with it. Replaying feeds the
+* samples to analyzers running at the analysis rate in the same steps, on a virtual clock as fast as the engine goes.
+**/
+class MicRecorder {
+  public:
+	/// Record the analyzers singing vocals (one track per analyzer) of song into file
+	MicRecorder(fs::path const& file, Song const& song, std::deque<Analyzer>& analyzers, std::vector<VocalTrack*> const& vocals, double roundTrip);
+	~MicRecorder();
+	MicRecorder(MicRecorder const&) = delete;
+	MicRecorder& operator=(MicRecorder const&) = delete;
+	/// Folder where start records (set by --record-mics), empty if not recording
+	static fs::path& folder();
+	/// Start recording into a new file in folder() unless it is empty (then or on failure returns nullptr)
+	static std::unique_ptr<MicRecorder> start(Song const& song, std::deque<Analyzer>& analyzers, std::vector<VocalTrack*> const& vocals);
+	/// Write the samples analyzed since the previous step with the song position pos (engine thread, after analysis)
+	void step(double pos);
+  private:
+	std::ofstream m_file;
+	std::deque<Analyzer>& m_analyzers;
+	std::vector<std::vector<float>> m_samples;  ///< Of each analyzer since the previous step
+};
+
+/// Replay a recording of MicRecorder and print the scores and the time that the engine took. Returns the exit status.
+int replayMics(fs::path const& file);
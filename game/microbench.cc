@@ -0,0 +1,285 @@
+#include "microbench.hh"
+
+#include "audio.hh"
+#include "chrono.hh"
+#include "configuration.hh"
+#include "database.hh"
+#include "ffmpeg.hh"
+#include "fs.hh"
+#include "image.hh"
+#include "libda/fft.hpp"
+#include "pitch.hh"
+#include "song.hh"
+#include "songs.hh"
+#include "svg.hh"
+#include "util.hh"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+	const Seconds MIN_TIME(0.25);  ///< Each measurement runs at least this long
+	const unsigned RUNS = 5;  ///< Measurements per case, the median is printed
+	const unsigned RATE = 48000;
+	const std::size_t CALLBACK = 256;  ///< Frames per audio callback
+	const double TRACK_SECONDS = 30.0;  ///< Of the generated music tracks
+	const double LAP_SECONDS = 1.5;  ///< Played before seeking back (well within what is buffered before playback starts)
+	const unsigned LIBRARY_SONGS = 25000;
+	volatile float g_sink;  ///< Keeps the results of computations that would otherwise be optimized away
+
+	/// Runs the cases selected by a filter and prints their timings
+	class Runner {
+	  public:
+		explicit Runner(std::string const& filter): m_filter(filter) {}
+		/// Is the case called name selected?
+		bool wanted(std::string const& name) const { return name.find(m_filter) != std::string::npos; }
+		/// Time run, which performs the operation n times, and print the median time per operation (if wanted)
+		void measure(std::string const& name, std::function<void (std::size_t n)> const& run) {
+			if (!wanted(name)) return;
+			++m_cases;
+			// Find a count that takes MIN_TIME (this also warms up caches and lazily built tables)
+			std::size_t n = 1;
+			for (Seconds t = time(run, n); t < MIN_TIME && n < (std::size_t(1) << 30); t = time(run, n)) {
+				n = t.count() > 0.0 ? std::min(10 * n, std::max(2 * n, std::size_t(n * 1.2 * MIN_TIME.count() / t.count()))) : 10 * n;
+			}
+			std::vector<double> perOp;
+			for (unsigned r = 0; r < RUNS; ++r) perOp.push_back(1e9 * time(run, n).count() / n);
+			std::sort(perOp.begin(), perOp.end());
+			std::cout << std::left << std::setw(28) << name << std::right << std::setw(14) << perOp[RUNS / 2] << " ns (min "
+			  << perOp.front() << " ns, " << n << " per run)" << std::endl;
+		}
+		/// Excludes its lifetime from the measurement in progress (for preparing the next operations)
+		class Untimed {
+		  public:
+			explicit Untimed(Runner& runner): m_runner(runner), m_begin(Clock::now()) {}
+			~Untimed() { m_runner.m_excluded += Clock::now() - m_begin; }
+		  private:
+			Runner& m_runner;
+			Time m_begin;
+		};
+		unsigned cases() const { return m_cases; }
+	  private:
+		Seconds time(std::function<void (std::size_t n)> const& run, std::size_t n) {
+			m_excluded = Seconds(0.0);
+			const Time begin = Clock::now();
+			run(n);
+			return Clock::now() - begin - m_excluded;
+		}
+		std::string m_filter;
+		Seconds m_excluded{ 0.0 };
+		unsigned m_cases = 0;
+	};
+
+	/// Write a stereo 16-bit WAV file of a chord on freq with some noise
+	void writeTrack(fs::path const& file, double freq) {
+		const std::uint32_t frames = TRACK_SECONDS * RATE, bytes = frames * 4;
+		std::ofstream f(file.string(), std::ios::binary);
+		auto le16 = [&f](std::uint16_t v) { f.put(v & 0xFF).put(v >> 8); };
+		auto le32 = [&](std::uint32_t v) { le16(v & 0xFFFF); le16(v >> 16); };
+		f.write("RIFF", 4); le32(36 + bytes); f.write("WAVE", 4);
+		f.write("fmt ", 4); le32(16); le16(1); le16(2); le32(RATE); le32(RATE * 4); le16(4); le16(16);
+		f.write("data", 4); le32(bytes);
+		unsigned noise = 1;
+		for (std::uint32_t i = 0; i < frames; ++i) {
+			const double t = double(i) / RATE;
+			noise = noise * 1103515245 + 12345;
+			const double s = 0.3 * std::sin(TAU * freq * t) + 0.2 * std::sin(TAU * 1.5 * freq * t) + 0.05 * ((noise >> 16) / 32768.0 - 1.0);
+			le16(std::uint16_t(std::int16_t(std::lround(20000.0 * s))));
+			le16(std::uint16_t(std::int16_t(std::lround(20000.0 * s * 0.8))));
+		}
+		if (!f) throw std::runtime_error("Cannot write " + file.string());
+	}
+
+	/// Write an UltraStar duet of the given length with phrases of eight notes, its title and artist made of words picked by num
+	void writeSong(fs::path const& file, unsigned num, double seconds) {
+		static char const* words[] = { "Love", "Night", "Heart", "Fire", "Dance", "Rain", "Summer", "Dream", "Road", "Angel", "Ocean", "Stars", "Gold", "Blue", "Wild", "Home" };
+		auto word = [](unsigned i) { return words[i % (sizeof(words) / sizeof(*words))]; };
+		fs::create_directories(file.parent_path());
+		std::ofstream f(file.string());
+		f << "#TITLE:" << word(num) << " " << word(num / 7 + 3) << " " << num << "\n#ARTIST:The " << word(num / 3) << " " << word(num / 11 + 5)
+		  << "\n#LANGUAGE:" << (num % 3 ? "English" : "Finnish") << "\n#EDITION:Benchmark " << num % 20 << "\n#GENRE:" << word(num / 5)
+		  << "\n#YEAR:" << 1960 + num % 60 << "\n#BPM:300\n#GAP:0\n#P1:First singer\n#P2:Second singer\n";
+		char const* syllables[] = { "la ", "di ", "da", "dum ", "ba", "dee " };
+		const unsigned beats = seconds * 20.0;  // 300 BPM is 20 beats per second
+		for (unsigned singer = 1; singer <= 2; ++singer) {
+			f << "P" << singer << "\n";
+			unsigned phrase = 0;
+			for (unsigned ts = (singer - 1) * 48; ts + 48 <= beats; ts += 96, ++phrase) {
+				for (unsigned i = 0; i < 8; ++i) {
+					f << (i == 7 ? "* " : ": ") << ts + 6 * i << " 5 " << 3 + int((i * 5 + phrase * 3 + num) % 12) << " " << syllables[(i + phrase) % 6] << "\n";
+				}
+				f << "- " << ts + 48 << "\n";
+			}
+		}
+		f << "E\n";
+		if (!f) throw std::runtime_error("Cannot write " + file.string());
+	}
+
+	void benchDSP(Runner& runner) {
+		std::vector<float> pcm(FFT_MAX_N), window(FFT_MAX_N, 1.0f);
+		for (std::size_t i = 0; i < pcm.size(); ++i) pcm[i] = std::sin(0.05 * i) + 0.3f * std::sin(0.31 * i);
+		std::vector<std::complex<float>> out(FFT_MAX_N);
+		runner.measure("fft/1024", [&](std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i) da::fft<10>(pcm.begin(), window, out.data());
+			g_sink = out[1].real();
+		});
+		runner.measure("fft/4096", [&](std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i) da::fft<12>(pcm.begin(), window, out.data());
+			g_sink = out[1].real();
+		});
+		// As the analyzers use it: a callback of input, then a window read and a step popped
+		auto ring = std::make_unique<RingBuffer<2 * FFT_MAX_N>>();
+		std::vector<float> chunk(CALLBACK, 0.5f), windowed(FFT_N);
+		ring->insert(windowed.begin(), windowed.end());
+		runner.measure("ringbuffer/insert+read", [&](std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i) {
+				ring->insert(chunk.begin(), chunk.end());
+				ring->read(windowed.begin(), windowed.end());
+				ring->pop(chunk.size());
+			}
+			g_sink = windowed[0];
+		});
+		// A callback of a sung vowel with noise into an analyzer of the default settings, then the analysis
+		std::vector<float> voice(RATE);
+		unsigned noise = 1;
+		for (std::size_t i = 0; i < voice.size(); ++i) {
+			noise = noise * 1103515245 + 12345;
+			const double t = double(i) / RATE;
+			voice[i] = 0.3 * std::sin(TAU * 220.0 * t) + 0.15 * std::sin(TAU * 440.0 * t) + 0.1 * std::sin(TAU * 660.0 * t) + 0.02 * ((noise >> 16) / 32768.0 - 1.0);
+		}
+		for (std::string detector: { "fft", "yin" }) {
+			Analyzer analyzer(RATE, "bench", 200, FFT_N, detector);
+			std::size_t pos = 0;
+			runner.measure("analyzer/process " + detector, [&](std::size_t n) {
+				for (std::size_t i = 0; i < n; ++i) {
+					analyzer.input(voice.begin() + pos, voice.begin() + pos + CALLBACK);
+					analyzer.process();
+					pos = (pos + CALLBACK) % (voice.size() - CALLBACK);
+				}
+			});
+		}
+	}
+
+	void benchAudio(Runner& runner, fs::path const& tmp) {
+		if (!runner.wanted("audiobuffer/read") && !runner.wanted("music/mix")) return;
+		config["audio/buffer_seconds"].i() = 45;  // The whole track
+		writeTrack(tmp / "background.wav", 220.0);
+		writeTrack(tmp / "vocals.wav", 330.0);
+		const std::int64_t lap = 2 * std::int64_t(LAP_SECONDS * RATE);
+		std::vector<float> buf(2 * CALLBACK);
+		// Callbacks from the start of the track, going back after each lap (and then waiting for buffering, untimed)
+		{
+			AudioBuffer audioBuffer(tmp / "background.wav", RATE);
+			std::int64_t pos = lap;
+			runner.measure("audiobuffer/read", [&](std::size_t n) {
+				for (std::size_t i = 0; i < n; ++i, pos += buf.size()) {
+					if (pos + std::int64_t(buf.size()) > lap) {
+						Runner::Untimed untimed(runner);
+						while (!audioBuffer.prepare(0)) std::this_thread::sleep_for(1ms);
+						pos = 0;
+					}
+					std::fill(buf.begin(), buf.end(), 0.0f);
+					audioBuffer.read(buf.data(), buf.size(), pos);
+				}
+				g_sink = buf[0];
+			});
+		}
+		{
+			Music music(Audio::Files{ { "background", tmp / "background.wav" }, { "vocals", tmp / "vocals.wav" } }, RATE, false);
+			std::int64_t pos = lap;
+			runner.measure("music/mix", [&](std::size_t n) {
+				for (std::size_t i = 0; i < n; ++i, pos += buf.size()) {
+					if (pos + std::int64_t(buf.size()) > lap) {
+						Runner::Untimed untimed(runner);
+						music.seek(0.0);
+						while (!music.prepare()) std::this_thread::sleep_for(1ms);
+						pos = 0;
+					}
+					std::fill(buf.begin(), buf.end(), 0.0f);
+					music(buf.data(), buf.data() + buf.size());
+				}
+				g_sink = buf[0];
+			});
+		}
+	}
+
+	void benchLibrary(Runner& runner, fs::path const& tmp) {
+		const fs::path sample = tmp / "sample" / "song.txt";
+		writeSong(sample, 0, 180.0);
+		runner.measure("songparser/txt", [&](std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i) Song song(sample.parent_path(), sample);
+		});
+		runner.measure("songparser/txt notes", [&](std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i) {
+				Song song(sample.parent_path(), sample);
+				song.loadNotes(false);
+			}
+		});
+		if (!runner.wanted("songs/filter") && !runner.wanted("songs/sort")) return;
+		std::cout << "Generating a library of " << LIBRARY_SONGS << " songs..." << std::endl;
+		for (unsigned i = 0; i < LIBRARY_SONGS; ++i) writeSong(tmp / "library" / std::to_string(i / 100) / std::to_string(i) / "song.txt", i, 10.0);
+		config["paths/songs"].sl() = { (tmp / "library").string() };
+		config["paths/system-songs"].sl().clear();
+		config["songs/watch"].b() = false;
+		Database database(tmp / "database.xml");
+		Songs songs(database, std::string(), tmp);
+		while (!songs.doneLoading) std::this_thread::sleep_for(10ms);
+		// Interactive searches: each operation is a new filter (a word, two words, a miss and none)
+		char const* filters[] = { "love", "night dream", "xyzzy", "" };
+		std::size_t query = 0;
+		runner.measure("songs/filter", [&](std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i) songs.setFilter(filters[query++ % 4]);
+		});
+		songs.setFilter("");
+		int order = 0;
+		runner.measure("songs/sort", [&](std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i, ++order) songs.sortSpecificChange(order % Songs::ORDERS, order / Songs::ORDERS % 2);
+		});
+	}
+
+	void benchImages(Runner& runner) {
+		if (!runner.wanted("svg/load cached")) return;
+		const fs::path file = findFile("songs_bg.svg");
+		Bitmap bitmap;
+		loadSVG(bitmap, file);  // Rasterized into the cache unless already there
+		runner.measure("svg/load cached", [&](std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i) loadSVG(bitmap, file);
+		});
+	}
+}
+
+int benchMicro(std::string const& filter) {
+	const fs::path tmp = fs::temp_directory_path() / fs::unique_path("performous-bench-%%%%-%%%%");
+	fs::create_directories(tmp);
+	std::cout << std::fixed << std::setprecision(1) << "Microbenchmarks" << (filter.empty() ? "" : " matching " + filter)
+	  << " (median time per operation of " << RUNS << " runs)" << std::endl;
+	int ret = EXIT_SUCCESS;
+	Runner runner(filter);
+	try {
+		benchDSP(runner);
+		benchAudio(runner, tmp);
+		benchLibrary(runner, tmp);
+		benchImages(runner);
+		if (!runner.cases()) {
+			std::cerr << "ERROR: No benchmarks match " << filter << std::endl;
+			ret = EXIT_FAILURE;
+		}
+	} catch (std::exception& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		ret = EXIT_FAILURE;
+	}
+	boost::system::error_code ec;
+	fs::remove_all(tmp, ec);
+	return ret;
+}
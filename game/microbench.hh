@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+
+/**
+* Microbenchmarks of the core data paths (performous --bench-micro [filter]): FFT, ring buffer, pitch analysis,
+* audio buffer reads and music mixing of a generated track, filtering and sorting a generated library of 25k songs,
+* song parsing and cached SVG loading. Each case whose name contains filter is run repeatedly for a fixed time and the
+* median time per operation is printed, for comparing builds and machines. Returns the exit status. The user's song
+* cache and database are not touched.
+**/
+int benchMicro(std::string const& filter);
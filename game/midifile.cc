@@ -1,8 +1,10 @@
 #include "midifile.hh"
 
-#include <boost/filesystem/fstream.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <algorithm>
+#include <future>
 #include <iomanip>
+#include <iterator>
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
@@ -11,127 +13,139 @@
 #define MIDI_DEBUG_LEVEL 0
 
 
+/**
+ * @short A RIFF chunk of a MIDI file in memory. Reads are bounds checked against the chunk.
+ */
+
+class MidiChunk {
+  public:
+	std::string name;
+	MidiChunk(char const* data, size_t size, std::string const& name):
+	  name(name), m_begin(reinterpret_cast<unsigned char const*>(data)), m_pos(m_begin), m_end(m_begin + size) {}
+	bool has_more_data() const { return m_pos < m_end; }
+	uint8_t read_uint8() { return *consume(1); }
+	uint16_t read_uint16() { uint16_t v; return read(v); }
+	uint32_t read_uint32() { uint32_t v; return read(v); }
+	uint32_t read_varlen();
+	template <typename T> T read(T& value) {
+		unsigned char const* p = consume(sizeof(T));
+		value = 0;
+		for (size_t i = 0; i < sizeof(T); ++i) value = value << 8 | p[i];
+		return value;
+	}
+	std::string read_bytes(size_t size) { return std::string(reinterpret_cast<char const*>(consume(size)), size); }
+	void ignore(size_t size) { consume(size); }
+	void seek_back(size_t offset = 1);
+  private:
+	unsigned char const* consume(size_t bytes);
+	unsigned char const* m_begin;
+	unsigned char const* m_pos;
+	unsigned char const* m_end;
+};
+
 /**
  * @short The MidiStream class reads midifile for MidiFileParser.
  */
 
 class MidiStream {
   public:
-
 	/** Constructor.
 	 *
-	 * Creates MidiStream object that reads given midiFile.
+	 * Maps the whole file into memory (pages are read as the chunks are parsed, without copying).
 	 *
 	 * @param file MidiFile to be read
 	 */
 	MidiStream(fs::path const& file) {
-		fs::ifstream ifs(file, std::ios::binary);
 #if MIDI_DEBUG_LEVEL > 1
 		std::cout << "Opening file: " << file << std::endl;
 #endif
-		f << ifs.rdbuf();
-		f.exceptions(std::ios::failbit);
-	}
-
-	/// read bytes
-	std::string read_bytes(size_t bytes);
-
-	class Riff {
-	  public:
-		MidiStream& ms;
-		std::string name;
-		size_t pos;
-		size_t size;
-		size_t offset;
-		Riff(MidiStream& ms);
-		~Riff();
-		bool has_more_data() const { return offset < size; }
-		uint8_t read_uint8() { consume(1); return ms.f.get(); }
-		uint16_t read_uint16() { consume(2); return ms.read_uint16(); }
-		uint32_t read_uint32() { consume(4); return ms.read_uint32(); }
-		uint32_t read_varlen();
-		template <typename T> T read(T& value) {
-			consume(sizeof(T));
-			value = 0;
-			for (int i = sizeof(T) - 1; i >= 0; --i) value |= ms.f.get() << (8 * i);
-			return value;
+		try {
+			m_file.open(file.string());
+		} catch (std::exception&) {
+			throw std::runtime_error("Cannot open " + file.string());
 		}
-		std::string read_bytes(size_t size) { consume(size); return ms.read_bytes(size); }
-		void ignore(size_t size) { consume(size); ms.f.ignore(size); }
-		void seek_back(size_t offset = 1);
-	  private:
-		void consume(size_t bytes);
-	};
-
-private:
-
-	std::stringstream f;
-	uint16_t read_uint16() { return f.get() << 8 | f.get(); }
-	uint32_t read_uint32() { return f.get() << 24 | f.get() << 16 | f.get() << 8 | f.get(); }
-
+		if (!m_file.is_open()) throw std::runtime_error("Cannot open " + file.string());
+	}
+	bool has_more_data() const { return m_pos < m_file.size(); }
+	/// The next chunk of the file (the data stays owned by the stream)
+	MidiChunk next();
+  private:
+	boost::iostreams::mapped_file_source m_file;
+	size_t m_pos = 0;
 };
 
 namespace { bool is_not_alpha(char c) { return (c < 'A' || c > 'Z') && (c < 'a' || c > 'z'); } }
 
-MidiStream::Riff::Riff(MidiStream& ms): ms(ms), name(ms.read_bytes(4)), size(ms.read_uint32()), offset(0) {
+MidiChunk MidiStream::next() {
+	if (m_file.size() - m_pos < 8) throw std::runtime_error("Unexpected end of MIDI file");
+	MidiChunk header(m_file.data() + m_pos, m_file.size() - m_pos, "header");
+	std::string name = header.read_bytes(4);
 	if (std::find_if(name.begin(), name.end(), is_not_alpha) != name.end()) throw std::runtime_error("Invalid RIFF chunk name");
-	pos = ms.f.tellg();
-}
-
-MidiStream::Riff::~Riff() {
-#if MIDI_DEBUG_LEVEL > 0
-	if (has_more_data()) std::clog << "midistream/warning: Only " << offset << " of " << size << " bytes read of RIFF chunk " << name << std::endl;
-#endif
-	ms.f.seekg(pos + size);
+	size_t size = header.read_uint32();
+	m_pos += 8;
+	if (m_file.size() - m_pos < size) throw std::runtime_error("RIFF chunk " + name + " is truncated");
+	MidiChunk chunk(m_file.data() + m_pos, size, name);
+	m_pos += size;
+	return chunk;
 }
 
-uint32_t MidiStream::Riff::read_varlen() {
-	unsigned long value = 0;
-	size_t a = 0;
-	unsigned char c;
-	do {
-		if (++a > 4) throw std::runtime_error("Too long varlen sequence");
-		consume(1);
-		c = ms.f.get();
+uint32_t MidiChunk::read_varlen() {
+	// Decoded straight from the pointer; only a sequence near the end of the chunk needs checks per byte
+	unsigned char const* p = m_pos;
+	const size_t avail = std::min<size_t>(m_end - p, 4);
+	uint32_t value = 0;
+	for (size_t i = 0; i < avail; ++i) {
+		const unsigned char c = p[i];
 		value = (value << 7) | (c & 0x7F);
-	} while (c & 0x80);
-	return value;
-}
-
-std::string MidiStream::read_bytes(size_t bytes) {
-	std::string data;
-	for(size_t i=0; i < bytes; ++i) data += f.get();
-	return data;
+		if (!(c & 0x80)) { m_pos = p + i + 1; return value; }
+	}
+	if (avail == 4) throw std::runtime_error("Too long varlen sequence");
+	throw std::runtime_error("Read past the end of RIFF chunk " + name);
 }
 
-void MidiStream::Riff::consume(size_t bytes) {
-	if (size - offset < bytes) throw std::runtime_error("Read past the end of RIFF chunk " + name);
-	ms.f.seekg(pos + offset);
-	offset += bytes;
+unsigned char const* MidiChunk::consume(size_t bytes) {
+	if (size_t(m_end - m_pos) < bytes) throw std::runtime_error("Read past the end of RIFF chunk " + name);
+	unsigned char const* p = m_pos;
+	m_pos += bytes;
+	return p;
 }
 
-void MidiStream::Riff::seek_back(size_t o) {
-	if (offset < o) throw std::runtime_error("Seek past the beginning of RIFF chunk " + name);
-	offset -= o;
-	ms.f.seekg(pos + offset);
+void MidiChunk::seek_back(size_t o) {
+	if (size_t(m_pos - m_begin) < o) throw std::runtime_error("Seek past the beginning of RIFF chunk " + name);
+	m_pos -= o;
 }
 
 
-MidiFileParser::MidiFileParser(fs::path const& name):
+MidiFileParser::MidiFileParser(fs::path const& name, bool parallel):
   format(0), division(0), ts_last(0)
 {
 	MidiStream stream(name);
-	size_t ntracks = parse_header(stream);
-	if (format > 0) {
-		// First track is a control track
-		read_track(stream);
-		--ntracks;
+	MidiChunk header = stream.next();
+	size_t ntracks = parse_header(header);
+	std::vector<MidiChunk> chunks;
+	for (size_t i = 0; i < ntracks; ++i) chunks.push_back(stream.next());
+	// Tracks are independent of each other until their tempo changes, sections etc. are merged below
+	std::vector<TrackEvents> events(chunks.size());
+	std::vector<std::future<Track>> parsed;
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		auto read = [this, &chunks, &events, i] { return read_track(chunks[i], events[i]); };
+		parsed.push_back(std::async(parallel && chunks.size() > 1 ? std::launch::async : std::launch::deferred, read));
+	}
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		Track track = parsed[i].get();
+		if (format == 0 || i > 0) tracks.push_back(std::move(track));  // First track of format 1 is a control track
+	}
+	for (TrackEvents const& ev: events) {
+		for (auto const& tc: ev.tempochanges) add_tempo_change(tc.miditime, tc.value);
+		cmdevents.insert(cmdevents.end(), ev.cmdevents.begin(), ev.cmdevents.end());
+		ts_last = std::max(ts_last, ev.end);
+	}
+	for (TrackEvents const& ev: events) {
+		for (auto const& sect: ev.sections) midisections.push_back(MidiSection(sect.first, get_seconds(sect.second)));
 	}
-	for (size_t i = 0; i < ntracks; ++i) tracks.push_back(read_track(stream));
 }
 
-uint16_t MidiFileParser::parse_header(MidiStream& stream) {
-	MidiStream::Riff riff(stream);
+uint16_t MidiFileParser::parse_header(MidiChunk& riff) {
 	if (riff.name != "MThd") throw std::runtime_error("Header not found");
 	if (riff.read(format) > 1) throw std::runtime_error("Unsupported MIDI format (only 0 and 1 are supported)");
 	uint16_t ntracks = riff.read_uint16();
@@ -144,10 +158,10 @@ uint16_t MidiFileParser::parse_header(MidiStream& stream) {
 	return ntracks;
 }
 
-MidiFileParser::Track MidiFileParser::read_track(MidiStream& stream) {
-	MidiStream::Riff riff(stream);
+MidiFileParser::Track MidiFileParser::read_track(MidiChunk& riff, TrackEvents& events) const {
 	if (riff.name != "MTrk") throw std::runtime_error("Chunk MTrk not found");
 	Track track;
+	std::string lyric;
 	uint32_t miditime = 0;
 	uint8_t runningstatus = 0;
 	bool end = false;
@@ -175,7 +189,7 @@ MidiFileParser::Track MidiFileParser::read_track(MidiStream& stream) {
 			  case 0x01: { // Text Event
 				const std::string sect_pfx = "[section ";
 				// Lyrics are hidden here, only [text] are orders
-				if (data[0] != '[') m_lyric = data;
+				if (data[0] != '[') lyric = data;
 				else if (!data.compare(0, sect_pfx.length(), sect_pfx)) {// [section verse_1]
 					std::string sect_name = data.substr(sect_pfx.length(), data.length()-sect_pfx.length()-1);
 					if (sect_name != "big_rock_ending") {
@@ -187,12 +201,12 @@ MidiFileParser::Track MidiFileParser::read_track(MidiStream& stream) {
 						}
 						// replace gtr => guitar
 #if MIDI_DEBUG_LEVEL > 2
-						std::cout << "Section: " << sect_name << " at " << get_seconds(miditime) << std::endl;
+						std::cout << "Section: " << sect_name << " at miditime " << miditime << std::endl;
 #endif
-						midisections.push_back(MidiSection(sect_name, get_seconds(miditime)));
-					} else cmdevents.push_back(std::string(data)); // see songparser-ini.cc: we need to keep the BRE in cmdevents
+						events.sections.emplace_back(sect_name, miditime);
+					} else events.cmdevents.push_back(std::string(data)); // see songparser-ini.cc: we need to keep the BRE in cmdevents
 				}
-				else cmdevents.push_back(std::string(data));
+				else events.cmdevents.push_back(std::string(data));
 #if MIDI_DEBUG_LEVEL > 2
 				std::cout << "Text: " << data << std::endl;
 #endif
@@ -206,7 +220,7 @@ MidiFileParser::Track MidiFileParser::read_track(MidiStream& stream) {
 				break;
 			  // 0x04: Instrument Name
 			  case 0x05: // Lyric Text
-				m_lyric = data;
+				lyric = data;
 #if MIDI_DEBUG_LEVEL > 2
 				std::cout << "Lyric: " << data << std::endl;
 #endif
@@ -219,7 +233,7 @@ MidiFileParser::Track MidiFileParser::read_track(MidiStream& stream) {
 				break;
 			  case 0x51: // Tempo Setting
 				if (data.size() != 3) throw std::runtime_error("Invalid tempo change event");
-				add_tempo_change(miditime, static_cast<unsigned char>(data[0]) << 16 | static_cast<unsigned char>(data[1]) << 8 | static_cast<unsigned char>(data[2])); break;
+				events.tempochanges.emplace_back(miditime, static_cast<unsigned char>(data[0]) << 16 | static_cast<unsigned char>(data[1]) << 8 | static_cast<unsigned char>(data[2])); break;
 			  // 0x54: SMPTE Offset
 			  case 0x58: // Time Signature
 				if (data.size() != 4) throw std::runtime_error("Invalid time signature event");
@@ -253,10 +267,10 @@ MidiFileParser::Track MidiFileParser::read_track(MidiStream& stream) {
 			case 0xC: case 0xD: break;  // These only take one argument
 			default: throw std::runtime_error("Unknown MIDI event");  // Quite possibly this is impossible, but I am too tired to prove it.
 			}
-			process_midi_event(track, ev, arg1, arg2, miditime);
+			process_midi_event(track, lyric, ev, arg1, arg2, miditime);
 		}
 	}
-	if (miditime > ts_last) ts_last = miditime;
+	events.end = miditime;
 	return track;
 }
 
@@ -272,10 +286,12 @@ void MidiFileParser::add_tempo_change(uint32_t miditime, uint32_t tempo) {
 #if MIDI_DEBUG_LEVEL > 2
 	std::cout << "Tempo change at miditime=" << miditime << ":  " << tempo << " us/QN  " << 6e7 / tempo << " BPM" << std::endl;
 #endif
-	tempochanges.push_back(TempoChange(miditime, tempo));
+	uint64_t time = 0;
+	if (!tempochanges.empty()) time = tempochanges.back().time + static_cast<uint64_t>(tempochanges.back().value) * (miditime - tempochanges.back().miditime);
+	tempochanges.push_back(TempoChange(miditime, tempo, time));
 }
 
-void MidiFileParser::cout_midi_event(uint8_t t, uint8_t arg1, uint8_t arg2, uint32_t miditime) {
+void MidiFileParser::cout_midi_event(uint8_t t, uint8_t arg1, uint8_t arg2, uint32_t miditime) const {
 	std::cout << "Midi event:" << std::setw(12) << miditime << std::fixed << std::setprecision(2) << std::setw(12) << get_seconds(miditime) << "  ";
 	switch (t) {
 	  case 0x8: std::cout << "note off   pitch=" << int(arg1) << " velocity=" << int(arg2); break;
@@ -290,19 +306,16 @@ void MidiFileParser::cout_midi_event(uint8_t t, uint8_t arg1, uint8_t arg2, uint
 	std::cout << std::endl;
 }
 
-uint64_t MidiFileParser::get_us(uint32_t miditime) {
+uint64_t MidiFileParser::get_us(uint32_t miditime) const {
 	if (tempochanges.empty()) throw std::runtime_error("Unable to calculate note duration without tempo");
-	uint64_t time = 0;
-	auto i = tempochanges.begin();
-	// TODO: cache previous
-	for (; i + 1 != tempochanges.end() && (i + 1)->miditime < miditime; ++i) {
-		time += static_cast<uint64_t>(i->value) * ((i + 1)->miditime - i->miditime);
-	}
-	time += static_cast<uint64_t>(i->value) * (miditime - i->miditime);
-	return time / division;
+	// The last tempo change before miditime (or the first one, which is at zero)
+	auto i = std::lower_bound(tempochanges.begin(), tempochanges.end(), miditime,
+	  [](TempoChange const& tc, uint32_t t) { return tc.miditime < t; });
+	if (i != tempochanges.begin()) --i;
+	return (i->time + static_cast<uint64_t>(i->value) * (miditime - i->miditime)) / division;
 }
 
-void MidiFileParser::process_midi_event(Track& track, uint8_t t, uint8_t arg1, uint8_t arg2, uint32_t miditime) {
+void MidiFileParser::process_midi_event(Track& track, std::string& lyric, uint8_t t, uint8_t arg1, uint8_t arg2, uint32_t miditime) const {
 #if MIDI_DEBUG_LEVEL > 3
 	cout_midi_event(t, arg1, arg2, miditime);
 #endif
@@ -324,9 +337,9 @@ void MidiFileParser::process_midi_event(Track& track, uint8_t t, uint8_t arg1, u
 		if( arg1 < 20 ) return;
 		if (t == 8 || (t == 9 && arg2 == 0)) {
 			// end of note (note off or note on with zero velocity)
-			if( !m_lyric.empty()  ) {
-				// here we should update the last note lyric with the current m_lyric
-				track.lyrics.back().lyric = m_lyric;
+			if( !lyric.empty()  ) {
+				// here we should update the last note lyric with the current lyric
+				track.lyrics.back().lyric = lyric;
 				// here we should update the last note end time with the miditime
 				track.lyrics.back().end = miditime;
 			} else {
@@ -335,7 +348,7 @@ void MidiFileParser::process_midi_event(Track& track, uint8_t t, uint8_t arg1, u
 					track.lyrics.pop_back();
 				}
 			}
-			m_lyric.clear();
+			lyric.clear();
 		} else {
 			// beginning of note then
 			// here we should add a lyric with the start time at miditime
@@ -27,7 +27,7 @@ class MidiEvent {
 
 #endif
 
-class MidiStream;
+class MidiChunk;
 
 /**
  * The Parser class, that contains needed information of given midi-file
@@ -42,12 +42,13 @@ public:
 	 *
 	 * @param name Name of midifile, which want to be read
 	 */
-	MidiFileParser(fs::path const& name);
+	MidiFileParser(fs::path const& name, bool parallel = false);
 
 	struct TempoChange {
 		uint32_t miditime;
 		uint32_t value;
-		TempoChange(uint32_t miditime, uint32_t value): miditime(miditime), value(value) {}
+		uint64_t time;  ///< Microseconds times division at miditime (set by add_tempo_change)
+		TempoChange(uint32_t miditime, uint32_t value, uint64_t time = 0): miditime(miditime), value(value), time(time) {}
 	};
 	typedef std::vector<TempoChange> TempoChanges;
 	TempoChanges tempochanges;
@@ -82,21 +83,26 @@ public:
 	};
 	typedef std::vector<MidiSection> MidiSections;
 	MidiSections midisections; ///< vector of song sections
-	uint16_t parse_header(MidiStream&);
-	Track read_track(MidiStream&);
-	void cout_midi_event(uint8_t type, uint8_t arg1, uint8_t arg2, uint32_t miditime);
-	void process_midi_event(Track& track, uint8_t type, uint8_t arg1, uint8_t arg2, uint32_t miditime);
-	uint64_t get_us(uint32_t miditime);
-	double get_seconds(uint32_t miditime) { return 1e-6 * get_us(miditime); }
-	void add_tempo_change(uint32_t miditime, uint32_t tempo);
-	uint16_t format;
 	typedef std::vector<std::string> CommandEvents;
 	CommandEvents cmdevents;
+	/// Everything of a MTrk chunk besides its notes, merged into the parser in file order (chunks may be read in parallel)
+	struct TrackEvents {
+		CommandEvents cmdevents;
+		std::vector<std::pair<std::string, uint32_t>> sections;  ///< Names and miditimes
+		TempoChanges tempochanges;
+		uint32_t end = 0;  ///< Miditime of the end of the track
+	};
+	uint16_t parse_header(MidiChunk&);
+	Track read_track(MidiChunk&, TrackEvents&) const;
+	void cout_midi_event(uint8_t type, uint8_t arg1, uint8_t arg2, uint32_t miditime) const;
+	void process_midi_event(Track& track, std::string& lyric, uint8_t type, uint8_t arg1, uint8_t arg2, uint32_t miditime) const;
+	uint64_t get_us(uint32_t miditime) const;
+	double get_seconds(uint32_t miditime) const { return 1e-6 * get_us(miditime); }
+	void add_tempo_change(uint32_t miditime, uint32_t tempo);
+	uint16_t format;
 
 	/** Ticks per beat == number of divisions per every quarter note **/
 	uint16_t division;
 	uint32_t ts_last;
-private:
-	std::string m_lyric;
 };
 
@@ -9,7 +9,7 @@ MusicalScale& MusicalScale::clear() { m_freq = m_note = getNaN(); return *this;
 
 MusicalScale& MusicalScale::setFreq(double freq) {
 	m_freq = freq;
-	m_note = m_baseId + 12.0 * std::log(freq / m_baseFreq) / std::log(2.0);
+	m_note = m_baseId + 12.0 * std::log2(freq / m_baseFreq);
 	if (!isValid()) m_note = getNaN();
 	return *this;
 }
@@ -0,0 +1,129 @@
+#include "netmic.hh"
+
+#include "log.hh"
+#include "pitch.hh"
+#include "threads.hh"
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace asio = boost::asio;
+using asio::ip::udp;
+
+namespace {
+	const std::size_t HEADER = 12;  ///< Bytes before the samples
+	const std::size_t MAX_FRAMES = 4096;  ///< Per packet
+	const unsigned MAX_DEPTH = 8;  ///< Packets of the jitter buffer
+	const unsigned WINDOW = 4;  ///< Sequence numbers further ahead than this many times the depth mean a restart
+	const std::size_t SLOTS = WINDOW * MAX_DEPTH;  ///< Of the jitter buffer, a power of two so that they survive 2^32 wrap
+	std::uint16_t le16(unsigned char const* p) { return p[0] | p[1] << 8; }
+	std::uint32_t le32(unsigned char const* p) { return p[0] | p[1] << 8 | p[2] << 16 | std::uint32_t(p[3]) << 24; }
+}
+
+struct NetworkMics::Socket {
+	asio::io_service service;
+	udp::socket socket{ service };
+};
+
+NetworkMics::NetworkMics(unsigned in, unsigned short port, double rate, unsigned depth, double latency):
+  port(port), rate(rate), mics(in, nullptr), m_depth(std::min(std::max(depth, 1u), MAX_DEPTH)), m_latency(latency), m_socket(std::make_unique<Socket>())
+{
+	boost::system::error_code ec;
+	m_socket->socket.open(udp::v4(), ec);
+	if (!ec) m_socket->socket.bind(udp::endpoint(udp::v4(), port), ec);
+	if (ec) throw std::runtime_error("Cannot listen on UDP port " + std::to_string(port) + ": " + ec.message());
+}
+
+NetworkMics::~NetworkMics() {
+	m_quit = true;
+	if (m_thread.joinable()) {
+		// Wake up the receiving thread with an empty datagram
+		boost::system::error_code ec;
+		udp::socket wake(m_socket->service);
+		wake.open(udp::v4(), ec);
+		char none = 0;
+		wake.send_to(asio::buffer(&none, 0), udp::endpoint(asio::ip::address_v4::loopback(), port), 0, ec);
+		m_thread.join();
+	}
+	for (std::size_t i = 0; i < m_streams.size(); ++i) {
+		Stream const& s = m_streams[i];
+		if (s.received) {
+			LOG("audio", debug) << "Network mic " << mics[i]->getId() << ": " << s.received << " packets, "
+			  << s.lost << " lost, " << s.late << " late" << std::endl;
+		}
+	}
+}
+
+void NetworkMics::start() {
+	m_streams.resize(mics.size());
+	for (std::size_t i = 0; i < mics.size(); ++i) if (mics[i]) m_streams[i].slots.resize(SLOTS);
+	for (Analyzer* a: mics) if (a) a->setLatency(m_latency);
+	m_thread = std::thread(&NetworkMics::run, this);
+}
+
+void NetworkMics::run() {
+	threads::enter(threads::Class::audio, "network mics");  // Input for the analyzers, like the audio callback
+	std::vector<unsigned char> buf(HEADER + 2 * MAX_FRAMES);
+	std::vector<udp::endpoint> senders(mics.size());
+	udp::endpoint sender;
+	while (true) {
+		boost::system::error_code ec;
+		const std::size_t size = m_socket->socket.receive_from(asio::buffer(buf), sender, 0, ec);
+		if (m_quit) return;
+		if (ec) continue;  // E.g. ICMP errors of earlier sends reported on Windows
+		if (size < HEADER || !std::equal(buf.begin(), buf.begin() + 4, "PMIC")) continue;
+		const unsigned mic = buf[4];
+		const std::size_t frames = le16(&buf[6]);
+		if (mic >= mics.size() || !mics[mic] || size != HEADER + 2 * frames) continue;
+		if (sender != senders[mic]) {
+			senders[mic] = sender;
+			std::clog << "audio/info: Network mic " << mics[mic]->getId() << " streaming from " << sender << std::endl;
+		}
+		receive(mic, le32(&buf[8]), &buf[HEADER], frames);
+	}
+}
+
+void NetworkMics::receive(unsigned mic, std::uint32_t seq, unsigned char const* data, std::size_t frames) {
+	Stream& s = m_streams[mic];
+	Analyzer& analyzer = *mics[mic];
+	++s.received;
+	// Packets further off than reordering can explain mean that the sender restarted or the network was out
+	const std::int32_t ahead = seq - s.next;  // Modulo 2^32
+	const std::int32_t window = WINDOW * m_depth;
+	if (!s.started || ahead >= window || ahead < -window) {
+		s.started = true;
+		for (Slot& slot: s.slots) slot.filled = false;
+		s.pending = 0;
+		s.next = seq;
+	} else if (ahead < 0) {
+		++s.late;  // Already replaced by silence
+		return;
+	}
+	if (frames != s.frames) {
+		s.frames = frames;
+		s.silence.assign(frames, 0.0f);
+		analyzer.setLatency(m_latency + m_depth * s.frames / rate);
+	}
+	// Within the window each sequence number has a slot of its own; a duplicate replaces the earlier copy
+	Slot& slot = s.slots[seq % SLOTS];
+	if (!slot.filled) ++s.pending;
+	slot.filled = true;
+	slot.samples.resize(frames);  // Keeps the capacity of earlier packets
+	for (std::size_t i = 0; i < frames; ++i) slot.samples[i] = std::int16_t(le16(data + 2 * i)) / 32768.0f;
+	// Feed what is in sequence, waiting for a missing packet only while fewer than depth packets are queued behind it
+	while (s.pending) {
+		Slot& next = s.slots[s.next % SLOTS];
+		if (next.filled) {
+			analyzer.input(next.samples.begin(), next.samples.end());
+			next.filled = false;
+			--s.pending;
+		} else if (s.pending > m_depth) {
+			++s.lost;
+			analyzer.input(s.silence.begin(), s.silence.end());
+		} else break;
+		++s.next;
+	}
+}
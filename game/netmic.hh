@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Analyzer;
+
+/**
+* A virtual input device for microphones streamed over the network, e.g. by phones, so that more singers can join
+* without more wireless mics. It listens on a UDP port where each datagram holds one packet of one mic:
+*   "PMIC", mic index (uint8), unused (uint8), frame count (uint16), sequence number (uint32), mono samples (int16)
+* all little-endian, with the samples at the rate of the device. The mics feed their analyzers just like the
+* channels of a sound card. A jitter buffer of a few packets per mic puts reordered packets back in sequence and
+* fills in lost ones with silence, so that the analysis keeps time. Its depth is included in the latency of the
+* mics (see Analyzer::latency), which the engine compensates for in addition to audio/round-trip.
+**/
+class NetworkMics {
+  public:
+	/// Listen on port for in mics sampled at rate, buffering up to depth packets per mic. The latency of the
+	/// transport (from the sender's input to receiving here) is given in seconds.
+	NetworkMics(unsigned in, unsigned short port, double rate, unsigned depth, double latency);
+	~NetworkMics();
+	NetworkMics(NetworkMics const&) = delete;
+	NetworkMics& operator=(NetworkMics const&) = delete;
+	/// Start receiving (the mics must be assigned by then)
+	void start();
+	const unsigned short port;
+	const double rate;
+	std::vector<Analyzer*> mics;  ///< By mic index of the packets, nullptr if not used
+	std::string spec;  ///< The audio/devices line that opened it
+  private:
+	struct Socket;
+	/// A packet waiting in a jitter buffer, reused so that receiving does not allocate once the streams are running
+	struct Slot {
+		bool filled = false;
+		std::vector<float> samples;
+	};
+	/// Jitter buffer of a mic
+	struct Stream {
+		bool started = false;
+		std::uint32_t next = 0;  ///< Sequence number of the next packet to feed to the analyzer
+		std::size_t frames = 0;  ///< Of the latest packet (the duration of silence for a lost one)
+		std::vector<Slot> slots;  ///< Packets received ahead of next, by sequence number modulo their count
+		std::size_t pending = 0;  ///< Filled slots
+		std::vector<float> silence;  ///< Fed for a lost packet
+		std::size_t received = 0, lost = 0, late = 0;
+	};
+	void run();
+	/// Add a packet of frames samples (int16 little-endian) to the jitter buffer of mic and feed the analyzer with
+	/// what is in sequence
+	void receive(unsigned mic, std::uint32_t seq, unsigned char const* data, std::size_t frames);
+	const unsigned m_depth;
+	const double m_latency;  ///< Of the transport, without the jitter buffer
+	std::vector<Stream> m_streams;  ///< Only accessed by the receiving thread
+	std::unique_ptr<Socket> m_socket;
+	std::atomic<bool> m_quit{ false };
+	std::thread m_thread;
+};
@@ -5,10 +5,12 @@
 #include "engine.hh"
 #include "player.hh"
 
+#include <algorithm>
+
 Dimensions dimensions; // Make a public member variable
 
 NoteGraph::NoteGraph(VocalTrack const& vocal):
-  m_vocal(vocal),
+  m_barsUnit(getNaN()), m_vocal(vocal),
   m_notelines(findFile("notelines.svg")), m_wave(findFile("wave.svg")),
   m_star(findFile("star.svg")), m_star_hl(findFile("star_glow.svg")),
   m_notebar(findFile("notebar.svg")), m_notebar_hl(findFile("notebar_hi.svg")),
@@ -25,40 +27,46 @@ NoteGraph::NoteGraph(VocalTrack const& vocal):
 
 void NoteGraph::reset() {
 	m_songit = m_vocal.notes.begin();
+	m_waves.clear();
 }
 
 namespace {
-	void drawNotebar(Texture const& texture, double x, double ybeg, double yend, double w, double h) {
-		glutil::VertexArray va;
-		UseTexture tblock(texture);
+	/// Vertices of a note bar (a strip of eight as separate triangles, so that bars can be drawn together)
+	const unsigned BAR_VERTICES = 18;
 
+	/// Append a note bar as GL_TRIANGLES
+	void notebar(glutil::VertexArray& va, double x, double ybeg, double yend, double w, double h, float alpha = 1.0f) {
+		struct Point { float s, t; double x, y; } strip[8];
 		// The front cap begins
-		va.texCoord(0.0f, 0.0f).vertex(x, ybeg);
-		va.texCoord(0.0f, 1.0f).vertex(x, ybeg + h);
+		strip[0] = { 0.0f, 0.0f, x, ybeg };
+		strip[1] = { 0.0f, 1.0f, x, ybeg + h };
 		if (w >= 2.0 * h) {
 			// Calculate the y coordinates of the middle part
 			double tmp = h / w;  // h = cap size (because it is a h by h square)
 			double y1 = (1.0 - tmp) * ybeg + tmp * yend;
 			double y2 = tmp * ybeg + (1.0 - tmp) * yend;
 			// The middle part between caps
-			va.texCoord(0.5f, 0.0f).vertex(x + h, y1);
-			va.texCoord(0.5f, 1.0f).vertex(x + h, y1 + h);
-			va.texCoord(0.5f, 0.0f).vertex(x + w - h, y2);
-			va.texCoord(0.5f, 1.0f).vertex(x + w - h, y2 + h);
+			strip[2] = { 0.5f, 0.0f, x + h, y1 };
+			strip[3] = { 0.5f, 1.0f, x + h, y1 + h };
+			strip[4] = { 0.5f, 0.0f, x + w - h, y2 };
+			strip[5] = { 0.5f, 1.0f, x + w - h, y2 + h };
 		} else {
 			// Note is too short to even fit caps, crop to fit.
 			double ymid = 0.5 * (ybeg + yend);
 			float crop = 0.25f * w / h;
-			va.texCoord(crop, 0.0f).vertex(x + 0.5 * w, ymid);
-			va.texCoord(crop, 1.0f).vertex(x + 0.5 * w, ymid + h);
-			va.texCoord(1.0f - crop, 0.0f).vertex(x + 0.5 * w, ymid);
-			va.texCoord(1.0f - crop, 1.0f).vertex(x + 0.5 * w, ymid + h);
+			strip[2] = { crop, 0.0f, x + 0.5 * w, ymid };
+			strip[3] = { crop, 1.0f, x + 0.5 * w, ymid + h };
+			strip[4] = { 1.0f - crop, 0.0f, x + 0.5 * w, ymid };
+			strip[5] = { 1.0f - crop, 1.0f, x + 0.5 * w, ymid + h };
 		}
 		// The rear cap ends
-		va.texCoord(1.0f, 0.0f).vertex(x + w, yend);
-		va.texCoord(1.0f, 1.0f).vertex(x + w, yend + h);
+		strip[6] = { 1.0f, 0.0f, x + w, yend };
+		strip[7] = { 1.0f, 1.0f, x + w, yend + h };
 
-		va.draw();
+		const glmath::vec4 c(1.0f, 1.0f, 1.0f, alpha);
+		for (unsigned i = 0; i + 2 < 8; ++i) {
+			for (unsigned j = i; j < i + 3; ++j) va.texCoord(strip[j].s, strip[j].t).color(c).vertex(strip[j].x, strip[j].y);
+		}
 	}
 }
 
@@ -121,12 +129,14 @@ void NoteGraph::draw(double time, Database const& database, Position position) {
 	ColorTrans c(Color::alpha(m_notealpha));
 
 	drawNotes();
-	if (config["game/pitch"].b()) drawWaves(database);
+	static ConfigItem& pitch = config["game/pitch"];
+	if (pitch.b()) drawWaves(database);
 
 	// Draw a star for well sung notes
 	for (auto it = m_songit; it != m_vocal.notes.end() && it->begin < m_time - (baseLine - 0.5) / pixUnit; ++it) {
 		float player_star_offset = 0;
-		for (std::vector<Color>::const_iterator it_col = it->stars.begin(); it_col != it->stars.end(); ++it_col) {
+		for (unsigned star = 0; star < it->stars.size(); ++star) {
+			const Color color = it->stars[star];
 			double x = m_baseX + it->begin * pixUnit + m_noteUnit; // left x coordinate: begin minus border (side borders -noteUnit wide)
 			double w = (it->end - it->begin) * pixUnit - m_noteUnit * 2.0; // width: including borders on both sides
 			float hh = -m_noteUnit;
@@ -138,7 +148,7 @@ void NoteGraph::draw(double time, Database const& database, Position position) {
 			using namespace glmath;
 			Transform trans(translate(vec3(centerx, centery, 0.0f)) * rotate(rot, vec3(0.0f, 0.0f, 1.0f)));
 			{
-				ColorTrans c(Color(it_col->r, it_col->g, it_col->b, it_col->a));
+				ColorTrans c(color);
 				m_star_hl.draw(Dimensions().stretch(zoom*1.2, zoom*1.2).center().middle(), TexCoords());
 			}
 			m_star.draw(Dimensions().stretch(zoom, zoom).center().middle(), TexCoords());
@@ -147,21 +157,61 @@ void NoteGraph::draw(double time, Database const& database, Position position) {
 	}
 }
 
+void NoteGraph::buildBars() {
+	glutil::VertexArray va[2];
+	for (auto& bars: m_bars) bars.begins.clear();
+	for (auto const& n: m_vocal.notes) {
+		unsigned kind;
+		switch (n.type) {
+			case Note::NORMAL: case Note::SLIDE: kind = 0; break;
+			case Note::GOLDEN: case Note::GOLDEN2: kind = 1; break;
+			default: continue;  // Not a bar
+		}
+		// Same as in drawNotes, without m_baseX and m_baseY
+		double x = n.begin * pixUnit + m_noteUnit;
+		double ybeg = (n.notePrev + 1) * m_noteUnit;
+		double yend = (n.note + 1) * m_noteUnit;
+		double w = (n.end - n.begin) * pixUnit - m_noteUnit * 2.0;
+		double h = -m_noteUnit * 2.0;
+		notebar(va[kind], x, ybeg, yend, w, h);
+		m_bars[kind].begins.push_back(n.begin);
+	}
+	for (unsigned kind = 0; kind < 2; ++kind) m_bars[kind].buffer.upload(va[kind]);
+	m_barsUnit = m_noteUnit;
+}
+
 void NoteGraph::drawNotes() {
 	// Draw note lines
 	m_notelines.draw(Dimensions().stretch(dimensions.w(), (m_max - m_min - 13) * m_noteUnit).middle(dimensions.xc()).center(dimensions.yc()), TexCoords(0.0, (-m_min - 7.0) / 12.0f, 1.0, (-m_max + 6.0) / 12.0f));
 
-	// Draw notes
-	for (auto it = m_songit; it != m_vocal.notes.end() && it->begin < m_time - (baseLine - 0.5) / pixUnit; ++it) {
+	const double endTime = m_time - (baseLine - 0.5) / pixUnit;
+	// Bars only change shape when zooming, otherwise the cached ones are just moved into place
+	if (m_noteUnit != m_barsUnit) buildBars();
+	if (m_songit != m_vocal.notes.end()) {
+		using namespace glmath;
+		Transform trans(translate(vec3(m_baseX, m_baseY, 0.0f)));
+		Texture const* textures[2] = { &m_notebar, &m_notebargold };
+		for (unsigned kind = 0; kind < 2; ++kind) {
+			auto const& begins = m_bars[kind].begins;
+			auto first = std::lower_bound(begins.begin(), begins.end(), m_songit->begin);
+			auto last = std::lower_bound(first, begins.end(), endTime);
+			if (first == last) continue;
+			UseTexture tblock(*textures[kind]);
+			m_bars[kind].buffer.draw(GL_TRIANGLES, (first - begins.begin()) * BAR_VERTICES, (last - first) * BAR_VERTICES);
+		}
+	}
+
+	// Highlights (by how well each note has been sung so far) and freestyle notes are drawn each frame
+	glutil::VertexArray highlights[2];
+	for (auto it = m_songit; it != m_vocal.notes.end() && it->begin < endTime; ++it) {
 		if (it->type == Note::SLEEP) continue;
 		double alpha = it->power;
-		Texture* t1;
-		Texture* t2;
+		unsigned kind;
 		switch (it->type) {
-			case Note::NORMAL: case Note::SLIDE: t1 = &m_notebar; t2 = &m_notebar_hl; break;
+			case Note::NORMAL: case Note::SLIDE: kind = 0; break;
 			case Note::GOLDEN:
 			case Note::GOLDEN2: //fallthrough
-				t1 = &m_notebargold; t2 = &m_notebargold_hl;
+				kind = 1;
 			break;
 			case Note::FREESTYLE:  // Freestyle notes use custom handling
 			case Note::RAP: //handle RAP notes like freestyle for now
@@ -183,11 +233,13 @@ void NoteGraph::drawNotes() {
 		double yend = m_baseY + (it->note + 1) * m_noteUnit; // top y coordinate (on the one higher note line)
 		double w = (it->end - it->begin) * pixUnit - m_noteUnit * 2.0; // width: including borders on both sides
 		double h = -m_noteUnit * 2.0; // height: 0.5 border + 1.0 bar + 0.5 border = 2.0
-		drawNotebar(*t1, x, ybeg, yend, w, h);
-		if (alpha > 0.0) {
-			ColorTrans c(Color::alpha(alpha));
-			drawNotebar(*t2, x, ybeg, yend, w, h);
-		}
+		if (alpha > 0.0) notebar(highlights[kind], x, ybeg, yend, w, h, alpha);
+	}
+	Texture const* textures[2] = { &m_notebar_hl, &m_notebargold_hl };
+	for (unsigned kind = 0; kind < 2; ++kind) {
+		if (highlights[kind].empty()) continue;
+		UseTexture tblock(*textures[kind]);
+		highlights[kind].draw(GL_TRIANGLES);
 	}
 }
 
@@ -198,61 +250,72 @@ namespace {
 	}
 }
 
+void NoteGraph::updateWave(Wave& wave, Player const& player) {
+	PitchHistory const& pitch = player.m_pitch;
+	size_t const endIdx = player.m_pos;
+	if (endIdx < wave.points.size()) wave.points.clear();  // Started over
+	if (wave.points.empty()) wave.noteIt = m_vocal.notes.begin();
+	size_t idx = wave.points.size();
+	double t = idx * Engine::TIMESTEP;
+	MusicalScale scale(m_vocal.scale);
+	for (; idx < endIdx; ++idx, t += Engine::TIMESTEP) {
+		WavePoint const* prev = idx ? &wave.points.back() : nullptr;
+		bool const voiced = prev && prev->val == prev->val;
+		// If not voiced, we have nothing to process
+		if (!pitch.voiced(idx)) { wave.points.push_back(WavePoint{ getNaN(), 0.0f, 0.0f, false }); continue; }
+		double const freq = pitch.freq(idx);
+		float phase = (voiced ? prev->phase : 0.0f) + freq * 0.001; // Wave phase (texture coordinate)
+		// Find the currently active note(s)
+		auto& noteIt = wave.noteIt;
+		while (noteIt != m_vocal.notes.end() && (noteIt->type == Note::SLEEP || t > noteIt->end)) ++noteIt;
+		auto notePrev = noteIt;
+		while (notePrev != m_vocal.notes.begin() && (notePrev->type == Note::SLEEP || t < notePrev->begin)) --notePrev;
+		bool hasNote = (noteIt != m_vocal.notes.end());
+		bool hasPrev = notePrev->type != Note::SLEEP && t >= notePrev->begin;
+		double val;
+		if (hasNote && hasPrev) val = 0.5 * (noteIt->note + notePrev->note);
+		else if (hasNote) val = noteIt->note;
+		else val = notePrev->note;
+		// Now val contains the active note value. The following calculates note value for current freq:
+		val += Note::diff(val, scale.setFreq(freq).getNote());
+		double thickness = clamp(1.0 + pitch.db(idx) / 60.0) + 0.5;
+		// If there has been a break or if the pitch change is too fast, a new strip begins
+		bool join = voiced && std::abs(prev->val - val) <= 1;
+		wave.points.push_back(WavePoint{ float(val), phase, float(thickness), join });
+	}
+}
+
 void NoteGraph::drawWaves(Database const& database) {
 	if (m_vocal.notes.empty()) return; // Cannot draw without notes
 	UseTexture tblock(m_wave);
 	for (auto const& player: database.cur) {
 		if (player.m_vocal.name != m_vocal.name)
 			continue;
+		Wave& wave = m_waves[&player];
+		updateWave(wave, player);
 		float const texOffset = 2.0 * m_time; // Offset for animating the wave texture
-		Player::pitch_t const& pitch = player.m_pitch;
 		size_t const beginIdx = std::max(0.0, m_time - 0.5 / pixUnit) / Engine::TIMESTEP; // At which pitch idx to start displaying the wave
-		size_t const endIdx = player.m_pos;
-		size_t idx = beginIdx;
-		// Go back until silence (NaN freq) to allow proper wave phase to be calculated
-		if (beginIdx < endIdx) while (idx > 0 && pitch[idx].first == pitch[idx].first) --idx;
-		// Start processing
-		float tex = texOffset;
-		double t = idx * Engine::TIMESTEP;
-		double oldval = getNaN();
+		size_t const endIdx = wave.points.size();
+		double t = beginIdx * Engine::TIMESTEP;
 		glutil::VertexArray va;
-		auto noteIt = m_vocal.notes.begin();
 		glmath::vec4 c(player.m_color.r, player.m_color.g, player.m_color.b, 1.0);
-		for (; idx < endIdx; ++idx, t += Engine::TIMESTEP) {
-			double const freq = pitch[idx].first;
-			// If freq is NaN, we have nothing to process
-			if (freq != freq) { oldval = getNaN(); tex = texOffset; continue; }
-			tex += freq * 0.001; // Wave phase (texture coordinate)
-			if (idx < beginIdx) continue; // Skip graphics rendering if out of screen
-			double x = -0.2 + (t - m_time) * pixUnit;
-			// Find the currently active note(s)
-			while (noteIt != m_vocal.notes.end() && (noteIt->type == Note::SLEEP || t > noteIt->end)) ++noteIt;
-			auto notePrev = noteIt;
-			while (notePrev != m_vocal.notes.begin() && (notePrev->type == Note::SLEEP || t < notePrev->begin)) --notePrev;
-			bool hasNote = (noteIt != m_vocal.notes.end());
-			bool hasPrev = notePrev->type != Note::SLEEP && t >= notePrev->begin;
-			double val;
-			if (hasNote && hasPrev) val = 0.5 * (noteIt->note + notePrev->note);
-			else if (hasNote) val = noteIt->note;
-			else val = notePrev->note;
-			// Now val contains the active note value. The following calculates note value for current freq:
-			val += Note::diff(val, MusicalScale(m_vocal.scale).setFreq(freq).getNote());
+		for (size_t idx = beginIdx; idx < endIdx; ++idx, t += Engine::TIMESTEP) {
+			WavePoint const& p = wave.points[idx];
+			if (p.val != p.val) continue;
 			// Graphics positioning & animation:
-			double y = m_baseY + val * m_noteUnit;
-			double thickness = clamp(1.0 + pitch[idx].second / 60.0) + 0.5;
-			thickness *= 1.0 + 0.2 * std::sin(tex - 2.0 * texOffset); // Further animation :)
+			float tex = texOffset + p.phase;
+			double x = -0.2 + (t - m_time) * pixUnit;
+			double y = m_baseY + p.val * m_noteUnit;
+			double thickness = p.thickness * (1.0 + 0.2 * std::sin(p.phase - texOffset)); // Further animation :)
 			thickness *= -m_noteUnit;
-			// If there has been a break or if the pitch change is too fast, terminate and begin a new one
-			if (oldval != oldval || std::abs(oldval - val) > 1) strip(va);
+			if (!p.join) strip(va);
 			// Add a point or a pair of points
 			if (!va.size()) va.texCoord(tex, 0.5f).color(c).vertex(x, y);
 			else {
 				va.texCoord(tex, 0.0f).color(c).vertex(x, y - thickness);
 				va.texCoord(tex, 1.0f).color(c).vertex(x, y + thickness);
 			}
-			oldval = val;
 		}
 		strip(va);
 	}
 }
-
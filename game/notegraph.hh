@@ -3,9 +3,12 @@
 #include "animvalue.hh"
 #include "texture.hh"
 #include "notes.hh"
+#include <map>
+#include <vector>
 
 class Song;
 class Database;
+class Player;
 
 /// handles drawing of notes and waves
 class NoteGraph {
@@ -23,8 +26,31 @@ class NoteGraph {
   private:
 	/// draw notebars
 	void drawNotes();
+	/// (re)build m_bars for the current note unit
+	void buildBars();
 	/// draw waves (what players are singing)
 	void drawWaves(Database const& database);
+	/// Note bars of the whole song, built relative to m_baseX and m_baseY for one note unit
+	struct Bars {
+		glutil::VertexBuffer buffer;
+		std::vector<double> begins;  ///< Begin times of the notes, BAR_VERTICES vertices each
+	};
+	Bars m_bars[2];  ///< Normal and golden notes
+	double m_barsUnit;  ///< m_noteUnit that m_bars were built for (NaN if none)
+	/// A sample of a pitch wave, computed once when the sample arrives
+	struct WavePoint {
+		float val;  ///< Note value (NaN for silence)
+		float phase;  ///< Wave phase since the beginning of the sung part
+		float thickness;  ///< Base thickness (in note units)
+		bool join;  ///< Continues the strip of the previous point
+	};
+	struct Wave {
+		std::vector<WavePoint> points;  ///< Indexed by pitch sample
+		Notes::const_iterator noteIt;  ///< Note active at the last point
+	};
+	/// Append the pitch samples that player has got since the last frame
+	void updateWave(Wave& wave, Player const& player);
+	std::map<Player const*, Wave> m_waves;
 	VocalTrack const& m_vocal;
 	Texture m_notelines;
 	Texture m_wave;
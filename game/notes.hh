@@ -1,5 +1,7 @@
 ﻿#pragma once
 
+#include <array>
+#include <cstdint>
 #include <map>
 #include <string>
 #include <vector>
@@ -46,6 +48,26 @@ static inline bool isTrackInside(InstrumentTracks const& track_map, std::string
 	return track_map.find(name) != track_map.end();
 }
 
+/// Colors of the players who sang a note well, stored in the note itself (with 8-bit components) rather than allocated per note
+class Stars {
+  public:
+	static const unsigned MAX = 8;  ///< Stars beyond this (more singers) are not shown
+	void push_back(Color const& c) {
+		if (m_size == MAX) return;
+		auto pack = [](float v) { return std::uint8_t(v <= 0.0f ? 0 : v >= 1.0f ? 255 : v * 255.0f + 0.5f); };
+		m_colors[m_size++] = { pack(c.r), pack(c.g), pack(c.b), pack(c.a) };
+	}
+	void clear() { m_size = 0; }
+	unsigned size() const { return m_size; }
+	Color operator[](unsigned i) const {
+		auto const& c = m_colors[i];
+		return Color(c[0] / 255.0f, c[1] / 255.0f, c[2] / 255.0f, c[3] / 255.0f);
+	}
+  private:
+	std::array<std::array<std::uint8_t, 4>, MAX> m_colors;
+	std::uint8_t m_size = 0;
+};
+
 // TODO: Make Note use Duration
 
 /// note read from songfile
@@ -58,7 +80,7 @@ struct Note {
 	/// power of note (how well it is being hit right now)
 	mutable double power;
 	/// which players sung well
-	mutable std::vector<Color> stars;
+	mutable Stars stars;
 	/// note type
 	enum Type { FREESTYLE = 'F', NORMAL = ':', GOLDEN = '*', GOLDEN2 = 'G', SLIDE = '+', SLEEP = '-', RAP = 'R',
 	  TAP = '1', HOLDBEGIN = '2', HOLDEND = '3', ROLL = '4', MINE = 'M', LIFT = 'L'} type;
@@ -119,8 +141,11 @@ struct DanceTrack {
 	DanceTrack(std::string& description, Notes& notes);
 	//track description
 	std::string description;
-	//container for the actual note data
-	Notes notes;
+	//container for the actual note data (SM charts are only loaded when played, see Song::danceNotes)
+	mutable Notes notes;
+	std::size_t offset = 0;  ///< Position of the note data in the song file, while not loaded
+	unsigned linenum = 0;  ///< Line of the note data in the song file (for error messages)
+	mutable bool loaded = true;
 };
 
 enum DanceDifficulty {
@@ -1,15 +1,49 @@
 #include "opengl_text.hh"
 
+#include "configuration.hh"
 #include "libxml++-impl.hh"
 
 #include "fontconfig/fontconfig.h"
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <tuple>
 #include "fs.hh"
 
-void loadFonts() {
+namespace {
+	/// Make Pango in the calling thread use FreeType (and thus the fonts added to fontconfig)
+	void selectFontMap(bool verbose) {
+		PangoCairoFontMap *map = PANGO_CAIRO_FONT_MAP(pango_cairo_font_map_get_default());
+		if (verbose) std::clog << "font/info: PangoCairo is using font map " << G_OBJECT_TYPE_NAME(map) << std::endl;
+		if (pango_cairo_font_map_get_font_type(map) != CAIRO_FONT_TYPE_FT) {
+			PangoCairoFontMap *ftMap = PANGO_CAIRO_FONT_MAP(pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT));
+			if (ftMap) {
+				if (verbose) std::clog << "font/info: Switching to font map " << G_OBJECT_TYPE_NAME(ftMap) << std::endl;
+				pango_cairo_font_map_set_default(ftMap);
+			} else
+				std::clog << "font/error: Can't switch to FreeType, fonts will be unavailable!" << std::endl;
+		}
+	}
+}
+
+void buildFonts() {
 	auto config = std::unique_ptr<FcConfig, decltype(&FcConfigDestroy)>(FcInitLoadConfig(), &FcConfigDestroy);
+	// Our own cache folder too, so that the system fonts are not rescanned at every start when the user's
+	// fontconfig cache is unavailable (fontconfig writes to the first writable folder)
+	std::string cachedir = (getCacheDir() / "fontconfig").string();
+	std::string xml = "<?xml version=\"1.0\"?><fontconfig><cachedir>";
+	for (char ch: cachedir) xml += ch == '&' ? std::string("&amp;") : ch == '<' ? std::string("&lt;") : std::string(1, ch);
+	xml += "</cachedir></fontconfig>";
+	if (!FcConfigParseAndLoadFromMemory(config.get(), reinterpret_cast<FcChar8 const*>(xml.c_str()), FcFalse)) {
+		std::clog << "font/warning: Cannot use font cache folder " << cachedir << std::endl;
+	}
 	for (fs::path const& font: listFiles("fonts")) {
 		FcBool err = FcConfigAppFontAddFile(config.get(), reinterpret_cast<const FcChar8*>(font.string().c_str()));
 		std::clog << "font/info: Loading font " << font << ": " << ((err == FcTrue)?"ok":"error") << std::endl;
@@ -19,19 +53,17 @@ void loadFonts() {
 
         // FcConfigSetCurrent increments the refcount of config, thus the local handle on config can be deleted safely.
 	FcConfigSetCurrent(config.get());
+}
 
-	// This would all be very useless if pango+cairo didn't use the fontconfig+freetype backend:
+void useFonts() {
+	// This would all be very useless if pango+cairo didn't use the fontconfig+freetype backend
+	// (the default font map is per thread, TextPrefetcher does the same for its own):
+	selectFontMap(true);
+}
 
-	PangoCairoFontMap *map = PANGO_CAIRO_FONT_MAP(pango_cairo_font_map_get_default());
-	std::clog << "font/info: PangoCairo is using font map " << G_OBJECT_TYPE_NAME(map) << std::endl;
-	if (pango_cairo_font_map_get_font_type(map) != CAIRO_FONT_TYPE_FT) {
-		PangoCairoFontMap *ftMap = PANGO_CAIRO_FONT_MAP(pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT));
-		if (ftMap) {
-			std::clog << "font/info: Switching to font map " << G_OBJECT_TYPE_NAME(ftMap) << std::endl;
-			pango_cairo_font_map_set_default(ftMap);
-		} else
-			std::clog << "font/error: Can't switch to FreeType, fonts will be unavailable!" << std::endl;
-	}
+void loadFonts() {
+	buildFonts();
+	useFonts();
 }
 
 namespace {
@@ -57,38 +89,237 @@ namespace {
 	}
 }
 
-OpenGLText::OpenGLText(TextStyle& _text, double m) {
+/// Glyphs rendered into a texture atlas, shared by all texts (while any of them exist)
+class GlyphCache {
+  public:
+	struct Key {
+		PangoFont* font;
+		PangoGlyph glyph;
+		bool stroke;
+		std::string style;
+		bool operator<(Key const& k) const { return std::tie(font, glyph, stroke, style) < std::tie(k.font, k.glyph, k.stroke, k.style); }
+	};
+	/// A rendered glyph: its sprite and where it goes relative to the glyph origin (in pixels)
+	struct Glyph {
+		TextureAtlas::Sprite const* sprite = nullptr;  ///< nullptr for blank glyphs (e.g. space)
+		double x = 0.0, y = 0.0, w = 0.0, h = 0.0;
+	};
+	/// A glyph rasterized (by any thread) but not in the atlas yet
+	struct Rendered {
+		Glyph metrics;
+		std::shared_ptr<Bitmap> bitmap;  ///< Not set for blank glyphs
+	};
+	static std::shared_ptr<GlyphCache> instance() {
+		static std::weak_ptr<GlyphCache> s_instance;
+		static std::mutex s_mutex;
+		std::lock_guard<std::mutex> l(s_mutex);
+		auto ptr = s_instance.lock();
+		if (!ptr) s_instance = ptr = std::make_shared<GlyphCache>();
+		return ptr;
+	}
+	~GlyphCache() { for (auto& f: m_fonts) g_object_unref(f.first); }
+	/// Key of the fill or the stroke of a glyph in the given style
+	static Key key(PangoFont* font, PangoGlyph glyph, TextStyle& style, double border, bool stroke) {
+		std::ostringstream oss;
+		if (stroke) oss << style.stroke_col.r << ',' << style.stroke_col.g << ',' << style.stroke_col.b << ',' << style.stroke_col.a
+		  << ',' << border << ',' << style.LineJoin() << ',' << style.LineCap() << ',' << style.stroke_miterlimit;
+		else oss << style.fill_col.r << ',' << style.fill_col.g << ',' << style.fill_col.b << ',' << style.fill_col.a;
+		return Key{ font, glyph, stroke, oss.str() };
+	}
+	/// Is the glyph already in the atlas? (any thread)
+	bool contains(Key const& key) {
+		std::lock_guard<std::mutex> l(m_mutex);
+		return m_glyphs.find(key) != m_glyphs.end();
+	}
+	/// Get a glyph from the atlas, adding it (rendered earlier or now) if missing. Main thread only.
+	Glyph const& get(Key const& key, Rendered const* rendered, TextStyle& style, double border) {
+		std::lock_guard<std::mutex> l(m_mutex);
+		auto it = m_glyphs.find(key);
+		if (it != m_glyphs.end()) return it->second;
+		// Fonts are kept referenced, so that another font cannot get the same address
+		if (m_fonts.emplace(key.font, true).second) g_object_ref(key.font);
+		Rendered glyph = rendered ? *rendered : render(key, style, border);
+		Glyph g = glyph.metrics;
+		if (glyph.bitmap) g.sprite = &m_atlas.add(*glyph.bitmap);
+		return m_glyphs.emplace(key, g).first->second;
+	}
+	/// Rasterize a glyph without touching the atlas (any thread)
+	static Rendered render(Key const& key, TextStyle& style, double border) {
+		Rendered ret;
+		PangoRectangle ink;
+		pango_font_get_glyph_extents(key.font, key.glyph, &ink, nullptr);
+		if (ink.width <= 0 || ink.height <= 0) return ret;
+		// Room for half of the border outside of the outline (and antialiasing)
+		const double margin = 0.5 * border + 1.0;
+		Glyph& g = ret.metrics;
+		g.x = std::floor(double(ink.x) / PANGO_SCALE - margin);
+		g.y = std::floor(double(ink.y) / PANGO_SCALE - margin);
+		g.w = std::ceil(double(ink.x + ink.width) / PANGO_SCALE + margin) - g.x;
+		g.h = std::ceil(double(ink.y + ink.height) / PANGO_SCALE + margin) - g.y;
+		std::shared_ptr<cairo_surface_t> surface(
+		  cairo_image_surface_create(CAIRO_FORMAT_ARGB32, g.w, g.h),
+		  cairo_surface_destroy);
+		std::shared_ptr<cairo_t> dc(
+		  cairo_create(surface.get()),
+		  cairo_destroy);
+		cairo_set_antialias(dc.get(), CAIRO_ANTIALIAS_FAST);  // As OpenGLText without glyphs
+		cairo_set_scaled_font(dc.get(), pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(key.font)));
+		cairo_glyph_t cg = { key.glyph, -g.x, -g.y };
+		cairo_glyph_path(dc.get(), &cg, 1);
+		if (key.stroke) {
+			cairo_set_line_join(dc.get(), style.LineJoin());
+			cairo_set_line_cap(dc.get(), style.LineCap());
+			cairo_set_miter_limit(dc.get(), style.stroke_miterlimit);
+			cairo_set_line_width(dc.get(), border);
+			cairo_set_source_rgba(dc.get(), style.stroke_col.r, style.stroke_col.g, style.stroke_col.b, style.stroke_col.a);
+			cairo_stroke(dc.get());
+		} else {
+			cairo_set_source_rgba(dc.get(), style.fill_col.r, style.fill_col.g, style.fill_col.b, style.fill_col.a);
+			cairo_fill(dc.get());
+		}
+		ret.bitmap = std::make_shared<Bitmap>();
+		copySurface(surface.get(), *ret.bitmap);
+		return ret;
+	}
+	/// Copy the contents of an image surface into a bitmap of its own
+	static void copySurface(cairo_surface_t* surface, Bitmap& bitmap) {
+		cairo_surface_flush(surface);
+		bitmap.fmt = pix::INT_ARGB;
+		bitmap.linearPremul = true;
+		bitmap.resize(cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
+		std::memcpy(bitmap.data(), cairo_image_surface_get_data(surface), bitmap.buf.size());  // ARGB32 rows are never padded
+	}
+  private:
+	std::mutex m_mutex;
+	TextureAtlas m_atlas;
+	std::map<Key, Glyph> m_glyphs;
+	std::map<PangoFont*, bool> m_fonts;
+};
+
+/// Everything of OpenGLText but the OpenGL part
+struct RenderedText {
+	struct Placed {
+		GlyphCache::Key key;
+		double x, y;  ///< Origin in pixels
+		std::shared_ptr<GlyphCache::Rendered> rendered;  ///< nullptr if found in the cache
+	};
+	TextStyle style;
+	double m = 1.0;  ///< Quality multiplier
+	double border = 0.0;
+	double x = 0.0, y = 0.0;  ///< Size in pixels
+	std::shared_ptr<GlyphCache> glyphCache;  ///< Set if the text is made of glyphs
+	std::vector<Placed> glyphs;  ///< Fills first, then strokes
+	Bitmap bitmap;  ///< The whole text, if not made of glyphs
+};
+
+namespace {
+	/**
+	* Pango objects reused by renderText, one set per thread (Pango is not thread safe and font maps are per
+	* thread). Texts drawn whole and texts made of glyphs get contexts of their own, as pango_cairo_update_layout
+	* changes the context of the former.
+	**/
+	class PangoCache {
+	  public:
+		static PangoCache& instance() {
+			thread_local PangoCache cache;
+			return cache;
+		}
+		/// The layout for texts drawn whole (glyphs = false) or made of glyphs
+		PangoLayout* layout(bool glyphs) {
+			auto& layout = m_layouts[glyphs];
+			if (!layout) {
+				std::shared_ptr<PangoContext> ctx(pango_font_map_create_context(pango_cairo_font_map_get_default()), g_object_unref);
+				layout.reset(pango_layout_new(ctx.get()), g_object_unref);
+			}
+			return layout.get();
+		}
+		/// Font description of style at size (in Pango units)
+		PangoFontDescription const* font(TextStyle const& style, double size) {
+			auto key = std::make_tuple(style.fontfamily, style.fontstyle, style.fontweight, size);
+			auto it = m_fonts.find(key);
+			if (it != m_fonts.end()) return it->second.get();
+			if (m_fonts.size() >= MAX_FONTS) m_fonts.clear();  // Only a few are used at once
+			std::shared_ptr<PangoFontDescription> desc(pango_font_description_new(), pango_font_description_free);
+			pango_font_description_set_weight(desc.get(), parseWeight(style.fontweight));
+			pango_font_description_set_style(desc.get(), parseStyle(style.fontstyle));
+			pango_font_description_set_family(desc.get(), style.fontfamily.c_str());
+			pango_font_description_set_absolute_size(desc.get(), size);
+			return m_fonts.emplace(key, desc).first->second.get();
+		}
+	  private:
+		static const std::size_t MAX_FONTS = 64;
+		std::shared_ptr<PangoLayout> m_layouts[2];
+		std::map<std::tuple<std::string, std::string, std::string, double>, std::shared_ptr<PangoFontDescription>> m_fonts;
+	};
+
+	/// Lay out the text and pick its glyphs, rendering those not in the cache
+	void layoutGlyphs(RenderedText& text, PangoLayout* layout) {
+		TextStyle& st = text.style;
+		std::vector<RenderedText::Placed> strokes;
+		std::unique_ptr<PangoLayoutIter, void (*)(PangoLayoutIter*)> iter(pango_layout_get_iter(layout), pango_layout_iter_free);
+		do {
+			PangoLayoutRun* run = pango_layout_iter_get_run_readonly(iter.get());
+			if (!run) continue;  // End of a line
+			PangoRectangle logical;
+			pango_layout_iter_get_run_extents(iter.get(), nullptr, &logical);
+			const int baseline = pango_layout_iter_get_baseline(iter.get());
+			PangoFont* font = run->item->analysis.font;
+			int x = logical.x;
+			for (int i = 0; i < run->glyphs->num_glyphs; x += run->glyphs->glyphs[i].geometry.width, ++i) {
+				PangoGlyphInfo const& info = run->glyphs->glyphs[i];
+				if (info.glyph == PANGO_GLYPH_EMPTY || (info.glyph & PANGO_GLYPH_UNKNOWN_FLAG)) continue;
+				// Glyph origin in pixels, with the margins for the border as in the texture
+				const double ox = double(x + info.geometry.x_offset) / PANGO_SCALE + 0.5 * text.border;
+				const double oy = double(baseline + info.geometry.y_offset) / PANGO_SCALE + 0.5 * text.border;
+				for (bool stroke: { false, true }) {
+					if ((stroke ? st.stroke_col.a : st.fill_col.a) <= 0.0) continue;
+					RenderedText::Placed p{ GlyphCache::key(font, info.glyph, st, text.border, stroke), ox, oy, nullptr };
+					if (!text.glyphCache->contains(p.key)) p.rendered = std::make_shared<GlyphCache::Rendered>(GlyphCache::render(p.key, st, text.border));
+					(stroke ? strokes : text.glyphs).push_back(p);
+				}
+			}
+		} while (pango_layout_iter_next_run(iter.get()));
+		// Strokes are drawn over the fills of all glyphs, as they are when rendering the whole text at once
+		text.glyphs.insert(text.glyphs.end(), strokes.begin(), strokes.end());
+	}
+}
+
+std::shared_ptr<RenderedText> renderText(TextStyle const& style, double m, bool glyphs) {
+	auto ret = std::make_shared<RenderedText>();
+	RenderedText& text = *ret;
+	text.style = style;
+	TextStyle& _text = text.style;
 	m *= 2.0;  // HACK to improve text quality without affecting compatibility with old versions
-	// Setup font settings
+	text.m = m;
+	// Setup font settings and layout
 	PangoAlignment alignment = parseAlignment(_text.fontalign);
-	std::shared_ptr<PangoFontDescription> desc(
-	  pango_font_description_new(),
-	  pango_font_description_free);
-	pango_font_description_set_weight(desc.get(), parseWeight(_text.fontweight));
-	pango_font_description_set_style(desc.get(), parseStyle(_text.fontstyle));
-	pango_font_description_set_family(desc.get(), _text.fontfamily.c_str());
-	pango_font_description_set_absolute_size(desc.get(), _text.fontsize * PANGO_SCALE * m);
-	double border = _text.stroke_width * m;
-	// Setup Pango context and layout
-	std::shared_ptr<PangoContext> ctx(
-	  pango_font_map_create_context(pango_cairo_font_map_get_default()),
-	  g_object_unref);
-	std::shared_ptr<PangoLayout> layout(
-	  pango_layout_new(ctx.get()),
-	  g_object_unref);
-	pango_layout_set_alignment(layout.get(), alignment);
-	pango_layout_set_font_description(layout.get(), desc.get());
-	pango_layout_set_text(layout.get(), _text.text.c_str(), -1);
+	double border = text.border = _text.stroke_width * m;
+	PangoCache& pango = PangoCache::instance();
+	PangoLayout* layout = pango.layout(glyphs);
+	pango_layout_set_alignment(layout, alignment);
+	pango_layout_set_font_description(layout, pango.font(_text, _text.fontsize * PANGO_SCALE * m));
+	pango_layout_set_text(layout, _text.text.c_str(), -1);
 	// Compute text extents
 	{
 		PangoRectangle rec;
-		pango_layout_get_pixel_extents(layout.get(), nullptr, &rec);
-		m_x = rec.width + border;  // Add twice half a border for margins
-		m_y = rec.height + border;
+		pango_layout_get_pixel_extents(layout, nullptr, &rec);
+		text.x = rec.width + border;  // Add twice half a border for margins
+		text.y = rec.height + border;
 	}
-	// Create Cairo surface and drawing context
+	if (glyphs) {
+		text.glyphCache = GlyphCache::instance();
+		layoutGlyphs(text, layout);
+		return ret;
+	}
+	// Cairo surface drawing straight into the bitmap (ARGB32 rows are never padded)
+	Bitmap& bitmap = text.bitmap;
+	bitmap.fmt = pix::INT_ARGB;
+	bitmap.linearPremul = true;
+	bitmap.resize(text.x, text.y);
+	if (bitmap.buf.empty()) return ret;
+	std::fill(bitmap.buf.begin(), bitmap.buf.end(), 0);  // Pooled buffers are not cleared
 	std::shared_ptr<cairo_surface_t> surface(
-	  cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_x, m_y),
+	  cairo_image_surface_create_for_data(bitmap.data(), CAIRO_FORMAT_ARGB32, bitmap.width, bitmap.height, bitmap.width * 4),
 	  cairo_surface_destroy);
 	std::shared_ptr<cairo_t> dc(
 	  cairo_create(surface.get()),
@@ -99,8 +330,8 @@ OpenGLText::OpenGLText(TextStyle& _text, double m) {
 	cairo_set_operator(dc.get(),CAIRO_OPERATOR_SOURCE);
 	// Add Pango line and path to proper position on the DC
 	cairo_move_to(dc.get(), 0.5 * border, 0.5 * border);  // Margins needed for border stroke to fit in
-	pango_cairo_update_layout(dc.get(), layout.get());
-	pango_cairo_layout_path(dc.get(), layout.get());
+	pango_cairo_update_layout(dc.get(), layout);
+	pango_cairo_layout_path(dc.get(), layout);
 	// Render text
 	if (_text.fill_col.a > 0.0) {
 		cairo_set_source_rgba(dc.get(), _text.fill_col.r, _text.fill_col.g, _text.fill_col.b, _text.fill_col.a);
@@ -120,25 +351,102 @@ OpenGLText::OpenGLText(TextStyle& _text, double m) {
 	cairo_pop_group_to_source (dc.get());
 	cairo_set_operator(dc.get(),CAIRO_OPERATOR_OVER);
 	cairo_paint (dc.get());
-	// Load into m_texture (OpenGL texture)
-	Bitmap bitmap(cairo_image_surface_get_data(surface.get()));
-	bitmap.fmt = pix::INT_ARGB;
-	bitmap.linearPremul = true;
-	bitmap.resize(cairo_image_surface_get_width(surface.get()), cairo_image_surface_get_height(surface.get()));
-	m_texture.load(bitmap, true);
+	cairo_surface_flush(surface.get());
+	return ret;
+}
+
+/// Renders texts for SvgTxtTheme::prefetch on a thread of its own (shared by all themes while any of them prefetch)
+class TextPrefetcher {
+  public:
+	using Result = std::shared_future<std::shared_ptr<RenderedText>>;
+	static std::shared_ptr<TextPrefetcher> instance() {
+		static std::weak_ptr<TextPrefetcher> s_instance;
+		auto ptr = s_instance.lock();
+		if (!ptr) s_instance = ptr = std::make_shared<TextPrefetcher>();
+		return ptr;
+	}
+	TextPrefetcher(): m_thread(&TextPrefetcher::run, this) {}
+	~TextPrefetcher() {
+		{
+			std::lock_guard<std::mutex> l(m_mutex);
+			m_quit = true;
+		}
+		m_cond.notify_one();
+		m_thread.join();  // Texts still queued are dropped (their futures report broken promises)
+	}
+	Result render(TextStyle const& style, double m, bool glyphs) {
+		std::packaged_task<std::shared_ptr<RenderedText>()> task([style, m, glyphs] { return renderText(style, m, glyphs); });
+		Result ret = task.get_future().share();
+		{
+			std::lock_guard<std::mutex> l(m_mutex);
+			m_queue.push_back(std::move(task));
+		}
+		m_cond.notify_one();
+		return ret;
+	}
+  private:
+	void run() {
+		selectFontMap(false);
+		std::unique_lock<std::mutex> l(m_mutex);
+		while (true) {
+			m_cond.wait(l, [this] { return m_quit || !m_queue.empty(); });
+			if (m_quit) return;
+			auto task = std::move(m_queue.front());
+			m_queue.pop_front();
+			l.unlock();
+			task();
+			l.lock();
+		}
+	}
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<std::packaged_task<std::shared_ptr<RenderedText>()>> m_queue;
+	bool m_quit = false;
+	std::thread m_thread;
+};
+
+OpenGLText::OpenGLText(TextStyle& _text, double m) {
+	load(*renderText(_text, m, config["graphic/glyph_cache"].b()));
+}
+
+OpenGLText::OpenGLText(RenderedText& text) {
+	load(text);
+}
+
+void OpenGLText::load(RenderedText& text) {
 	// We don't want text quality multiplier m to affect rendering size...
-	m_x /= m;
-	m_y /= m;
+	m_x = text.x / text.m;
+	m_y = text.y / text.m;
+	if (!text.glyphCache) {
+		// Load into m_texture (OpenGL texture)
+		m_texture.load(text.bitmap, true);
+		return;
+	}
+	m_glyphCache = text.glyphCache;
+	const unsigned width = text.x, height = text.y;  // As the texture would be
+	m_texture.dimensions = Dimensions(width && height ? double(width) / height : 1.0).fixedWidth(1.0f);
+	if (!width || !height) return;
+	for (auto const& p: text.glyphs) {
+		GlyphCache::Glyph const& g = m_glyphCache->get(p.key, p.rendered.get(), text.style, text.border);
+		if (!g.sprite || g.sprite->empty()) continue;
+		m_glyphs.push_back(GlyphQuad{ g.sprite, float((p.x + g.x) / width), float((p.y + g.y) / height), float((p.x + g.x + g.w) / width), float((p.y + g.y + g.h) / height) });
+	}
 }
 
 void OpenGLText::draw() {
-	m_texture.draw();
+	if (!m_glyphCache) { m_texture.draw(); return; }
+	Dimensions const& dim = m_texture.dimensions;
+	for (auto const& g: m_glyphs) {
+		Dimensions gd;
+		gd.left(dim.x1() + g.x1 * dim.w()).top(dim.y1() + g.y1 * dim.h()).stretch((g.x2 - g.x1) * dim.w(), (g.y2 - g.y1) * dim.h());
+		g.sprite->draw(gd);
+	}
 }
 
 void OpenGLText::draw(Dimensions &_dim, TexCoords &_tex) {
 	m_texture.dimensions = _dim;
-	m_texture.tex = _tex;
-	m_texture.draw();
+	m_texture.tex = _tex;  // Glyphs are always drawn in full
+	draw();
 }
 
 namespace {
@@ -209,7 +517,7 @@ SvgTxtThemeSimple::SvgTxtThemeSimple(fs::path const& themeFile, double factor) :
 	parseTheme(themeFile, m_text, tmp, tmp, tmp, tmp, a);
 }
 
-void SvgTxtThemeSimple::render(std::string _text) {
+void SvgTxtThemeSimple::render(std::string const& _text) {
 	if (!m_opengl_text.get() || m_cache_text != _text) {
 		m_cache_text = _text;
 		m_text.text = _text;
@@ -232,7 +540,7 @@ void SvgTxtTheme::setHighlight(fs::path const& themeFile) {
 	parseTheme(themeFile, m_text_highlight, a, b, c, d, e);
 }
 
-void SvgTxtTheme::draw(std::string _text) {
+void SvgTxtTheme::draw(std::string const& _text) {
 	std::vector<TZoomText> tmp;
 	TZoomText t;
 	t.string = _text;
@@ -241,25 +549,80 @@ void SvgTxtTheme::draw(std::string _text) {
 	draw(tmp);
 }
 
-void SvgTxtTheme::draw(std::vector<TZoomText>& _text, bool lyrics) {
-
-	std::string tmp;
-	for (auto& zt: _text) { tmp += zt.string; }
-	if (m_opengl_text.size() != _text.size() || m_cache_text != tmp) {
-		m_cache_text = tmp;
-		m_opengl_text.clear();
-		for (auto& zt: _text) {
-			m_text.text = zt.string;
-			auto openGlPtr = std::unique_ptr<OpenGLText>(std::make_unique<OpenGLText>(m_text, m_factor));
-			m_opengl_text.push_back(std::move(openGlPtr));
+namespace {
+	/// Texts kept by SvgTxtTheme for drawing again
+	const unsigned RECENT_LINES = 4;
+	/// Limit for prefetched texts not drawn yet (e.g. after seeking), all are dropped beyond it
+	const unsigned MAX_PREFETCHED = 256;
+}
+
+void SvgTxtTheme::prefetch(std::vector<std::string> const& texts) {
+	if (!m_prefetcher) m_prefetcher = TextPrefetcher::instance();
+	if (m_prefetched.size() > MAX_PREFETCHED) m_prefetched.clear();
+	static ConfigItem& glyphCache = config["graphic/glyph_cache"];
+	const bool glyphs = glyphCache.b();
+	for (auto const& str: texts) {
+		if (m_prefetched.count(str)) continue;
+		bool recent = false;  // Drawn recently, reused from m_lines
+		for (auto const& l: m_lines) recent |= std::find(l.key.begin(), l.key.end(), str) != l.key.end();
+		if (recent) continue;
+		TextStyle style = m_text;
+		style.text = str;
+		m_prefetched.emplace(str, m_prefetcher->render(style, m_factor, glyphs));
+	}
+}
+
+std::uint64_t SvgTxtTheme::newTextId() {
+	static std::atomic<std::uint64_t> s_next{ 1 };
+	return s_next++;
+}
+
+std::vector<std::unique_ptr<OpenGLText>>& SvgTxtTheme::line(std::vector<TZoomText> const& _text, std::uint64_t id) {
+	auto matches = [&](Line const& l) {
+		if (id) return l.id == id;
+		if (l.key.size() != _text.size()) return false;
+		for (std::size_t i = 0; i < _text.size(); ++i) if (l.key[i] != _text[i].string) return false;
+		return true;
+	};
+	for (auto it = m_lines.begin(); it != m_lines.end(); ++it) {
+		if (!matches(*it)) continue;
+		if (it != m_lines.begin()) {
+			Line l = std::move(*it);
+			m_lines.erase(it);
+			m_lines.push_front(std::move(l));
 		}
+		return m_lines.front().texts;
 	}
+	std::vector<std::string> key;
+	for (auto const& zt: _text) key.push_back(zt.string);
+	Line l;
+	for (auto const& str: key) {
+		auto it = m_prefetched.find(str);
+		if (it != m_prefetched.end()) {
+			try {
+				l.texts.push_back(std::make_unique<OpenGLText>(*it->second.get()));  // Waits if not done yet
+				continue;
+			} catch (std::future_error const&) {}  // Dropped by the worker, render it here
+		}
+		m_text.text = str;
+		l.texts.push_back(std::make_unique<OpenGLText>(m_text, m_factor));
+	}
+	for (auto const& str: key) m_prefetched.erase(str);
+	l.id = id;
+	l.key = std::move(key);
+	m_lines.push_front(std::move(l));
+	if (m_lines.size() > RECENT_LINES) m_lines.pop_back();
+	return m_lines.front().texts;
+}
+
+void SvgTxtTheme::draw(std::vector<TZoomText>& _text, bool lyrics, std::uint64_t id) {
+	auto& texts = line(_text, id);
 	double text_x = 0.0;
 	double text_y = 0.0;
 	// First compute maximum height and whole length
 	for (size_t i = 0; i < _text.size(); i++ ) {
-		text_x += m_opengl_text[i]->x();
-		text_y = std::max(text_y, m_opengl_text[i]->y());
+		text_x += texts[i]->x();
+		text_y = std::max(text_y, texts[i]->y());
 	}
 
 	double texture_ar = text_x / text_y;
@@ -274,7 +637,7 @@ void SvgTxtTheme::draw(std::vector<TZoomText>& _text, bool lyrics) {
 	}
 	m_texture_height = m_texture_width / texture_ar; // Keep aspect ratio.
 	for (size_t i = 0; i < _text.size(); i++) {
-		double syllable_x = m_opengl_text[i]->x();
+		double syllable_x = texts[i]->x();
 		double syllable_width = syllable_x *  m_texture_width / text_x * _text[i].factor;
 		double syllable_height = m_texture_height * _text[i].factor;
 		double syllable_ar = syllable_width / syllable_height;
@@ -286,9 +649,9 @@ void SvgTxtTheme::draw(std::vector<TZoomText>& _text, bool lyrics) {
 		if (factor > 1.0) {
 			LyricColorTrans lc(m_text.fill_col, m_text.stroke_col, m_text_highlight.fill_col, m_text_highlight.stroke_col);
 			dim.fixedWidth(dim.w() * factor);
-			m_opengl_text[i]->draw(dim, tex);
+			texts[i]->draw(dim, tex);
 		} 
-		else { m_opengl_text[i]->draw(dim, tex); }
+		else { texts[i]->draw(dim, tex); }
 		position_x += (syllable_width / factor) * (lyrics ? 1.1 : 1.0);
 	}
 }
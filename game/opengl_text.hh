@@ -2,11 +2,21 @@
 
 #include "color.hh"
 #include "texture.hh"
+#include "textureatlas.hh"
 #include "unicode.hh"
 #include <pango/pangocairo.h>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
 #include <vector>
 
-/// Load custom fonts from current theme and data folders
+/// Build the font database and make it current in fontconfig (slow; may run in a worker thread, before any text)
+void buildFonts();
+/// Make Pango of the calling thread use the fonts of buildFonts
+void useFonts();
+/// Load custom fonts from current theme and data folders (buildFonts and useFonts)
 void loadFonts();
 
 /// zoomed text
@@ -51,15 +61,26 @@ struct TextStyle {
 	TextStyle(): stroke_width(), stroke_miterlimit(1.0), fontsize() {}
 };
 
+class GlyphCache;
+class TextPrefetcher;
+struct RenderedText;
+
+/// Lay out (and rasterize) a text without OpenGL, for OpenGLText. Safe to call from any thread.
+std::shared_ptr<RenderedText> renderText(TextStyle const& style, double m, bool glyphs);
+
 /// this class will enable to create a texture from a themed text structure
 /** it will not cache any data (class using this class should)
  * it provides size of the texture are drawn (x,y)
  * it provides size of the texture created (x_power_of_two, y_power_of_two)
+ * With graphic/glyph_cache the text is not rendered into a texture of its own but drawn glyph by glyph
+ * from an atlas shared by all texts, so that each glyph is only rasterized once (per font and style).
  */
 class OpenGLText {
 public:
 	/// constructor
 	OpenGLText(TextStyle &_text, double m);
+	/// constructor for a text rendered earlier (by renderText)
+	explicit OpenGLText(RenderedText& text);
 	/// draws area
 	void draw(Dimensions &_dim, TexCoords &_tex);
 	/// draws full texture
@@ -72,9 +93,17 @@ public:
 	Dimensions& dimensions() { return m_texture.dimensions; }
 
 private:
+	void load(RenderedText& text);
+	/// A glyph of the text, in coordinates relative to the text (0..1)
+	struct GlyphQuad {
+		TextureAtlas::Sprite const* sprite;
+		float x1, y1, x2, y2;
+	};
 	double m_x;
 	double m_y;
-	Texture m_texture;
+	DynamicTexture m_texture;  ///< Whole text (when not using glyphs), also holds the dimensions
+	std::shared_ptr<GlyphCache> m_glyphCache;
+	std::vector<GlyphQuad> m_glyphs;  ///< Fills of all glyphs first, then their strokes
 };
 
 /// themed svg texts (simple)
@@ -82,8 +111,8 @@ class SvgTxtThemeSimple {
 public:
 	/// constructor
 	SvgTxtThemeSimple(fs::path const& themeFile, double factor = 1.0);
-	/// renders text
-	void render(std::string _text);
+	/// renders text (only if it differs from the last one)
+	void render(std::string const& _text);
 	/// draws texture
 	void draw();
 	/// gets dimensions
@@ -147,10 +176,13 @@ public:
 	Dimensions dimensions;
 	/// constructor
 	SvgTxtTheme(fs::path const& themeFile, double factor = 1.0);
-	/// draws text with alpha
-	void draw(std::vector<TZoomText>& _text, bool lyrics = false);
+	/// draws text with alpha. A nonzero id identifies the text (see newTextId), so that the text drawn
+	/// again is found without comparing strings; the strings of _text are only read when the id is new.
+	void draw(std::vector<TZoomText>& _text, bool lyrics = false, std::uint64_t id = 0);
 	/// draw text with alpha
-	void draw(std::string _text);
+	void draw(std::string const& _text);
+	/// A text id for draw that has not been used before (any thread)
+	static std::uint64_t newTextId();
 	/// sets highlight
 	void setHighlight(fs::path const& themeFile);
 	/// width
@@ -159,9 +191,21 @@ public:
 	double h() const { return m_texture_height; }
 	/// set align
 	void setAlign(Align align) { m_align = align; }
+	/// Render texts (e.g. syllables of upcoming lyrics) on a worker thread, so that drawing them later only needs to upload them
+	void prefetch(std::vector<std::string> const& texts);
 
 private:
-	std::vector<std::unique_ptr<OpenGLText>> m_opengl_text;
+	/// A recently drawn text (one OpenGLText for each TZoomText)
+	struct Line {
+		std::uint64_t id = 0;  ///< As given to draw (0 if none)
+		std::vector<std::string> key;
+		std::vector<std::unique_ptr<OpenGLText>> texts;
+	};
+	/// Find or create the OpenGLTexts for _text
+	std::vector<std::unique_ptr<OpenGLText>>& line(std::vector<TZoomText> const& _text, std::uint64_t id);
+	std::deque<Line> m_lines;  ///< Most recent first (several, as duets draw two lines with the same theme)
+	std::shared_ptr<TextPrefetcher> m_prefetcher;
+	std::map<std::string, std::shared_future<std::shared_ptr<RenderedText>>> m_prefetched;
 	Align m_align;
 	double m_x;
 	double m_y;
@@ -170,7 +214,6 @@ private:
 	double m_factor;
 	double m_texture_width;
 	double m_texture_height;
-	std::string m_cache_text;
 	TextStyle m_text;
 	TextStyle m_text_highlight;
 };
@@ -0,0 +1,108 @@
+#include "perfoverlay.hh"
+
+#include "configuration.hh"
+#include "fs.hh"
+#include "glutil.hh"
+#include "metrics.hh"
+#include "video_driver.hh"
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+	const float LEFT = -0.48f, WIDTH = 0.4f;  ///< Of the graph and the gauges
+	const float GRAPH_HEIGHT = 0.1f, GAUGE_HEIGHT = 0.008f, GAP = 0.004f;
+	const float BOTTOM = -0.02f;  ///< Of the lowest gauge, from the bottom of the screen
+	const unsigned GAUGES = 3;
+	const float DEFAULT_REFRESH = 1.0f / 60.0f;  ///< When the display does not tell
+	const double VIDEO_QUEUE_FULL = 1.0;  ///< Seconds of decoded video that fill the gauge (as much as the decoder queues)
+	const double TEXTURE_BACKLOG_FULL = 64.0;  ///< Images waiting that fill the gauge
+	const Seconds UPDATE_INTERVAL(0.5);
+
+	/// Append a quad as two triangles
+	void quad(glutil::VertexArray& va, float x1, float y1, float x2, float y2, glmath::vec4 const& color) {
+		va.color(color).vertex(x1, y1);
+		va.color(color).vertex(x2, y1);
+		va.color(color).vertex(x1, y2);
+		va.color(color).vertex(x2, y1);
+		va.color(color).vertex(x2, y2);
+		va.color(color).vertex(x1, y2);
+	}
+}
+
+PerfOverlay::PerfOverlay(): m_frames(FRAMES, Frame{ 0.0f, 0.0f, 0.0f }), m_text(findFile("message_text.svg"), config["graphic/text_lod"].f()) {}
+
+void PerfOverlay::frame(Seconds interval, Seconds cpu, Seconds refresh) {
+	// The GPU times arrive a few frames late, so the latest one goes with the current frame
+	auto gpu = glutil::GPUTimer::current();
+	m_frames[m_pos] = Frame{ float(interval.count()), float(cpu.count()), gpu ? float(gpu->latest().count()) : 0.0f };
+	m_pos = (m_pos + 1) % FRAMES;
+	m_refresh = refresh.count();
+}
+
+void PerfOverlay::update() {
+	m_audioLoad = metrics::peek("performous_audio_callback_max_load");
+	m_videoQueue = metrics::peek("performous_video_queue_seconds");
+	m_textureBacklog = metrics::peek("performous_texture_load_backlog") + metrics::peek("performous_texture_upload_backlog");
+	double sum = 0.0, cpu = 0.0, gpu = 0.0, longest = 0.0;
+	unsigned count = 0;
+	for (Frame const& f: m_frames) {
+		if (f.interval <= 0.0f) continue;
+		sum += f.interval;
+		cpu += f.cpu;
+		gpu += f.gpu;
+		longest = std::max<double>(longest, f.interval);
+		++count;
+	}
+	if (count) { sum /= count; cpu /= count; gpu /= count; }
+	char buf[160];
+	std::snprintf(buf, sizeof(buf), "%.1f ms (max %.1f), CPU %.1f, GPU %.1f | audio %.0f %% | video %.2f s | textures %.0f",
+	  1e3 * sum, 1e3 * longest, 1e3 * cpu, 1e3 * gpu, 100.0 * m_audioLoad, m_videoQueue, m_textureBacklog);
+	m_line = buf;
+}
+
+void PerfOverlay::draw() {
+	const Time now = Clock::now();
+	if (now - m_updated >= UPDATE_INTERVAL) {
+		m_updated = now;
+		update();
+	}
+	const float budget = m_refresh > 0.0f ? m_refresh : DEFAULT_REFRESH;
+	const float scale = GRAPH_HEIGHT / (2.0f * budget);  // The graph goes up to two refresh intervals
+	const float bottom = 0.5f * virtH() + BOTTOM;
+	const float gaugesTop = bottom - GAUGES * GAUGE_HEIGHT - (GAUGES - 1) * GAP;
+	const float graphBottom = gaugesTop - GAP, graphTop = graphBottom - GRAPH_HEIGHT;
+	const float column = WIDTH / FRAMES;
+	glutil::VertexArray va;
+	quad(va, LEFT - GAP, graphTop - GAP, LEFT + WIDTH + GAP, bottom + GAP, glmath::vec4(0.0f, 0.0f, 0.0f, 0.6f));
+	// Frames from the oldest at left: the interval (red when late), the CPU time and on the right half the GPU time
+	for (unsigned i = 0; i < FRAMES; ++i) {
+		Frame const& f = m_frames[(m_pos + i) % FRAMES];
+		if (f.interval <= 0.0f) continue;
+		const float x1 = LEFT + i * column, x2 = x1 + column, xm = x1 + 0.5f * column;
+		auto height = [&](float seconds) { return graphBottom - std::min(GRAPH_HEIGHT, seconds * scale); };
+		const bool late = f.interval > 1.5f * budget;
+		quad(va, x1, height(f.interval), x2, graphBottom, late ? glmath::vec4(1.0f, 0.2f, 0.2f, 0.8f) : glmath::vec4(0.3f, 0.8f, 0.3f, 0.5f));
+		quad(va, x1, height(f.cpu), xm, graphBottom, glmath::vec4(0.3f, 0.5f, 1.0f, 0.9f));
+		quad(va, xm, height(f.gpu), x2, graphBottom, glmath::vec4(1.0f, 0.6f, 0.1f, 0.9f));
+	}
+	const float refreshLine = graphBottom - budget * scale;
+	quad(va, LEFT, refreshLine - 0.001f, LEFT + WIDTH, refreshLine, glmath::vec4(1.0f, 1.0f, 1.0f, 0.7f));
+	// Gauges: audio callback load (red above 80 %), video queue fill and texture backlog
+	struct Gauge { float fill; glmath::vec4 color; };
+	const Gauge gauges[GAUGES] = {
+		{ m_audioLoad, m_audioLoad > 0.8f ? glmath::vec4(1.0f, 0.2f, 0.2f, 0.9f) : glmath::vec4(0.3f, 0.8f, 0.3f, 0.9f) },
+		{ float(m_videoQueue / VIDEO_QUEUE_FULL), glmath::vec4(0.3f, 0.5f, 1.0f, 0.9f) },
+		{ float(m_textureBacklog / TEXTURE_BACKLOG_FULL), glmath::vec4(1.0f, 0.6f, 0.1f, 0.9f) },
+	};
+	for (unsigned i = 0; i < GAUGES; ++i) {
+		const float y1 = gaugesTop + i * (GAUGE_HEIGHT + GAP), y2 = y1 + GAUGE_HEIGHT;
+		quad(va, LEFT, y1, LEFT + WIDTH, y2, glmath::vec4(1.0f, 1.0f, 1.0f, 0.15f));
+		quad(va, LEFT, y1, LEFT + WIDTH * std::min(1.0f, std::max(0.0f, gauges[i].fill)), y2, gauges[i].color);
+	}
+	{
+		UseShader shader(getShader("color"));
+		va.draw(GL_TRIANGLES);
+	}
+	m_text.dimensions.left(LEFT).screenBottom(graphTop - 0.5f * virtH() - 2.0f * GAP);
+	m_text.draw(m_line);
+}
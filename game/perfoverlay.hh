@@ -0,0 +1,38 @@
+#pragma once
+
+#include "chrono.hh"
+#include "opengl_text.hh"
+#include <string>
+#include <vector>
+
+/**
+* Live performance overlay (graphic/perf_overlay, toggled with F10) for spotting problems during an event.
+* A rolling graph of the latest frames shows the interval of each frame against the display refresh, with the
+* CPU time of rendering it and the GPU time of drawing it. Gauges below show the audio callback load, the fill
+* of the video decoder queue and the texture loader backlog. Graph and gauges are a single vertex array drawn
+* with one draw call; the gauges and the text line are only read (from the metrics registry) a few times
+* per second.
+**/
+class PerfOverlay {
+  public:
+	PerfOverlay();
+	/// Record a frame: the interval since the previous one, the CPU time of rendering it and the refresh interval
+	/// (zero if unknown). Called by the main loop after each swap.
+	void frame(Seconds interval, Seconds cpu, Seconds refresh);
+	/// Draw the overlay (by Game, over everything else)
+	void draw();
+  private:
+	struct Frame {
+		float interval, cpu, gpu;  ///< In seconds
+	};
+	static const unsigned FRAMES = 240;  ///< Shown in the graph
+	/// Read the gauges and write the text line
+	void update();
+	std::vector<Frame> m_frames;  ///< Ring of the latest frames
+	unsigned m_pos = 0;  ///< Next frame to write (the oldest one)
+	float m_refresh = 0.0f;
+	float m_audioLoad = 0.0f, m_videoQueue = 0.0f, m_textureBacklog = 0.0f;
+	Time m_updated{};
+	SvgTxtTheme m_text;
+	std::string m_line;
+};
@@ -0,0 +1,88 @@
+#include "pitch-yin.hh"
+
+#include "libda/simd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+	// The singing range searched (a bit wider than what Analyzer::findTone returns by default)
+	const double YIN_MINFREQ = 60.0;
+	const double YIN_MAXFREQ = 1100.0;
+	const float YIN_THRESHOLD = 0.15f;  ///< Normalized difference below which a period counts as repeating
+	const float YIN_NOISY_THRESHOLD = 0.5f;  ///< Of the best period when none is below YIN_THRESHOLD (noisy input)
+	const double YIN_MINDB = -53.0;  ///< Quieter windows have no tone
+	/// From the mean square of the window to the level that the FFT engine gives the fundamental of a sine (-11.4 dB
+	/// with the Hamming window versus -3.0 dB for the RMS), so that levels of both engines compare
+	const double YIN_LEVEL_OFFSET = -8.4;
+
+	/// Dot product of a[0, n) and b[0, n)
+	double dot(float const* a, float const* b, std::size_t n) {
+		std::size_t i = 0;
+		float sum = 0.0f;
+#if defined(DA_SIMD_SSE2)
+		__m128 acc = _mm_setzero_ps();
+		for (; i + 4 <= n; i += 4) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		float lanes[4];
+		_mm_storeu_ps(lanes, acc);
+		sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(DA_SIMD_NEON)
+		float32x4_t acc = vdupq_n_f32(0.0f);
+		for (; i + 4 <= n; i += 4) acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+		float lanes[4];
+		vst1q_f32(lanes, acc);
+		sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+		for (; i < n; ++i) sum += a[i] * b[i];
+		return sum;
+	}
+}
+
+YinDetector::YinDetector(double rate, std::size_t size):
+  m_rate(rate),
+  m_size(size),
+  m_tauMin(std::max<std::size_t>(2, rate / YIN_MAXFREQ)),
+  m_tauMax(std::min<std::size_t>(size / 2 - 1, rate / YIN_MINFREQ)),
+  m_diff(m_tauMax + 2)
+{
+	if (m_tauMin + 2 > m_tauMax) throw std::logic_error("YIN window is too short for the singing range.");
+}
+
+void YinDetector::analyze(float const* pcm, ToneSet& tones) {
+	// Periods up to m_tauMax are compared over the newest 2 * m_tauMax + 1 samples (m_tauMax of them at a time)
+	const std::size_t n = m_tauMax;
+	float const* x = pcm + m_size - 2 * n - 1;
+	// The difference of the window x[0, n) and the one shifted by tau is their energies minus twice their correlation
+	const double e0 = dot(x, x, n);
+	double et = e0;  // Energy of x[tau, tau + n)
+	double sum = 0.0;
+	m_diff[0] = 1.0f;
+	for (std::size_t tau = 1; tau <= m_tauMax + 1; ++tau) {
+		et += double(x[tau + n - 1]) * x[tau + n - 1] - double(x[tau - 1]) * x[tau - 1];
+		const double d = std::max(0.0, e0 + et - 2.0 * dot(x, x + tau, n));
+		sum += d;
+		m_diff[tau] = sum > 0.0 ? d * tau / sum : 1.0f;
+	}
+	// The level of the newest samples (e0 and the final et cover all but x[n])
+	const double db = 10.0 * std::log10((e0 + et) / (2 * n) + 1e-20) + YIN_LEVEL_OFFSET;
+	if (db < YIN_MINDB) return;
+	// The first dip below the threshold, followed down to its minimum (not a multiple of the period further on)
+	std::size_t tau = m_tauMin;
+	while (tau <= m_tauMax && m_diff[tau] >= YIN_THRESHOLD) ++tau;
+	if (tau <= m_tauMax) {
+		while (tau < m_tauMax && m_diff[tau + 1] < m_diff[tau]) ++tau;
+	} else {
+		// None: the best period, if it still repeats somewhat (otherwise unvoiced or just noise)
+		tau = std::min_element(m_diff.begin() + m_tauMin, m_diff.begin() + m_tauMax + 1) - m_diff.begin();
+		if (m_diff[tau] >= YIN_NOISY_THRESHOLD) return;
+	}
+	// Parabola through the neighbours for a period between samples
+	const double a = m_diff[tau - 1], b = m_diff[tau], c = m_diff[tau + 1];
+	const double curve = a - 2.0 * b + c;
+	const double shift = curve > 0.0 ? 0.5 * (a - c) / curve : 0.0;
+	Tone t;
+	t.freq = m_rate / (tau + std::max(-0.5, std::min(0.5, shift)));
+	t.db = db;
+	t.stabledb = db;
+	tones.push_back(t);
+}
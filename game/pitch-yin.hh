@@ -0,0 +1,21 @@
+#pragma once
+
+#include "pitch.hh"
+
+/**
+* Time-domain single-pitch detector after YIN (de Cheveigné and Kawahara, 2002). The cumulative mean normalized
+* difference function of the newest samples is searched for the shortest period that repeats well enough, refined by
+* parabolic interpolation. It finds at most one tone per step and no harmonics, at a fraction of the cost of the FFT
+* engine, which suits a solo voice per mic on low-power machines. Selected with pitch=yin in audio/devices.
+**/
+class YinDetector: public PitchDetector {
+  public:
+	/// Detect in windows of size samples at rate (the period search is limited to half of the window)
+	YinDetector(double rate, std::size_t size);
+	void analyze(float const* pcm, ToneSet& tones) override;
+  private:
+	const double m_rate;
+	const std::size_t m_size;
+	const std::size_t m_tauMin, m_tauMax;  ///< Range of periods searched, in samples
+	std::vector<float> m_diff;  ///< Cumulative mean normalized difference of periods 0 to m_tauMax
+};
@@ -1,7 +1,9 @@
 #include "pitch.hh"
 
+#include "pitch-yin.hh"
 #include "util.hh"
 #include "libda/fft.hpp"
+#include "libda/resample.hpp"
 #include <cmath>
 #include <iostream>
 #include <iomanip>
@@ -10,42 +12,170 @@
 // Limit the range to avoid noise and useless computation
 static const double FFT_MINFREQ = 45.0;
 static const double FFT_MAXFREQ = 5000.0;
+// Skip the analysis of inputs that stay below GATE_DB (peak level) for GATE_HOLD seconds (mics left in their stands)
+static const double GATE_DB = -65.0;
+static const double GATE_HOLD = 1.0;
+// Harmonics below a peak that count in the score of a fundamental for it
+static const std::size_t HARMONICS_SCORED = 7;
+
+namespace {
+	template <unsigned P> void transform(float const* pcm, std::vector<float> const& window, std::complex<float>* out) {
+		da::fft<P>(pcm, window, out);
+	}
+
+	template <unsigned P> void batchTransform(float const* const* pcm, std::size_t count, std::vector<float> const& window, std::complex<float>* const* out, float* scratch) {
+		da::fftBatch<P>(pcm, count, window, out, scratch);
+	}
+
+	/// The transform of fftSize points, or nullptr if not supported
+	Analyzer::Transform transformFor(std::size_t fftSize) {
+		static_assert(FFT_MIN_P == 9 && FFT_MAX_P == 12, "Update the transforms below");
+		switch (fftSize) {
+		  case 1 << 9: return transform<9>;
+		  case 1 << 10: return transform<10>;
+		  case 1 << 11: return transform<11>;
+		  case 1 << 12: return transform<12>;
+		}
+		return nullptr;
+	}
+
+	/// The batch transform of fftSize points, or nullptr if not supported
+	Analyzer::BatchTransform batchTransformFor(std::size_t fftSize) {
+		static_assert(ANALYZER_BATCH == da::FFT_LANES, "Analyzer batches must fill the lanes of the FFT");
+		switch (fftSize) {
+		  case 1 << 9: return batchTransform<9>;
+		  case 1 << 10: return batchTransform<10>;
+		  case 1 << 11: return batchTransform<11>;
+		  case 1 << 12: return batchTransform<12>;
+		}
+		return nullptr;
+	}
+
+	/// The supported FFT size covering at least fftSize samples decimated by factor (or fftSize if unsupported, for the error)
+	std::size_t decimatedSize(std::size_t fftSize, unsigned factor) {
+		if (!transformFor(fftSize)) return fftSize;
+		std::size_t n = std::size_t(1) << FFT_MIN_P;
+		while (n * factor < fftSize) n *= 2;
+		return n;
+	}
+}
 
 Tone::Tone():
   freq(0.0),
   db(-getInf()),
   stabledb(-getInf()),
   age()
-{
-	for (auto& h: harmonics) h = -getInf();
+{}
+
+bool Tone::operator==(double f) const {
+	return std::abs(freq / f - 1.0) < 0.05;
+}
+
+ToneSet::ToneSet(bool harmonics):
+  m_freq(CAPACITY),
+  m_db(CAPACITY),
+  m_stabledb(CAPACITY),
+  m_age(CAPACITY),
+  m_harmonics(harmonics ? CAPACITY * Tone::MAXHARM : 0)
+{}
+
+bool ToneSet::push_back(Tone const& t) {
+	if (m_size == CAPACITY) return false;
+	std::size_t i = m_size++;
+	m_freq[i] = t.freq;
+	m_db[i] = t.db;
+	m_stabledb[i] = t.stabledb;
+	m_age[i] = t.age;
+	if (float* h = harmonics(i)) std::fill(h, h + Tone::MAXHARM, -std::numeric_limits<float>::infinity());
+	return true;
 }
 
-void Tone::print() const {
-	if (age < Tone::MINAGE) return;
-	std::cout << std::fixed << std::setprecision(1) << freq << " Hz, age " << age << ", " << db << " dB:";
-	for (std::size_t i = 0; i < 8; ++i) std::cout << " " << harmonics[i];
+bool ToneSet::push_back(ToneSet const& other, std::size_t j) {
+	if (!push_back(other[j])) return false;
+	float* h = harmonics(m_size - 1);
+	float const* oh = other.harmonics(j);
+	if (h && oh) std::copy(oh, oh + Tone::MAXHARM, h);
+	return true;
+}
+
+Tone ToneSet::operator[](std::size_t i) const {
+	Tone t;
+	t.freq = m_freq[i];
+	t.db = m_db[i];
+	t.stabledb = m_stabledb[i];
+	t.age = m_age[i];
+	return t;
+}
+
+void ToneSet::sortedOrder(std::vector<std::uint16_t>& order) const {
+	order.resize(m_size);  // Never exceeds CAPACITY, so no allocation once reserved
+	// Stable insertion sort with the rough frequency compare of Tone, matching what std::list::sort did (there are only a few tones)
+	for (std::size_t i = 0; i < m_size; ++i) {
+		const Tone t = (*this)[i];
+		std::size_t j = i;
+		for (; j > 0 && t < (*this)[order[j - 1]]; --j) order[j] = order[j - 1];
+		order[j] = i;
+	}
+}
+
+void ToneSet::swap(ToneSet& other) {
+	std::swap(m_size, other.m_size);
+	m_freq.swap(other.m_freq);
+	m_db.swap(other.m_db);
+	m_stabledb.swap(other.m_stabledb);
+	m_age.swap(other.m_age);
+	m_harmonics.swap(other.m_harmonics);
+}
+
+void ToneSet::print(std::size_t i) const {
+	if (m_age[i] < Tone::MINAGE) return;
+	std::cout << std::fixed << std::setprecision(1) << m_freq[i] << " Hz, age " << m_age[i] << ", " << m_db[i] << " dB:";
+	if (float const* h = harmonics(i)) for (std::size_t n = 0; n < 8; ++n) std::cout << " " << h[n];
 	std::cout << std::endl;
 }
 
-bool Tone::operator==(double f) const {
-	return std::abs(freq / f - 1.0) < 0.05;
+AnalyzerSignal& Analyzer::signal() {
+	static AnalyzerSignal s;
+	return s;
+}
+
+bool Analyzer::supportsFFT(std::size_t fftSize) { return transformFor(fftSize); }
+
+std::unique_ptr<PitchDetector> PitchDetector::create(std::string const& name, double rate, std::size_t size) {
+	if (name == "fft") return nullptr;
+	if (name == "yin") return std::unique_ptr<PitchDetector>(new YinDetector(rate, size));
+	throw std::runtime_error("Unknown pitch detector " + name + " (use fft or yin)");
 }
 
-Analyzer::Analyzer(double rate, std::string id, std::size_t step):
-  m_step(step),
+Analyzer::Analyzer(double rate, std::string id, std::size_t step, std::size_t fftSize, std::string const& detector):
+  m_decimator(unsigned(rate / ANALYSIS_RATE)),
+  m_step(std::max<std::size_t>(1, step / m_decimator.factor())),
+  m_fftN(decimatedSize(fftSize, m_decimator.factor())),
+  m_transform(transformFor(m_fftN)),
+  m_batchTransform(batchTransformFor(m_fftN)),
   m_resampleFactor(1.0),
   m_resamplePos(),
   m_rate(rate),
   m_id(id),
-  m_window(FFT_N),
-  m_fftLastPhase(FFT_N / 2),
+  m_window(m_fftN),
+  m_pcm(m_fftN),
+  m_fft(m_fftN),
+  m_fftLastPhase(m_fftN / 2 + 1),
+  m_peaks(m_fftN / 2 + 2),
   m_peak(0.0),
-  m_oldfreq(0.0)
+  m_oldfreq(0.0),
+  m_gateLevel(std::pow(10.0, GATE_DB / 10.0)),
+  m_gateSteps(std::max(1.0, GATE_HOLD * analysisRate() / m_step)),
+  m_detectorName(detector),
+  m_detector(PitchDetector::create(detector, analysisRate(), m_fftN))
 {
-	if (m_step > FFT_N) throw std::logic_error("Analyzer step is larger that FFT_N (ideally it should be less than a fourth of FFT_N).");
+	m_order.reserve(tones_t::CAPACITY);
+	m_candidates.reserve(m_fftN / 2);
+	if (!transformFor(fftSize)) throw std::logic_error("Analyzer FFT size " + std::to_string(fftSize) + " is not supported.");
+	if (step == 0 || step > fftSize) throw std::logic_error("Analyzer step is zero or larger than the FFT size (ideally it should be less than a fourth of it).");
 	// Hamming window
-	for (size_t i=0; i < FFT_N; i++) {
-		m_window[i] = 0.53836 - 0.46164 * std::cos(TAU * i / (FFT_N - 1));
+	for (size_t i=0; i < m_fftN; i++) {
+		m_window[i] = 0.53836 - 0.46164 * std::cos(TAU * i / (m_fftN - 1));
 	}
 }
 
@@ -57,17 +187,8 @@ void Analyzer::output(float* begin, float* end, double rate) {
 	const unsigned in = m_resampleFactor * (m_rate / rate) * out + 2 * a /* lanczos kernel */ + 5 /* safety margin for rounding errors */;
 	float pcm[m_passthrough.capacity];
 	m_passthrough.read(pcm, pcm + in + 4);
-	for (unsigned i = 0; i < out; ++i) {
-		double s = 0.0;
-		unsigned k = m_resamplePos;
-		double x = m_resamplePos - k;
-		// Lanczos sampling of input at m_resamplePos
-		for (unsigned j = 0; j <= 2 * a; ++j) s += pcm[k + j] * da::lanc<a>(x - j + a);
-		s *= 5.0;
-		begin[i * 2] += s;
-		begin[i * 2 + 1] += s;
-		m_resamplePos += m_resampleFactor;
-	}
+	// Lanczos sampling of input at m_resamplePos, mixed to both output channels
+	m_resamplePos = da::LanczosResampler<a>::get().mix(pcm, m_resamplePos, m_resampleFactor, begin, out, 2, 5.0f);
 	unsigned num = m_resamplePos;
 	m_resamplePos -= num;
 	if (size > 3000) {
@@ -81,56 +202,65 @@ void Analyzer::output(float* begin, float* end, double rate) {
 }
 
 
-namespace {
-	struct Peak {
-		double freq;
-		double db;
-		bool harm[Tone::MAXHARM];
-		Peak(double _freq = 0.0, double _db = -getInf()):
-		  freq(_freq), db(_db)
-		{
-			for (auto& h: harm) h = false;
-		}
-		void clear() {
-			freq = 0.0;
-			db = -getInf();
-		}
-	};
-
-	Peak& match(std::vector<Peak>& peaks, std::size_t pos) {
-		std::size_t best = pos;
-		if (peaks[pos - 1].db > peaks[best].db) best = pos - 1;
-		if (peaks[pos + 1].db > peaks[best].db) best = pos + 1;
-		return peaks[best];
-	}
+Analyzer::Peak& Analyzer::match(std::vector<Peak>& peaks, std::size_t pos) {
+	std::size_t best = pos;
+	if (peaks[pos - 1].db > peaks[best].db) best = pos - 1;
+	if (peaks[pos + 1].db > peaks[best].db) best = pos + 1;
+	return peaks[best];
 }
 
-bool Analyzer::calcFFT() {
-	float pcm[FFT_N];
-	// Read FFT_N samples, move forward by m_step samples
-	if (!m_buf.read(pcm, pcm + FFT_N)) return false;
+bool Analyzer::readStep() {
+	float* pcm = m_pcm.data();
+	// A full ring has been dropping the newest input while nobody was analyzing (e.g. between songs), so it only holds
+	// stale audio that would delay the analysis for good: start over with what comes next
+	if (m_buf.size() == m_buf.capacity) m_buf.pop(m_buf.capacity);
+	// Read m_fftN samples, move forward by m_step samples
+	if (!m_buf.read(pcm, pcm + m_fftN)) return false;
 	m_buf.pop(m_step);
+	if (m_tap) {
+		m_tap(m_tapped ? pcm + m_fftN - m_step : pcm, pcm + m_fftN);
+		m_tapped = true;
+	}
 	// Peak level calculation of the most recent m_step samples (the rest is overlap)
-	for (float const* ptr = pcm + FFT_N - m_step; ptr != pcm + FFT_N; ++ptr) {
+	float stepPeak = 0.0f;
+	for (float const* ptr = pcm + m_fftN - m_step; ptr != pcm + m_fftN; ++ptr) {
 		float s = *ptr;
 		float p = s * s;
+		stepPeak = std::max(stepPeak, p);
 		if (p > m_peak) m_peak = p; else m_peak *= 0.999;
 	}
-	// Calculate FFT
-	m_fft = da::fft<FFT_P>(pcm, m_window);
+	// Silence gate: closes after a sustained quiet period, opens on the first louder step
+	if (stepPeak >= m_gateLevel) m_quietSteps = 0;
+	else if (m_quietSteps < m_gateSteps) ++m_quietSteps;
+	return true;
+}
+
+bool Analyzer::calcFFT() {
+	if (!readStep()) return false;
+	// Calculate FFT into the preallocated buffer (only used by the built-in engine)
+	if (!gated() && !m_detector) m_transform(m_pcm.data(), m_window, m_fft.data());
 	return true;
 }
 
 void Analyzer::calcTones() {
+	m_newTones.clear();
+	if (m_detector) m_detector->analyze(m_pcm.data(), m_newTones);
+	else calcFFTTones();
+	mergeWithOld();
+	m_tones.swap(m_merged);
+}
+
+void Analyzer::calcFFTTones() {
 	// Precalculated constants
-	const double freqPerBin = m_rate / FFT_N;
-	const double phaseStep = TAU * m_step / FFT_N;
-	const double normCoeff = 1.0 / FFT_N;
+	const double freqPerBin = analysisRate() / m_fftN;
+	const double phaseStep = TAU * m_step / m_fftN;
+	const double normCoeff = 1.0 / m_fftN;
 	const double minMagnitude = pow(10, -100.0 / 20.0) / normCoeff; // -100 dB
 	// Limit frequency range of processing
 	const size_t kMin = std::max(size_t(1), size_t(FFT_MINFREQ / freqPerBin));
-	const size_t kMax = std::min(FFT_N / 2, size_t(FFT_MAXFREQ / freqPerBin));
-	std::vector<Peak> peaks(kMax + 1); // One extra to simplify loops
+	const size_t kMax = std::min(m_fftN / 2, size_t(FFT_MAXFREQ / freqPerBin));
+	std::vector<Peak>& peaks = m_peaks;  // Allocated for all bins; kMax + 1 used (one extra to simplify loops)
+	for (size_t k = 0; k <= kMax; ++k) peaks[k].clear();
 	for (size_t k = 1; k <= kMax; ++k) {
 		double magnitude = std::abs(m_fft[k]);
 		double phase = std::arg(m_fft[k]);
@@ -154,17 +284,27 @@ void Analyzer::calcTones() {
 		if (db < prevdb) peaks[k].clear();
 		prevdb = db;
 	}
+	// The peaks loud enough to start a tone, from the highest bin down (noise leaves many quiet ones)
+	m_candidates.clear();
+	for (size_t k = kMax - 1; k >= kMin; --k) if (peaks[k].db >= -70.0) m_candidates.push_back(k);
 	// Find the tones (collections of harmonics) from the array of peaks
-	tones_t tones;
-	for (size_t k = kMax - 1; k >= kMin; --k) {
-		if (peaks[k].db < -70.0) continue;
+	tones_t& tones = m_newTones;
+	for (std::size_t k: m_candidates) {
+		if (peaks[k].db < -70.0) continue;  // Taken by a tone already
 		// Find the best divider for getting the fundamental from peaks[k]
 		std::size_t bestDiv = 1;
 		int bestScore = 0;
 		for (std::size_t div = 2; div <= Tone::MAXHARM && k / div > 1; ++div) {
+			// Each harmonic below peaks[k] scores at most +1, the fundamental +5: stop when no divider can do better
+			const std::size_t harmonics = std::min<std::size_t>(div, HARMONICS_SCORED + 1) - 1;
+			if (int(harmonics) + 4 <= bestScore) {
+				if (harmonics == HARMONICS_SCORED) break;
+				continue;
+			}
 			double freq = peaks[k].freq / div; // Fundamental
 			int score = 0;
-			for (std::size_t n = 1; n < div && n < 8; ++n) {
+			for (std::size_t n = 1; n <= harmonics; ++n) {
+				if (score + int(harmonics - n) + (n == 1 ? 5 : 1) <= bestScore) break;  // Cannot beat bestScore any more
 				Peak& p = match(peaks, k * n / div);
 				--score;
 				if (p.db < -90.0 || std::abs(p.freq / n / freq - 1.0) > .03) continue;
@@ -177,58 +317,112 @@ void Analyzer::calcTones() {
 			}
 		}
 		// Construct a Tone by combining the fundamental frequency (freq) and all harmonics
-		Tone t;
+		if (!tones.push_back(Tone())) { ++m_dropped; continue; }
+		const std::size_t i = tones.size() - 1;
+		float* harmonics = tones.harmonics(i);
 		std::size_t count = 0;
 		double freq = peaks[k].freq / bestDiv;
-		t.db = peaks[k].db;
+		double tfreq = 0.0;
+		double tdb = peaks[k].db;
 		for (std::size_t n = 1; n <= bestDiv; ++n) {
 			// Find the peak for n'th harmonic
 			Peak& p = match(peaks, k * n / bestDiv);
 			if (std::abs(p.freq / n / freq - 1.0) > .03) continue; // Does it match the fundamental freq?
-			if (p.db > t.db - 10.0) {
-				t.db = std::max(t.db, p.db);
+			if (p.db > tdb - 10.0) {
+				tdb = std::max(tdb, p.db);
 				++count;
-				t.freq += p.freq / n;
+				tfreq += p.freq / n;
 			}
-			t.harmonics[n - 1] = p.db;
+			if (harmonics) harmonics[n - 1] = p.db;
 			p.clear();
 		}
-		t.freq /= count;
+		tones.freq(i) = tfreq / count;
+		tones.db(i) = tdb;
 		// If the tone seems strong enough, add it (-3 dB compensation for each harmonic)
-		if (t.db > -50.0 - 3.0 * count) {
-			t.stabledb = t.db;
-			tones.push_back(t);
-		}
+		if (tdb > -50.0 - 3.0 * count) tones.stabledb(i) = tdb;
+		else tones.pop_back();  // Too weak
 	}
-	mergeWithOld(tones);
-	m_tones.swap(tones);
 }
 
-void Analyzer::mergeWithOld(tones_t& tones) const {
-	tones.sort();
-	auto it = tones.begin();
+void Analyzer::mergeWithOld() {
+	tones_t const& tones = m_newTones;
+	tones_t& out = m_merged;
+	out.clear();
+	tones.sortedOrder(m_order);
+	std::size_t pos = 0;
+	// Emit new tones (in frequency order) until the one at pos
+	auto flush = [&](std::size_t end) {
+		for (; pos < end; ++pos) if (!out.push_back(tones, m_order[pos])) ++m_dropped;
+	};
+	std::size_t it = 0;
 	// Iterate over old tones
-	for (auto const& old: m_tones) {
+	for (std::size_t o = 0; o < m_tones.size(); ++o) {
+		Tone const old = m_tones[o];
 		// Try to find a matching new tone
-		while (it != tones.end() && *it < old) ++it;
+		while (it < m_order.size() && tones[m_order[it]] < old) ++it;
+		flush(it);
 		// If match found
-		if (it != tones.end() && *it == old) {
+		if (it < m_order.size() && tones[m_order[it]] == old) {
 			// Merge the old tone into the new tone
-			it->age = old.age + 1;
-			it->stabledb = 0.8 * old.stabledb + 0.2 * it->db;
-			it->freq = 0.5 * old.freq + 0.5 * it->freq;
+			std::size_t i = m_order[it];
+			m_newTones.age(i) = old.age + 1;
+			m_newTones.stabledb(i) = 0.8 * old.stabledb + 0.2 * tones.db(i);
+			m_newTones.freq(i) = 0.5 * old.freq + 0.5 * tones.freq(i);
 		} else if (old.db > -80.0) {
 			// Insert a decayed version of the old tone into new tones
-			Tone& t = *tones.insert(it, old);
-			t.db -= 5.0;
-			t.stabledb -= 0.1;
+			if (!out.push_back(m_tones, o)) { ++m_dropped; continue; }
+			std::size_t i = out.size() - 1;
+			out.db(i) -= 5.0;
+			out.stabledb(i) -= 0.1;
 		}
 	}
+	flush(m_order.size());
 }
 
-void Analyzer::process() {
+void Analyzer::process(std::function<void ()> const& onStep) {
 	// Try calculating FFT and calculate tones until no more data in input buffer
-	while (calcFFT()) calcTones();
+#ifndef NDEBUG
+	const std::size_t dropped = m_dropped;
+#endif
+	while (calcFFT()) {
+		if (!gated()) calcTones();
+		else if (!m_tones.empty()) m_tones.clear();  // Nothing is being sung
+		if (onStep) onStep();
+	}
+#ifndef NDEBUG
+	if (m_dropped != dropped) {
+		// Plain std::clog (rare, and log.cc is not part of pitchbench)
+		std::clog << "pitch/debug: Analyzer " << m_id << " dropped " << m_dropped - dropped << " tone(s), tone storage is full" << std::endl;
+	}
+#endif
 }
 
-
+void Analyzer::process(Analyzer* const* batch, std::size_t count) {
+	if (count == 1) { batch[0]->process(); return; }
+	if (count > ANALYZER_BATCH) throw std::logic_error("Analyzer batch is too large");
+	float scratch[ANALYZER_BATCH * FFT_MAX_N];
+	// Analyze a step of each analyzer that has one, transforming all of them at once
+	while (true) {
+		bool input = false;
+		Analyzer* lanes[ANALYZER_BATCH];
+		float const* pcm[ANALYZER_BATCH];
+		std::complex<float>* fft[ANALYZER_BATCH];
+		std::size_t n = 0;
+		for (std::size_t i = 0; i < count; ++i) {
+			Analyzer& a = *batch[i];
+			if (!a.readStep()) continue;
+			input = true;
+			if (a.gated()) { if (!a.m_tones.empty()) a.m_tones.clear(); continue; }
+			if (a.m_detector) { a.calcTones(); continue; }  // Needs no FFT
+			lanes[n] = &a;
+			pcm[n] = a.m_pcm.data();
+			fft[n] = a.m_fft.data();
+			++n;
+		}
+		if (!input) return;
+		if (n == 0) continue;
+		if (n == 1) lanes[0]->m_transform(pcm[0], lanes[0]->m_window, fft[0]);
+		else lanes[0]->m_batchTransform(pcm, n, lanes[0]->m_window, fft, scratch);
+		for (std::size_t i = 0; i < n; ++i) lanes[i]->calcTones();
+	}
+}
@@ -1,11 +1,21 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <complex>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <vector>
-#include <list>
 #include <algorithm>
 #include <cmath>
+#include <limits>
+#include <string>
+
+#include "libda/resample.hpp"
 
 /// struct to represent tones
 struct Tone {
@@ -14,15 +24,58 @@ struct Tone {
 	double freq; ///< Frequency (Hz)
 	double db; ///< Level (dB)
 	double stabledb; ///< Stable level, useful for graphics rendering
-	double harmonics[MAXHARM]; ///< Harmonics' levels
 	std::size_t age; ///< How many times the tone has been detected in row
 	Tone();
-	void print() const; ///< Prints Tone to std::cout
 	bool operator==(double f) const; ///< Compare for rough frequency match
 	/// Less-than compare by levels (instead of frequencies like operator< does)
 	static bool dbCompare(Tone const& l, Tone const& r) { return l.db < r.db; }
 };
 
+/**
+* Fixed-capacity container of tones, stored as structure-of-arrays so that scanning
+* frequencies or levels touches only a few contiguous cache lines. The harmonics' levels
+* are optional and kept in a separate table. All storage is allocated on construction.
+**/
+class ToneSet {
+public:
+	static const std::size_t CAPACITY = 256; ///< Maximum number of tones (more than the peaks of a single FFT)
+	explicit ToneSet(bool harmonics = true);
+	std::size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	void clear() { m_size = 0; }
+	/// Append a tone (harmonics reset to -inf), returns false if there is no room for it
+	bool push_back(Tone const& t);
+	/// Append a copy of tone i of other (including harmonics), returns false if there is no room for it
+	bool push_back(ToneSet const& other, std::size_t i);
+	/// Remove the last tone
+	void pop_back() { --m_size; }
+	/// Get tone i as a value
+	Tone operator[](std::size_t i) const;
+	double freq(std::size_t i) const { return m_freq[i]; }
+	double db(std::size_t i) const { return m_db[i]; }
+	double stabledb(std::size_t i) const { return m_stabledb[i]; }
+	std::size_t age(std::size_t i) const { return m_age[i]; }
+	double& freq(std::size_t i) { return m_freq[i]; }
+	double& db(std::size_t i) { return m_db[i]; }
+	double& stabledb(std::size_t i) { return m_stabledb[i]; }
+	std::size_t& age(std::size_t i) { return m_age[i]; }
+	bool hasHarmonics() const { return !m_harmonics.empty(); }
+	/// Levels of the Tone::MAXHARM harmonics of tone i, or nullptr if harmonics are not stored
+	float* harmonics(std::size_t i) { return hasHarmonics() ? &m_harmonics[i * Tone::MAXHARM] : nullptr; }
+	float const* harmonics(std::size_t i) const { return hasHarmonics() ? &m_harmonics[i * Tone::MAXHARM] : nullptr; }
+	/// Fill order with the indices of all tones, sorted by frequency
+	void sortedOrder(std::vector<std::uint16_t>& order) const;
+	void swap(ToneSet& other);
+	void print(std::size_t i) const; ///< Prints tone i to std::cout
+private:
+	std::size_t m_size = 0;
+	std::vector<double> m_freq;
+	std::vector<double> m_db;
+	std::vector<double> m_stabledb;
+	std::vector<std::size_t> m_age;
+	std::vector<float> m_harmonics;
+};
+
 static inline bool operator==(Tone const& lhs, Tone const& rhs) { return lhs == rhs.freq; }
 static inline bool operator!=(Tone const& lhs, Tone const& rhs) { return !(lhs == rhs); }
 static inline bool operator<=(Tone const& lhs, Tone const& rhs) { return lhs.freq < rhs.freq || lhs == rhs; }
@@ -30,43 +83,98 @@ static inline bool operator>=(Tone const& lhs, Tone const& rhs) { return lhs.fre
 static inline bool operator<(Tone const& lhs, Tone const& rhs) { return lhs.freq < rhs.freq && lhs != rhs; }
 static inline bool operator>(Tone const& lhs, Tone const& rhs) { return lhs.freq > rhs.freq && lhs != rhs; }
 
-static const unsigned FFT_P = 10;
+static const unsigned FFT_P = 10;  ///< Default FFT size of analyzers (2^FFT_P points)
 static const std::size_t FFT_N = 1 << FFT_P;
+static const unsigned FFT_MIN_P = 9, FFT_MAX_P = 12;  ///< FFT sizes that Analyzer supports
+static const std::size_t FFT_MAX_N = 1 << FFT_MAX_P;
+static const std::size_t ANALYZER_BATCH = 4;  ///< Maximum number of analyzers transformed together (one per SIMD lane)
+static const double ANALYSIS_RATE = 16000.0;  ///< Analyzers decimate their input to about this rate (enough for the tones used)
 
-/// Lock-free ring buffer. Discards oldest data on overflow (not strictly thread-safe).
+/**
+* Single-producer single-consumer lock-free ring buffer. Only the producer writes m_write and only the
+* consumer writes m_read, so one thread may insert while another one reads and pops. The indices run
+* freely and are masked on access (SIZE must be a power of two). Data that does not fit is discarded.
+**/
 template <size_t SIZE> class RingBuffer {
+	static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "RingBuffer SIZE must be a power of two");
 public:
 	constexpr static size_t capacity = SIZE;
-	RingBuffer(): m_read(), m_write() {}  ///< Initialize empty buffer
+	RingBuffer() {}  ///< Initialize empty buffer
+	/// Append data (producer only). Whatever does not fit in the free space is dropped; a consumer that cares about
+	/// latency more than continuity discards the stale contents of a full buffer itself (see Analyzer::readStep).
 	template <typename InIt> void insert(InIt begin, InIt end) {
-		unsigned r = m_read;  // The read position
-		unsigned w = m_write;  // The write position
-		bool overflow = false;
-		while (begin != end) {
-			m_buf[w] = *begin++;  // Copy sample
-			w = modulo(w + 1);  // Update cursor
-			if (w == r) overflow = true;
-		}
-		m_write = w;
-		if (overflow) m_read = modulo(w + 1);  // Reset read pointer on overflow
+		const unsigned w = m_write.load(std::memory_order_relaxed);
+		const unsigned r = m_read.load(std::memory_order_acquire);  // Consumer is done with the data before r
+		const unsigned n = std::min<unsigned>(end - begin, SIZE - (w - r));
+		const unsigned pos = w & MASK;
+		const unsigned first = std::min<unsigned>(n, SIZE - pos);  // Up to the physical end of the buffer
+		std::copy_n(begin, first, m_buf + pos);
+		std::copy_n(begin + first, n - first, m_buf);
+		m_write.store(w + n, std::memory_order_release);  // Publish the data
 	}
 	/// Read data from current position if there is enough data to fill the range (otherwise return false). Does not move read pointer.
-	template <typename OutIt> bool read(OutIt begin, OutIt end) {
-		unsigned r = m_read;
-		if (modulo(m_write - r) <= end - begin) return false;  // Not enough audio available
-		while (begin != end) *begin++ = m_buf[r++ % SIZE];  // Copy audio to output iterator
+	template <typename OutIt> bool read(OutIt begin, OutIt end) const {
+		const unsigned n = end - begin;
+		const unsigned r = m_read.load(std::memory_order_relaxed);
+		const unsigned w = m_write.load(std::memory_order_acquire);
+		if (w - r < n) return false;  // Not enough audio available
+		const unsigned pos = r & MASK;
+		const unsigned first = std::min<unsigned>(n, SIZE - pos);
+		std::copy_n(m_buf + pos, first, begin);
+		std::copy_n(m_buf, n - first, begin + first);
 		return true;
 	}
-	void pop(unsigned n) { m_read = modulo(m_read + n); } ///< Move reading pointer forward.
-	unsigned size() const { return modulo(m_write - m_read); }
+	/// Move reading pointer forward (consumer only), at most to the end of available data.
+	void pop(unsigned n) {
+		const unsigned r = m_read.load(std::memory_order_relaxed);
+		n = std::min(n, m_write.load(std::memory_order_acquire) - r);
+		m_read.store(r + n, std::memory_order_release);  // Hand the space back to the producer
+	}
+	unsigned size() const { return m_write.load(std::memory_order_acquire) - m_read.load(std::memory_order_acquire); }
 private:
-	static unsigned modulo(unsigned idx) { return (SIZE + idx) % SIZE; }  ///< Modulo operation with proper rounding (handles slightly "negative" idx as well)
+	static constexpr unsigned MASK = SIZE - 1;
 	float m_buf[SIZE];
-	// The indices of the next read/write operations. read == write implies that buffer is empty.
+	// Free-running positions of the next read/write operations. read == write implies that buffer is empty.
 	std::atomic<unsigned> m_read{ 0 };
 	std::atomic<unsigned> m_write{ 0 };
 };
 
+/**
+* Signalled by the analyzers whenever one of them has input for a new step, so that the engine can wait for
+* input instead of polling. notify does not block (it is called from audio callbacks) and may thus be missed by a
+* thread that is just about to wait, which is why waiting always has a timeout.
+**/
+class AnalyzerSignal {
+  public:
+	void notify() { ++m_count; m_cond.notify_all(); }
+	/// The number of notifications so far (remember it before processing and wait on it after)
+	unsigned count() const { return m_count; }
+	/// Wait until notified after count() returned count, or until timeout
+	void wait(unsigned count, std::chrono::duration<double> timeout) {
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_cond.wait_for(l, timeout, [&]{ return m_count != count; });
+	}
+  private:
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::atomic<unsigned> m_count{ 0 };
+};
+
+/**
+* Alternative pitch detection engine of an Analyzer. The default engine (FFT peaks combined into tones by their
+* harmonics) is built into Analyzer, as it transforms the windows of several analyzers at once and Spectrogram shows
+* its spectrum. A detector gets the window of each step instead and adds the tones that it finds in it; the analyzer
+* tracks the tones over the steps (age, stable level) the same way for all engines.
+**/
+class PitchDetector {
+  public:
+	virtual ~PitchDetector() = default;
+	/// Add the tones of the window pcm (the FFT size of the analyzer at its analysis rate, the newest sample last)
+	virtual void analyze(float const* pcm, ToneSet& tones) = 0;
+	/// The detector called name ("yin") for windows of size samples at rate; nullptr for "fft" (the built-in engine)
+	static std::unique_ptr<PitchDetector> create(std::string const& name, double rate, std::size_t size);
+};
+
 /// analyzer class
  /** class to analyze input audio and transform it into useable data
  */
@@ -76,61 +184,147 @@ public:
   	const Analyzer& operator=(const Analyzer&) = delete;
 	/// fast fourier transform vector
 	typedef std::vector<std::complex<float> > fft_t;
-	/// list of tones
-	typedef std::list<Tone> tones_t;
-	/// constructor
-	Analyzer(double rate, std::string id, std::size_t step = 200);
+	/// collection of tones, sorted by frequency
+	typedef ToneSet tones_t;
+	/// Transform of fftSize windowed samples into fftSize bins
+	typedef void (*Transform)(float const* pcm, std::vector<float> const& window, std::complex<float>* out);
+	/// Transform of the windowed samples of count <= ANALYZER_BATCH analyzers at once (scratch holds ANALYZER_BATCH * fftSize floats)
+	typedef void (*BatchTransform)(float const* const* pcm, std::size_t count, std::vector<float> const& window, std::complex<float>* const* out, float* scratch);
+	/**
+	* Construct with step (hop) samples between FFTs of fftSize points (a power of two between 2^FFT_MIN_P and 2^FFT_MAX_P),
+	* both at the input rate. The input is decimated by an integer factor to about ANALYSIS_RATE, and the FFT size and step
+	* are scaled to match, the FFT rounded up to a power of two (so it covers at least the same time with finer bins).
+	* The tones are found by the engine called detector (see PitchDetector::create).
+	**/
+	Analyzer(double rate, std::string id, std::size_t step = 200, std::size_t fftSize = FFT_N, std::string const& detector = "fft");
+	/** Is fftSize supported by the constructor **/
+	static bool supportsFFT(std::size_t fftSize);
 	/** Add input data to buffer. This is thread-safe (against other functions). **/
 	template <typename InIt> void input(InIt begin, InIt end) {
-		m_buf.insert(begin, end);
 		m_passthrough.insert(begin, end);
+		// Decimate in blocks to the analysis rate
+		float in[256], out[256];
+		while (begin != end) {
+			std::size_t n = 0;
+			for (; n < 256 && begin != end; ++n, ++begin) in[n] = *begin;
+			const std::size_t decimated = m_decimator.process(in, n, out);
+			m_buf.insert(out, out + decimated);
+			m_unsignalled += decimated;
+		}
+		if (m_unsignalled >= m_step) { m_unsignalled %= m_step; signal().notify(); }
 	}
-	/** Call this to process all data input so far. **/
-	void process();
+	/** Notified by all analyzers when they have input for a new step. **/
+	static AnalyzerSignal& signal();
+	/** Call this to process all data input so far, calling onStep (if given) after each analysis step. **/
+	void process(std::function<void ()> const& onStep = std::function<void ()>());
+	/**
+	* Process all data input so far on count <= ANALYZER_BATCH analyzers of the same device (they must have equal FFT sizes),
+	* computing their FFTs together in SIMD lanes. Faster than processing each of them separately.
+	**/
+	static void process(Analyzer* const* batch, std::size_t count);
 	/** Get the raw FFT. **/
 	fft_t const& getFFT() const { return m_fft; }
+	/** Number of points of the FFT (at the analysis rate) **/
+	std::size_t fftSize() const { return m_fftN; }
+	/** Number of samples between FFTs (at the analysis rate) **/
+	std::size_t step() const { return m_step; }
+	/** Name of the pitch detection engine **/
+	std::string const& detector() const { return m_detectorName; }
+	/** Sample rate of the input **/
+	double inputRate() const { return m_rate; }
+	/** Sample rate of the FFT **/
+	double analysisRate() const { return m_rate / m_decimator.factor(); }
 	/** Get the peak level in dB (negative value, 0.0 = clipping). **/
 	double getPeak() const { return 10.0 * log10(m_peak); }
 	/** Get a list of all tones detected. **/
 	tones_t const& getTones() const { return m_tones; }
-	/** Find a tone within the singing range; prefers strong tones around 200-400 Hz. **/
-	Tone const* findTone(double minfreq = 65.0, double maxfreq = 1000.0) const {
-		if (m_tones.empty()) { m_oldfreq = 0.0; return nullptr; }
-		double db = std::max_element(m_tones.begin(), m_tones.end(), Tone::dbCompare)->db;
-		Tone const* best = nullptr;
+	/** Find a tone within the singing range into found (returns false if none); prefers strong tones around 200-400 Hz. **/
+	bool findTone(Tone& found, double minfreq = 65.0, double maxfreq = 1000.0) const {
+		tones_t const& tones = m_tones;
+		if (tones.empty()) { m_oldfreq = 0.0; return false; }
+		double db = -std::numeric_limits<double>::infinity();
+		for (std::size_t i = 0; i < tones.size(); ++i) db = std::max(db, tones.db(i));
+		std::size_t best = tones.size();
 		double bestscore = 0;
-		for (tones_t::const_iterator it = m_tones.begin(); it != m_tones.end(); ++it) {
-			if (it->db < db - 20.0 || it->freq < minfreq || it->age < Tone::MINAGE) continue;
-			if (it->freq > maxfreq) break;
-			double score = it->db - std::max(180.0, std::abs(it->freq - 300.0)) / 10.0;
-			if (m_oldfreq != 0.0 && std::fabs(it->freq/m_oldfreq - 1.0) < 0.05) score += 10.0;
-			if (best && bestscore > score) break;
-			best = &*it;
+		for (std::size_t i = 0; i < tones.size(); ++i) {
+			const double freq = tones.freq(i);
+			if (tones.db(i) < db - 20.0 || freq < minfreq || tones.age(i) < Tone::MINAGE) continue;
+			if (freq > maxfreq) break;
+			double score = tones.db(i) - std::max(180.0, std::abs(freq - 300.0)) / 10.0;
+			if (m_oldfreq != 0.0 && std::fabs(freq/m_oldfreq - 1.0) < 0.05) score += 10.0;
+			if (best != tones.size() && bestscore > score) break;
+			best = i;
 			bestscore = score;
 		}
-		m_oldfreq = (best ? best->freq : 0.0);
-		return best;
+		if (best == tones.size()) { m_oldfreq = 0.0; return false; }
+		found = tones[best];
+		m_oldfreq = found.freq;
+		return true;
 	}
 	/** Give data away for mic pass-through */
 	void output(float* begin, float* end, double rate);
 	/** Returns the id (color name) of the mic */
 	std::string const& getId() const { return m_id; }
+	/** Number of tones dropped because the tone storage was full (should stay zero). **/
+	std::size_t dropped() const { return m_dropped; }
+	/** Is the analysis skipped because the input has been silent for a while **/
+	bool gated() const { return m_quietSteps >= m_gateSteps; }
+	/** Latency of the input in addition to audio/round-trip (e.g. of a network transport), in seconds **/
+	double latency() const { return m_latency; }
+	void setLatency(double seconds) { m_latency = seconds; }
+	/**
+	* Call tap with the samples that the analysis consumes (at analysisRate, on the thread processing), or stop with an
+	* empty function. Each step passes the samples it adds, the first one its whole window. Not while processing.
+	**/
+	void setTap(std::function<void (float const*, float const*)> tap) { m_tap = std::move(tap); m_tapped = false; }
 
 private:
+	/// FFT bin with its exact frequency, used internally by calcTones
+	struct Peak {
+		double freq;
+		double db;
+		Peak(double _freq = 0.0, double _db = -std::numeric_limits<double>::infinity()): freq(_freq), db(_db) {}
+		void clear() { *this = Peak(); }
+	};
+	static Peak& match(std::vector<Peak>& peaks, std::size_t pos);
+	da::Decimator m_decimator;  ///< Input rate to analysis rate (used by the input thread only)
 	const std::size_t m_step;
-	RingBuffer<2 * FFT_N> m_buf;  // Twice the FFT size should give enough room for sliding window and for engine delays
+	const std::size_t m_fftN;
+	const Transform m_transform;  ///< da::fft instance of size m_fftN
+	const BatchTransform m_batchTransform;  ///< da::fftBatch instance of size m_fftN
+	std::size_t m_unsignalled = 0;  ///< Input samples since the last notification (used by the input thread only)
+	RingBuffer<2 * FFT_MAX_N> m_buf;  // Twice the FFT size should give enough room for sliding window and for engine delays
 	RingBuffer<4096> m_passthrough;
 	double m_resampleFactor;
 	double m_resamplePos;
-	double m_rate;
+	double m_rate;  ///< Input rate
 	std::string m_id;
 	std::vector<float> m_window;
+	std::vector<float> m_pcm;  ///< Samples of the current step
 	fft_t m_fft;
 	std::vector<float> m_fftLastPhase;
+	std::vector<Peak> m_peaks;
+	std::vector<std::uint16_t> m_candidates;  ///< Bins of m_peaks that may start a tone, in the order calcTones tries them
 	double m_peak;
 	tones_t m_tones;
+	tones_t m_newTones;  ///< Tones of the current step before merging
+	tones_t m_merged;  ///< Merge output, swapped with m_tones
+	std::vector<std::uint16_t> m_order;  ///< Frequency order of m_newTones
+	std::size_t m_dropped = 0;
 	mutable double m_oldfreq;
+	const float m_gateLevel;  ///< Squared sample level below which a step counts as quiet
+	const std::size_t m_gateSteps;  ///< Quiet steps in a row that close the silence gate
+	std::size_t m_quietSteps = 0;
+	std::atomic<double> m_latency{ 0.0 };
+	std::function<void (float const*, float const*)> m_tap;
+	bool m_tapped = false;  ///< Has m_tap got the first window
+	const std::string m_detectorName;
+	const std::unique_ptr<PitchDetector> m_detector;  ///< nullptr for the built-in FFT engine
+	bool readStep();
 	bool calcFFT();
+	/// Find the tones of the current step and merge them with the old ones
 	void calcTones();
-	void mergeWithOld(tones_t& tones) const;
+	/// The built-in engine: tones from the peaks of m_fft
+	void calcFFTTones();
+	void mergeWithOld();
 };
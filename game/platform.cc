@@ -1,6 +1,16 @@
 #include "platform.hh"
 #include "fs.hh"
 
+#if (BOOST_OS_WINDOWS)
+#include <windows.h>
+#elif (BOOST_OS_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 Platform::platforms Platform::currentOS() {
 if (BOOST_OS_WINDOWS != 0) { return windows; }
 else if (BOOST_OS_LINUX != 0) { return linux; }
@@ -21,6 +31,41 @@ Platform::Platform() {
 	#endif
 }
 
+void Platform::lowerThreadPriority(int nice) {
+	#if (BOOST_OS_WINDOWS)
+	SetThreadPriority(GetCurrentThread(), nice >= 10 ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_BELOW_NORMAL);
+	#elif (BOOST_OS_LINUX)
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice);  // Nice values are per thread on Linux
+	#else
+	(void)nice;
+	#endif
+}
+
+void Platform::raiseThreadPriority() {
+	#if (BOOST_OS_WINDOWS)
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	#elif (BOOST_OS_LINUX)
+	sched_param param{};
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	// Real-time scheduling needs a permission, otherwise try a higher nice value
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) setpriority(PRIO_PROCESS, syscall(SYS_gettid), -5);
+	#endif
+}
+
+bool Platform::setThreadAffinity(std::uint64_t mask) {
+	#if (BOOST_OS_WINDOWS)
+	return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(mask)) != 0;
+	#elif (BOOST_OS_LINUX)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned i = 0; i < 64; ++i) if (mask >> i & 1) CPU_SET(i, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+	#else
+	(void)mask;
+	return false;  // macOS only has affinity hints
+	#endif
+}
+
 const std::array<const char*,6> Platform::platformNames = {{ "Windows", "Linux", "MacOS", "BSD", "Solaris", "Unix" }}; // Relevant for debug only.
 
 int Platform::defaultBackEnd() {
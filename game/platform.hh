@@ -4,6 +4,7 @@
 #include "log.hh"
 
 #include <array>
+#include <cstdint>
 #include <iostream>
 
 #if ((BOOST_VERSION / 100 % 1000) >= 55)
@@ -32,6 +33,12 @@ Platform();
 static platforms currentOS();
 static uint16_t shortcutModifier(bool eitherSide = true);
 static int defaultBackEnd();
+/// Let the calling thread yield to the others (for background work that is not time critical); nice is 1 to 19 as on Unix
+static void lowerThreadPriority(int nice = 5);
+/// Let the calling thread preempt the others (for real-time audio); does nothing if not permitted
+static void raiseThreadPriority();
+/// Restrict the calling thread to the CPU cores in mask (bit n for core n), returning false if not supported
+static bool setThreadAffinity(std::uint64_t mask);
 
 private:
 static const std::array<const char*,6> platformNames;
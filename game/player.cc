@@ -2,10 +2,42 @@
 #include "song.hh"
 #include "engine.hh" // just for Engine::TIMESTEP
 
+#include <cmath>
+
+namespace {
+	/// Glow fade of a note sung over a whole timestep
+	const double FADE_PER_STEP = std::pow(0.05, Engine::TIMESTEP);
+}
+
+PitchHistory::PitchHistory(std::size_t size): m_size(size), m_chunks((size + CHUNK - 1) / CHUNK) {}
+
+PitchHistory::Chunk& PitchHistory::write(std::size_t idx) {
+	auto& c = m_chunks[idx / CHUNK];
+	if (!c) c = std::make_unique<Chunk>();  // Written by the engine before the timesteps that readers may access
+	return *c;
+}
+
+void PitchHistory::set(std::size_t idx, double freq, double db) {
+	Chunk& c = write(idx);
+	c.freq[idx % CHUNK] = freq;
+	c.level[idx % CHUNK] = std::lround(clamp(db, -300.0, 0.0) * 10.0);
+	c.voiced[idx % CHUNK] = true;
+}
+
+void PitchHistory::unvoiced(std::size_t idx) { write(idx).voiced[idx % CHUNK] = false; }
+
+double PitchHistory::freq(std::size_t idx) const {
+	Chunk const& c = chunk(idx);
+	return c.voiced[idx % CHUNK] ? c.freq[idx % CHUNK] : getNaN();
+}
+
+double PitchHistory::db(std::size_t idx) const {
+	Chunk const& c = chunk(idx);
+	return c.voiced[idx % CHUNK] ? c.level[idx % CHUNK] * 0.1 : -getInf();
+}
 
 Player::Player(VocalTrack& vocal, Analyzer& analyzer, size_t frames):
-	  m_vocal(vocal), m_analyzer(analyzer), m_pitch(frames, std::make_pair(getNaN(),
-	  -getInf())), m_pos(), m_score(), m_noteScore(), m_lineScore(), m_maxLineScore(),
+	  m_vocal(vocal), m_scale(vocal.scale), m_analyzer(analyzer), m_pitch(frames), m_pos(), m_score(), m_noteScore(), m_lineScore(), m_maxLineScore(),
 	  m_prevLineScore(-1), m_feedbackFader(0.0, 2.0), m_activitytimer(),
 	  m_scoreIt(m_vocal.notes.begin())
 {
@@ -19,22 +51,26 @@ void Player::update() {
 	if (m_pos == m_pitch.size()) return; // End of song already
 	double beginTime = Engine::TIMESTEP * m_pos;
 	// Get the currently sung tone and store it in player's pitch data (also control inactivity timer)
-	Tone const* t = m_analyzer.findTone();
+	Tone tone;
+	Tone const* t = m_analyzer.findTone(tone) ? &tone : nullptr;
 	if (t) {
 		m_activitytimer = 1000;
-		m_pitch[m_pos++] = std::make_pair(t->freq, t->stabledb);
+		m_pitch.set(m_pos++, t->freq, t->stabledb);
 	} else {
 		if (m_activitytimer > 0) --m_activitytimer;
-		m_pitch[m_pos++] = std::make_pair(getNaN(), -getInf());
+		m_pitch.unvoiced(m_pos++);
 	}
 	double endTime = Engine::TIMESTEP * m_pos;
+	// The same note value for all the notes of this timestep
+	const double note = t ? m_scale.setFreq(t->freq).getNote() : getNaN();
 	// Iterate over all the notes that are considered for this timestep
 	while (m_scoreIt != m_vocal.notes.end()) {
 		if (endTime < m_scoreIt->begin) break;  // The note begins later than on this timestep
+		// Fade glow (by the whole step unless the note begins or ends within it)
+		if (m_scoreIt->begin <= beginTime && m_scoreIt->end >= endTime) m_scoreIt->power *= FADE_PER_STEP;
+		else m_scoreIt->power *= std::pow(0.05, m_scoreIt->clampDuration(beginTime, endTime));
 		// If tone was detected, calculate score
-		m_scoreIt->power *= std::pow(0.05, m_scoreIt->clampDuration(beginTime, endTime));  // Fade glow
 		if (t) {
-			double note = MusicalScale(m_vocal.scale).setFreq(t->freq).getNote();
 			// Add score
 			double score_addition = m_vocal.m_scoreFactor * m_scoreIt->score(note, beginTime, endTime);
 			m_score += score_addition;
@@ -5,24 +5,58 @@
 #include "notes.hh"
 #include "animvalue.hh"
 
+#include <bitset>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 #include <utility>
 
 class Song;
 
+/**
+* Pitch of each engine timestep (frequency and level of the sung tone). Stored as floats and centibels with a
+* separate voicing bitmap, in chunks that are allocated only when the song gets that far. The chunk table is
+* allocated on construction, so that other threads may read the timesteps written so far.
+**/
+class PitchHistory {
+  public:
+	explicit PitchHistory(std::size_t size);
+	std::size_t size() const { return m_size; }
+	/// Store a sung tone
+	void set(std::size_t idx, double freq, double db);
+	/// Store silence
+	void unvoiced(std::size_t idx);
+	bool voiced(std::size_t idx) const { return chunk(idx).voiced[idx % CHUNK]; }
+	/// Frequency (Hz), NaN if unvoiced
+	double freq(std::size_t idx) const;
+	/// Level (dB), -inf if unvoiced
+	double db(std::size_t idx) const;
+  private:
+	static const std::size_t CHUNK = 1024;  ///< Timesteps per chunk (about ten seconds)
+	struct Chunk {
+		float freq[CHUNK];
+		std::int16_t level[CHUNK];  ///< Centibels
+		std::bitset<CHUNK> voiced;
+	};
+	Chunk& write(std::size_t idx);
+	Chunk const& chunk(std::size_t idx) const { return *m_chunks[idx / CHUNK]; }
+	std::size_t m_size;
+	std::vector<std::unique_ptr<Chunk>> m_chunks;
+};
+
 /// player class
 struct Player {
 	/// currently played vocal track
 	VocalTrack& m_vocal;
+	/// scale of m_vocal, for converting the sung frequencies to notes
+	MusicalScale m_scale;
 	/// sound analyzer
 	Analyzer& m_analyzer;
 	/// player color for bars, waves, scores
 	Color m_color;
-	/// typedef for pitch
-	typedef std::vector<std::pair<double, double> > pitch_t;
 	/// player's pitch
-	pitch_t m_pitch;
+	PitchHistory m_pitch;
 	/// current position in pitch vector (first unused spot)
 	size_t m_pos;
 	/// score for current song
@@ -43,8 +77,6 @@ struct Player {
 	Notes::const_iterator m_scoreIt;
 	/// constructor
 	Player(VocalTrack& vocal, Analyzer& analyzer, size_t frames);
-	/// prepares analyzer
-	void prepare() { m_analyzer.process(); }
 	/// updates player stats
 	void update();
 	/// calculate how well last lyrics row went
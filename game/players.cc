@@ -21,29 +21,8 @@ Players::Players():
 
 Players::~Players() {}
 
-void Players::load(xmlpp::NodeSet const& n) {
-	for (auto const& elem: n) {
-		xmlpp::Element& element = dynamic_cast<xmlpp::Element&>(*elem);
-		xmlpp::Attribute* a_name = element.get_attribute("name");
-		if (!a_name) throw PlayersException("Attribute name not found");
-		xmlpp::Attribute* a_id = element.get_attribute("id");
-		if (!a_id) throw PlayersException("Attribute id not found");
-		int id = -1;
-		try { id = std::stoi(a_id->get_value()); } catch (std::exception&) { }
-		xmlpp::NodeSet n2 = element.find("picture");
-		std::string picture;
-		if (!n2.empty()) // optional picture element
-		{
-			auto tn = xmlpp::get_first_child_text(dynamic_cast<xmlpp::Element&>(**n2.begin()));
-			picture = tn->get_content();
-		}
-		addPlayer(a_name->get_value(), picture, id);
-	}
-	filter_internal();
-}
-
-void Players::save(xmlpp::Element *players) {
-	for (auto const& p: m_players) {
+void Players::save(xmlpp::Element *players, players_t const& items) {
+	for (auto const& p: items) {
 		xmlpp::Element* player = xmlpp::add_child_element(players, "player");
 		player->set_attribute("name", p.name);
 		player->set_attribute("id", std::to_string(p.id));
@@ -60,11 +39,8 @@ void Players::update() {
 }
 
 int Players::lookup(std::string const& name) const {
-	for (auto const& p: m_players) {
-		if (p.name == name) return p.id;
-	}
-
-	return -1;
+	auto it = m_ids.find(name);
+	return it == m_ids.end() ? -1 : it->second;
 }
 
 std::string Players::lookup(int id) const {
@@ -75,7 +51,7 @@ std::string Players::lookup(int id) const {
 	else return it->name;
 }
 
-void Players::addPlayer (std::string const& name, std::string const& picture, int id) {
+int Players::addPlayer (std::string const& name, std::string const& picture, int id) {
 	PlayerItem pi;
 	pi.id = id;
 	pi.name = name;
@@ -102,6 +78,9 @@ void Players::addPlayer (std::string const& name, std::string const& picture, in
 		pi.id = assign_id_internal();
 		m_players.insert(pi); // now do the insert with the fresh id
 	}
+	auto byName = m_ids.emplace(pi.name, pi.id);
+	if (!byName.second && pi.id < byName.first->second) byName.first->second = pi.id;
+	return pi.id;
 }
 
 void Players::setFilter(std::string const& val) {
@@ -126,7 +105,7 @@ void Players::filter_internal() {
 		else {
 			icu::UnicodeString filter = icu::UnicodeString::fromUTF8(m_filter);
 			std::copy_if (m_players.begin(), m_players.end(), std::back_inserter(filtered), [&](PlayerItem it){
-			icu::StringSearch search = icu::StringSearch(filter, icu::UnicodeString::fromUTF8(it.name), &UnicodeUtil::m_dummyCollator, nullptr, m_icuError);
+			icu::StringSearch search = icu::StringSearch(filter, icu::UnicodeString::fromUTF8(it.name), &UnicodeUtil::searchCollator(), nullptr, m_icuError);
 			return (search.first(m_icuError) != USEARCH_DONE);
 			});
 		}
@@ -5,6 +5,7 @@
 #include <vector>
 #include <string>
 #include <stdexcept>
+#include <unordered_map>
 
 #include <unicode/tblcoll.h>
 #include <unicode/unistr.h>
@@ -35,12 +36,14 @@ struct PlayersException: public std::runtime_error {
  the screen_players.
  */
 class Players {
-  private:
+  public:
 	typedef std::set<PlayerItem> players_t;
+  private:
 	typedef std::vector<PlayerItem> fplayers_t;
 
   private:
 	players_t m_players;
+	std::unordered_map<std::string, int> m_ids;  ///< Lowest id of each name in m_players
 	fplayers_t m_filtered;
 
 	std::string m_filter;
@@ -54,8 +57,10 @@ class Players {
 	Players();
 	~Players();
 
-	void load(xmlpp::NodeSet const& n);
-	void save(xmlpp::Element *players);
+	/// save items (a copy of items(), so that saving can be done in another thread)
+	static void save(xmlpp::Element *players, players_t const& items);
+	/// all players, unfiltered
+	players_t const& items() const { return m_players; }
 
 	void update();
 
@@ -68,7 +73,8 @@ class Players {
 	std::string lookup(int id) const;
 
 	/// add a player with a displayed name and an optional picture; if no id is given one will be assigned
-	void addPlayer (std::string const& name, std::string const& picture = "", int id = -1);
+	/// @return the id of the player
+	int addPlayer (std::string const& name, std::string const& picture = "", int id = -1);
 
 	/// const array access
 	PlayerItem operator[](std::size_t pos) const {
@@ -1,4 +1,5 @@
 #include "playlist.hh"
+#include "mediacache.hh"
 #include "song.hh"
 #include <algorithm>
 #include <random>
@@ -6,6 +7,8 @@
 void PlayList::addSong(std::shared_ptr<Song> song) {
 	std::lock_guard<std::mutex> l(m_mutex);
 	m_list.push_back(song);
+	if (song) MediaCache::instance().prefetch(*song);
+	changed(Change{ Change::ADD, 0, unsigned(m_list.size() - 1), 0, { song } });
 }
 
 std::shared_ptr<Song> PlayList::getNext() {
@@ -15,9 +18,15 @@ std::shared_ptr<Song> PlayList::getNext() {
 	nextSong = m_list[0];
 	m_list.erase(m_list.begin());
 	currentlyActive = nextSong;
+	changed(Change{ Change::REMOVE, 0, 0, 0, {} });
 	return nextSong;
 }
 
+std::shared_ptr<Song> PlayList::peekNext() const {
+	std::lock_guard<std::mutex> l(m_mutex);
+	return m_list.empty() ? std::shared_ptr<Song>() : m_list.front();
+}
+
 PlayList::SongList& PlayList::getList() {
 	return m_list;
 }
@@ -30,39 +39,40 @@ bool PlayList::isEmpty() {
 void PlayList::shuffle() {
 	std::lock_guard<std::mutex> l(m_mutex);
 	std::shuffle(m_list.begin(), m_list.end(), std::mt19937(std::random_device()()));
+	changed(Change{ Change::RESET, 0, 0, 0, m_list });
 }
 
 void PlayList::clear() {
 	std::lock_guard<std::mutex> l(m_mutex);
 	m_list.clear();
+	changed(Change{ Change::RESET, 0, 0, 0, {} });
 }
 
 void PlayList::removeSong(int index) {
 	std::lock_guard<std::mutex> l(m_mutex);
 	m_list.erase(m_list.begin() + index);
+	changed(Change{ Change::REMOVE, 0, unsigned(index), 0, {} });
 }
 void PlayList::swap(int index1, int index2) {
 	std::lock_guard<std::mutex> l(m_mutex);
+	if (index1 == index2) return;
 	std::shared_ptr<Song> song1 = m_list[index1];
 	m_list[index1] = m_list[index2];
 	m_list[index2] = song1;
+	// As moves: the first song to the place of the second, then the second (now next to it) to the place of the first
+	changed(Change{ Change::MOVE, 0, unsigned(index1), unsigned(index2), {} });
+	int second = index1 < index2 ? index2 - 1 : index2 + 1;
+	if (second != index1) changed(Change{ Change::MOVE, 0, unsigned(second), unsigned(index1), {} });
 }
 void PlayList::setPosition(unsigned int index1, unsigned int index2) {
-	if(index1 != index2) {	
-		int diff = index1 - index2;
-		if(diff > 0) {
-			// Going to Top
-			swap(index1, index1 - 1);
-			setPosition(index1 - 1, index2);
-		} else {
-			// Going to Bottom
-			swap(index1, index1 + 1);
-			setPosition(index1 + 1, index2);
-		} 
-	}
+	std::lock_guard<std::mutex> l(m_mutex);
+	if (index1 == index2) return;
+	// Move the song, shifting those in between by one
+	if (index1 > index2) std::rotate(m_list.begin() + index2, m_list.begin() + index1, m_list.begin() + index1 + 1);
+	else std::rotate(m_list.begin() + index1, m_list.begin() + index1 + 1, m_list.begin() + index2 + 1);
+	changed(Change{ Change::MOVE, 0, index1, index2, {} });
 }
 
-
 std::shared_ptr<Song> PlayList::getSong(int index) {
 	std::lock_guard<std::mutex> l(m_mutex);
 	if (isEmpty()) return std::shared_ptr<Song>();
@@ -70,5 +80,22 @@ std::shared_ptr<Song> PlayList::getSong(int index) {
 	nextSong = m_list[index];
 	m_list.erase(m_list.begin() + index);
 	currentlyActive = nextSong;
+	changed(Change{ Change::REMOVE, 0, unsigned(index), 0, {} });
 	return nextSong;
 }
+
+void PlayList::setObserver(Observer observer) {
+	std::lock_guard<std::mutex> l(m_mutex);
+	m_observer = std::move(observer);
+}
+
+PlayList::SongList PlayList::snapshot(unsigned& version) const {
+	std::lock_guard<std::mutex> l(m_mutex);
+	version = m_version;
+	return m_list;
+}
+
+void PlayList::changed(Change change) {
+	change.version = ++m_version;
+	if (m_observer) m_observer(change);
+}
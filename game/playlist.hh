@@ -2,6 +2,7 @@
 #pragma once
 
 #include "song.hh"
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <sstream>
@@ -18,6 +19,8 @@ public:
 	void addSong(std::shared_ptr<Song> song);
 	/// Returns the next song and removes it from the queue
 	std::shared_ptr<Song> getNext();
+	/// Returns the next song without removing it (null if the queue is empty)
+	std::shared_ptr<Song> peekNext() const;
 	/// Returns all currently queued songs
 	SongList& getList();
 	///array-access should replace getList!!
@@ -37,8 +40,25 @@ public:
 	std::shared_ptr<Song> getSong(int index);
 	/// this is for the webserver, to avoid crashing when adding the current playing song
 	std::shared_ptr<Song> currentlyActive;
+	/// A change of the queue, as told to the observer
+	struct Change {
+		enum Type { ADD, REMOVE, MOVE, RESET } type;
+		unsigned version;  ///< Of the queue after the change (see snapshot)
+		unsigned index;  ///< Song added, removed or moved
+		unsigned to;  ///< MOVE only: new position of the song
+		SongList songs;  ///< ADD: the song added, RESET: the new queue
+	};
+	typedef std::function<void (Change const&)> Observer;
+	/// Called after every change by the thread that made it, with the playlist locked (so it must not call back)
+	void setObserver(Observer observer);
+	/// A copy of the queue and the version of its latest change
+	SongList snapshot(unsigned& version) const;
 private:
+	/// Number the change and pass it to the observer (with m_mutex locked)
+	void changed(Change change);
 	SongList m_list;
+	unsigned m_version = 0;
+	Observer m_observer;
 	mutable std::mutex m_mutex;
 };
 
@@ -0,0 +1,188 @@
+#include "previewcache.hh"
+
+#include "audio.hh"
+#include "configuration.hh"
+#include "ffmpeg.hh"
+#include "song.hh"
+#include "threads.hh"
+#include "util.hh"
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+namespace {
+	const std::size_t MAX_URGENT = 16;  ///< Prefetch requests kept (older ones are dropped)
+	const unsigned CHANNELS = 2;
+
+	void writeLE(std::ostream& os, std::uint32_t value, unsigned bytes) {
+		for (unsigned i = 0; i < bytes; ++i) os.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+	}
+
+	/// Write interleaved s16 stereo samples as a canonical WAV file
+	void writeWav(fs::path const& filename, std::vector<std::int16_t> const& samples, unsigned rate) {
+		std::ofstream f(filename.string(), std::ios::binary);
+		const std::uint32_t bytes = samples.size() * sizeof(std::int16_t);
+		f.write("RIFF", 4); writeLE(f, 36 + bytes, 4); f.write("WAVE", 4);
+		f.write("fmt ", 4); writeLE(f, 16, 4); writeLE(f, 1 /* PCM */, 2); writeLE(f, CHANNELS, 2);
+		writeLE(f, rate, 4); writeLE(f, rate * CHANNELS * 2, 4); writeLE(f, CHANNELS * 2, 2); writeLE(f, 16, 2);
+		f.write("data", 4); writeLE(f, bytes, 4);
+		for (std::int16_t s: samples) writeLE(f, static_cast<std::uint16_t>(s), 2);
+		if (!f) throw std::runtime_error("Cannot write " + filename.string());
+	}
+}
+
+PreviewCache::PreviewCache():
+  m_seconds(config["audio/preview_cache_seconds"].i()),
+  m_limit(std::uintmax_t(config["audio/preview_cache_mb"].i()) << 20),
+  m_dir(getCacheDir() / "previews")
+{
+	if (m_limit) m_thread = std::thread(&PreviewCache::run, this);
+}
+
+PreviewCache::~PreviewCache() {
+	if (!m_thread.joinable()) return;
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_one();
+	m_thread.join();
+}
+
+double PreviewCache::startOf(Song const& song) {
+	return std::isnan(song.preview_start) ? 0.0 : song.preview_start;
+}
+
+fs::path PreviewCache::filename(Song const& song) const {
+	std::ostringstream key;
+	key << Audio::getSR() << ' ' << startOf(song) << ' ' << m_seconds;
+	for (auto const& kv: song.music) {
+		if (kv.second.empty()) continue;
+		boost::system::error_code ec;
+		key << '\n' << kv.first << '=' << kv.second.string() << ' ' << fs::last_write_time(kv.second, ec);
+	}
+	std::ostringstream name;
+	name << std::hex << std::hash<std::string>()(key.str()) << ".wav";
+	return m_dir / name.str();
+}
+
+fs::path PreviewCache::lookup(Song const& song) {
+	if (!m_limit) return fs::path();
+	fs::path p = filename(song);
+	boost::system::error_code ec;
+	if (!fs::is_regular_file(p, ec)) return fs::path();
+	fs::last_write_time(p, std::time(nullptr), ec);  // Most recently used, for trim()
+	return p;
+}
+
+void PreviewCache::prefetch(std::vector<std::shared_ptr<Song>> const& songs) {
+	if (!m_limit) return;
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		for (auto it = songs.rbegin(); it != songs.rend(); ++it) m_urgent.push_front(*it);
+		if (m_urgent.size() > MAX_URGENT) m_urgent.resize(MAX_URGENT);
+	}
+	m_cond.notify_one();
+}
+
+void PreviewCache::populate(std::vector<std::shared_ptr<Song>> const& songs) {
+	if (!m_limit) return;
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_background.assign(songs.begin(), songs.end());
+	}
+	m_cond.notify_one();
+}
+
+void PreviewCache::generate(Song const& song, fs::path const& target) {
+	const unsigned rate = Audio::getSR();
+	const std::int64_t begin = CHANNELS * std::int64_t(startOf(song) * rate);
+	const std::int64_t count = CHANNELS * std::int64_t(m_seconds * rate);
+	std::vector<std::int32_t> mix(count);
+	std::int64_t length = 0;
+	for (auto const& kv: song.music) {
+		if (kv.second.empty()) continue;
+		std::int64_t end = 0;
+		AudioFFmpeg ffmpeg(kv.second, rate, [&](std::int16_t const* data, size_t n, int64_t pos) {
+			for (size_t i = 0; i < n; ++i) {
+				std::int64_t p = pos + std::int64_t(i) - begin;
+				if (p >= 0 && p < count) mix[p] += data[i];
+			}
+			end = std::max(end, pos + std::int64_t(n) - begin);
+		});
+		ffmpeg.seek(startOf(song));
+		try {
+			while (end < count && !m_quit) ffmpeg.handleOneFrame();
+		} catch (FFmpeg::Eof const&) {}
+		if (m_quit) return;
+		length = std::max(length, std::min(end, count));
+	}
+	if (length <= 0) throw std::runtime_error("No audio in preview range");
+	std::vector<std::int16_t> samples(length);
+	for (std::int64_t i = 0; i < length; ++i) samples[i] = clamp<std::int32_t>(mix[i], -32768, 32767);
+	// Write to a temporary name first so that lookup never sees partial files
+	fs::path part = target;
+	part += ".part";
+	writeWav(part, samples, rate);
+	fs::rename(part, target);
+}
+
+void PreviewCache::trim(std::uintmax_t limit) {
+	struct Entry { std::time_t time; std::uintmax_t size; fs::path path; };
+	std::vector<Entry> entries;
+	m_size = 0;
+	boost::system::error_code ec;
+	for (fs::directory_iterator it(m_dir, ec), end; !ec && it != end; it.increment(ec)) {
+		if (it->path().extension() != ".wav") continue;
+		Entry e{ fs::last_write_time(it->path(), ec), fs::file_size(it->path(), ec), it->path() };
+		if (ec) continue;
+		m_size += e.size;
+		entries.push_back(e);
+	}
+	std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) { return a.time < b.time; });
+	for (auto const& e: entries) {
+		if (m_size <= limit) break;
+		if (fs::remove(e.path, ec)) m_size -= e.size;
+	}
+}
+
+void PreviewCache::run() {
+	threads::enter(threads::Class::background, "preview cache");
+	try {
+		fs::create_directories(m_dir);
+		trim(m_limit);
+	} catch (std::exception& e) {
+		std::clog << "cache/error: Preview cache disabled, cannot use " << m_dir << ": " << e.what() << std::endl;
+		return;
+	}
+	std::unique_lock<std::mutex> l(m_mutex);
+	while (!m_quit) {
+		std::shared_ptr<Song> song;
+		bool urgent = !m_urgent.empty();
+		if (urgent) { song = m_urgent.front().lock(); m_urgent.pop_front(); }
+		else if (!m_background.empty() && m_size < m_limit) { song = m_background.front().lock(); m_background.pop_front(); }
+		else { m_cond.wait(l); continue; }
+		if (!song) continue;
+		UnlockGuard<decltype(l)> unlocked(l);  // Decoding takes a while
+		fs::path target = filename(*song);
+		if (fs::exists(target)) continue;
+		try {
+			generate(*song, target);
+		} catch (std::exception& e) {
+			std::clog << "cache/warning: Cannot cache preview of " << song->filename << ": " << e.what() << std::endl;
+			boost::system::error_code ec;
+			fs::path part = target;
+			part += ".part";
+			fs::remove(part, ec);
+			continue;
+		}
+		// Make room for what the user is browsing by dropping the least recently used previews
+		trim(urgent ? m_limit : std::numeric_limits<std::uintmax_t>::max());
+	}
+}
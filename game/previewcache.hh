@@ -0,0 +1,53 @@
+#pragma once
+
+#include "fs.hh"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Song;
+
+/**
+* On-disk cache of decoded song previews in getCacheDir() / "previews".
+* Each preview is a WAV file at the audio output rate with all tracks of the song mixed together,
+* covering audio/preview_cache_seconds from the song's preview start. Files are named by a hash of
+* the music files, their modification times and the preview range, so changed songs simply miss.
+* Previews are generated by a background thread; the total size is kept within audio/preview_cache_mb
+* by removing the least recently used files.
+**/
+class PreviewCache {
+  public:
+	PreviewCache();
+	~PreviewCache();
+	/// Length of the cached previews (seconds)
+	double seconds() const { return m_seconds; }
+	/// Song time where the cached preview begins
+	static double startOf(Song const& song);
+	/// Path of the cached preview of song, or an empty path if it is not (yet) cached
+	fs::path lookup(Song const& song);
+	/// Generate previews for songs before anything else queued (e.g. the neighbours of the current selection)
+	void prefetch(std::vector<std::shared_ptr<Song>> const& songs);
+	/// Queue songs for background population, done only while the cache is below its size limit
+	void populate(std::vector<std::shared_ptr<Song>> const& songs);
+
+  private:
+	fs::path filename(Song const& song) const;
+	void generate(Song const& song, fs::path const& target);
+	void trim(std::uintmax_t limit);
+	void run();
+
+	const double m_seconds;
+	const std::uintmax_t m_limit;  ///< Maximum total size in bytes, 0 if disabled
+	const fs::path m_dir;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<std::weak_ptr<Song>> m_urgent, m_background;
+	std::uintmax_t m_size = 0;  ///< Current total size of the cache files (only used by the worker thread)
+	std::atomic<bool> m_quit{ false };
+	std::thread m_thread;
+};
@@ -0,0 +1,124 @@
+#include "profiler.hh"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+
+namespace {
+	struct Event {
+		char const* name;
+		Time begin, end;
+	};
+	/// Events of one thread. Only the owner writes; the events below count are complete and may be read by anyone.
+	struct Buffer {
+		/// Enough for several minutes of a busy thread (the audio callback runs a few hundred times per second)
+		static const std::size_t CAPACITY = 1 << 18;
+		explicit Buffer(unsigned id): id(id) {}
+		unsigned id;
+		std::unique_ptr<Event[]> events;  ///< Allocated by the first event (so that naming threads costs nothing)
+		std::atomic<std::size_t> count{ 0 };
+		std::atomic<std::size_t> dropped{ 0 };
+		std::string name;  ///< Guarded by Registry::mutex
+	};
+	/// All buffers ever created; they are never freed because finished threads still need to be written out
+	struct Registry {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Buffer>> buffers;
+		std::set<std::string> names;  ///< Interned event names
+		std::atomic<bool> enabled{ false };
+		Time start;
+	};
+	Registry& registry() {
+		static Registry* r = new Registry();  // Leaked so that threads still running at exit can use it
+		return *r;
+	}
+	Buffer& threadBuffer() {
+		thread_local Buffer* buf = nullptr;
+		if (!buf) {
+			Registry& r = registry();
+			std::lock_guard<std::mutex> l(r.mutex);
+			r.buffers.push_back(std::make_unique<Buffer>(r.buffers.size() + 1));
+			buf = r.buffers.back().get();
+		}
+		return *buf;
+	}
+	/// Write s as a JSON string
+	void quote(std::ostream& os, std::string const& s) {
+		os << '"';
+		for (char ch: s) {
+			if (ch == '"' || ch == '\\') os << '\\' << ch;
+			else if (static_cast<unsigned char>(ch) < 0x20) os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(ch) << std::dec << std::setfill(' ');
+			else os << ch;
+		}
+		os << '"';
+	}
+	double micros(Time t) { return std::chrono::duration<double, std::micro>(t - registry().start).count(); }
+}
+
+namespace trace {
+	Session::Session(fs::path const& filename): m_filename(filename) {
+		if (m_filename.empty()) return;
+		Registry& r = registry();
+		r.start = Clock::now();
+		r.enabled = true;
+		std::clog << "profiler/notice: Recording a trace to " << m_filename.string() << std::endl;
+	}
+
+	Session::~Session() {
+		if (m_filename.empty()) return;
+		Registry& r = registry();
+		r.enabled = false;
+		std::ofstream f(m_filename.string());
+		f << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		std::size_t total = 0, dropped = 0;
+		bool first = true;
+		std::lock_guard<std::mutex> l(r.mutex);
+		for (auto const& buf: r.buffers) {
+			std::size_t count = buf->count.load(std::memory_order_acquire);
+			if (count == 0) continue;
+			total += count;
+			dropped += buf->dropped;
+			if (!first) f << ",\n";
+			first = false;
+			f << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << buf->id << ",\"name\":\"thread_name\",\"args\":{\"name\":";
+			quote(f, buf->name.empty() ? "thread " + std::to_string(buf->id) : buf->name);
+			f << "}}";
+			for (std::size_t i = 0; i < count; ++i) {
+				Event const& ev = buf->events[i];
+				f << ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":" << buf->id << ",\"name\":";
+				quote(f, ev.name);
+				f << ",\"ts\":" << micros(ev.begin) << ",\"dur\":" << micros(ev.end) - micros(ev.begin) << "}";
+			}
+		}
+		f << "\n]}\n";
+		if (!f) { std::clog << "profiler/error: Cannot write trace " << m_filename.string() << std::endl; return; }
+		std::clog << "profiler/notice: Wrote " << total << " trace events to " << m_filename.string() << std::endl;
+		if (dropped) std::clog << "profiler/warning: " << dropped << " trace events did not fit in the buffers." << std::endl;
+	}
+
+	bool enabled() { return registry().enabled.load(std::memory_order_relaxed); }
+
+	void threadName(char const* name) {
+		Buffer& buf = threadBuffer();
+		std::lock_guard<std::mutex> l(registry().mutex);
+		buf.name = name;
+	}
+
+	void record(char const* name, Time begin, Time end) {
+		if (!enabled()) return;
+		Buffer& buf = threadBuffer();
+		std::size_t i = buf.count.load(std::memory_order_relaxed);
+		if (!buf.events) buf.events.reset(new Event[Buffer::CAPACITY]);
+		if (i == Buffer::CAPACITY) { buf.dropped.fetch_add(1, std::memory_order_relaxed); return; }
+		buf.events[i] = Event{ name, begin, end };
+		buf.count.store(i + 1, std::memory_order_release);
+	}
+
+	char const* intern(std::string const& name) {
+		Registry& r = registry();
+		std::lock_guard<std::mutex> l(r.mutex);
+		return r.names.insert(name).first->c_str();
+	}
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "alloctrack.hh"
 #include "chrono.hh"
+#include "fs.hh"
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <map>
@@ -8,11 +11,52 @@
 #include <string>
 #include <vector>
 
+/**
+* Timeline of what each thread was doing, for finding stutters that involve several threads (e.g. the audio
+* callback and the render loop). Scopes are recorded into a buffer of the calling thread without locking, so
+* they are cheap enough for the audio callback, and written as Chrome trace JSON (chrome://tracing or
+* ui.perfetto.dev) when the Session ends. Nested scopes show up nested. Nothing is recorded without a Session.
+**/
+namespace trace {
+	/// Records everything while it exists and writes it to filename on destruction (no-op if filename is empty)
+	class Session {
+	  public:
+		explicit Session(fs::path const& filename);
+		~Session();
+		Session(Session const&) = delete;
+		Session& operator=(Session const&) = delete;
+	  private:
+		fs::path m_filename;
+	};
+	/// Is a Session recording?
+	bool enabled();
+	/// Name the calling thread on the timeline
+	void threadName(char const* name);
+	/// Record a completed event. The name must outlive the Session (a string literal or from intern).
+	void record(char const* name, Time begin, Time end);
+	/// Get a permanent copy of a dynamic event name (takes a lock, so cache the result)
+	char const* intern(std::string const& name);
+	/// Record the lifetime of the object as an event
+	class Scope {
+	  public:
+		explicit Scope(char const* name): m_name(enabled() ? name : nullptr) { if (m_name) m_begin = Clock::now(); }
+		~Scope() { if (m_name) record(m_name, m_begin, Clock::now()); }
+		Scope(Scope const&) = delete;
+		Scope& operator=(Scope const&) = delete;
+	  private:
+		char const* m_name;
+		Time m_begin;
+	};
+}
+
 struct ProfCP {
 	unsigned long samples;
 	double total;
 	double peak;
 	double avg;
+	char const* traceName = nullptr;  ///< Interned event name, if tracing
+	std::uint64_t allocations = 0;  ///< Heap allocations in total (with allocation tracking)
+	bool countsAllocations = false;  ///< Measured on the thread that did the work (not e.g. GPU time)
 	ProfCP(): samples(), total(), peak(), avg() {}
 	void add(double t) {
 		++samples;
@@ -28,29 +72,43 @@ static inline std::ostream& operator<<(std::ostream& os, ProfCP const& cp) {
 	if (cp.samples > 1) os << cp.samples << "x ";
 	os << cp.avg * 1000.0 << " ms";
 	if (cp.peak > 2.0 * cp.avg) os << " peak " << cp.peak * 1000.0 << " ms";
+	if (cp.countsAllocations) os << ", " << double(cp.allocations) / cp.samples << " allocs";
 	return os;
 }
 
-/// @short A simple performance profiling tool
+/// @short A simple performance profiling tool (checkpoints also go to the trace, as "name/tag")
 class Profiler {
 	typedef std::map<std::string, ProfCP> Checkpoints;
 	typedef std::pair<std::string, ProfCP> Pair;
 	Checkpoints m_checkpoints;
 	std::string m_name;
 	Time m_time;
+	std::uint64_t m_allocations = alloctrack::allocations();  ///< Of the thread at the previous checkpoint
 	static bool cmpFunc(Pair const& a, Pair const& b) { return a.second.total > b.second.total; }
   public:
 	/// Start a profiler with the given name
 	Profiler(std::string const& name): m_name(name), m_time(Clock::now()) {}
 	~Profiler() { dump(); }
-	/// Profiling checkpoint: record the duration since construction or previous checkpoint.
-	/// If no tag is specified, no recording is done.
+	/// Profiling checkpoint: record the duration (and with allocation tracking the allocations of the calling thread)
+	/// since construction or previous checkpoint. If no tag is specified, no recording is done.
 	void operator()(std::string const& tag = std::string()) {
+		const std::uint64_t allocations = alloctrack::allocations();  // First, so that adding a checkpoint counts for the next one
 		auto n = Clock::now();
 		std::swap(n, m_time);
 		double t = Seconds(m_time - n).count();
-		m_checkpoints[tag].add(t);
+		ProfCP& cp = m_checkpoints[tag];
+		cp.add(t);
+		if (alloctrack::enabled()) {
+			cp.allocations += allocations - m_allocations;
+			cp.countsAllocations = true;
+			m_allocations = allocations;
+		}
+		if (!trace::enabled()) return;
+		if (!cp.traceName) cp.traceName = trace::intern(m_name + "/" + tag);
+		trace::record(cp.traceName, n, m_time);
 	}
+	/// Record a duration measured elsewhere (e.g. on the GPU)
+	void add(char const* tag, double t) { m_checkpoints[tag].add(t); }
 	/// Dump current stats to log and reset
 	void dump(std::string const& level = "debug") {
 		if (m_checkpoints.empty()) return;
@@ -0,0 +1,186 @@
+#include "renderbench.hh"
+
+#include "audio.hh"
+#include "chrono.hh"
+#include "configuration.hh"
+#include "controllers.hh"
+#include "covercache.hh"
+#include "database.hh"
+#include "fbo.hh"
+#include "glutil.hh"
+#include "guitargraph.hh"
+#include "layout_singer.hh"
+#include "opengl_text.hh"
+#include "screen.hh"
+#include "screen_songs.hh"
+#include "song.hh"
+#include "songparser.hh"
+#include "songs.hh"
+#include "texture.hh"
+#include "video_driver.hh"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+	const unsigned WIDTH = 1280, HEIGHT = 720;
+	/// Song time advanced by each frame (independent of how long the frame took)
+	const double FRAME_TIME = 1.0 / 60.0;
+	const unsigned FRAMES = 600;  ///< Per scene
+	const unsigned SONGS = 200;  ///< In the generated library
+	const double SONG_LENGTH = 90.0;  ///< Seconds
+
+	/// Write an UltraStar duet: both singers take turns on eight-note phrases at 300 BPM (20 beats per second)
+	void writeSong(fs::path const& dir, unsigned num) {
+		fs::create_directories(dir);
+		std::ofstream f((dir / "song.txt").string());
+		f << "#TITLE:Render benchmark " << num << "\n#ARTIST:Performous\n#BPM:300\n#GAP:0\n#P1:First singer\n#P2:Second singer\n";
+		char const* syllables[] = { "la ", "di ", "da", "dum ", "ba", "dee " };
+		const unsigned beats = SONG_LENGTH * 20.0;
+		for (unsigned singer = 1; singer <= 2; ++singer) {
+			f << "P" << singer << "\n";
+			unsigned phrase = 0;
+			for (unsigned ts = (singer - 1) * 48; ts + 48 <= beats; ts += 96, ++phrase) {
+				for (unsigned i = 0; i < 8; ++i) {
+					const int pitch = 3 + int((i * 5 + phrase * 3 + num) % 12);
+					f << (i == 7 ? "* " : ": ") << ts + 6 * i << " 5 " << pitch << " " << syllables[(i + phrase) % 6] << "\n";
+				}
+				f << "- " << ts + 48 << "\n";
+			}
+		}
+		f << "E\n";
+		if (!f) throw std::runtime_error("Cannot write " + dir.string());
+	}
+
+	/// Add guitar, bass and drum tracks on every difficulty level (chords, sustains and drum fills of sorts)
+	void addInstruments(Song& song) {
+		const int basepitches[] = { 0x3C, 0x48, 0x54, 0x60 };
+		for (auto const& name: { TrackName::GUITAR, TrackName::BASS, TrackName::DRUMS }) {
+			InstrumentTrack track(name);
+			for (int basepitch: basepitches) {
+				for (unsigned i = 0; 0.25 * i < SONG_LENGTH; ++i) {
+					const double begin = 0.25 * i;
+					const double end = begin + (i % 8 == 0 && name != TrackName::DRUMS ? 1.0 : 0.0);
+					track.nm[basepitch + i % 5].push_back(Duration(begin, end));
+					if (i % 4 == 0) track.nm[basepitch + (i / 4 + 2) % 5].push_back(Duration(begin, end));
+				}
+			}
+			song.instrumentTracks.emplace(name, std::move(track));
+		}
+		for (double t = 0.0; t < SONG_LENGTH; t += 0.5) song.beats.push_back(t);
+		song.m_duration = SONG_LENGTH;
+	}
+
+	/// The value below which fraction p of the sorted values are
+	double percentile(std::vector<double> const& sorted, double p) {
+		if (sorted.empty()) return 0.0;
+		return sorted[std::min<std::size_t>(sorted.size() - 1, p * sorted.size())];
+	}
+
+	/// Render FRAMES frames of a scene into the FBO and print the statistics. draw gets the song time.
+	void scene(char const* name, Window& window, FBO& fbo, Game& gm, std::function<void (double)> const& draw) {
+		std::vector<double> frameTimes;
+		frameTimes.reserve(FRAMES);
+		const std::size_t drawCalls = glutil::drawCalls();
+		const std::size_t uploads = textureUploads();
+		for (unsigned frame = 0; frame < FRAMES; ++frame) {
+			const auto begin = std::chrono::steady_clock::now();
+			AnimValue::beginFrame();
+			{
+				UseFBO use(fbo);
+				window.blank();
+				window.render([&]{ draw(frame * FRAME_TIME); });
+			}
+			updateTextures();
+			gm.prepareScreen();
+			glFinish();  // Count the GPU work of this frame too
+			frameTimes.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+		}
+		std::sort(frameTimes.begin(), frameTimes.end());
+		std::cout << name << ": " << FRAMES << " frames, frame time p50 " << percentile(frameTimes, 0.5) << " ms, p90 "
+		  << percentile(frameTimes, 0.9) << " ms, p99 " << percentile(frameTimes, 0.99) << " ms, max " << frameTimes.back()
+		  << " ms\n  " << double(glutil::drawCalls() - drawCalls) / FRAMES << " draw calls per frame, "
+		  << textureUploads() - uploads << " texture uploads" << std::endl;
+	}
+}
+
+int benchRender() {
+	// A window of a fixed size (only used for its GL context) and a library of generated songs only
+	config["graphic/fullscreen"].b() = false;
+	config["graphic/stereo3d"].b() = false;
+	config["graphic/window_width"].i() = WIDTH;
+	config["graphic/window_height"].i() = HEIGHT;
+	config["songs/watch"].b() = false;
+	const fs::path tmp = fs::temp_directory_path() / fs::unique_path("performous-bench-%%%%-%%%%");
+	int ret = EXIT_SUCCESS;
+	try {
+		for (unsigned i = 0; i < SONGS; ++i) writeSong(tmp / "songs" / std::to_string(i), i);
+		config["paths/songs"].sl() = { (tmp / "songs").string() };
+		config["paths/system-songs"].sl().clear();
+		Audio audio;
+		TextureLoader loader;
+		CoverCache covers;
+		Database database(tmp / "database.xml");
+		Songs songs(database, std::string(), tmp);
+		loadFonts();
+		Window window;
+		Game gm(window, audio);
+		gm.addScreen(std::make_unique<ScreenSongs>("Songs", audio, songs, database, covers));
+		while (!songs.doneLoading) std::this_thread::sleep_for(10ms);
+		std::cout << std::fixed << std::setprecision(2) << "Benchmarking rendering at " << screenW() << "x" << screenH()
+		  << " with " << songs.loadedSongs() << " songs" << std::endl;
+		FBO fbo(screenW(), screenH());
+
+		gm.activateScreen("Songs");
+		gm.updateScreen();
+		unsigned frame = 0;
+		scene("Song browser", window, fbo, gm, [&](double) {
+			if (++frame % 15 == 0) songs.advance(1);  // A new song four times per second
+			gm.drawScreen();
+		});
+
+		Song song(tmp / "songs" / "0", tmp / "songs" / "0" / "song.txt");
+		song.loadNotes(false);
+		addInstruments(song);
+		{
+			// Guitar, bass (the second guitar player takes the next track) and drums, with a singer on top
+			std::vector<std::unique_ptr<InstrumentGraph>> instruments;
+			const input::DevType types[] = { input::DEVTYPE_GUITAR, input::DEVTYPE_GUITAR, input::DEVTYPE_DRUMS };
+			for (auto type: types) {
+				auto dev = std::make_shared<input::Device>(input::SourceId(input::SOURCETYPE_NONE, instruments.size()), type);
+				instruments.push_back(std::make_unique<GuitarGraph>(audio, song, dev, instruments.size()));
+			}
+			LayoutSinger singer(song.getVocalTrack(TrackName::LEAD_VOCAL), database);
+			scene("Band", window, fbo, gm, [&](double time) {
+				const double iw = 1.0 / instruments.size();
+				for (std::size_t i = 0; i < instruments.size(); ++i) {
+					// No engine(): nobody plays, and the notes are drawn at the scripted time rather than the audio position
+					instruments[i]->position((0.5 + i - 0.5 * instruments.size()) * iw, iw);
+					instruments[i]->draw(time);
+				}
+				singer.draw(time, LayoutSinger::TOP);
+			});
+		}
+		{
+			LayoutSinger first(song.getVocalTrack(TrackName::LEAD_VOCAL), database);
+			LayoutSinger second(song.getVocalTrack(SongParserUtil::DUET_P2), database);
+			scene("Duet", window, fbo, gm, [&](double time) {
+				first.draw(time, LayoutSinger::TOP);
+				second.draw(time, LayoutSinger::BOTTOM);
+			});
+		}
+	} catch (std::exception& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		ret = EXIT_FAILURE;
+	}
+	boost::system::error_code ec;
+	fs::remove_all(tmp, ec);
+	return ret;
+}
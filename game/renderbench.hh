@@ -0,0 +1,9 @@
+#pragma once
+
+/**
+* Rendering benchmark (performous --bench-render): draws scripted scenes (scrolling the song browser, a band of
+* four players and duet lyrics) of a generated song library into an offscreen FBO, as fast as possible and with
+* song time advancing a fixed 1/60 s per frame, and prints frame time percentiles, draw calls and texture uploads
+* of each scene. Returns the exit status. The user's song cache and database are not touched.
+**/
+int benchRender();
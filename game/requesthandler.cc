@@ -1,20 +1,77 @@
 #include "requesthandler.hh"
+#include "chrono.hh"
+#include "log.hh"
+#include "memstats.hh"
+#include "metrics.hh"
+#include "profiler.hh"
+#include "texture.hh"
+#include "texturecache.hh"
+#include "threads.hh"
 #include "unicode.hh"
+#include "util.hh"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <zlib.h>
 
 #ifdef USE_WEBSERVER
-RequestHandler::RequestHandler(Songs& songs):m_songs(songs)
+namespace {
+    web::http::experimental::listener::http_listener_config ListenerConfig() {
+        web::http::experimental::listener::http_listener_config listenerConfig;
+        listenerConfig.set_timeout(utility::seconds(config["game/webserver_timeout"].i()));
+        listenerConfig.set_backlog(config["game/webserver_backlog"].i());
+        return listenerConfig;
+    }
+}
+
+RequestHandler::RequestHandler(Songs& songs):m_songs(songs),m_maxRequests(1)
 {
 }
-RequestHandler::RequestHandler(std::string url, Songs& songs):m_listener(url),m_songs(songs)
+RequestHandler::RequestHandler(std::string url, Songs& songs):m_listener(url, ListenerConfig()),m_songs(songs),m_maxRequests(std::max(1, config["game/webserver_max_requests"].i()))
 {
     m_listener.support(web::http::methods::GET, std::bind(&RequestHandler::Get, this, std::placeholders::_1));
     m_listener.support(web::http::methods::PUT, std::bind(&RequestHandler::Put, this, std::placeholders::_1));
     m_listener.support(web::http::methods::POST, std::bind(&RequestHandler::Post, this, std::placeholders::_1));
     m_listener.support(web::http::methods::DEL, std::bind(&RequestHandler::Delete, this, std::placeholders::_1));
-
+    Game::getSingletonPtr()->getCurrentPlayList().setObserver([this](PlayList::Change const& change) {
+        std::lock_guard<std::mutex> l(m_eventsMutex);
+        m_changes.push_back(change);
+        m_eventsCond.notify_one();
+    });
+    m_eventsThread = std::thread(&RequestHandler::PlaylistEvents, this);
 }
 RequestHandler::~RequestHandler()
 {
+    if (!m_eventsThread.joinable()) return;
+    if (Game* gm = Game::getSingletonPtr()) gm->getCurrentPlayList().setObserver(nullptr);
+    {
+        std::lock_guard<std::mutex> l(m_eventsMutex);
+        m_eventsQuit = true;
+    }
+    m_eventsCond.notify_one();
+    m_eventsThread.join();
+}
+
+std::shared_ptr<RequestHandler::InFlight> RequestHandler::Admit(web::http::http_request& request)
+{
+    // The pool threads are cpprest's own, so they get their priority from the first request they handle
+    static thread_local bool entered = false;
+    if (!entered) {
+        threads::enter(threads::Class::background, "webserver");
+        entered = true;
+    }
+    if (m_inFlight.fetch_add(1) >= m_maxRequests) {
+        --m_inFlight;
+        LOG("requesthandler", debug) << "Too many requests, refusing " << request.relative_uri().path() << std::endl;
+        web::http::http_response response(web::http::status_codes::ServiceUnavailable);
+        response.headers().add(U("Retry-After"), U("1"));
+        request.reply(response);
+        return nullptr;
+    }
+    return std::shared_ptr<InFlight>(new InFlight{ m_inFlight });
 }
 
 void RequestHandler::Error(pplx::task<void>& t)
@@ -28,77 +85,241 @@ void RequestHandler::Error(pplx::task<void>& t)
     }
 }
 
+namespace {
+    /// MIME type by extension, and whether it is worth compressing
+    struct FileType {
+        char const* contentType;
+        bool compress;
+    };
+    FileType fileType(std::string const& path) {
+        static const std::map<std::string, FileType> types = {
+            { ".html", { "text/html", true } },
+            { ".js", { "text/javascript", true } },
+            { ".css", { "text/css", true } },
+            { ".json", { "application/json", true } },
+            { ".svg", { "image/svg+xml", true } },
+            { ".ico", { "image/x-icon", true } },
+            { ".png", { "image/png", false } },
+            { ".gif", { "image/gif", false } },
+        };
+        auto it = types.find(UnicodeUtil::toLower(fs::path(path).extension().string()));
+        return it == types.end() ? FileType{ "application/octet-stream", false } : it->second;
+    }
+
+    /// FNV-1a hash of data as hex, stable across runs (unlike std::hash)
+    std::string fnv1a(std::string const& data) {
+        std::uint64_t hash = 0xcbf29ce484222325;
+        for (unsigned char ch: data) hash = (hash ^ ch) * 0x100000001b3;
+        std::ostringstream oss;
+        oss << std::hex << hash;
+        return oss.str();
+    }
+
+    /// Identifies a song in URLs (by its file, so that browsers may cache what they got for it)
+    std::string songId(Song const& song) { return fnv1a(song.filename.string()); }
+
+    const std::string COVER_PATH = "/api/cover/";
+
+    /// Gzip (RFC 1952) data, an empty string on failure
+    std::string gzip(std::string const& data) {
+        z_stream z = z_stream();
+        if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return std::string();
+        std::string out(deflateBound(&z, data.size()), '\0');
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        z.avail_in = data.size();
+        z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        z.avail_out = out.size();
+        const bool ok = deflate(&z, Z_FINISH) == Z_STREAM_END;
+        out.resize(z.total_out);
+        deflateEnd(&z);
+        return ok ? out : std::string();
+    }
+
+    /// Does an Accept-Encoding header allow the coding (i.e. lists it without q=0)?
+    bool accepts(std::string const& acceptEncoding, std::string const& coding) {
+        std::istringstream iss(acceptEncoding);
+        for (std::string item; std::getline(iss, item, ',');) {
+            item.erase(std::remove(item.begin(), item.end(), ' '), item.end());
+            std::string name = UnicodeUtil::toLower(item.substr(0, item.find(';')));
+            if (name != coding && name != "*") continue;
+            auto q = item.find(";q=");
+            return q == std::string::npos || std::atof(item.c_str() + q + 3) > 0.0;
+        }
+        return false;
+    }
+}
+
+std::shared_ptr<RequestHandler::Asset const> RequestHandler::LoadAsset(std::string const& fileName) {
+    const fs::path file = findFile(fileName);
+    const std::time_t modified = fs::last_write_time(file);
+    {
+        std::lock_guard<std::mutex> l(m_assetsMutex);
+        auto it = m_assets.find(fileName);
+        if (it != m_assets.end() && it->second->file == file && it->second->modified == modified) return it->second;
+    }
+    std::ifstream f(file.string(), std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (!f && !f.eof()) throw std::runtime_error("Cannot read " + file.string());
+    auto asset = std::make_shared<Asset>();
+    asset->file = file;
+    asset->modified = modified;
+    FileType type = fileType(fileName);
+    asset->contentType = type.contentType;
+    // ETag by content, so that it survives restarts and touching the file
+    asset->etag = '"' + fnv1a(data) + '"';
+    if (type.compress) {
+        asset->gzip = gzip(data);
+        if (asset->gzip.size() >= data.size()) asset->gzip.clear();  // Not worth it
+    }
+    asset->data = std::move(data);
+    asset->memory.set(asset->data.size() + asset->gzip.size());
+    std::lock_guard<std::mutex> l(m_assetsMutex);
+    m_assets[fileName] = asset;
+    return asset;
+}
+
 void RequestHandler::HandleFile(web::http::http_request request, std::string filePath) {
     auto path = filePath != "" ? filePath : request.relative_uri().path();
     auto fileName = path.substr(path.find_last_of("/\\") + 1);
-        
-    std::string fileToSend = findFile(fileName).string();
-
-    concurrency::streams::fstream::open_istream(U(fileToSend), std::ios::in).then([=](concurrency::streams::istream is) {
-        std::string content_type = "";
-        if(path.find(".html") != std::string::npos) {
-            content_type = "text/html";
-        } else if(path.find(".js") != std::string::npos) {
-            content_type = "text/javascript";
-        } else if (path.find(".css") != std::string::npos) {
-            content_type = "text/css";
-        } else if (path.find(".png") != std::string::npos) {
-            content_type = "image/png";
-        } else if (path.find(".gif") != std::string::npos) {
-            content_type = "image/gif";
-        } else if (path.find(".ico") != std::string::npos) {
-            content_type = "image/x-icon";
+    std::shared_ptr<Asset const> asset;
+    try {
+        asset = LoadAsset(fileName);
+    } catch (std::exception const& e) {
+        std::clog << "webserver/warning: Cannot serve " << path << ": " << e.what() << std::endl;
+        request.reply(web::http::status_codes::NotFound, U("NOT FOUND"));
+        return;
+    }
+    web::http::http_response response;
+    auto& headers = response.headers();
+    headers.add(web::http::header_names::etag, asset->etag);
+    // Pages revalidate every time (with the ETag), the other files are good for a while
+    headers.add(web::http::header_names::cache_control, asset->contentType == "text/html" ? "no-cache" : "public, max-age=3600");
+    headers.add(web::http::header_names::vary, "Accept-Encoding");
+    if (request.headers().has(web::http::header_names::if_none_match) && request.headers()[web::http::header_names::if_none_match] == asset->etag) {
+        response.set_status_code(web::http::status_codes::NotModified);
+    } else {
+        const bool compressed = !asset->gzip.empty() && request.headers().has(web::http::header_names::accept_encoding)
+          && accepts(request.headers()[web::http::header_names::accept_encoding], "gzip");
+        std::string const& body = compressed ? asset->gzip : asset->data;
+        response.set_status_code(web::http::status_codes::OK);
+        response.set_body(std::vector<unsigned char>(body.begin(), body.end()));
+        headers.set_content_type(asset->contentType);
+        if (compressed) headers.add(web::http::header_names::content_encoding, "gzip");
+    }
+    request.reply(response).then([](pplx::task<void> t) {
+        try {
+            t.get();
+        } catch(...){
+            //
         }
+    });
+}
 
-        request.reply(web::http::status_codes::OK, is, U(content_type)).then([](pplx::task<void> t) {
-            try {
-                t.get();
-            } catch(...){
-                //
-            }
-        });
+std::shared_ptr<RequestHandler::CoverIndex const> RequestHandler::Covers() {
+    auto snapshot = m_songs.snapshot();
+    {
+        std::lock_guard<std::mutex> l(m_songListsMutex);
+        if (m_covers && m_covers->generation == snapshot->generation()) return m_covers;
+    }
+    auto index = std::make_shared<CoverIndex>();
+    index->generation = snapshot->generation();
+    for (auto const& song : snapshot->songs()) if (!song->cover.empty()) index->covers[songId(*song)] = song->cover;
+    std::lock_guard<std::mutex> l(m_songListsMutex);
+    m_covers = index;
+    return index;
+}
 
-    }).then([=](pplx::task<void>t) {
+void RequestHandler::HandleCover(web::http::http_request request, std::string const& id) {
+    auto covers = Covers();
+    auto it = covers->covers.find(id);
+    if (it == covers->covers.end()) {
+        request.reply(web::http::status_codes::NotFound, "No cover for song " + id);
+        return;
+    }
+    fs::path file;
+    try {
+        // The size of the song browser thumbnails, in the same cache
+        file = TextureCache::jpeg(it->second, Texture::THUMBNAIL_SIZE);
+    } catch (std::exception const& e) {
+        std::clog << "webserver/warning: Cannot serve the cover " << it->second.string() << ": " << e.what() << std::endl;
+        request.reply(web::http::status_codes::NotFound, "No cover for song " + id);
+        return;
+    }
+    // The file name changes with the cover, and so does the ETag; covers rarely change, so clients keep them for a week
+    const std::string etag = '"' + file.stem().string() + '"';
+    web::http::http_response response;
+    auto& headers = response.headers();
+    headers.add(web::http::header_names::etag, etag);
+    headers.add(web::http::header_names::cache_control, "public, max-age=604800");
+    if (request.headers().has(web::http::header_names::if_none_match) && request.headers()[web::http::header_names::if_none_match] == etag) {
+        response.set_status_code(web::http::status_codes::NotModified);
+    } else {
+        std::ifstream f(file.string(), std::ios::binary);
+        std::vector<unsigned char> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        response.set_status_code(web::http::status_codes::OK);
+        response.set_body(std::move(data));
+        headers.set_content_type("image/jpeg");
+    }
+    request.reply(response).then([](pplx::task<void> t) {
         try {
             t.get();
-        } catch(...) {
-            request.reply(web::http::status_codes::InternalError,U("INTERNAL ERROR "));
+        } catch(...){
+            //
         }
     });
 }
 
 void RequestHandler::Get(web::http::http_request request)
 {
+    auto inFlight = Admit(request);
+    if (!inFlight) return;
     std::string content_type = "text/html";
     auto uri = request.relative_uri().path();
     if(request.relative_uri().query() != "") {
         uri += "?" + request.relative_uri().query();
     }
-    std::clog << "requesthandler/debug: path is: " << uri << std::endl;
+    LOG("requesthandler", debug) << "path is: " << uri << std::endl;
     auto path = request.relative_uri().path();
     if (path == "/") {
         HandleFile(request, findFile("index.html").string());
+    } else if (path.compare(0, COVER_PATH.size(), COVER_PATH) == 0) {
+        HandleCover(request, path.substr(COVER_PATH.size()));
     } else if (path == "/api/getDataBase.json") { //get database
-        m_songs.setFilter("");
-        if(request.relative_uri().query() == "sort=artist&order=ascending") {
-            m_songs.sortSpecificChange(2);    
-        } else if(request.relative_uri().query() == "sort=artist&order=descending") {
-            m_songs.sortSpecificChange(2, true);
-        } else if(request.relative_uri().query() == "sort=title&order=ascending") {
-            m_songs.sortSpecificChange(1);    
-        } else if(request.relative_uri().query() == "sort=title&order=descending") {
-            m_songs.sortSpecificChange(1, true);
-        } else if(request.relative_uri().query() == "sort=language&order=ascending") {
-            m_songs.sortSpecificChange(6);    
-        } else if(request.relative_uri().query() == "sort=language&order=descending") {
-            m_songs.sortSpecificChange(6, true);
-        } else if(request.relative_uri().query() == "sort=edition&order=ascending") {
-            m_songs.sortSpecificChange(3);    
-        } else if(request.relative_uri().query() == "sort=edition&order=descending") {
-            m_songs.sortSpecificChange(3, true);
+        auto query = web::uri::split_query(request.relative_uri().query());
+        auto param = [&query](std::string const& name) { auto it = query.find(name); return it == query.end() ? std::string() : it->second; };
+        // The same sort orders as in the song browser, or its current one by default
+        static const std::map<std::string, int> sorts = { { "title", 1 }, { "artist", 2 }, { "edition", 3 }, { "language", 6 } };
+        auto sort = sorts.find(param("sort"));
+        const int order = sort == sorts.end() ? m_songs.sortNum() : sort->second;
+        const bool descending = param("order") == "descending";
+        std::size_t offset = 0, limit = std::numeric_limits<std::size_t>::max();
+        try {
+            if (!param("offset").empty()) offset = std::stoul(param("offset"));
+            if (!param("limit").empty()) limit = std::stoul(param("limit"));
+        } catch (std::exception const&) {
+            request.reply(web::http::status_codes::BadRequest, "offset and limit must be non-negative numbers.");
+            return;
         }
-        web::json::value jsonRoot = SongsToJsonObject();
-        request.reply(web::http::status_codes::OK, jsonRoot);
+        auto songs = SerializedSongs(order, descending);
+        std::string etag = "\"" + std::to_string(songs->generation) + "-" + std::to_string(order) + (descending ? "d-" : "a-")
+          + std::to_string(offset) + "-" + std::to_string(limit) + "\"";
+        web::http::http_response response;
+        response.headers().add(web::http::header_names::etag, etag);
+        response.headers().add("X-Total-Count", songs->items.size());
+        if (request.headers().has(web::http::header_names::if_none_match) && request.headers()[web::http::header_names::if_none_match] == etag) {
+            response.set_status_code(web::http::status_codes::NotModified);
+            request.reply(response);
+            return;
+        }
+        std::string body = "[";
+        for (std::size_t i = offset; i < songs->items.size() && i - offset < limit; ++i) {
+            if (i != offset) body += ',';
+            body += songs->items[i];
+        }
+        body += ']';
+        response.set_status_code(web::http::status_codes::OK);
+        response.set_body(body, "application/json");
+        request.reply(response);
         return;
     }  else if(path == "/api/language") {
         auto localeMap = GenerateLocaleDict();
@@ -119,29 +340,67 @@ void RequestHandler::Get(web::http::http_request request)
         Game* gm = Game::getSingletonPtr();
         web::json::value jsonRoot = web::json::value::array();
         auto i = 0;
-        for (auto const& song : gm->getCurrentPlayList().getList()) {
-            web::json::value songObject = web::json::value::object();
-            songObject["Title"] = web::json::value::string(song->title);
-            songObject["Artist"] = web::json::value::string(song->artist);
-            songObject["Edition"] = web::json::value::string(song->edition);
-            songObject["Language"] = web::json::value::string(song->language);
-            songObject["Creator"] = web::json::value::string(song->creator);
-            songObject["Duration"] = web::json::value(song->getDurationSeconds());
-            jsonRoot[i] = songObject;
+        unsigned version;
+        for (auto const& song : gm->getCurrentPlayList().snapshot(version)) {
+            jsonRoot[i] = PlaylistSongToJsonObject(*song);
             i++;
         }
 
         request.reply(web::http::status_codes::OK, jsonRoot);
         return;
+    } else if(path == "/api/playlistEvents") {
+        SubscribePlaylist(request);
+        return;
     } else if(path == "/api/getplaylistTimeout") {
         request.reply(web::http::status_codes::OK, U(config["game/playlist_screen_timeout"].i()));
         return;
+    } else if(path == "/api/metrics") {
+        request.reply(web::http::status_codes::OK, metrics::exposition(), "text/plain; version=0.0.4");
+        return;
+    } else if(path == "/api/stats") {
+        web::json::value memory = web::json::value::object();
+        for (auto const& a : memstats::statistics()) {
+            web::json::value account = web::json::value::object();
+            account["kind"] = web::json::value::string(a.kind == memstats::Kind::VRAM ? "vram" : "ram");
+            account["bytes"] = web::json::value::number(static_cast<uint64_t>(a.current));
+            account["peakBytes"] = web::json::value::number(static_cast<uint64_t>(a.peak));
+            account["objects"] = web::json::value::number(a.holders);
+            memory[a.name] = account;
+        }
+        web::json::value jsonRoot = web::json::value::object();
+        jsonRoot["memory"] = memory;
+        request.reply(web::http::status_codes::OK, jsonRoot);
+        return;
     } else {
         HandleFile(request);
     }
 };
 
 void RequestHandler::Post(web::http::http_request request)
+{
+    auto inFlight = Admit(request);
+    if (!inFlight) return;
+    // Handled once the body has arrived, without holding a pool thread while it is read (but still counted in flight)
+    request.extract_json().then([this, request, inFlight](pplx::task<web::json::value> task) {
+        web::json::value jsonPostBody = web::json::value::null();
+        try {
+            jsonPostBody = task.get();
+        } catch (web::json::json_exception const & e) {
+            std::clog << "webserver/error: JSON exception was thrown \"" << e.what() << "\"." << std::endl;
+        } catch (web::http::http_exception const & e) {
+            std::clog << "webserver/error: Cannot read the request body: " << e.what() << std::endl;
+        }
+        try {
+            HandlePost(request, jsonPostBody);
+        } catch (std::exception const & e) {
+            // There is no listener to turn exceptions into error replies here (and an unobserved one would abort)
+            std::clog << "webserver/error: " << e.what() << std::endl;
+            request.reply(web::http::status_codes::InternalError, U("INTERNAL ERROR "));
+        }
+    });
+}
+
+void RequestHandler::HandlePost(web::http::http_request request, web::json::value jsonPostBody)
 {
     Game* gm = Game::getSingletonPtr();
 
@@ -149,28 +408,25 @@ void RequestHandler::Post(web::http::http_request request)
     if(request.relative_uri().query() != "") {
         uri += "?" + request.relative_uri().query();
     }
-    std::clog << "requesthandler/debug: path is: " << uri << std::endl;
+    LOG("requesthandler", debug) << "path is: " << uri << std::endl;
 
     auto path = request.relative_uri().path();
 
-    web::json::value jsonPostBody = ExtractJsonFromRequest(request);
-
     if(jsonPostBody == web::json::value::null()) {
         request.reply(web::http::status_codes::BadRequest, "Post body is malformed. Please make a valid request.");
         return;
     }
 
     if (path == "/api/add") {
-        m_songs.setFilter("");
         std::shared_ptr<Song> songPointer = GetSongFromJSON(jsonPostBody);
         if(!songPointer) {
             request.reply(web::http::status_codes::NotFound, "Song \"" + jsonPostBody["Artist"].as_string() + " - " + jsonPostBody["Title"].as_string() + "\" was not found.");
             return;
         } else {
-            std::clog << "requesthandler/debug: Adding " << songPointer->artist << " - " << songPointer->title << " to the playlist " << std::endl;
+            LOG("requesthandler", debug) << "Adding " << songPointer->artist << " - " << songPointer->title << " to the playlist " << std::endl;
             gm->getCurrentPlayList().addSong(songPointer);
-            ScreenPlaylist* m_pp = dynamic_cast<ScreenPlaylist*>(gm->getScreen("Playlist"));
-            m_pp->triggerSongListUpdate();
+            ScreenPlaylist* m_pp = dynamic_cast<ScreenPlaylist*>(gm->findScreen("Playlist"));
+            if (m_pp) m_pp->triggerSongListUpdate();  // Not created yet: reads the playlist when it is
 
             request.reply(web::http::status_codes::OK, "success");
             return;
@@ -184,8 +440,8 @@ void RequestHandler::Post(web::http::http_request request)
             auto songIdToDelete = jsonPostBody["songId"].as_integer();
             if(songIdToDelete >= 0) {
                 gm->getCurrentPlayList().removeSong(songIdToDelete);
-                ScreenPlaylist* m_pp = dynamic_cast<ScreenPlaylist*>(gm->getScreen("Playlist"));
-                m_pp->triggerSongListUpdate();
+                ScreenPlaylist* m_pp = dynamic_cast<ScreenPlaylist*>(gm->findScreen("Playlist"));
+                if (m_pp) m_pp->triggerSongListUpdate();  // Not created yet: reads the playlist when it is
 
                 request.reply(web::http::status_codes::OK, "success");
                 return;
@@ -221,8 +477,8 @@ void RequestHandler::Post(web::http::http_request request)
             }
             if(positionToMoveTo <= sizeOfPlaylist - 1) {
                 gm->getCurrentPlayList().setPosition(songIdToMove,positionToMoveTo);
-                ScreenPlaylist* m_pp = dynamic_cast<ScreenPlaylist*>(gm->getScreen("Playlist"));
-                m_pp->triggerSongListUpdate();
+                ScreenPlaylist* m_pp = dynamic_cast<ScreenPlaylist*>(gm->findScreen("Playlist"));
+                if (m_pp) m_pp->triggerSongListUpdate();  // Not created yet: reads the playlist when it is
                 request.reply(web::http::status_codes::OK, "success");
                 return;
             } else  {
@@ -236,16 +492,11 @@ void RequestHandler::Post(web::http::http_request request)
         }     
     } else if(path == "/api/search") {
         auto query = jsonPostBody["query"].as_string();
-        m_songs.setFilter(query);
         web::json::value jsonRoot = web::json::value::array();
-        for(int i = 0; i < m_songs.size(); i++) {
-            web::json::value songObject = web::json::value::object();
-            songObject["Title"] = web::json::value::string(m_songs[i]->title);
-            songObject["Artist"] = web::json::value::string(m_songs[i]->artist);
-            songObject["Edition"] = web::json::value::string(m_songs[i]->edition);
-            songObject["Language"] = web::json::value::string(m_songs[i]->language);
-            songObject["Creator"] = web::json::value::string(m_songs[i]->creator);
-            jsonRoot[i] = songObject;
+        auto i = 0;
+        for (auto const& song : m_songs.snapshot()->query(query, 0, m_songs.sortNum())) {
+            jsonRoot[i] = SongToJsonObject(*song);
+            i++;
         }
         request.reply(web::http::status_codes::OK, jsonRoot);
         return;
@@ -265,51 +516,163 @@ void RequestHandler::Put(web::http::http_request request)
     request.reply(web::http::status_codes::OK);
 };
 
-web::json::value RequestHandler::ExtractJsonFromRequest(web::http::http_request request) {
-    web::json::value jsonBody = web::json::value::null();
-    request.extract_json().then([&jsonBody](pplx::task<web::json::value> task)
+std::shared_ptr<RequestHandler::SerializedList const> RequestHandler::SerializedSongs(int order, bool descending) {
+    auto snapshot = m_songs.snapshot();
     {
-         try
-         {
-            jsonBody = task.get();
-         }
-         catch (web::json::json_exception const & e)
-         {
-            std::clog << "webserver/error: JSON exception was thrown \"" << e.what() << "\"." << std::endl;
-         }
-    }).wait();
+        std::lock_guard<std::mutex> l(m_songListsMutex);
+        auto cached = m_songLists.find(std::make_pair(order, descending));
+        if (cached != m_songLists.end() && cached->second->generation == snapshot->generation()) return cached->second;
+    }
+    auto list = std::make_shared<SerializedList>();
+    list->generation = snapshot->generation();
+    for (auto const& song : snapshot->query("", 0, order, descending)) {
+        web::json::value songObject = SongToJsonObject(*song);
+        songObject["name"] = web::json::value::string(song->artist + " " + song->title);
+        list->items.push_back(songObject.serialize());
+    }
+    std::lock_guard<std::mutex> l(m_songListsMutex);
+    // Other orders of an older library are of no use any more
+    for (auto it = m_songLists.begin(); it != m_songLists.end();) {
+        if (it->second->generation != list->generation) it = m_songLists.erase(it); else ++it;
+    }
+    m_songLists[std::make_pair(order, descending)] = list;
+    return list;
+}
 
-    return jsonBody;
+web::json::value RequestHandler::SongToJsonObject(Song const& song) {
+    web::json::value songObject = web::json::value::object();
+    songObject["Title"] = web::json::value::string(song.title);
+    songObject["Artist"] = web::json::value::string(song.artist.str());
+    songObject["Edition"] = web::json::value::string(song.edition.str());
+    songObject["Language"] = web::json::value::string(song.language.str());
+    songObject["Creator"] = web::json::value::string(song.creator.str());
+    const std::string id = songId(song);
+    songObject["Id"] = web::json::value::string(id);
+    if (!song.cover.empty()) songObject["Cover"] = web::json::value::string(COVER_PATH + id);
+    return songObject;
 }
 
+web::json::value RequestHandler::PlaylistSongToJsonObject(Song const& song) {
+    web::json::value songObject = SongToJsonObject(song);
+    songObject["Duration"] = web::json::value(song.getDurationSeconds());
+    return songObject;
+}
+
+namespace {
+    /// Clients that have this much unread are considered stuck and disconnected
+    const std::size_t MAX_EVENT_BACKLOG = 1 << 20;
 
-web::json::value RequestHandler::SongsToJsonObject() {
-    web::json::value jsonRoot = web::json::value::array();
-    for (int i=0; i< m_songs.size(); i++) {
-        web::json::value songObject = web::json::value::object();
-        songObject["Title"] = web::json::value::string(m_songs[i]->title);
-        songObject["Artist"] = web::json::value::string(m_songs[i]->artist);
-        songObject["Edition"] = web::json::value::string(m_songs[i]->edition);
-        songObject["Language"] = web::json::value::string(m_songs[i]->language);
-        songObject["Creator"] = web::json::value::string(m_songs[i]->creator);
-        songObject["name"] = web::json::value::string(m_songs[i]->artist + " " + m_songs[i]->title);
-        jsonRoot[i] = songObject;
+    std::string serverSentEvent(char const* name, web::json::value const& data) {
+        return std::string("event: ") + name + "\ndata: " + data.serialize() + "\n\n";
     }
+}
 
-    return jsonRoot;
+void RequestHandler::SubscribePlaylist(web::http::http_request request) {
+    auto subscriber = std::make_shared<Subscriber>();
+    web::http::http_response response(web::http::status_codes::OK);
+    response.headers().set_content_type("text/event-stream");
+    response.headers().add(web::http::header_names::cache_control, "no-cache");
+    response.set_body(subscriber->buffer.create_istream());
+    // The reply is complete when PlaylistEvents closes the stream, or fails when the client goes away
+    request.reply(response).then([subscriber](pplx::task<void> t) {
+        try {
+            t.get();
+        } catch(...) {
+            //
+        }
+        subscriber->gone = true;
+    });
+    std::lock_guard<std::mutex> l(m_eventsMutex);
+    m_newSubscribers.push_back(subscriber);
+    m_eventsCond.notify_one();
+}
+
+void RequestHandler::Send(Subscriber& subscriber, std::string const& text) {
+    subscriber.buffer.putn_nocopy(reinterpret_cast<uint8_t const*>(text.data()), text.size()).wait();
+}
+
+void RequestHandler::PlaylistEvents() {
+    trace::threadName("webserver events");
+    std::vector<std::shared_ptr<Subscriber>> subscribers;
+    std::unique_lock<std::mutex> l(m_eventsMutex);
+    while (true) {
+        bool idle = !m_eventsCond.wait_for(l, 15s, [this] { return m_eventsQuit || !m_changes.empty() || !m_newSubscribers.empty(); });
+        if (m_eventsQuit) break;
+        std::deque<PlayList::Change> changes;
+        changes.swap(m_changes);
+        std::vector<std::shared_ptr<Subscriber>> fresh;
+        fresh.swap(m_newSubscribers);
+        UnlockGuard<decltype(l)> unlocked(l);
+        // New subscribers get the whole queue; changes up to its version (perhaps still in changes) are already in it
+        if (!fresh.empty()) {
+            unsigned version;
+            web::json::value songs = web::json::value::array();
+            auto i = 0;
+            for (auto const& song : Game::getSingletonPtr()->getCurrentPlayList().snapshot(version)) songs[i++] = PlaylistSongToJsonObject(*song);
+            web::json::value data = web::json::value::object();
+            data["version"] = web::json::value::number(version);
+            data["timeout"] = web::json::value::number(config["game/playlist_screen_timeout"].i());
+            data["songs"] = songs;
+            const std::string text = serverSentEvent("reset", data);
+            for (auto const& subscriber : fresh) {
+                subscriber->version = version;
+                Send(*subscriber, text);
+                subscribers.push_back(subscriber);
+            }
+        }
+        for (auto const& change : changes) {
+            web::json::value data = web::json::value::object();
+            data["version"] = web::json::value::number(change.version);
+            char const* name = "";
+            switch (change.type) {
+              case PlayList::Change::ADD:
+                name = "add";
+                data["position"] = web::json::value::number(change.index);
+                data["song"] = PlaylistSongToJsonObject(*change.songs.front());
+                break;
+              case PlayList::Change::REMOVE:
+                name = "remove";
+                data["position"] = web::json::value::number(change.index);
+                break;
+              case PlayList::Change::MOVE:
+                name = "move";
+                data["from"] = web::json::value::number(change.index);
+                data["to"] = web::json::value::number(change.to);
+                break;
+              case PlayList::Change::RESET: {
+                name = "reset";
+                web::json::value songs = web::json::value::array();
+                auto i = 0;
+                for (auto const& song : change.songs) songs[i++] = PlaylistSongToJsonObject(*song);
+                data["timeout"] = web::json::value::number(config["game/playlist_screen_timeout"].i());
+                data["songs"] = songs;
+                break;
+              }
+            }
+            const std::string text = serverSentEvent(name, data);
+            for (auto const& subscriber : subscribers) if (change.version > subscriber->version) Send(*subscriber, text);
+        }
+        // A comment now and then keeps proxies from timing out and finds the clients that went away
+        if (idle) for (auto const& subscriber : subscribers) Send(*subscriber, ": keepalive\n\n");
+        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), [](std::shared_ptr<Subscriber> const& subscriber) {
+            if (!subscriber->gone && subscriber->buffer.in_avail() < MAX_EVENT_BACKLOG) return false;
+            subscriber->buffer.close(std::ios_base::out).wait();
+            return true;
+        }), subscribers.end());
+    }
+    subscribers.insert(subscribers.end(), m_newSubscribers.begin(), m_newSubscribers.end());
+    for (auto const& subscriber : subscribers) subscriber->buffer.close(std::ios_base::out).wait();
 }
 
 std::shared_ptr<Song> RequestHandler::GetSongFromJSON(web::json::value jsonDoc) {
-    m_songs.setFilter("");
-
-    for(int i = 0; i< m_songs.size(); i++) {
-        if(m_songs[i]->title == jsonDoc["Title"].as_string() &&
-           m_songs[i]->artist == jsonDoc["Artist"].as_string() &&
-           m_songs[i]->edition == jsonDoc["Edition"].as_string() &&
-           m_songs[i]->language == jsonDoc["Language"].as_string() &&
-           m_songs[i]->creator == jsonDoc["Creator"].as_string() ) {
+    for (auto const& song : m_songs.snapshot()->songs()) {
+        if(song->title == jsonDoc["Title"].as_string() &&
+           song->artist == jsonDoc["Artist"].as_string() &&
+           song->edition == jsonDoc["Edition"].as_string() &&
+           song->language == jsonDoc["Language"].as_string() &&
+           song->creator == jsonDoc["Creator"].as_string() ) {
             std::clog << "webserver/info: Found requested song." << std::endl;
-            return m_songs[i];
+            return song;
         }
     }
 
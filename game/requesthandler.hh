@@ -3,8 +3,22 @@
 
 #include <cpprest/http_listener.h>
 #include <cpprest/filestream.h>
+#include <cpprest/producerconsumerstream.h>
 
+#include "fs.hh"
+#include "memstats.hh"
 #include "screen_playlist.hh"
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 class RequestHandler
 {
@@ -25,17 +39,76 @@ class RequestHandler
         void Delete(web::http::http_request request);
         void Error(pplx::task<void>& t);
 
-        web::json::value ExtractJsonFromRequest(web::http::http_request request);
+        /// Counts a request against game/webserver_max_requests until it is destroyed
+        struct InFlight {
+            std::atomic<unsigned>& count;
+            ~InFlight() { --count; }
+        };
+        /// Start handling a request on the calling pool thread, or refuse it if too many are in flight (null then)
+        std::shared_ptr<InFlight> Admit(web::http::http_request& request);
+
+        /// Post with the request body read (null if it is not valid JSON)
+        void HandlePost(web::http::http_request request, web::json::value jsonPostBody);
 
         void HandleFile(web::http::http_request request, std::string filePath = "");
-        web::json::value SongsToJsonObject();
+        /// A web interface file, kept in memory with its gzipped version (if smaller) until the file changes
+        struct Asset {
+            fs::path file;
+            std::time_t modified;
+            std::string contentType, etag;
+            std::string data, gzip;
+            memstats::Usage memory{ "web assets" };
+        };
+        std::shared_ptr<Asset const> LoadAsset(std::string const& fileName);
+        /// A cover thumbnail (/api/cover/<id>, see the Id of the songs), from TextureCache
+        void HandleCover(web::http::http_request request, std::string const& id);
+        /// Cover images by song id, as of Songs::generation()
+        struct CoverIndex {
+            unsigned generation;
+            std::unordered_map<std::string, fs::path> covers;
+        };
+        /// Cached until the library changes
+        std::shared_ptr<CoverIndex const> Covers();
+        /// The library as JSON objects (one string per song) in a sort order, as of Songs::generation()
+        struct SerializedList {
+            unsigned generation;
+            std::vector<std::string> items;
+        };
+        /// Cached until the library changes
+        std::shared_ptr<SerializedList const> SerializedSongs(int order, bool descending);
+        web::json::value SongToJsonObject(Song const& song);
         std::map<std::string, std::string> GenerateLocaleDict();
         std::vector<std::string> GetTranslationKeys();
         std::shared_ptr<Song> GetSongFromJSON(web::json::value);
+        web::json::value PlaylistSongToJsonObject(Song const& song);
+
+        /// A client of /api/playlistEvents (server-sent events)
+        struct Subscriber {
+            concurrency::streams::producer_consumer_buffer<uint8_t> buffer;
+            unsigned version = 0;  ///< Of the queue sent to it in the reset event, older changes are skipped
+            std::atomic<bool> gone{ false };  ///< Set when the response ends
+        };
+        void SubscribePlaylist(web::http::http_request request);
+        /// Thread that sends the queued playlist changes (and keepalives) to subscribers
+        void PlaylistEvents();
+        void Send(Subscriber& subscriber, std::string const& text);
 
         web::http::experimental::listener::http_listener m_listener;
 
         Songs& m_songs;
+        const unsigned m_maxRequests;  ///< game/webserver_max_requests
+        std::atomic<unsigned> m_inFlight{ 0 };
+        std::mutex m_assetsMutex;
+        std::map<std::string, std::shared_ptr<Asset const>> m_assets;  ///< By file name (guarded by m_assetsMutex)
+        std::mutex m_songListsMutex;
+        std::map<std::pair<int, bool>, std::shared_ptr<SerializedList const>> m_songLists;  ///< By order and descending (guarded by m_songListsMutex)
+        std::shared_ptr<CoverIndex const> m_covers;  ///< (guarded by m_songListsMutex)
+        std::mutex m_eventsMutex;
+        std::condition_variable m_eventsCond;
+        std::deque<PlayList::Change> m_changes;  ///< Waiting for PlaylistEvents (guarded by m_eventsMutex)
+        std::vector<std::shared_ptr<Subscriber>> m_newSubscribers;  ///< Waiting for their reset event (guarded by m_eventsMutex)
+        bool m_eventsQuit = false;  ///< (guarded by m_eventsMutex)
+        std::thread m_eventsThread;
 };
 #else
 class Songs;
@@ -8,10 +8,16 @@
 #include "dialog.hh"
 #include "playlist.hh"
 #include "fbo.hh"
+#include "perfoverlay.hh"
 
 #include <SDL2/SDL_events.h>
-#include <string>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 class Audio;
 
@@ -37,6 +43,9 @@ class Screen {
 	virtual void reloadGL() { exit(); enter(); }
 	/// returns screen name
 	std::string getName() const { return m_name; }
+	/// Frames per second needed while there is no input and no AnimValue moving: infinite (the default) for
+	/// screens that keep changing by themselves, zero for static ones (the main loop then stops redrawing)
+	virtual double idleFps() const { return std::numeric_limits<double>::infinity(); }
   private:
 	std::string m_name;
 };
@@ -50,12 +59,18 @@ class Game: public Singleton <Game> {
 	/// constructor
 	Game(Window& window, Audio& audio);
 	~Game();
+	typedef std::function<std::unique_ptr<Screen> ()> ScreenFactory;
 	/// Adds a screen to the manager
 	void addScreen(std::unique_ptr<Screen> s) { 
 		std::string screenName = s.get()->getName(); 
 		std::pair<std::string, std::unique_ptr<Screen>> kv = std::make_pair(screenName, std::move(s));
+		std::lock_guard<std::recursive_mutex> l(m_screensMutex);
 		screens.insert(std::move(kv));
 	}
+	/// Adds a screen that is created when first needed, or by prewarmScreen if prewarm is set
+	void addScreen(std::string const& name, ScreenFactory factory, bool prewarm = false);
+	/// Create one of the screens added for prewarming (call between frames). Returns false when none is left.
+	bool prewarmScreen();
 	/// Switches active screen
 	void activateScreen(std::string const& name);
 	/// Does actual switching of screens (if necessary)
@@ -64,12 +79,16 @@ class Game: public Singleton <Game> {
 	void prepareScreen();
 	/// Draws the current screen and possible transition effects
 	void drawScreen();
+	/// Frames per second needed by what is on screen while nothing happens (see Screen::idleFps)
+	double idleFps() const;
 	/// Reload OpenGL resources (after fullscreen toggle etc)
 	void reloadGL() { if (currentScreen) currentScreen->reloadGL(); }
 	/// Returns pointer to current Screen
 	Screen* getCurrentScreen() { return currentScreen; }
-	/// Returns pointer to Screen for given name
+	/// Returns pointer to Screen for given name, creating it if necessary (rendering thread only)
 	Screen* getScreen(std::string const& name);
+	/// Returns pointer to Screen for given name, or nullptr if it has not been created (any thread)
+	Screen* findScreen(std::string const& name);
 	/// Returns a reference to the window
 	Window& window() { return m_window; }
 
@@ -92,6 +111,12 @@ class Game: public Singleton <Game> {
 	bool isDialogOpen() { return !!m_dialog; }
 	/// Draw dialogs & flash messages, called automatically by drawScreen
 	void drawNotifications();
+	/// Draw the audio statistics overlay (audio/stats), also logging them once per second
+	void drawAudioStats();
+	/// Draw the memory accounting overlay (graphic/memory_stats), also logging it once per second
+	void drawMemoryStats();
+	/// The frame-time graph and subsystem gauges (graphic/perf_overlay)
+	PerfOverlay& perfOverlay() { return m_perfOverlay; }
 
 	/// Sets finished to true
 	void finished();
@@ -119,6 +144,9 @@ private:
 	bool m_finished;
 	typedef std::map<std::string, std::unique_ptr<Screen>> screenmap_t;
 	screenmap_t screens;
+	std::map<std::string, ScreenFactory> m_factories;  ///< Screens not created yet
+	std::vector<std::string> m_prewarm;  ///< Names of the screens to create before they are needed
+	std::recursive_mutex m_screensMutex;  ///< Held while screens or factories are modified (factories may add screens)
 	Screen* newScreen;
 	Screen* currentScreen;
 	PlayList currentPlaylist;
@@ -129,6 +157,13 @@ private:
 	std::string m_message;
 	AnimValue m_messagePopup;
 	SvgTxtTheme m_textMessage;
+	// Audio statistics members
+	SvgTxtTheme m_textStats;
+	std::vector<std::string> m_stats;
+	Time m_statsTime;
+	std::vector<std::string> m_memStats;
+	Time m_memStatsTime;
+	PerfOverlay m_perfOverlay;
 	float m_loadingProgress;
 	Texture m_logo;
 	AnimValue m_logoAnim;
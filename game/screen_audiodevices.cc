@@ -3,9 +3,12 @@
 #include "audio.hh"
 #include "configuration.hh"
 #include "controllers.hh"
+#include "latencycal.hh"
+#include "log.hh"
 #include "platform.hh"
 #include "theme.hh"
 #include "i18n.hh"
+#include "util.hh"
 
 namespace {
 	static const int unassigned_id = -1;  // mic.dev value for unassigned
@@ -31,13 +34,15 @@ ScreenAudioDevices::ScreenAudioDevices(std::string const& name, Audio& audio): S
 	m_pdev_icon = std::make_unique<Texture>(findFile("icon_pdev.svg"));
 }
 
+ScreenAudioDevices::~ScreenAudioDevices() = default;
+
+double ScreenAudioDevices::idleFps() const { return m_calibration ? getInf() : 0.0; }  // Polling for the results while measuring
+
 void ScreenAudioDevices::enter() {
 	int bend = getBackend();
-	std::clog << "audio-devices/debug: Entering audio Devices... backend has been detected as: " << bend << std::endl;
+	LOG("audio-devices", debug) << "Entering audio Devices... backend has been detected as: " << bend << std::endl;
 	m_theme = std::make_unique<ThemeAudioDevices>();
-	PaHostApiTypeId backend = PaHostApiTypeId(bend);
-	portaudio::AudioDevices ads(backend);
-	m_devs = ads.devices;
+	m_devs = m_audio.availableDevices();
 	// FIXME: Something more elegant, like a warning box
 	if (m_devs.empty()) throw std::runtime_error("No audio devices found!");
 	m_selected_column = 0;
@@ -72,13 +77,21 @@ void ScreenAudioDevices::enter() {
 	m_pdev_icon->dimensions.fixedWidth(s);
 }
 
-void ScreenAudioDevices::exit() { m_theme.reset(); }
+void ScreenAudioDevices::exit() {
+	if (m_calibration) { m_calibration.reset(); m_audio.playMusic(findFile("menu.ogg"), true); }
+	m_theme.reset();
+}
 
 void ScreenAudioDevices::manageEvent(input::NavEvent const& event) {
 	Game* gm = Game::getSingletonPtr();
 	input::NavButton nav = event.button;
 	auto& chpos = m_channels[m_selected_column].pos;
 	const unsigned posN = m_devs.size() + 1;
+	if (m_calibration) {
+		// Only cancelling while measuring
+		if (nav == input::NAV_CANCEL) { m_calibration.reset(); m_audio.playMusic(findFile("menu.ogg"), true); }
+		return;
+	}
 	if (nav == input::NAV_CANCEL) gm->activateScreen("Intro");
 	else if (nav == input::NAV_PAUSE) m_audio.togglePause();
 	else if (m_devs.empty()) return; // The rest work if there are any devices
@@ -93,7 +106,9 @@ void ScreenAudioDevices::manageEvent(SDL_Event event) {
 	if (event.type == SDL_KEYDOWN) {
 		int key = event.key.keysym.scancode;
 		uint16_t modifier = event.key.keysym.mod;
-		if (m_devs.empty()) return; // The rest work if there are any config options
+		if (m_devs.empty() || m_calibration) return; // The rest work if there are any config options
+		// Measure the round-trip latency
+		else if (key == SDL_SCANCODE_L && modifier & Platform::shortcutModifier()) calibrate();
 		// Reset to defaults
 		else if (key == SDL_SCANCODE_R && modifier & Platform::shortcutModifier()) {
 			config["audio/devices"].reset(modifier & KMOD_ALT);
@@ -105,6 +120,7 @@ void ScreenAudioDevices::manageEvent(SDL_Event event) {
 void ScreenAudioDevices::draw() {
 	m_theme->bg.draw();
 	if (m_devs.empty()) return;
+	if (m_calibration && m_calibration->done()) finishCalibration();
 	// Calculate spacing between columns/rows
 	const float xstep = (xoff - 0.5 + xoff) / m_channels.size();
 	const float ystep = yoff*2 / m_devs.size();
@@ -142,7 +158,8 @@ void ScreenAudioDevices::draw() {
 	m_theme->comment_bg.dimensions.stretch(1.0, 0.025).middle().screenBottom(-0.054);
 	m_theme->comment_bg.draw();
 	m_theme->comment.dimensions.left(-0.48).screenBottom(-0.067);
-	m_theme->comment.draw(_("Use arrow keys to configure. Hit Enter/Start to save and test or Esc/Select to cancel. Ctrl + R to reset defaults"));
+	m_theme->comment.draw(m_calibration ? _("Measuring the round-trip latency: keep the room quiet and the mics near the speakers. Esc/Select to cancel.")
+	  : _("Use arrow keys to configure. Hit Enter/Start to save and test or Esc/Select to cancel. Ctrl + R to reset defaults, Ctrl + L to measure latency"));
 	// Additional info
 	m_theme->comment_bg.dimensions.middle().screenBottom(-0.01);
 	m_theme->comment_bg.draw();
@@ -187,7 +204,7 @@ bool ScreenAudioDevices::save(bool skip_ui_config) {
 		config["audio/devices"].sl() = devconf;
 	}
 	writeConfig(false); // Save the new config
-	m_audio.restart(); // Reload audio to take the new settings into use
+	m_audio.updateDevices(); // Take the new settings into use (only the devices that changed are reopened)
 	m_audio.playMusic(findFile("menu.ogg"), true); // Start music again
 	// Check that all went well
 	bool ret = verify();
@@ -197,6 +214,30 @@ bool ScreenAudioDevices::save(bool skip_ui_config) {
 	return ret;
 }
 
+void ScreenAudioDevices::calibrate() {
+	try {
+		m_calibration = std::make_unique<LatencyCalibration>(m_audio);
+	} catch (std::exception& e) {
+		std::clog << "audio/error: Latency calibration: " << e.what() << std::endl;
+		Game::getSingletonPtr()->dialog(_("Cannot measure the latency:") + std::string("\n") + e.what());
+	}
+}
+
+void ScreenAudioDevices::finishCalibration() {
+	std::string text = _("Round-trip latency");
+	bool any = false;
+	for (auto const& r: m_calibration->results()) {
+		text += "\n" + r.spec + ": ";
+		if (r.ok) text += std::to_string(std::lround(1e3 * r.roundTrip)) + " ms";
+		else text += _("failed (turn up the volume or move the mics closer)");
+		any = any || r.ok;
+	}
+	if (any) m_calibration->save();
+	m_calibration.reset();
+	m_audio.playMusic(findFile("menu.ogg"), true);
+	Game::getSingletonPtr()->dialog(text);
+}
+
 bool ScreenAudioDevices::verify() {
 	for (auto const& c: m_channels) {
 		if (c.pos == unassigned_id) continue;  // No checking needed of unassigned channels
@@ -7,6 +7,7 @@
 #include <map>
 
 class Audio;
+class LatencyCalibration;
 class ThemeAudioDevices;
 
 /// options dialogue
@@ -14,11 +15,13 @@ class ScreenAudioDevices: public Screen {
   public:
 	/// constructor
 	ScreenAudioDevices(std::string const& name, Audio& m_audio);
+	~ScreenAudioDevices();
 	void enter();
 	void exit();
 	void manageEvent(SDL_Event event);
 	void manageEvent(input::NavEvent const& event);
 	void draw();
+	double idleFps() const;
 
   private:
 	struct Channel {
@@ -29,6 +32,8 @@ class ScreenAudioDevices: public Screen {
 	void load(); ///< Check what devices are open
 	bool save(bool skip_ui_config = false); ///< Save the config to disk xml and then reload
 	bool verify(); ///< Check that all were opened after audio reset
+	void calibrate(); ///< Start measuring the round-trip latency of the open devices
+	void finishCalibration(); ///< Store and show the results of the calibration once it is done
 
 	Audio& m_audio;
 	std::unique_ptr<ThemeAudioDevices> m_theme;
@@ -38,5 +43,6 @@ class ScreenAudioDevices: public Screen {
 	std::unique_ptr<Texture> m_selector;
 	std::unique_ptr<Texture> m_mic_icon;
 	std::unique_ptr<Texture> m_pdev_icon;
+	std::unique_ptr<LatencyCalibration> m_calibration;  ///< While measuring
 };
 
@@ -21,6 +21,7 @@ class ScreenIntro : public Screen {
 	void manageEvent(SDL_Event event);
 	void manageEvent(input::NavEvent const& event);
 	void draw();
+	double idleFps() const { return 15.0; }  ///< The slowly cycling background colors
 
   private:
 	void draw_menu_options();
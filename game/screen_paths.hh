@@ -24,6 +24,7 @@ class ScreenPaths: public Screen {
 	void manageEvent(SDL_Event event);
 	void manageEvent(input::NavEvent const& event);
 	void draw();
+	double idleFps() const { return 0.0; }
 	void generateMenuFromPath(fs::path path);
 
   private:
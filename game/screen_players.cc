@@ -3,6 +3,7 @@
 
 #include "configuration.hh"
 #include "audio.hh"
+#include "covercache.hh"
 #include "database.hh"
 #include "fs.hh"
 #include "util.hh"
@@ -16,8 +17,8 @@
 #include <sstream>
 #include <boost/format.hpp>
 
-ScreenPlayers::ScreenPlayers(std::string const& name, Audio& audio, Database& database):
-  Screen(name), m_audio(audio), m_database(database), m_players(database.m_players)
+ScreenPlayers::ScreenPlayers(std::string const& name, Audio& audio, Database& database, CoverCache& covers):
+  Screen(name), m_audio(audio), m_database(database), m_covers(covers), m_players(database.m_players)
 {
 	m_players.setAnimMargins(5.0, 5.0);
 	m_playTimer.setTarget(getInf()); // Using this as a simple timer counting seconds
@@ -39,16 +40,12 @@ void ScreenPlayers::enter() {
 
 void ScreenPlayers::exit() {
 	m_layout_singer.reset();
-
-	m_covers.clear();
 	m_emptyCover.reset();
 	theme.reset();
 	m_video.reset();
 	m_songbg.reset();
 	m_playing.clear();
 	m_playReq.clear();
-
-	m_database.save();
 }
 
 void ScreenPlayers::manageEvent(input::NavEvent const& event) {
@@ -60,7 +57,7 @@ void ScreenPlayers::manageEvent(input::NavEvent const& event) {
 		else { m_search.text.clear(); m_players.setFilter(m_search.text); }
 	} else if (nav == input::NAV_START) {
 		if (m_players.empty()) {
-			m_players.addPlayer(m_search.text);
+			m_database.addPlayer(m_search.text);
 			m_players.setFilter(m_search.text);
 			m_players.update();
 			// the current player is the new created one
@@ -103,21 +100,11 @@ void ScreenPlayers::manageEvent(SDL_Event event) {
 	}
 }
 
-Texture* ScreenPlayers::loadTextureFromMap(fs::path path) {
-	if(m_covers.find(path) == m_covers.end()) {
-		std::pair<fs::path, std::unique_ptr<Texture>> kv = std::make_pair(path, std::make_unique<Texture>(path));
-		m_covers.insert(std::move(kv));
-	}
-	try {
-		return m_covers.at(path).get();
-	} catch (std::exception const&) {}
-	return nullptr;
-}
-
 void ScreenPlayers::draw() {
 	m_players.update(); // Poll for new players
 	double length = m_audio.getLength();
-	double time = clamp(m_audio.getPosition() - config["audio/video_delay"].f(), 0.0, length);
+	static ConfigItem& videoDelay = config["audio/video_delay"];
+	double time = clamp(m_audio.getPosition() - videoDelay.f(), 0.0, length);
 	if (m_songbg.get()) m_songbg->draw();
 	if (m_video.get()) m_video->render(time);
 	theme->bg.draw();
@@ -155,10 +142,11 @@ void ScreenPlayers::draw() {
 		double shift = spos - baseidx;
 		// FIXME: 3D browser
 		for (int i = -2; i < 5; ++i) {
-			PlayerItem player_display = m_players[baseidx + i];
 			if (baseidx + i < 0 || baseidx + i >= int(ss)) continue;
-			
-			Texture& s = !player_display.path.empty() ? *loadTextureFromMap(player_display.path) : *m_emptyCover;
+			PlayerItem const& player_display = m_players[baseidx + i];
+			// Only the avatars shown are loaded, as thumbnails in the background (the placeholder until then)
+			Texture* avatar = player_display.path.empty() ? nullptr : &m_covers.get(player_display.path);
+			Texture& s = avatar && !avatar->empty() ? *avatar : *m_emptyCover;
 			double diff = (i == 0 ? (0.5 - fabs(shift)) * 0.07 : 0.0);
 			double y = 0.27 + 0.5 * diff;
 			// Draw the cover
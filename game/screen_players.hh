@@ -8,6 +8,7 @@
 
 class Song;
 class Audio;
+class CoverCache;
 class Video;
 class Players;
 class Texture;
@@ -22,7 +23,7 @@ class LayoutSinger;
 class ScreenPlayers : public Screen {
   public:
 	/// constructor
-	ScreenPlayers(std::string const& name, Audio& audio, Database& database);
+	ScreenPlayers(std::string const& name, Audio& audio, Database& database, CoverCache& covers);
 	void enter();
 	void exit();
 	void manageEvent(SDL_Event event);
@@ -35,9 +36,9 @@ class ScreenPlayers : public Screen {
 	}
 
   private:
-	Texture* loadTextureFromMap(fs::path path);
   	Audio& m_audio;
 	Database& m_database;
+	CoverCache& m_covers;  ///< Avatar thumbnails (only of the players shown)
 	Players& m_players;
 	std::shared_ptr<Song> m_song; /// Pointer to the current song
 	std::unique_ptr<Texture> m_songbg;
@@ -49,7 +50,6 @@ class ScreenPlayers : public Screen {
 	AnimValue m_quitTimer;
 	TextInput m_search;
 	std::unique_ptr<Texture> m_emptyCover;
-	std::map<fs::path, std::unique_ptr<Texture>> m_covers;
 	std::unique_ptr<LayoutSinger> m_layout_singer;
 	bool keyPressed = false;
 };
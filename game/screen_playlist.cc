@@ -1,4 +1,5 @@
 ﻿#include "screen_playlist.hh"
+#include "covercache.hh"
 #include "menu.hh"
 #include "screen_sing.hh"
 #include "playlist.hh"
@@ -9,8 +10,8 @@
 #include <iostream>
 #include <sstream>
 
-ScreenPlaylist::ScreenPlaylist(std::string const& name,Audio& audio, Songs& songs, Backgrounds& bgs):
-	Screen(name), m_audio(audio), m_songs(songs), m_backgrounds(bgs), keyPressed()
+ScreenPlaylist::ScreenPlaylist(std::string const& name,Audio& audio, Songs& songs, Backgrounds& bgs, CoverCache& covers):
+	Screen(name), m_audio(audio), m_songs(songs), m_backgrounds(bgs), m_covers(covers), keyPressed()
 {}
 
 void ScreenPlaylist::enter() {
@@ -102,7 +103,7 @@ void ScreenPlaylist::manageEvent(SDL_Event) {
 
 void ScreenPlaylist::draw() {
 	Game* gm = Game::getSingletonPtr();
-	if (!m_background || m_background->empty()) m_background = std::make_unique<Texture>(m_backgrounds.getRandom());
+	if (!m_background || (m_background->empty() && !m_background->loading())) m_background = m_backgrounds.takeRandom();
 	m_background->draw();
 	if (m_nextTimer.get() == 0.0 && keyPressed == false) {
 		Screen* s = gm->getScreen("Sing");
@@ -117,7 +118,8 @@ void ScreenPlaylist::draw() {
 		}
 		gm->activateScreen("Sing");
 	}
-	if (m_cam && config["graphic/webcam"].b()) m_cam->render();
+	static ConfigItem& webcam = config["graphic/webcam"];
+	if (m_cam && webcam.b()) m_cam->render();
 	draw_menu_options();
 	//menu on top of everything
 	if (overlay_menu.isOpen()) {
@@ -145,14 +147,7 @@ void ScreenPlaylist::draw() {
 }
 
 Texture* ScreenPlaylist::loadTextureFromMap(fs::path path) {
-	if(m_covers.find(path) == m_covers.end()) {
-		std::pair<fs::path, std::unique_ptr<Texture>> kv = std::make_pair(path, std::make_unique<Texture>(path));
-		m_covers.insert(std::move(kv));
-	}
-	try {
-		return m_covers.at(path).get();
-	} catch (std::exception const&) {}
-	return nullptr;
+	return &m_covers.get(path);
 }
 
 Texture& ScreenPlaylist::getCover(Song const& song) {
@@ -168,8 +163,7 @@ Texture& ScreenPlaylist::getCover(Song const& song) {
 		} else if(song.hasDrums()) {
 			cover = m_bandCover.get();
 		} else {
-			size_t tracks = song.instrumentTracks.size();
-			if (tracks == 0) cover = m_singCover.get();
+			if (!song.hasGuitars() && !song.hasKeyboard()) cover = m_singCover.get();
 			else cover = m_instrumentCover.get();
 		}
 	}
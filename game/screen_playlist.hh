@@ -18,6 +18,7 @@
 class Audio;
 class Database;
 class Song;
+class CoverCache;
 class Texture;
 class ThemePlaylistScreen;
 class Backgrounds;
@@ -27,7 +28,7 @@ class ScreenPlaylist : public Screen
 {
 public:
 	typedef std::vector< std::shared_ptr<Song> > SongList;
-	ScreenPlaylist(std::string const& name, Audio& audio, Songs& songs, Backgrounds& bgs);
+	ScreenPlaylist(std::string const& name, Audio& audio, Songs& songs, Backgrounds& bgs, CoverCache& covers);
 	void manageEvent(input::NavEvent const& event);
 	void manageEvent(SDL_Event);
 	void prepare();
@@ -50,7 +51,7 @@ private:
 	void createMenuFromPlaylist();
 	Texture* loadTextureFromMap(fs::path path);
 	Backgrounds& m_backgrounds;
-	std::map<fs::path, std::unique_ptr<Texture>> m_covers;
+	CoverCache& m_covers;
 	std::unique_ptr<ThemeInstrumentMenu> m_menuTheme;
 	std::unique_ptr<ThemePlaylistScreen> theme;
 	std::unique_ptr<Texture> m_background;
@@ -6,6 +6,7 @@
 #include "controllers.hh"
 #include "theme.hh"
 #include "progressbar.hh"
+#include "spectrogram.hh"
 
 ScreenPractice::ScreenPractice(std::string const& name, Audio& audio):
   Screen(name), m_audio(audio)
@@ -30,11 +31,14 @@ void ScreenPractice::enter() {
 
 void ScreenPractice::reloadGL() {
 	theme = std::make_unique<ThemePractice>();
+	m_spectrograms.clear();
+	for (std::size_t i = 0, mics = m_audio.analyzers().size(); i < mics; ++i) m_spectrograms.push_back(std::make_unique<Spectrogram>());
 }
 
 void ScreenPractice::exit() {
 	Game::getSingletonPtr()->controllers.enableEvents(false);
 	m_vumeters.clear();
+	m_spectrograms.clear();
 	m_samples.clear();
 	theme.reset();
 }
@@ -71,14 +75,19 @@ void ScreenPractice::draw_analyzers() {
 	MusicalScale scale;
 	double textPower = -getInf();
 	double textFreq = 0.0;
+	// Spectrograms stacked at the top of the screen
+	const float spectrogramHeight = std::min(0.1f, 0.25f / analyzers.size());
 
 	for (unsigned int i = 0; i < analyzers.size(); ++i) {
 		Analyzer& analyzer = analyzers[i];
-		analyzer.process();
-		Tone const* tone = analyzer.findTone();
-		double freq = (tone ? tone->freq : 0.0);
-		if (tone && tone->db > textPower) {
-			textPower = tone->db;
+		Spectrogram& spectrogram = *m_spectrograms[i];
+		analyzer.process([&] { spectrogram.addStep(analyzer); });
+		spectrogram.draw(Dimensions().stretch(0.8f, spectrogramHeight).middle().screenTop(0.02f + i * spectrogramHeight));
+		Tone tone;
+		const bool found = analyzer.findTone(tone);
+		double freq = (found ? tone.freq : 0.0);
+		if (found && tone.db > textPower) {
+			textPower = tone.db;
 			textFreq = freq;
 		}
 		// getPeak returns 0.0 when clipping, negative values when not that loud.
@@ -87,13 +96,13 @@ void ScreenPractice::draw_analyzers() {
 		m_vumeters[i]->draw(analyzer.getPeak() / 43.0 + 1.0);
 
 		if (freq != 0.0) {
-			Analyzer::tones_t tones = analyzer.getTones();
+			Analyzer::tones_t const& tones = analyzer.getTones();
 
-			for (Analyzer::tones_t::const_iterator t = tones.begin(); t != tones.end(); ++t) {
-				if (t->age < Tone::MINAGE) continue;
-				if (!scale.setFreq(t->freq).isValid()) continue;
+			for (std::size_t t = 0; t < tones.size(); ++t) {
+				if (tones.age(t) < Tone::MINAGE) continue;
+				if (!scale.setFreq(tones.freq(t)).isValid()) continue;
 				double line = scale.getNoteLine() + 0.4 * scale.getNoteOffset();
-				float posXnote = -0.25 + 0.2 * i + 0.002 * t->stabledb;  // Wiggle horizontally based on volume
+				float posXnote = -0.25 + 0.2 * i + 0.002 * tones.stabledb(t);  // Wiggle horizontally based on volume
 				float posYnote = -0.03 - line * 0.015;  // On treble key (C4), plus offset (lines)
 
 				theme->note.dimensions.left(posXnote).center(posYnote);
@@ -7,6 +7,7 @@
 class Audio;
 class Sample;
 class ProgressBar;
+class Spectrogram;
 class ThemePractice;
 
 /// screen for practice mode
@@ -27,5 +28,6 @@ class ScreenPractice : public Screen {
 	Audio& m_audio;
 	std::vector<std::string> m_samples;
 	std::vector<std::unique_ptr<ProgressBar>> m_vumeters;
+	std::vector<std::unique_ptr<Spectrogram>> m_spectrograms;  ///< One per analyzer
 	std::unique_ptr<ThemePractice> theme;
 };
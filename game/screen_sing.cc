@@ -10,21 +10,28 @@
 #include "i18n.hh"
 #include "layout_singer.hh"
 #include "menu.hh"
+#include "micrecord.hh"
 #include "platform.hh"
 #include "screen_players.hh"
 #include "songparser.hh"
+#include "songs.hh"
 #include "util.hh"
 #include "video.hh"
 #include "webcam.hh"
 #include "screen_songs.hh"
 
 #include <boost/format.hpp>
+#include <future>
 #include <iostream>
 #include <stdexcept>
 #include <cmath>
+#include <sstream>
 #include <utility>
 
 namespace {
+	/// Seconds before the crossfade to the next song that its music is opened (so that it is buffered in time)
+	const double NEXT_SONG_PRELOAD = 10.0;
+
 	/// Add a flash message about the state of a config item
 	void dispInFlash(ConfigItem& ci) {
 		Game* gm = Game::getSingletonPtr();
@@ -32,8 +39,8 @@ namespace {
 	}
 }
 
-ScreenSing::ScreenSing(std::string const& name, Audio& audio, Database& database, Backgrounds& bgs):
-	Screen(name), m_audio(audio), m_database(database), m_backgrounds(bgs),
+ScreenSing::ScreenSing(std::string const& name, Audio& audio, Songs& songs, Database& database, Backgrounds& bgs):
+	Screen(name), m_audio(audio), m_songs(songs), m_database(database), m_backgrounds(bgs),
 	m_selectedTrack(TrackName::LEAD_VOCAL)
 {}
 
@@ -41,32 +48,71 @@ void ScreenSing::enter() {
 	keyPressed = false;
 	m_DuetTimeout.setValue(10);
 	Game* gm = Game::getSingletonPtr();
-	// Initialize webcam
-	gm->loading(_("Initializing webcam..."), 0.1);
-	if (config["graphic/webcam"].b() && Webcam::enabled()) {
-		try {
-			m_cam = std::make_unique<Webcam>(config["graphic/webcamid"].i());
-		} catch (std::exception& e) { std::cout << e.what() << std::endl; };
-	}
-	// Load video
-	gm->loading(_("Loading video..."), 0.2);
+	m_enterTime = Clock::now();
+	const bool handover = m_handoverSong && m_handoverSong == m_song;  // Music crossfaded in by the previous song
+	m_handoverSong.reset();
+	m_song = m_songs.refresh(m_song);  // Parse again if the file changed after the song cache was written
+	auto millis = [](Time since) { return int(1e3 * Seconds(Clock::now() - since).count()); };
+	// Open the music, the video and the webcam on other threads while the notes and graphics load
+	int musicTime = 0, videoTime = 0, notesTime = 0;
+	gm->loading(_("Loading song..."), 0.1);
+	std::future<std::unique_ptr<Music>> musicTask;
+	if (!handover) {
+		musicTask = std::async(std::launch::async, [files = m_song->music, &musicTime, millis] {
+			const Time begin = Clock::now();
+			auto music = Audio::openMusic(files);
+			musicTime = millis(begin);
+			return music;
+		});
+	}
+	std::future<std::unique_ptr<Video>> videoTask;
 	if (!m_song->video.empty() && config["graphic/video"].b()) {
-		m_video = std::make_unique<Video>(m_song->video, m_song->videoGap);
+		videoTask = std::async(std::launch::async, [file = m_song->video, gap = m_song->videoGap, &videoTime, millis] {
+			const Time begin = Clock::now();
+			auto video = std::make_unique<Video>(file, gap);
+			videoTime = millis(begin);
+			return video;
+		});
+	}
+	std::future<std::unique_ptr<Webcam>> camTask;
+	if (config["graphic/webcam"].b() && Webcam::enabled()) {
+		camTask = std::async(std::launch::async, []() -> std::unique_ptr<Webcam> {
+			try {
+				return std::make_unique<Webcam>(config["graphic/webcamid"].i());
+			} catch (std::exception& e) { std::cout << e.what() << std::endl; };
+			return nullptr;
+		});
 	}
 	reloadGL();
 	// Load song notes
-	gm->loading(_("Loading song..."), 0.4);
-	try { m_song->loadNotes(false /* don't ignore errors */); }
-	catch (SongParserException& e) {
-		std::clog << e;
-		gm->activateScreen("Songs");
+	gm->loading(_("Loading song..."), 0.3);
+	{
+		const Time begin = Clock::now();
+		if (m_prefetch.has(*m_song) && !m_prefetch.ready()) std::clog << "screen_sing/debug: Waiting for the prefetch of " << m_song->str() << std::endl;
+		m_prefetch.take(*m_song);  // Usually loaded while the previous song played
+		try { m_song->loadNotes(false /* don't ignore errors */); }
+		catch (SongParserException& e) {
+			std::clog << e;
+			gm->activateScreen("Songs");
+		}
+		notesTime = millis(begin);
 	}
 	// Notify about broken tracks
 	if (!m_song->b0rked.empty()) gm->dialog(_("Song contains broken tracks!") + std::string("\n\n") + m_song->b0rked);
 	// Startup delay for instruments is longer than for singing only
 	double setup_delay = (!m_song->hasControllers() ? -1.0 : -5.0);
-	m_audio.pause();
-	m_audio.playMusic(m_song->music, false, 0.0, setup_delay);
+	if (musicTask.valid()) {
+		m_audio.pause();
+		m_audio.playMusic(musicTask.get(), 0.0, setup_delay);
+	}
+	gm->loading(_("Loading video..."), 0.5);
+	if (videoTask.valid()) m_video = videoTask.get();
+	gm->loading(_("Initializing webcam..."), 0.6);
+	if (camTask.valid()) m_cam = camTask.get();
+	std::ostringstream details;
+	details << "notes " << notesTime << " ms, music " << musicTime << " ms, video " << videoTime << " ms, ready to play after " << millis(m_enterTime) << " ms";
+	m_startDetails = details.str();
+	m_startPending = true;
 	gm->loading(_("Loading menu..."), 0.7);
 	{
 		m_duet = ConfigItem(0);
@@ -75,6 +121,7 @@ void ScreenSing::enter() {
 			vocalTrack = ConfigItem(0);
 		}
 		prepareVoicesMenu();
+		if (handover && m_menu.isOpen()) setupVocals();  // Keep the music going with the default tracks
 	}
 	gm->showLogo(false);
 	gm->loading(_("Loading complete"), 1.0);
@@ -128,7 +175,10 @@ void ScreenSing::setupVocals() {
 			m_layout_singer.push_back(std::move(layoutSingerPtr));
 		}
 		// Note: Engine maps tracks with analyzers 1:1. If user doesn't have mics, we still want to have singer layout enabled but without engine...
-		if (!analyzers.empty()) m_engine = std::make_unique<Engine>(m_audio, selectedTracks, m_database);
+		if (!analyzers.empty()) {
+			m_engine.reset();  // Before recording, so that the previous one is done with the analyzers
+			m_engine = std::make_unique<Engine>(m_audio, selectedTracks, m_database, MicRecorder::start(*m_song, analyzers, selectedTracks));
+		}
 	}
 	createPauseMenu();
 	bool sameVoice = true;
@@ -184,11 +234,36 @@ void ScreenSing::exit() {
 	m_song->dropNotes();
 	m_menuTheme.reset();
 	theme.reset();
-	m_audio.fadeout(0);
+	if (m_handoverSong) m_song = m_handoverSong;  // Its music is playing already
+	else m_audio.fadeout(0);
+	m_nextSong.reset();
+	m_nextMusic = {};
 	if (m_audio.isPaused()) m_audio.togglePause();
 	Game::getSingletonPtr()->showLogo();
 }
 
+void ScreenSing::crossfadeToNext(double time) {
+	static ConfigItem& crossfade = config["game/playlist_crossfade"];
+	const double fadeTime = crossfade.i();
+	if (fadeTime <= 0.0 || m_handoverSong || m_audio.isPaused()) return;
+	const double remaining = m_audio.getLength() - time;
+	if (std::isnan(remaining) || remaining > fadeTime + NEXT_SONG_PRELOAD) return;
+	Game* gm = Game::getSingletonPtr();
+	PlayList& playlist = gm->getCurrentPlayList();
+	if (!m_nextSong) {
+		m_nextSong = playlist.peekNext();
+		if (m_nextSong) m_nextMusic = std::async(std::launch::async, [files = m_nextSong->music] { return Audio::openMusic(files); });
+		return;
+	}
+	if (remaining > fadeTime || m_nextMusic.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+	if (playlist.peekNext() != m_nextSong) { m_nextSong.reset(); m_nextMusic = {}; return; }  // The playlist was changed meanwhile
+	std::clog << "screen_sing/info: Crossfading to " << m_nextSong->str() << std::endl;
+	m_audio.playMusic(m_nextMusic.get(), fadeTime, 0.0);
+	m_database.addSong(m_song);
+	m_handoverSong = playlist.getNext();
+	gm->activateScreen("Sing");
+}
+
 
 
 /// Manages the instrument drawing
@@ -221,7 +296,10 @@ void ScreenSing::instrumentLayout(double time) {
 	for (Instruments::iterator it = m_instruments.begin(); it != m_instruments.end(); ++it, ++i) {
 		(*it)->engine();
 		(*it)->position((0.5 + i - 0.5 * count_alive) * iw, iw); // Do layout stuff
-		(*it)->draw(time);
+		{
+			glutil::GPUTimer::Section section("note highway");
+			(*it)->draw(time);
+		}
 		{
 			CountSum& cs = volume[(*it)->getTrack()];
 			cs.first++;
@@ -471,6 +549,8 @@ void ScreenSing::prepare() {
 	gm->controllers.enableEvents(m_song->hasControllers() && !m_menu.isOpen() && !m_score_window.get());
 	double time = m_audio.getPosition();
 	if (m_video) m_video->prepare(time);
+	m_prefetch.start(gm->getCurrentPlayList().peekNext());
+	crossfadeToNext(time);
 	// Menu mangling
 	// We don't allow instrument menus during global menu
 	// except for joining, in which case global menu is closed
@@ -494,8 +574,18 @@ bool ScreenSing::devCanParticipate(input::DevType const& devType) const {
 void ScreenSing::draw() {
 	// Get the time in the song
 	double length = m_audio.getLength();
+	static ConfigItem& videoDelay = config["audio/video_delay"];
+	static ConfigItem& webcam = config["graphic/webcam"];
+	static ConfigItem& karaokeMode = config["game/karaoke_mode"];
+	static ConfigItem& autoplay = config["game/autoplay"];
 	double time = m_audio.getPosition();
-	time -= config["audio/video_delay"].f();
+	if (m_startPending && !std::isnan(time)) {
+		// The music is buffered and playing (or paused at its start)
+		m_startPending = false;
+		m_startSeconds = Seconds(Clock::now() - m_enterTime).count();
+		std::clog << "screen_sing/info: " << m_song->str() << " started in " << int(1e3 * m_startSeconds) << " ms (" << m_startDetails << ")" << std::endl;
+	}
+	time -= videoDelay.f();
 	double songPercent = clamp(time / length);
 
 	// Rendering starts
@@ -503,12 +593,12 @@ void ScreenSing::draw() {
 		Transform ft(farTransform());
 		double ar = arMax;
 		// Background image
-		if (!m_background || m_background->empty()) m_background = std::make_unique<Texture>(m_backgrounds.getRandom());
+		if (!m_background || (m_background->empty() && !m_background->loading())) m_background = m_backgrounds.takeRandom();
 		ar = m_background->dimensions.ar();
 		if (ar > arMax || (m_video && ar > arMin)) fillBG();  // Fill white background to avoid black borders
 		m_background->draw();
 		// Webcam
-		if (m_cam && config["graphic/webcam"].b()) m_cam->render();
+		if (m_cam && webcam.b()) m_cam->render();
 		// Video
 		if (m_video) {
 			m_video->render(time); double tmp = m_video->dimensions().ar(); if (tmp > 0.0) ar = tmp;
@@ -553,8 +643,8 @@ void ScreenSing::draw() {
 			if (status == Song::Status::INSTRUMENTAL_BREAK) {
 				statustxt += _("   ENTER to skip instrumental break");
 			}
-			if (status == Song::Status::FINISHED && !config["game/karaoke_mode"].i()) {
-				if(config["game/autoplay"].b()) {
+			if (status == Song::Status::FINISHED && !karaokeMode.i()) {
+				if(autoplay.b()) {
 					if(m_displayAutoPlay) {
 						statustxt += _("   Autoplay enabled");
 					} else {
@@ -576,7 +666,7 @@ void ScreenSing::draw() {
 						statustxt += _("   Choose your next song!");
 					}
 				}
-			} else if(status == Song::Status::FINISHED && config["game/autoplay"].b()) {
+			} else if(status == Song::Status::FINISHED && autoplay.b()) {
 				statustxt += _("   Autoplay enabled");
 			}
 		}
@@ -584,7 +674,7 @@ void ScreenSing::draw() {
 		theme->timer.draw(statustxt);
 	}
 
-	if (config["game/karaoke_mode"].i() && !m_song->hasControllers()) { //guitar track? display the score window anyway!
+	if (karaokeMode.i() && !m_song->hasControllers()) { //guitar track? display the score window anyway!
 		if (!m_audio.isPlaying()) {
 			Game* gm = Game::getSingletonPtr();
 			gm->activateScreen("Playlist");
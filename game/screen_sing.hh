@@ -2,16 +2,21 @@
 
 #include "animvalue.hh"
 #include "audio.hh" // for AUDIO_MAX_ANALYZERS
+#include "chrono.hh"
 #include "configuration.hh"
 #include "menu.hh"
+#include "metrics.hh"
 #include "opengl_text.hh"
 #include "progressbar.hh"
 #include "screen.hh"
+#include "songprefetch.hh"
 #include "texture.hh"
 #include "theme.hh"
 #include "instrumentgraph.hh"
 
+#include <atomic>
 #include <deque>
+#include <future>
 
 class Audio;
 class Backgrounds;
@@ -21,6 +26,7 @@ class InstrumentGraph;
 class LayoutSinger;
 class Players;
 class Song;
+class Songs;
 class ThemeInstrumentMenu;
 class ThemeSing;
 class Video;
@@ -50,7 +56,7 @@ class ScoreWindow {
 class ScreenSing: public Screen {
   public:
 	/// constructor
-	ScreenSing(std::string const& name, Audio& audio, Database& database, Backgrounds& bgs);
+	ScreenSing(std::string const& name, Audio& audio, Songs& songs, Database& database, Backgrounds& bgs);
 	void enter();
 	void exit();
 	void reloadGL();
@@ -81,11 +87,15 @@ class ScreenSing: public Screen {
 	void createPauseMenu();
 	void drawMenu();
 	void prepareVoicesMenu(size_t moveSelectionTo = 0);
+	/// Crossfade into the next song of the playlist near the end of this one (game/playlist_crossfade)
+	void crossfadeToNext(double time);
 	bool devCanParticipate(input::DevType const& devType) const;
 	Audio& m_audio;
+	Songs& m_songs;
 	Database& m_database;
 	Backgrounds& m_backgrounds;
 	std::shared_ptr<Song> m_song; /// Pointer to the current song
+	SongPrefetch m_prefetch;  ///< Notes of the next song in the playlist
 	std::unique_ptr<ScoreWindow> m_score_window;
 	std::unique_ptr<ProgressBar> m_progress;
 	std::unique_ptr<Texture> m_background;
@@ -112,5 +122,14 @@ class ScreenSing: public Screen {
 	size_t m_selectedVocal;
 	bool m_displayAutoPlay = false;
 	bool keyPressed = false;
+	std::shared_ptr<Song> m_nextSong;  ///< Next song in the playlist, whose music is being opened for crossfading
+	std::future<std::unique_ptr<Music>> m_nextMusic;
+	std::shared_ptr<Song> m_handoverSong;  ///< Song whose music is already playing (crossfaded in) when entering
+	Time m_enterTime;  ///< When the song was selected
+	bool m_startPending = false;  ///< Waiting for the music to start, to log the time it took
+	std::string m_startDetails;  ///< Durations of the loading steps, for the log
+	std::atomic<double> m_startSeconds{ 0.0 };  ///< Latest time from selection to playback (read by the metrics server)
+	metrics::Family m_startMetric{ "performous_song_start_seconds", "Time from selecting the latest song until its music was ready to play", "gauge",
+	  [this] { return m_startSeconds.load(); } };
 };
 
@@ -1,11 +1,14 @@
 #include "screen_songs.hh"
 
 #include "audio.hh"
+#include "beatgrid.hh"
 #include "configuration.hh"
+#include "covercache.hh"
 #include "database.hh"
 #include "hiscore.hh"
 #include "i18n.hh"
 #include "platform.hh"
+#include "previewcache.hh"
 #include "screen_sing.hh"
 #include "screen_playlist.hh"
 #include "songs.hh"
@@ -13,15 +16,14 @@
 #include "util.hh"
 #include "playlist.hh"
 
-#include "aubio/aubio.h"
 #include <iostream>
 #include <mutex>
 #include <sstream>
 
 static const double IDLE_TIMEOUT = 35.0; // seconds
 
-ScreenSongs::ScreenSongs(std::string const& name, Audio& audio, Songs& songs, Database& database):
-  Screen(name), m_audio(audio), m_songs(songs), m_database(database)
+ScreenSongs::ScreenSongs(std::string const& name, Audio& audio, Songs& songs, Database& database, CoverCache& covers):
+  Screen(name), m_audio(audio), m_songs(songs), m_database(database), m_covers(covers), m_previewCache(std::make_unique<PreviewCache>()), m_beatGrid(std::make_unique<BeatGrid>())
 {
 	m_songs.setAnimMargins(5.0, 5.0);
 	// Using AnimValues as a simple timers counting seconds
@@ -29,9 +31,11 @@ ScreenSongs::ScreenSongs(std::string const& name, Audio& audio, Songs& songs, Da
 	m_idleTimer.setTarget(getInf());
 }
 
+ScreenSongs::~ScreenSongs() {}
+
 void ScreenSongs::enter() {
 	m_menu.close();
-	m_songs.setFilter(m_search.text);
+	m_songs.setFilter(m_search.text, true);
 	m_audio.fadeout();
 	m_menuPos = 1;
 	m_infoPos = 0;
@@ -52,7 +56,6 @@ void ScreenSongs::reloadGL() {
 }
 
 void ScreenSongs::exit() {
-	m_covers.clear();
 	m_menu.clear();
 	m_menuTheme.reset();
 	m_singCover.reset();
@@ -104,7 +107,7 @@ void ScreenSongs::manageEvent(input::NavEvent const& event) {
 		else if (nav == input::NAV_MOREDOWN) m_audio.seek(30);
 	} else if (nav == input::NAV_CANCEL) {
 		if (m_menuPos != 1) m_menuPos = 1;  // Exit menu (back to song selection)
-		else if (!m_search.text.empty()) { m_search.text.clear(); m_songs.setFilter(m_search.text); }  // Clear search
+		else if (!m_search.text.empty()) { m_search.text.clear(); m_songs.setFilter(m_search.text, true); }  // Clear search
 		else if (m_songs.typeNum()) m_songs.typeChange(0);  // Clear type filter
 		else gm->activateScreen("Intro");
 	}
@@ -145,7 +148,7 @@ void ScreenSongs::manageEvent(SDL_Event event) {
 	// Handle less common, keyboard only keys
 	if (event.type == SDL_TEXTINPUT) {
 		m_search += event.text.text;
-		m_songs.setFilter(m_search.text);
+		m_songs.setFilter(m_search.text, true);
 	}
 	else if (event.type == SDL_KEYDOWN) {
 		SDL_Keysym keysym = event.key.keysym;
@@ -154,12 +157,12 @@ void ScreenSongs::manageEvent(SDL_Event event) {
 		if (key == SDL_SCANCODE_F4) m_jukebox = !m_jukebox;
 		else if (key == SDL_SCANCODE_BACKSPACE) {
 			m_search.backspace();
-			m_songs.setFilter(m_search.text);
+			m_songs.setFilter(m_search.text, true);
 		}
 		else if (!m_jukebox) {
 			if (key == SDL_SCANCODE_R && mod & Platform::shortcutModifier()) {
 				m_songs.reload();
-				m_songs.setFilter(m_search.text);
+				m_songs.setFilter(m_search.text, true);
 				}
 			// Shortcut keys for accessing different type filter modes
 			if (key == SDL_SCANCODE_TAB) m_songs.sortChange(1);
@@ -175,8 +178,19 @@ void ScreenSongs::manageEvent(SDL_Event event) {
 void ScreenSongs::update() {
 	Game* sm = Game::getSingletonPtr();
 	sm->showLogo(!m_jukebox);
+	if (auto current = m_songs.currentPtr()) {
+		if (current->beats.empty() && !current->hasControllers()) m_beatGrid->take(*current);  // Detected in the background
+	}
 	if (m_idleTimer.get() < 0.3) return;  // Only update when the user gives us a break
 	m_songs.update(); // Poll for new songs
+	if (!m_previewsPopulated && m_songs.doneLoading) {
+		// Song scan finished, fill the preview cache in the background
+		std::vector<std::shared_ptr<Song>> all;
+		for (int i = 0; i < m_songs.size(); ++i) all.push_back(m_songs[i]);
+		m_previewCache->populate(all);
+		m_beatGrid->populate(all);
+		m_previewsPopulated = true;
+	}
 	bool songChange = false;  // Do we need to switch songs?
 	// Automatic song browsing
 	if (!m_audio.isPaused() && m_idleTimer.get() > 1.0) {
@@ -197,17 +211,17 @@ void ScreenSongs::update() {
 	if (m_playing != music) songChange = true;
 	// Switch songs if needed, only when the user is not browsing for a moment
 	if (!songChange) return;
-	ScreenSongs::previewBeatsBuffer.reset(new_fvec(1));
-	{
-	std::lock_guard<std::recursive_mutex> l(Audio::aubio_mutex);	
-	Audio::aubioTempo.reset(new_aubio_tempo("default", Audio::aubio_win_size, Audio::aubio_hop_size, Audio::getSR()));
-	}
-	if (song && song->hasControllers()) { song->loadNotes(); } // Needed for BPM info.
+	if (song && song->hasControllers()) { song = m_songs.refresh(song); song->loadNotes(); } // Needed for BPM info.
+	m_beatGrid->request(song);
 	m_playing = music;
 	// Clear the old content and load new content if available
 	m_songbg.reset(); m_video.reset();
 	double pstart = (!m_jukebox && song ? song->preview_start : 0.0);
-	m_audio.playMusic(music, true, 1.0, pstart);
+	// Regular previews are played from the cache when available (jukebox plays full songs)
+	fs::path cached = (!m_jukebox && song ? m_previewCache->lookup(*song) : fs::path());
+	if (!cached.empty()) m_audio.playMusic(Audio::Files{{ "background", cached }}, true, 1.0, pstart, PreviewCache::startOf(*song));
+	else m_audio.playMusic(music, true, 1.0, pstart);
+	if (!m_jukebox) prefetchPreviews();
 	if (song) {
 		fs::path const& background = song->background.empty() ? song->cover : song->background;
 		if (!background.empty()) try { m_songbg = std::make_unique<Texture>(background); } catch (std::exception const&) {}
@@ -215,6 +229,19 @@ void ScreenSongs::update() {
 	}
 }
 
+void ScreenSongs::prefetchPreviews() {
+	const int size = m_songs.size();
+	if (size == 0) return;
+	// Nearest first: the current song, then alternating forward and backward
+	std::vector<std::shared_ptr<Song>> songs;
+	const int current = m_songs.currentId();
+	for (int d = 0; d <= 3 && 2 * d < size; ++d) {
+		songs.push_back(m_songs[(current + d) % size]);
+		if (d > 0) songs.push_back(m_songs[(current - d + size) % size]);
+	}
+	m_previewCache->prefetch(songs);
+}
+
 bool ScreenSongs::addSong() {
 	Game* gm = Game::getSingletonPtr();
 	auto& pl = gm->getCurrentPlayList();
@@ -231,7 +258,8 @@ void ScreenSongs::sing() {
 }
 
 void ScreenSongs::prepare() {
-	double time = m_audio.getPosition() - config["audio/video_delay"].f();
+	static ConfigItem& videoDelay = config["audio/video_delay"];
+	double time = m_audio.getPosition() - videoDelay.f();
 	if (m_video) m_video->prepare(time);
 }
 
@@ -261,8 +289,9 @@ void ScreenSongs::drawJukebox() {
 void ScreenSongs::drawMultimedia() {
 	if (!m_songs.empty()) {
 		Transform ft(farTransform());  // 3D effect
+		static ConfigItem& videoDelay = config["audio/video_delay"];
 		double length = m_audio.getLength();
-		double time = clamp(m_audio.getPosition() - config["audio/video_delay"].f(), 0.0, length);
+		double time = clamp(m_audio.getPosition() - videoDelay.f(), 0.0, length);
 		m_songbg_default->draw();   // Default bg
 		if (m_songbg.get() && !m_video.get()) {
 			if (m_songbg->width() > 512 && m_songbg->dimensions.ar() > 1.1) {
@@ -293,21 +322,28 @@ void ScreenSongs::draw() {
 	if (m_songs.empty()) {
 		// Format the song information text
 		if (!m_search.text.empty()) {
-			oss_song << _("Sorry, no songs match the search!");
+			oss_song << _C("Sorry, no songs match the search!");
 			oss_order << m_search.text;
 		} else if (m_songs.typeNum()) {
-			oss_song << _("Sorry, no songs match the filter!");
+			oss_song << _C("Sorry, no songs match the filter!");
 			oss_order << m_songs.typeDesc();
 		} else {
-			oss_song << _("No songs found!");
-			oss_order << _("Visit performous.org for free songs");
+			oss_song << _C("No songs found!");
+			oss_order << _C("Visit performous.org for free songs");
 		}
 	} else {
 		Song& song = m_songs.current();
 		// Format the song information text
 		oss_song << song.artist << ": " << song.title;
-		// Get hiscores from database
-		m_database.queryPerSongHiscore(oss_hiscore, m_songs.currentPtr());
+		// Get hiscores from database (only when the song or the database has changed)
+		if (m_hiscoreSong != &song || m_hiscoreGeneration != m_database.generation()) {
+			m_hiscoreSong = &song;
+			m_hiscoreGeneration = m_database.generation();
+			std::ostringstream oss;
+			m_database.queryPerSongHiscore(oss, m_songs.currentPtr());
+			m_hiscoreText = oss.str();
+		}
+		oss_hiscore << m_hiscoreText;
 		// Escaped bytes of UTF-8 must be used here for compatibility with Windows (MSVC, mingw)
 		char const* VERT_ARROW = "\xe2\x86\x95 ";  // ↕
 		char const* HORIZ_ARROW = "\xe2\x86\x94 ";  // ↔
@@ -318,14 +354,14 @@ void ScreenSongs::draw() {
 			if (!m_search.text.empty()) oss_order << m_search.text;
 			else if (m_songs.typeNum()) oss_order << m_songs.typeDesc();
 			else if (m_songs.sortNum()) oss_order << m_songs.sortDesc();
-			else oss_order << _("<type in to search>") << PAD << HORIZ_ARROW << _("songs") << PAD << VERT_ARROW << _("options");
+			else oss_order << _C("<type in to search>") << PAD << HORIZ_ARROW << _C("songs") << PAD << VERT_ARROW << _C("options");
 			break;
-		case 2: oss_order << HORIZ_ARROW << _("sort order: ") << m_songs.sortDesc(); break;
-		case 3: oss_order << HORIZ_ARROW << _("type filter: ") << m_songs.typeDesc(); break;
-		case 4: oss_order << HORIZ_ARROW << _("hiscores") << PAD << ENTER << _("jukebox mode"); break;
+		case 2: oss_order << HORIZ_ARROW << _C("sort order: ") << m_songs.sortDesc(); break;
+		case 3: oss_order << HORIZ_ARROW << _C("type filter: ") << m_songs.typeDesc(); break;
+		case 4: oss_order << HORIZ_ARROW << _C("hiscores") << PAD << ENTER << _C("jukebox mode"); break;
 		case 0:
 			bool empty = Game::getSingletonPtr()->getCurrentPlayList().isEmpty();
-			oss_order << ENTER << (empty ? _("start a playlist with this song!") : _("open the playlist menu"));
+			oss_order << ENTER << (empty ? _C("start a playlist with this song!") : _C("open the playlist menu"));
 			break;
 		}
 	}
@@ -343,6 +379,7 @@ void ScreenSongs::draw() {
 }
 
 void ScreenSongs::drawCovers() {
+	glutil::GPUTimer::Section section("covers");
 	double spos = m_songs.currentPosition(); // This needs to be polled to run the animation
 	std::size_t ss = m_songs.size();
 	int currentId = m_songs.currentId();
@@ -354,7 +391,8 @@ void ScreenSongs::drawCovers() {
 		// Use actual song BPM. FIXME: Should only do this if currentId is also playing.
 		if (m_songs.currentPtr()->music == m_playing) {
 				if (m_songs.currentPtr()->hasControllers() || !m_songs.currentPtr()->beats.empty()) {
-				double t = m_audio.getPosition() - config["audio/video_delay"].f();
+				static ConfigItem& videoDelay = config["audio/video_delay"];
+				double t = m_audio.getPosition() - videoDelay.f();
 				Song::Beats const& beats = m_songs.current().beats;
 				auto it = std::lower_bound(m_songs.currentPtr()->hasControllers() ? beats.begin() : (beats.begin() + 1), beats.end(), t);
 				if (it != beats.begin() && it != beats.end()) {
@@ -396,12 +434,7 @@ void ScreenSongs::drawCovers() {
 		Transform trans(translate(vec3(x, y, z)) * rotate(angle, vec3(0.0, 1.0, 0.0)));
 		ColorTrans c1(Color(c, c, c));
 		s.dimensions.middle().screenCenter().bottom().fitInside(0.17, 0.17);
-		// Draw the cover normally
-		s.draw();
-		// Draw the reflection
-		Transform transMirror(scale(vec3(1.0f, -1.0f, 1.0f)));
-		ColorTrans c2(Color::alpha(0.4));
-		s.draw();
+		s.drawReflected(0.4);
 	}
 	// Draw the playlist
 	Game* gm = Game::getSingletonPtr();
@@ -422,14 +455,7 @@ void ScreenSongs::drawCovers() {
 }
 
 Texture* ScreenSongs::loadTextureFromMap(fs::path path) {
-	if(m_covers.find(path) == m_covers.end()) {
-		std::pair<fs::path, std::unique_ptr<Texture>> kv = std::make_pair(path, std::make_unique<Texture>(path));
-		m_covers.insert(std::move(kv));
-	}
-	try {
-		return m_covers.at(path).get();
-	} catch (std::exception const&) {}
-	return nullptr;
+	return &m_covers.get(path);
 }
 
 Texture& ScreenSongs::getCover(Song const& song) {
@@ -445,8 +471,7 @@ Texture& ScreenSongs::getCover(Song const& song) {
 		} else if(song.hasDrums()) {
 			cover = m_bandCover.get();
 		} else {
-			size_t tracks = song.instrumentTracks.size();
-			if (tracks == 0) cover = m_singCover.get();
+			if (!song.hasGuitars() && !song.hasKeyboard()) cover = m_singCover.get();
 			else cover = m_instrumentCover.get();
 		}
 	}
@@ -486,6 +511,7 @@ void ScreenSongs::drawInstruments(Dimensions dim) const {
 		if (isTrackInside(song.instrumentTracks,TrackName::GUITAR_COOP)) guitarCount++;
 		if (isTrackInside(song.instrumentTracks,TrackName::GUITAR_RHYTHM)) guitarCount++;
 		if (isTrackInside(song.instrumentTracks,TrackName::BASS)) { guitarCount++; have_bass = true; }
+		if (guitarCount == 0 && song.hasGuitars()) guitarCount = 1;  // Headers from the cache only tell that there are guitars
 	}
 
 	UseTexture tex(*m_instrumentList);
@@ -545,7 +571,6 @@ void ScreenSongs::drawMenu() {
 	m_menu.dimensions.stretch(w, h);
 }
 
-std::unique_ptr<fvec_t, void(*)(fvec_t*)> ScreenSongs::previewBeatsBuffer = std::unique_ptr<fvec_t, void(*)(fvec_t*)>(new_fvec(1), [](fvec_t* p){del_fvec(p);});
 
 void ScreenSongs::createPlaylistMenu() {
 	m_menu.clear();
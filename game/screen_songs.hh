@@ -9,23 +9,26 @@
 #include "video.hh"
 #include "playlist.hh"
 #include "menu.hh"
-#include "aubio/aubio.h"
 
 class Audio;
 class Database;
 class Song;
 class Songs;
+class CoverCache;
 class Texture;
 class ThemeSongs;
 
 class Backgrounds;
+class BeatGrid;
+class PreviewCache;
 class ThemeInstrumentMenu;
 
 /// song chooser screen
 class ScreenSongs : public Screen {
 public:
 	/// constructor
-	ScreenSongs(std::string const& name, Audio& audio, Songs& songs, Database& database);
+	ScreenSongs(std::string const& name, Audio& audio, Songs& songs, Database& database, CoverCache& covers);
+	~ScreenSongs();
 	void enter();
 	void exit();
 	void reloadGL();
@@ -38,7 +41,6 @@ public:
 	void drawCovers(); ///< draw the cover browser
 	Texture& getCover(Song const& song); ///< get appropriate cover image for the song (incl. no cover)
 	void drawJukebox(); ///< draw the songbrowser in jukebox mode (fullscreen, full previews, ...)
-	static std::unique_ptr<fvec_t, void(*)(fvec_t*)> previewBeatsBuffer;
 private:
 	void manageSharedKey(input::NavEvent const& event); ///< same behaviour for jukebox and normal mode
 	void drawInstruments(Dimensions dim) const;
@@ -49,6 +51,7 @@ private:
 	void sing(); ///< Enter singing screen with current playlist.
 	void createPlaylistMenu();
 	Texture* loadTextureFromMap(fs::path path);
+	void prefetchPreviews(); ///< Queue previews of the songs around the selection for caching
 
 	Audio& m_audio;
 	Songs& m_songs;
@@ -66,8 +69,14 @@ private:
 	std::unique_ptr<Texture> m_danceCover;
 	std::unique_ptr<Texture> m_instrumentList;
 	std::unique_ptr<ThemeInstrumentMenu> m_menuTheme;
-	std::map<fs::path, std::unique_ptr<Texture>> m_covers;
+	CoverCache& m_covers;
+	std::unique_ptr<PreviewCache> m_previewCache;
+	std::unique_ptr<BeatGrid> m_beatGrid;  ///< Beats of the songs without instrument tracks
+	bool m_previewsPopulated = false;
 	int m_menuPos, m_infoPos;
 	bool m_jukebox;
 	Menu m_menu;
+	Song const* m_hiscoreSong = nullptr;  ///< Song of m_hiscoreText
+	unsigned m_hiscoreGeneration = 0;  ///< Database::generation() of m_hiscoreText
+	std::string m_hiscoreText;
 };
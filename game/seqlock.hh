@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/**
+* Single-writer sequence lock: publishes a small trivially copyable value so that readers on any thread get
+* a consistent copy without locking. The writer never waits; a reader retries if the value changed while it
+* was copying (which only happens when it races with store()). Only one thread at a time may call store().
+**/
+template <typename T> class SeqLock {
+	static_assert(std::is_trivially_copyable<T>::value, "SeqLock value must be trivially copyable");
+	static constexpr std::size_t WORDS = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+public:
+	explicit SeqLock(T const& value = T()) { store(value); }
+	/// Publish a new value (writer only)
+	void store(T const& value) {
+		std::uint64_t words[WORDS] = {};
+		std::memcpy(words, &value, sizeof(T));
+		const unsigned seq = m_seq.load(std::memory_order_relaxed);
+		m_seq.store(seq + 1, std::memory_order_relaxed);  // Odd while writing
+		std::atomic_thread_fence(std::memory_order_release);
+		for (std::size_t i = 0; i < WORDS; ++i) m_words[i].store(words[i], std::memory_order_relaxed);
+		m_seq.store(seq + 2, std::memory_order_release);
+	}
+	/// Get the latest value published
+	T load() const {
+		std::uint64_t words[WORDS];
+		unsigned before, after;
+		do {
+			before = m_seq.load(std::memory_order_acquire);
+			for (std::size_t i = 0; i < WORDS; ++i) words[i] = m_words[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			after = m_seq.load(std::memory_order_relaxed);
+		} while (before != after || (before & 1));
+		T value;
+		std::memcpy(&value, words, sizeof(T));
+		return value;
+	}
+private:
+	std::atomic<unsigned> m_seq{ 0 };
+	std::atomic<std::uint64_t> m_words[WORDS];
+};
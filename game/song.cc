@@ -5,13 +5,79 @@
 #include "unicode.hh"
 #include "util.hh"
 
+#include <boost/filesystem.hpp>
 #include <algorithm>
 #include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
 
 extern "C" {
 #include AVFORMAT_INCLUDE
 #include AVCODEC_INCLUDE
 }
+
+namespace {
+	/// The notes dropped from a song (its tracks stay, with their other data)
+	struct NoteSet {
+		std::map<std::string, Notes> vocals;
+		std::map<std::string, NoteMap> instruments;
+		DanceTracks dance;
+		std::string b0rked;
+		std::size_t bytes = 0;
+	};
+
+	/**
+	* Notes of recently played songs by file and stamp, so that playing one again (common in competitions) is
+	* a move instead of parsing the file. Kept within game/notes_cache_mb, dropping the least recently played.
+	* Songs loading notes in the background (SongPrefetch) use it too, hence the lock.
+	**/
+	class NoteCache {
+	  public:
+		void put(std::string const& key, NoteSet&& notes) {
+			const std::size_t limit = std::size_t(config["game/notes_cache_mb"].i()) << 20;
+			if (notes.bytes > limit) return;
+			std::lock_guard<std::mutex> l(m_mutex);
+			erase(key);
+			m_bytes += notes.bytes;
+			m_lru.emplace_front(key, std::move(notes));
+			m_entries[key] = m_lru.begin();
+			while (m_bytes > limit) erase(m_lru.back().first);
+			m_memory.set(m_bytes);
+		}
+		/// Move the notes out of the cache, returning false if not there
+		bool take(std::string const& key, NoteSet& notes) {
+			std::lock_guard<std::mutex> l(m_mutex);
+			auto it = m_entries.find(key);
+			if (it == m_entries.end()) return false;
+			notes = std::move(it->second->second);
+			erase(key);
+			m_memory.set(m_bytes);
+			return true;
+		}
+	  private:
+		void erase(std::string const& key) {
+			auto it = m_entries.find(key);
+			if (it == m_entries.end()) return;
+			m_bytes -= it->second->second.bytes;
+			m_lru.erase(it->second);
+			m_entries.erase(it);
+		}
+		typedef std::list<std::pair<std::string, NoteSet>> List;
+		std::mutex m_mutex;
+		List m_lru;  ///< Most recently dropped first
+		std::unordered_map<std::string, List::iterator> m_entries;
+		std::size_t m_bytes = 0;  ///< Sum of NoteSet::bytes
+		memstats::Usage m_memory{ "song notes cache" };
+	};
+
+	NoteCache& noteCache() {
+		static NoteCache& cache = *new NoteCache();  // Never destroyed, as songs may drop notes during exit
+		return cache;
+	}
+}
+
 #ifdef USE_WEBSERVER
 Song::Song(web::json::value const& song): dummyVocal(TrackName::LEAD_VOCAL), randomIdx(rand()) {
 	path = song.has_field("TxtFileFolder") ? fs::path(song.at("TxtFileFolder").as_string().substr(0, song.at("TxtFileFolder").as_string().find_last_of("/\\"))) : "";
@@ -29,31 +95,16 @@ Song::Song(web::json::value const& song): dummyVocal(TrackName::LEAD_VOCAL), ran
 	start = song.has_field("Start") ? song.at("Start").as_number().to_double() : 0.0;
 	preview_start = song.has_field("PreviewStart") ? song.at("PreviewStart").as_number().to_double() : 0.0;
 	m_duration = song.has_field("Duration") ? song.at("Duration").as_number().to_double() : 0.0;
+	fileSize = song.has_field("FileSize") ? song.at("FileSize").as_number().to_uint64() : 0;
+	fileTime = song.has_field("FileTime") ? song.at("FileTime").as_number().to_int64() : 0;
 	music["background"] = song.has_field("SongFile") ? fs::path(song.at("SongFile").as_string()) : "";
 	music["vocals"] = song.has_field("Vocals") ? fs::path(song.at("Vocals").as_string()) : "";
 	loadStatus = Song::LoadStatus::HEADER;
 	
-	if (song.has_field("VocalTracks")) {
-		for (unsigned i = 0; i < song.at("VocalTracks").as_number().to_uint32(); i++) {
-			std::string track = "DummyTrack" + std::to_string(i);
-			insertVocalTrack(track, VocalTrack(track));
-		}
-	}
-	
-	if (song.has_field("KeyboardTracks")) {
-			instrumentTracks.insert(make_pair(TrackName::KEYBOARD, InstrumentTrack(TrackName::KEYBOARD)));
-	}
-	
-	if (song.has_field("DrumTracks")) {
-			instrumentTracks.insert(make_pair(TrackName::DRUMS, InstrumentTrack(TrackName::DRUMS)));
-	}		
-	if (song.has_field("DanceTracks")) {
-		DanceDifficultyMap danceDifficultyMap;
-			danceTracks.insert(std::make_pair("dance-single", danceDifficultyMap));
-	}		
-	if (song.has_field("GuitarTracks")) {
-			instrumentTracks.insert(std::make_pair(TrackName::GUITAR, InstrumentTrack(TrackName::GUITAR)));
-	}
+	addCachedTracks(song.has_field("VocalTracks") ? song.at("VocalTracks").as_number().to_uint32() : 0,
+	  song.has_field("KeyboardTracks"), song.has_field("DrumTracks"),
+	  song.has_field("DanceTracks") ? song.at("DanceTracks").as_number().to_uint32() : 0,
+	  song.has_field("GuitarTracks") ? song.at("GuitarTracks").as_number().to_uint32() : 0);
 	if (song.has_field("BPM")) {
 			m_bpms.push_back(BPM(0, 0, song.at("BPM").as_number().to_double()));
 	}
@@ -61,10 +112,25 @@ Song::Song(web::json::value const& song): dummyVocal(TrackName::LEAD_VOCAL), ran
 }
 #endif
 
-Song::Song(fs::path const& path, fs::path const& filename):
+Song::Song(): dummyVocal(TrackName::LEAD_VOCAL), randomIdx(rand()) {}
+
+void Song::addCachedTracks(unsigned vocals, bool keyboard, bool drums, unsigned dance, unsigned guitars) {
+	const unsigned limit = std::numeric_limits<std::uint8_t>::max();
+	m_cachedTracks.valid = true;
+	m_cachedTracks.keyboard = keyboard;
+	m_cachedTracks.drums = drums;
+	m_cachedTracks.vocals = std::min(vocals, limit);
+	m_cachedTracks.dance = std::min(dance, limit);
+	m_cachedTracks.guitars = std::min(guitars, limit);
+}
+
+Song::Song(fs::path const& path, fs::path const& filename, std::vector<fs::path> const* folder):
   dummyVocal(TrackName::LEAD_VOCAL), path(path), filename(filename), randomIdx(rand())
 {
-	SongParser(*this);
+	boost::system::error_code ec;
+	std::uintmax_t size = fs::file_size(filename, ec);
+	if (!ec) { fileSize = size; fileTime = fs::last_write_time(filename, ec); }
+	SongParser(*this, folder);
 	collateUpdate();
 }
 
@@ -74,43 +140,131 @@ void Song::reload(bool errorIgnore) {
 
 void Song::loadNotes(bool errorIgnore) {
 	if (loadStatus == LoadStatus::FULL) return;
-	try { SongParser(*this); } catch (...) { if (!errorIgnore) throw; }
+	try {
+		NoteSet cached;
+		if (m_parsed && noteCache().take(noteKey(), cached)) {
+			// Only the notes were dropped since the song was parsed: put them back
+			for (auto& v: cached.vocals) {
+				auto it = vocalTracks.find(v.first);
+				if (it != vocalTracks.end()) it->second.notes = std::move(v.second);
+			}
+			for (auto& i: cached.instruments) {
+				auto it = instrumentTracks.find(i.first);
+				if (it != instrumentTracks.end()) it->second.nm = std::move(i.second);
+			}
+			for (auto& d: cached.dance) danceTracks[d.first] = std::move(d.second);
+			b0rked = std::move(cached.b0rked);
+			m_cachedTracks.valid = false;
+			loadStatus = LoadStatus::FULL;
+			m_notesMemory.set(cached.bytes);
+			updateTimelines();
+			return;
+		}
+		m_cachedTracks.valid = false;  // The parser queries the actual tracks
+		SongParser(*this);
+	} catch (...) { if (!errorIgnore) throw; }
+	m_parsed = loadStatus == LoadStatus::FULL;
+	m_notesMemory.set(notesBytes());
+	updateTimelines();
+}
+
+void Song::updateTimelines() {
+	auto timeline = [](Notes const& notes) {
+		Timeline t;
+		t.reserve(notes.size());
+		for (Note const& n: notes) t.push_back(NoteTimes{ n.begin, n.end });
+		return t;
+	};
+	m_timelines.clear();
+	for (auto const& trk: vocalTracks) m_timelines.push_back(timeline(trk.second.notes));
+	m_duetTimeline.clear();
+	if (m_timelines.size() < 2) return;
+	Timeline const& t1 = m_timelines[0];
+	Timeline const& t2 = m_timelines[1];
+	m_duetTimeline.reserve(t1.size() + t2.size());
+	std::merge(t1.begin(), t1.end(), t2.begin(), t2.end(), std::back_inserter(m_duetTimeline), [](NoteTimes const& a, NoteTimes const& b) { return a.begin < b.begin; });
+}
+
+std::size_t Song::notesBytes() const {
+	std::size_t bytes = 0;
+	for (auto const& trk: vocalTracks) for (auto const& n: trk.second.notes) bytes += sizeof(Note) + n.syllable.capacity();
+	for (auto const& trk: instrumentTracks) for (auto const& nm: trk.second.nm) bytes += nm.second.capacity() * sizeof(Duration);
+	for (auto const& trk: danceTracks) for (auto const& d: trk.second) bytes += d.second.notes.size() * sizeof(Note);
+	return bytes;
+}
+
+std::string Song::noteKey() const {
+	return filename.string() + '\n' + std::to_string(fileSize) + '\n' + std::to_string(fileTime);
+}
+
+Notes const& Song::danceNotes(std::string const& mode, DanceDifficulty level) const {
+	DanceTrack const& track = danceTracks.at(mode).at(level);
+	if (!track.loaded) {
+		track.loaded = true;  // Even if it fails, rather than parsing again
+		try {
+			SongParser(*this, track);
+		} catch (std::exception& e) {
+			std::clog << "songparser/error: " << e.what() << std::endl;
+		}
+	}
+	return track.notes;
+}
+
+bool Song::fileChanged() const {
+	boost::system::error_code ec;
+	std::uintmax_t size = fs::file_size(filename, ec);
+	if (ec) return true;
+	return size != fileSize || fs::last_write_time(filename, ec) != fileTime;
 }
 
 void Song::dropNotes() {
-	for (auto& trk: vocalTracks) trk.second.notes.clear();
+	if (loadStatus == LoadStatus::FULL && m_parsed) {
+		NoteSet notes;
+		notes.bytes = notesBytes();  // Including dance charts loaded since
+		for (auto& trk: vocalTracks) notes.vocals[trk.first] = std::move(trk.second.notes);
+		for (auto& trk: instrumentTracks) notes.instruments[trk.first] = std::move(trk.second.nm);
+		for (auto& trk: danceTracks) notes.dance[trk.first] = std::move(trk.second);
+		notes.b0rked = b0rked;
+		noteCache().put(noteKey(), std::move(notes));
+	}
+	for (auto& trk: vocalTracks) Notes().swap(trk.second.notes);  // Release the memory too, unlike clear()
 	for (auto& trk: instrumentTracks) trk.second.nm.clear();
 	for (auto& trk: danceTracks) trk.second.clear();
+	m_timelines.clear();
+	Timeline().swap(m_duetTimeline);
 	b0rked.clear();
 	loadStatus = LoadStatus::HEADER;
+	m_notesMemory.set(0);
 }
 
 void Song::collateUpdate() {
-	songMetadata collateInfo {{"artist", artist}, {"title", title}};
-	UnicodeUtil::collate(collateInfo);	
-	
-	collateByTitle = collateInfo["title"] + "__" + collateInfo["artist"] + "__" + filename.string();
-	collateByTitleOnly = collateInfo["title"];
-	
-	collateByArtist = collateInfo["artist"] + "__" + collateInfo["title"] + "__" + filename.string();
-	collateByArtistOnly = collateInfo["artist"];
+	std::atomic_store(&m_collate, std::shared_ptr<Collate const>());
+}
+
+Song::Collate const& Song::collate() const {
+	std::shared_ptr<Collate const> current = std::atomic_load(&m_collate);
+	if (current) return *current;
+	songMetadata collateInfo {{"artist", artist.str()}, {"title", title}};
+	UnicodeUtil::collate(collateInfo);
+	auto c = std::make_shared<Collate>();
+	c->byTitle = collateInfo["title"] + "__" + collateInfo["artist"] + "__" + filename.string();
+	c->titleLength = collateInfo["title"].size();
+	c->byArtist = collateInfo["artist"] + "__" + collateInfo["title"] + "__" + filename.string();
+	c->artistLength = collateInfo["artist"].size();
+	// Another thread may have been first, then its strings are kept (and stay valid until collateUpdate)
+	std::shared_ptr<Collate const> made = std::move(c);
+	if (std::atomic_compare_exchange_strong(&m_collate, &current, made)) return *made;
+	return *current;
 }
 
 Song::Status Song::status(double time, ScreenSing* song) {
 	if (song->getMenu().isOpen()) return Status::NORMAL; // This should prevent querying getVocalTrack with an out-of-bounds/uninitialized index.
 	if (vocalTracks.empty()) return Status::NORMAL;  // To avoid crash with non-vocal songs (dance, guitar) -- FIXME: what should we actually do?
-	Note target; target.end = time;
-	Notes s1, s2, notes;
-	Notes::const_iterator it;
-	if (song->singingDuet()) {
-		s1 = getVocalTrack(0).notes;
-		s2 = getVocalTrack(1).notes;
-		std::merge(s1.begin(), s1.end(), s2.begin(), s2.end(), std::back_inserter(notes), Note::ltBegin);
-	}
-	else {
-		notes = getVocalTrack(song->selectedVocalTrack()).notes;
-	}
-	it = std::lower_bound(notes.begin(), notes.end(), target, [](Note const& a, Note const& b) { return a.end < b.end; });
+	if (m_timelines.size() != vocalTracks.size()) updateTimelines();  // Notes not loaded by loadNotes
+	const std::size_t track = song->selectedVocalTrack();
+	if (!song->singingDuet() && track >= m_timelines.size()) throw std::logic_error("Index " + std::to_string(track) + " out of bounds in Song::status");
+	Timeline const& notes = song->singingDuet() ? m_duetTimeline : m_timelines[track];
+	auto it = std::lower_bound(notes.begin(), notes.end(), time, [](NoteTimes const& a, double t) { return a.end < t; });
 	if (it == notes.end()) return Status::FINISHED;
 	if (it->begin > time + 4.0) return Status::INSTRUMENTAL_BREAK;
 	return Status::NORMAL;
@@ -2,6 +2,8 @@
 
 #include "fs.hh"
 #include "i18n.hh"
+#include "internedstring.hh"
+#include "memstats.hh"
 #include "notes.hh"
 #include "util.hh"
 
@@ -9,6 +11,8 @@
 #include <cpprest/json.h>
 #endif
 
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
 #include <string>
 
@@ -34,6 +38,7 @@ class ScreenSing;
 /// Song object contains all information about a song (headers, notes)
 class Song {
 	friend class SongParser;
+	friend class SongCache;
 public:
 	/// Is the song parsed from the file yet?
 	enum class LoadStatus { NONE, HEADER, FULL } loadStatus = LoadStatus::NONE;
@@ -55,26 +60,29 @@ public:
 	};
 	std::vector<BPM> m_bpms;
 	std::vector<std::string> category; ///< category of song
-	std::string genre; ///< genre
-	std::string edition; ///< license
+	// Metadata shared by many songs is interned, so that each song only holds a pointer
+	InternedString genre; ///< genre
+	InternedString edition; ///< license
 	std::string title; ///< songtitle
-	std::string artist; ///< artist
+	InternedString artist; ///< artist
 	std::string text; ///< songtext
-	std::string creator; ///< creator
-	std::string language; ///< language
+	InternedString creator; ///< creator
+	InternedString language; ///< language
 	using MusicFiles = std::map<std::string, fs::path>;
 	MusicFiles music; ///< music files (background, guitar, rhythm/bass, drums, vocals)
 	fs::path cover; ///< cd cover
 	fs::path background; ///< background image
 	fs::path video; ///< video
-	std::string collateByTitle;  ///< String for sorting by title, artist
-	std::string collateByTitleOnly;  ///< String for sorting by title only
-	std::string collateByArtist;  ///< String for sorting by artist, title
-	std::string collateByArtistOnly;  ///< String for sorting by artist only
+	std::string const& collateByTitle() const { return collate().byTitle; }  ///< String for sorting by title, artist
+	std::string const& collateByArtist() const { return collate().byArtist; }  ///< String for sorting by artist, title
+	std::string collateByTitleOnly() const { return collate().byTitle.substr(0, collate().titleLength); }  ///< For sorting by title only
+	std::string collateByArtistOnly() const { return collate().byArtist.substr(0, collate().artistLength); }  ///< For sorting by artist only
 	double videoGap = 0.0; ///< gap with video
 	double start = 0.0; ///< start of song
 	double preview_start = getNaN(); ///< starting time for the preview
 	double m_duration = 0.0;
+	std::uintmax_t fileSize = 0; ///< size of the song file when it was parsed (for detecting changes in the song cache)
+	std::int64_t fileTime = 0; ///< modification time of the song file when it was parsed
 	using Stops = std::vector<std::pair<double,double> >;
 	Stops stops; ///< related to dance
 	using Beats = std::vector<double>;
@@ -93,10 +101,12 @@ public:
 #ifdef USE_WEBSERVER
 	Song(web::json::value const& song);  ///< Load song from cache.
 #endif
-	Song(fs::path const& path, fs::path const& filename);  ///< Load song from specified path and filename
+	/// Load song from specified path and filename; folder is the listing of path if the caller has one (saves listing it again)
+	Song(fs::path const& path, fs::path const& filename, std::vector<fs::path> const* folder = nullptr);
 	void reload(bool errorIgnore = true);  ///< Reset and reload the entire song from file
-	void loadNotes(bool errorIgnore = true);  ///< Load note data (called when entering singing screen, headers preloaded).
-	void dropNotes();  ///< Remove note data (when exiting singing screen), to conserve RAM
+	void loadNotes(bool errorIgnore = true);  ///< Load note data (called when entering singing screen, headers preloaded; see Songs::refresh for changed files).
+	bool fileChanged() const;  ///< Has the song file been modified (or removed) since it was parsed?
+	void dropNotes();  ///< Remove note data (when exiting singing screen), to conserve RAM; recently dropped notes are cached for loadNotes
 	void insertVocalTrack(std::string vocalTrack, VocalTrack track);
 	void eraseVocalTrack(std::string vocalTrack = TrackName::LEAD_VOCAL);
 	std::string str() const;  ///< Return "title by artist" string for UI
@@ -108,17 +118,52 @@ public:
 	VocalTrack& getVocalTrack(size_t idx = 0);
 	std::vector<std::string> getVocalTrackNames() const;
 	double getDurationSeconds();
-	bool hasDance() const { return !danceTracks.empty(); }
-	bool hasDrums() const { return instrumentTracks.find(TrackName::DRUMS) != instrumentTracks.end(); }
-	bool hasKeyboard() const { return instrumentTracks.find(TrackName::KEYBOARD) != instrumentTracks.end(); }
-	bool hasGuitars() const { return instrumentTracks.size() - hasDrums() - hasKeyboard(); }
-	bool hasVocals() const { return !vocalTracks.empty(); }
-	bool hasDuet() const { return vocalTracks.size() > 1; }
-	bool hasControllers() const { return !danceTracks.empty() || !instrumentTracks.empty(); }
+	// Songs loaded from a cache only know their track types (m_cachedTracks) until the notes are loaded
+	unsigned vocalTrackCount() const { return m_cachedTracks.valid ? m_cachedTracks.vocals : vocalTracks.size(); }
+	/// Notes of a dance chart, parsed from the file on first use (throws if there is no such chart)
+	Notes const& danceNotes(std::string const& mode, DanceDifficulty level) const;
+	unsigned danceTrackCount() const { return m_cachedTracks.valid ? m_cachedTracks.dance : danceTracks.size(); }
+	unsigned guitarTrackCount() const { return m_cachedTracks.valid ? m_cachedTracks.guitars : instrumentTracks.size() - hasDrums() - hasKeyboard(); }
+	bool hasDance() const { return danceTrackCount() > 0; }
+	bool hasDrums() const { return m_cachedTracks.valid ? m_cachedTracks.drums : instrumentTracks.find(TrackName::DRUMS) != instrumentTracks.end(); }
+	bool hasKeyboard() const { return m_cachedTracks.valid ? m_cachedTracks.keyboard : instrumentTracks.find(TrackName::KEYBOARD) != instrumentTracks.end(); }
+	bool hasGuitars() const { return guitarTrackCount() > 0; }
+	bool hasVocals() const { return vocalTrackCount() > 0; }
+	bool hasDuet() const { return vocalTrackCount() > 1; }
+	bool hasControllers() const { return hasDance() || hasGuitars() || hasDrums() || hasKeyboard(); }
 	bool getNextSection(double pos, SongSection &section);
 	bool getPrevSection(double pos, SongSection &section);
 private:
-	void collateUpdate();   ///< Rebuild collate variables (used for sorting) from other strings
+	Song();  ///< Empty song, filled in by SongCache
+	void collateUpdate();   ///< Forget the collate strings (rebuilt on next use) after the strings they derive from changed
+	/// Collate strings, derived on first use (from any thread), as most songs are never sorted by them
+	struct Collate {
+		std::string byTitle, byArtist;
+		std::size_t titleLength = 0, artistLength = 0;  ///< Of the "only" prefixes
+	};
+	Collate const& collate() const;
+	mutable std::shared_ptr<Collate const> m_collate;  ///< Only accessed with the std::atomic_ functions
+	/// Record the track types of a song loaded from a cache, reported until the notes are loaded
+	void addCachedTracks(unsigned vocals, bool keyboard, bool drums, unsigned dance, unsigned guitars);
+	struct CachedTracks {
+		bool valid = false;
+		bool keyboard = false, drums = false;
+		std::uint8_t vocals = 0, dance = 0, guitars = 0;
+	} m_cachedTracks;
+	memstats::Usage m_notesMemory{ "song notes" };  ///< Set by loadNotes, released by dropNotes
+	bool m_parsed = false;  ///< Has loadNotes parsed the file (so that notes dropped since are all that is missing)?
+	/// Key of the notes in the cache of dropped notes (file and its stamp)
+	std::string noteKey() const;
+	std::size_t notesBytes() const;  ///< Memory used by the notes loaded
+	/// Times of a note, in the order of the notes (by begin) of a vocal track or of the duet
+	struct NoteTimes {
+		double begin, end;
+	};
+	using Timeline = std::vector<NoteTimes>;
+	/// Build the timelines queried by status from the vocal tracks (when the notes are loaded)
+	void updateTimelines();
+	std::vector<Timeline> m_timelines;  ///< By vocal track index
+	Timeline m_duetTimeline;  ///< The first two vocal tracks merged
 };
 
 /// Thrown by SongParser when there is an error
@@ -0,0 +1,80 @@
+#include "songbench.hh"
+
+#include "chrono.hh"
+#include "configuration.hh"
+#include "database.hh"
+#include "songs.hh"
+#include <boost/filesystem.hpp>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+namespace {
+	/// Peak resident set size in MiB (0 if not known)
+	double peakRSS() {
+#if defined(__unix__) || defined(__APPLE__)
+		rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+#ifdef __APPLE__
+		return usage.ru_maxrss / 1048576.0;  // Bytes
+#else
+		return usage.ru_maxrss / 1024.0;  // KiB
+#endif
+#else
+		return 0.0;
+#endif
+	}
+
+	/// Load the songs and print the statistics, returning the number of songs
+	std::size_t pass(char const* name, Database& database, fs::path const& cacheDir) {
+		const Time begin = Clock::now();
+		Songs songs(database, std::string(), cacheDir);
+		while (!songs.doneLoading) std::this_thread::sleep_for(10ms);
+		const double total = Seconds(Clock::now() - begin).count();
+		Songs::LoadStats stats = songs.loadStats();
+		unsigned files = 0, failed = 0;
+		for (auto const& f: stats.formats) { files += f.second.files; failed += f.second.failed; }
+		std::cout << name << " pass: " << songs.loadedSongs() << " songs in " << total << " s\n"
+		  << "  cache load " << stats.cacheLoad << " s (" << stats.cached << " songs), scan " << stats.scan
+		  << " s (" << files << " files parsed, " << failed << " failed, " << (stats.scan > 0.0 ? files / stats.scan : 0.0)
+		  << " files/s), cache save " << stats.cacheSave << " s\n";
+		for (auto const& f: stats.formats) {
+			std::cout << "  " << std::setw(6) << (f.first.empty() ? "(none)" : f.first) << ": " << f.second.files << " files, "
+			  << f.second.seconds << " s, " << 1000.0 * f.second.seconds / f.second.files << " ms per file\n";
+		}
+		std::cout << "  peak RSS " << peakRSS() << " MiB" << std::endl;
+		return songs.loadedSongs();
+	}
+}
+
+int benchSongs(fs::path const& dir) {
+	if (!fs::is_directory(dir)) { std::cerr << "ERROR: " << dir.string() << " is not a folder" << std::endl; return EXIT_FAILURE; }
+	// Only the given folder, and nothing that runs after loading
+	config["paths/songs"].sl() = { dir.string() };
+	config["paths/system-songs"].sl().clear();
+	config["songs/watch"].b() = false;
+	const fs::path tmp = fs::temp_directory_path() / fs::unique_path("performous-bench-%%%%-%%%%");
+	fs::create_directories(tmp);
+	std::cout << std::fixed << std::setprecision(3) << "Benchmarking song loading from " << dir.string() << std::endl;
+	int ret = EXIT_SUCCESS;
+	try {
+		Database database(tmp / "database.xml");
+		const std::size_t cold = pass("Cold", database, tmp);
+		const std::size_t warm = pass("Cached", database, tmp);
+		if (warm != cold) {
+			std::cout << "WARNING: The cached pass found " << warm << " songs instead of " << cold << std::endl;
+			ret = EXIT_FAILURE;
+		}
+	} catch (std::exception& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		ret = EXIT_FAILURE;
+	}
+	boost::system::error_code ec;
+	fs::remove_all(tmp, ec);
+	return ret;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "fs.hh"
+
+/**
+* Song library load benchmark (performous --bench-songs <dir>): scans dir twice without opening a window,
+* first with an empty song cache (every file gets parsed) and then from the cache written by the first pass,
+* and prints the timings of each phase, parse time by song format and peak memory use. Returns the exit status.
+* The user's song cache and database are not touched.
+**/
+int benchSongs(fs::path const& dir);
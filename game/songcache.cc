@@ -0,0 +1,227 @@
+#include "songcache.hh"
+
+#include "song.hh"
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+	const char MAGIC[8] = { 'P', 'E', 'R', 'F', 'S', 'O', 'N', 'G' };
+	const std::uint32_t VERSION = 1;
+	const std::uint32_t ENDIAN_MARK = 0x01020304;
+
+	struct Header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t byteOrder;  ///< ENDIAN_MARK as written by the creator of the file
+		std::uint32_t songCount;
+		std::uint32_t dirCount;
+		std::uint32_t subdirCount;
+		std::uint32_t stringCount;
+		std::uint64_t stringBytes;
+	};
+
+	/// String fields of SongRecord
+	enum StringField { PATH, FILENAME, TITLE, ARTIST, EDITION, LANGUAGE, CREATOR, GENRE, COVER, BACKGROUND, MUSIC, VOCALS, VIDEO, STRING_FIELDS };
+	const std::uint32_t KEYBOARD = 1, DRUMS = 2;
+
+	struct SongRecord {
+		std::uint32_t strings[14];  ///< Indexed by StringField (padded for alignment)
+		std::uint32_t vocalTracks, danceTracks, guitarTracks, flags;
+		double start, videoGap, previewStart, duration, bpm;  ///< NaN if unknown
+		std::uint64_t fileSize;
+		std::int64_t fileTime;
+	};
+
+	struct DirRecord {
+		std::uint32_t path;
+		std::uint32_t firstSubdir;  ///< Index to the subfolder name list
+		std::uint32_t subdirCount;
+		std::uint32_t reserved;
+		std::int64_t time;
+	};
+
+	static_assert(sizeof(Header) == 40 && sizeof(SongRecord) == 128 && sizeof(DirRecord) == 24, "Song cache records must have a fixed layout");
+	static_assert(STRING_FIELDS <= 14, "Too many song cache string fields");
+
+	std::uint64_t align8(std::uint64_t n) { return (n + 7) & ~std::uint64_t(7); }
+
+	/// Byte offsets of the file sections (following each other in this order)
+	struct Layout {
+		std::uint64_t songs, dirs, subdirs, offsets, strings, end;
+		Layout(Header const& h):
+		  songs(sizeof(Header)),
+		  dirs(songs + std::uint64_t(h.songCount) * sizeof(SongRecord)),
+		  subdirs(dirs + std::uint64_t(h.dirCount) * sizeof(DirRecord)),
+		  offsets(align8(subdirs + std::uint64_t(h.subdirCount) * sizeof(std::uint32_t))),
+		  strings(offsets + (std::uint64_t(h.stringCount) + 1) * sizeof(std::uint64_t)),
+		  end(strings + h.stringBytes)
+		{}
+	};
+
+	/// Collects distinct strings for writing
+	class StringTable {
+	  public:
+		StringTable() { (*this)(std::string()); }  // Index 0 is the empty string
+		std::uint32_t operator()(std::string const& str) {
+			auto it = m_index.emplace(str, m_strings.size());
+			if (it.second) m_strings.push_back(&it.first->first);
+			return it.first->second;
+		}
+		std::uint32_t operator()(fs::path const& path) { return (*this)(path.string()); }
+		std::vector<std::string const*> const& strings() const { return m_strings; }
+	  private:
+		std::unordered_map<std::string, std::uint32_t> m_index;
+		std::vector<std::string const*> m_strings;  ///< Pointing to keys of m_index, in index order
+	};
+
+	void write(std::ostream& os, void const* data, std::size_t bytes) { os.write(static_cast<char const*>(data), bytes); }
+	void pad(std::ostream& os, std::uint64_t pos) { static const char zeros[8] = {}; os.write(zeros, align8(pos) - pos); }
+}
+
+void SongCache::load(fs::path const& file, SongVector& songs, Dirs& dirs, Validator const& validate) {
+	boost::iostreams::mapped_file_source map;
+	try {
+		map.open(file.string());
+	} catch (std::exception& e) {
+		throw std::runtime_error("Cannot open " + file.string() + ": " + e.what());
+	}
+	char const* data = map.data();
+	Header h;
+	if (map.size() < sizeof(h)) throw std::runtime_error("Truncated song cache");
+	std::memcpy(&h, data, sizeof(h));
+	if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0) throw std::runtime_error("Not a song cache file");
+	if (h.version != VERSION || h.byteOrder != ENDIAN_MARK) throw std::runtime_error("Song cache of another version or architecture");
+	Layout layout(h);
+	if (layout.end != map.size()) throw std::runtime_error("Song cache size mismatch");
+	auto subdirIndex = reinterpret_cast<std::uint32_t const*>(data + layout.subdirs);
+	auto offsets = reinterpret_cast<std::uint64_t const*>(data + layout.offsets);
+	for (std::uint32_t i = 0; i < h.stringCount; ++i) {
+		if (offsets[i] > offsets[i + 1]) throw std::runtime_error("Corrupted song cache string table");
+	}
+	if (offsets[0] != 0 || offsets[h.stringCount] != h.stringBytes) throw std::runtime_error("Corrupted song cache string table");
+	auto str = [&](std::uint32_t idx) {
+		if (idx >= h.stringCount) throw std::runtime_error("Corrupted song cache string index");
+		return std::string(data + layout.strings + offsets[idx], offsets[idx + 1] - offsets[idx]);
+	};
+
+	auto dirRecords = reinterpret_cast<DirRecord const*>(data + layout.dirs);
+	for (std::uint32_t i = 0; i < h.dirCount; ++i) {
+		DirRecord const& r = dirRecords[i];
+		if (std::uint64_t(r.firstSubdir) + r.subdirCount > h.subdirCount) throw std::runtime_error("Corrupted song cache folder");
+		Dir& dir = dirs[str(r.path)];
+		dir.time = r.time;
+		dir.subdirs.clear();
+		for (std::uint32_t j = 0; j < r.subdirCount; ++j) dir.subdirs.push_back(str(subdirIndex[r.firstSubdir + j]));
+	}
+
+	auto songRecords = reinterpret_cast<SongRecord const*>(data + layout.songs);
+	for (std::uint32_t i = 0; i < h.songCount; ++i) {
+		SongRecord const& r = songRecords[i];
+		std::string filename = str(r.strings[FILENAME]);
+		if (!validate(filename, r.fileSize, r.fileTime)) continue;
+		std::shared_ptr<Song> s(new Song());
+		s->path = str(r.strings[PATH]);
+		s->filename = filename;
+		s->title = str(r.strings[TITLE]);
+		s->artist = str(r.strings[ARTIST]);
+		s->edition = str(r.strings[EDITION]);
+		s->language = str(r.strings[LANGUAGE]);
+		s->creator = str(r.strings[CREATOR]);
+		s->genre = str(r.strings[GENRE]);
+		s->cover = str(r.strings[COVER]);
+		s->background = str(r.strings[BACKGROUND]);
+		s->music["background"] = str(r.strings[MUSIC]);
+		s->music["vocals"] = str(r.strings[VOCALS]);
+		s->video = str(r.strings[VIDEO]);
+		s->start = r.start;
+		s->videoGap = r.videoGap;
+		s->preview_start = r.previewStart;
+		s->m_duration = std::isnan(r.duration) ? 0.0 : r.duration;
+		s->fileSize = r.fileSize;
+		s->fileTime = r.fileTime;
+		s->loadStatus = Song::LoadStatus::HEADER;
+		s->addCachedTracks(r.vocalTracks, r.flags & KEYBOARD, r.flags & DRUMS, r.danceTracks, r.guitarTracks);
+		if (!std::isnan(r.bpm)) s->m_bpms.push_back(Song::BPM(0, 0, r.bpm));
+		s->collateUpdate();
+		songs.push_back(s);
+	}
+}
+
+void SongCache::save(fs::path const& file, SongVector const& songs, Dirs const& dirs) {
+	StringTable strings;
+	std::vector<SongRecord> songRecords;
+	songRecords.reserve(songs.size());
+	for (auto const& song: songs) {
+		SongRecord r{};
+		r.strings[PATH] = strings(song->path);
+		r.strings[FILENAME] = strings(song->filename);
+		r.strings[TITLE] = strings(song->title);
+		r.strings[ARTIST] = strings(song->artist.str());
+		r.strings[EDITION] = strings(song->edition.str());
+		r.strings[LANGUAGE] = strings(song->language.str());
+		r.strings[CREATOR] = strings(song->creator.str());
+		r.strings[GENRE] = strings(song->genre.str());
+		r.strings[COVER] = strings(song->cover);
+		r.strings[BACKGROUND] = strings(song->background);
+		r.strings[MUSIC] = strings(song->music["background"]);
+		r.strings[VOCALS] = strings(song->music["vocals"]);
+		r.strings[VIDEO] = strings(song->video);
+		r.vocalTracks = song->vocalTrackCount();
+		r.danceTracks = song->danceTrackCount();
+		r.guitarTracks = song->guitarTrackCount();
+		r.flags = (song->hasKeyboard() ? KEYBOARD : 0) | (song->hasDrums() ? DRUMS : 0);
+		r.start = song->start;
+		r.videoGap = song->videoGap;
+		r.previewStart = song->preview_start;
+		r.duration = song->getDurationSeconds();
+		r.bpm = song->m_bpms.empty() ? getNaN() : 15 / song->m_bpms.front().step;
+		r.fileSize = song->fileSize;
+		r.fileTime = song->fileTime;
+		songRecords.push_back(r);
+	}
+	std::vector<DirRecord> dirRecords;
+	std::vector<std::uint32_t> subdirIndex;
+	for (auto const& dir: dirs) {
+		DirRecord r{};
+		r.path = strings(dir.first);
+		r.firstSubdir = subdirIndex.size();
+		r.subdirCount = dir.second.subdirs.size();
+		r.time = dir.second.time;
+		for (auto const& sub: dir.second.subdirs) subdirIndex.push_back(strings(sub));
+		dirRecords.push_back(r);
+	}
+	std::vector<std::uint64_t> offsets{ 0 };
+	for (auto str: strings.strings()) offsets.push_back(offsets.back() + str->size());
+
+	Header h{};
+	std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = VERSION;
+	h.byteOrder = ENDIAN_MARK;
+	h.songCount = songRecords.size();
+	h.dirCount = dirRecords.size();
+	h.subdirCount = subdirIndex.size();
+	h.stringCount = strings.strings().size();
+	h.stringBytes = offsets.back();
+	Layout layout(h);
+
+	// Write to a temporary name first so that a crash never leaves a partial cache behind
+	fs::path part = file;
+	part += ".part";
+	{
+		std::ofstream f(part.string(), std::ios::binary);
+		write(f, &h, sizeof(h));
+		write(f, songRecords.data(), songRecords.size() * sizeof(SongRecord));
+		write(f, dirRecords.data(), dirRecords.size() * sizeof(DirRecord));
+		write(f, subdirIndex.data(), subdirIndex.size() * sizeof(std::uint32_t));
+		pad(f, layout.subdirs + subdirIndex.size() * sizeof(std::uint32_t));
+		write(f, offsets.data(), offsets.size() * sizeof(std::uint64_t));
+		for (auto str: strings.strings()) write(f, str->data(), str->size());
+		if (!f) throw std::runtime_error("Cannot write " + part.string());
+	}
+	fs::rename(part, file);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "fs.hh"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Song;
+
+/**
+* Binary song metadata cache.
+* The file consists of a header, fixed size song and folder records, subfolder lists and a string table.
+* Every distinct string is stored once and referenced by index, and all sections are aligned, so the
+* records are read straight from a read-only memory mapping. The data is in native byte order; files
+* written by another version or on another architecture are rejected (and then simply rebuilt).
+**/
+class SongCache {
+  public:
+	/// Modification time and subfolders of a scanned folder
+	struct Dir {
+		std::int64_t time;
+		std::vector<std::string> subdirs;
+	};
+	typedef std::unordered_map<std::string, Dir> Dirs;
+	typedef std::vector<std::shared_ptr<Song>> SongVector;
+	/// Decides whether a cached song file is still valid (given its size and modification time when cached)
+	typedef std::function<bool (std::string const& filename, std::uintmax_t size, std::int64_t time)> Validator;
+	/**
+	* Read a cache file, appending the songs accepted by validate to songs and the folders to dirs.
+	* All folders are added before songs get validated, so validate may modify dirs.
+	* Throws std::runtime_error if the file cannot be read or is not a valid cache of this version.
+	**/
+	static void load(fs::path const& file, SongVector& songs, Dirs& dirs, Validator const& validate);
+	/// Write a cache file (atomically replacing any old one). Throws std::runtime_error on failure.
+	static void save(fs::path const& file, SongVector const& songs, Dirs const& dirs);
+};
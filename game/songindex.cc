@@ -0,0 +1,60 @@
+#include "songindex.hh"
+
+#include "song.hh"
+#include "unicode.hh"
+
+#include <algorithm>
+#include <iterator>
+
+std::vector<std::uint32_t> SongIndex::trigrams(std::string const& str) {
+	std::vector<std::uint32_t> ret;
+	for (std::size_t i = 0; i + 3 <= str.size(); ++i) {
+		ret.push_back(std::uint32_t(std::uint8_t(str[i])) << 16 | std::uint32_t(std::uint8_t(str[i + 1])) << 8 | std::uint8_t(str[i + 2]));
+	}
+	std::sort(ret.begin(), ret.end());
+	ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+	return ret;
+}
+
+void SongIndex::add(std::uint32_t pos, Song const& song) {
+	const std::string full = song.strFull();
+	m_texts.push_back(Texts{ UnicodeUtil::foldForSearch(full), icu::UnicodeString::fromUTF8(full) });
+	for (std::uint32_t t: trigrams(m_texts.back().folded)) m_postings[t].push_back(pos);
+}
+
+void SongIndex::sync(SongVector const& songs) {
+	std::size_t same = 0;
+	while (same < m_songs.size() && same < songs.size() && m_songs[same] == songs[same]) ++same;
+	if (same < m_songs.size()) {
+		m_postings.clear();
+		m_songs.clear();
+		m_texts.clear();
+		same = 0;
+	}
+	for (std::size_t i = same; i < songs.size(); ++i) add(i, *songs[i]);
+	m_songs.insert(m_songs.end(), songs.begin() + same, songs.end());
+}
+
+std::vector<std::uint32_t> SongIndex::candidates(std::string const& folded) const {
+	std::vector<std::uint32_t> ret;
+	std::vector<std::vector<std::uint32_t> const*> lists;
+	for (std::uint32_t t: trigrams(folded)) {
+		auto it = m_postings.find(t);
+		if (it == m_postings.end()) return ret;  // No song has this trigram
+		lists.push_back(&it->second);
+	}
+	if (lists.empty()) {
+		for (std::uint32_t i = 0; i < m_songs.size(); ++i) ret.push_back(i);
+		return ret;
+	}
+	// Intersect starting from the rarest trigram
+	std::sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->size() < b->size(); });
+	ret = *lists.front();
+	std::vector<std::uint32_t> tmp;
+	for (std::size_t i = 1; i < lists.size() && !ret.empty(); ++i) {
+		tmp.clear();
+		std::set_intersection(ret.begin(), ret.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(tmp));
+		ret.swap(tmp);
+	}
+	return ret;
+}
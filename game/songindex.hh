@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unicode/unistr.h>
+#include <unordered_map>
+#include <vector>
+
+class Song;
+
+/**
+* Trigram index over the search text of songs (Song::strFull() case and accent folded) for quickly finding
+* the songs that may match a search. Songs are identified by their position in the song list that the index
+* was synced with. The texts are only derived when a song is indexed (on the first search) and are kept for
+* verifying the candidates without allocating.
+**/
+class SongIndex {
+  public:
+	typedef std::vector<std::shared_ptr<Song>> SongVector;
+	/// Update the index to match songs (songs appended since the last sync are added, other changes rebuild)
+	void sync(SongVector const& songs);
+	/**
+	* Positions (ascending) of the songs whose search text contains all trigrams of the folded query.
+	* Candidates still need to be verified. Queries shorter than a trigram match every song.
+	**/
+	std::vector<std::uint32_t> candidates(std::string const& folded) const;
+	/// Search text of the song at pos, for substring matching
+	std::string const& folded(std::uint32_t pos) const { return m_texts[pos].folded; }
+	/// Song::strFull() of the song at pos, for collator matching
+	icu::UnicodeString const& text(std::uint32_t pos) const { return m_texts[pos].full; }
+  private:
+	struct Texts {
+		std::string folded;
+		icu::UnicodeString full;
+	};
+	void add(std::uint32_t pos, Song const& song);
+	static std::vector<std::uint32_t> trigrams(std::string const& str);
+	std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> m_postings;  ///< Song positions by trigram
+	SongVector m_songs;  ///< Indexed songs (kept alive so that removed songs are never mistaken for new ones)
+	std::vector<Texts> m_texts;  ///< By position
+};
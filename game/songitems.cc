@@ -2,33 +2,19 @@
 
 #include "unicode.hh"
 #include "libxml++-impl.hh"
+#include <algorithm>
 #include <memory>
 #include <string>
 
 
-void SongItems::load(xmlpp::NodeSet const& n) {
-	for (auto const& elem: n) {
-		xmlpp::Element& element = dynamic_cast<xmlpp::Element&>(*elem);
-
-		xmlpp::Attribute* a_id = element.get_attribute("id");
-		if (!a_id) throw SongItemsException("No attribute id");
-
-		xmlpp::Attribute* a_artist = element.get_attribute("artist");
-		if (!a_artist) throw SongItemsException("No attribute artist");
-
-		xmlpp::Attribute* a_title = element.get_attribute("title");
-		if (!a_title) throw SongItemsException("No attribute title");
-
-		addSongItem(a_artist->get_value(), a_title->get_value(), std::stoi(a_id->get_value()));
-	}
-}
-
-void SongItems::save(xmlpp::Element* songs) {
+void SongItems::save(xmlpp::Element* songs) const {
 	for (auto const& song: m_songs) {
 		xmlpp::Element* element = xmlpp::add_child_element(songs, "song");
 		element->set_attribute("id", std::to_string(song.id));
-		element->set_attribute("artist", song.artist);
+		element->set_attribute("artist", song.artist.str());
 		element->set_attribute("title", song.title);
+		if (song.summary.plays) element->set_attribute("plays", std::to_string(song.summary.plays));
+		if (song.summary.lastPlayed) element->set_attribute("lastPlayed", std::to_string(song.summary.lastPlayed));
 	}
 }
 
@@ -46,6 +32,8 @@ int SongItems::addSongItem(std::string const& artist, std::string const& title,
 		si.id = assign_id_internal();
 		m_songs.insert(si); // now do the insert with the fresh id
 	}
+	auto byName = m_ids.emplace(key(si.artist, si.title), si.id);
+	if (!byName.second && si.id < byName.first->second) byName.first->second = si.id;
 	return si.id;
 }
 
@@ -66,23 +54,44 @@ void SongItems::addSong(std::shared_ptr<Song> song) {
 	si.artist = it->artist;
 	si.title = it->title;
 	si.song = song;
+	si.summary = it->summary;
 
 	m_songs.erase(it);
 	m_songs.insert(si);
 }
 
 int SongItems::lookup(std::shared_ptr<Song> song) const {
-	for (auto const& s: m_songs) {
-		if (song->collateByArtistOnly == s.artist && song->collateByTitleOnly == s.title) return s.id;
-	}
-	return -1;
+	return lookup(*song);
 }
 
-int SongItems::lookup(Song& song) const {
-	for (auto const& s: m_songs) {
-		if (song.collateByArtistOnly == s.artist && song.collateByTitleOnly == s.title) return s.id;
-	}
-	return -1;
+int SongItems::lookup(Song const& song) const {
+	auto it = m_ids.find(key(song.collateByArtistOnly(), song.collateByTitleOnly()));
+	return it == m_ids.end() ? -1 : it->second;
+}
+
+SongSummary SongItems::summary(Song const& song) const {
+	SongItem si;
+	si.id = lookup(song);
+	auto it = m_songs.find(si);
+	return it == m_songs.end() ? SongSummary() : it->summary;
+}
+
+void SongItems::played(int id, std::time_t when, unsigned count) {
+	SongItem si;
+	si.id = id;
+	auto it = m_songs.find(si);
+	if (it == m_songs.end()) return;
+	it->summary.plays += count;
+	it->summary.lastPlayed = std::max(it->summary.lastPlayed, when);
+}
+
+void SongItems::scored(int id, unsigned score, int playerid) {
+	SongItem si;
+	si.id = id;
+	auto it = m_songs.find(si);
+	if (it == m_songs.end() || score <= it->summary.topScore) return;
+	it->summary.topScore = score;
+	it->summary.topPlayer = playerid;
 }
 
 std::string SongItems::lookup(int id) const {
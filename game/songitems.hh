@@ -4,8 +4,10 @@
 
 #include "libxml++.hh"
 
+#include <ctime>
 #include <memory>
 #include <set>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <stdexcept>
@@ -18,6 +20,15 @@ struct SongItemsException: public std::runtime_error {
 	{}
 };
 
+/// Plays and the best hiscore of a song
+struct SongSummary
+{
+	unsigned plays = 0;
+	std::time_t lastPlayed = 0;  ///< 0 if never
+	unsigned topScore = 0;  ///< 0 if no hiscores
+	int topPlayer = -1;  ///< Player id of topScore
+};
+
 struct SongItem
 {
 	int id; ///< The unique id for every song
@@ -36,6 +47,9 @@ struct SongItem
 	 */
 	std::shared_ptr<Song> song;
 
+	/// Not part of the ordering, so it can be updated in place
+	mutable SongSummary summary;
+
 	bool operator< (SongItem const& other) const
 	{
 		return id < other.id;
@@ -56,8 +70,7 @@ struct SongItem
   easily. */
 class SongItems {
 public:
-	void load(xmlpp::NodeSet const& n);
-	void save(xmlpp::Element *players);
+	void save(xmlpp::Element *players) const;
 
 	/**Adds a song item.
 	  If the id is not unique or -1 a new one will be assigned.
@@ -81,7 +94,14 @@ public:
 	/**Lookup a songid for a specific song.
 	  @return -1 if no song found.*/
 	int lookup(std::shared_ptr<Song> song) const;
-	int lookup(Song& song) const;
+	int lookup(Song const& song) const;
+
+	/// Summary of the song item (an empty one for unknown songs)
+	SongSummary summary(Song const& song) const;
+	/// Count plays of the song item, the latest at time when
+	void played(int id, std::time_t when, unsigned count = 1);
+	/// Account a new hiscore of the song item
+	void scored(int id, unsigned score, int playerid);
 
 	/**Lookup the artist + title for a specific song.
 	  @return "Unknown Song" if nothing is found.
@@ -92,7 +112,10 @@ public:
 
 private:
 	int assign_id_internal() const;
+	/// Key of m_ids for collated artist and title
+	static std::string key(std::string const& artist, std::string const& title) { return artist + '\0' + title; }
 
 	typedef std::set<SongItem> songs_t;
 	songs_t m_songs;
+	std::unordered_map<std::string, int> m_ids;  ///< Lowest id of each artist and title in m_songs
 };
@@ -11,9 +11,8 @@
 using namespace SongParserUtil;
 
 /// 'Magick' to check if this file looks like correct format
-bool SongParser::iniCheck(std::string const& data) const {
-	static const std::string header = "[song]";
-	return std::equal(header.begin(), header.end(), data.begin());
+bool SongParser::iniCheck(boost::string_ref data) const {
+	return data.starts_with("[song]");
 }
 
 /// Parse header data for Songs screen
@@ -25,11 +24,10 @@ void SongParser::iniParseHeader() {
 	while (getline(line)) {
 		if (line.empty()) continue;
 		if (line[0] == '[') continue; // Section header
-		std::istringstream iss(line);
-		std::string key, value;
-		if (!std::getline(iss, key, '=') || !std::getline(iss, value)) std::runtime_error("Invalid format, should be key=value");
-		boost::trim(key); key = UnicodeUtil::toLower(key);
-		boost::trim(value);
+		std::string::size_type pos = line.find('=');
+		if (pos == std::string::npos) continue;  // Not key=value
+		std::string key = UnicodeUtil::toLower(boost::trim_copy(line.substr(0, pos)));
+		std::string value = boost::trim_copy(line.substr(pos + 1));
 		// Supported tags
 		if (key == "name") s.title = value;
 		else if (key == "artist") s.artist = value;
@@ -2,6 +2,7 @@
 
 #include <boost/algorithm/string.hpp>
 #include <stdexcept>
+#include "log.hh"
 #include "midifile.hh"
 
 /// @file
@@ -75,7 +76,7 @@ void SongParser::midParseHeader() {
 		}
 	}
 	addBPM(0, (6e7 / midi.tempochanges.front().value));
-	std::clog << "songparser-mid/debug: Got a bpm: " << (6e7 / midi.tempochanges.front().value) << std::endl;
+	LOG("songparser-mid", debug) << "Got a bpm: " << (6e7 / midi.tempochanges.front().value) << std::endl;
 }
 
 /// Parse notes
@@ -83,7 +84,7 @@ void SongParser::midParse() {
 	Song& s = m_song;
 	s.instrumentTracks.clear();
 
-	MidiFileParser midi(s.midifilename);
+	MidiFileParser midi(s.midifilename, true);  // Tracks are parsed concurrently
 	int reversedNoteCount = 0;
 	for (uint32_t ts = 0, end = midi.ts_last + midi.division; ts < end; ts += midi.division) s.beats.push_back(midi.get_seconds(ts)+s.start);
 	for (MidiFileParser::Tracks::const_iterator it = midi.tracks.begin(); it != midi.tracks.end(); ++it) {
@@ -12,7 +12,7 @@
 using namespace SongParserUtil;
 
 /// 'Magick' to check if this file looks like correct format
-bool SongParser::smCheck(std::string const& data) const {
+bool SongParser::smCheck(boost::string_ref data) const {
 	if (data[0] != '#' || data[1] < 'A' || data[1] > 'Z') return false;
 	for (char ch: data) {
 		if (ch == '\n') return false;
@@ -24,14 +24,14 @@ bool SongParser::smCheck(std::string const& data) const {
 /* Parsing the note data is separated into three different functions: smParse, smParseField and smParseNote.
 - smParse only begins a loop which continues as long as there is something to read in the file. It also checks if the needed information
 could be read.
-- smParseField reads all data beginning with '#'. That is, all but the actual notes. This function calls smParseNotes every time it
-reaches value #NOTES.
-- smParseNotes reads the notes into vector called notes which is a vector of structs (Note);
+- smParseField reads all data beginning with '#'. That is, all but the actual notes. This function calls smSkipNotes every time it
+reaches value #NOTES, recording where the notes are.
+- smParseNotes reads the notes into vector called notes which is a vector of structs (Note), once a chart is played;
 */
 
 /// Parse header data for Songs screen
-// TODO: This actually parses the whole thing
-// TODO: Songparser drops parsed notes, remove it when smParseHeader is more intelligent
+/// The note data of each chart is only skipped over (also when parsing fully), noting where it is, so that only
+/// the chart that is played needs to be parsed (see Song::danceNotes); packs typically have many charts per song.
 void SongParser::smParseHeader() {
 	Song& s = m_song;
 	std::string line;
@@ -95,7 +95,10 @@ bool SongParser::smParseField(std::string line) {
 			if(!getline(line)) { throw std::runtime_error("Required note data missing"); }
 
 			//<NoteData>:
-			Notes notes = smParseNotes(line);
+			Notes notes;
+			std::size_t offset = m_pos;
+			unsigned linenum = m_linenum;
+			smSkipNotes();
 
 			//Here all note data from the current track is inserted into containers
 			// TODO: support other track types. For now all others are simply ignored.
@@ -103,6 +106,9 @@ bool SongParser::smParseField(std::string line) {
 			  || notestype == "pump-single" || notestype == "ez2-single" || notestype == "ez2-real"
 			  || notestype == "para-single") {
 				DanceTrack danceTrack(description, notes);
+				danceTrack.offset = offset;
+				danceTrack.linenum = linenum;
+				danceTrack.loaded = false;
 				if (m_song.danceTracks.find(notestype) == m_song.danceTracks.end() ) {
 					DanceDifficultyMap danceDifficultyMap;
 					m_song.danceTracks.insert(std::make_pair(notestype, danceDifficultyMap));
@@ -125,22 +131,22 @@ bool SongParser::smParseField(std::string line) {
 	// Parse header data that is stored in SongParser rather than in song (and thus needs to be read every time)
 	if (key == "OFFSET") { assign(m_gap, value); m_gap *= -1; }
 	else if (key == "BPMS"){
-			std::istringstream iss(value);
+			boost::string_ref list = value;
 			double ts, bpm;
 			char chr;
-			while (iss >> ts >> chr >> bpm) {
+			while (parse(list, ts) && parseChar(list, chr) && parse(list, bpm)) {
 				if (ts == 0.0) m_bpm = bpm;
 				addBPM(ts * 4.0, bpm);
-				if (!(iss >> chr)) break;
+				if (!parseChar(list, chr)) break;
 			}
 	}
 	else if (key == "STOPS"){
-			std::istringstream iss(value);
+			boost::string_ref list = value;
 			double beat, sec;
 			char chr;
-			while (iss >> beat >> chr >> sec) {
+			while (parse(list, beat) && parseChar(list, chr) && parse(list, sec)) {
 				m_stops.push_back(std::make_pair(beat * 4.0, sec));
-				if (!(iss >> chr)) break;
+				if (!parseChar(list, chr)) break;
 			}
 	}
 
@@ -255,6 +261,20 @@ Notes SongParser::smParseNotes(std::string line) {
 	return notes;
 }
 
+/// Read past note data without parsing it (up to and including the next #NOTES line), counting the measures like smParseNotes
+void SongParser::smSkipNotes() {
+	std::string line;
+	unsigned measure = 1;
+	while (getline(line)) {
+		boost::trim(line);
+		if (line.empty() || line.substr(0, 2) == "//") continue;
+		if (line[0] == '#') break;
+		char first = line[0], last = line[line.size() - 1];
+		if (first == ',' || first == ';' || last == ',' || last == ';') ++measure;
+	}
+	m_tsEnd = std::max(m_tsEnd, measure * 16);
+}
+
 /// Convert a stop into <time, duration> (as stored in the song)
 std::pair<double, double> SongParser::smStopConvert(std::pair<double, double> s) {
 	s.first = tsTime(s.first);
@@ -11,10 +11,20 @@
 using namespace SongParserUtil;
 
 /// 'Magick' to check if this file looks like correct format
-bool SongParser::txtCheck(std::string const& data) const {
+bool SongParser::txtCheck(boost::string_ref data) const {
 	return data[0] == '#' && data[1] >= 'A' && data[1] <= 'Z';
 }
 
+/// The beginning of data up to the first note line (all that txtParseHeader reads)
+boost::string_ref SongParser::txtHeader(boost::string_ref data) const {
+	for (std::size_t pos = 0; pos < data.size(); ) {
+		if (data[pos] != '#' && data[pos] != '\n') return data.substr(0, pos);
+		auto end = std::find(data.begin() + pos, data.end(), '\n');
+		pos = end - data.begin() + 1;
+	}
+	return data;
+}
+
 /// Parse header data for Songs screen
 void SongParser::txtParseHeader() {
 	Song& s = m_song;
@@ -131,37 +141,39 @@ bool SongParser::txtParseField(std::string const& line) {
 	return true;
 }
 
-bool SongParser::txtParseNote(std::string line) {
+bool SongParser::txtParseNote(std::string const& text) {
+	// Tokenized in place, without streams (this is called for every line of notes)
+	boost::string_ref line = text;
 	if (line.empty() || line == "\r") return true;
 	if (line[0] == '#') throw std::runtime_error("Key found in the middle of notes");
-	if (line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+	if (line.back() == '\r') line.remove_suffix(1);
 	if (line[0] == 'E') return false;
-	std::istringstream iss(line);
 	if (line[0] == 'B') {
 		unsigned int ts;
 		double bpm;
-		iss.ignore();
-		if (!(iss >> ts >> bpm)) throw std::runtime_error("Invalid BPM line format");
+		boost::string_ref args = line.substr(1);
+		if (!parse(args, ts) || !parse(args, bpm)) throw std::runtime_error("Invalid BPM line format");
 		addBPM(ts, bpm);
 		return true;
 	}
 	if (line[0] == 'P') {
 		if (m_relative) // FIXME?
 			throw std::runtime_error("Relative note timing not supported with multiple singers");
-		if (line.size() < 2) throw std::runtime_error("Invalid player info line [too short]: " + line);
+		if (line.size() < 2) throw std::runtime_error("Invalid player info line [too short]: " + line.to_string());
 		else if (line[1] == '1') m_curSinger = CurrentSinger::P1;
 		else if (line[1] == '2') m_curSinger = CurrentSinger::P2;
 		else if (line[1] == '3') m_curSinger = CurrentSinger::BOTH;
-		else if (line.size() < 3) throw std::runtime_error("Invalid player info line [too short]: " + line);
+		else if (line.size() < 3) throw std::runtime_error("Invalid player info line [too short]: " + line.to_string());
 		else if (line[2] == '1') m_curSinger = CurrentSinger::P1;
 		else if (line[2] == '2') m_curSinger = CurrentSinger::P2;
 		else if (line[2] == '3') m_curSinger = CurrentSinger::BOTH;
-		else throw std::runtime_error("Invalid player info line [malformed]: " + line);
+		else throw std::runtime_error("Invalid player info line [malformed]: " + line.to_string());
 		txtResetState();
 		return true;
 	}
 	Note n;
-	n.type = Note::Type(iss.get());
+	n.type = Note::Type(line[0]);
+	boost::string_ref args = line.substr(1);
 	unsigned int ts = m_txt.prevts;
 	switch (n.type) {
 		case Note::NORMAL:
@@ -171,18 +183,18 @@ bool SongParser::txtParseNote(std::string line) {
 		case Note::GOLDEN2:
 		{
 			unsigned int length = 0;
-			if (!(iss >> ts >> length >> n.note)) throw std::runtime_error("Invalid note line format");
+			if (!parse(args, ts) || !parse(args, length) || !parse(args, n.note)) throw std::runtime_error("Invalid note line format");
 			if (length < 1) std::clog << "songparser/info: Notes must have positive durations." << std::endl;
 			n.notePrev = n.note; // No slide notes in TXT yet.
 			if (m_relative) ts += m_txt.relativeShift;
-			if (iss.get() == ' ') std::getline(iss, n.syllable);
+			if (!args.empty() && args.front() == ' ') n.syllable.assign(args.begin() + 1, args.end());
 			n.end = tsTime(ts + length);
 		}
 			break;
 		case Note::SLEEP:
 		{
 			unsigned int end;
-			if (!(iss >> ts >> end)) end = ts;
+			if (!parse(args, ts) || !parse(args, end)) end = ts;
 			if (m_relative) {
 				ts += m_txt.relativeShift;
 				end += m_txt.relativeShift;
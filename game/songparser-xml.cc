@@ -11,9 +11,8 @@
 using namespace SongParserUtil;
 
 /// 'Magick' to check if this file looks like correct format
-bool SongParser::xmlCheck(std::string const& data) const {
-	static const std::string header = "<?";
-	return std::equal(header.begin(), header.end(), data.begin());
+bool SongParser::xmlCheck(boost::string_ref data) const {
+	return data.starts_with("<?");
 }
 
 
@@ -26,10 +25,10 @@ void disableXMLLogger() { xmlSetGenericErrorFunc(NULL, xmlLogger); }
 
 struct SSDom: public xmlpp::DomParser {
 	xmlpp::Node::PrefixNsMap nsmap;
-	SSDom(std::stringstream const& _ss) {
-		load(_ss.str());
+	SSDom(boost::string_ref buf) {
+		load(buf);
 	}
-	void load(std::string const& buf) {
+	void load(boost::string_ref buf) {
 		set_substitute_entities();
 		/*
 		struct DisableLogger {
@@ -37,7 +36,7 @@ struct SSDom: public xmlpp::DomParser {
 			~DisableLogger() { enableXMLLogger(); }
 		} disabler;
 		*/
-		parse_memory(buf);
+		parse_memory_raw(reinterpret_cast<unsigned char const*>(buf.data()), buf.size());
 		nsmap["ss"] = get_document()->get_root_node()->get_namespace_uri();
 	}
 	bool find(xmlpp::Element const& elem, std::string xpath, xmlpp::const_NodeSet& n) {
@@ -58,7 +57,7 @@ struct SSDom: public xmlpp::DomParser {
 
 namespace {
 	/// Parse str (from XML comment node) for header/value and store cleaned up value in result.
-	bool parseComment(std::string const& str, std::string const& header, std::string& result) {
+	template <typename String> bool parseComment(std::string const& str, std::string const& header, String& result) {
 		if (!boost::starts_with(str, header)) return false;
 		result = boost::replace_all_copy(
 		  boost::trim_left_copy(str.substr(header.size())),
@@ -72,7 +71,7 @@ void SongParser::xmlParseHeader() {
 	Song& s = m_song;
 
 	// Parse notes.xml
-	SSDom dom(m_ss);
+	SSDom dom(m_data);
 	// Extract artist and title from XML comments
 	{
 		xmlpp::const_NodeSet comments;
@@ -131,7 +130,7 @@ void addNoteToTrack(VocalTrack& vocal, const Note& note) {
 /// Parse notes
 void SongParser::xmlParse() {
 	// Parse notes.xml
-	SSDom dom(m_ss);
+	SSDom dom(m_data);
 	Song& s = m_song;
 
 	// Parse each track...
@@ -1,34 +1,105 @@
 #include "songparser.hh"
+#include "log.hh"
 #include "unicode.hh"
 #include "regex.hh"
 
 #include <boost/algorithm/string.hpp>
-#include <boost/filesystem/fstream.hpp>
+#include <cmath>
+#include <limits>
 
 
 namespace SongParserUtil {
 
-	void assign (int& var, std::string const& str) {
-		try {
-			var = std::stoi (str);
-		} catch (...) {
-			throw std::runtime_error ("\"" + str + "\" is not valid integer value");
+	namespace {
+		bool isSpace(char ch) { return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == '\v' || ch == '\f'; }
+		bool isDigit(char ch) { return ch >= '0' && ch <= '9'; }
+		void skipSpace(boost::string_ref& str) {
+			while (!str.empty() && isSpace(str.front())) str.remove_prefix(1);
+		}
+		/// Parse an optionally signed integer, as long long to detect overflow of int
+		bool parseInteger(boost::string_ref& str, long long& var) {
+			boost::string_ref s = str;
+			skipSpace(s);
+			bool negative = false;
+			if (!s.empty() && (s.front() == '-' || s.front() == '+')) { negative = s.front() == '-'; s.remove_prefix(1); }
+			if (s.empty() || !isDigit(s.front())) return false;
+			long long value = 0;
+			for (; !s.empty() && isDigit(s.front()); s.remove_prefix(1)) {
+				value = 10 * value + (s.front() - '0');
+				if (value > std::numeric_limits<int>::max() + 1LL) return false;
+			}
+			var = negative ? -value : value;
+			str = s;
+			return true;
 		}
 	}
-	void assign (unsigned& var, std::string const& str) {
-		try {
-			var = std::stoi (str);
-		} catch (...) {
-			throw std::runtime_error ("\"" + str + "\" is not valid unsigned integer value");
+
+	bool parse(boost::string_ref& str, int& var) {
+		long long value;
+		if (!parseInteger(str, value) || value > std::numeric_limits<int>::max()) return false;
+		var = value;
+		return true;
+	}
+	bool parse(boost::string_ref& str, unsigned& var) {
+		long long value;
+		if (!parseInteger(str, value) || value > std::numeric_limits<int>::max()) return false;
+		var = value;  // Negative values wrap around, as with streams
+		return true;
+	}
+	bool parse(boost::string_ref& str, double& var) {
+		boost::string_ref s = str;
+		skipSpace(s);
+		bool negative = false;
+		if (!s.empty() && (s.front() == '-' || s.front() == '+')) { negative = s.front() == '-'; s.remove_prefix(1); }
+		// Collect up to 18 significant digits into an integer, the rest only scale it
+		unsigned long long mantissa = 0;
+		int exponent = 0, digits = 0, significant = 0;
+		for (; !s.empty() && isDigit(s.front()); s.remove_prefix(1), ++digits) {
+			if (significant < 18) { mantissa = 10 * mantissa + (s.front() - '0'); if (mantissa) ++significant; }
+			else ++exponent;
 		}
+		if (!s.empty() && s.front() == '.') {
+			s.remove_prefix(1);
+			for (; !s.empty() && isDigit(s.front()); s.remove_prefix(1), ++digits) {
+				if (significant < 18) { mantissa = 10 * mantissa + (s.front() - '0'); --exponent; if (mantissa) ++significant; }
+			}
+		}
+		if (digits == 0) return false;
+		if (s.size() >= 2 && (s.front() == 'e' || s.front() == 'E')) {
+			boost::string_ref e = s.substr(1);
+			long long value;
+			if (!e.empty() && !isSpace(e.front()) && parseInteger(e, value)) { exponent += int(std::max(-1000LL, std::min(1000LL, value))); s = e; }
+		}
+		// Exact for typical values (mantissa < 2^53 and a power of ten that is exact too)
+		double value = mantissa;
+		if (exponent < 0 && exponent >= -22) value /= std::pow(10.0, -exponent);
+		else if (exponent != 0) value *= std::pow(10.0, exponent);
+		var = negative ? -value : value;
+		str = s;
+		return true;
 	}
-	void assign (double& var, std::string str) {
-		std::replace (str.begin(), str.end(), ',', '.');  // Fix decimal separators
-		try {
-			var = std::stod (str);
-		} catch (...) {
-			throw std::runtime_error ("\"" + str + "\" is not valid floating point value");
+	bool parseChar(boost::string_ref& str, char& ch) {
+		skipSpace(str);
+		if (str.empty()) return false;
+		ch = str.front();
+		str.remove_prefix(1);
+		return true;
+	}
+
+	void assign (int& var, boost::string_ref str) {
+		if (!parse(str, var)) throw std::runtime_error ("\"" + str.to_string() + "\" is not valid integer value");
+	}
+	void assign (unsigned& var, boost::string_ref str) {
+		if (!parse(str, var)) throw std::runtime_error ("\"" + str.to_string() + "\" is not valid unsigned integer value");
+	}
+	void assign (double& var, boost::string_ref str) {
+		std::string fixed;
+		if (str.find(',') != boost::string_ref::npos) {
+			fixed = str.to_string();
+			std::replace (fixed.begin(), fixed.end(), ',', '.');  // Fix decimal separators
+			str = fixed;
 		}
+		if (!parse(str, var)) throw std::runtime_error ("\"" + str.to_string() + "\" is not valid floating point value");
 	}
 	void assign (bool& var, std::string const& str) {
 		auto lowerStr = UnicodeUtil::toLower(str);
@@ -42,29 +113,44 @@ namespace SongParserUtil {
 	}
 }
 
-SongParser::SongParser(Song& s): m_song(s) {
+SongParser::SongParser(Song& s, std::vector<fs::path> const* folder): m_song(s), m_folder(folder) {
 	try {
 		enum { NONE, TXT, XML, INI, SM } type = NONE;
-		// Read the file, determine the type and do some initial validation checks
-		fs::ifstream f (s.filename, std::ios::binary);
-		if (!f.is_open()) {
+		// Map the file, determine the type and do some initial validation checks
+		boost::system::error_code ec;
+		std::uintmax_t size = fs::file_size(s.filename, ec);
+		if (ec) {
 			throw SongParserException (s, "Could not open song file", 0);
 		}
-		m_ss << f.rdbuf();
-		int size = m_ss.str().length();
 		if ((size < 10) || (size > 100000)) {
 			throw SongParserException (s, "Does not look like a song file (wrong size)", 1, true);
 		}
-		// Convert m_ss; filename supplied for possible warning messages
-		if (xmlCheck (m_ss.str())) {
+		try {
+			m_file.open(s.filename.string());
+		} catch (std::exception&) {
+			throw SongParserException (s, "Could not open song file", 0);
+		}
+		m_data = boost::string_ref(m_file.data(), m_file.size());
+		m_headerOnly = s.loadStatus != Song::LoadStatus::HEADER;
+		if (m_headerOnly) {
+			// Only the header of a TXT is needed for now, so don't bother converting (or even reading) the notes
+			boost::string_ref text = m_data;
+			if (text.starts_with("\xEF\xBB\xBF")) text.remove_prefix(3);
+			if (txtCheck(text) && !smCheck(text)) m_data = boost::string_ref(m_data.data(), text.data() - m_data.data() + txtHeader(text).size());
+		}
+		if (xmlCheck (m_data)) {
 			type = XML;	// XMLPP should deal with encoding so we don't have to.
 		}
 		else {
-			UnicodeUtil::convertToUTF8(m_ss, s.filename.string());
-			if (smCheck (m_ss.str())) {type = SM; } else if (txtCheck (m_ss.str())) {
+			// Convert only if needed; filename supplied for possible warning messages
+			m_data = UnicodeUtil::convertToUTF8(m_data, m_converted, s.filename.string());
+			if (m_data.size() < 2) {
+				throw SongParserException (s, "Does not look like a song file (wrong size)", 1, true);
+			}
+			if (smCheck (m_data)) {type = SM; } else if (txtCheck (m_data)) {
 				type = TXT;
 			}
-			else if (iniCheck (m_ss.str())) {
+			else if (iniCheck (m_data)) {
 				type = INI;
 			}
 			else { 
@@ -90,9 +176,7 @@ SongParser::SongParser(Song& s): m_song(s) {
 		if (type == TXT) txtParseHeader();
 		else if (type == INI) iniParseHeader();
 		else if (type == XML) xmlParseHeader();
-		else if (type == SM) {
-			smParseHeader(); s.dropNotes();  // Hack: drop notes here (load again when playing the song)
-		}
+		else if (type == SM) smParseHeader();
 
 		// Default for preview position if none was specified in header
 		if (std::isnan(s.preview_start)) {
@@ -111,50 +195,98 @@ SongParser::SongParser(Song& s): m_song(s) {
 	}
 }
 
+SongParser::SongParser(Song const& s, DanceTrack const& track): m_song(const_cast<Song&>(s)) {
+	if (s.fileChanged()) throw std::runtime_error("Song file changed since it was parsed");
+	m_file.open(s.filename.string());
+	m_data = UnicodeUtil::convertToUTF8(boost::string_ref(m_file.data(), m_file.size()), m_converted, s.filename.string());
+	if (track.offset > m_data.size()) throw std::runtime_error("Song file changed since it was parsed");
+	m_pos = track.offset;
+	m_linenum = track.linenum;
+	try {
+		track.notes = smParseNotes(std::string());
+	} catch (std::runtime_error& e) {
+		throw std::runtime_error(s.filename.string() + ":" + std::to_string(m_linenum) + ": " + e.what());
+	}
+}
+
+bool SongParser::getline (std::string& line) {
+	++m_linenum;
+	if (m_pos >= m_data.size()) return false;
+	auto begin = m_data.begin() + m_pos;
+	auto end = std::find(begin, m_data.end(), '\n');
+	line.assign(begin, end);
+	m_pos = end - m_data.begin() + 1;
+	return true;
+}
+
 void SongParser::guessFiles () {
-	// List of fields containing filenames, and auto-matching regexps, in order of priority
-	const std::vector<std::pair<fs::path*, char const*> > fields = {
-		{ &m_song.cover, R"((cover|album|label|banner|bn|\[co\])\.(png|jpeg|jpg|svg)$)" },
-		{ &m_song.background, R"((background|bg|\[bg\])\.(png|jpeg|jpg|svg)$)" },
-		{ &m_song.cover, R"(\.(png|jpeg|jpg|svg)$)" },
-		{ &m_song.background, R"(\.(png|jpeg|jpg|svg)$)" },
-		{ &m_song.video, R"(\.(avi|mpg|mpeg|flv|mov|mp4|mkv|m4v)$)" },
-		{ &m_song.midifilename, R"(^notes\.mid$)" },
-		{ &m_song.midifilename, R"(\.mid$)" },
-		{ &m_song.music[TrackName::PREVIEW], R"(^preview\.(mp3|ogg|aac)$)" },
-		{ &m_song.music[TrackName::GUITAR], R"(^guitar\.(mp3|ogg|aac)$)" },
-		{ &m_song.music[TrackName::BASS], R"(^rhythm\.(mp3|ogg|aac)$)" },
-		{ &m_song.music[TrackName::DRUMS], R"(^drums\.(mp3|ogg|aac)$)" },
-		{ &m_song.music[TrackName::KEYBOARD], R"(^keyboard\.(mp3|ogg|aac)$)" },
-		{ &m_song.music[TrackName::GUITAR_COOP], R"(^guitar_coop\.(mp3|ogg|aac)$)"},
-		{ &m_song.music[TrackName::GUITAR_RHYTHM], R"(^guitar_rhythm\.(mp3|ogg|aac)$)"},
-		{ &m_song.music[TrackName::LEAD_VOCAL], R"(^vocals\.(mp3|ogg|aac)$)" },
-		{ &m_song.music[TrackName::BGMUSIC], R"(^song\.(mp3|ogg|aac)$)" },
-		{ &m_song.music[TrackName::BGMUSIC], R"(\.(mp3|ogg|aac)$)" },
+	// Auto-matching regexps for guessFiles, in order of priority (compiled once, used by all loader threads)
+	static const std::vector<regex> regexps = [] {
+		std::vector<regex> ret;
+		for (char const* expr: {
+			R"((cover|album|label|banner|bn|\[co\])\.(png|jpeg|jpg|svg)$)",
+			R"((background|bg|\[bg\])\.(png|jpeg|jpg|svg)$)",
+			R"(\.(png|jpeg|jpg|svg)$)",
+			R"(\.(png|jpeg|jpg|svg)$)",
+			R"(\.(avi|mpg|mpeg|flv|mov|mp4|mkv|m4v)$)",
+			R"(^notes\.mid$)",
+			R"(\.mid$)",
+			R"(^preview\.(mp3|ogg|aac)$)",
+			R"(^guitar\.(mp3|ogg|aac)$)",
+			R"(^rhythm\.(mp3|ogg|aac)$)",
+			R"(^drums\.(mp3|ogg|aac)$)",
+			R"(^keyboard\.(mp3|ogg|aac)$)",
+			R"(^guitar_coop\.(mp3|ogg|aac)$)",
+			R"(^guitar_rhythm\.(mp3|ogg|aac)$)",
+			R"(^vocals\.(mp3|ogg|aac)$)",
+			R"(^song\.(mp3|ogg|aac)$)",
+			R"(\.(mp3|ogg|aac)$)",
+		}) ret.emplace_back(expr, regex_constants::icase);
+		return ret;
+	}();
+	// List of fields containing filenames, matching regexps by index
+	const std::vector<fs::path*> fields = {
+		&m_song.cover,
+		&m_song.background,
+		&m_song.cover,
+		&m_song.background,
+		&m_song.video,
+		&m_song.midifilename,
+		&m_song.midifilename,
+		&m_song.music[TrackName::PREVIEW],
+		&m_song.music[TrackName::GUITAR],
+		&m_song.music[TrackName::BASS],
+		&m_song.music[TrackName::DRUMS],
+		&m_song.music[TrackName::KEYBOARD],
+		&m_song.music[TrackName::GUITAR_COOP],
+		&m_song.music[TrackName::GUITAR_RHYTHM],
+		&m_song.music[TrackName::LEAD_VOCAL],
+		&m_song.music[TrackName::BGMUSIC],
+		&m_song.music[TrackName::BGMUSIC],
 	};
 	
 	std::string logMissing, logFound;
 
-	// Run checks, remove bogus values and construct regexps
-	std::vector<regex> regexps;
+	// Run checks, remove bogus values
 	bool missing = false;
-	for (auto const& p : fields) {
-		fs::path& file = *p.first;
+	for (fs::path* p : fields) {
+		fs::path& file = *p;
 		if (!file.empty() && !is_regular_file (file)) {
 			logMissing += "  " + file.filename().string();
 			file.clear();
 		}
 		if (file.empty()) { missing = true; }
-		regexps.emplace_back (p.second, regex_constants::icase);
 	}
 	
 	if (!missing) {
 		return;	// All OK!
 	}
-	// Try matching all files in song folder with any field
-	std::set<fs::path> files (fs::directory_iterator {m_song.path}, fs::directory_iterator {});
+	// Try matching all files in song folder with any field (as listed by the scanner, if it did)
+	std::set<fs::path> files;
+	if (m_folder) files.insert(m_folder->begin(), m_folder->end());
+	else files.insert(fs::directory_iterator {m_song.path}, fs::directory_iterator {});
 	for (unsigned i = 0; i < fields.size(); ++i) {
-		fs::path& field = *fields[i].first;
+		fs::path& field = *fields[i];
 		if (field.empty()) {
 			for (fs::path const& f : files) {
 				std::string name = f.filename().string();  // File basename
@@ -230,7 +362,7 @@ void SongParser::finalize () {
 		// Remove empty sentences
 		{
 			Note::Type lastType = Note::NORMAL;
-			std::clog << "songparser/debug: In " << m_song.artist << " - " << m_song.title << std::endl;
+			LOG("songparser", debug) << "In " << m_song.artist << " - " << m_song.title << std::endl;
 			for (auto itn = vocal.notes.begin(); itn != vocal.notes.end();) {
 				if (itn->type == Note::SLEEP) { itn->end = itn->begin; ++itn; continue; }
 				auto next = (itn +1);
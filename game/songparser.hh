@@ -4,20 +4,29 @@
 #include "song.hh"
 #include "unicode.hh"
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/range/adaptor/reversed.hpp>
+#include <boost/utility/string_ref.hpp>
 #include <sstream>
 
 namespace SongParserUtil {
 	const std::string DUET_P2 = "Duet singer";	// FIXME
 	const std::string DUET_BOTH = "Both singers";	// FIXME
 	/// Parse an int from string and assign it to a variable
-	void assign(int& var, std::string const& str);
+	void assign(int& var, boost::string_ref str);
 	/// Parse an unsigned int from string and assign it to a variable
-	void assign(unsigned& var, std::string const& str);
-	/// Parse a double from string and assign it to a variable
-	void assign(double& var, std::string str);
+	void assign(unsigned& var, boost::string_ref str);
+	/// Parse a double from string and assign it to a variable (either '.' or ',' as decimal separator)
+	void assign(double& var, boost::string_ref str);
 	/// Parse a boolean from string and assign it to a variable
 	void assign(bool& var, std::string const& str);
+	// Tokenizers for note lines: skip whitespace, parse a value from the beginning of str and remove it from str.
+	// Return false (leaving var untouched) if there is no such value. Unlike streams these neither allocate nor use locales.
+	bool parse(boost::string_ref& str, int& var);
+	bool parse(boost::string_ref& str, unsigned& var);
+	bool parse(boost::string_ref& str, double& var);
+	/// Skip whitespace and remove one character from str, returning false if there is none
+	bool parseChar(boost::string_ref& str, char& ch);
 	/// Erase last character if it matches
 	void eraseLast(std::string& s, char ch = ' ');
 }
@@ -26,12 +35,19 @@ namespace SongParserUtil {
 /// Format-specific member functions are implemented in songparser-*.cc.
 class SongParser {
 public:
-	/// Parse into s
-	SongParser (Song & s);
+	/// Parse into s; folder is the listing of the song folder, if known (otherwise listed when needed)
+	SongParser (Song & s, std::vector<fs::path> const* folder = nullptr);
+	/// Load the notes of a dance chart that parsing s skipped (s is only read, for the tempo)
+	SongParser (Song const& s, DanceTrack const& track);
 private:
 	// Variables and types
 	Song& m_song;
-	std::stringstream m_ss;
+	std::vector<fs::path> const* m_folder = nullptr;
+	boost::iostreams::mapped_file_source m_file;
+	std::string m_converted;  ///< File contents converted to UTF-8 (only if not UTF-8 already)
+	boost::string_ref m_data;  ///< The text being parsed (pointing to m_file or m_converted)
+	std::size_t m_pos = 0;  ///< Read position in m_data
+	bool m_headerOnly = false;  ///< Parsing for the song browser (notes are loaded later)
 	unsigned m_linenum = 0;
 	bool m_relative = false;
 	double m_gap = 0.0;
@@ -50,29 +66,31 @@ private:
 	void finalize();
 	void vocalsTogether();
 	void guessFiles();
-	bool getline (std::string& line) { ++m_linenum; return (bool) std::getline (m_ss, line); }
+	bool getline (std::string& line);
 	Song::BPM getBPM(Song const& s, double ts) const;
 	void addBPM(double ts, double bpm);
 	double tsTime(double ts) const;  ///< Convert a timestamp (beats) into time (seconds)
-	bool txtCheck(std::string const& data) const;
+	bool txtCheck(boost::string_ref data) const;
+	boost::string_ref txtHeader(boost::string_ref data) const;
 	void txtParseHeader();
 	void txtParse();
 	bool txtParseField(std::string const& line);
-	bool txtParseNote(std::string line);
+	bool txtParseNote(std::string const& line);
 	void txtResetState();
-	bool iniCheck(std::string const& data) const;
+	bool iniCheck(boost::string_ref data) const;
 	void iniParseHeader();
-	bool midCheck(std::string const& data) const;
+	bool midCheck(boost::string_ref data) const;
 	void midParseHeader();
 	void midParse();
-	bool xmlCheck(std::string const& data) const;
+	bool xmlCheck(boost::string_ref data) const;
 	void xmlParseHeader();
 	void xmlParse();
 	Note xmlParseNote(xmlpp::Element const& noteNode, unsigned& ts);
-	bool smCheck(std::string const& data) const;
+	bool smCheck(boost::string_ref data) const;
 	void smParseHeader();
 	void smParse();
 	bool smParseField(std::string line);
 	Notes smParseNotes(std::string line);
+	void smSkipNotes();
 	std::pair<double, double> smStopConvert(std::pair<double, double> s);
 };
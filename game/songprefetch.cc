@@ -0,0 +1,59 @@
+#include "songprefetch.hh"
+
+#include "configuration.hh"
+#include "log.hh"
+#include "mediacache.hh"
+#include "song.hh"
+
+#include <boost/filesystem/fstream.hpp>
+#include <iostream>
+#include <vector>
+
+namespace {
+	/// Bytes of each media file read ahead (enough for container headers and the first seconds of data)
+	const std::size_t READAHEAD = 4 << 20;
+
+	void readAhead(fs::path const& file) {
+		fs::ifstream f(file, std::ios::binary);
+		std::vector<char> buf(64 << 10);
+		for (std::size_t total = 0; f && total < READAHEAD; total += buf.size()) f.read(buf.data(), buf.size());
+	}
+}
+
+SongPrefetch::~SongPrefetch() {
+	if (m_future.valid()) m_future.wait();
+}
+
+void SongPrefetch::start(std::shared_ptr<Song> const& song) {
+	if (!song || has(*song) || song->loadStatus == Song::LoadStatus::FULL) return;
+	if (m_future.valid() && !m_ready) return;  // Busy, try again later
+	m_song = song;
+	m_copy = std::make_unique<Song>(*song);  // Copied here because the main thread may change the song meanwhile
+	m_ready = false;
+	const bool video = !song->video.empty() && config["graphic/video"].b();
+	LOG("songprefetch", debug) << "Loading " << song->str() << std::endl;
+	MediaCache::instance().prefetch(*song);
+	m_future = std::async(std::launch::async, [this, video] {
+		bool ok = true;
+		Song& s = *m_copy;
+		try { s.loadNotes(false); } catch (std::exception& e) {
+			std::clog << "songprefetch/info: " << s.str() << " will be loaded when started: " << e.what() << std::endl;
+			ok = false;
+		}
+		for (auto const& m: s.music) readAhead(m.second);
+		if (s.music.count("background")) s.getDurationSeconds();  // Probe (and remember) the duration
+		if (video) readAhead(s.video);
+		m_ready = true;
+		return ok;
+	});
+}
+
+bool SongPrefetch::take(Song& song) {
+	if (!has(song)) return false;
+	const bool ok = m_future.get();
+	if (ok && song.loadStatus != Song::LoadStatus::FULL) song = std::move(*m_copy);
+	m_copy.reset();
+	m_song.reset();
+	m_ready = false;
+	return ok;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+#include <future>
+#include <memory>
+
+class Song;
+
+/**
+* Loads the notes of the next song in the background (e.g. while the current song is being sung), so that
+* entering the singing screen does not stall on parsing big MIDI or StepMania files. The notes are parsed into
+* a copy of the song, which is swapped in by take() on the main thread. Opening the music and the video is
+* prepared by probing the music duration and reading the beginning of the files into the OS cache; the decoders
+* themselves are still created when the song starts (they belong to the audio output and the GL context).
+**/
+class SongPrefetch {
+  public:
+	~SongPrefetch();
+	/// Start loading song unless it is already loaded or being loaded. Does nothing while another load is running.
+	void start(std::shared_ptr<Song> const& song);
+	/// Is a load of song running or done?
+	bool has(Song const& song) const { return m_song && m_song.get() == &song; }
+	/// Has the background load finished?
+	bool ready() const { return m_ready; }
+	/// Move the prefetched notes into song, waiting for the load to finish. Returns false if song was not prefetched
+	/// or it failed (then loadNotes will report the error); either way the prefetch is released.
+	bool take(Song& song);
+
+  private:
+	std::shared_ptr<Song> m_song;  ///< The song being prefetched
+	std::unique_ptr<Song> m_copy;  ///< Loaded by the background thread
+	std::future<bool> m_future;  ///< Whether m_copy loaded without errors
+	std::atomic<bool> m_ready{ false };
+};
@@ -3,6 +3,9 @@
 #include "configuration.hh"
 #include "fs.hh"
 #include "song.hh"
+#include "songcache.hh"
+#include "songwatcher.hh"
+#include "threads.hh"
 #include "database.hh"
 #include "i18n.hh"
 #include "profiler.hh"
@@ -11,10 +14,19 @@
 #include "platform.hh"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <deque>
 #include <iostream>
-#include "regex.hh"
+#include <iterator>
 #include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
@@ -24,16 +36,94 @@
 #include <cpprest/json.h>
 #endif
 
-Songs::Songs(Database & database, std::string const& songlist): m_songlist(songlist), m_database(database), m_order(config["songs/sort-order"].i()) {
+namespace {
+	/// Does the filename (without folder) look like a song file: *.txt, *.sm, song.ini or notes.xml (any case)?
+	bool isSongFile(std::string name) {
+		for (char& ch: name) if (ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+		auto endsWith = [&name](char const* suffix) {
+			const std::size_t len = std::strlen(suffix);
+			return name.size() >= len && name.compare(name.size() - len, len, suffix) == 0;
+		};
+		return endsWith(".txt") || endsWith(".sm") || name == "song.ini" || name == "notes.xml";
+	}
+
+	/// Set of folders that can be checked for containing a path, in steps of path components
+	class PathTrie {
+	  public:
+		PathTrie(): m_nodes(1) {}
+		void insert(fs::path const& dir) {
+			std::size_t n = 0;
+			for (auto const& part: dir) {
+				if (part == ".") continue;  // Trailing slash
+				auto it = m_nodes[n].children.find(part.string());
+				if (it == m_nodes[n].children.end()) {
+					it = m_nodes[n].children.emplace(part.string(), m_nodes.size()).first;
+					m_nodes.emplace_back();
+				}
+				n = it->second;
+			}
+			m_nodes[n].terminal = true;
+		}
+		/// Is path inside (or equal to) any of the inserted folders?
+		bool contains(fs::path const& path) const {
+			std::size_t n = 0;
+			for (auto const& part: path) {
+				if (m_nodes[n].terminal) return true;
+				auto it = m_nodes[n].children.find(part.string());
+				if (it == m_nodes[n].children.end()) return false;
+				n = it->second;
+			}
+			return m_nodes[n].terminal;
+		}
+	  private:
+		struct Node {
+			std::unordered_map<std::string, std::size_t> children;  ///< Indices to m_nodes by path component
+			bool terminal = false;
+		};
+		std::vector<Node> m_nodes;
+	};
+}
+
+Songs::Songs(Database & database, std::string const& songlist, fs::path const& cacheDir):
+  m_songlist(songlist), m_cacheDir(cacheDir.empty() ? getCacheDir() : cacheDir), m_database(database), m_order(config["songs/sort-order"].i())
+{
 	m_updateTimer.setTarget(getInf()); // Using this as a simple timer counting seconds
+	if (config["songs/watch"].b()) m_watcher = std::make_unique<SongWatcher>();
+	m_filterThread = std::thread(&Songs::filterWorker, this);
 	reload();
 }
 
 Songs::~Songs() {
+	{
+		std::lock_guard<std::mutex> l(m_filterMutex);
+		m_filterQuit = true;
+		++m_filterGeneration;
+	}
+	m_filterCond.notify_one();
+	m_filterThread.join();
 	m_loading = false; // Terminate song loading if currently in progress
 	m_thread->join();
 }
 
+std::shared_ptr<Song> Songs::refresh(std::shared_ptr<Song> const& song) {
+	if (!song || !song->fileChanged()) return song;
+	std::shared_ptr<Song> fresh;
+	try { fresh = std::make_shared<Song>(song->path, song->filename); } catch (std::exception& e) {
+		std::clog << "songs/warning: Cannot parse changed song " << song->filename << ": " << e.what() << std::endl;
+		return song;  // Played as cached (loadNotes reports what is wrong with the file)
+	}
+	{
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
+		std::replace(m_songs.begin(), m_songs.end(), song, fresh);
+		++m_removals;
+		m_dirty = true;
+		++m_generation;
+	}
+	std::replace(m_filtered.begin(), m_filtered.end(), song, fresh);
+	std::clog << "songs/info: Song file changed, parsed again: " << song->filename << std::endl;
+	return fresh;
+}
+
 void Songs::reload() {
 	if (m_loading) return;
 	if (doneLoading == true) {
@@ -46,13 +136,147 @@ void Songs::reload() {
 	m_thread = std::make_unique<std::thread>([this]{ reload_internal(); });
 }
 
-void Songs::reload_internal() {
+/**
+* Song loading pipeline: the directory walker queues song files (blocking while the queue is full) and
+* worker threads parse them, merging the results into m_songs in batches. Stops early when m_loading is cleared.
+**/
+class Songs::Loader {
+  public:
+	Loader(Songs& songs);
+	~Loader() { finish(); }
+	typedef std::shared_ptr<std::vector<fs::path> const> Folder;  ///< Listing of a song folder, shared by its files
+	/// Queue a song file for parsing (walker thread only). Returns false if the file is already loaded.
+	bool push(fs::path const& p, Folder const& folder);
+	/// Wait until all queued files are parsed and merged
+	void finish();
+	/// Folders with files that failed to parse (valid after finish)
+	std::unordered_set<std::string> const& failedDirs() const { return m_failed; }
+  private:
+	static const std::size_t QUEUE_SIZE = 256;
+	static const std::size_t BATCH_SIZE = 32;
+	static std::string key(Song const& s) { return s.filename.stem().string() + '\0' + s.title + '\0' + s.artist; }
+	void worker();
+	void merge(SongVector& batch);
+	Songs& m_s;
+	std::unordered_set<std::string> m_known;  ///< Files already in m_songs (walker thread only)
+	std::unordered_map<std::string, fs::path> m_stems;  ///< Loaded files by key(), for detecting additional song files (guarded by m_s.m_mutex)
+	std::unordered_set<std::string> m_failed;  ///< Folders of files that could not be parsed (guarded by m_s.m_mutex)
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<std::pair<fs::path, Folder>> m_queue;
+	bool m_closed = false;
+	std::vector<std::thread> m_workers;
+};
+
+Songs::Loader::Loader(Songs& songs): m_s(songs) {
+	{
+		std::lock_guard<lockstats::Mutex> l(m_s.m_mutex);
+		for (auto const& song: m_s.m_songs) {
+			m_known.insert(song->filename.string());
+			m_stems.emplace(key(*song), song->filename);
+		}
+	}
+	const unsigned count = threads::poolSize(threads::Class::io, config["songs/loader_threads"].i());
+	for (unsigned i = 0; i < count; ++i) m_workers.emplace_back(&Loader::worker, this);
+}
+
+bool Songs::Loader::push(fs::path const& p, Folder const& folder) {
+	if (!m_known.insert(p.string()).second) return false;
+	std::unique_lock<std::mutex> l(m_mutex);
+	// Poll m_loading because nobody notifies us when loading is cancelled
+	while (m_s.m_loading && m_queue.size() >= QUEUE_SIZE) m_cond.wait_for(l, std::chrono::milliseconds(100));
+	m_queue.emplace_back(p, folder);
+	m_cond.notify_all();
+	return true;
+}
+
+void Songs::Loader::finish() {
 	{
 		std::lock_guard<std::mutex> l(m_mutex);
+		m_closed = true;
+	}
+	m_cond.notify_all();
+	for (auto& t: m_workers) t.join();
+	m_workers.clear();
+}
+
+void Songs::Loader::worker() {
+	threads::enter(threads::Class::io, "song loader");
+	SongVector batch;
+	std::map<std::string, LoadStats::Format> formats;  // Merged into m_s.m_stats when done
+	std::unique_lock<std::mutex> l(m_mutex);
+	while (m_s.m_loading) {
+		if (m_queue.empty()) {
+			if (!batch.empty()) { UnlockGuard<decltype(l)> unlocked(l); merge(batch); continue; }
+			if (m_closed) break;
+			m_cond.wait_for(l, std::chrono::milliseconds(100));
+			continue;
+		}
+		fs::path p = std::move(m_queue.front().first);
+		Folder folder = std::move(m_queue.front().second);
+		m_queue.pop_front();
+		m_cond.notify_all();  // Wake up the walker if it waits for space
+		UnlockGuard<decltype(l)> unlocked(l);
+		std::clog << "songs/notice: Found song which was not in the cache: " << p.string() << std::endl;
+		LoadStats::Format& format = formats[UnicodeUtil::toLower(p.extension().string())];
+		const Time begin = Clock::now();
+		try {
+			trace::Scope scope("song parse");
+			std::shared_ptr<Song> s(new Song(p.parent_path(), p, folder.get()));
+			s->getDurationSeconds();
+			batch.push_back(s);
+		} catch (SongParserException& e) {
+			std::clog << e;
+			++format.failed;
+			std::lock_guard<lockstats::Mutex> l(m_s.m_mutex);
+			m_failed.insert(p.parent_path().string());  // Retry on next startup even if the folder is unchanged
+		}
+		++format.files;
+		format.seconds += Seconds(Clock::now() - begin).count();
+		if (batch.size() >= BATCH_SIZE) merge(batch);
+	}
+	l.unlock();
+	std::lock_guard<lockstats::Mutex> lock(m_s.m_mutex);
+	for (auto const& f: formats) {
+		LoadStats::Format& total = m_s.m_stats.formats[f.first];
+		total.files += f.second.files;
+		total.failed += f.second.failed;
+		total.seconds += f.second.seconds;
+	}
+}
+
+void Songs::Loader::merge(SongVector& batch) {
+	std::lock_guard<lockstats::Mutex> l(m_s.m_mutex);
+	for (auto const& s: batch) {
+		auto it = m_stems.emplace(key(*s), s->filename).first;
+		if (it->second.extension() != s->filename.extension()) {
+			std::clog << "songs/info: >>> Found additional song file: " << s->filename << " for: " << it->second << std::endl;
+			std::clog << "songs/info: >>> not yet implemented " << std::endl; //TODO: add it to existing song
+		}
+		m_s.m_songs.push_back(s); // will make additional files appear double!!
+	}
+	batch.clear();
+	m_s.m_dirty = true;
+	++m_s.m_generation;
+}
+
+void Songs::reload_internal() {
+	threads::enter(threads::Class::io, "song scanner");
+	{
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
 		m_songs.clear();
+		++m_removals;
 		m_dirty = true;
+		++m_generation;
+		m_stats = LoadStats();
 	}
+	Time time = Clock::now();
 	LoadCache();
+	{
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
+		m_stats.cacheLoad = Seconds(Clock::now() - time).count();
+		m_stats.cached = m_songs.size();
+	}
 	std::clog << "songs/notice: Done loading the cache. You now have " << m_songs.size() << " songs in your list." << std::endl;
 	std::clog << "songs/notice: Starting to load all songs from disk, to update the cache." << std::endl;
 	Profiler prof("songloader");
@@ -60,31 +284,124 @@ void Songs::reload_internal() {
 	Paths paths = getPathsConfig("paths/songs");
 	paths.insert(paths.begin(), systemSongs.begin(), systemSongs.end());
 
-	for (auto it = paths.begin(); m_loading && it != paths.end(); ++it) { //loop through stored directories from config
-		try {
-			if (!fs::is_directory(*it)) { std::clog << "songs/info: >>> Not scanning: " << *it << " (no such directory)\n"; continue; }
-			std::clog << "songs/info: >>> Scanning " << *it << std::endl;
-			size_t count = m_songs.size();
-			reload_internal(*it);
-			size_t diff = m_songs.size() - count;
-			if (diff > 0 && m_loading) std::clog << "songs/info: " << diff << " songs loaded\n";
-		} catch (std::exception& e) {
-			std::clog << "songs/error: >>> Error scanning " << *it << ": " << e.what() << '\n';
+	m_scannedDirs.clear();
+	time = Clock::now();
+	{
+		Loader loader(*this);
+		for (auto it = paths.begin(); m_loading && it != paths.end(); ++it) { //loop through stored directories from config
+			try {
+				if (!fs::is_directory(*it)) { std::clog << "songs/info: >>> Not scanning: " << *it << " (no such directory)\n"; continue; }
+				std::clog << "songs/info: >>> Scanning " << *it << std::endl;
+				reload_internal(*it, loader);
+			} catch (std::exception& e) {
+				std::clog << "songs/error: >>> Error scanning " << *it << ": " << e.what() << '\n';
+			}
 		}
+		prof("scan");
+		loader.finish();
+		for (auto const& dir: loader.failedDirs()) m_scannedDirs.erase(dir);
 	}
 	prof("total");
+	const double scan = Seconds(Clock::now() - time).count();
+	// Folder stamps are only valid if all songs in them got loaded
+	if (!m_loading) m_scannedDirs.clear();
+	m_dirs.clear();
 	if (m_loading) dumpSongs_internal(); // Dump the songlist to file (if requested)
+	if (m_loading) watchScanned();
 	std::clog << std::flush;
 	m_loading = false;
 	std::clog << "songs/notice: Done Loading. Loaded " << m_songs.size() << " Songs." << std::endl;
+	time = Clock::now();
 	CacheSonglist();
+	{
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
+		m_stats.scan = scan;
+		m_stats.cacheSave = Seconds(Clock::now() - time).count();
+	}
 	std::clog << "songs/notice: Done Caching." << std::endl;
 	doneLoading = true;
 }
 
+Songs::LoadStats Songs::loadStats() const {
+	std::lock_guard<lockstats::Mutex> l(m_mutex);
+	return m_stats;
+}
+
+void Songs::update_internal(std::vector<fs::path> const& dirs) {
+	std::clog << "songs/notice: Updating " << dirs.size() << " changed song folders." << std::endl;
+	// Only the changed folders are listed again, unchanged ones below them are skipped as usual
+	m_dirs = m_scannedDirs;
+	std::vector<std::string> prefixes;
+	for (auto const& dir: dirs) {
+		m_dirs.erase(dir.string());
+		prefixes.push_back(dir.string() + fs::path::preferred_separator);
+		for (auto it = m_scannedDirs.begin(); it != m_scannedDirs.end(); ) {
+			if (it->first == dir.string() || it->first.compare(0, prefixes.back().size(), prefixes.back()) == 0) it = m_scannedDirs.erase(it);
+			else ++it;
+		}
+	}
+	// Find songs that were modified or removed (modified ones get parsed again by the scan)
+	SongVector songs;
+	{
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
+		songs = m_songs;
+	}
+	std::unordered_set<Song const*> gone;
+	std::unordered_map<std::string, bool> dirExists;  // Folders below the changed ones (may have been removed)
+	for (auto const& song: songs) {
+		fs::path dir = song->filename.parent_path();
+		if (std::find(dirs.begin(), dirs.end(), dir) != dirs.end()) {
+			boost::system::error_code ec;
+			std::uintmax_t size = fs::file_size(song->filename, ec);
+			if (ec || size != song->fileSize || fs::last_write_time(song->filename, ec) != song->fileTime || ec) gone.insert(song.get());
+			continue;
+		}
+		std::string name = song->filename.string();
+		for (auto const& prefix: prefixes) {
+			if (name.compare(0, prefix.size(), prefix) != 0) continue;
+			auto it = dirExists.find(dir.string());
+			boost::system::error_code ec;
+			if (it == dirExists.end()) it = dirExists.emplace(dir.string(), fs::is_directory(dir, ec)).first;
+			if (!it->second) gone.insert(song.get());
+			break;
+		}
+	}
+	if (!gone.empty()) {
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
+		m_songs.erase(std::remove_if(m_songs.begin(), m_songs.end(), [&gone](std::shared_ptr<Song> const& s) { return gone.count(s.get()) > 0; }), m_songs.end());
+		++m_removals;
+		m_dirty = true;
+		++m_generation;
+		std::clog << "songs/info: " << gone.size() << " songs removed or modified." << std::endl;
+	}
+	{
+		Loader loader(*this);
+		for (auto it = dirs.begin(); m_loading && it != dirs.end(); ++it) {
+			boost::system::error_code ec;
+			if (fs::is_directory(*it, ec)) reload_internal(*it, loader);  // Removed folders only matter to their parent
+		}
+		loader.finish();
+		for (auto const& dir: loader.failedDirs()) m_scannedDirs.erase(dir);
+	}
+	m_dirs.clear();
+	if (m_loading) {
+		watchScanned();
+		CacheSonglist();
+	}
+	m_loading = false;
+	std::clog << "songs/notice: Done updating. You now have " << m_songs.size() << " songs." << std::endl;
+}
+
+void Songs::watchScanned() {
+	if (!m_watcher) return;
+	std::vector<fs::path> dirs;
+	for (auto const& dir: m_scannedDirs) dirs.push_back(dir.first);
+	m_watcher->watch(dirs);
+}
+
 #ifdef USE_WEBSERVER
-void Songs::LoadCache() {
-	fs::path songsMetaFile = getCacheDir() / "Songs-Metadata.json";
+/// Read the JSON song cache (the only format of older versions)
+static void loadJsonCache(fs::path const& songsMetaFile, SongCache::SongVector& songs, SongCache::Dirs& dirs, SongCache::Validator const& validate) {
 	std::ifstream file(songsMetaFile.string());
 	web::json::value jsonRoot;
     if (file)
@@ -103,35 +420,35 @@ void Songs::LoadCache() {
     	return;
     }
 
-	Paths systemSongs = getPathsConfig("paths/system-songs");
-	Paths localPaths = getPathsConfig("paths/songs");
-	localPaths.insert(localPaths.begin(), systemSongs.begin(), systemSongs.end());
+	try {
+		// Songs-Metadata.json used to be a plain array of songs, without file stamps or folders
+		bool legacy = jsonRoot.is_array();
+		if (!legacy && jsonRoot.has_field("Directories")) {
+			for (auto const& dir: jsonRoot.at("Directories").as_array()) {
+				SongCache::Dir& stamp = dirs[dir.at("Path").as_string()];
+				stamp.time = dir.at("Time").as_number().to_int64();
+				for (auto const& sub: dir.at("Subdirs").as_array()) stamp.subdirs.push_back(sub.as_string());
+			}
+		}
 
-	std::vector<std::string> userSongs;
-	for(const fs::path& userSong : localPaths) {
-		userSongs.push_back(userSong.string());
-	}
-
-    for(auto const& song : jsonRoot.as_array()) {
-    	STAT buffer;
-    	auto songPath = song.at("TxtFile").as_string();
-    	auto isSongPathInConfiguredPaths = std::find_if(
-                                                        userSongs.begin(), 
-                                                        userSongs.end(), 
-														[songPath](const std::string& userSongItem) { 
-															return songPath.find(userSongItem) != std::string::npos;
-														 }) != userSongs.end();
-    	if(_STAT(songPath.c_str(), &buffer) == 0 && isSongPathInConfiguredPaths) {
-    		std::shared_ptr<Song> realSong(new Song(song));
-    		m_songs.push_back(realSong);
-    	}  	
-    }
+		for(auto const& song : legacy ? jsonRoot.as_array() : jsonRoot.at("Songs").as_array()) {
+			auto songPath = song.at("TxtFile").as_string();
+			std::uintmax_t size = song.has_field("FileSize") ? song.at("FileSize").as_number().to_uint64() : 0;
+			std::int64_t time = song.has_field("FileTime") ? song.at("FileTime").as_number().to_int64() : 0;
+			if (validate(songPath, size, time)) songs.push_back(std::shared_ptr<Song>(new Song(song)));
+		}
+	} catch (std::exception const& e) {
+		std::clog << "songs/error: Invalid songs meta cache file " << songsMetaFile.string() << ": " << e.what() << std::endl;
+		songs.clear();
+		dirs.clear();
+	}
 }
 
-void Songs::CacheSonglist() {
+/// Export the song cache as JSON for external tools (also imported if there is no binary cache)
+static void saveJsonCache(fs::path const& cacheDir, SongCache::SongVector const& songs, SongCache::Dirs const& dirs) {
     web::json::value jsonRoot = web::json::value::array();
     auto i = 0;
-	for (auto const& song : m_songs)
+	for (auto const& song : songs)
     {  
         web::json::value songObject = web::json::value::object();
         if(!song->path.string().empty()) {
@@ -144,19 +461,19 @@ void Songs::CacheSonglist() {
         	songObject["Title"] = web::json::value::string(song->title);
     	}
 		if(!song->artist.empty()) {
-        	songObject["Artist"] = web::json::value::string(song->artist);
+        	songObject["Artist"] = web::json::value::string(song->artist.str());
     	}
         if(!song->edition.empty()) {
-        	songObject["Edition"] = web::json::value::string(song->edition);
+        	songObject["Edition"] = web::json::value::string(song->edition.str());
     	}
     	if(!song->language.empty()) {
-        	songObject["Language"] = web::json::value::string(song->language);
+        	songObject["Language"] = web::json::value::string(song->language.str());
         }
         if(!song->creator.empty()) {
-        	songObject["Creator"] = web::json::value::string(song->creator);
+        	songObject["Creator"] = web::json::value::string(song->creator.str());
     	}
     	if(!song->genre.empty()) {
-        	songObject["Genre"] = web::json::value::string(song->genre);
+        	songObject["Genre"] = web::json::value::string(song->genre.str());
     	}
     	if(!song->cover.string().empty()) {
         	songObject["Cover"] = web::json::value::string(song->cover.string());
@@ -182,6 +499,8 @@ void Songs::CacheSonglist() {
     	if(!song->music["vocals"].string().empty()) {
 	        songObject["Vocals"] = web::json::value::string(song->music["vocals"].string());
 	    }
+		songObject["FileSize"] = web::json::value::number(uint64_t(song->fileSize));
+		songObject["FileTime"] = web::json::value::number(int64_t(song->fileTime));
     	double duration = song->getDurationSeconds();
     	if(!std::isnan(duration)) {
 	    	songObject["Duration"] = web::json::value::number(duration);
@@ -192,7 +511,7 @@ void Songs::CacheSonglist() {
 			
 		// Cache songtype also.
 		if(song->hasVocals()) {
-			uint32_t vocals = song->vocalTracks.size();
+			uint32_t vocals = song->vocalTrackCount();
         	songObject["VocalTracks"] = web::json::value::number(vocals);
     	}
 		if(song->hasKeyboard()) {
@@ -202,11 +521,11 @@ void Songs::CacheSonglist() {
         	songObject["DrumTracks"] = web::json::value::number(1);
     	}
 		if(song->hasDance()) {
-			uint32_t dance = song->danceTracks.size();
+			uint32_t dance = song->danceTrackCount();
         	songObject["DanceTracks"] = web::json::value::number(dance);
     	}
 		if(song->hasGuitars()) {
-			uint32_t guitars = song->instrumentTracks.size() - song->hasDrums() - song->hasKeyboard();
+			uint32_t guitars = song->guitarTrackCount();
         	songObject["GuitarTracks"] = web::json::value::number(guitars);
     	}
 	    if(songObject != web::json::value::object()) {
@@ -215,11 +534,25 @@ void Songs::CacheSonglist() {
     	}
 	}
 
-	fs::path cacheDir = getCacheDir() / "Songs-Metadata.json";
+	web::json::value dirArray = web::json::value::array();
+	i = 0;
+	for (auto const& dir: dirs) {
+		web::json::value dirObject = web::json::value::object();
+		web::json::value subdirs = web::json::value::array();
+		for (std::size_t j = 0; j < dir.second.subdirs.size(); ++j) subdirs[j] = web::json::value::string(dir.second.subdirs[j]);
+		dirObject["Path"] = web::json::value::string(dir.first);
+		dirObject["Time"] = web::json::value::number(int64_t(dir.second.time));
+		dirObject["Subdirs"] = subdirs;
+		dirArray[i++] = dirObject;
+	}
+
+	web::json::value cacheRoot = web::json::value::object();
+	cacheRoot["Songs"] = jsonRoot;
+	cacheRoot["Directories"] = dirArray;
 
 	try {
 		std::stringstream stream;
-		jsonRoot.serialize(stream);
+		cacheRoot.serialize(stream);
 		std::ofstream outFile(cacheDir.string());
     	outFile << stream.rdbuf();
     	outFile.close();
@@ -228,55 +561,122 @@ void Songs::CacheSonglist() {
 		return;
 	}
 }
-#else 
-void Songs::LoadCache() { }
-void Songs::CacheSonglist() { }
 #endif
 
-void Songs::reload_internal(fs::path const& parent) {
-	if (std::distance(parent.begin(), parent.end()) > 20) { std::clog << "songs/info: >>> Not scanning: " << parent.string() << " (maximum depth reached, possibly due to cyclic symlinks)\n"; return; }
+void Songs::LoadCache() {
+	Paths systemSongs = getPathsConfig("paths/system-songs");
+	Paths localPaths = getPathsConfig("paths/songs");
+	localPaths.insert(localPaths.begin(), systemSongs.begin(), systemSongs.end());
+	PathTrie roots;
+	for (fs::path const& userSong: localPaths) roots.insert(userSong);
+
+	// Only songs from the configured folders; file stamps are checked below
+	auto validate = [&roots](std::string const& songPath, std::uintmax_t, std::int64_t) { return roots.contains(songPath); };
+
+	SongVector songs;
+	fs::path cacheFile = m_cacheDir / "Songs.cache";
 	try {
-		regex expression(R"((\.txt|^song\.ini|^notes\.xml|\.sm)$)", regex_constants::icase);
-		for (fs::directory_iterator dirIt(parent), dirEnd; m_loading && dirIt != dirEnd; ++dirIt) { //loop through files
-			fs::path p = dirIt->path();
-			if (fs::is_directory(p)) { reload_internal(p); continue; } //if the file is a folder redo this function with this folder as path
-			if (!regex_search(p.filename().string(), expression)) continue; //if the folder does not contain any of the requested files, ignore it
-			try { //found song file, make a new song with it.
-				auto it = std::find_if(m_songs.begin(), m_songs.end(), [p](std::shared_ptr<Song> n) {
-					return n->filename == p;
-				});
-				auto alreadyInCache = it != m_songs.end();
+		SongCache::load(cacheFile, songs, m_dirs, validate);
+	} catch (std::exception const& e) {
+		std::clog << "songs/info: Not using song cache: " << e.what() << std::endl;
+		songs.clear();
+		m_dirs.clear();
+#ifdef USE_WEBSERVER
+		loadJsonCache(m_cacheDir / "Songs-Metadata.json", songs, m_dirs, validate);  // Import the cache of older versions
+#endif
+	}
+	removeStale(songs, config["songs/lazy_validation"].b());
+	std::lock_guard<lockstats::Mutex> l(m_mutex);
+	m_songs.insert(m_songs.end(), songs.begin(), songs.end());
+	++m_generation;
+}
 
-				if(alreadyInCache) { 
-					continue;
-				}
+void Songs::removeStale(SongVector& songs, bool lazy) {
+	// With lazy validation only songs without file stamps are dropped here, others are checked by refresh when played
+	if (lazy) {
+		auto end = std::remove_if(songs.begin(), songs.end(), [this](std::shared_ptr<Song> const& s) {
+			if (s->fileTime != 0) return false;
+			m_dirs.erase(s->filename.parent_path().string());
+			return true;
+		});
+		songs.erase(end, songs.end());
+		return;
+	}
+	// Check one folder at a time per thread (network file systems handle that better) with many folders in parallel
+	std::vector<std::pair<std::string, std::size_t>> order;
+	for (std::size_t i = 0; i < songs.size(); ++i) order.emplace_back(songs[i]->filename.parent_path().string(), i);
+	std::sort(order.begin(), order.end());
+	std::vector<std::size_t> groups;  // Start of each folder in order
+	for (std::size_t i = 0; i < order.size(); ++i) if (i == 0 || order[i].first != order[i - 1].first) groups.push_back(i);
+	groups.push_back(order.size());
+	std::vector<char> stale(songs.size());
+	std::atomic<std::size_t> next{ 0 };
+	auto work = [&] {
+		for (std::size_t g = next++; g + 1 < groups.size(); g = next++) {
+			for (std::size_t i = groups[g]; i < groups[g + 1]; ++i) {
+				Song const& song = *songs[order[i].second];
+				STAT buffer;
+				stale[order[i].second] = _STAT(song.filename.string().c_str(), &buffer) != 0
+				  || std::int64_t(buffer.st_mtime) != song.fileTime || std::uintmax_t(buffer.st_size) != song.fileSize;
+			}
+		}
+	};
+	const unsigned count = threads::poolSize(threads::Class::io, config["songs/loader_threads"].i());
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < std::min<std::size_t>(count, groups.size() - 1); ++i) workers.emplace_back(work);
+	work();
+	for (auto& t: workers) t.join();
+	// Changed or removed: have their folders listed again so that the files get parsed if they still exist
+	std::size_t count = 0;
+	for (std::size_t i = 0; i < songs.size(); ++i) {
+		if (!stale[i]) songs[count++] = songs[i];
+		else m_dirs.erase(songs[i]->filename.parent_path().string());
+	}
+	songs.resize(count);
+}
 
-				std::clog << "songs/notice: Found song which was not in the cache: " << p.string() << std::endl;
+void Songs::CacheSonglist() {
+	fs::path cacheFile = m_cacheDir / "Songs.cache";
+	try {
+		SongCache::save(cacheFile, m_songs, m_scannedDirs);
+	} catch (std::exception const& e) {
+		std::clog << "songs/error: Could not save " << cacheFile.string() << ": " << e.what() << std::endl;
+	}
+#ifdef USE_WEBSERVER
+	if (config["songs/cache_json"].b()) saveJsonCache(m_cacheDir / "Songs-Metadata.json", m_songs, m_scannedDirs);
+#endif
+}
 
-				std::shared_ptr<Song>s(new Song(p.parent_path(), p));
-				std::lock_guard<std::mutex> l(m_mutex);
-				int AdditionalFileIndex = -1;
-				for(unsigned int i = 0; i< m_songs.size(); i++) {
-					if(s->filename.extension() != m_songs[i]->filename.extension() && s->filename.stem() == m_songs[i]->filename.stem() &&
-							s->title == m_songs[i]->title && s->artist == m_songs[i]->artist) {
-						std::clog << "songs/info: >>> Found additional song file: " << s->filename << " for: " << m_songs[i]->filename << std::endl;
-						AdditionalFileIndex = i;
-					}
-				}				
-
-				if(AdditionalFileIndex > 0) { //TODO: add it to existing song
-					std::clog << "songs/info: >>> not yet implemented " << std::endl;
-					s->getDurationSeconds();
-					m_songs.push_back(s); // will make it appear double!!
-				} else {
-					s->getDurationSeconds();
-					m_songs.push_back(s); //put it in the database
-				}
-				m_dirty = true;
-			} catch (SongParserException& e) {
-				std::clog << e;
+void Songs::reload_internal(fs::path const& parent, Loader& loader) {
+	if (std::distance(parent.begin(), parent.end()) > 20) { std::clog << "songs/info: >>> Not scanning: " << parent.string() << " (maximum depth reached, possibly due to cyclic symlinks)\n"; return; }
+	try {
+		boost::system::error_code ec;
+		DirStamp stamp{ fs::last_write_time(parent, ec), {} };
+		auto cached = m_dirs.find(parent.string());
+		if (!ec && cached != m_dirs.end() && cached->second.time == stamp.time) {
+			// No files were added or removed here since the cache was written, only visit the subfolders
+			stamp.subdirs = cached->second.subdirs;
+			m_scannedDirs[parent.string()] = stamp;
+			for (auto const& sub: stamp.subdirs) if (m_loading) reload_internal(parent / sub, loader);
+			return;
+		}
+		// List the folder once: the parsers get the listing for finding the song's other files
+		auto folder = std::make_shared<std::vector<fs::path>>();
+		std::vector<fs::path> songFiles;
+		for (fs::directory_iterator dirIt(parent), dirEnd; m_loading && dirIt != dirEnd; ++dirIt) { //loop through files
+			fs::path p = dirIt->path();
+			folder->push_back(p);
+			if (fs::is_directory(p)) { //if the file is a folder redo this function with this folder as path
+				stamp.subdirs.push_back(p.filename().string());
+				reload_internal(p, loader);
+				continue;
 			}
+			if (isSongFile(p.filename().string())) songFiles.push_back(p);
 		}
+		std::size_t count = 0;
+		for (auto const& p: songFiles) if (loader.push(p, folder)) ++count; //found song file, queue it for parsing unless it is already loaded (e.g. from the cache)
+		if (count > 0 && m_loading) std::clog << "songs/info: " << count << " new song files in " << parent.string() << '\n';
+		if (!ec && m_loading) m_scannedDirs[parent.string()] = std::move(stamp);
 	} catch (std::exception const& e) {
 		std::clog << "songs/error: Error accessing " << parent << ": " << e.what() << '\n';
 	}
@@ -309,115 +709,237 @@ class Songs::RestoreSel {
 };
 
 void Songs::update() {
-	if (m_dirty && m_updateTimer.get() > 0.5) filter_internal(); // Update with newly loaded songs
+	if (m_watcher && doneLoading && !m_loading) {
+		std::vector<fs::path> dirs = m_watcher->takeChanged();
+		if (!dirs.empty()) {
+			// Update the changed folders in the background, like reload() but keeping all other songs
+			m_loading = true;
+			if (m_thread) m_thread->join();
+			m_thread = std::make_unique<std::thread>([this, dirs]{ update_internal(dirs); });
+		}
+	}
+	if (m_dirty && m_updateTimer.get() > 0.5) requestFilter(); // Update with newly loaded songs
+	filterResults();
 	// A hack to move to the first song when the song screen is entered the first time
 	static bool first = true;
 	if (first) { first = false; math_cover.reset(); math_cover.setTarget(0, size()); }
 }
 
-void Songs::setFilter(std::string const& val) {
+void Songs::setFilter(std::string const& val, bool background) {
 	if (m_filter == val) return;
 	m_filter = val;
-	filter_internal();
+	if (background) requestFilter();
+	else filter_now();
 }
 
-void Songs::filter_internal() {
+void Songs::requestFilter() {
 	m_updateTimer.setValue(0.0);
-	std::lock_guard<std::mutex> l(m_mutex);
 	m_dirty = false;
+	{
+		std::lock_guard<std::mutex> l(m_filterMutex);
+		m_filterQuery = FilterQuery{ m_filter, m_type, m_order, false };
+		m_filterPending = true;
+		++m_filterGeneration;  // Cancels the query in progress, if any
+	}
+	m_filterCond.notify_one();
+}
+
+void Songs::filter_now(bool descending) {
+	m_updateTimer.setValue(0.0);
+	m_dirty = false;
+	unsigned generation = ++m_filterGeneration;  // Supersedes any background query
+	SongVector filtered;
+	filter_internal(FilterQuery{ m_filter, m_type, m_order, descending }, filtered, generation);
 	RestoreSel restore(*this);
-	try {
+	m_filtered.swap(filtered);
+}
+
+void Songs::filterResults() {
+	SongVector filtered;
+	{
+		std::lock_guard<std::mutex> l(m_filterMutex);
+		if (!m_filterResultReady) return;
+		m_filterResultReady = false;
+		if (m_filterResultGeneration != m_filterGeneration) return;  // Superseded meanwhile
+		filtered.swap(m_filterResult);
+	}
+	RestoreSel restore(*this);
+	m_filtered.swap(filtered);
+}
+
+void Songs::filterWorker() {
+	std::unique_lock<std::mutex> l(m_filterMutex);
+	while (true) {
+		m_filterCond.wait(l, [this]{ return m_filterPending || m_filterQuit; });
+		if (m_filterQuit) return;
+		FilterQuery query = m_filterQuery;
+		unsigned generation = m_filterGeneration;
+		m_filterPending = false;
 		SongVector filtered;
-		// if filter text is blank and no type filter is set, just display all songs.
-		if (m_filter == std::string() && m_type == 0) filtered = m_songs;
-		else {
-			std::string charset = UnicodeUtil::getCharset(m_filter);
-			icu::UnicodeString filter = ((charset == "UTF-8") ? icu::UnicodeString::fromUTF8(m_filter) : icu::UnicodeString(m_filter.c_str(), charset.c_str()));
-			UErrorCode icuError = U_ZERO_ERROR;
-			
-			std::copy_if (m_songs.begin(), m_songs.end(), std::back_inserter(filtered), [&](std::shared_ptr<Song> it){
-			// Filter by type first.	
-				if (m_type == 1 && !(*it).hasDance()) return false;
-				if (m_type == 2 && !(*it).hasVocals()) return false;
-				if (m_type == 3 && !(*it).hasDuet()) return false;
-				if (m_type == 4 && !(*it).hasGuitars()) return false;
-				if (m_type == 5 && !(*it).hasDrums() && !(*it).hasKeyboard()) return false;
-				if (m_type == 6 && (!(*it).hasVocals() || !(*it).hasGuitars() || (!(*it).hasDrums() && !(*it).hasKeyboard()))) return false;
-				
-		  // If search is not empty, filter by search term.	
-				if (!m_filter.empty()) {
-					icu::StringSearch search = icu::StringSearch(filter, icu::UnicodeString::fromUTF8((*it).strFull()), &UnicodeUtil::m_dummyCollator, nullptr, icuError);
-					return (search.first(icuError) != USEARCH_DONE);
-					}
-					
-		// If we still haven't returned, it must be a type match with an empty search string.			
-				return true;
-			});
+		bool done;
+		{
+			UnlockGuard<decltype(l)> unlocked(l);
+			done = filter_internal(query, filtered, generation);
 		}
-		m_filtered.swap(filtered);
-	} catch (...) {
-		SongVector(m_songs.begin(), m_songs.end()).swap(m_filtered);  // Invalid regex => copy everything
+		if (!done || generation != m_filterGeneration) continue;
+		m_filterResult.swap(filtered);
+		m_filterResultGeneration = generation;
+		m_filterResultReady = true;
 	}
-	sort_internal();
 }
 
 namespace {
+	/// Smallest number of songs worth a thread of its own when sorting or filtering
+	const std::size_t PARALLEL_MIN_SONGS = 2048;
 
-	/// A functor that compares songs based on a selected member field of them.
-	template<typename Field> class CmpByField {
-		Field Song::* m_field;
-	  public:
-		/** @param field a pointer to the field to use (pointer to member) **/
-		CmpByField(Field Song::* field): m_field(field) {}
-		/// Compare left < right
-		bool operator()(Song const& left , Song const& right) {
-			return left.*m_field < right.*m_field;
+	/// Split items into chunks for threads to work on (one for small counts), as the chunk boundaries
+	std::vector<std::size_t> chunks(std::size_t items) {
+		const std::size_t count = std::max<std::size_t>(1, std::min<std::size_t>(items / PARALLEL_MIN_SONGS, threads::poolSize(threads::Class::io)));
+		std::vector<std::size_t> bounds;
+		for (std::size_t i = 0; i <= count; ++i) bounds.push_back(items * i / count);
+		return bounds;
+	}
+
+	/// Call fn(chunk, begin, end) for each chunk, the first one in the calling thread and the others in threads of their own
+	template <typename Fn> void forChunks(std::vector<std::size_t> const& bounds, Fn const& fn) {
+		std::vector<std::future<void>> tasks;
+		for (std::size_t i = 1; i + 1 < bounds.size(); ++i) tasks.push_back(std::async(std::launch::async, [&fn, &bounds, i] { fn(i, bounds[i], bounds[i + 1]); }));
+		fn(0, bounds[0], bounds[1]);
+		for (auto& t: tasks) t.get();
+	}
+
+	/// Does the song pass a song type filter (see Songs::typeDesc)?
+	bool typeMatches(Song const& song, int type) {
+		switch (type) {
+		  case 1: return song.hasDance();
+		  case 2: return song.hasVocals();
+		  case 3: return song.hasDuet();
+		  case 4: return song.hasGuitars();
+		  case 5: return song.hasDrums() || song.hasKeyboard();
+		  case 6: return song.hasVocals() && song.hasGuitars() && (song.hasDrums() || song.hasKeyboard());
+		  default: return true;
 		}
-		/// Compare *left < *right
-		bool operator()(std::shared_ptr<Song> const& left, std::shared_ptr<Song> const& right) {
-			return operator()(*left, *right);
+	}
+
+	/// A search term, matched by folded substring first and then verified with the collator
+	class SearchTerm {
+	  public:
+		SearchTerm(std::string const& text) {
+			std::string charset = UnicodeUtil::isUTF8(text) ? "UTF-8" : UnicodeUtil::getCharset(text);
+			m_pattern = ((charset == "UTF-8") ? icu::UnicodeString::fromUTF8(text) : icu::UnicodeString(text.c_str(), charset.c_str()));
+			if (text.empty()) return;
+			m_pattern.toUTF8String(m_folded);
+			m_folded = UnicodeUtil::foldForSearch(m_folded);
 		}
+		/// Folded search text for SongIndex::candidates (empty for no search)
+		std::string const& folded() const { return m_folded; }
+		/// Matches songs of an index for one thread (each needs a StringSearch of its own, reused for all songs)
+		class Matcher {
+		  public:
+			explicit Matcher(SearchTerm const& term): m_term(term) {}
+			/// Does the song at pos of the index match? (The index need not be synced if the search text is empty.)
+			bool operator()(SongIndex const& index, std::uint32_t pos) {
+				if (m_term.m_pattern.isEmpty()) return true;
+				if (index.folded(pos).find(m_term.m_folded) == std::string::npos) return false;
+				icu::UnicodeString const& text = index.text(pos);
+				if (text.isEmpty()) return false;
+				UErrorCode icuError = U_ZERO_ERROR;
+				if (!m_search) m_search = std::make_unique<icu::StringSearch>(m_term.m_pattern, text, &UnicodeUtil::searchCollator(), nullptr, icuError);
+				else m_search->setText(text, icuError);
+				return U_SUCCESS(icuError) && m_search->first(icuError) != USEARCH_DONE;
+			}
+		  private:
+			SearchTerm const& m_term;
+			std::unique_ptr<icu::StringSearch> m_search;
+		};
+	  private:
+		icu::UnicodeString m_pattern;
+		std::string m_folded;
 	};
-	
-	template<> class CmpByField<std::string> {
-		std::string Song::* m_field;
-	  public:
-		/** @param field a pointer to the field to use (pointer to member) **/
-		CmpByField(std::string Song::* field): m_field(field) {}
-		/// Compare left < right
-		bool operator()(Song const& left , Song const& right) {
-			icu::UnicodeString leftVal = icu::UnicodeString::fromUTF8(left.*m_field);
-			icu::UnicodeString rightVal = icu::UnicodeString::fromUTF8(right.*m_field);
-			UErrorCode sortError = U_ZERO_ERROR;
-			UCollationResult result = UnicodeUtil::m_sortCollator.compare(leftVal, rightVal, sortError);
-			if (U_SUCCESS(sortError)) {
-			return (result == UCOL_LESS);
+}
+
+bool Songs::filter_internal(FilterQuery const& query, SongVector& filtered, unsigned generation) {
+	std::lock_guard<lockstats::Mutex> l(m_mutex);
+	try {
+		auto const& sorted = sorted_internal(query.order);  // First, as it may start the orders over
+		auto less = lessBy(query.order);
+		LastFilter& last = m_lastFilter;
+		SearchTerm search(query.filter);
+		if (last.valid && last.filter == query.filter && last.type == query.type && last.order == query.order && last.removals == m_removals
+		  && last.strength == m_sortStrength && last.summaryGeneration == m_summaryGeneration) {
+			// Only songs were appended (by the loader) since the last query: filter and sort them alone and merge them in
+			if (!query.filter.empty()) m_index.sync(m_songs);
+			SearchTerm::Matcher matches(search);
+			std::vector<SortEntry> added;
+			for (std::size_t i = last.songs; i < m_songs.size(); ++i) {
+				std::shared_ptr<Song> const& song = m_songs[i];
+				if (typeMatches(*song, query.type) && matches(m_index, i)) added.push_back(entryBy(query.order, song, m_database));
 			}
-			else {
-			throw std::runtime_error("unicode/error: Sorting comparison error in CmpByField<std::string> ");
+			if (!added.empty()) {
+				std::stable_sort(added.begin(), added.end(), less);
+				std::vector<SortEntry> merged;
+				merged.reserve(last.entries.size() + added.size());
+				// Earlier songs first among equals, as in the presorted orders
+				std::merge(std::make_move_iterator(last.entries.begin()), std::make_move_iterator(last.entries.end()),
+				  std::make_move_iterator(added.begin()), std::make_move_iterator(added.end()), std::back_inserter(merged), less);
+				last.entries.swap(merged);
 			}
+		} else {
+			// Pick the matches from the presorted order; the index narrows the search down to songs containing every
+			// trigram of the search term (or all songs with no search term)
+			std::unordered_set<Song const*> members;
+			if (query.filter.empty() && query.type == 0) {
+				for (auto const& song: m_songs) members.insert(song.get());
+			} else {
+				m_index.sync(m_songs);
+				const std::vector<std::uint32_t> candidates = m_index.candidates(search.folded());
+				// Threads check chunks of the candidates, each with collators of its own
+				const std::vector<std::size_t> bounds = chunks(candidates.size());
+				std::vector<std::vector<Song const*>> matches(bounds.size() - 1);
+				std::atomic<bool> cancelled{ false };
+				forChunks(bounds, [&](std::size_t chunk, std::size_t b, std::size_t e) {
+					auto& out = matches[chunk];
+					SearchTerm::Matcher matcher(search);
+					for (std::size_t i = b; i < e; ++i) {
+						if ((i - b) % 256 == 255 && (cancelled || generation != m_filterGeneration)) { cancelled = true; return; }  // Superseded by a newer query
+						Song const& song = *m_songs[candidates[i]];
+						if (typeMatches(song, query.type) && matcher(m_index, candidates[i])) out.push_back(&song);
+					}
+				});
+				if (cancelled) return false;
+				for (auto const& m: matches) members.insert(m.begin(), m.end());
+			}
+			last = LastFilter{ true, query.filter, query.type, query.order, m_removals, m_sortStrength, m_summaryGeneration };
+			for (auto const& e: sorted) if (members.count(e.song.get())) last.entries.push_back(e);
 		}
-		/// Compare *left < *right
-		bool operator()(std::shared_ptr<Song> const& left, std::shared_ptr<Song> const& right) {
-			return operator()(*left, *right);
-		}
-	};
+		last.songs = m_songs.size();
+		filtered.reserve(last.entries.size());
+		for (auto const& e: last.entries) filtered.push_back(e.song);
+		// Random order is the same either way (and keeps its order among equal indices)
+		if (query.descending && query.order != 0) std::reverse(filtered.begin(), filtered.end());
+	} catch (...) {
+		m_lastFilter.valid = false;
+		filtered = m_songs;  // Invalid regex => copy everything
+		sort_internal(filtered, query.order, query.descending);
+	}
+	return true;
+}
+
+namespace {
 
-	/// A helper for easily constructing CmpByField objects
-	template <typename T> CmpByField<T> customComparator(T Song::*field) { return CmpByField<T>(field); }
-	static const int types = 7, orders = 7;
+	static const int types = 7, orders = Songs::ORDERS;
 
 }
 
-std::string Songs::typeDesc() const {
+std::string const& Songs::typeDesc() const {
 	switch (m_type) {
-		case 0: return _("show all songs");
-		case 1: return _("has dance");
-		case 2: return _("has vocals");
-		case 3: return _("has duet");
-		case 4: return _("has guitar");
-		case 5: return _("drums or keytar");
-		case 6: return _("full band");
+		case 0: return _C("show all songs");
+		case 1: return _C("has dance");
+		case 2: return _C("has vocals");
+		case 3: return _C("has duet");
+		case 4: return _C("has guitar");
+		case 5: return _C("drums or keytar");
+		case 6: return _C("full band");
 	}
 	throw std::logic_error("Internal error: unknown type filter in Songs::typeDesc");
 }
@@ -428,7 +950,7 @@ void Songs::typeChange(int diff) {
 		m_type = (m_type + diff) % types;
 		if (m_type < 0) m_type += types;
 	}
-	filter_internal();
+	requestFilter();
 }
 
 void Songs::typeCycle(int cat) {
@@ -439,87 +961,214 @@ void Songs::typeCycle(int cat) {
 		if (categories[t] == cat) { type = t; break; }
 	}
 	m_type = type;
-	filter_internal();
+	requestFilter();
 }
 
-std::string Songs::sortDesc() const {
-	std::string str;
+std::string const& Songs::sortDesc() const {
 	switch (m_order) {
-	  case 0: str = _("random order"); break;
-	  case 1: str = _("sorted by song"); break;
-	  case 2: str = _("sorted by artist"); break;
-	  case 3: str = _("sorted by edition"); break;
-	  case 4: str = _("sorted by genre"); break;
-	  case 5: str = _("sorted by path"); break;
-	  case 6: str = _("sorted by language"); break;
+	  case 0: return _C("random order");
+	  case 1: return _C("sorted by song");
+	  case 2: return _C("sorted by artist");
+	  case 3: return _C("sorted by edition");
+	  case 4: return _C("sorted by genre");
+	  case 5: return _C("sorted by path");
+	  case 6: return _C("sorted by language");
+	  case 7: return _C("sorted by most played");
+	  case 8: return _C("sorted by highest score");
 	  default: throw std::logic_error("Internal error: unknown sort order in Songs::sortDesc");
 	}
-	return str;
 }
 
 void Songs::sortChange(int diff) {
 	m_order = (m_order + diff) % orders;
 	if (m_order < 0) m_order += orders;
-	RestoreSel restore(*this);
 	config["songs/sort-order"].i() = m_order;
-	switch (m_order) {
-		case 1:
-		 [[fallthrough]];
-		case 2:
-		 [[fallthrough]];
-		case 3:
-		 [[fallthrough]];
-		case 4:
-		 [[fallthrough]];
-		case 6:
-			UErrorCode collatorError = U_ZERO_ERROR;
-			UnicodeUtil::m_sortCollator.setAttribute(UCOL_STRENGTH, (config["game/case-sorting"].b()) ? UCOL_TERTIARY : UCOL_SECONDARY, collatorError);
-			if (U_FAILURE(collatorError)) {
-				std::clog << "sorting/error: Unable to change collator strength." << std::endl;
-			}
-			break;		
-		}
-	sort_internal();
+	requestFilter();
 	writeConfig(false);
 }
 
 void Songs::sortSpecificChange(int sortOrder, bool descending) {
 	if(sortOrder < 0) {
 		m_order = 0;
-	} else if(sortOrder <= 6) {
+	} else if(sortOrder < orders) {
 		m_order = sortOrder;
 	} else {
 		m_order = 0;
 	}
-	RestoreSel restore(*this);
 	config["songs/sort-order"].i() = m_order;
-	sort_internal(descending);
-}
-
-void Songs::sort_internal(bool descending) {
-	if(descending) {
-		switch (m_order) {
-		  case 0: std::stable_sort(m_filtered.begin(), m_filtered.end(), customComparator(&Song::randomIdx)); break;
-		  case 1: std::sort(m_filtered.rbegin(), m_filtered.rend(), customComparator(&Song::collateByTitle)); break;
-		  case 2: std::sort(m_filtered.rbegin(), m_filtered.rend(), customComparator(&Song::collateByArtist)); break;
-		  case 3: std::sort(m_filtered.rbegin(), m_filtered.rend(), customComparator(&Song::edition)); break;
-		  case 4: std::sort(m_filtered.rbegin(), m_filtered.rend(), customComparator(&Song::genre)); break;
-		  case 5: std::sort(m_filtered.rbegin(), m_filtered.rend(), customComparator(&Song::path)); break;
-		  case 6: std::sort(m_filtered.rbegin(), m_filtered.rend(), customComparator(&Song::language)); break;
-		  default: throw std::logic_error("Internal error: unknown sort order in Songs::sortChange");
+	filter_now(descending);
+}
+
+namespace {
+	/// ICU collation key of an UTF-8 string: comparing keys bytewise gives the same order as the collator
+	std::string sortKey(std::string const& str) {
+		icu::UnicodeString ustr = icu::UnicodeString::fromUTF8(str);
+		std::string key(64, '\0');
+		int32_t len = UnicodeUtil::sortCollator().getSortKey(ustr, reinterpret_cast<std::uint8_t*>(&key[0]), key.size());
+		if (len > int32_t(key.size())) {
+			key.resize(len);
+			len = UnicodeUtil::sortCollator().getSortKey(ustr, reinterpret_cast<std::uint8_t*>(&key[0]), key.size());
+		}
+		if (len == 0) throw std::runtime_error("unicode/error: Sorting comparison error in sortKey");
+		key.resize(len - 1);  // Terminating zero
+		return key;
+	}
+
+	/// Comparison of sort entries for a sort order
+	std::function<bool (Songs::SortEntry const&, Songs::SortEntry const&)> lessBy(int order) {
+		switch (order) {
+		  case 0: return [](Songs::SortEntry const& a, Songs::SortEntry const& b) { return a.song->randomIdx < b.song->randomIdx; };
+		  case 5: return [](Songs::SortEntry const& a, Songs::SortEntry const& b) { return a.song->path < b.song->path; };
+		  default: return [](Songs::SortEntry const& a, Songs::SortEntry const& b) { return a.key < b.key; };
+		}
+	}
+
+	/// A key that sorts larger values first
+	std::string descendingKey(std::uint64_t value) {
+		std::string key(8, '\0');
+		for (int i = 0; i < 8; ++i) key[i] = char(~value >> (56 - 8 * i));
+		return key;
+	}
+
+	/// Sort entry of a song for a sort order (collation keys for the text orders, database summaries for plays and scores)
+	Songs::SortEntry entryBy(int order, std::shared_ptr<Song> const& song, Database const& database) {
+		switch (order) {
+		  case 7: {
+			SongSummary summary = database.summary(*song);
+			return { descendingKey(summary.plays) + descendingKey(summary.lastPlayed), song };
+		  }
+		  case 8: return { descendingKey(database.summary(*song).topScore), song };
+		  case 1: return { sortKey(song->collateByTitle()), song };
+		  case 2: return { sortKey(song->collateByArtist()), song };
+		  case 3: return { sortKey(song->edition), song };
+		  case 4: return { sortKey(song->genre), song };
+		  case 6: return { sortKey(song->language), song };
+		  default: return { std::string(), song };
+		}
+	}
+
+	/// Append the sort entries of songs from position begin on, computed in parallel for large libraries
+	void appendEntries(std::vector<Songs::SortEntry>& entries, int order, std::vector<std::shared_ptr<Song>> const& songs, std::size_t begin, Database const& database) {
+		const std::size_t offset = entries.size();
+		entries.resize(offset + songs.size() - begin);
+		forChunks(chunks(songs.size() - begin), [&](std::size_t, std::size_t b, std::size_t e) {
+			for (std::size_t i = b; i < e; ++i) entries[offset + i] = entryBy(order, songs[begin + i], database);
+		});
+	}
+
+	/// Stable sort of the entries from position begin on: chunks are sorted in parallel and then merged pairwise
+	template <typename Less> void parallelStableSort(std::vector<Songs::SortEntry>& entries, std::size_t begin, Less const& less) {
+		auto first = entries.begin() + begin;
+		const std::vector<std::size_t> bounds = chunks(entries.end() - first);
+		forChunks(bounds, [&](std::size_t, std::size_t b, std::size_t e) { std::stable_sort(first + b, first + e, less); });
+		// The earlier run goes first among equals, which keeps the sort stable
+		const std::size_t runs = bounds.size() - 1;
+		for (std::size_t width = 1; width < runs; width *= 2) {
+			std::vector<std::future<void>> merges;
+			for (std::size_t i = 0; i + width < runs; i += 2 * width) {
+				auto mid = first + bounds[i + width], last = first + bounds[std::min(i + 2 * width, runs)];
+				merges.push_back(std::async(std::launch::async, [&less, a = first + bounds[i], mid, last] { std::inplace_merge(a, mid, last, less); }));
+			}
+			for (auto& m: merges) m.get();
+		}
+	}
+}
+
+std::vector<Songs::SortEntry> const& Songs::sorted_internal(int order) {
+	// Songs appended to m_songs since the last call are merged into the existing orders, other changes start over
+	int strength = config["game/case-sorting"].b() ? UCOL_TERTIARY : UCOL_SECONDARY;
+	if (strength != m_sortStrength) UnicodeUtil::setSortStrength(icu::Collator::ECollationStrength(strength));
+	std::size_t same = 0;
+	while (same < m_sortBase.size() && same < m_songs.size() && m_sortBase[same] == m_songs[same]) ++same;
+	if (same < m_sortBase.size() || strength != m_sortStrength) {
+		for (auto& entries: m_sorted) entries.clear();
+		m_sortBase.clear();
+		m_sortStrength = strength;
+	}
+	m_sorted.resize(orders);
+	// Plays and hiscores change without the songs changing
+	if (m_database.generation() != m_summaryGeneration) {
+		m_summaryGeneration = m_database.generation();
+		m_sorted[7].clear();
+		m_sorted[8].clear();
+	}
+	// Merge new songs into the orders computed so far
+	if (m_sortBase.size() < m_songs.size()) {
+		std::size_t old = m_sortBase.size();
+		m_sortBase.insert(m_sortBase.end(), m_songs.begin() + old, m_songs.end());
+		for (int o = 0; o < orders; ++o) {
+			auto& entries = m_sorted[o];
+			if (entries.empty()) continue;
+			auto cmp = lessBy(o);
+			appendEntries(entries, o, m_sortBase, old, m_database);
+			parallelStableSort(entries, old, cmp);
+			std::inplace_merge(entries.begin(), entries.begin() + old, entries.end(), cmp);
 		}
+	}
+	auto& entries = m_sorted[order];
+	if (entries.empty()) {
+		appendEntries(entries, order, m_sortBase, 0, m_database);
+		parallelStableSort(entries, 0, lessBy(order));
+	}
+	return m_sorted[order];
+}
+
+void Songs::sort_internal(SongVector& songs, int order, bool descending) {
+	if (songs.empty()) return;
+	auto const& entries = sorted_internal(order);
+	// Pick the songs from the presorted list (songs removed from m_songs since they were filtered get dropped)
+	std::unordered_set<Song const*> members;
+	for (auto const& song: songs) members.insert(song.get());
+	SongVector sorted;
+	sorted.reserve(songs.size());
+	for (auto const& e: entries) if (members.count(e.song.get())) sorted.push_back(e.song);
+	// Random order is the same either way (and keeps its order among equal indices)
+	if (descending && order != 0) std::reverse(sorted.begin(), sorted.end());
+	songs.swap(sorted);
+}
+
+std::shared_ptr<Songs::Snapshot const> Songs::snapshot() {
+	std::lock_guard<lockstats::Mutex> l(m_mutex);
+	if (!m_snapshot || m_snapshot->generation() != m_generation) m_snapshot = std::make_shared<Snapshot const>(m_songs, m_generation, m_database);
+	return m_snapshot;
+}
+
+Songs::Snapshot::Snapshot(SongVector const& songs, unsigned generation, Database const& database):
+  m_songs(songs), m_generation(generation), m_database(database) {}
+
+Songs::Snapshot::SongVector Songs::Snapshot::query(std::string const& filter, int type, int order, bool descending) const {
+	if (order < 0 || order >= orders) order = 0;
+	auto const& entries = sorted(order);
+	SongVector result;
+	if (filter.empty() && type == 0) {
+		result.reserve(entries.size());
+		for (auto const& e: entries) result.push_back(e.song);
 	} else {
-		switch (m_order) {
-		  case 0: std::stable_sort(m_filtered.begin(), m_filtered.end(), customComparator(&Song::randomIdx)); break;
-		  case 1: std::sort(m_filtered.begin(), m_filtered.end(), customComparator(&Song::collateByTitle)); break;
-		  case 2: std::sort(m_filtered.begin(), m_filtered.end(), customComparator(&Song::collateByArtist)); break;
-		  case 3: std::sort(m_filtered.begin(), m_filtered.end(), customComparator(&Song::edition)); break;
-		  case 4: std::sort(m_filtered.begin(), m_filtered.end(), customComparator(&Song::genre)); break;
-		  case 5: std::sort(m_filtered.begin(), m_filtered.end(), customComparator(&Song::path)); break;
-		  case 6: std::sort(m_filtered.begin(), m_filtered.end(), customComparator(&Song::language)); break;
-		  default: throw std::logic_error("Internal error: unknown sort order in Songs::sortChange");
+		std::unordered_set<Song const*> members;
+		try {
+			SearchTerm search(filter);
+			std::call_once(m_indexed, [this] { m_index.sync(m_songs); });
+			SearchTerm::Matcher matches(search);
+			for (std::uint32_t pos: m_index.candidates(search.folded())) {
+				Song const& song = *m_songs[pos];
+				if (typeMatches(song, type) && matches(m_index, pos)) members.insert(&song);
+			}
+		} catch (...) {
+			for (auto const& song: m_songs) members.insert(song.get());  // Invalid search => everything
 		}
+		for (auto const& e: entries) if (members.count(e.song.get())) result.push_back(e.song);
 	}
+	if (descending && order != 0) std::reverse(result.begin(), result.end());
+	return result;
+}
+
+std::vector<Songs::SortEntry> const& Songs::Snapshot::sorted(int order) const {
+	std::call_once(m_sortedOnce[order], [this, order] {
+		auto& entries = m_sorted[order];
+		appendEntries(entries, order, m_songs, 0, m_database);
+		parallelStableSort(entries, 0, lessBy(order));
+	});
+	return m_sorted[order];
 }
 
 namespace {
@@ -545,9 +1194,9 @@ namespace {
 			xmlpp::Element* song = xmlpp::add_child_element(songlist, "song");
 			song->set_attribute("num", std::to_string(i + 1));
 			xmlpp::Element* collate = xmlpp::add_child_element(song, "collate");
-			xmlpp::set_first_child_text(xmlpp::add_child_element(collate, "artist"), s.collateByArtist);
-			xmlpp::set_first_child_text(xmlpp::add_child_element(collate, "title"), s.collateByTitle);
-			xmlpp::set_first_child_text(xmlpp::add_child_element(song, "artist"), s.artist);
+			xmlpp::set_first_child_text(xmlpp::add_child_element(collate, "artist"), s.collateByArtist());
+			xmlpp::set_first_child_text(xmlpp::add_child_element(collate, "title"), s.collateByTitle());
+			xmlpp::set_first_child_text(xmlpp::add_child_element(song, "artist"), s.artist.str());
 			xmlpp::set_first_child_text(xmlpp::add_child_element(song, "title"), s.title);
 			if (!s.cover.empty()) dumpCover(song, s, i + 1);
 		}
@@ -557,8 +1206,11 @@ namespace {
 
 void Songs::dumpSongs_internal() const {
 	if (m_songlist.empty()) return;
-	SongVector svec = m_songs;
-	std::sort(svec.begin(), svec.end(), customComparator(&Song::collateByArtist));
+	std::vector<SortEntry> entries;
+	appendEntries(entries, 2, m_songs, 0, m_database);  // By artist
+	parallelStableSort(entries, 0, lessBy(2));
+	SongVector svec;
+	for (auto const& e: entries) svec.push_back(e.song);
 	fs::path coverpath = fs::path(m_songlist) / "covers";
 	fs::create_directories(coverpath);
 	dumpXML(svec, m_songlist + "/songlist.xml");
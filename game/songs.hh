@@ -2,7 +2,14 @@
 
 #include "animvalue.hh"
 #include "fs.hh"
+#include "lockstats.hh"
+#include "metrics.hh"
+#include "songcache.hh"
+#include "songindex.hh"
+#include <array>
 #include <atomic>
+#include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <set>
@@ -12,6 +19,7 @@
 #include "screen.hh"
 
 class Song;
+class SongWatcher;
 class Database;
 
 /// songs class for songs screen
@@ -19,8 +27,8 @@ class Songs {
   public:
   	Songs(const Songs&) = delete;
   	const Songs& operator=(const Songs&) = delete;
-	/// constructor
-	Songs(Database& database, std::string const& songlist = std::string());
+	/// constructor (the song cache goes to cacheDir, empty for getCacheDir())
+	Songs(Database& database, std::string const& songlist = std::string(), fs::path const& cacheDir = fs::path());
 	~Songs();
 	/// updates filtered songlist
 	void update();
@@ -54,36 +62,78 @@ class Songs {
 	Song& current() { return *m_filtered[math_cover.getTarget()]; }
 	/// @return current Song
 	Song const& current() const { return *m_filtered[math_cover.getTarget()]; }
-	/// filters songlist by regular expression
-	void setFilter(std::string const& regex);
+	/// filters songlist by search string, with background=true the result appears in a later update() (for interactive search)
+	void setFilter(std::string const& regex, bool background = false);
 	/// Get the current song type filter number
 	int typeNum() const { return m_type; }
 	/// Description of the current song type filter
-	std::string typeDesc() const;
-	/// Change song type filter (diff is normally -1 or 1; 0 has special meaning of reset)
+	std::string const& typeDesc() const;
+	/// Change song type filter (diff is normally -1 or 1; 0 has special meaning of reset), applied in the background
 	void typeChange(int diff);
-	/// Cycle song type filters by filter category (0 = none, 1..4 = different categories)
+	/// Cycle song type filters by filter category (0 = none, 1..4 = different categories), applied in the background
 	void typeCycle(int cat);
+	/// Number of sort orders
+	static const int ORDERS = 9;
 	int sortNum() const { return m_order; }
 	/// Description of the current sort mode
-	std::string sortDesc() const;
-	/// Change sorting mode (diff is normally -1 or 1)
+	std::string const& sortDesc() const;
+	/// Change sorting mode (diff is normally -1 or 1), applied in the background
 	void sortChange(int diff);
 	void sortSpecificChange(int sortOrder, bool descending = false);
 	/// parses file into Song &tmp
 	void parseFile(Song& tmp);
+	/**
+	* Parse song again if its file changed since it was parsed (songs/lazy_validation leaves that to when a song is
+	* played) and put the new Song in the library in its place (main thread only). Other threads may be reading the
+	* headers of the old one, so it is never changed in place. Returns the song to use, which is song if unchanged.
+	**/
+	std::shared_ptr<Song> refresh(std::shared_ptr<Song> const& song);
 	std::atomic<bool> doneLoading{ false };
 	std::atomic<bool> displayedAlert{ false };
 	size_t loadedSongs() const { return m_songs.size(); }
+	/// Changes whenever songs are added to or removed from the library (for caching anything derived from it)
+	unsigned generation() const { return m_generation; }
+	/// A song with its collation key for one sort order (empty for orders not sorted by text)
+	struct SortEntry {
+		std::string key;
+		std::shared_ptr<Song> song;
+	};
+	/// Timing of the latest full reload
+	struct LoadStats {
+		double cacheLoad = 0.0;  ///< Seconds in LoadCache
+		double scan = 0.0;  ///< Seconds from starting the scan until all files are parsed
+		double cacheSave = 0.0;  ///< Seconds in CacheSonglist
+		std::size_t cached = 0;  ///< Songs loaded from the cache
+		struct Format {
+			unsigned files = 0;
+			unsigned failed = 0;
+			double seconds = 0.0;  ///< Parse time summed over loader threads
+		};
+		std::map<std::string, Format> formats;  ///< Files parsed by extension (lower case)
+	};
+	/// Get the statistics (complete once doneLoading is set)
+	LoadStats loadStats() const;
+	class Snapshot;
+	/// The library as of now for other threads (web requests), without touching the filtered list of the song browser
+	std::shared_ptr<Snapshot const> snapshot();
 
   private:
   	void LoadCache();
 	void CacheSonglist();
 
 	class RestoreSel;
+	class Loader;
+	/// Modification time and subfolders of a scanned folder; unchanged folders are not listed again
+	typedef SongCache::Dir DirStamp;
+	typedef SongCache::Dirs DirStamps;
+	DirStamps m_dirs;  ///< Folders from the song cache (loader thread only)
+	DirStamps m_scannedDirs;  ///< Folders visited by the current scan, saved to the song cache (loader thread only)
 	typedef std::vector<std::shared_ptr<Song> > SongVector;
 	std::string m_songlist;
+	fs::path m_cacheDir;
+	LoadStats m_stats;  ///< (guarded by m_mutex)
 	SongVector m_songs, m_filtered;
+	SongIndex m_index;  ///< Search index of m_songs (guarded by m_mutex)
 	AnimValue m_updateTimer;
 	AnimAcceleration math_cover;
 	std::string m_filter;
@@ -92,13 +142,90 @@ class Songs {
 	int m_order;  // Set by constructor
 	void dumpSongs_internal() const;
 	void reload_internal();
-	void reload_internal(fs::path const& p);
+	void reload_internal(fs::path const& p, Loader& loader);
+	void update_internal(std::vector<fs::path> const& dirs);
+	void removeStale(SongVector& songs, bool lazy);
+	void watchScanned();
 	void randomize_internal();
-	void filter_internal();
-	void sort_internal(bool descending = false);
+	/// Filter and sort parameters (a snapshot of m_filter, m_type and m_order)
+	struct FilterQuery {
+		std::string filter;
+		int type;
+		int order;
+		bool descending;
+	};
+	/// The matches of the latest query, so that songs appended while loading only need to be merged in (guarded by m_mutex)
+	struct LastFilter {
+		bool valid = false;
+		std::string filter;
+		int type = 0;
+		int order = 0;
+		unsigned removals = 0;  ///< m_removals of the query
+		int strength = -1;  ///< m_sortStrength of the entries
+		unsigned summaryGeneration = 0;  ///< m_summaryGeneration of the entries
+		std::size_t songs = 0;  ///< Prefix of m_songs filtered
+		std::vector<SortEntry> entries;  ///< The matches, in ascending order
+	};
+	LastFilter m_lastFilter;
+	unsigned m_removals = 0;  ///< Incremented whenever songs are removed from m_songs, which voids m_lastFilter (guarded by m_mutex)
+	void requestFilter();
+	void filter_now(bool descending = false);
+	void filterResults();
+	void filterWorker();
+	/// Returns false if cancelled by a newer query (m_filterGeneration changed)
+	bool filter_internal(FilterQuery const& query, SongVector& filtered, unsigned generation);
+	void sort_internal(SongVector& songs, int order, bool descending);
+	std::vector<SortEntry> const& sorted_internal(int order);
+	// Presorted permutations of m_songs, so that sorting m_filtered is a linear pass (guarded by m_mutex)
+	SongVector m_sortBase;  ///< The songs in m_sorted (a prefix of m_songs unless songs were removed)
+	std::vector<std::vector<SortEntry>> m_sorted;  ///< By sort order, empty until first needed
+	int m_sortStrength = -1;  ///< Collator strength of the keys in m_sorted
+	unsigned m_summaryGeneration = 0;  ///< Database::generation() of the orders by plays and scores in m_sorted
 	std::atomic<bool> m_dirty{ false };
+	std::atomic<unsigned> m_generation{ 0 };
+	std::shared_ptr<Snapshot const> m_snapshot;  ///< Of the current generation, unless changed since (guarded by m_mutex)
 	std::atomic<bool> m_loading{ false };
 	std::unique_ptr<std::thread> m_thread;
-	mutable std::mutex m_mutex;
+	std::unique_ptr<SongWatcher> m_watcher;  ///< Only if songs/watch is enabled
+	mutable lockstats::Mutex m_mutex{ "songs" };
+	// Background filtering: the worker computes the latest query and update() installs the result in m_filtered
+	std::thread m_filterThread;
+	std::mutex m_filterMutex;
+	std::condition_variable m_filterCond;
+	std::atomic<unsigned> m_filterGeneration{ 0 };  ///< Incremented by every query
+	FilterQuery m_filterQuery;  ///< Query waiting for the worker (guarded by m_filterMutex)
+	bool m_filterPending = false;  ///< (guarded by m_filterMutex)
+	bool m_filterQuit = false;  ///< (guarded by m_filterMutex)
+	SongVector m_filterResult;  ///< Result waiting for update() (guarded by m_filterMutex)
+	unsigned m_filterResultGeneration = 0;  ///< (guarded by m_filterMutex)
+	bool m_filterResultReady = false;  ///< (guarded by m_filterMutex)
+	metrics::Family m_loadedMetric{ "performous_songs_loaded", "Songs in the library (so far, while scanning)", "gauge",
+	  [this]() -> double { std::lock_guard<lockstats::Mutex> l(m_mutex); return m_songs.size(); } };
+	metrics::Family m_scanningMetric{ "performous_songs_scanning", "1 while the song folders are being scanned", "gauge",
+	  [this]() -> double { return m_loading; } };
 };
 
+/**
+* An immutable copy of the song library (see Songs::snapshot()), which any number of threads may query at once.
+* The search index and sort orders are built on first use and kept for the lifetime of the snapshot.
+**/
+class Songs::Snapshot {
+  public:
+	typedef std::vector<std::shared_ptr<Song>> SongVector;
+	Snapshot(SongVector const& songs, unsigned generation, Database const& database);
+	/// Songs::generation() of the copied library
+	unsigned generation() const { return m_generation; }
+	/// All songs, in the order they were loaded
+	SongVector const& songs() const { return m_songs; }
+	/// Songs matching a search text and type filter (as in the song browser, see typeDesc), in a sort order (see sortDesc)
+	SongVector query(std::string const& filter, int type, int order, bool descending = false) const;
+  private:
+	std::vector<SortEntry> const& sorted(int order) const;
+	const SongVector m_songs;
+	const unsigned m_generation;
+	Database const& m_database;
+	mutable SongIndex m_index;
+	mutable std::once_flag m_indexed;
+	mutable std::array<std::vector<SortEntry>, ORDERS> m_sorted;  ///< By sort order
+	mutable std::array<std::once_flag, ORDERS> m_sortedOnce;
+};
@@ -0,0 +1,100 @@
+#include "songwatcher.hh"
+#include "threads.hh"
+
+#include <iostream>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	/// How long folders must stay quiet before their changes are handed out
+	const std::chrono::seconds SETTLE_TIME(2);
+}
+
+#ifdef __linux__
+
+SongWatcher::SongWatcher(): m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+	if (m_fd < 0) {
+		std::clog << "songs/warning: Cannot watch song folders: " << std::strerror(errno) << std::endl;
+		return;
+	}
+	m_thread = std::thread(&SongWatcher::run, this);
+}
+
+SongWatcher::~SongWatcher() {
+	if (m_fd < 0) return;
+	m_quit = true;
+	m_thread.join();
+	close(m_fd);
+}
+
+void SongWatcher::watch(std::vector<fs::path> const& dirs) {
+	if (m_fd < 0) return;
+	const std::uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR;
+	std::lock_guard<std::mutex> l(m_mutex);
+	for (auto const& dir: dirs) {
+		std::string name = dir.string();
+		if (m_full || m_watched.count(name)) continue;
+		int wd = inotify_add_watch(m_fd, name.c_str(), mask);
+		if (wd < 0) {
+			if (errno != ENOSPC) continue;  // Folder vanished or similar, its parent will notice
+			std::clog << "songs/warning: Too many song folders to watch them all, see /proc/sys/fs/inotify/max_user_watches" << std::endl;
+			m_full = true;
+			continue;
+		}
+		m_watches[wd] = name;  // The same folder under another name (e.g. a symlink) gets the same descriptor
+		m_watched.insert(name);
+	}
+}
+
+std::vector<fs::path> SongWatcher::takeChanged() {
+	std::lock_guard<std::mutex> l(m_mutex);
+	if (m_changed.empty() || std::chrono::steady_clock::now() - m_lastChange < SETTLE_TIME) return {};
+	std::vector<fs::path> ret(m_changed.begin(), m_changed.end());
+	m_changed.clear();
+	return ret;
+}
+
+void SongWatcher::run() {
+	threads::enter(threads::Class::io, "song watcher");
+	alignas(inotify_event) char buf[4096];
+	while (!m_quit) {
+		pollfd p = { m_fd, POLLIN, 0 };
+		if (poll(&p, 1, 200) <= 0) continue;
+		ssize_t len = read(m_fd, buf, sizeof(buf));
+		if (len <= 0) continue;
+		std::lock_guard<std::mutex> l(m_mutex);
+		for (char const* ptr = buf; ptr < buf + len; ) {
+			auto ev = reinterpret_cast<inotify_event const*>(ptr);
+			ptr += sizeof(inotify_event) + ev->len;
+			auto it = m_watches.find(ev->wd);
+			if (it == m_watches.end()) continue;
+			if (ev->mask & IN_IGNORED) {  // Folder removed (its parent reports the change)
+				m_watched.erase(it->second);
+				m_watches.erase(it);
+				continue;
+			}
+			m_changed.insert(it->second);
+			m_lastChange = std::chrono::steady_clock::now();
+		}
+	}
+}
+
+#else
+
+SongWatcher::SongWatcher() {
+	std::clog << "songs/info: Watching song folders is not supported on this platform." << std::endl;
+}
+
+SongWatcher::~SongWatcher() {}
+
+void SongWatcher::watch(std::vector<fs::path> const&) {}
+
+std::vector<fs::path> SongWatcher::takeChanged() { return {}; }
+
+#endif
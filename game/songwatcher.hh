@@ -0,0 +1,41 @@
+#pragma once
+
+#include "fs.hh"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+* Watches song folders for added, removed and modified files (inotify on Linux; elsewhere this does nothing).
+* Changes are collected per folder and handed out once no further changes have arrived for a moment,
+* so that a song being copied in is only picked up after all of its files are there.
+**/
+class SongWatcher {
+  public:
+	SongWatcher();
+	~SongWatcher();
+	/// Is watching supported and working?
+	bool active() const { return m_fd >= 0; }
+	/// Start watching folders (ones already watched are ignored). Thread-safe.
+	void watch(std::vector<fs::path> const& dirs);
+	/// Take the folders that have changed, or nothing if changes are still coming in. Thread-safe.
+	std::vector<fs::path> takeChanged();
+
+  private:
+	void run();
+	int m_fd = -1;
+	std::mutex m_mutex;
+	std::unordered_map<int, std::string> m_watches;  ///< Folders by watch descriptor
+	std::unordered_set<std::string> m_watched;
+	std::set<std::string> m_changed;
+	std::chrono::steady_clock::time_point m_lastChange;
+	bool m_full = false;  ///< Watch limit reached (warned once)
+	std::atomic<bool> m_quit{ false };
+	std::thread m_thread;
+};
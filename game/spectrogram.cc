@@ -0,0 +1,73 @@
+#include "spectrogram.hh"
+
+#include "pitch.hh"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	const double SHOW_MINFREQ = 50.0, SHOW_MAXFREQ = 2000.0;  ///< Range shown (the texture only holds the bins up to SHOW_MAXFREQ)
+	const double LEVEL_MINDB = -100.0, LEVEL_MAXDB = -30.0;  ///< Levels mapped to the color scale
+}
+
+void Spectrogram::addStep(Analyzer const& analyzer) {
+	const double freqPerBin = analyzer.analysisRate() / analyzer.fftSize();
+	const unsigned bins = std::min<std::size_t>(analyzer.fftSize() / 2, std::ceil(SHOW_MAXFREQ / freqPerBin)) + 1;
+	if (bins != m_bins || m_resize) {
+		// A new analyzer profile: start over
+		m_resize = true;
+		m_bins = bins;
+		m_topFreq = bins * freqPerBin;
+		m_pending.clear();
+	}
+	// Rows older than the history will not be seen anyway
+	if (m_pending.size() >= std::size_t(ROWS) * m_bins) m_pending.erase(m_pending.begin(), m_pending.begin() + m_bins);
+	if (analyzer.gated()) { m_pending.resize(m_pending.size() + m_bins, 0); return; }  // No spectrum of silence
+	Analyzer::fft_t const& fft = analyzer.getFFT();
+	const double normCoeff = 1.0 / analyzer.fftSize();
+	for (unsigned k = 0; k < m_bins; ++k) {
+		const double db = 20.0 * std::log10(normCoeff * std::abs(fft[k]) + 1e-12);
+		const double level = (db - LEVEL_MINDB) / (LEVEL_MAXDB - LEVEL_MINDB);
+		m_pending.push_back(std::lround(255.0 * std::min(1.0, std::max(0.0, level))));
+	}
+}
+
+void Spectrogram::draw(Dimensions const& dim) {
+	if (m_bins == 0) return;
+	glutil::GLErrorChecker glerror("Spectrogram::draw");
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (m_resize) {
+		UseTexture tex(m_texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);  // Time wraps around the ring
+		const std::vector<std::uint8_t> blank(std::size_t(m_bins) * ROWS);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, m_bins, ROWS, 0, GL_RED, GL_UNSIGNED_BYTE, blank.data());
+		m_memory.set(blank.size());
+		m_row = 0;
+		m_resize = false;
+	}
+	// Upload the new rows into the ring, in two parts if they wrap over
+	if (!m_pending.empty()) {
+		UseTexture tex(m_texture);
+		const unsigned rows = m_pending.size() / m_bins;
+		const unsigned first = std::min(rows, ROWS - m_row);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, m_row, m_bins, first, GL_RED, GL_UNSIGNED_BYTE, m_pending.data());
+		if (first < rows) glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_bins, rows - first, GL_RED, GL_UNSIGNED_BYTE, m_pending.data() + std::size_t(first) * m_bins);
+		m_row = (m_row + rows) % ROWS;
+		m_pending.clear();
+	}
+	glerror.check("upload");
+	UseShader shader(getShader("spectrogram"));
+	glutil::bindTexture(GL_TEXTURE_2D, m_texture.id());
+	shader()[UniformId::scroll].set(float(m_row) / ROWS);
+	shader()[UniformId::freqRange].set(float(SHOW_MINFREQ / m_topFreq), float(SHOW_MAXFREQ / m_topFreq));
+	glutil::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glutil::VertexArray va;
+	va.texCoord(0.0f, 0.0f).vertex(dim.x1(), dim.y1());
+	va.texCoord(1.0f, 0.0f).vertex(dim.x2(), dim.y1());
+	va.texCoord(0.0f, 1.0f).vertex(dim.x1(), dim.y2());
+	va.texCoord(1.0f, 1.0f).vertex(dim.x2(), dim.y2());
+	va.draw();
+}
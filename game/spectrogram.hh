@@ -0,0 +1,31 @@
+#pragma once
+
+#include "memstats.hh"
+#include "texture.hh"
+
+#include <cstdint>
+#include <vector>
+
+class Analyzer;
+
+/**
+* Scrolling spectrogram of an analyzer. Each analysis step adds one row to a ring texture (uploaded with
+* glTexSubImage2D when drawn) and the spectrogram shader scrolls and colors it, so drawing costs no CPU
+* beyond the new rows.
+**/
+class Spectrogram {
+  public:
+	/// Add the current spectrum of analyzer (call from the onStep of Analyzer::process, in the main thread)
+	void addStep(Analyzer const& analyzer);
+	/// Draw the history, oldest step at left and logarithmic frequency from bottom to top
+	void draw(Dimensions const& dim);
+  private:
+	static const unsigned ROWS = 1024;  ///< Steps of history
+	OpenGLTexture<GL_TEXTURE_2D> m_texture;
+	memstats::Usage m_memory{ "textures/spectrogram", memstats::Kind::VRAM };
+	unsigned m_bins = 0;  ///< Width of the texture (0 until allocated)
+	double m_topFreq = 0.0;  ///< Frequency at the right edge of the texture
+	unsigned m_row = 0;  ///< Next row to write (the oldest one)
+	std::vector<std::uint8_t> m_pending;  ///< Rows added since the last draw
+	bool m_resize = false;  ///< Reallocate the texture at the next draw
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+/**
+* Wait-free single-producer single-consumer queue of fixed capacity.
+* Only the producer calls push() and only the consumer calls front()/pop()/tryPop(), each from one
+* thread at a time (multiple producers must serialize with a mutex of their own). Slots are reused,
+* so the consumer never allocates or frees memory; a popped slot is only overwritten by the next push.
+**/
+template <typename T, std::size_t SIZE> class SpscQueue {
+	static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "SpscQueue SIZE must be a power of two");
+public:
+	constexpr static std::size_t capacity = SIZE;
+	/// Add an item (producer only). Returns false (and leaves item untouched) if the queue is full.
+	template <typename U> bool push(U&& item) {
+		const std::size_t w = m_write.load(std::memory_order_relaxed);
+		if (w - m_read.load(std::memory_order_acquire) == SIZE) return false;
+		m_items[w & (SIZE - 1)] = std::forward<U>(item);
+		m_write.store(w + 1, std::memory_order_release);
+		return true;
+	}
+	/// Get the oldest item (consumer only), or nullptr if the queue is empty. The item stays queued until pop().
+	T* front() {
+		const std::size_t r = m_read.load(std::memory_order_relaxed);
+		if (r == m_write.load(std::memory_order_acquire)) return nullptr;
+		return &m_items[r & (SIZE - 1)];
+	}
+	/// Remove the item returned by front() (consumer only)
+	void pop() { m_read.store(m_read.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+	/// Move the oldest item to item and remove it (consumer only). Returns false if the queue was empty.
+	bool tryPop(T& item) {
+		T* f = front();
+		if (!f) return false;
+		item = std::move(*f);
+		pop();
+		return true;
+	}
+	bool empty() const { return m_read.load(std::memory_order_acquire) == m_write.load(std::memory_order_acquire); }
+private:
+	std::array<T, SIZE> m_items;
+	std::atomic<std::size_t> m_read{ 0 };
+	std::atomic<std::size_t> m_write{ 0 };
+};
@@ -3,21 +3,32 @@
 #include "cache.hh"
 #include "configuration.hh"
 #include "image.hh"
+#include "log.hh"
 
 #include <librsvg/rsvg.h>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 
 // Avoid deprecation messages with new versions since Ubuntu 12.10.
 #if LIBRSVG_MAJOR_VERSION * 10000 + LIBRSVG_MINOR_VERSION * 100 + LIBRSVG_MICRO_VERSION < 23602
 #include <librsvg/rsvg-cairo.h>
 #endif
 
+// Note: this is called by several TextureLoader threads at once, each with its own RsvgHandle.
 void loadSVG(Bitmap& bitmap, fs::path const& filename) {
 	double factor = config["graphic/svg_lod"].f();
-	// Try to load a cached PNG instead
-	if (cache::loadSVG(bitmap, filename, factor)) return;
-	std::clog << "image/debug: Loading SVG: " + filename.string() << std::endl;
-	// Open the SVG file in librsvg
+	// Read the file (also for identifying it in the cache)
+	std::string data;
+	{
+		std::ifstream f(filename.string(), std::ios::binary);
+		data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+		if (!f && !f.eof()) throw std::runtime_error("Unable to read " + filename.string());
+	}
+	// Try to load a cached rasterization instead
+	if (cache::loadSVG(bitmap, data, factor)) return;
+	LOG("image", debug) << "Loading SVG: " + filename.string() << std::endl;
+	// Open the SVG file in librsvg (from the file, so that relative links work)
 #if !GLIB_CHECK_VERSION(2, 36, 0)   // Avoid deprecation warnings
 	g_type_init();
 #endif
@@ -32,24 +43,24 @@ void loadSVG(Bitmap& bitmap, fs::path const& filename) {
 	rsvg_handle_get_dimensions(svgHandle.get(), &svgDimension);
 	// Prepare the pixel buffer
 	bitmap.resize(svgDimension.width*factor, svgDimension.height*factor);
-	bitmap.fmt = pix::INT_ARGB;
+	bitmap.fmt = pix::INT_ARGB;  // Uploaded as is (GL_BGRA), no need to change the byte order
 	bitmap.linearPremul = true;
 	// Raster with Cairo
 	std::shared_ptr<cairo_surface_t> surface(
 	  cairo_image_surface_create_for_data(&bitmap.buf[0], CAIRO_FORMAT_ARGB32, bitmap.width, bitmap.height, bitmap.width * 4),
 	  cairo_surface_destroy);
 	std::shared_ptr<cairo_t> dc(cairo_create(surface.get()), cairo_destroy);
+	// Start from transparent (the buffer may be a recycled one)
+	cairo_set_operator(dc.get(), CAIRO_OPERATOR_CLEAR);
+	cairo_paint(dc.get());
+	cairo_set_operator(dc.get(), CAIRO_OPERATOR_OVER);
 	cairo_scale(dc.get(), factor, factor);
 	rsvg_handle_render_cairo(svgHandle.get(), dc.get());
-	// Change byte order from BGRA to RGBA
-	for (uint32_t *ptr = reinterpret_cast<uint32_t*>(bitmap.buf.data()), *end = ptr + bitmap.buf.size() / 4; ptr < end; ++ptr) {
-		uint8_t* pixel = reinterpret_cast<uint8_t*>(ptr);
-		uint8_t r = pixel[2], g = pixel[1], b = pixel[0], a = pixel[3];
-		pixel[0] = r; pixel[1] = g; pixel[2] = b; pixel[3] = a;
-	}
-	bitmap.fmt = pix::CHAR_RGBA;
+	cairo_surface_flush(surface.get());
 	// Write to cache so that it can be loaded faster the next time
-	fs::path cache_filename = cache::constructSVGCacheFileName(filename, factor);
-	fs::create_directories(cache_filename.parent_path());
-	writePNG(cache_filename, bitmap);
+	try {
+		cache::saveSVG(bitmap, data, factor);
+	} catch (std::exception& e) {
+		std::clog << "image/warning: Cannot cache " << filename << ": " << e.what() << std::endl;
+	}
 }
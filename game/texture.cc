@@ -1,17 +1,29 @@
 #include "texture.hh"
 
 #include "configuration.hh"
+#include "lockstats.hh"
+#include "metrics.hh"
 #include "video_driver.hh"
 #include "screen.hh"
 #include "svg.hh"
+#include "texturecache.hh"
+#include "threads.hh"
+#include "themebundle.hh"
+#include "profiler.hh"
+#include "util.hh"
 #include <boost/algorithm/string/case_conv.hpp>
 #include <boost/filesystem.hpp>
 #include <atomic>
 #include <cctype>
+#include <chrono>
 #include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <queue>
 #include <stdexcept>
 #include <sstream>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 using std::uint32_t;
@@ -29,91 +41,183 @@ float Dimensions::screenY() const {
 	throw std::logic_error("Dimensions::screenY(): unknown m_screenAnchor value");
 }
 
+namespace {
+	typedef std::chrono::steady_clock Clock;
+	/// Time per frame spent uploading loaded images (at least one image is uploaded per frame)
+	const std::chrono::microseconds UPLOAD_BUDGET(3000);
+	/// Decoded images kept waiting for compression into TextureCache (more are skipped and done another time)
+	const std::size_t MAX_COMPRESS = 8;
+}
+
 struct Job {
 	fs::path name;
 	typedef std::function<void (Bitmap& bitmap)> ApplyFunc;
 	ApplyFunc apply;
 	Bitmap bitmap;
+	std::uint64_t priority = 0;  ///< Larger is loaded first
+	unsigned maxSize = 0;  ///< Downscale to fit (0 = full size)
 	Job() {}
-	Job(fs::path const& n, ApplyFunc const& a): name(n), apply(a) {}
+	Job(fs::path const& n, ApplyFunc const& a, unsigned m = 0): name(n), apply(a), maxSize(m) {}
 };
 
 class TextureLoader::Impl {
-	/// Load a file from disk into a buffer
-	static void load(Bitmap& bitmap, fs::path const& name) {
+	/// Load a file from disk into a buffer (possibly decoded at a reduced size, but no smaller than maxSize)
+	static void load(Bitmap& bitmap, fs::path const& name, unsigned maxSize) {
 		try {
 			std::string ext = boost::algorithm::to_lower_copy(name.extension().string());
+			if (ext == ".svg" && ThemeBundle::load(name, bitmap)) return;  // Pre-rasterized, no file access needed
 			if (!fs::is_regular_file(name)) throw std::runtime_error("File not found: " + name.string());
 			else if (ext == ".svg") loadSVG(bitmap, name);
-			else if (ext == ".jpg" || ext == ".jpeg") loadJPEG(bitmap, name);
+			else if (ext == ".jpg" || ext == ".jpeg") loadJPEG(bitmap, name, maxSize);
 			else if (ext == ".png") loadPNG(bitmap, name);
 			else throw std::runtime_error("Unknown image file format: " + name.string());
 		} catch (std::exception& e) {
 			std::clog << "image/error: " << e.what() << std::endl;
 		}
 	}
+	/// A queued job; entries whose priority no longer matches the job are stale (the job was removed or reprioritized)
+	struct Pending {
+		std::uint64_t priority;
+		void const* target;
+		bool operator<(Pending const& other) const { return priority < other.priority; }
+	};
 	std::atomic<bool> m_quit{ false };
-	std::mutex m_mutex;
-	std::condition_variable m_condition;
-	typedef std::map<void const*, Job> Jobs;
+	lockstats::Mutex m_mutex{ "texture loader" };
+	std::condition_variable_any m_condition;
+	typedef std::unordered_map<void const*, Job> Jobs;
 	Jobs m_jobs;
-	std::thread m_thread;
+	std::priority_queue<Pending> m_queue;
+	std::vector<Pending> m_done;  ///< Completed jobs waiting for apply()
+	struct Compress {
+		fs::path name;
+		unsigned maxSize;
+		Bitmap bitmap;
+	};
+	std::deque<Compress> m_compress;  ///< Decoded images to be added to TextureCache when there is nothing else to do
+	std::atomic<bool> m_compressed{ false };  ///< Use TextureCache (once apply() has found the GPU to support it)
+	bool m_checked = false;  ///< Has apply() checked for compressed texture support
+	typedef std::pair<void const*, Job> ReadyJob;
+	std::deque<ReadyJob> m_ready;  ///< Completed jobs waiting for upload (main thread only)
+	std::uint64_t m_priority = 0;  ///< Incremented for every push and prioritize, so that the latest requests go first
+	std::vector<std::thread> m_threads;
+	std::atomic<std::size_t> m_readyCount{ 0 };  ///< m_ready.size(), for the metrics
+	metrics::Family m_loadBacklog{ "performous_texture_load_backlog", "Images waiting to be loaded or being loaded", "gauge",
+	  [this]() -> double { std::lock_guard<lockstats::Mutex> l(m_mutex); return m_jobs.size(); } };
+	metrics::Family m_uploadBacklog{ "performous_texture_upload_backlog", "Loaded images waiting for upload to OpenGL", "gauge",
+	  [this]() -> double { return m_readyCount; } };
 public:
-	Impl(): m_quit(), m_thread(&Impl::run, this) {}
-	~Impl() { m_quit = true; m_condition.notify_one(); m_thread.join(); }
-	/// The loader main loop: poll for image load jobs and load into RAM
+	std::size_t m_uploads = 0;  ///< Images applied so far (main thread only)
+	Impl() {
+		unsigned threads = config["graphic/texture_threads"].i();
+		if (threads == 0) threads = clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+		for (unsigned i = 0; i < threads; ++i) m_threads.emplace_back(&Impl::run, this);
+	}
+	~Impl() {
+		{
+			std::lock_guard<lockstats::Mutex> l(m_mutex);
+			m_quit = true;
+		}
+		m_condition.notify_all();
+		for (auto& t: m_threads) t.join();
+	}
+	/// The loader main loop: take the most urgent image load job and load into RAM
 	void run() {
+		threads::enter(threads::Class::io, "texture loader");
+		std::unique_lock<lockstats::Mutex> l(m_mutex);
 		while (!m_quit) {
-			void const* target = nullptr;
+			if (m_queue.empty()) {
+				if (m_compress.empty()) { m_condition.wait(l); continue; }
+				Compress item = std::move(m_compress.front());
+				m_compress.pop_front();
+				UnlockGuard<decltype(l)> unlocked(l);
+				trace::Scope scope("texture compress");
+				try {
+					TextureCache::save(item.name, item.bitmap, item.maxSize);
+				} catch (std::exception& e) {
+					std::clog << "image/warning: Cannot cache compressed " << item.name << ": " << e.what() << std::endl;
+				}
+				continue;
+			}
+			Pending p = m_queue.top();
+			m_queue.pop();
+			auto it = m_jobs.find(p.target);
+			if (it == m_jobs.end() || it->second.priority != p.priority) continue;  // Stale entry
 			fs::path name;
+			name.swap(it->second.name);  // Mark the job taken
+			unsigned maxSize = it->second.maxSize;
+			// Load image file into buffer (preferably the compressed version)
+			Bitmap bitmap, uncompressed;
 			{
-				// Poll for jobs to be done
-				std::unique_lock<std::mutex> l(m_mutex);
-				for (auto& job: m_jobs) {
-					if (job.second.name.empty()) continue;  // Job already done
-					name = job.second.name;
-					target = job.first;
-					break;
-				}
-				// If not found, wait for one
-				if (!target) {
-					m_condition.wait(l);
-					continue;
+				UnlockGuard<decltype(l)> unlocked(l);
+				trace::Scope scope("texture load");
+				bool cached = m_compressed && TextureCache::load(name, bitmap, maxSize);
+				if (!cached) {
+					load(bitmap, name, maxSize);
+					if (maxSize && !bitmap.buf.empty()) bitmap.shrink(maxSize);
 				}
+				if (!cached && m_compressed && TextureCache::compressible(bitmap)) uncompressed = bitmap;
 			}
-			// Load image file into buffer
-			Bitmap bitmap;
-			load(bitmap, name);
+			if (!uncompressed.buf.empty() && m_compress.size() < MAX_COMPRESS) m_compress.push_back(Compress{ name, maxSize, std::move(uncompressed) });
 			// Store the result
-			std::lock_guard<std::mutex> l(m_mutex);
-			auto it = m_jobs.find(target);
-			if (it == m_jobs.end()) continue;  // The job has been removed already
-			it->second.name.clear();  // Mark the job completed
+			it = m_jobs.find(p.target);
+			if (it == m_jobs.end() || it->second.priority != p.priority) continue;  // The job has been removed (or replaced) meanwhile
 			it->second.bitmap.swap(bitmap);  // Store the bitmap (if we got any)
+			m_done.push_back(p);
 		}
 	}
 	/// Add a new job, using calling Texture's address as unique ID.
 	void push(void const* t, Job const& job) {
-		std::lock_guard<std::mutex> l(m_mutex);
-		m_jobs[t] = job;
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
+		Job& j = m_jobs[t] = job;
+		j.priority = ++m_priority;
+		m_queue.push(Pending{ j.priority, t });
 		m_condition.notify_one();
 	}
-	/// Cancel a job in progress (no effect if the job has already completed)
+	/// Move a waiting job to the front of the queue (no effect if it is already being loaded or done)
+	void prioritize(void const* t) {
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
+		auto it = m_jobs.find(t);
+		if (it == m_jobs.end() || it->second.name.empty()) return;
+		if (it->second.priority == m_priority) return;  // Already the most recent
+		it->second.priority = ++m_priority;
+		m_queue.push(Pending{ m_priority, t });
+	}
+	/// Cancel a job (must be called from the main thread, like apply)
 	void remove(void const* t) {
-		std::lock_guard<std::mutex> l(m_mutex);
-		m_jobs.erase(t);
+		{
+			std::lock_guard<lockstats::Mutex> l(m_mutex);
+			m_jobs.erase(t);
+		}
+		auto it = std::find_if(m_ready.begin(), m_ready.end(), [t](ReadyJob const& r) { return r.first == t; });
+		if (it != m_ready.end()) m_ready.erase(it);
 	}
-	/// Upload all completed jobs to OpenGL (must be called from a valid OpenGL context)
-	void apply() {
-		std::lock_guard<std::mutex> l(m_mutex);
-		for (auto it = m_jobs.begin(); it != m_jobs.end();) {
-			{
-				Job& j = it->second;
-				if (!j.name.empty()) { ++it; continue; }  // Job incomplete, skip it
-				j.apply(j.bitmap);  // Upload to OpenGL
+	/// Upload completed jobs to OpenGL (must be called from a valid OpenGL context), within a time budget per call
+	void apply(Clock::duration budget) {
+		if (!m_checked) {
+			m_checked = true;
+			m_compressed = config["graphic/texture_cache"].b() && epoxy_has_gl_extension("GL_EXT_texture_compression_s3tc")
+			  && (epoxy_has_gl_extension("GL_EXT_texture_sRGB") || epoxy_has_gl_extension("GL_EXT_texture_compression_s3tc_srgb"));
+		}
+		{
+			std::lock_guard<lockstats::Mutex> l(m_mutex);
+			for (Pending const& p: m_done) {
+				auto it = m_jobs.find(p.target);
+				if (it == m_jobs.end() || it->second.priority != p.priority) continue;  // Removed (or replaced by a new job)
+				m_ready.emplace_back(p.target, std::move(it->second));
+				m_jobs.erase(it);
 			}
-			m_jobs.erase(it++);
+			m_done.clear();
 		}
+		// The uploads happen without holding the mutex; whatever doesn't fit in this frame is left for the next one
+		auto end = Clock::now() + budget;
+		while (!m_ready.empty()) {
+			Job j = std::move(m_ready.front().second);
+			m_ready.pop_front();
+			j.apply(j.bitmap);  // Upload to OpenGL
+			++m_uploads;
+			if (Clock::now() > end) break;
+		}
+		m_readyCount = m_ready.size();
 	}
 };
 
@@ -124,21 +228,32 @@ TextureLoader::TextureLoader() {
 	ldr = std::make_unique<Impl>();
 }
 
-TextureLoader::~TextureLoader() { ldr.reset(); }
+void updateTextures(Clock::duration budget) {
+	trace::Scope scope("texture upload");
+	ldr->apply(budget);
+}
+
+void updateTextures() { updateTextures(UPLOAD_BUDGET); }
+
+std::size_t textureUploads() { return ldr ? ldr->m_uploads : 0; }
 
-void updateTextures() { ldr->apply(); }
+void requestImage(void const* target, fs::path const& filename, std::function<void (Bitmap& bitmap)> const& apply) {
+	ldr->push(target, Job(filename, apply));
+}
+
+void cancelImage(void const* target) { ldr->remove(target); }
 
-template <typename T> void loader(T* target, fs::path const& name) {
+template <typename T> void loader(T* target, fs::path const& name, unsigned maxSize) {
 	// Temporarily add 1x1 pixel black texture
 	Bitmap bitmap;
 	bitmap.fmt = pix::RGB;
 	bitmap.resize(1, 1);
 	target->load(bitmap);
 	// Ask the loader to retrieve the image
-	ldr->push(target, Job(name, [target](Bitmap& bitmap){ target->load(bitmap); }));
+	ldr->push(target, Job(name, [target](Bitmap& bitmap){ target->load(bitmap); }, maxSize));
 }
 
-Texture::Texture(fs::path const& filename) { loader(this, filename); }
+Texture::Texture(fs::path const& filename, unsigned maxSize) { loader(this, filename, maxSize); m_loading = true; }
 Texture::~Texture() { ldr->remove(this); }
 
 // Stuff for converting pix::Format into OpenGL enum values & other flags
@@ -169,10 +284,115 @@ namespace {
 	GLint internalFormat(bool linear) {
 		return (!linear && GL_EXT_framebuffer_sRGB ? GL_SRGB_ALPHA : GL_RGBA);
 	}
+	/// internalFormat for immutable storage (which requires a sized format)
+	GLenum sizedFormat(bool linear) {
+		return (!linear && GL_EXT_framebuffer_sRGB ? GL_SRGB8_ALPHA8 : GL_RGBA8);
+	}
+	unsigned formatBytes(GLenum internalFormat) {
+		return internalFormat == GL_R8 ? 1 : 4;
+	}
+	unsigned bytesPerPixel(pix::Format format) {
+		return format == pix::RGB || format == pix::BGR ? 3 : 4;
+	}
 }
 
+/**
+* Streams pixel data into textures through a pixel buffer object, so that the driver does the actual transfer
+* asynchronously instead of copying from our memory before glTexImage2D returns.
+* With ARB_buffer_storage a persistently mapped ring buffer is used (fences keep us from overwriting data still
+* being transferred); otherwise the buffer is orphaned and mapped again for each upload.
+**/
+class PixelUploader {
+	static const std::size_t RING_SIZE = 32 << 20;
+	static const std::size_t MIN_BYTES = 64 << 10;  ///< Smaller images are uploaded directly
+	struct Region {
+		std::size_t begin, end;
+		GLsync fence;
+	};
+	GLuint m_pbo = 0;
+	unsigned char* m_ring = nullptr;  ///< Persistent mapping (if available)
+	std::size_t m_head = 0;
+	std::deque<Region> m_inFlight;  ///< Ring regions that the GPU may still be reading, oldest first
+	/// Wait until the GPU is done with all ring regions overlapping [begin, end)
+	void waitFor(std::size_t begin, std::size_t end) {
+		while (!m_inFlight.empty()) {
+			Region const& r = m_inFlight.front();
+			if (r.end <= begin || r.begin >= end) break;
+			glClientWaitSync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 /* ns */);
+			glDeleteSync(r.fence);
+			m_inFlight.pop_front();
+		}
+	}
+	/// Reserve space for bytes in the ring, returning its offset
+	std::size_t reserve(std::size_t bytes) {
+		if (m_head + bytes > RING_SIZE) {
+			waitFor(m_head, RING_SIZE);  // The regions skipped at the end are the oldest ones
+			m_head = 0;
+		}
+		waitFor(m_head, m_head + bytes);
+		std::size_t offset = m_head;
+		m_head = (m_head + bytes + 255) & ~std::size_t(255);  // Keep offsets well aligned
+		return offset;
+	}
+public:
+	PixelUploader() {
+		glutil::GLErrorChecker glerror("PixelUploader");
+		glGenBuffers(1, &m_pbo);
+		if (epoxy_gl_version() < 44 && !epoxy_has_gl_extension("GL_ARB_buffer_storage")) return;
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glutil::bindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, RING_SIZE, nullptr, flags);
+		m_ring = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, RING_SIZE, flags));
+		glutil::bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (m_ring) return;
+		// Storage is immutable, so start over with a new buffer for the fallback path
+		std::clog << "video/warning: Cannot map pixel buffer persistently, using slower texture uploads." << std::endl;
+		glutil::deleteBuffer(m_pbo);
+		glGenBuffers(1, &m_pbo);
+	}
+	~PixelUploader() {
+		for (auto const& r: m_inFlight) glDeleteSync(r.fence);
+		glutil::deleteBuffer(m_pbo);  // Also unmaps the ring
+	}
+	/// Upload level 0 of the texture bound to target. With replace, existing storage of the same size is overwritten.
+	void texImage(GLenum target, GLint internalFormat, GLsizei width, GLsizei height, GLenum format, GLenum type, void const* data, std::size_t bytes, bool replace = false) {
+		auto upload = [&](void const* ptr) {
+			if (replace) glTexSubImage2D(target, 0, 0, 0, width, height, format, type, ptr);
+			else glTexImage2D(target, 0, internalFormat, width, height, 0, format, type, ptr);
+		};
+		if (bytes < MIN_BYTES || bytes > RING_SIZE) {
+			upload(data);
+			return;
+		}
+		glutil::bindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo);
+		std::size_t offset = 0;
+		if (m_ring) {
+			offset = reserve(bytes);
+			std::memcpy(m_ring + offset, data, bytes);
+		} else {
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);  // Orphan the previous contents
+			void* ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			if (!ptr) {
+				glutil::bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				upload(data);
+				return;
+			}
+			std::memcpy(ptr, data, bytes);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		upload(reinterpret_cast<void const*>(offset));
+		if (m_ring) m_inFlight.push_back(Region{ offset, offset + bytes, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) });
+		glutil::bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+};
+
+std::unique_ptr<PixelUploader> uploader;  ///< Created on first use (when there is an OpenGL context)
+
+TextureLoader::~TextureLoader() { uploader.reset(); ldr.reset(); }
+
 void Texture::load(Bitmap const& bitmap, bool isText) {
 	glutil::GLErrorChecker glerror("Texture::load");
+	m_loading = false;
 	// Initialize dimensions
 	m_width = bitmap.width; m_height = bitmap.height;
 	dimensions = Dimensions(bitmap.ar).fixedWidth(1.0f);
@@ -192,17 +412,121 @@ void Texture::load(Bitmap const& bitmap, bool isText) {
 	}
 
 	// Load the data into texture
+	if (bitmap.fmt == pix::BC1 || bitmap.fmt == pix::BC3) {
+		// Compressed images from TextureCache come with their mipmaps
+		GLenum format = bitmap.fmt == pix::BC1 ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;
+		unsigned levels = TextureCache::levels(bitmap);
+		glTexParameteri(type(), GL_TEXTURE_MAX_LEVEL, levels - 1);
+		unsigned char const* data = bitmap.data();
+		std::size_t total = 0;
+		for (unsigned level = 0; level < levels; ++level) {
+			std::size_t bytes = TextureCache::levelBytes(bitmap, level);
+			total += bytes;
+			glCompressedTexImage2D(type(), level, format, std::max(1u, bitmap.width >> level), std::max(1u, bitmap.height >> level), 0, bytes, data);
+			data += bytes;
+		}
+		m_memory.set(total);
+		return;
+	}
 	PixFmt const& f = getPixFmt(bitmap.fmt);
+	std::size_t stored = std::size_t(bitmap.width) * bitmap.height * 4;  // Stored as RGBA
+	if (!isText) stored += stored / 3;  // Mipmaps
+	m_memory.set(stored);
 	glPixelStorei(GL_UNPACK_SWAP_BYTES, f.swap);
-	glTexImage2D(type(), 0, internalFormat(bitmap.linearPremul), bitmap.width, bitmap.height, 0, f.format, f.type, bitmap.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // Our bitmaps have no padding at the end of lines
+	if (!uploader) uploader = std::make_unique<PixelUploader>();
+	std::size_t bytes = std::size_t(bitmap.width) * bitmap.height * bytesPerPixel(bitmap.fmt);
+	uploader->texImage(type(), internalFormat(bitmap.linearPremul), bitmap.width, bitmap.height, f.format, f.type, bitmap.data(), bytes);
 	if (!isText) glGenerateMipmap(type());
 }
 
+void DynamicTexture::update(GLenum internalFormat, unsigned width, unsigned height, GLenum format, GLenum type, void const* data, std::size_t bytes, unsigned rowLength) {
+	glutil::GLErrorChecker glerror("DynamicTexture::update");
+	if (internalFormat != m_internalFormat || width != m_width || height != m_height) {
+		// Immutable storage cannot be resized, so start over with new textures
+		m_textures[0].reset();
+		m_textures[1].reset();
+		m_current = 0;
+		m_internalFormat = internalFormat;
+		m_width = width;
+		m_height = height;
+		m_memory.set(std::size_t(width) * height * formatBytes(internalFormat));
+	}
+	// Write to the texture that is not being drawn (only one until there is a second update)
+	const unsigned target = m_textures[m_current] ? m_current ^ 1 : m_current;
+	auto& texture = m_textures[target];
+	const bool allocate = !texture;
+	if (allocate) {
+		texture = std::make_unique<OpenGLTexture<GL_TEXTURE_2D>>();
+		if (m_textures[target ^ 1]) m_memory.set(2 * m_memory.bytes());
+	}
+	UseTexture use(*texture);
+	if (allocate) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, m_nearest ? GL_NEAREST : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		if (epoxy_gl_version() >= 42 || epoxy_has_gl_extension("GL_ARB_texture_storage")) {
+			glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, width, height);
+		} else {
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+		}
+		glerror.check("allocate");
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+	if (!uploader) uploader = std::make_unique<PixelUploader>();
+	uploader->texImage(GL_TEXTURE_2D, internalFormat, width, height, format, type, data, bytes, true);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glerror.check("upload");
+	m_current = target;
+}
+
+void DynamicTexture::load(Bitmap const& bitmap, bool nearest) {
+	if (nearest != m_nearest) m_width = m_height = 0;  // Filters are set when the storage is allocated
+	m_nearest = nearest;
+	dimensions = Dimensions(bitmap.ar).fixedWidth(1.0f);
+	m_premultiplied = bitmap.linearPremul;
+	PixFmt const& f = getPixFmt(bitmap.fmt);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, f.swap);
+	std::size_t bytes = std::size_t(bitmap.width) * bitmap.height * bytesPerPixel(bitmap.fmt);
+	update(sizedFormat(bitmap.linearPremul), bitmap.width, bitmap.height, f.format, f.type, bitmap.data(), bytes);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+}
+
+void DynamicTexture::draw() const {
+	if (empty()) return;
+	glutil::blendFunc(m_premultiplied ? GL_ONE : GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	draw(dimensions, tex);
+}
+
 void Texture::draw() const {
+	if (m_loading) ldr->prioritize(this);  // Images on screen are loaded first
 	if (empty()) return;
 	// FIXME: This gets image alpha handling right but our ColorMatrix system always assumes premultiplied alpha
 	// (will produce incorrect results for fade effects)
-	glBlendFunc(m_premultiplied ? GL_ONE : GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glutil::blendFunc(m_premultiplied ? GL_ONE : GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	draw(dimensions, TexCoords(tex.x1, tex.y1, tex.x2, tex.y2));
 }
 
+void Texture::drawReflected(float alpha) const {
+	if (m_loading) ldr->prioritize(this);
+	if (empty()) return;
+	glutil::blendFunc(m_premultiplied ? GL_ONE : GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	// One strip of three rows: the top edge, the bottom edge (the mirror line) and the mirrored top edge
+	Dimensions const& d = dimensions;
+	const float mirrored = 2.0f * d.y2() - d.y1();
+	const glmath::vec4 faded = Color::alpha(alpha).linear();
+	glutil::VertexArray va;
+	va.texCoord(tex.x1, tex.y1).vertex(d.x1(), d.y1());
+	va.texCoord(tex.x2, tex.y1).vertex(d.x2(), d.y1());
+	va.texCoord(tex.x1, tex.y2).vertex(d.x1(), d.y2());
+	va.texCoord(tex.x2, tex.y2).vertex(d.x2(), d.y2());
+	// The bottom edge again in the reflection's color (the triangles in between have no area)
+	va.texCoord(tex.x1, tex.y2).color(faded).vertex(d.x1(), d.y2());
+	va.texCoord(tex.x2, tex.y2).color(faded).vertex(d.x2(), d.y2());
+	va.texCoord(tex.x1, tex.y1).color(faded).vertex(d.x1(), mirrored);
+	va.texCoord(tex.x2, tex.y1).color(faded).vertex(d.x2(), mirrored);
+	UseTexture use(*this);
+	va.draw();
+}
+
@@ -1,12 +1,15 @@
 #pragma once
 
+#include "chrono.hh"
 #include "glutil.hh"
 #include "image.hh"
+#include "memstats.hh"
 #include "video_driver.hh"
 
 #include <cairo.h>
 
 #include <algorithm>
+#include <functional>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -120,7 +123,7 @@ template <GLenum Type> class OpenGLTexture {
 	static GLenum type() { return Type; };
 	static Shader& shader() { return getShader("texture"); }
 	OpenGLTexture(): m_id() { glGenTextures(1, &m_id); }
-	~OpenGLTexture() { glDeleteTextures(1, &m_id); }
+	~OpenGLTexture() { glutil::QuadBatch::flush(); glutil::deleteTexture(m_id); }
 	/// returns id
 	GLuint id() const { return m_id; };
 	/// draw in given dimensions, with given texture coordinates
@@ -138,31 +141,16 @@ class UseTexture {
   	const UseTexture& operator=(const UseTexture&) = delete;
 	/// constructor
 	template <GLenum Type> UseTexture(OpenGLTexture<Type> const& tex):
-	  m_shader(/* hack of the year */ (glutil::GLErrorChecker("UseTexture"), glActiveTexture(GL_TEXTURE0), glBindTexture(Type, tex.id()), tex.shader())) {}
+	  m_shader(/* hack of the year */ (glutil::GLErrorChecker("UseTexture"), glutil::QuadBatch::flush(), glutil::bindTexture(Type, tex.id()), tex.shader())) {}
 
   private:
 	UseShader m_shader;
 };
 
 template <GLenum Type> void OpenGLTexture<Type>::draw(Dimensions const& dim, TexCoords const& tex) const {
-	glutil::GLErrorChecker glerror("OpenGLTexture::draw()");
-	glutil::VertexArray va;
-
-	UseTexture texture(*this);
-	glerror.check("texture");
-
-	// The texture wraps over at the edges (repeat)
-	const bool repeating = tex.outOfBounds();
-	glTexParameterf(type(), GL_TEXTURE_WRAP_S, repeating ? GL_REPEAT : GL_CLAMP_TO_EDGE);
-	glTexParameterf(type(), GL_TEXTURE_WRAP_T, repeating ? GL_REPEAT : GL_CLAMP_TO_EDGE);
-	glerror.check("repeat mode");
-
-	va.texCoord(tex.x1, tex.y1).vertex(dim.x1(), dim.y1());
-	va.texCoord(tex.x2, tex.y1).vertex(dim.x2(), dim.y1());
-	va.texCoord(tex.x1, tex.y2).vertex(dim.x1(), dim.y2());
-	va.texCoord(tex.x2, tex.y2).vertex(dim.x2(), dim.y2());
-
-	va.draw();
+	// Drawn with the following quads of the same texture (and state), the texture wraps over at the edges if needed (repeat)
+	const glutil::QuadBatch::Key key{ Type, m_id, shader().id(), tex.outOfBounds() };
+	glutil::QuadBatch::add(key, dim.x1(), dim.y1(), dim.x2(), dim.y2(), tex.x1, tex.y1, tex.x2, tex.y2);
 }
 
 template <GLenum Type> void OpenGLTexture<Type>::drawCropped(Dimensions const& orig, TexCoords const& tex) const {
@@ -175,7 +163,16 @@ template <GLenum Type> void OpenGLTexture<Type>::drawCropped(Dimensions const& o
 	draw(dim, tex);
 }
 
+/// Upload loaded images to OpenGL (main thread), spending at most about budget on it (the rest waits for the next call)
+void updateTextures(Clock::duration budget);
 void updateTextures();
+/// Number of images uploaded by updateTextures() so far (for benchmarks)
+std::size_t textureUploads();
+
+/// Load an image file in the background and pass it to apply in the main thread (from updateTextures()). The request is identified by target.
+void requestImage(void const* target, fs::path const& filename, std::function<void (Bitmap& bitmap)> const& apply);
+/// Cancel the request of target (must be done before target goes away)
+void cancelImage(void const* target);
 
 /**
 * @short High level texture/image wrapper on top of OpenGLTexture
@@ -188,25 +185,69 @@ public:
 	/// texture coordinates
 	TexCoords tex;
 	Texture(): m_width(0), m_height(0), m_premultiplied(true) {}
-	/// creates texture from file
-	Texture(fs::path const& filename);
+	/// Size limit of cover thumbnails (song browser and playlist)
+	static const unsigned THUMBNAIL_SIZE = 256;
+	/// creates texture from file, downscaled to fit inside maxSize x maxSize pixels if maxSize is given
+	Texture(fs::path const& filename, unsigned maxSize = 0);
 	~Texture();
 	bool empty() const { return m_width * m_height == 0; } ///< Test if the loading has failed
+	bool loading() const { return m_loading; } ///< Still being loaded by TextureLoader (empty until done)
 	/// draws texture
 	void draw() const;
+	/// draws texture and its mirror image below it (faded by alpha) with one draw call
+	void drawReflected(float alpha) const;
 	using OpenGLTexture<GL_TEXTURE_2D>::draw;
 	/// loads texture into buffer
 	void load(Bitmap const& bitmap, bool isText = false);
 	Shader& shader() { return m_texture.shader(); }
 	float width() const { return m_width; }
 	float height() const { return m_height; }
+	/// Video memory used by the image (estimate)
+	std::size_t bytes() const { return m_memory.bytes(); }
 private:
 	float m_width, m_height;
+	memstats::Usage m_memory{ "textures", memstats::Kind::VRAM };
 	bool m_premultiplied;
+	bool m_loading = false;  ///< The image is still being loaded by TextureLoader
 	OpenGLTexture<GL_TEXTURE_2D> m_texture;
 };
 
-/// A RAII wrapper for texture loading worker thread. There must be exactly one (global) instance whenever any Textures exist.
+/**
+* Texture for contents that are replaced often or rendered once (video and camera frames, text). The storage is
+* allocated once per size with glTexStorage2D (a single level, no mipmaps) and then only updated with glTexSubImage2D.
+* Updates alternate between two textures, so that an update never waits for the GPU to finish drawing the previous
+* contents (the second texture is only created by the second update).
+**/
+class DynamicTexture {
+public:
+	/// dimensions
+	Dimensions dimensions;
+	/// texture coordinates
+	TexCoords tex;
+	/// Replace the contents with data (in format and type, rows of rowLength pixels or width if 0) of bytes bytes
+	void update(GLenum internalFormat, unsigned width, unsigned height, GLenum format, GLenum type, void const* data, std::size_t bytes, unsigned rowLength = 0);
+	/// Replace the contents with bitmap, updating dimensions; nearest magnifies without filtering (for text)
+	void load(Bitmap const& bitmap, bool nearest = false);
+	bool empty() const { return m_width * m_height == 0; }
+	unsigned width() const { return m_width; }
+	unsigned height() const { return m_height; }
+	/// The texture holding the latest contents
+	OpenGLTexture<GL_TEXTURE_2D> const& current() const { return *m_textures[m_current]; }
+	GLuint id() const { return current().id(); }
+	/// draws the latest contents in dimensions
+	void draw() const;
+	void draw(Dimensions const& dim, TexCoords const& tex = TexCoords()) const { current().draw(dim, tex); }
+private:
+	std::unique_ptr<OpenGLTexture<GL_TEXTURE_2D>> m_textures[2];
+	unsigned m_current = 0;
+	GLenum m_internalFormat = 0;
+	unsigned m_width = 0, m_height = 0;
+	bool m_nearest = false;
+	bool m_premultiplied = true;
+	memstats::Usage m_memory{ "textures/dynamic", memstats::Kind::VRAM };
+};
+
+/// A RAII wrapper for texture loading worker threads. There must be exactly one (global) instance whenever any Textures exist.
 class TextureLoader {
 public:
 	TextureLoader();
@@ -0,0 +1,165 @@
+#include "textureatlas.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+
+namespace {
+	/// Edge pixels are repeated this far around each image, so that filtering never picks up its neighbours
+	const unsigned PADDING = 4;
+	/// Mipmap levels below the full size; positions are aligned so that each level keeps a pixel of padding
+	const unsigned MAX_LEVEL = 2;
+	unsigned align(unsigned x) { const unsigned a = 1 << MAX_LEVEL; return (x + a - 1) & ~(a - 1); }
+}
+
+const unsigned TextureAtlas::PAGE_SIZE;
+
+struct TextureAtlas::Page {
+	/// A row of images, filled from left to right
+	struct Shelf {
+		unsigned y, height, x;
+	};
+	OpenGLTexture<GL_TEXTURE_2D> texture;
+	unsigned size;
+	std::vector<Shelf> shelves;
+	unsigned top = 0;  ///< Height used by shelves
+	mutable bool dirty = false;  ///< Mipmaps need to be regenerated
+	memstats::Usage memory{ "texture atlas", memstats::Kind::VRAM };
+	explicit Page(unsigned size): size(size) {
+		memory.set(std::size_t(size) * size * 4 * 4 / 3);  // RGBA with mipmaps
+		glutil::GLErrorChecker glerror("TextureAtlas::Page");
+		UseTexture tex(texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, MAX_LEVEL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+	/// Regenerate mipmaps if images were added (once for any number of them)
+	void prepare() const {
+		if (!dirty) return;
+		UseTexture tex(texture);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		dirty = false;
+	}
+	/// Find room for a w x h area, returning false if the page is full
+	bool allocate(unsigned w, unsigned h, unsigned& x, unsigned& y) {
+		if (w > size || h > size) return false;
+		// The lowest shelf that is tall enough and has room left
+		Shelf* best = nullptr;
+		for (auto& s: shelves) {
+			if (s.height < h || s.x + w > size) continue;
+			if (!best || s.height < best->height) best = &s;
+		}
+		if (!best) {
+			if (top + h > size) return false;
+			shelves.push_back(Shelf{ top, h, 0 });
+			top += h;
+			best = &shelves.back();
+		}
+		x = best->x;
+		y = best->y;
+		best->x += w;
+		return true;
+	}
+};
+
+TextureAtlas::TextureAtlas() {}
+
+TextureAtlas::~TextureAtlas() {
+	for (auto& sprite: m_sprites) cancelImage(&sprite);
+}
+
+TextureAtlas::Sprite& TextureAtlas::add(fs::path const& filename) {
+	m_sprites.emplace_back();
+	Sprite& sprite = m_sprites.back();
+	requestImage(&sprite, filename, [this, &sprite](Bitmap& bitmap) { insert(sprite, bitmap); });
+	return sprite;
+}
+
+TextureAtlas::Sprite& TextureAtlas::add(Bitmap const& bitmap) {
+	m_sprites.emplace_back();
+	Sprite& sprite = m_sprites.back();
+	insert(sprite, bitmap);
+	return sprite;
+}
+
+void TextureAtlas::insert(Sprite& sprite, Bitmap const& bitmap) {
+	if (bitmap.width * bitmap.height == 0) return;  // Loading failed (already reported)
+	if (bitmap.fmt != pix::INT_ARGB) {
+		std::clog << "image/warning: Only SVG images can go into a texture atlas." << std::endl;
+		return;
+	}
+	const unsigned w = align(bitmap.width + 2 * PADDING), h = align(bitmap.height + 2 * PADDING);
+	unsigned x, y;
+	Page* page = nullptr;
+	for (auto& p: m_pages) if (p->allocate(w, h, x, y)) { page = p.get(); break; }
+	if (!page) {
+		m_pages.push_back(std::make_unique<Page>(std::max(PAGE_SIZE, std::max(w, h))));
+		page = m_pages.back().get();
+		page->allocate(w, h, x, y);
+	}
+	// Copy the image with its edges repeated into the padding
+	std::vector<std::uint32_t> buf(w * h);
+	std::uint32_t const* src = reinterpret_cast<std::uint32_t const*>(bitmap.data());
+	for (unsigned row = 0; row < h; ++row) {
+		unsigned sy = std::min(bitmap.height - 1, unsigned(std::max(0, int(row) - int(PADDING))));
+		for (unsigned col = 0; col < w; ++col) {
+			unsigned sx = std::min(bitmap.width - 1, unsigned(std::max(0, int(col) - int(PADDING))));
+			buf[row * w + col] = src[sy * bitmap.width + sx];
+		}
+	}
+	glutil::GLErrorChecker glerror("TextureAtlas::insert");
+	UseTexture tex(page->texture);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_TRUE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8, buf.data());
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+	glerror.check("upload");
+	page->dirty = true;
+	const float s = page->size;
+	sprite.m_tex = TexCoords((x + PADDING) / s, (y + PADDING) / s, (x + PADDING + bitmap.width) / s, (y + PADDING + bitmap.height) / s);
+	sprite.dimensions = Dimensions(bitmap.ar).fixedWidth(1.0f);
+	sprite.m_page = page;
+}
+
+void TextureAtlas::Sprite::draw() const {
+	draw(dimensions);
+}
+
+void TextureAtlas::Sprite::draw(Dimensions const& dim) const {
+	if (empty()) return;
+	m_page->prepare();
+	glutil::blendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);  // Premultiplied alpha
+	m_page->texture.draw(dim, m_tex);
+}
+
+void TextureAtlas::Batch::add(Sprite const& sprite) {
+	if (sprite.empty()) return;
+	auto it = m_pages.begin();
+	while (it != m_pages.end() && it->first != sprite.m_page) ++it;
+	if (it == m_pages.end()) it = m_pages.emplace(it, sprite.m_page, glutil::VertexArray());
+	glutil::VertexArray& va = it->second;
+	Dimensions const& dim = sprite.dimensions;
+	TexCoords const& tex = sprite.m_tex;
+	// Two triangles per sprite
+	va.texCoord(tex.x1, tex.y1).vertex(dim.x1(), dim.y1());
+	va.texCoord(tex.x2, tex.y1).vertex(dim.x2(), dim.y1());
+	va.texCoord(tex.x1, tex.y2).vertex(dim.x1(), dim.y2());
+	va.texCoord(tex.x2, tex.y1).vertex(dim.x2(), dim.y1());
+	va.texCoord(tex.x2, tex.y2).vertex(dim.x2(), dim.y2());
+	va.texCoord(tex.x1, tex.y2).vertex(dim.x1(), dim.y2());
+}
+
+void TextureAtlas::Batch::draw() {
+	glutil::GLErrorChecker glerror("TextureAtlas::Batch::draw");
+	glutil::blendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);  // Premultiplied alpha
+	for (auto& p: m_pages) {
+		p.first->prepare();
+		UseTexture tex(p.first->texture);
+		p.second.draw(GL_TRIANGLES);
+	}
+	m_pages.clear();
+}
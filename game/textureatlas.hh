@@ -0,0 +1,58 @@
+#pragma once
+
+#include "texture.hh"
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+* Packs theme images into a few large textures, so that sprites sharing a page can be drawn together with
+* a single draw call (see TextureAtlas::Batch) instead of binding a texture for each of them.
+* Images are loaded in the background by TextureLoader and packed as they arrive. Only SVG images
+* (premultiplied linear RGB) can be added.
+**/
+class TextureAtlas {
+	struct Page;
+  public:
+	/// Width and height of atlas pages (larger images get a page of their own)
+	static const unsigned PAGE_SIZE = 1024;
+	class Batch;
+	/// An image in the atlas; dimensions work like those of Texture
+	class Sprite {
+	  public:
+		Dimensions dimensions;
+		bool empty() const { return !m_page; }  ///< Not loaded (yet), or loading has failed
+		/// Draw the sprite alone (use Batch for drawing several)
+		void draw() const;
+		/// Draw the sprite at the given dimensions (instead of its own)
+		void draw(Dimensions const& dim) const;
+	  private:
+		friend class TextureAtlas;
+		friend class Batch;
+		Page const* m_page = nullptr;
+		TexCoords m_tex;
+	};
+	/// Collects sprites (at their current dimensions) for drawing them with one draw call per atlas page
+	class Batch {
+	  public:
+		void add(Sprite const& sprite);
+		/// Draw the collected sprites and start over
+		void draw();
+	  private:
+		std::vector<std::pair<Page const*, glutil::VertexArray>> m_pages;
+	};
+	TextureAtlas();
+	~TextureAtlas();
+	TextureAtlas(TextureAtlas const&) = delete;
+	TextureAtlas& operator=(TextureAtlas const&) = delete;
+	/// Add an image file to the atlas. The sprite stays valid as long as the atlas does.
+	Sprite& add(fs::path const& filename);
+	/// Add an image that is already loaded (pix::INT_ARGB, premultiplied), e.g. rendered text
+	Sprite& add(Bitmap const& bitmap);
+
+  private:
+	void insert(Sprite& sprite, Bitmap const& bitmap);
+	std::vector<std::unique_ptr<Page>> m_pages;
+	std::deque<Sprite> m_sprites;  ///< Deque for stable addresses
+};
@@ -0,0 +1,272 @@
+#include "texturecache.hh"
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+	const unsigned VERSION = 1;  ///< Part of the file name hash, increment when the encoding changes
+	const unsigned MIN_SIZE = 64;  ///< Smaller images are not worth caching
+
+	std::uint32_t fourCC(char const (&code)[5]) {
+		return std::uint32_t(code[0]) | std::uint32_t(code[1]) << 8 | std::uint32_t(code[2]) << 16 | std::uint32_t(code[3]) << 24;
+	}
+
+	/// DDS file header (after the "DDS " magic), as defined by DirectX
+	struct DDSHeader {
+		std::uint32_t size, flags, height, width, linearSize, depth, mipMapCount, reserved1[11];
+		std::uint32_t pfSize, pfFlags, pfFourCC, pfBitCount, pfMasks[4];
+		std::uint32_t caps, caps2, caps3, caps4, reserved2;
+	};
+	static_assert(sizeof(DDSHeader) == 124, "DDS header must have a fixed layout");
+	const std::uint32_t DDSD_CAPS = 0x1, DDSD_HEIGHT = 0x2, DDSD_WIDTH = 0x4, DDSD_PIXELFORMAT = 0x1000, DDSD_MIPMAPCOUNT = 0x20000, DDSD_LINEARSIZE = 0x80000;
+	const std::uint32_t DDPF_FOURCC = 0x4;
+	const std::uint32_t DDSCAPS_COMPLEX = 0x8, DDSCAPS_TEXTURE = 0x1000, DDSCAPS_MIPMAP = 0x400000;
+
+	unsigned levelCount(unsigned width, unsigned height) {
+		unsigned levels = 1;
+		for (unsigned size = std::max(width, height); size > 1 && levels < TextureCache::LEVELS; size /= 2) ++levels;
+		return levels;
+	}
+
+	std::size_t bytesOf(pix::Format fmt, unsigned width, unsigned height, unsigned level) {
+		unsigned w = std::max(1u, width >> level), h = std::max(1u, height >> level);
+		return std::size_t((w + 3) / 4) * ((h + 3) / 4) * (fmt == pix::BC1 ? 8 : 16);
+	}
+
+	fs::path cacheFile(fs::path const& image, unsigned maxSize, char const* extension = ".dds") {
+		boost::system::error_code ec;
+		std::ostringstream key;
+		key << VERSION << ' ' << maxSize << ' ' << image.string() << ' ' << fs::file_size(image, ec) << ' ' << fs::last_write_time(image, ec);
+		std::ostringstream name;
+		name << std::hex << std::hash<std::string>()(key.str()) << extension;
+		return getCacheDir() / "textures" / name.str();
+	}
+
+	/// An RGBA8 image, used for building the mipmaps
+	struct Image {
+		unsigned width, height;
+		std::vector<unsigned char> data;
+		unsigned char const* at(unsigned x, unsigned y) const { return &data[4 * (std::size_t(std::min(y, height - 1)) * width + std::min(x, width - 1))]; }
+	};
+
+	Image toRGBA(Bitmap const& bitmap) {
+		Image img{ bitmap.width, bitmap.height, std::vector<unsigned char>(std::size_t(bitmap.width) * bitmap.height * 4) };
+		unsigned char const* src = bitmap.data();
+		for (std::size_t i = 0, n = std::size_t(bitmap.width) * bitmap.height; i < n; ++i) {
+			if (bitmap.fmt == pix::CHAR_RGBA) std::memcpy(&img.data[4 * i], src + 4 * i, 4);
+			else { std::memcpy(&img.data[4 * i], src + 3 * i, 3); img.data[4 * i + 3] = 255; }
+		}
+		return img;
+	}
+
+	/// Half size with a box filter (odd edges repeat the last pixel)
+	Image downsample(Image const& img) {
+		Image ret{ std::max(1u, img.width / 2), std::max(1u, img.height / 2), {} };
+		ret.data.resize(std::size_t(ret.width) * ret.height * 4);
+		auto dst = ret.data.begin();
+		for (unsigned y = 0; y < ret.height; ++y) {
+			for (unsigned x = 0; x < ret.width; ++x) {
+				unsigned char const* p[4] = { img.at(2 * x, 2 * y), img.at(2 * x + 1, 2 * y), img.at(2 * x, 2 * y + 1), img.at(2 * x + 1, 2 * y + 1) };
+				for (unsigned c = 0; c < 4; ++c) *dst++ = (p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4;
+			}
+		}
+		return ret;
+	}
+
+	std::uint16_t to565(int r, int g, int b) { return (r * 31 + 127) / 255 << 11 | (g * 63 + 127) / 255 << 5 | (b * 31 + 127) / 255; }
+	void from565(std::uint16_t c, int* rgb) {
+		int r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+		rgb[0] = r << 3 | r >> 2; rgb[1] = g << 2 | g >> 4; rgb[2] = b << 3 | b >> 2;
+	}
+
+	/// Encode the colors of a 4x4 block (RGBA8, 16 pixels) as a four-color BC1 block
+	void encodeColors(unsigned char const* px, unsigned char* out) {
+		// Endpoints from the bounding box, using the diagonal that follows the correlation of the channels
+		int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 }, mean[3] = {};
+		for (unsigned i = 0; i < 16; ++i) for (unsigned c = 0; c < 3; ++c) {
+			lo[c] = std::min<int>(lo[c], px[4 * i + c]);
+			hi[c] = std::max<int>(hi[c], px[4 * i + c]);
+			mean[c] += px[4 * i + c];
+		}
+		int covRG = 0, covBG = 0;
+		for (unsigned i = 0; i < 16; ++i) {
+			int g = 16 * px[4 * i + 1] - mean[1];
+			covRG += (16 * px[4 * i] - mean[0]) * g;
+			covBG += (16 * px[4 * i + 2] - mean[2]) * g;
+		}
+		if (covRG < 0) std::swap(lo[0], hi[0]);
+		if (covBG < 0) std::swap(lo[2], hi[2]);
+		for (unsigned c = 0; c < 3; ++c) {  // Inset the box a little to reduce the error of the interpolated colors
+			int inset = (hi[c] - lo[c]) / 16;
+			hi[c] -= inset; lo[c] += inset;
+		}
+		std::uint16_t c0 = to565(hi[0], hi[1], hi[2]), c1 = to565(lo[0], lo[1], lo[2]);
+		if (c0 < c1) std::swap(c0, c1);  // c0 > c1 selects the four-color mode
+		std::uint32_t indices = 0;
+		if (c0 != c1) {
+			int pal[4][3];
+			from565(c0, pal[0]);
+			from565(c1, pal[1]);
+			for (unsigned c = 0; c < 3; ++c) {
+				pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+				pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+			}
+			for (unsigned i = 0; i < 16; ++i) {
+				unsigned best = 0;
+				int bestDist = std::numeric_limits<int>::max();
+				for (unsigned j = 0; j < 4; ++j) {
+					int dist = 0;
+					for (unsigned c = 0; c < 3; ++c) dist += (px[4 * i + c] - pal[j][c]) * (px[4 * i + c] - pal[j][c]);
+					if (dist < bestDist) { bestDist = dist; best = j; }
+				}
+				indices |= std::uint32_t(best) << (2 * i);
+			}
+		}
+		out[0] = c0 & 0xFF; out[1] = c0 >> 8; out[2] = c1 & 0xFF; out[3] = c1 >> 8;
+		for (unsigned i = 0; i < 4; ++i) out[4 + i] = (indices >> (8 * i)) & 0xFF;
+	}
+
+	/// Encode the alpha of a 4x4 block as a BC3 alpha block (eight-value mode)
+	void encodeAlpha(unsigned char const* px, unsigned char* out) {
+		int a0 = 0, a1 = 255;
+		for (unsigned i = 0; i < 16; ++i) { a0 = std::max<int>(a0, px[4 * i + 3]); a1 = std::min<int>(a1, px[4 * i + 3]); }
+		std::uint64_t indices = 0;
+		if (a0 != a1) {
+			int pal[8] = { a0, a1 };
+			for (int j = 1; j < 7; ++j) pal[j + 1] = ((7 - j) * a0 + j * a1) / 7;
+			for (unsigned i = 0; i < 16; ++i) {
+				unsigned best = 0;
+				for (unsigned j = 1; j < 8; ++j) if (std::abs(px[4 * i + 3] - pal[j]) < std::abs(px[4 * i + 3] - pal[best])) best = j;
+				indices |= std::uint64_t(best) << (3 * i);
+			}
+		}
+		out[0] = a0; out[1] = a1;
+		for (unsigned i = 0; i < 6; ++i) out[2 + i] = (indices >> (8 * i)) & 0xFF;
+	}
+
+	void compress(Image const& img, pix::Format fmt, std::vector<unsigned char>& out) {
+		unsigned char block[64];
+		for (unsigned by = 0; by < img.height; by += 4) {
+			for (unsigned bx = 0; bx < img.width; bx += 4) {
+				for (unsigned y = 0; y < 4; ++y) for (unsigned x = 0; x < 4; ++x) std::memcpy(block + 4 * (4 * y + x), img.at(bx + x, by + y), 4);
+				std::size_t pos = out.size();
+				if (fmt == pix::BC1) {
+					out.resize(pos + 8);
+					encodeColors(block, &out[pos]);
+				} else {
+					out.resize(pos + 16);
+					encodeAlpha(block, &out[pos]);
+					encodeColors(block, &out[pos + 8]);
+				}
+			}
+		}
+	}
+}
+
+bool TextureCache::compressible(Bitmap const& bitmap) {
+	return (bitmap.fmt == pix::RGB || bitmap.fmt == pix::CHAR_RGBA) && !bitmap.linearPremul
+	  && bitmap.width >= MIN_SIZE && bitmap.height >= MIN_SIZE;
+}
+
+std::size_t TextureCache::levelBytes(Bitmap const& bitmap, unsigned level) {
+	return bytesOf(bitmap.fmt, bitmap.width, bitmap.height, level);
+}
+
+unsigned TextureCache::levels(Bitmap const& bitmap) {
+	return levelCount(bitmap.width, bitmap.height);
+}
+
+bool TextureCache::load(fs::path const& image, Bitmap& bitmap, unsigned maxSize) {
+	std::ifstream f(cacheFile(image, maxSize).string(), std::ios::binary);
+	if (!f) return false;
+	char magic[4];
+	DDSHeader h;
+	if (!f.read(magic, sizeof(magic)) || std::memcmp(magic, "DDS ", 4) != 0) return false;
+	if (!f.read(reinterpret_cast<char*>(&h), sizeof(h)) || h.size != sizeof(h)) return false;
+	pix::Format fmt;
+	if (h.pfFourCC == fourCC("DXT1")) fmt = pix::BC1;
+	else if (h.pfFourCC == fourCC("DXT5")) fmt = pix::BC3;
+	else return false;
+	if (h.width < MIN_SIZE || h.height < MIN_SIZE || h.width > 16384 || h.height > 16384) return false;
+	if (h.mipMapCount != levelCount(h.width, h.height)) return false;
+	std::size_t bytes = 0;
+	for (unsigned l = 0; l < h.mipMapCount; ++l) bytes += bytesOf(fmt, h.width, h.height, l);
+	std::vector<unsigned char> data(bytes);
+	if (!f.read(reinterpret_cast<char*>(data.data()), bytes) || f.peek() != std::ifstream::traits_type::eof()) return false;
+	Bitmap ret;
+	ret.buf.swap(data);
+	ret.width = h.width;
+	ret.height = h.height;
+	ret.ar = float(h.width) / float(h.height);
+	ret.fmt = fmt;
+	bitmap.swap(ret);
+	bitmap.linearPremul = false;
+	return true;
+}
+
+void TextureCache::save(fs::path const& image, Bitmap const& bitmap, unsigned maxSize) {
+	if (!compressible(bitmap)) throw std::logic_error("TextureCache::save: unsupported bitmap");
+	Image img = toRGBA(bitmap);
+	bool alpha = false;
+	for (std::size_t i = 3; i < img.data.size() && !alpha; i += 4) alpha = img.data[i] != 255;
+	pix::Format fmt = alpha ? pix::BC3 : pix::BC1;
+	unsigned levels = levelCount(img.width, img.height);
+	std::vector<unsigned char> data;
+	for (unsigned l = 0; l < levels; ++l) {
+		if (l > 0) img = downsample(img);
+		compress(img, fmt, data);
+	}
+	DDSHeader h{};
+	h.size = sizeof(h);
+	h.flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE;
+	h.width = bitmap.width;
+	h.height = bitmap.height;
+	h.linearSize = bytesOf(fmt, bitmap.width, bitmap.height, 0);
+	h.mipMapCount = levels;
+	h.pfSize = 32;
+	h.pfFlags = DDPF_FOURCC;
+	h.pfFourCC = fourCC(alpha ? "DXT5" : "DXT1");
+	h.caps = DDSCAPS_TEXTURE | DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+	// Write to a temporary name first so that load never sees partial files
+	fs::path file = cacheFile(image, maxSize);
+	fs::create_directories(file.parent_path());
+	fs::path part = file;
+	part += ".part";
+	{
+		std::ofstream f(part.string(), std::ios::binary);
+		f.write("DDS ", 4);
+		f.write(reinterpret_cast<char const*>(&h), sizeof(h));
+		f.write(reinterpret_cast<char const*>(data.data()), data.size());
+		if (!f) throw std::runtime_error("Cannot write " + part.string());
+	}
+	fs::rename(part, file);
+}
+
+fs::path TextureCache::jpeg(fs::path const& image, unsigned maxSize) {
+	fs::path file = cacheFile(image, maxSize, ".jpg");
+	if (fs::exists(file)) return file;
+	// Decoded and downscaled like the textures of the same size
+	Bitmap bitmap;
+	std::string ext = boost::algorithm::to_lower_copy(image.extension().string());
+	if (ext == ".jpg" || ext == ".jpeg") loadJPEG(bitmap, image, maxSize);
+	else if (ext == ".png") loadPNG(bitmap, image);
+	else throw std::runtime_error("Unknown image file format: " + image.string());
+	if (maxSize) bitmap.shrink(maxSize);
+	// A temporary name of this thread first, so that concurrent requests never see (or write) partial files
+	fs::create_directories(file.parent_path());
+	fs::path part = file;
+	part += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".part";
+	writeJPEG(part, bitmap);
+	fs::rename(part, file);
+	return file;
+}
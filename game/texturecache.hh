@@ -0,0 +1,33 @@
+#pragma once
+
+#include "fs.hh"
+#include "image.hh"
+
+/**
+* On-disk cache of GPU-compressed images in getCacheDir() / "textures".
+* Covers and backgrounds are stored as DDS files with S3TC (BC1 for opaque, BC3 for translucent images)
+* and a precomputed mipmap chain, so that they can be uploaded without decoding and take a fraction of
+* the texture memory. Files are named by a hash of the source path, size and modification time (and
+* the size limit for downscaled versions such as cover thumbnails), so changed images simply miss.
+**/
+class TextureCache {
+  public:
+	/// Mipmap levels stored (matching GL_TEXTURE_MAX_LEVEL set by Texture::load)
+	static const unsigned LEVELS = 5;
+	/// Can bitmap be compressed (a decoded JPEG or PNG big enough to bother)?
+	static bool compressible(Bitmap const& bitmap);
+	/// Load the cached version of image (downscaled to maxSize, 0 for full size) into bitmap (pix::BC1 or pix::BC3). Returns false if not cached.
+	static bool load(fs::path const& image, Bitmap& bitmap, unsigned maxSize = 0);
+	/// Compress bitmap (decoded from image and downscaled to maxSize) and store it in the cache. Throws std::runtime_error on failure.
+	static void save(fs::path const& image, Bitmap const& bitmap, unsigned maxSize = 0);
+	/// Bytes of the given mipmap level of a compressed bitmap
+	static std::size_t levelBytes(Bitmap const& bitmap, unsigned level);
+	/// Number of mipmap levels in a compressed bitmap
+	static unsigned levels(Bitmap const& bitmap);
+	/**
+	* A JPEG of image downscaled to maxSize, for clients that cannot use the textures (the web interface). It is stored
+	* in the cache next to the texture of the same image and size, created on first use (from any thread). Throws
+	* std::runtime_error if the image cannot be read.
+	**/
+	static fs::path jpeg(fs::path const& image, unsigned maxSize);
+};
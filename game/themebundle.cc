@@ -0,0 +1,277 @@
+#include "themebundle.hh"
+
+#include "configuration.hh"
+#include "image.hh"
+#include "svg.hh"
+#include "threads.hh"
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+	const unsigned VERSION = 1;  ///< Part of the key, increment when the format changes
+	const char MAGIC[8] = { 'P', 'T', 'H', 'E', 'M', 'E', 0, 0 };
+	const std::size_t ALIGN = 16;  ///< Of the pixel data
+
+	// The file is a header, the entries, a string table (NUL terminated) and the pixel data (INT_ARGB), in native byte order
+	struct Header {
+		char magic[8];
+		std::uint64_t key;
+		std::uint64_t entries;
+	};
+	struct Entry {
+		std::uint64_t name, path;  ///< Offsets of the file name and the full path
+		std::int64_t time;  ///< Modification time of the source file
+		std::uint64_t size;  ///< Size of the source file
+		std::uint32_t width, height;  ///< Of the rasterization (0 for other than SVG)
+		std::uint64_t pixels;  ///< Offset of the rasterization
+	};
+
+	std::int64_t stamp(fs::path const& p) {
+		boost::system::error_code ec;
+		std::int64_t time = fs::last_write_time(p, ec);
+		return ec ? -1 : time;
+	}
+
+	bool isImage(fs::path const& p) {
+		std::string ext = boost::algorithm::to_lower_copy(p.extension().string());
+		return ext == ".svg" || ext == ".png" || ext == ".jpg" || ext == ".jpeg";
+	}
+
+	bool isSVG(fs::path const& p) { return boost::algorithm::to_lower_copy(p.extension().string()) == ".svg"; }
+
+	/// What a bundle is for: the theme, the SVG quality and the search path with the folders' modification times
+	struct Key {
+		std::string theme;
+		double lod;
+		std::uint64_t hash;
+		fs::path file;
+		static Key current() {
+			Key key;
+			key.theme = config["game/theme"].getEnumName();
+			key.lod = config["graphic/svg_lod"].f();
+			std::ostringstream oss;
+			oss << VERSION << ' ' << key.theme << ' ' << key.lod;
+			for (auto const& dir: getThemePaths()) oss << '\n' << dir.string() << ' ' << stamp(dir);
+			key.hash = std::hash<std::string>()(oss.str());
+			key.file = getCacheDir() / "themes" / (key.theme + ".bundle");
+			return key;
+		}
+	};
+
+	class Bundle {
+	  public:
+		/// Map file, throws if it is not a valid bundle of key
+		Bundle(Key const& key): m_theme(key.theme), m_lod(key.lod), m_map(key.file.string()) {
+			char const* data = m_map.data();
+			const std::size_t size = m_map.size();
+			if (size < sizeof(Header)) throw std::runtime_error("Truncated file");
+			Header const& h = *reinterpret_cast<Header const*>(data);
+			if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC))) throw std::runtime_error("Not a theme bundle");
+			if (h.key != key.hash) throw std::runtime_error("Outdated");
+			if (h.entries > (size - sizeof(Header)) / sizeof(Entry)) throw std::runtime_error("Truncated file");
+			auto str = [&](std::uint64_t offset) -> char const* {
+				if (offset >= size || !std::memchr(data + offset, 0, size - offset)) throw std::runtime_error("Invalid string");
+				return data + offset;
+			};
+			Entry const* entries = reinterpret_cast<Entry const*>(data + sizeof(Header));
+			for (std::uint64_t i = 0; i < h.entries; ++i) {
+				Entry const& e = entries[i];
+				if (e.width && (e.pixels % ALIGN || e.pixels > size || std::uint64_t(e.width) * e.height * 4 > size - e.pixels)) throw std::runtime_error("Invalid image");
+				m_byName.emplace(str(e.name), &e);
+				m_byPath.emplace(str(e.path), &e);
+			}
+		}
+		/// Does this bundle cover the current configuration?
+		bool matches() const { return config["game/theme"].getEnumName() == m_theme && config["graphic/svg_lod"].f() == m_lod; }
+		fs::path find(std::string const& name) const {
+			auto it = m_byName.find(name);
+			return it == m_byName.end() ? fs::path() : fs::path(path(*it->second));
+		}
+		bool load(std::string const& path, Bitmap& bitmap) const {
+			auto it = m_byPath.find(path);
+			if (it == m_byPath.end() || !it->second->width) return false;
+			Entry const& e = *it->second;
+			Bitmap ret;
+			ret.fmt = pix::INT_ARGB;
+			ret.resize(e.width, e.height);
+			std::memcpy(ret.data(), m_map.data() + e.pixels, std::size_t(e.width) * e.height * 4);
+			bitmap.swap(ret);
+			bitmap.linearPremul = true;
+			return true;
+		}
+		/// Have any of the files changed since the bundle was written?
+		bool stale() const {
+			for (auto const& p: m_byPath) {
+				boost::system::error_code ec;
+				const fs::path file = p.first;
+				const std::uintmax_t size = fs::file_size(file, ec);
+				if (ec || size != p.second->size || stamp(file) != p.second->time) return true;
+			}
+			return false;
+		}
+	  private:
+		char const* path(Entry const& e) const { return m_map.data() + e.path; }
+		std::string m_theme;
+		double m_lod;
+		boost::iostreams::mapped_file_source m_map;
+		std::unordered_map<std::string, Entry const*> m_byName, m_byPath;
+	};
+
+	std::mutex s_mutex;
+	std::shared_ptr<Bundle const> s_bundle;  ///< The bundle in use (guarded by s_mutex)
+
+	std::shared_ptr<Bundle const> current() {
+		std::lock_guard<std::mutex> l(s_mutex);
+		return s_bundle;
+	}
+
+	/// Collect the images of the search path (the first file of each name, as findFile does) and write them to key.file
+	void build(Key const& key, std::atomic<bool> const& quit) {
+		struct Source {
+			std::string name, path;
+			std::int64_t time;
+			std::uint64_t size;
+			Bitmap bitmap;
+		};
+		std::vector<Source> sources;
+		std::unordered_map<std::string, std::size_t> found;
+		for (auto const& dir: getThemePaths()) {
+			boost::system::error_code ec;
+			if (!fs::is_directory(dir, ec)) continue;
+			for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+				const fs::path p = it->path();
+				if (!isImage(p) || !fs::is_regular_file(p, ec) || found.count(p.filename().string())) continue;
+				found.emplace(p.filename().string(), sources.size());
+				sources.push_back(Source{ p.filename().string(), p.string(), stamp(p), fs::file_size(p, ec), Bitmap() });
+			}
+		}
+		for (auto& s: sources) {
+			if (quit) return;
+			if (!isSVG(s.path)) continue;
+			try {
+				loadSVG(s.bitmap, s.path);
+				if (s.bitmap.fmt != pix::INT_ARGB) s.bitmap = Bitmap();
+			} catch (std::exception& e) {
+				std::clog << "themes/warning: Not bundling " << s.path << ": " << e.what() << std::endl;
+				s.bitmap = Bitmap();
+			}
+		}
+		// Lay out the file
+		std::vector<Entry> entries(sources.size());
+		std::string strings;
+		std::uint64_t offset = sizeof(Header) + entries.size() * sizeof(Entry);
+		for (std::size_t i = 0; i < sources.size(); ++i) {
+			entries[i].name = offset + strings.size();
+			strings += sources[i].name + '\0';
+			entries[i].path = offset + strings.size();
+			strings += sources[i].path + '\0';
+		}
+		offset += strings.size();
+		std::uint64_t pixels = (offset + ALIGN - 1) / ALIGN * ALIGN;
+		for (std::size_t i = 0; i < sources.size(); ++i) {
+			Entry& e = entries[i];
+			Bitmap const& b = sources[i].bitmap;
+			e.time = sources[i].time;
+			e.size = sources[i].size;
+			if (b.buf.empty()) continue;
+			e.width = b.width;
+			e.height = b.height;
+			e.pixels = pixels;
+			pixels += (std::uint64_t(b.width) * b.height * 4 + ALIGN - 1) / ALIGN * ALIGN;
+		}
+		Header h{};
+		std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+		h.key = key.hash;
+		h.entries = entries.size();
+		// Write to a temporary name first so that a bundle is never seen half written
+		fs::create_directories(key.file.parent_path());
+		fs::path part = key.file;
+		part += ".part";
+		{
+			fs::ofstream f(part, std::ios::binary);
+			f.write(reinterpret_cast<char const*>(&h), sizeof(h));
+			f.write(reinterpret_cast<char const*>(entries.data()), entries.size() * sizeof(Entry));
+			f.write(strings.data(), strings.size());
+			for (std::size_t i = 0; i < sources.size(); ++i) {
+				if (!entries[i].width) continue;
+				const std::vector<char> padding(entries[i].pixels - std::uint64_t(f.tellp()));
+				f.write(padding.data(), padding.size());
+				f.write(reinterpret_cast<char const*>(sources[i].bitmap.data()), std::size_t(entries[i].width) * entries[i].height * 4);
+			}
+			if (!f) throw std::runtime_error("Cannot write " + part.string());
+		}
+		fs::rename(part, key.file);
+		std::clog << "themes/info: Bundled " << sources.size() << " images of theme " << key.theme << std::endl;
+	}
+}
+
+class ThemeBundle::Impl {
+  public:
+	Impl(): m_key(Key::current()) {
+		std::shared_ptr<Bundle const> bundle;
+		try {
+			bundle = std::make_shared<Bundle const>(m_key);
+		} catch (std::exception& e) {
+			std::clog << "themes/info: Not using the theme bundle: " << e.what() << std::endl;
+		}
+		{
+			std::lock_guard<std::mutex> l(s_mutex);
+			s_bundle = bundle;
+		}
+		m_thread = std::thread([this, bundle] { update(bundle); });
+	}
+	~Impl() {
+		m_quit = true;
+		m_thread.join();
+		std::lock_guard<std::mutex> l(s_mutex);
+		s_bundle.reset();
+	}
+  private:
+	/// Rebuild the bundle if there is none or it is stale, and take the new one into use
+	void update(std::shared_ptr<Bundle const> bundle) {
+		threads::enter(threads::Class::io, "theme bundle");
+		try {
+			if (bundle && !bundle->stale()) return;
+			bundle.reset();
+			build(m_key, m_quit);
+			if (m_quit) return;
+			bundle = std::make_shared<Bundle const>(m_key);
+			std::lock_guard<std::mutex> l(s_mutex);
+			s_bundle = bundle;
+		} catch (std::exception& e) {
+			std::clog << "themes/error: Cannot build the theme bundle: " << e.what() << std::endl;
+		}
+	}
+	Key m_key;
+	std::atomic<bool> m_quit{ false };
+	std::thread m_thread;
+};
+
+ThemeBundle::ThemeBundle(): self(std::make_unique<Impl>()) {}
+
+ThemeBundle::~ThemeBundle() = default;
+
+fs::path ThemeBundle::find(fs::path const& filename) {
+	auto bundle = current();
+	if (!bundle || !bundle->matches()) return fs::path();
+	return bundle->find(filename.string());
+}
+
+bool ThemeBundle::load(fs::path const& path, Bitmap& bitmap) {
+	auto bundle = current();
+	return bundle && bundle->matches() && bundle->load(path.string(), bitmap);
+}
+
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "fs.hh"
+#include <memory>
+
+struct Bitmap;
+
+/**
+* The images of the current theme packed into a single file (getCacheDir() / "themes" / <theme>.bundle) with an
+* index by file name and all SVGs rasterized at graphic/svg_lod, so that finding and loading theme images takes
+* one memory mapping instead of probing, reading and hashing each file.
+*
+* The bundle is identified by the theme, the SVG quality and the modification times of the theme folders, which
+* are checked when it is opened. A thread then checks the stamps of the files themselves and rebuilds the bundle
+* when anything has changed (or when there was no valid bundle), replacing the one in use once done.
+* Lookups while the theme or graphic/svg_lod differ from those of the bundle simply miss.
+**/
+class ThemeBundle {
+  public:
+	/// Open the bundle of the configured theme (only one instance may exist at a time)
+	ThemeBundle();
+	~ThemeBundle();
+	ThemeBundle(ThemeBundle const&) = delete;
+	ThemeBundle& operator=(ThemeBundle const&) = delete;
+	/// The full path that findFile would return for filename, or an empty path if it is not in the bundle. Thread-safe.
+	static fs::path find(fs::path const& filename);
+	/// Load the rasterization of the SVG file path into bitmap. Returns false if it is not in the bundle. Thread-safe.
+	static bool load(fs::path const& path, Bitmap& bitmap);
+	class Impl;
+  private:
+	std::unique_ptr<Impl> self;
+};
+
@@ -0,0 +1,54 @@
+#include "threads.hh"
+
+#include "configuration.hh"
+#include "platform.hh"
+#include "profiler.hh"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+
+namespace {
+	/// Cores for the pools; with audio/reserve_core the last one is left to audio
+	unsigned usableCores(bool& reserved) {
+		const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+		reserved = cores >= 4 && cores <= 64 && config["audio/reserve_core"].b();
+		return cores - reserved;
+	}
+}
+
+namespace threads {
+	void enter(Class cls, char const* name) {
+		trace::threadName(name);
+		switch (cls) {
+		case Class::audio: Platform::raiseThreadPriority(); break;
+		case Class::decode: Platform::lowerThreadPriority(2); break;
+		case Class::io: Platform::lowerThreadPriority(5); break;
+		case Class::background: Platform::lowerThreadPriority(10); break;
+		}
+		bool reserved;
+		const unsigned usable = usableCores(reserved);
+		if (!reserved) return;
+		const std::uint64_t audioCore = std::uint64_t(1) << usable;
+		if (!Platform::setThreadAffinity(cls == Class::audio ? audioCore : audioCore - 1))
+			std::clog << "platform/warning: Cannot set the CPU cores of thread " << name << std::endl;
+	}
+
+	unsigned poolSize(Class cls, unsigned configured) {
+		if (configured) return configured;
+		bool reserved;
+		const unsigned usable = usableCores(reserved);
+		switch (cls) {
+		case Class::audio: return 1;
+		case Class::decode: return std::max(1u, usable - 1);  // Leave a core for rendering
+		case Class::io: return usable;
+		case Class::background: return std::max(1u, usable / 2);
+		}
+		return 1;
+	}
+
+	Budget& decodeBudget() {
+		static Budget budget(poolSize(Class::decode, config["audio/decoder_threads"].i()));
+		return budget;
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+
+/**
+* Classes of the threads of the game. Each long-running thread enters the class of its work, which sets its
+* priority and the CPU cores it may run on, and thread pools are sized by class. With audio/reserve_core one
+* core is kept for the audio threads alone; audio/decoder_threads limits the decoders working at once, so that
+* starting a song with many tracks and a video does not crowd out the audio callback.
+**/
+namespace threads {
+	enum class Class {
+		audio,  ///< Real-time mixing (highest priority)
+		decode,  ///< Audio and video decoding for playback (buffered, but must keep up)
+		io,  ///< Loading songs, images and caches that the user is waiting for
+		background  ///< Analysis and maintenance that nobody waits for (lowest priority)
+	};
+
+	/// Name the calling thread (for the profiler) and apply the priority and cores of its class
+	void enter(Class cls, char const* name);
+	/// Threads for a pool of the class: the configured number if nonzero, otherwise a share of the cores
+	unsigned poolSize(Class cls, unsigned configured = 0);
+
+	/// Limits how many threads do a kind of work at once. Hold a Slot for each unit of work (not while waiting for something else).
+	class Budget {
+	  public:
+		explicit Budget(unsigned slots): m_free(slots) {}
+		class Slot {
+		  public:
+			explicit Slot(Budget& budget): m_budget(budget) {
+				std::unique_lock<std::mutex> l(m_budget.m_mutex);
+				m_budget.m_cond.wait(l, [this] { return m_budget.m_free > 0; });
+				--m_budget.m_free;
+			}
+			~Slot() {
+				{
+					std::lock_guard<std::mutex> l(m_budget.m_mutex);
+					++m_budget.m_free;
+				}
+				m_budget.m_cond.notify_one();
+			}
+			Slot(Slot const&) = delete;
+			Slot& operator=(Slot const&) = delete;
+		  private:
+			Budget& m_budget;
+		};
+	  private:
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		unsigned m_free;
+	};
+
+	/// Decoders working at once (audio/decoder_threads)
+	Budget& decodeBudget();
+}
@@ -1,9 +1,16 @@
 #include "unicode.hh"
 
 #include "configuration.hh"
+#include "libda/simd.hpp"
 #include "regex.hh"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
+#include <unicode/normalizer2.h>
+#include <unicode/uchar.h>
 #include <unicode/unistr.h>
 #include <unicode/ustream.h>
 #include "../3rdparty/ced/compact_enc_det/compact_enc_det.h"
@@ -12,13 +19,85 @@ UErrorCode UnicodeUtil::m_staticIcuError = U_ZERO_ERROR;
 icu::RuleBasedCollator UnicodeUtil::m_dummyCollator (icu::UnicodeString (""), icu::Collator::PRIMARY, m_staticIcuError);
 icu::RuleBasedCollator UnicodeUtil::m_sortCollator  (nullptr, icu::Collator::SECONDARY, m_staticIcuError);
 
-std::string UnicodeUtil::getCharset (std::string const& str) {
-	const char* text = str.c_str();
+namespace {
+	std::mutex s_collatorMutex;  ///< Guards the prototypes while they are changed or copied
+	std::atomic<unsigned> s_sortVersion{ 0 };  ///< Incremented by setSortStrength, outdating the copies
+
+	/// A copy of a prototype collator for one thread
+	struct CollatorCopy {
+		std::unique_ptr<icu::RuleBasedCollator> collator;
+		unsigned version = 0;
+		icu::RuleBasedCollator& get(icu::RuleBasedCollator const& prototype, unsigned current) {
+			if (!collator || version != current) {
+				std::lock_guard<std::mutex> l(s_collatorMutex);
+				collator.reset(static_cast<icu::RuleBasedCollator*>(prototype.clone()));
+				version = current;
+			}
+			return *collator;
+		}
+	};
+}
+
+void UnicodeUtil::setSortStrength(icu::Collator::ECollationStrength strength) {
+	std::lock_guard<std::mutex> l(s_collatorMutex);
+	UErrorCode error = U_ZERO_ERROR;
+	m_sortCollator.setAttribute(UCOL_STRENGTH, UColAttributeValue(strength), error);
+	if (U_FAILURE(error)) std::clog << "sorting/error: Unable to change collator strength." << std::endl;
+	++s_sortVersion;
+}
+
+icu::RuleBasedCollator& UnicodeUtil::sortCollator() {
+	static thread_local CollatorCopy copy;
+	return copy.get(m_sortCollator, s_sortVersion);
+}
+
+icu::RuleBasedCollator& UnicodeUtil::searchCollator() {
+	static thread_local CollatorCopy copy;
+	return copy.get(m_dummyCollator, 0);
+}
+
+namespace {
+	/// Length of the plain ASCII at the beginning of [begin, end), checked 16 bytes at a time where SIMD is available
+	std::size_t asciiPrefix(unsigned char const* begin, unsigned char const* end) {
+		unsigned char const* p = begin;
+#if defined(DA_SIMD_SSE2)
+		// Up to the block with a high bit set, in which the scalar loop finds the byte
+		for (; end - p >= 16; p += 16) if (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p)))) break;
+#elif defined(DA_SIMD_NEON) && defined(__aarch64__)
+		for (; end - p >= 16; p += 16) if (vmaxvq_u8(vld1q_u8(p)) >= 0x80) break;
+#endif
+		while (p != end && *p < 0x80) ++p;
+		return p - begin;
+	}
+}
+
+bool UnicodeUtil::isUTF8(boost::string_ref str) {
+	auto p = reinterpret_cast<unsigned char const*>(str.data());
+	auto const end = p + str.size();
+	while (true) {
+		p += asciiPrefix(p, end);
+		if (p == end) return true;
+		// A multi-byte sequence: the lead byte tells the length and the range of the first continuation byte,
+		// which rules out overlong forms, surrogates and code points above U+10FFFF
+		unsigned len;
+		unsigned char lo = 0x80, hi = 0xBF;
+		const unsigned char c = *p;
+		if (c >= 0xC2 && c <= 0xDF) len = 2;
+		else if (c >= 0xE0 && c <= 0xEF) { len = 3; if (c == 0xE0) lo = 0xA0; else if (c == 0xED) hi = 0x9F; }
+		else if (c >= 0xF0 && c <= 0xF4) { len = 4; if (c == 0xF0) lo = 0x90; else if (c == 0xF4) hi = 0x8F; }
+		else return false;
+		if (std::size_t(end - p) < len || p[1] < lo || p[1] > hi) return false;
+		for (unsigned i = 2; i < len; ++i) if ((p[i] & 0xC0) != 0x80) return false;
+		p += len;
+	}
+}
+
+std::string UnicodeUtil::getCharset (boost::string_ref str) {
 	int bytes_consumed;
 	bool is_reliable;
 	
 	Encoding encoding = CompactEncDet::DetectEncoding(
-        text, strlen(text),
+        str.data(), str.size(),
         nullptr, nullptr, nullptr,
         UNKNOWN_ENCODING,
         UNKNOWN_LANGUAGE,
@@ -30,41 +109,42 @@ std::string UnicodeUtil::getCharset (std::string const& str) {
 	if (!is_reliable) {
 			std::clog << "unicode/warning: detected encoding (" <<
 			MimeEncodingName(encoding) << ") for text: " <<
-			((str.size() <= 256) ? str : str.substr(0,255)) <<
+			str.substr(0, 255) <<
 			" was flagged as not reliable." <<
 			std::endl; // Magic number, so sue me.
 		}
 	return MimeEncodingName(encoding);
 }
 
-void UnicodeUtil::convertToUTF8 (std::stringstream &_stream, std::string _filename) {
-	std::string data = _stream.str();
-	std::string charset = UnicodeUtil::getCharset(data);	
-	icu::UnicodeString ustring;
+boost::string_ref UnicodeUtil::convertToUTF8 (boost::string_ref data, std::string& buffer, std::string const& filename) {
 	// Test for UTF-8 BOM (a three-byte sequence at the beginning of a file)
-	if (data.substr(0, 3) == "\xEF\xBB\xBF") {
-		_stream.str(data.substr(3)); // Remove BOM if there is one
-	}
-	if (charset != "UTF-8") {
-		if (!_filename.empty()) { std::clog << "unicode/info: " << _filename << " does not appear to be UTF-8; (" << charset << ") detected." << std::endl; }
-		std::string _str;
-		const char* tmp = data.c_str();
-		icu::UnicodeString ustring = icu::UnicodeString(tmp, charset.c_str());
-		if (!ustring.isEmpty()) {
-			_stream.str(ustring.toUTF8String(_str));
-		}
-		else {
-			if (!data.empty()) {
-				std::clog << "unicode/error: tried to convert text in an unknown encoding: " << charset << std::endl;
-			}
-		}
+	if (data.starts_with("\xEF\xBB\xBF")) data.remove_prefix(3); // Remove BOM if there is one
+	// Valid UTF-8 (including plain ASCII) needs no conversion, nor detection
+	if (isUTF8(data)) return data;
+	std::string charset = UnicodeUtil::getCharset(data);
+	if (charset == "UTF-8") return data;
+	if (!filename.empty()) { std::clog << "unicode/info: " << filename << " does not appear to be UTF-8; (" << charset << ") detected." << std::endl; }
+	icu::UnicodeString ustring = icu::UnicodeString(data.data(), data.size(), charset.c_str());
+	if (ustring.isEmpty()) {
+		std::clog << "unicode/error: tried to convert text in an unknown encoding: " << charset << std::endl;
+		return data;
 	}
+	buffer.clear();
+	return ustring.toUTF8String(buffer);
+}
+
+void UnicodeUtil::convertToUTF8 (std::stringstream &_stream, std::string _filename) {
+	std::string data = _stream.str();
+	std::string buffer;
+	boost::string_ref converted = convertToUTF8(data, buffer, _filename);
+	if (converted.data() != data.data() || converted.size() != data.size()) _stream.str(converted.to_string());
 }
 
 std::string UnicodeUtil::convertToUTF8 (std::string const& str) {
-	std::stringstream ss (str);
-	convertToUTF8 (ss, std::string());
-	return ss.str();
+	std::string buffer;
+	boost::string_ref converted = convertToUTF8(str, buffer, std::string());
+	if (converted.data() == buffer.data()) return buffer;
+	return converted.size() == str.size() ? str : converted.to_string();
 }
 
 std::string UnicodeUtil::toLower (std::string const& str, size_t length) {
@@ -89,6 +169,19 @@ std::string UnicodeUtil::toUpper (std::string const& str, size_t length) {
 	return ret;
 }
 
+std::string UnicodeUtil::foldForSearch (std::string const& str) {
+	UErrorCode error = U_ZERO_ERROR;
+	icu::UnicodeString decomposed = icu::Normalizer2::getNFDInstance(error)->normalize(icu::UnicodeString::fromUTF8(str).foldCase(), error);
+	if (U_FAILURE(error)) return str;
+	icu::UnicodeString folded;
+	for (int32_t i = 0; i < decomposed.length(); i = decomposed.moveIndex32(i, 1)) {
+		UChar32 c = decomposed.char32At(i);
+		if (u_charType(c) != U_NON_SPACING_MARK) folded.append(c);
+	}
+	std::string ret;
+	return folded.toUTF8String(ret);
+}
+
 void UnicodeUtil::collate (songMetadata& stringmap) {
 	for (auto& kv: stringmap) { 
 		ConfigItem::StringList termsToCollate = config["game/sorting_ignore"].sl();
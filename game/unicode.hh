@@ -1,5 +1,6 @@
 #pragma once
 
+#include <boost/utility/string_ref.hpp>
 #include <iostream>
 #include <map>
 #include <string>
@@ -13,11 +14,22 @@ struct UnicodeUtil {
 	UnicodeUtil() {}
 	~UnicodeUtil() {};
 	static void collate (songMetadata& stringmap);
-	static std::string getCharset(std::string const& str);
+	static std::string getCharset(boost::string_ref str);
+	/// Is str valid UTF-8 (which includes plain ASCII)? Much faster than getCharset, which is only needed otherwise.
+	static bool isUTF8(boost::string_ref str);
+	/// Returns data as UTF-8 without BOM: a view into data if it already is UTF-8, otherwise into buffer (which receives the converted text)
+	static boost::string_ref convertToUTF8 (boost::string_ref data, std::string& buffer, std::string const& filename);
 	static void convertToUTF8 (std::stringstream &_stream, std::string _filename);
 	static std::string convertToUTF8 (std::string const& str);
 	static std::string toLower (std::string const& str, size_t length = 0);
 	static std::string toUpper (std::string const& str, size_t length = 0);
+	/// Case fold and strip accents (UTF-8 in and out), so that plain substring search ignores both
+	static std::string foldForSearch (std::string const& str);
+	/// Change the strength of m_sortCollator (and of the copies of sortCollator() from then on)
+	static void setSortStrength(icu::Collator::ECollationStrength strength);
+	/// Copies of m_sortCollator and m_dummyCollator for the calling thread, as an ICU collator must not be used by two threads at once
+	static icu::RuleBasedCollator& sortCollator();
+	static icu::RuleBasedCollator& searchCollator();
 	static icu::RuleBasedCollator m_dummyCollator;
 	static icu::RuleBasedCollator m_sortCollator;
 	static UErrorCode m_staticIcuError;
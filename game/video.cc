@@ -1,16 +1,41 @@
 #include "video.hh"
 
 #include "ffmpeg.hh"
+#include "log.hh"
 #include "util.hh"
+#include "threads.hh"
 #include <cmath>
+#include <iostream>
+
+namespace {
+	/// Memory for decoded frames (about 25 frames of 1080p or 6 of 4K)
+	const std::size_t QUEUE_BYTES = 80 << 20;
+	/// Decoding ahead further than this is pointless, as frames are consumed in real time
+	const double QUEUE_SECONDS = 1.0;
+	/// The queue always takes this many frames, however big
+	const std::size_t QUEUE_MIN_FRAMES = 3;
+	/// Jumps further ahead than this past the queued frames seek; shorter ones are faster to decode through,
+	/// as late frames are skipped before conversion (see VideoFFmpeg::Display)
+	const double SEEK_AHEAD = 2.0;
+}
+
+bool Video::hasRoom(std::size_t bytes) const {
+	if (m_queue.size() < QUEUE_MIN_FRAMES) return true;
+	return m_queueBytes + bytes <= QUEUE_BYTES && backPosition() - headPosition() < QUEUE_SECONDS;
+}
+
+Video::QueueStats Video::queueStats() const {
+	std::lock_guard<lockstats::Mutex> l(m_mutex);
+	const double seconds = m_queue.empty() ? 0.0 : std::max(0.0, backPosition() - headPosition());
+	return QueueStats{ m_queue.size(), m_queueBytes, seconds, m_display.dropped, m_discarded };
+}
 
 bool Video::tryPop(Bitmap& f, double timestamp) {
-	std::unique_lock<std::mutex> l(m_mutex);
+	std::unique_lock<lockstats::Mutex> l(m_mutex);
 
 	// if timestamp is out of the queue's range, ask a seek
-	// FIXME 4 should be linked to queue depth: we know the frame rate, thus how
-	// many frames needed for an arbitrary duration
-	m_seek_asked |= timestamp > m_readPosition + 4 || timestamp < m_readPosition;
+	const double decoded = m_queue.empty() ? m_readPosition : std::max(m_readPosition, backPosition());
+	m_seek_asked |= timestamp > decoded + SEEK_AHEAD || timestamp < m_readPosition;
 
 	m_readPosition = timestamp;
 
@@ -21,37 +46,52 @@ bool Video::tryPop(Bitmap& f, double timestamp) {
 	if (m_seek_asked) return false;
 
 	// discard outdated frames retaining only the most recent frame that is _before_ timestamp
-	while (!m_queue.empty() && std::next(m_queue.begin()) != m_queue.end() && std::next(m_queue.begin())->timestamp < timestamp) m_queue.pop_front();
+	while (!m_queue.empty() && std::next(m_queue.begin()) != m_queue.end() && std::next(m_queue.begin())->timestamp < timestamp) {
+		m_queueBytes -= m_queue.front().buf.size();
+		m_queue.pop_front();
+		++m_discarded;
+	}
+	m_queueMemory.set(m_queueBytes);
 
 	if (m_queue.empty() || m_queue.front().timestamp > timestamp) return false; // Nothing to deliver
 
 	f = std::move(m_queue.front());
 	m_queue.pop_front();
+	m_queueBytes -= f.buf.size();
+	m_queueMemory.set(m_queueBytes);
 	return true;
 }
 
 void Video::push(Bitmap&& f) {
-	std::unique_lock<std::mutex> l(m_mutex);
-	m_cond.wait(l, [this]{ return m_quit || m_seek_asked || m_queue.size() < m_max; });
+	std::unique_lock<lockstats::Mutex> l(m_mutex);
+	const std::size_t bytes = f.buf.size();
+	m_cond.wait(l, [this, bytes]{ return m_quit || m_seek_asked || hasRoom(bytes); });
 	if (m_quit || m_seek_asked) return; // Drop frame when seek/quit asked
 	m_queue.emplace_back(std::move(f));
+	m_queueBytes += bytes;
+	m_queueMemory.set(m_queueBytes);
 }
 
 Video::~Video() { 
 	{
-		std::lock_guard<std::mutex> l(m_mutex);
+		std::lock_guard<lockstats::Mutex> l(m_mutex);
 		m_quit = true;
 	}
 	m_cond.notify_all();
 	m_grabber.get();
+	QueueStats stats = queueStats();
+	if (stats.dropped || stats.discarded) LOG("video", debug) << stats.dropped << " late frames dropped, " << stats.discarded << " not shown" << std::endl;
 }
 
 Video::Video(fs::path const& _videoFile, double videoGap): m_videoGap(videoGap), m_textureTime(), m_alpha(-0.5, 1.5) {
 	// make ffmpeg here to get any exception in the current thread
-	auto ffmpeg = std::make_unique<VideoFFmpeg>(_videoFile, [this] (auto f) { push(std::move(f)); });
+	m_display.width = screenW();
+	m_display.height = screenH();
+	auto ffmpeg = std::make_unique<VideoFFmpeg>(_videoFile, [this] (auto f) { push(std::move(f)); }, m_display);
 	m_grabber = std::async(std::launch::async, [this, file = _videoFile, ffmpeg = std::move(ffmpeg)] {
+		threads::enter(threads::Class::decode, "video decoder");
 		int errors = 0;
-		std::unique_lock<std::mutex> l(m_mutex);
+		std::unique_lock<lockstats::Mutex> l(m_mutex);
 		while (!m_quit) {
 			if (m_seek_asked) {
 				m_seek_asked = false;
@@ -59,6 +99,8 @@ Video::Video(fs::path const& _videoFile, double videoGap): m_videoGap(videoGap),
 				auto seek_pos = m_readPosition;
 				// discard all outdated frame. To avoid races between clean and push, clean and push are done in this thread.
 				m_queue.clear();
+				m_queueBytes = 0;
+				m_queueMemory.set(0);
 
 				UnlockGuard<decltype(l)> unlocked(l); // release lock during seek
 				ffmpeg->seek(seek_pos);
@@ -73,7 +115,7 @@ Video::Video(fs::path const& _videoFile, double videoGap): m_videoGap(videoGap),
 				{
 					UnlockGuard<decltype(l)> unlocked(l); // release lock for possibly blocking calls
 					push(Bitmap()); // EOF marker
-					std::clog << "ffmpeg/debug: done loading " << file << std::endl;
+					LOG("ffmpeg", debug) << "done loading " << file << std::endl;
 				}
 				m_cond.wait(l, [this]{ return m_quit || m_seek_asked; });
 			} catch (std::exception& e) {
@@ -83,6 +125,11 @@ Video::Video(fs::path const& _videoFile, double videoGap): m_videoGap(videoGap),
 			}
 		}
 	});
+	const std::string label = metrics::label("file", _videoFile.filename().string());
+	m_metrics.push_back(std::make_unique<metrics::Family>("performous_video_queue_frames", "Decoded video frames waiting to be shown", "gauge",
+	  [this, label] { return metrics::Samples{ metrics::Sample{ label, double(queueStats().frames) } }; }));
+	m_metrics.push_back(std::make_unique<metrics::Family>("performous_video_queue_seconds", "Video time covered by the decoded frames", "gauge",
+	  [this, label] { return metrics::Samples{ metrics::Sample{ label, queueStats().seconds } }; }));
 }
 
 void Video::prepare(double time) {
@@ -90,14 +137,35 @@ void Video::prepare(double time) {
 
 	// shift video timestamp if gap is declared in song config
 	time += m_videoGap;
+	// Follow window resizes and playback
+	m_display.width = screenW();
+	m_display.height = screenH();
+	m_display.time = time;
 
 	Bitmap videoFrame;
 	if (tryPop(videoFrame, time) && !videoFrame.buf.empty()) {
-		m_texture.load(videoFrame);
+		load(videoFrame);
 		m_textureTime = videoFrame.timestamp;
 	}
 }
 
+void Video::load(Bitmap const& frame) {
+	const unsigned stride = (frame.width + 15) & ~15u;  // See pix::YUV420P
+	unsigned char const* data = frame.data();
+	for (unsigned i = 0; i < 3; ++i) {
+		// Chroma planes have half the resolution (rounded up)
+		const unsigned w = i ? (frame.width + 1) / 2 : frame.width, h = i ? (frame.height + 1) / 2 : frame.height, rowLength = i ? stride / 2 : stride;
+		const std::size_t bytes = std::size_t(rowLength) * h;
+		m_planes[i].update(GL_R8, w, h, GL_RED, GL_UNSIGNED_BYTE, data, bytes, rowLength);
+		data += bytes;
+	}
+	if (frame.width != m_width || frame.height != m_height) {
+		m_width = frame.width;
+		m_height = frame.height;
+		m_dimensions = Dimensions(frame.ar).fixedWidth(1.0f);
+	}
+}
+
 void Video::render(double time) {
 	time += m_videoGap;
 	double tdist = std::abs(m_textureTime - time);
@@ -105,6 +173,30 @@ void Video::render(double time) {
 	double alpha = clamp(m_alpha.get());
 	if (alpha == 0.0) return;
 	ColorTrans c(Color::alpha(alpha));
-	m_texture.draw();
+	if (m_width == 0) return;
+	glutil::GLErrorChecker glerror("Video::render");
+	glutil::GPUTimer::Section section("video");
+	UseShader shader(getShader("video"));
+	// Y on the usual texture unit, U and V on the next ones
+	for (unsigned i = 2; i < 3; --i) {
+		glutil::bindTexture(GL_TEXTURE_2D, m_planes[i].id(), i);
+	}
+	shader()[UniformId::texU].set(1);
+	shader()[UniformId::texV].set(2);
+	// Limited range YCbCr to R'G'B' (columns for Y, Cb and Cr); HD videos use BT.709, others BT.601
+	const float ys = 255.0f / 219.0f, cs = 255.0f / 224.0f;
+	const bool hd = m_height >= 720;
+	shader()[UniformId::yuvMatrix].setMat3(glmath::mat3(
+	  ys, ys, ys,
+	  0.0f, (hd ? -0.1873f : -0.3441f) * cs, (hd ? 1.8556f : 1.7720f) * cs,
+	  (hd ? 1.5748f : 1.4020f) * cs, (hd ? -0.4681f : -0.7141f) * cs, 0.0f));
+	glutil::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	Dimensions const& dim = m_dimensions;
+	glutil::VertexArray va;
+	va.texCoord(0.0f, 0.0f).vertex(dim.x1(), dim.y1());
+	va.texCoord(1.0f, 0.0f).vertex(dim.x2(), dim.y1());
+	va.texCoord(0.0f, 1.0f).vertex(dim.x1(), dim.y2());
+	va.texCoord(1.0f, 1.0f).vertex(dim.x2(), dim.y2());
+	va.draw();
 }
 
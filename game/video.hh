@@ -1,10 +1,15 @@
 #pragma once
 
 #include "animvalue.hh"
+#include "ffmpeg.hh"
+#include "lockstats.hh"
+#include "memstats.hh"
+#include "metrics.hh"
 #include "texture.hh"
 #include <deque>
 #include <future>
 #include <string>
+#include <vector>
    
 /// class for playing videos  
 class Video {
@@ -15,15 +20,29 @@ class Video {
 	void prepare(double time);  ///< Load the current video frame into a texture
 	void render(double time);  ///< Render the prepared video frame
 	/// returns Dimensions of video clip
-	Dimensions const& dimensions() const { return m_texture.dimensions; }
+	Dimensions const& dimensions() const { return m_dimensions; }
+	/// Frame queue fill and frames that were never shown
+	struct QueueStats {
+		std::size_t frames, bytes;
+		double seconds;  ///< Video time covered by the queued frames
+		unsigned dropped;  ///< Late frames skipped by the decoder before conversion
+		unsigned discarded;  ///< Decoded frames that went out of date in the queue
+	};
+	QueueStats queueStats() const;
 
   private:
 	const double m_videoGap;
-	Texture m_texture;
+	/// Y, U and V planes of the current frame (converted to RGB by the video shader)
+	DynamicTexture m_planes[3];
+	unsigned m_width = 0, m_height = 0;  ///< Size of the current frame (0 until the first one)
+	Dimensions m_dimensions;
+	/// Upload a pix::YUV420P frame
+	void load(Bitmap const& frame);
 	double m_textureTime;
 	double m_readPosition = 0.0;
 	AnimValue m_alpha;
 	bool m_quit{false};
+	VideoFFmpeg::Display m_display;  ///< Must be declared before m_grabber
 	std::future<void> m_grabber;
 
 	/// trys to pop a video frame from queue
@@ -37,10 +56,17 @@ class Video {
 	/// return timestamp of next frame to read
 	double backPosition() const { return m_queue.back().timestamp; }
 
+	/// Is there room for a frame of the given size? The queue is limited by memory and by duration, so that
+	/// its depth follows the resolution and the frame rate of the video.
+	bool hasRoom(std::size_t bytes) const;
+
 	std::deque<Bitmap> m_queue;
-	mutable std::mutex m_mutex;
-	std::condition_variable m_cond;
-	static const unsigned m_max = 20;
+	std::size_t m_queueBytes = 0;  ///< Pixel data in m_queue
+	memstats::Usage m_queueMemory{ "video queue" };
+	unsigned m_discarded = 0;
+	mutable lockstats::Mutex m_mutex{ "video" };
+	std::condition_variable_any m_cond;
 	bool m_seek_asked{false};
+	std::vector<std::unique_ptr<metrics::Family>> m_metrics;  ///< Last, so that they go away first
 };
 
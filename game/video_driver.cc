@@ -1,23 +1,39 @@
 #include "video_driver.hh"
 
+#include "capture.hh"
 #include "chrono.hh"
 #include "config.hh"
 #include "controllers.hh"
 #include "fs.hh"
 #include "glmath.hh"
 #include "image.hh"
+#include "log.hh"
 #include "platform.hh"
 #include "screen.hh"
+#include "threads.hh"
 #include "util.hh"
 #include <boost/filesystem.hpp>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_hints.h>
 #include <SDL2/SDL_rect.h>
 #include <SDL2/SDL_video.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
 
 namespace {
 	float s_width;
 	float s_height;
+	/// Frames of a video capture being read back at once (more are skipped)
+	const std::size_t CAPTURE_READS_IN_FLIGHT = 3;
+	/// Dynamic resolution: a frame is late when it took this many refresh intervals (longer gaps are idle time)
+	const double LATE_FRAME = 1.25, IDLE_GAP = 4.0;
+	/// Render scale change when frames come late, and after RAISE_AFTER seconds of frames on time
+	const float SCALE_DOWN = 0.9f, SCALE_UP = 0.05f;
+	const double RAISE_AFTER = 3.0;
+	/// Amount of sharpening when scaling up (0 = none)
+	const float UPSCALE_SHARPNESS = 0.5f;
 	/// Attempt to set attribute and report errors.
 	/// Tests for success when destoryed.
 	struct GLattrSetter {
@@ -35,8 +51,31 @@ namespace {
 		int m_value;
 	};
 
+	/// Color conversion for an eye (0 = left, 1 = right) of anaglyph stereo3d type (0 = red/cyan, 1 = green/magenta)
+	glmath::mat3 anaglyphMatrix(int type, int num) {
+		float saturation = 0.5;  // (0..1)
+		float col = (1.0 + 2.0 * saturation) / 3.0;
+		float gry = 0.5 * (1.0 - col);
+		bool out[3] = {};  // Which colors to output
+		if (type == 0 && num == 0) { out[0] = true; }  // Red
+		if (type == 0 && num == 1) { out[1] = out[2] = true; }  // Cyan
+		if (type == 1 && num == 0) { out[1] = true; }  // Green
+		if (type == 1 && num == 1) { out[0] = out[2] = true; }  // Magenta
+		glmath::mat3 ret(0.0f);
+		for (unsigned i = 0; i < 3; ++i) {
+			for (unsigned j = 0; j < 3; ++j) {
+				float val = 0.0;
+				if (out[i]) val = (i == j ? col : gry);
+				ret[j][i] = val;
+			}
+		}
+		return ret;
+	}
+
 	float getSeparation() {
-		return config["graphic/stereo3d"].b() ? 0.001f * config["graphic/stereo3dseparation"].f() : 0.0;
+		static ConfigItem& stereo3d = config["graphic/stereo3d"];
+		static ConfigItem& separation = config["graphic/stereo3dseparation"];
+		return stereo3d.b() ? 0.001f * separation.f() : 0.0;
 	}
 
 	// stump: under MSVC, near and far are #defined to nothing for compatibility with ancient code, hence the underscores.
@@ -52,10 +91,8 @@ namespace {
 float screenW() { return s_width; }
 float screenH() { return s_height; }
 
-GLuint Window::m_ubo = 0;
 GLuint Window::m_vao = 0;
 GLuint Window::m_vbo = 0;
-GLint Window::bufferOffsetAlignment = -1;
 
 Window::Window() : screen(nullptr, &SDL_DestroyWindow), glContext(nullptr, &SDL_GL_DeleteContext) {
 	std::atexit(SDL_Quit);
@@ -151,20 +188,37 @@ Window::Window() : screen(nullptr, &SDL_DestroyWindow), glContext(nullptr, &SDL_
 	// Extensions would need more complex outputting, otherwise they will break clog.
 	//std::clog << "video/info: GL_EXTENSIONS: " << glGetString(GL_EXTENSIONS) << std::endl;
 	createShaders();
+	updateVsync();
 	resize();
 	SDL_ShowWindow(screen.get());
 }
 
 void Window::createShaders() {
-	// The Stereo3D shader needs OpenGL 3.3 and GL_ARB_viewport_array, some Intel drivers support GL 3.3,
+	// With GL_OVR_multiview the vertex shaders draw both eyes into a layered FBO in one pass,
+	// otherwise the Stereo3D geometry shader duplicates each primitive for the two viewports.
+	// The geometry shader needs OpenGL 3.3 and GL_ARB_viewport_array, some Intel drivers support GL 3.3,
 	// but not GL_ARB_viewport_array, so we just check for the extension here.
+	std::string stereoDefines;
+	m_multiview = false;
 	if (config["graphic/stereo3d"].b()) {
-		if (epoxy_has_gl_extension("GL_ARB_viewport_array")) {
+		if (epoxy_has_gl_extension("GL_OVR_multiview")) {
+		std::clog << "video/info: Stereo3D using GL_OVR_multiview" << std::endl;
+		stereoDefines = "#extension GL_OVR_multiview : require\n#define ENABLE_MULTIVIEW\n";
+		m_multiview = true;
+		shader("stereo3d")
+		  .compileFile(findFile("shaders/core.vert"))
+		  .compileFile(findFile("shaders/stereo3d.frag"))
+		  .link()
+		  .bindUniformBlocks();
+		}
+		else if (epoxy_has_gl_extension("GL_ARB_viewport_array")) {
 		// Compile geometry shaders when stereo is requested
 		shader("color").compileFile(findFile("shaders/stereo3d.geom"));
 		shader("texture").compileFile(findFile("shaders/stereo3d.geom"));
+		shader("video").compileFile(findFile("shaders/stereo3d.geom"));
 		shader("3dobject").compileFile(findFile("shaders/stereo3d.geom"));
 		shader("dancenote").compileFile(findFile("shaders/stereo3d.geom"));
+		shader("spectrogram").compileFile(findFile("shaders/stereo3d.geom"));
 		}
 		else { 
 		std::clog << "video/warning: Stereo3D was enabled but the 'GL_ARB_viewport_array' extension is unsupported; will now disable Stereo3D." << std::endl;
@@ -173,65 +227,88 @@ void Window::createShaders() {
 	}
 
 	shader("color")
+	  .addDefines(stereoDefines)
 	  .addDefines("#define ENABLE_VERTEX_COLOR\n")
 	  .compileFile(findFile("shaders/core.vert"))
 	  .compileFile(findFile("shaders/core.frag"))
 	  .link()
 	  .bindUniformBlocks();
 	shader("texture")
+	  .addDefines(stereoDefines)
+	  .addDefines("#define ENABLE_TEXTURING\n")
+	  .addDefines("#define ENABLE_VERTEX_COLOR\n")
+	  .compileFile(findFile("shaders/core.vert"))
+	  .compileFile(findFile("shaders/core.frag"))
+	  .link()
+	  .bindUniformBlocks();
+	shader("video")
+	  .addDefines(stereoDefines)
 	  .addDefines("#define ENABLE_TEXTURING\n")
+	  .addDefines("#define ENABLE_YUV\n")
 	  .addDefines("#define ENABLE_VERTEX_COLOR\n")
 	  .compileFile(findFile("shaders/core.vert"))
 	  .compileFile(findFile("shaders/core.frag"))
 	  .link()
 	  .bindUniformBlocks();
 	shader("3dobject")
+	  .addDefines(stereoDefines)
 	  .addDefines("#define ENABLE_LIGHTING\n")
 	  .compileFile(findFile("shaders/core.vert"))
 	  .compileFile(findFile("shaders/core.frag"))
 	  .link()
 	  .bindUniformBlocks();
 	shader("dancenote")
+	  .addDefines(stereoDefines)
 	  .addDefines("#define ENABLE_TEXTURING\n")
 	  .addDefines("#define ENABLE_VERTEX_COLOR\n")
 	  .compileFile(findFile("shaders/dancenote.vert"))
 	  .compileFile(findFile("shaders/core.frag"))
 	  .link()
 	  .bindUniformBlocks();
+	shader("spectrogram")
+	  .addDefines(stereoDefines)
+	  .addDefines("#define ENABLE_TEXTURING\n")
+	  .addDefines("#define ENABLE_SPECTROGRAM\n")
+	  .addDefines("#define ENABLE_VERTEX_COLOR\n")
+	  .compileFile(findFile("shaders/core.vert"))
+	  .compileFile(findFile("shaders/core.frag"))
+	  .link()
+	  .bindUniformBlocks();
+	shader("upscale")
+	  .compileFile(findFile("shaders/core.vert"))
+	  .compileFile(findFile("shaders/upscale.frag"))
+	  .link()
+	  .bindUniformBlocks();
 	
-	updateColor();
+	bindUniforms();
 	view(0);  // For loading screens
 }
 
 void Window::initBuffers() {
 	glGenVertexArrays(1, &Window::m_vao); // Create VAO.
-	glBindVertexArray(Window::m_vao);
-	glGenBuffers(1, &Window::m_vbo); // Create VBO.
-	glGenBuffers(1, &Window::m_ubo); // Create UBO.	
-
-	GLsizei stride = glutil::VertexArray::stride();
-	glBindBuffer(GL_ARRAY_BUFFER, Window::m_vbo);
-	
-	glEnableVertexAttribArray(vertPos);
-	glVertexAttribPointer(vertPos, 3, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(glutil::VertexInfo, vertPos));
-	glEnableVertexAttribArray(vertTexCoord);
-	glVertexAttribPointer(vertTexCoord, 2, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(glutil::VertexInfo, vertTexCoord));
-	glEnableVertexAttribArray(vertNormal);
-	glVertexAttribPointer(vertNormal, 3, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(glutil::VertexInfo, vertNormal));
-	glEnableVertexAttribArray(vertColor);
-	glVertexAttribPointer(vertColor, 4, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(glutil::VertexInfo, vertColor));
+	glutil::bindVertexArray(Window::m_vao);
+	m_uniformArena = std::make_unique<glutil::UniformArena>();
+	m_gpuTimer = std::make_unique<glutil::GPUTimer>();
+	m_readback = std::make_unique<glutil::PixelReadback>();
+
+	// Create VBO (streamed to by all vertex arrays), the attributes point at it again whenever it is replaced.
+	m_vertexStream = std::make_unique<glutil::VertexStream>([this](GLuint vbo) {
+		Window::m_vbo = vbo;
+		glutil::VertexInfo::setupAttribs();
+	});
 }
 
 Window::~Window() {
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-	glBindVertexArray(0);
-	glDeleteBuffers(1, &m_vbo);
-	glDeleteBuffers(1, &m_ubo);
-	glDeleteVertexArrays(1, &m_vao);
+	m_readback.reset();  // Screenshots not yet read back are lost, the ones being written are finished
+	glutil::bindBuffer(GL_ARRAY_BUFFER, 0);
+	glutil::bindVertexArray(0);
+	m_vertexStream.reset();  // Deletes m_vbo
+	m_uniformArena.reset();
+	glutil::deleteVertexArray(m_vao);
 }
 
 void Window::blank() {
+	glutil::QuadBatch::flush();
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 }
 
@@ -239,13 +316,14 @@ void Window::updateStereo(float sepFactor) {
 		try {
 			m_stereoUniforms.sepFactor = sepFactor;
 			m_stereoUniforms.z0 = (z0 - 2.0f * near_);
-			glBufferSubData(GL_UNIFORM_BUFFER, m_stereoUniforms.offset(), m_stereoUniforms.size(), &m_stereoUniforms);
+			m_uniformArena->bind(m_stereoUniforms);
 		} catch(...) {}  // Not fatal if 3d shader is missing		
 }
 
 void Window::updateColor() {	
+	if (m_matrixUniforms.colorMatrix == g_color) return;  // Unchanged, keep batching
 	m_matrixUniforms.colorMatrix = g_color;
-	glBufferSubData(GL_UNIFORM_BUFFER, (glutil::shaderMatrices::offset() + offsetof(glutil::shaderMatrices, colorMatrix)), sizeof(glmath::mat4), &m_matrixUniforms.colorMatrix);
+	m_uniformArena->bind(m_matrixUniforms);
 }
 
 void Window::updateLyricHighlight(glmath::vec4 const& fill, glmath::vec4 const& stroke, glmath::vec4 const& newFill, glmath::vec4 const& newStroke) {
@@ -253,13 +331,13 @@ void Window::updateLyricHighlight(glmath::vec4 const& fill, glmath::vec4 const&
 	m_lyricColorUniforms.origStroke = stroke;
 	m_lyricColorUniforms.newFill = newFill;
 	m_lyricColorUniforms.newStroke = newStroke;
-	glBufferSubData(GL_UNIFORM_BUFFER, m_lyricColorUniforms.offset(), m_lyricColorUniforms.size(), &m_lyricColorUniforms);
+	m_uniformArena->bind(m_lyricColorUniforms);
 }
 
 void Window::updateLyricHighlight(glmath::vec4 const& fill, glmath::vec4 const& stroke) {
 	m_lyricColorUniforms.newFill = fill;
 	m_lyricColorUniforms.newStroke = stroke;
-	glBufferSubData(GL_UNIFORM_BUFFER, m_lyricColorUniforms.offset(), m_lyricColorUniforms.size(), &m_lyricColorUniforms);
+	m_uniformArena->bind(m_lyricColorUniforms);
 }
 
 void Window::updateTransforms() {
@@ -268,18 +346,27 @@ void Window::updateTransforms() {
 	m_matrixUniforms.projMatrix = g_projection;
 	m_matrixUniforms.mvMatrix = g_modelview;
 	m_matrixUniforms.normalMatrix = normal;	
-	glBufferSubData(GL_UNIFORM_BUFFER, m_matrixUniforms.offset(), m_matrixUniforms.size(), &m_matrixUniforms);
+	m_uniformArena->bind(m_matrixUniforms);
+}
+
+void Window::bindUniforms() {
+	m_matrixUniforms.colorMatrix = g_color;
+	m_uniformArena->bind(m_matrixUniforms);
+	m_uniformArena->bind(m_stereoUniforms);
+	m_uniformArena->bind(m_lyricColorUniforms);
 }
 
 void Window::render(std::function<void (void)> drawFunc) {
 	glutil::GLErrorChecker glerror("Window::render");
 	ViewTrans trans;  // Default frustum
-	bool stereo = config["graphic/stereo3d"].b();
-	int type = config["graphic/stereo3dtype"].i();
+	static ConfigItem& stereo3d = config["graphic/stereo3d"];
+	static ConfigItem& stereo3dType = config["graphic/stereo3dtype"];
+	bool stereo = stereo3d.b();
+	int type = stereo3dType.i();
 
 	static bool warn3d = false;
 	if (!stereo) warn3d = false;
-	if (stereo && !epoxy_has_gl_extension("GL_ARB_viewport_array")) {
+	if (stereo && !m_multiview && !epoxy_has_gl_extension("GL_ARB_viewport_array")) {
 		stereo = false;
 		if (!warn3d) {
 			warn3d = true;
@@ -291,11 +378,17 @@ void Window::render(std::function<void (void)> drawFunc) {
 	// Over/under only available in fullscreen
 	if (stereo && type == 2 && !m_fullscreen) stereo = false;
 
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glutil::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	updateStereo(stereo ? getSeparation() : 0.0);
 	glerror.check("setup");
+	glutil::GPUTimer::Section section("frame");
+	// Multiview shaders always draw both eyes
+	if (m_multiview) { renderMultiview(drawFunc, stereo ? type : -1); return; }
+	// Draw at a reduced resolution when frames come late
+	if (!stereo && config["graphic/render_scale_min"].i() < 100) { renderScaled(drawFunc); return; }
+	m_renderScale = 1.0f;
 	// Can we do direct to framebuffer rendering (no FBO)?
-	if (!stereo || type == 2) { view(stereo); drawFunc(); return; }
+	if (!stereo || type == 2) { view(stereo); drawFunc(); glutil::QuadBatch::flush(); return; }
 	// Render both eyes to FBO (full resolution top/bottom for anaglyph)
 	
 	glerror.check("FBO");
@@ -311,48 +404,147 @@ void Window::render(std::function<void (void)> drawFunc) {
 	// Render to actual framebuffer from FBOs
 	UseTexture use(getFBO().getTexture());
 	view(0);  // Viewport for drawable area
+	glutil::QuadBatch::flush();
 	glDisable(GL_BLEND);
 	glmath::mat4 colorMatrix = glmath::mat4(1.0f);
 	updateStereo(0.0);  // Disable stereo mode while we composite
 	glerror.check("FBO->FB setup");
 	for (int num = 0; num < 2; ++num) {
-		{
-			float saturation = 0.5;  // (0..1)
-			float col = (1.0 + 2.0 * saturation) / 3.0;
-			float gry = 0.5 * (1.0 - col);
-			bool out[3] = {};  // Which colors to output
-			if (type == 0 && num == 0) { out[0] = true; }  // Red
-			if (type == 0 && num == 1) { out[1] = out[2] = true; }  // Cyan
-			if (type == 1 && num == 0) { out[1] = true; }  // Green
-			if (type == 1 && num == 1) { out[0] = out[2] = true; }  // Magenta
-			for (unsigned i = 0; i < 3; ++i) {
-				for (unsigned j = 0; j < 3; ++j) {
-					float val = 0.0;
-					if (out[i]) val = (i == j ? col : gry);
-					colorMatrix[j][i] = val;
-				}
-			}
-		}
+		colorMatrix = glmath::mat4(anaglyphMatrix(type, num));
 		// Render FBO with 1:1 pixels, properly filtered/positioned for 3d
 		ColorTrans c(colorMatrix);
 		Dimensions dim = Dimensions(getFBO().width() / getFBO().height()).fixedWidth(1.0);
 		dim.center((num == 0 ? 0.25 : -0.25) * dim.h());
 		if (num == 1) {
 			// Right eye blends over the left eye
+			glutil::QuadBatch::flush();
 			glEnable(GL_BLEND);
-			glBlendFunc(GL_ONE, GL_ONE);
+			glutil::blendFunc(GL_ONE, GL_ONE);
 		}
 		getFBO().getTexture().draw(dim, TexCoords(0.0, 1.0, 1.0, 0));
 	}
+	glutil::QuadBatch::flush();
+}
+
+void Window::renderMultiview(std::function<void (void)> drawFunc, int type) {
+	glutil::GLErrorChecker glerror("Window::renderMultiview");
+	// Eye viewports of over/under (they also set the resolution of HDMI 3D modes)
+	GLfloat eyeViewports[2][4] = {};
+	if (type == 2) {
+		view(1);
+		for (unsigned eye = 0; eye < 2; ++eye) glGetFloati_v(GL_VIEWPORT, eye + 1, eyeViewports[eye]);
+	}
+	MultiviewFBO& fbo = getMultiviewFBO();
+	{
+		UseFBO user(fbo);
+		view(0);
+		glViewport(0, 0, fbo.width(), fbo.height());
+		blank();
+		drawFunc();
+	}
+	glerror.check("Render to FBO");
+	// Composite the eyes with one full screen quad (one per half for over/under)
+	view(0);  // Viewport for drawable area
+	glDisable(GL_BLEND);
+	updateStereo(0.0);
+	UseShader use(getShader("stereo3d"));
+	glutil::bindTexture(GL_TEXTURE_2D_ARRAY, fbo.getTexture().id());
+	Dimensions dim = Dimensions(fbo.width() / fbo.height()).fixedWidth(1.0).center();
+	glutil::VertexArray va;
+	va.texCoord(0.0f, 1.0f).vertex(dim.x1(), dim.y1());
+	va.texCoord(1.0f, 1.0f).vertex(dim.x2(), dim.y1());
+	va.texCoord(0.0f, 0.0f).vertex(dim.x1(), dim.y2());
+	va.texCoord(1.0f, 0.0f).vertex(dim.x2(), dim.y2());
+	const glmath::mat3 none(0.0f), all(1.0f);
+	if (type == 2) {
+		for (unsigned eye = 0; eye < 2; ++eye) {
+			GLfloat const* vp = eyeViewports[eye];
+			glViewport(vp[0], vp[1], vp[2], vp[3]);
+			use()["eyeMatrix[0]"].setMat3(eye == 0 ? all : none);
+			use()["eyeMatrix[1]"].setMat3(eye == 1 ? all : none);
+			va.draw(GL_TRIANGLE_STRIP);
+		}
+		view(0);
+	} else {
+		bool anaglyph = type == 0 || type == 1;
+		use()["eyeMatrix[0]"].setMat3(anaglyph ? anaglyphMatrix(type, 0) : all);
+		use()["eyeMatrix[1]"].setMat3(anaglyph ? anaglyphMatrix(type, 1) : none);  // Left eye only without stereo
+		va.draw(GL_TRIANGLE_STRIP);
+	}
+	glutil::bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glEnable(GL_BLEND);
+	glerror.check("FBO->FB");
+}
+
+void Window::renderScaled(std::function<void (void)> drawFunc) {
+	glutil::GLErrorChecker glerror("Window::renderScaled");
+	updateRenderScale();
+	if (!m_scaledFbo) m_scaledFbo = std::make_unique<FBO>(s_width, s_height);
+	FBO& fbo = *m_scaledFbo;
+	const float w = std::max(1.0f, std::round(m_renderScale * fbo.width()));
+	const float h = std::max(1.0f, std::round(m_renderScale * fbo.height()));
+	{
+		UseFBO user(fbo);
+		view(0);
+		glViewport(0, 0, w, h);
+		blank();
+		drawFunc();
+	}
+	glerror.check("Render to FBO");
+	// Scale up with one full screen quad
+	view(0);  // Viewport for drawable area
+	glDisable(GL_BLEND);
+	UseShader use(getShader("upscale"));
+	glutil::bindTexture(GL_TEXTURE_2D, fbo.getTexture().id());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	const float u = w / fbo.width(), v = h / fbo.height();
+	use()["texelSize"].set(1.0f / fbo.width(), 1.0f / fbo.height());
+	use()["maxCoord"].set(u, v);
+	use()["sharpness"].set(m_renderScale < 1.0f ? UPSCALE_SHARPNESS : 0.0f);
+	Dimensions dim = Dimensions(fbo.width() / fbo.height()).fixedWidth(1.0).center();
+	glutil::VertexArray va;
+	va.texCoord(0.0f, v).vertex(dim.x1(), dim.y1());
+	va.texCoord(u, v).vertex(dim.x2(), dim.y1());
+	va.texCoord(0.0f, 0.0f).vertex(dim.x1(), dim.y2());
+	va.texCoord(u, 0.0f).vertex(dim.x2(), dim.y2());
+	va.draw(GL_TRIANGLE_STRIP);
+	glutil::bindTexture(GL_TEXTURE_2D, 0);
+	glEnable(GL_BLEND);
+	glerror.check("FBO->FB");
+}
+
+void Window::updateRenderScale() {
+	const Time now = Clock::now();
+	const Seconds frame = now - m_lastFrame;
+	m_lastFrame = now;
+	Seconds target = refreshInterval();
+	if (target == Seconds(0.0)) target = Seconds(1.0 / 60.0);
+	if (frame > IDLE_GAP * target) return;  // Not drawing continuously (loading, or idle screens skipping frames)
+	const float minScale = 0.01f * clamp(config["graphic/render_scale_min"].i(), 25, 100);
+	float scale = m_renderScale;
+	if (frame > LATE_FRAME * target) {
+		scale = std::max(minScale, scale * SCALE_DOWN);
+		m_framesOnTime = 0;
+	} else if (++m_framesOnTime * target.count() >= RAISE_AFTER) {
+		scale = std::min(1.0f, scale + SCALE_UP);
+		m_framesOnTime = 0;
+	}
+	scale = std::max(scale, minScale);  // The setting may have been raised meanwhile
+	if (scale == m_renderScale) return;
+	m_framesOnTime = 0;
+	LOG("video", debug) << "Render scale " << m_renderScale << " -> " << scale << " (frame took " << frame.count() * 1e3 << " ms)" << std::endl;
+	m_renderScale = scale;
 }
 
 void Window::view(unsigned num) {
 	glutil::GLErrorChecker glerror("Window::view");
+	glutil::QuadBatch::flush();
 	// Set flags
 	glClearColor (0.0f, 0.0f, 0.0f, 1.0f);
-	glDisable(GL_DEPTH_TEST);
+	glutil::depthTest(false);
 	glDisable(GL_CULL_FACE);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glutil::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glEnable(GL_BLEND);
 	if (GL_EXT_framebuffer_sRGB) glEnable(GL_FRAMEBUFFER_SRGB);
 	glerror.check("setup");
@@ -389,9 +581,38 @@ void Window::view(unsigned num) {
 }
 
 void Window::swap() {
+	glutil::QuadBatch::flush();
+	if (m_vertexStream) m_vertexStream->endFrame();
+	if (m_uniformArena) m_uniformArena->endFrame();
+	if (m_gpuTimer) m_gpuTimer->endFrame();
+	if (m_capture) captureFrame();
+	if (m_readback) m_readback->endFrame();
+	while (!m_screenshotWriters.empty() && m_screenshotWriters.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+		m_screenshotWriters.pop_front();
+	}
 	SDL_GL_SwapWindow(screen.get());
 }
 
+void Window::updateVsync(bool enable) {
+	const int mode = enable ? config["graphic/vsync"].i() : -1;
+	if (mode == m_vsyncMode) return;
+	m_vsyncMode = mode;
+	// Adaptive vsync shows late frames immediately instead of waiting for another refresh, it falls back to regular vsync
+	m_swapInterval = 0;
+	if (mode == 2 && SDL_GL_SetSwapInterval(-1) == 0) m_swapInterval = -1;
+	else if (mode >= 1 && SDL_GL_SetSwapInterval(1) == 0) m_swapInterval = 1;
+	else SDL_GL_SetSwapInterval(0);
+	if (mode >= 1 && m_swapInterval == 0) std::clog << "video/warning: Cannot enable vsync: " << SDL_GetError() << std::endl;
+	std::clog << "video/info: Swap interval " << m_swapInterval << std::endl;
+}
+
+Seconds Window::refreshInterval() {
+	SDL_DisplayMode mode;
+	const int display = SDL_GetWindowDisplayIndex(screen.get());
+	if (display < 0 || SDL_GetCurrentDisplayMode(display, &mode) != 0 || mode.refresh_rate <= 0) return Seconds(0.0);
+	return Seconds(1.0 / mode.refresh_rate);
+}
+
 void Window::event(Uint8 const& eventID, Sint32 const& data1, Sint32 const& data2) {
 	switch (eventID) {
 		case SDL_WINDOWEVENT_MOVED:
@@ -426,6 +647,12 @@ void Window::setWindowPosition(const Sint32& x, const Sint32& y)
 	config["graphic/window_pos_y"].i() = y;
 }
 
+MultiviewFBO& Window::getMultiviewFBO() {
+	if (!m_multiviewFbo) m_multiviewFbo = std::make_unique<MultiviewFBO>(s_width, s_height);
+	else if (m_multiviewFbo->width() != s_width || m_multiviewFbo->height() != s_height) m_multiviewFbo->resize(s_width, s_height);
+	return *m_multiviewFbo;
+}
+
 FBO& Window::getFBO() {
 	if (!m_fbo) m_fbo = std::make_unique<FBO>(s_width, (2 * s_height));
 	return *m_fbo;
@@ -441,7 +668,7 @@ void Window::setFullscreen() {
 	if (!m_fullscreen) {
 		int w = config["graphic/window_width"].i();
 		int h = config["graphic/window_height"].i();
-		std::clog << "video/debug: Restoring window size " << w << "x" << h << " and position " << m_windowX << "," << m_windowY << std::endl;
+		LOG("video", debug) << "Restoring window size " << w << "x" << h << " and position " << m_windowX << "," << m_windowY << std::endl;
 		SDL_SetWindowSize(screen.get(), w, h);
 		SDL_SetWindowPosition(screen.get(), m_windowX, m_windowY);
 	}
@@ -480,34 +707,81 @@ void Window::resize() {
 	if (w != nativeW) std::clog << " (HiDPI " << nativeW << "x" << nativeH << ")";
 	std::clog << ", rendering in " << s_width << "x" << s_height << std::endl;
 	if (m_fbo) { m_fbo->resize(s_width, 2 * s_height); }
+	if (m_scaledFbo) { m_scaledFbo->resize(s_width, s_height); }
 }
 
-void Window::screenshot() {
-	Bitmap img;
+void Window::drawableSize(unsigned& width, unsigned& height) {
 	int nativeW;
 	int nativeH;
 	if (std::stoi(SDL_GetHint("SDL_HINT_VIDEO_HIGHDPI_DISABLED")) == 1) {
 		SDL_GetWindowSize(screen.get(), &nativeW, &nativeH);
 	}
 	else { SDL_GL_GetDrawableSize(screen.get(), &nativeW, &nativeH); }
-	img.width = nativeW;
-	img.height = nativeH;
-	unsigned stride = (img.width * 3 + 3) & ~3;  // Rows are aligned to 4 byte boundaries
-	img.buf.resize(stride * img.height);
-	img.fmt = pix::RGB;
-	img.linearPremul = true; // Not really, but this will use correct gamma.
-	img.bottomFirst = true;
-	// Get pixel data from OpenGL
-	glReadPixels(0, 0, img.width, img.height, GL_RGB, GL_UNSIGNED_BYTE, img.data());
-	// Compose filename with first available number
+	width = nativeW;
+	height = nativeH;
+}
+
+void Window::screenshot() {
+	unsigned width, height;
+	drawableSize(width, height);
+	const unsigned stride = (width * 3 + 3) & ~3;  // Rows are aligned to 4 byte boundaries
+	// Get pixel data from OpenGL once the GPU is there, then encode in the background
+	m_readback->read(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, std::size_t(stride) * height, [this, width, height, stride](std::vector<std::uint8_t>&& pixels) {
+		auto img = std::make_shared<Bitmap>();
+		img->width = width;
+		img->height = height;
+		img->buf.swap(pixels);
+		img->fmt = pix::RGB;
+		img->linearPremul = true; // Not really, but this will use correct gamma.
+		img->bottomFirst = true;
+		m_screenshotWriters.push_back(std::async(std::launch::async, [img, stride] {
+			threads::enter(threads::Class::background, "screenshot");
+			// One at a time, so that two screenshots never get the same number
+			static std::mutex mutex;
+			std::lock_guard<std::mutex> l(mutex);
+			try {
+				// Compose filename with first available number
+				fs::path filename;
+				for (unsigned i = 1;; ++i) {
+					filename = getHomeDir() / ("Performous_" + std::to_string(i) + ".png");
+					if (!fs::exists(filename)) break;
+				}
+				// Save to disk
+				writePNG(filename.string(), *img, stride);
+				std::clog << "video/info: Screenshot taken: " << filename << " (" << img->width << "x" << img->height << ")" << std::endl;
+			} catch (std::exception& e) {
+				std::clog << "video/error: Screenshot failed: " << e.what() << std::endl;
+			}
+		}));
+	});
+}
+
+std::shared_ptr<Capture> Window::startCapture(unsigned rate) {
+	unsigned width, height;
+	drawableSize(width, height);
 	fs::path filename;
 	for (unsigned i = 1;; ++i) {
-		filename = getHomeDir() / ("Performous_" + std::to_string(i) + ".png");
+		filename = getHomeDir() / ("Performous_" + std::to_string(i) + ".mkv");
 		if (!fs::exists(filename)) break;
 	}
-	// Save to disk
-	writePNG(filename.string(), img, stride);
-	std::clog << "video/info: Screenshot taken: " << filename << " (" << img.width << "x" << img.height << ")" << std::endl;
+	m_capture = std::make_shared<Capture>(filename, width, height, config["graphic/capture_fps"].i(), rate);
+	return m_capture;
+}
+
+void Window::captureFrame() {
+	const std::int64_t pts = m_capture->nextFrame(Clock::now());
+	if (pts < 0) return;
+	unsigned width, height;
+	drawableSize(width, height);
+	// Skip the frame rather than wait if the GPU has not caught up with the earlier reads (or the window was resized)
+	if (m_readback->pending() >= CAPTURE_READS_IN_FLIGHT || width != m_capture->width() || height != m_capture->height()) {
+		m_capture->dropFrame();
+		return;
+	}
+	auto capture = m_capture;
+	m_readback->read(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, capture->frameBytes(), [capture, pts](std::vector<std::uint8_t>&& pixels) {
+		capture->addFrame(std::move(pixels), pts);
+	});
 }
 
 ColorTrans::ColorTrans(Color const& c): m_old(g_color) {
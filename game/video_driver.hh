@@ -1,8 +1,11 @@
 #pragma once
 
+#include "chrono.hh"
 #include "glmath.hh"
 #include "glshader.hh"
 #include "glutil.hh"
+#include <deque>
+#include <future>
 #include <map>
 #include <SDL2/SDL_events.h>
 
@@ -13,7 +16,9 @@ static inline float virtH() { return float(screenH()) / screenW(); }
 
 struct SDL_Surface;
 struct SDL_Window;
+class Capture;
 class FBO;
+class MultiviewFBO;
 
 struct ColorTrans {
 	ColorTrans(Color const& c);
@@ -66,21 +71,27 @@ public:
 	void initBuffers();
 	/// swaps buffers
 	void swap();
+	/// Apply graphic/vsync (or disable vsync, e.g. for benchmarking). Cheap to call every frame.
+	void updateVsync(bool enable = true);
+	/// Does swap() wait for the display refresh?
+	bool vsync() const { return m_swapInterval != 0; }
+	/// Refresh interval of the display showing the window (zero if unknown)
+	Seconds refreshInterval();
 	/// Handle window events
 	void event(Uint8 const& eventID, Sint32 const& data1, Sint32 const& data2);
 	/// Resize window (contents) / toggle full screen according to config. Returns true if resized.
 	void resize();
-	/// take a screenshot
+	/// take a screenshot (read back at a later frame and written to a PNG file in the background)
 	void screenshot();
+	/// Start recording the frames shown into a new video file (with audio of rate Hz, which the caller supplies)
+	std::shared_ptr<Capture> startCapture(unsigned rate);
+	/// Stop recording (the file is finished once the frames still being read back are encoded)
+	void stopCapture() { m_capture.reset(); }
 	
-	/// Return reference to Uniform Buffer Object.
-	static GLuint const& UBO() { return Window::m_ubo; }	
 	/// Return reference to Vertex Array Object.
 	GLuint const& VAO() const { return Window::m_vao; }
 	/// Return reference to Vertex Buffer Object.
 	GLuint const& VBO() const { return Window::m_vbo; }
-	/// Store value of GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT.
-	static GLint bufferOffsetAlignment;
 	
 	/// Construct a new shader or return an existing one by name
 	Shader& shader(std::string const& name) {
@@ -97,25 +108,47 @@ public:
 	void updateLyricHighlight(glmath::vec4 const& fill, glmath::vec4 const& stroke);
 	void updateTransforms();
 private:
-	const GLuint vertPos = 0;
-	const GLuint vertTexCoord = 1;
-	const GLuint vertNormal = 2;
-	const GLuint vertColor = 3;
+	/// Bind all uniform blocks (e.g. after shaders have been created)
+	void bindUniforms();
+	/// Size of the drawable area in pixels
+	void drawableSize(unsigned& width, unsigned& height);
+	/// Read back the frame being swapped for m_capture, if one is due
+	void captureFrame();
 	void setWindowPosition(const Sint32& x, const Sint32& y);
 	void setFullscreen();
 	/// Setup everything for drawing a view.
 	/// @param num 0 = no stereo, 1 = left eye, 2 = right eye
 	void view(unsigned num);
 	void updateStereo(float separation);
+	/// Draw both eyes at once into the layers of getMultiviewFBO() and composite them for the stereo mode (type, -1 for none)
+	void renderMultiview(std::function<void (void)> drawFunc, int type);
+	MultiviewFBO& getMultiviewFBO();
+	/// Draw into m_scaledFbo at m_renderScale times the resolution and scale it up to the window
+	void renderScaled(std::function<void (void)> drawFunc);
+	/// Lower the render scale when frames come late, raise it again after a while of frames on time
+	void updateRenderScale();
 	bool m_fullscreen = false;
+	bool m_multiview = false;  ///< Shaders render both eyes using GL_OVR_multiview (instead of stereo3d.geom)
+	int m_vsyncMode = -1;  ///< graphic/vsync value (or -1 for disabled) last applied
+	int m_swapInterval = 0;  ///< Swap interval in effect (as for SDL_GL_SetSwapInterval)
 	bool m_needResize = true;
-	static GLuint m_ubo;
 	static GLuint m_vao;
 	static GLuint m_vbo;
+	std::unique_ptr<glutil::VertexStream> m_vertexStream;
+	std::unique_ptr<glutil::UniformArena> m_uniformArena;
+	std::unique_ptr<glutil::GPUTimer> m_gpuTimer;
+	std::unique_ptr<glutil::PixelReadback> m_readback;
+	std::deque<std::future<void>> m_screenshotWriters;  ///< PNG encoders still running, oldest first
+	std::shared_ptr<Capture> m_capture;  ///< Recording in progress (also held by its reads in flight)
 	glutil::stereo3dParams m_stereoUniforms;
 	glutil::shaderMatrices m_matrixUniforms;
 	glutil::lyricColorUniforms m_lyricColorUniforms;
 	std::unique_ptr<FBO> m_fbo;
+	std::unique_ptr<MultiviewFBO> m_multiviewFbo;
+	std::unique_ptr<FBO> m_scaledFbo;  ///< Full resolution, of which only m_renderScale is drawn to
+	float m_renderScale = 1.0f;  ///< Fraction of the resolution drawn (with graphic/render_scale_min below 100)
+	Time m_lastFrame{};  ///< Start of the previous frame, for updateRenderScale
+	unsigned m_framesOnTime = 0;  ///< Frames since the render scale was last changed or a frame came late
 	int m_windowX = 0;
 	int m_windowY = 0;
 	std::unique_ptr<SDL_Window, void (*)(SDL_Window*)> screen;
@@ -2,6 +2,7 @@
 
 #include "chrono.hh"
 #include "fs.hh"
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
 #include <stdexcept>
@@ -13,13 +14,14 @@
 #else
 // Dummy classes
 namespace cv {
+	class Mat {};
 	class VideoCapture {};
 	class VideoWriter {};
 }
 #endif
 
 Webcam::Webcam(int cam_id):
-  m_thread(), m_capture(), m_writer(), m_frameAvailable(false)
+  m_frames(new cv::Mat[3]), m_thread(), m_capture(), m_writer()
 {
 	#ifdef USE_OPENCV
 	// Initialize the capture device
@@ -64,7 +66,11 @@ Webcam::Webcam(int cam_id):
 }
 
 Webcam::~Webcam() {
-	m_quit = true;
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_one();
 	#ifdef USE_OPENCV
 	if (m_thread) m_thread->join();
 	#endif
@@ -73,50 +79,51 @@ Webcam::~Webcam() {
 void Webcam::operator()() {
 	#ifdef USE_OPENCV
 	m_running = true;
+	unsigned capturing = 0;  // Index of the buffer being captured into
+	Seconds retry = 10ms;  // Wait after a failed read (e.g. camera unplugged or busy), doubled up to a second
 	while (!m_quit) {
-		if (m_running) {
-			try {
-				// Get a new frame
-				cv::Mat frame;
-				*m_capture >> frame;
-				if (m_writer) *m_writer << frame;
-				std::lock_guard<std::mutex> l(m_mutex);
-				// Copy the frame to storage
-				m_frame.width = frame.cols;
-				m_frame.height = frame.rows;
-				m_frame.data.assign(frame.data, frame.data + (m_frame.width * m_frame.height * 3));
-				// Notify renderer
-				m_frameAvailable = true;
-			} catch (std::exception&) { std::cerr << "Error capturing webcam frame!" << std::endl; }
+		if (!m_running) {
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_cond.wait(l, [this] { return m_quit || m_running; });
+			continue;
 		}
-		// Sleep a little, much if the cam isn't active
-		std::this_thread::sleep_for(m_running ? 10ms : 500ms);
+		try {
+			// Blocks until the camera has a new frame (the buffer is reused when the size stays the same)
+			cv::Mat& frame = m_frames[capturing];
+			if (!m_capture->read(frame) || frame.empty()) {
+				std::unique_lock<std::mutex> l(m_mutex);
+				m_cond.wait_for(l, retry, [this] { return m_quit || !m_running; });
+				retry = std::min<Seconds>(2 * retry, 1s);
+				continue;
+			}
+			retry = 10ms;
+			if (m_writer) *m_writer << frame;
+			if (!frame.isContinuous() || frame.type() != CV_8UC3) frame = frame.clone();  // Textures want packed BGR
+			capturing = m_ready.exchange(capturing | FRESH) & ~FRESH;
+		} catch (std::exception&) { std::cerr << "Error capturing webcam frame!" << std::endl; }
 	}
 	#endif
 }
 
 void Webcam::pause(bool do_pause) {
-	#ifdef USE_OPENCV
-	std::lock_guard<std::mutex> l(m_mutex);
-	#endif
-	m_running = !do_pause;
-	m_frameAvailable = false;
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_running = !do_pause;
+	}
+	m_cond.notify_one();
 }
 
 void Webcam::render() {
 	#ifdef USE_OPENCV
 	if (!m_capture || !m_running) return;
-	// Do we have a new frame available?
-	if (m_frameAvailable && !m_frame.data.empty()) {
-		std::lock_guard<std::mutex> l(m_mutex);
-		// Load the image
-		Bitmap bitmap;
+	// Take the latest frame if there is one that we have not displayed
+	if (m_ready.load() & FRESH) {
+		m_rendered = m_ready.exchange(m_rendered) & ~FRESH;
+		cv::Mat const& frame = m_frames[m_rendered];
+		Bitmap bitmap(frame.data);
 		bitmap.fmt = pix::BGR;
-		bitmap.buf.swap(m_frame.data);
-		bitmap.resize(m_frame.width, m_frame.height);
+		bitmap.resize(frame.cols, frame.rows);
 		m_texture.load(bitmap);
-		bitmap.buf.swap(m_frame.data);  // Get back our buffer (FIXME: do we need to?)
-		m_frameAvailable = false;
 	}
 	using namespace glmath;
 	Transform trans(scale(vec3(-1.0, 1.0, 1.0)));
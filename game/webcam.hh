@@ -2,22 +2,17 @@
 
 #include "texture.hh"
 #include <atomic>
+#include <condition_variable>
 #include <mutex>
 #include <thread>
-#include <vector>
 
 namespace cv {
 	// Forward declarations
+	class Mat;
 	class VideoCapture;
 	class VideoWriter;
 }
 
-struct CamFrame {
-	int width = 0;
-	int height = 0;
-	std::vector<std::uint8_t> data;
-};
-
 class Webcam {
   public:
 	/// cam_id -1 means pick any device
@@ -38,13 +33,21 @@ class Webcam {
 	Dimensions const& dimensions() const { return m_texture.dimensions; }
 
   private:
+	/**
+	* Frames are captured straight into one of three buffers and exchanged without copying or locking: the
+	* capture thread owns one, render owns another and the third one is in m_ready. A finished capture trades
+	* places with m_ready (marking it fresh) and render takes it from there when fresh.
+	**/
+	static const unsigned FRESH = 4;  ///< Flag of m_ready: a frame that render has not taken yet
+	std::unique_ptr<cv::Mat[]> m_frames;
+	std::atomic<unsigned> m_ready{ 1 };  ///< Index of the buffer in the middle (| FRESH)
+	unsigned m_rendered = 2;  ///< Index of the buffer of render()
 	std::unique_ptr<std::thread> m_thread;
-	mutable std::mutex m_mutex;
+	std::mutex m_mutex;  ///< For waking up the capture thread when paused
+	std::condition_variable m_cond;
 	std::unique_ptr<cv::VideoCapture> m_capture;
 	std::unique_ptr<cv::VideoWriter> m_writer;
-	CamFrame m_frame;
-	Texture m_texture;
-	bool m_frameAvailable;
+	DynamicTexture m_texture;
 	std::atomic<bool> m_running{ false };
 	std::atomic<bool> m_quit{ false };
 
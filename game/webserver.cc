@@ -1,6 +1,10 @@
 #include "webserver.hh"
 #ifdef USE_WEBSERVER
+#include "threads.hh"
 #include <boost/asio.hpp>
+#ifndef _WIN32
+#include <pplx/threadpool.h>
+#endif
 
 void WebServer::StartServer(int tried, bool fallbackPortInUse) {
 	if(tried > 2) {
@@ -50,6 +54,16 @@ WebServer::WebServer(Songs& songs)
 	if(config["game/webserver_access"].i() == 0) {
 		std::clog << "webserver/notice: Not starting webserver." << std::endl;
 	} else {
+#ifndef _WIN32
+		// Requests are handled on cpprest's pool, which must be sized before its first use (Windows uses the system pool)
+		const unsigned count = threads::poolSize(threads::Class::background, config["game/webserver_threads"].i());
+		try {
+			crossplat::threadpool::initialize_with_threads(count);
+			std::clog << "webserver/info: Serving with " << count << " threads." << std::endl;
+		} catch (std::exception& e) {
+			std::clog << "webserver/warning: Cannot size the thread pool: " << e.what() << std::endl;
+		}
+#endif
 		m_serverThread = std::make_unique<std::thread>([this] { StartServer(0, false); });
 	}
 }